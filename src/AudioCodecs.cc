@@ -3,6 +3,7 @@
 #include <inttypes.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <stdexcept>
 #include <vector>
 
@@ -132,14 +133,6 @@ static const struct {
   {mace_table_1, &mace_table_2[0][0], 4},
 };
 
-struct ChannelData {
-  int16_t index;
-  int16_t factor;
-  int16_t prev2;
-  int16_t previous;
-  int16_t level;
-};
-
 static int16_t clip_int16(int32_t x) {
   if (x > 0x7FFF) {
     return 0x7FFF;
@@ -150,100 +143,154 @@ static int16_t clip_int16(int32_t x) {
   return x;
 }
 
-static int16_t read_table(ChannelData& channel, uint8_t value, size_t table_index) {
-  int16_t current;
-
-  size_t entry_index = ((channel.index & 0x7F0) >> 4) * tables[table_index].stride;
-  if (value < tables[table_index].stride) {
-    entry_index += value;
-    current = tables[table_index].table2[entry_index];
-  } else {
-    entry_index += 2 * tables[table_index].stride - value - 1;
-    current = -1 - tables[table_index].table2[entry_index];
+// read_table's result depends only on the table, the value, and bits 4-10 of
+// the channel's index, so it's precomputed here for every combination. This
+// avoids the branch on the value in the inner loop.
+struct MACEReadTable {
+  int16_t entries[3][128][8];
+
+  MACEReadTable() {
+    for (size_t table_index = 0; table_index < 3; table_index++) {
+      const auto& table = tables[table_index];
+      for (size_t row = 0; row < 128; row++) {
+        size_t row_index = row * table.stride;
+        for (int value = 0; value < 2 * table.stride; value++) {
+          if (value < table.stride) {
+            this->entries[table_index][row][value] = table.table2[row_index + value];
+          } else {
+            this->entries[table_index][row][value] =
+                -1 - table.table2[row_index + 2 * table.stride - value - 1];
+          }
+        }
+      }
+    }
   }
+};
 
-  if ((channel.index += tables[table_index].table1[value] - (channel.index >> 5)) < 0) {
-    channel.index = 0;
-  }
+static const MACEReadTable mace_read_table;
 
+static inline int16_t read_table(int16_t& channel_index, uint8_t value, size_t table_index) {
+  int16_t current = mace_read_table.entries[table_index][(channel_index & 0x7F0) >> 4][value];
+  if ((channel_index += tables[table_index].table1[value] - (channel_index >> 5)) < 0) {
+    channel_index = 0;
+  }
   return current;
 }
 
-vector<le_int16_t> decode_mace(const void* vdata, size_t size, bool stereo,
-    bool is_mace3) {
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+MACEDecoder::MACEDecoder(bool stereo, bool is_mace3)
+  : stereo(stereo), is_mace3(is_mace3) {
+  for (auto& channel : this->channels) {
+    channel = {0, 0, 0, 0, 0};
+  }
+}
 
-  size_t num_channels = stereo ? 2 : 1;
-  ChannelData channel_data[num_channels];
-  vector<le_int16_t> result_data(size * (is_mace3 ? 3 : 6));
+// The channels of a stereo sound are independent, so they're decoded in the
+// same loop (in the innermost position) to let the CPU overlap their otherwise
+// serial computations. Each frame contains the bytes for channel 0, then those
+// for channel 1; the samples are output in the same order.
+template <size_t NumChannels>
+void MACEDecoder::decode_mace3_frames(const uint8_t* data, size_t num_frames, le_int16_t* out) {
+  for (size_t z = 0; z < num_frames; z++, data += 2 * NumChannels, out += 6 * NumChannels) {
+    for (size_t k = 0; k < 2; k++) {
+      for (size_t l = 0; l < 3; l++) {
+        for (size_t c = 0; c < NumChannels; c++) {
+          ChannelState& channel = this->channels[c];
+          uint8_t value = data[c * 2 + k];
+          if (l == 0) {
+            value &= 7;
+          } else if (l == 1) {
+            value = (value >> 3) & 3;
+          } else {
+            value >>= 5;
+          }
 
-  size_t bytes_per_frame = (is_mace3 ? 2 : 1) * num_channels;
-  size_t output_offset = 0;
-  for (size_t input_offset = 0; input_offset < size;) {
-    if (input_offset + bytes_per_frame > size) {
-      throw runtime_error("odd number of bytes remaining");
-    }
+          int16_t current = read_table(channel.index, value, l);
 
-    for (size_t which_channel = 0; which_channel < num_channels; which_channel++) {
-      ChannelData& channel = channel_data[which_channel];
+          int16_t sample = clip_int16(current + channel.level);
+          out[c * 6 + k * 3 + l] = sample;
+          channel.level = sample - (sample >> 3);
+        }
+      }
+    }
+  }
+}
 
-      if (is_mace3) {
-        for (size_t k = 0; k < 2; k++) {
-          uint8_t value = data[input_offset++];
-          uint8_t values[3] = {static_cast<uint8_t>(value & 7),
-                               static_cast<uint8_t>((value >> 3) & 3),
-                               static_cast<uint8_t>(value >> 5)};
+template <size_t NumChannels>
+void MACEDecoder::decode_mace6_frames(const uint8_t* data, size_t num_frames, le_int16_t* out) {
+  for (size_t z = 0; z < num_frames; z++, data += NumChannels, out += 6 * NumChannels) {
+    for (size_t l = 0; l < 3; l++) {
+      for (size_t c = 0; c < NumChannels; c++) {
+        ChannelState& channel = this->channels[c];
+        uint8_t value = data[c];
+        if (l == 0) {
+          value >>= 5;
+        } else if (l == 1) {
+          value = (value >> 3) & 3;
+        } else {
+          value &= 7;
+        }
 
-          for (size_t l = 0; l < 3; l++) {
-            int16_t current = read_table(channel_data[which_channel], values[l], l);
+        int16_t current = read_table(channel.index, value, l);
 
-            int16_t sample = clip_int16(current + channel.level);
-            result_data[output_offset++] = sample;
-            channel.level = sample - (sample >> 3);
+        if ((channel.previous ^ current) >= 0) {
+          if (channel.factor + 506 > 32767) {
+            channel.factor = 32767;
+          } else {
+            channel.factor += 506;
+          }
+        } else {
+          if (channel.factor - 314 < -32768) {
+            channel.factor = -32767;
+          } else {
+            channel.factor -= 314;
           }
         }
 
-      } else {
-        uint8_t value = data[input_offset++];
-
-        uint8_t values[3] = {static_cast<uint8_t>(value >> 5),
-                             static_cast<uint8_t>((value >> 3) & 3),
-                             static_cast<uint8_t>(value & 7)};
-        for (size_t l = 0; l < 3; l++) {
+        current = clip_int16(current + channel.level);
 
-          int16_t current = read_table(channel, values[l], l);
+        channel.level = (current * channel.factor) >> 15;
+        current >>= 1;
 
-          if ((channel.previous ^ current) >= 0) {
-            if (channel.factor + 506 > 32767) {
-              channel.factor = 32767;
-            } else {
-              channel.factor += 506;
-            }
-          } else {
-            if (channel.factor - 314 < -32768) {
-              channel.factor = -32767;
-            } else {
-              channel.factor -= 314;
-            }
-          }
+        out[c * 6 + l * 2] = channel.previous + channel.prev2 -
+                             ((channel.prev2 - current) >> 2);
+        out[c * 6 + l * 2 + 1] = channel.previous + current +
+                                 ((channel.prev2 - current) >> 2);
 
-          current = clip_int16(current + channel.level);
+        channel.prev2 = channel.previous;
+        channel.previous = current;
+      }
+    }
+  }
+}
 
-          channel.level = (current * channel.factor) >> 15;
-          current >>= 1;
+void MACEDecoder::decode(const void* vdata, size_t size, le_int16_t* out) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
 
-          result_data[output_offset++] = channel.previous + channel.prev2 -
-                                        ((channel.prev2 - current) >> 2);
-          result_data[output_offset++] = channel.previous + current +
-                                        ((channel.prev2 - current) >> 2);
+  if (size % this->frame_size()) {
+    throw runtime_error("odd number of bytes remaining");
+  }
+  size_t num_frames = size / this->frame_size();
 
-          channel.prev2 = channel.previous;
-          channel.previous = current;
-        }
-      }
+  if (this->is_mace3) {
+    if (this->stereo) {
+      this->decode_mace3_frames<2>(data, num_frames, out);
+    } else {
+      this->decode_mace3_frames<1>(data, num_frames, out);
+    }
+  } else {
+    if (this->stereo) {
+      this->decode_mace6_frames<2>(data, num_frames, out);
+    } else {
+      this->decode_mace6_frames<1>(data, num_frames, out);
     }
   }
+}
 
+vector<le_int16_t> decode_mace(const void* data, size_t size, bool stereo,
+    bool is_mace3) {
+  MACEDecoder decoder(stereo, is_mace3);
+  vector<le_int16_t> result_data(decoder.output_samples(size));
+  decoder.decode(data, size, result_data.data());
   return result_data;
 }
 
@@ -264,111 +311,122 @@ struct IMA4Packet {
   }
 };
 
-vector<le_int16_t> decode_ima4(const void* vdata, size_t size, bool stereo) {
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
-
-  static const int16_t index_table[16] = {
-      -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
-  static const int16_t step_table[89] = {
-          7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
-         19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
-         50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
-        130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
-        337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
-        876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
-       2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
-       5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
-      15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
-
-  if (size % (stereo ? 68 : 34)) {
-    throw runtime_error("ima4 data size must be a multiple of 34 bytes");
-  }
-  vector<le_int16_t> result_data((size * 64) / 34);
-
-  struct ChannelState {
-    int32_t predictor;
-    int32_t step_index;
-    int32_t step;
-  } channel_state[2];
-
-  {
-    const IMA4Packet* base_packet = reinterpret_cast<const IMA4Packet*>(data);
-    channel_state[0].predictor = base_packet->predictor();
-    channel_state[0].step_index = base_packet->step_index();
-    channel_state[0].step = step_table[channel_state[0].step_index];
-  }
-  if (stereo) {
-    const IMA4Packet* base_packet = reinterpret_cast<const IMA4Packet*>(data + 34);
-    channel_state[1].predictor = base_packet->predictor();
-    channel_state[1].step_index = base_packet->step_index();
-    channel_state[1].step = step_table[channel_state[1].step_index];
-  }
-
-  for (size_t packet_offset = 0; packet_offset < size; packet_offset += 34) {
-    const IMA4Packet* packet = reinterpret_cast<const IMA4Packet*>(
-        data + packet_offset);
-    size_t packet_index = packet_offset / 34;
-    auto& channel = channel_state[stereo ? (packet_index & 1) : 0];
-
-    // Interleave stereo samples appropriately
-    size_t output_offset;
-    size_t output_step = stereo ? 2 : 1;
-    if (stereo) {
-      output_offset = (packet_index & ~1) * 64 + (packet_index & 1);
-    } else {
-      output_offset = packet_index * 64;
-    }
-
-    for (size_t x = 0; x < 32; x++) {
-      uint8_t value = packet->data[x];
-      for (size_t y = 0; y < 2; y++) {
-        uint8_t nybble = value & 0x0F;
-        value >>= 4;
-
-        int32_t diff = 0;
+static const int16_t ima4_index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+static const int16_t ima4_step_table[89] = {
+        7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
+       19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+       50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
+      130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+      337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+      876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+     2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+     5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+// The effect of each nybble on the decoder state depends only on the nybble
+// and the current step index, so it's precomputed for every combination
+struct IMA4StepTable {
+  int32_t diff[89][16];
+  uint8_t next_step_index[89][16];
+
+  IMA4StepTable() {
+    for (int32_t step_index = 0; step_index < 89; step_index++) {
+      int32_t step = ima4_step_table[step_index];
+      for (uint8_t nybble = 0; nybble < 16; nybble++) {
+        int32_t diff = step >> 3;
         if (nybble & 4) {
-          diff += channel.step;
+          diff += step;
         }
         if (nybble & 2) {
-          diff += channel.step >> 1;
+          diff += step >> 1;
         }
         if (nybble & 1) {
-          diff += channel.step >> 2;
-        }
-        diff += channel.step >> 3;
-        if (nybble & 8) {
-          diff = -diff;
+          diff += step >> 2;
         }
+        this->diff[step_index][nybble] = (nybble & 8) ? -diff : diff;
 
-        channel.predictor += diff;
+        int32_t next_step_index = step_index + ima4_index_table[nybble];
+        this->next_step_index[step_index][nybble] = min<int32_t>(max<int32_t>(next_step_index, 0), 88);
+      }
+    }
+  }
+};
 
-        if (channel.predictor > 0x7FFF) {
-          channel.predictor = 0x7FFF;
-        } else if (channel.predictor < -0x8000) {
-          channel.predictor = -0x8000;
-        }
+static const IMA4StepTable ima4_steps;
 
-        result_data[output_offset] = channel.predictor;
-        output_offset += output_step;
+IMA4Decoder::IMA4Decoder(bool stereo)
+  : stereo(stereo), initialized(false) {
+  for (auto& channel : this->channels) {
+    channel = {0, 0};
+  }
+}
+
+// Each frame contains one packet per channel. As in MACEDecoder, the channels
+// are decoded in the same loop since they're independent; the output samples
+// are interleaved.
+template <size_t NumChannels>
+void IMA4Decoder::decode_frames(const uint8_t* data, size_t num_frames, le_int16_t* out) {
+  for (size_t z = 0; z < num_frames; z++, data += 34 * NumChannels, out += 64 * NumChannels) {
+    const IMA4Packet* packets = reinterpret_cast<const IMA4Packet*>(data);
+    for (size_t x = 0; x < 32; x++) {
+      for (size_t y = 0; y < 2; y++) {
+        for (size_t c = 0; c < NumChannels; c++) {
+          ChannelState& channel = this->channels[c];
+          uint8_t nybble = (packets[c].data[x] >> (y * 4)) & 0x0F;
+
+          channel.predictor += ima4_steps.diff[channel.step_index][nybble];
+          if (channel.predictor > 0x7FFF) {
+            channel.predictor = 0x7FFF;
+          } else if (channel.predictor < -0x8000) {
+            channel.predictor = -0x8000;
+          }
+          channel.step_index = ima4_steps.next_step_index[channel.step_index][nybble];
 
-        channel.step_index += index_table[nybble];
-        if (channel.step_index < 0) {
-          channel.step_index = 0;
-        } else if (channel.step_index > 88) {
-          channel.step_index = 88;
+          out[(x * 2 + y) * NumChannels + c] = channel.predictor;
         }
-        channel.step = step_table[channel.step_index];
       }
     }
   }
+}
+
+void IMA4Decoder::decode(const void* vdata, size_t size, le_int16_t* out) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+
+  if (size % this->frame_size()) {
+    throw runtime_error("ima4 data size must be a multiple of 34 bytes");
+  }
+  if (size == 0) {
+    return;
+  }
+
+  if (!this->initialized) {
+    for (size_t z = 0; z < (this->stereo ? 2 : 1); z++) {
+      const IMA4Packet* base_packet = reinterpret_cast<const IMA4Packet*>(data + 34 * z);
+      this->channels[z].predictor = base_packet->predictor();
+      // The header has room for step indexes beyond the end of the table
+      this->channels[z].step_index = min<int32_t>(base_packet->step_index(), 88);
+    }
+    this->initialized = true;
+  }
 
+  if (this->stereo) {
+    this->decode_frames<2>(data, size / 68, out);
+  } else {
+    this->decode_frames<1>(data, size / 34, out);
+  }
+}
+
+vector<le_int16_t> decode_ima4(const void* data, size_t size, bool stereo) {
+  IMA4Decoder decoder(stereo);
+  vector<le_int16_t> result_data(decoder.output_samples(size));
+  decoder.decode(data, size, result_data.data());
   return result_data;
 }
 
-vector<le_int16_t> decode_alaw(const void* vdata, size_t size) {
+void decode_alaw(const void* vdata, size_t size, le_int16_t* out) {
   const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
 
-  vector<le_int16_t> ret(size);
   for (size_t x = 0; x < size; x++) {
     int8_t sample = static_cast<int8_t>(data[x]) ^ 0x55;
     int8_t sign = (sample & 0x80) ? -1 : 1;
@@ -379,20 +437,24 @@ vector<le_int16_t> decode_alaw(const void* vdata, size_t size) {
 
     uint8_t shift = ((sample & 0xF0) >> 4) + 4;
     if (shift == 4) {
-      ret[x] = sign * ((sample << 1) | 1);
+      out[x] = sign * ((sample << 1) | 1);
     } else {
-      ret[x] = sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5)));
+      out[x] = sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5)));
     }
   }
+}
+
+vector<le_int16_t> decode_alaw(const void* data, size_t size) {
+  vector<le_int16_t> ret(size);
+  decode_alaw(data, size, ret.data());
   return ret;
 }
 
-vector<le_int16_t> decode_ulaw(const void* vdata, size_t size) {
+void decode_ulaw(const void* vdata, size_t size, le_int16_t* out) {
   const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
 
   static const uint16_t ULAW_BIAS = 33;
 
-  vector<le_int16_t> ret(size);
   for (size_t x = 0; x < size; x++) {
     int8_t sample = ~static_cast<int8_t>(data[x]);
 
@@ -401,7 +463,12 @@ vector<le_int16_t> decode_ulaw(const void* vdata, size_t size) {
       sample &= 0x7F;
     }
     uint8_t shift = ((sample & 0xF0) >> 4) + 5;
-    ret[x] = sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5))) - ULAW_BIAS;
+    out[x] = sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5))) - ULAW_BIAS;
   }
+}
+
+vector<le_int16_t> decode_ulaw(const void* data, size_t size) {
+  vector<le_int16_t> ret(size);
+  decode_ulaw(data, size, ret.data());
   return ret;
 }
@@ -1,12 +1,81 @@
+#pragma once
+
 #include <stdint.h>
 #include <stddef.h>
 
 #include <vector>
 #include <phosg/Encoding.hh>
 
+// These decoders keep their channel state between calls to decode(), so long
+// sounds can be decoded a block at a time instead of all at once. Each call's
+// input must be a whole number of frames (see frame_size()), and out must have
+// room for output_samples(size) samples.
+class MACEDecoder {
+public:
+  MACEDecoder(bool stereo, bool is_mace3);
+
+  inline size_t frame_size() const {
+    return (this->is_mace3 ? 2 : 1) * (this->stereo ? 2 : 1);
+  }
+  inline size_t output_samples(size_t size) const {
+    return size * (this->is_mace3 ? 3 : 6);
+  }
+
+  void decode(const void* data, size_t size, le_int16_t* out);
+
+private:
+  struct ChannelState {
+    int16_t index;
+    int16_t factor;
+    int16_t prev2;
+    int16_t previous;
+    int16_t level;
+  };
+
+  bool stereo;
+  bool is_mace3;
+  ChannelState channels[2];
+
+  template <size_t NumChannels>
+  void decode_mace3_frames(const uint8_t* data, size_t num_frames, le_int16_t* out);
+  template <size_t NumChannels>
+  void decode_mace6_frames(const uint8_t* data, size_t num_frames, le_int16_t* out);
+};
+
+class IMA4Decoder {
+public:
+  explicit IMA4Decoder(bool stereo);
+
+  inline size_t frame_size() const {
+    return this->stereo ? 68 : 34;
+  }
+  inline size_t output_samples(size_t size) const {
+    return (size * 64) / 34;
+  }
+
+  void decode(const void* data, size_t size, le_int16_t* out);
+
+private:
+  struct ChannelState {
+    int32_t predictor;
+    int32_t step_index;
+  };
+
+  bool stereo;
+  // The channel states are initialized from the first packet(s) passed to
+  // decode(), not from each packet
+  bool initialized;
+  ChannelState channels[2];
+
+  template <size_t NumChannels>
+  void decode_frames(const uint8_t* data, size_t num_frames, le_int16_t* out);
+};
+
 std::vector<le_int16_t> decode_mace(const void* data, size_t size,
     bool stereo, bool is_mace3);
 std::vector<le_int16_t> decode_ima4(const void* data, size_t size,
     bool stereo);
 std::vector<le_int16_t> decode_alaw(const void* data, size_t size);
 std::vector<le_int16_t> decode_ulaw(const void* data, size_t size);
+void decode_alaw(const void* data, size_t size, le_int16_t* out);
+void decode_ulaw(const void* data, size_t size, le_int16_t* out);
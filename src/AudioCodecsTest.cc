@@ -0,0 +1,164 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <phosg/Encoding.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+#include <vector>
+
+#include "AudioCodecs.hh"
+
+using namespace std;
+
+
+
+static string random_data(size_t size, uint32_t seed) {
+  string ret(size, '\0');
+  for (size_t z = 0; z < size; z++) {
+    seed = seed * 1103515245 + 12345;
+    ret[z] = static_cast<char>(seed >> 16);
+  }
+  return ret;
+}
+
+// A straightforward IMA4 decoder for one channel, written from the format's
+// description. As in IMA4Decoder, the state carries over from each packet to
+// the next, and only the first packet's header is used.
+static vector<int16_t> decode_ima4_reference(const string& data) {
+  static const int8_t index_table[16] = {
+      -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+  static const int16_t step_table[89] = {
+      7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41,
+      45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190,
+      209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+      876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499,
+      2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845,
+      8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350,
+      22385, 24623, 27086, 29794, 32767};
+
+  vector<int16_t> ret;
+  uint16_t header = (static_cast<uint8_t>(data[0]) << 8) | static_cast<uint8_t>(data[1]);
+  int32_t predictor = header & 0xFF80;
+  int32_t step_index = min<int32_t>(header & 0x7F, 88);
+  for (size_t offset = 0; offset < data.size(); offset += 34) {
+    for (size_t z = 2; z < 34; z++) {
+      uint8_t value = data[offset + z];
+      for (uint8_t nybble : {value & 0x0F, value >> 4}) {
+        int32_t step = step_table[step_index];
+        int32_t diff = step >> 3;
+        if (nybble & 4) {
+          diff += step;
+        }
+        if (nybble & 2) {
+          diff += step >> 1;
+        }
+        if (nybble & 1) {
+          diff += step >> 2;
+        }
+        predictor += (nybble & 8) ? -diff : diff;
+        predictor = min<int32_t>(max<int32_t>(predictor, -0x8000), 0x7FFF);
+        ret.emplace_back(predictor);
+        step_index = min<int32_t>(max<int32_t>(step_index + index_table[nybble], 0), 88);
+      }
+    }
+  }
+  return ret;
+}
+
+static vector<int16_t> to_vector(const vector<le_int16_t>& samples) {
+  return vector<int16_t>(samples.begin(), samples.end());
+}
+
+// Returns the bytes of each frame that belong to one channel of a stereo
+// stream, where each frame has bytes_per_channel bytes for channel 0 followed
+// by the same number for channel 1
+static string channel_data(const string& data, size_t bytes_per_channel, size_t channel) {
+  string ret;
+  for (size_t z = channel * bytes_per_channel; z < data.size(); z += bytes_per_channel * 2) {
+    ret += data.substr(z, bytes_per_channel);
+  }
+  return ret;
+}
+
+static void check_mace_stereo(bool is_mace3) {
+  size_t bytes_per_channel = is_mace3 ? 2 : 1;
+  string data = random_data(bytes_per_channel * 2 * 200, is_mace3 ? 3 : 6);
+  auto stereo = to_vector(decode_mace(data.data(), data.size(), true, is_mace3));
+  string left_data = channel_data(data, bytes_per_channel, 0);
+  string right_data = channel_data(data, bytes_per_channel, 1);
+  auto left = to_vector(decode_mace(left_data.data(), left_data.size(), false, is_mace3));
+  auto right = to_vector(decode_mace(right_data.data(), right_data.size(), false, is_mace3));
+
+  // Each stereo frame decodes to 6 samples for channel 0, then 6 for channel 1
+  expect_eq(left.size() + right.size(), stereo.size());
+  vector<int16_t> expected;
+  for (size_t z = 0; z < left.size(); z += 6) {
+    expected.insert(expected.end(), left.begin() + z, left.begin() + z + 6);
+    expected.insert(expected.end(), right.begin() + z, right.begin() + z + 6);
+  }
+  expect_eq(expected, stereo);
+}
+
+template <typename DecoderT>
+static void check_decode_in_pieces(DecoderT& decoder, const string& data,
+    const vector<int16_t>& expected, size_t frames_per_piece) {
+  vector<le_int16_t> out(decoder.output_samples(data.size()));
+  size_t piece_size = decoder.frame_size() * frames_per_piece;
+  for (size_t offset = 0; offset < data.size(); offset += piece_size) {
+    size_t size = min<size_t>(piece_size, data.size() - offset);
+    decoder.decode(data.data() + offset, size, out.data() + decoder.output_samples(offset));
+  }
+  expect_eq(expected, to_vector(out));
+}
+
+int main(int, char**) {
+  fprintf(stderr, "-- IMA4 mono\n");
+  {
+    string data = random_data(34 * 20, 1);
+    // Start with the largest step index the header can hold, which is beyond
+    // the end of the step table
+    data[1] |= 0x7F;
+    auto expected = decode_ima4_reference(data);
+    expect_eq(static_cast<size_t>(64 * 20), expected.size());
+    expect_eq(expected, to_vector(decode_ima4(data.data(), data.size(), false)));
+
+    IMA4Decoder decoder(false);
+    check_decode_in_pieces(decoder, data, expected, 3);
+  }
+
+  fprintf(stderr, "-- IMA4 stereo\n");
+  {
+    string data = random_data(68 * 20, 2);
+    string left_data = channel_data(data, 34, 0);
+    string right_data = channel_data(data, 34, 1);
+    auto left = decode_ima4_reference(left_data);
+    auto right = decode_ima4_reference(right_data);
+    vector<int16_t> expected;
+    for (size_t z = 0; z < left.size(); z++) {
+      expected.emplace_back(left[z]);
+      expected.emplace_back(right[z]);
+    }
+    expect_eq(expected, to_vector(decode_ima4(data.data(), data.size(), true)));
+
+    IMA4Decoder decoder(true);
+    check_decode_in_pieces(decoder, data, expected, 3);
+  }
+
+  fprintf(stderr, "-- MACE 3:1 stereo matches mono\n");
+  check_mace_stereo(true);
+  fprintf(stderr, "-- MACE 6:1 stereo matches mono\n");
+  check_mace_stereo(false);
+
+  fprintf(stderr, "-- MACE decoders keep state between calls\n");
+  for (bool is_mace3 : {true, false}) {
+    for (bool stereo : {false, true}) {
+      string data = random_data(24 * 50, 7);
+      auto expected = to_vector(decode_mace(data.data(), data.size(), stereo, is_mace3));
+      MACEDecoder decoder(stereo, is_mace3);
+      check_decode_in_pieces(decoder, data, expected, 7);
+    }
+  }
+
+  printf("AudioCodecsTest: all tests passed\n");
+  return 0;
+}
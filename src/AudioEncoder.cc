@@ -0,0 +1,826 @@
+#include "AudioEncoder.hh"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <phosg/Encoding.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <thread>
+
+#include "ParallelTasks.hh"
+
+using namespace std;
+
+
+
+const char* file_extension_for_audio_format(AudioFormat format) {
+  switch (format) {
+    case AudioFormat::WAV:
+      return "wav";
+    case AudioFormat::FLAC:
+      return "flac";
+    default:
+      throw invalid_argument("unknown audio format");
+  }
+}
+
+AudioFormat audio_format_for_name(const string& name) {
+  if (name == "wav") {
+    return AudioFormat::WAV;
+  } else if (name == "flac") {
+    return AudioFormat::FLAC;
+  } else {
+    throw invalid_argument("unknown audio format: " + name);
+  }
+}
+
+string filename_for_audio_format(const string& filename, AudioFormat format) {
+  if (!ends_with(filename, ".wav")) {
+    return filename;
+  }
+  return filename.substr(0, filename.size() - 3) + file_extension_for_audio_format(format);
+}
+
+
+
+static uint8_t flac_crc8(const void* data, size_t size) {
+  static const auto table = []() -> array<uint8_t, 0x100> {
+    array<uint8_t, 0x100> ret;
+    for (size_t z = 0; z < 0x100; z++) {
+      uint8_t c = z;
+      for (size_t b = 0; b < 8; b++) {
+        c = (c & 0x80) ? ((c << 1) ^ 0x07) : (c << 1);
+      }
+      ret[z] = c;
+    }
+    return ret;
+  }();
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  uint8_t crc = 0;
+  for (size_t z = 0; z < size; z++) {
+    crc = table[crc ^ bytes[z]];
+  }
+  return crc;
+}
+
+static uint16_t flac_crc16(const void* data, size_t size) {
+  static const auto table = []() -> array<uint16_t, 0x100> {
+    array<uint16_t, 0x100> ret;
+    for (size_t z = 0; z < 0x100; z++) {
+      uint16_t c = z << 8;
+      for (size_t b = 0; b < 8; b++) {
+        c = (c & 0x8000) ? ((c << 1) ^ 0x8005) : (c << 1);
+      }
+      ret[z] = c;
+    }
+    return ret;
+  }();
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  uint16_t crc = 0;
+  for (size_t z = 0; z < size; z++) {
+    crc = (crc << 8) ^ table[(crc >> 8) ^ bytes[z]];
+  }
+  return crc;
+}
+
+// phosg's BitWriter writes one bit at a time, which is too slow for residuals
+class FLACBitWriter {
+public:
+  FLACBitWriter() : buffer(0), buffer_bits(0) { }
+
+  // bits must be at most 32
+  inline void write(uint32_t value, uint8_t bits) {
+    if (bits == 0) {
+      return;
+    }
+    uint32_t mask = (bits == 32) ? 0xFFFFFFFF : ((1U << bits) - 1);
+    this->buffer = (this->buffer << bits) | (value & mask);
+    this->buffer_bits += bits;
+    while (this->buffer_bits >= 8) {
+      this->buffer_bits -= 8;
+      this->data.push_back(static_cast<char>(this->buffer >> this->buffer_bits));
+    }
+  }
+
+  inline void write_rice(uint32_t value, uint8_t param) {
+    uint32_t quotient = value >> param;
+    uint32_t remainder = value & ((1U << param) - 1);
+    if (quotient + 1 + param <= 32) {
+      this->write((1U << param) | remainder, quotient + 1 + param);
+    } else {
+      for (; quotient >= 32; quotient -= 32) {
+        this->write(0, 32);
+      }
+      this->write(1, quotient + 1);
+      this->write(remainder, param);
+    }
+  }
+
+  inline void align() {
+    if (this->buffer_bits) {
+      this->write(0, 8 - this->buffer_bits);
+    }
+  }
+
+  // Only valid when the writer is byte-aligned
+  inline string& str() {
+    return this->data;
+  }
+
+private:
+  string data;
+  uint64_t buffer;
+  uint8_t buffer_bits;
+};
+
+
+
+struct FLACSubframePlan {
+  enum class Type {
+    CONSTANT = 0,
+    VERBATIM,
+    FIXED,
+  };
+  Type type;
+  uint8_t order;
+  uint8_t partition_order;
+  // If true, Rice parameters are 5 bits instead of 4
+  bool rice2;
+  vector<uint8_t> rice_params;
+  uint64_t bits;
+};
+
+static inline uint32_t zigzag(int32_t value) {
+  return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+static void compute_fixed_residuals(
+    const int32_t* x, size_t n, uint8_t order, uint32_t* out) {
+  switch (order) {
+    case 0:
+      for (size_t z = 0; z < n; z++) {
+        out[z] = zigzag(x[z]);
+      }
+      break;
+    case 1:
+      for (size_t z = 1; z < n; z++) {
+        out[z - 1] = zigzag(x[z] - x[z - 1]);
+      }
+      break;
+    case 2:
+      for (size_t z = 2; z < n; z++) {
+        out[z - 2] = zigzag(x[z] - 2 * x[z - 1] + x[z - 2]);
+      }
+      break;
+    case 3:
+      for (size_t z = 3; z < n; z++) {
+        out[z - 3] = zigzag(x[z] - 3 * x[z - 1] + 3 * x[z - 2] - x[z - 3]);
+      }
+      break;
+    case 4:
+      for (size_t z = 4; z < n; z++) {
+        out[z - 4] = zigzag(x[z] - 4 * x[z - 1] + 6 * x[z - 2] - 4 * x[z - 3] + x[z - 4]);
+      }
+      break;
+    default:
+      throw logic_error("invalid fixed predictor order");
+  }
+}
+
+// Returns the best Rice parameter for a partition with count residuals whose
+// sum is sum, and the estimated size of the partition's residuals in bits
+static pair<uint8_t, uint64_t> choose_rice_param(uint64_t count, uint64_t sum) {
+  if (count == 0) {
+    return make_pair(0, 0);
+  }
+  uint8_t k = 0;
+  while ((k < 30) && ((count << (k + 1)) < sum)) {
+    k++;
+  }
+  auto estimate = [&](uint8_t k) -> uint64_t {
+    return count * (k + 1) + (sum >> k);
+  };
+  uint64_t best_bits = estimate(k);
+  uint8_t best_k = k;
+  if ((k > 0) && (estimate(k - 1) < best_bits)) {
+    best_k = k - 1;
+    best_bits = estimate(k - 1);
+  }
+  if ((k < 30) && (estimate(k + 1) < best_bits)) {
+    best_k = k + 1;
+    best_bits = estimate(k + 1);
+  }
+  return make_pair(best_k, best_bits);
+}
+
+static constexpr uint8_t MAX_PARTITION_ORDER = 8;
+
+static FLACSubframePlan plan_subframe(
+    const int32_t* x, size_t n, uint8_t bps, vector<uint32_t>& residuals) {
+  FLACSubframePlan plan;
+  plan.order = 0;
+  plan.partition_order = 0;
+  plan.rice2 = false;
+
+  bool is_constant = true;
+  for (size_t z = 1; z < n; z++) {
+    if (x[z] != x[0]) {
+      is_constant = false;
+      break;
+    }
+  }
+  if (is_constant) {
+    plan.type = FLACSubframePlan::Type::CONSTANT;
+    plan.bits = 8 + bps;
+    return plan;
+  }
+
+  plan.type = FLACSubframePlan::Type::VERBATIM;
+  plan.bits = 8 + static_cast<uint64_t>(n) * bps;
+
+  residuals.resize(n);
+  vector<uint64_t> sums;
+  vector<uint64_t> parent_sums;
+  for (uint8_t order = 0; (order <= 4) && (order < n); order++) {
+    compute_fixed_residuals(x, n, order, residuals.data());
+
+    uint8_t max_partition_order = 0;
+    while ((max_partition_order < MAX_PARTITION_ORDER) &&
+        !(n & ((1 << (max_partition_order + 1)) - 1)) &&
+        ((n >> (max_partition_order + 1)) > order)) {
+      max_partition_order++;
+    }
+
+    // Sum the residuals in each partition at the highest partition order;
+    // the sums for lower orders are then the sums of pairs of partitions
+    size_t max_num_partitions = 1 << max_partition_order;
+    size_t min_partition_size = n >> max_partition_order;
+    sums.assign(max_num_partitions, 0);
+    for (size_t p = 0; p < max_num_partitions; p++) {
+      size_t start = max<size_t>(p * min_partition_size, order) - order;
+      size_t end = (p + 1) * min_partition_size - order;
+      uint64_t sum = 0;
+      for (size_t z = start; z < end; z++) {
+        sum += residuals[z];
+      }
+      sums[p] = sum;
+    }
+
+    for (int8_t partition_order = max_partition_order; partition_order >= 0; partition_order--) {
+      size_t num_partitions = 1 << partition_order;
+      size_t partition_size = n >> partition_order;
+      uint64_t bits = 8 + static_cast<uint64_t>(order) * bps + 2 + 4;
+      uint8_t max_k = 0;
+      vector<uint8_t> params(num_partitions);
+      for (size_t p = 0; p < num_partitions; p++) {
+        uint64_t count = partition_size - ((p == 0) ? order : 0);
+        auto param = choose_rice_param(count, sums[p]);
+        params[p] = param.first;
+        max_k = max<uint8_t>(max_k, param.first);
+        bits += param.second;
+      }
+      bool rice2 = (max_k > 14);
+      bits += num_partitions * (rice2 ? 5 : 4);
+      if (bits < plan.bits) {
+        plan.type = FLACSubframePlan::Type::FIXED;
+        plan.order = order;
+        plan.partition_order = partition_order;
+        plan.rice2 = rice2;
+        plan.rice_params = move(params);
+        plan.bits = bits;
+      }
+
+      if (partition_order > 0) {
+        parent_sums.resize(num_partitions / 2);
+        for (size_t p = 0; p < num_partitions / 2; p++) {
+          parent_sums[p] = sums[2 * p] + sums[2 * p + 1];
+        }
+        sums.swap(parent_sums);
+      }
+    }
+  }
+  return plan;
+}
+
+static void write_subframe(FLACBitWriter& w, const int32_t* x, size_t n,
+    uint8_t bps, const FLACSubframePlan& plan, vector<uint32_t>& residuals) {
+  switch (plan.type) {
+    case FLACSubframePlan::Type::CONSTANT:
+      w.write(0x00, 8);
+      w.write(x[0], bps);
+      break;
+    case FLACSubframePlan::Type::VERBATIM:
+      w.write(0x02, 8);
+      for (size_t z = 0; z < n; z++) {
+        w.write(x[z], bps);
+      }
+      break;
+    case FLACSubframePlan::Type::FIXED: {
+      w.write((0x08 | plan.order) << 1, 8);
+      for (size_t z = 0; z < plan.order; z++) {
+        w.write(x[z], bps);
+      }
+      residuals.resize(n);
+      compute_fixed_residuals(x, n, plan.order, residuals.data());
+      w.write(plan.rice2 ? 1 : 0, 2);
+      w.write(plan.partition_order, 4);
+      size_t partition_size = n >> plan.partition_order;
+      const uint32_t* r = residuals.data();
+      for (size_t p = 0; p < plan.rice_params.size(); p++) {
+        uint8_t k = plan.rice_params[p];
+        w.write(k, plan.rice2 ? 5 : 4);
+        size_t count = partition_size - ((p == 0) ? plan.order : 0);
+        for (size_t z = 0; z < count; z++) {
+          w.write_rice(r[z], k);
+        }
+        r += count;
+      }
+      break;
+    }
+  }
+}
+
+static uint8_t flac_block_size_code(size_t num_frames) {
+  if (num_frames == 192) {
+    return 1;
+  }
+  for (uint8_t code = 2; code <= 5; code++) {
+    if (num_frames == (576U << (code - 2))) {
+      return code;
+    }
+  }
+  for (uint8_t code = 8; code <= 15; code++) {
+    if (num_frames == (256U << (code - 8))) {
+      return code;
+    }
+  }
+  return (num_frames <= 0x100) ? 6 : 7;
+}
+
+static uint8_t flac_sample_rate_code(uint32_t sample_rate) {
+  switch (sample_rate) {
+    case 88200:
+      return 1;
+    case 176400:
+      return 2;
+    case 192000:
+      return 3;
+    case 8000:
+      return 4;
+    case 16000:
+      return 5;
+    case 22050:
+      return 6;
+    case 24000:
+      return 7;
+    case 32000:
+      return 8;
+    case 44100:
+      return 9;
+    case 48000:
+      return 10;
+    case 96000:
+      return 11;
+  }
+  if (!(sample_rate % 1000) && (sample_rate / 1000 <= 0xFF)) {
+    return 12;
+  } else if (sample_rate <= 0xFFFF) {
+    return 13;
+  } else if (!(sample_rate % 10) && (sample_rate / 10 <= 0xFFFF)) {
+    return 14;
+  }
+  return 0; // Use the rate from STREAMINFO
+}
+
+static uint8_t flac_sample_size_code(uint16_t bits_per_sample) {
+  switch (bits_per_sample) {
+    case 8:
+      return 1;
+    case 12:
+      return 2;
+    case 16:
+      return 4;
+    case 20:
+      return 5;
+    case 24:
+      return 6;
+    default:
+      return 0; // Use the size from STREAMINFO
+  }
+}
+
+
+
+FLACEncoder::FLACEncoder(
+    uint16_t num_channels,
+    uint32_t sample_rate,
+    uint16_t bits_per_sample,
+    uint64_t total_frames,
+    const AudioEncodingOptions& options,
+    WriteFn write_fn,
+    const vector<pair<string, string>>& tags)
+  : num_channels(num_channels),
+    sample_rate(sample_rate),
+    bits_per_sample(bits_per_sample),
+    total_frames(total_frames),
+    block_frames(options.flac_block_frames),
+    num_threads(options.flac_threads
+        ? options.flac_threads : max<size_t>(thread::hardware_concurrency(), 1)),
+    write_fn(write_fn),
+    frames_written(0),
+    next_block_number(0),
+    finished(false) {
+  if ((this->num_channels < 1) || (this->num_channels > 8)) {
+    throw invalid_argument("FLAC streams must have 1 to 8 channels");
+  }
+  if ((this->sample_rate < 1) || (this->sample_rate > 655350)) {
+    throw invalid_argument("sample rate cannot be encoded in a FLAC stream");
+  }
+  if ((this->bits_per_sample < 4) || (this->bits_per_sample > 24)) {
+    throw invalid_argument("FLAC streams must have 4 to 24 bits per sample");
+  }
+  if ((this->block_frames < 16) || (this->block_frames > 0xFFFF)) {
+    throw invalid_argument("FLAC block size must be from 16 to 65535 frames");
+  }
+  if (this->total_frames >= (1ULL << 36)) {
+    throw invalid_argument("sound is too long to be encoded as a FLAC stream");
+  }
+  // With multiple threads, several blocks per thread are encoded at once, so
+  // the threads don't all wait for the slowest one too often
+  this->batch_blocks = (this->num_threads == 1) ? 1 : (this->num_threads * 4);
+  this->write_stream_header(tags);
+}
+
+void FLACEncoder::write_stream_header(const vector<pair<string, string>>& tags) {
+  FLACBitWriter w;
+  w.write(0x664C6143, 32); // 'fLaC'
+
+  // STREAMINFO block
+  w.write(tags.empty() ? 1 : 0, 1); // Last block flag
+  w.write(0, 7); // Block type
+  w.write(34, 24); // Block size
+  w.write(this->block_frames, 16); // Min block size
+  w.write(this->block_frames, 16); // Max block size
+  w.write(0, 24); // Min frame size (unknown)
+  w.write(0, 24); // Max frame size (unknown)
+  w.write(this->sample_rate, 20);
+  w.write(this->num_channels - 1, 3);
+  w.write(this->bits_per_sample - 1, 5);
+  w.write(this->total_frames >> 32, 4);
+  w.write(this->total_frames, 32);
+  for (size_t z = 0; z < 4; z++) {
+    w.write(0, 32); // MD5 signature (unknown)
+  }
+
+  if (!tags.empty()) {
+    // VORBIS_COMMENT block. Unlike the rest of the stream, its fields are
+    // little-endian.
+    StringWriter comment_w;
+    static const string vendor = "resource_dasm";
+    comment_w.put_u32l(vendor.size());
+    comment_w.write(vendor);
+    comment_w.put_u32l(tags.size());
+    for (const auto& tag : tags) {
+      comment_w.put_u32l(tag.first.size() + tag.second.size() + 1);
+      comment_w.write(tag.first);
+      comment_w.put_u8('=');
+      comment_w.write(tag.second);
+    }
+    if (comment_w.size() >= (1 << 24)) {
+      throw invalid_argument("FLAC tags are too long");
+    }
+    w.write(1, 1); // Last block flag
+    w.write(4, 7); // Block type
+    w.write(comment_w.size(), 24);
+    w.str() += comment_w.str();
+  }
+
+  this->write_fn(w.str().data(), w.str().size());
+}
+
+void FLACEncoder::write(const int32_t* samples, size_t num_frames) {
+  if (this->finished) {
+    throw logic_error("cannot add frames to a finished FLAC stream");
+  }
+  this->frames_written += num_frames;
+  if (this->total_frames && (this->frames_written > this->total_frames)) {
+    throw runtime_error("FLAC stream is longer than its declared length");
+  }
+  this->pending_samples.insert(this->pending_samples.end(),
+      samples, samples + num_frames * this->num_channels);
+  if (this->pending_samples.size() >= this->block_frames * this->batch_blocks * this->num_channels) {
+    this->flush_blocks(false);
+  }
+}
+
+void FLACEncoder::finish() {
+  if (this->finished) {
+    return;
+  }
+  this->finished = true;
+  this->flush_blocks(true);
+  if (this->total_frames && (this->frames_written != this->total_frames)) {
+    throw runtime_error("FLAC stream is shorter than its declared length");
+  }
+}
+
+void FLACEncoder::flush_blocks(bool final) {
+  size_t pending_frames = this->pending_samples.size() / this->num_channels;
+  size_t num_full_blocks = pending_frames / this->block_frames;
+  size_t num_blocks = num_full_blocks + ((final && (pending_frames % this->block_frames)) ? 1 : 0);
+  if (num_blocks == 0) {
+    return;
+  }
+
+  vector<string> encoded_blocks(num_blocks);
+  run_parallel_tasks(num_blocks, this->num_threads, [&](size_t z, FILE*) -> void {
+    size_t start_frame = z * this->block_frames;
+    size_t block_frames = min<size_t>(this->block_frames, pending_frames - start_frame);
+    encoded_blocks[z] = this->encode_block(
+        this->pending_samples.data() + start_frame * this->num_channels,
+        block_frames, this->next_block_number + z);
+  });
+  for (const auto& block : encoded_blocks) {
+    this->write_fn(block.data(), block.size());
+  }
+  this->next_block_number += num_blocks;
+
+  size_t consumed_samples = min<size_t>(
+      num_blocks * this->block_frames, pending_frames) * this->num_channels;
+  this->pending_samples.erase(this->pending_samples.begin(),
+      this->pending_samples.begin() + consumed_samples);
+}
+
+string FLACEncoder::encode_block(
+    const int32_t* samples, size_t num_frames, uint64_t block_number) const {
+  // Deinterleave the channels, and for stereo, also compute the side and mid
+  // channels
+  size_t num_signals = (this->num_channels == 2) ? 4 : this->num_channels;
+  vector<vector<int32_t>> signals(num_signals, vector<int32_t>(num_frames));
+  for (size_t z = 0; z < num_frames; z++) {
+    for (size_t c = 0; c < this->num_channels; c++) {
+      signals[c][z] = samples[z * this->num_channels + c];
+    }
+  }
+  vector<uint8_t> signal_bps(num_signals, this->bits_per_sample);
+  if (this->num_channels == 2) {
+    for (size_t z = 0; z < num_frames; z++) {
+      int32_t l = signals[0][z];
+      int32_t r = signals[1][z];
+      signals[2][z] = l - r; // Side
+      signals[3][z] = (l + r) >> 1; // Mid
+    }
+    signal_bps[2] = this->bits_per_sample + 1;
+  }
+
+  vector<uint32_t> residuals;
+  vector<FLACSubframePlan> plans;
+  for (size_t s = 0; s < num_signals; s++) {
+    plans.emplace_back(plan_subframe(signals[s].data(), num_frames, signal_bps[s], residuals));
+  }
+
+  // Choose the channel assignment and the signals for its subframes
+  uint8_t channel_assignment = this->num_channels - 1;
+  vector<size_t> subframe_signals;
+  for (size_t c = 0; c < this->num_channels; c++) {
+    subframe_signals.emplace_back(c);
+  }
+  if (this->num_channels == 2) {
+    static const array<pair<uint8_t, array<size_t, 2>>, 4> assignments({{
+        {0x01, {0, 1}}, // Independent
+        {0x08, {0, 2}}, // Left/side
+        {0x09, {2, 1}}, // Right/side
+        {0x0A, {3, 2}}, // Mid/side
+    }});
+    uint64_t best_bits = UINT64_MAX;
+    for (const auto& assignment : assignments) {
+      uint64_t bits = plans[assignment.second[0]].bits + plans[assignment.second[1]].bits;
+      if (bits < best_bits) {
+        best_bits = bits;
+        channel_assignment = assignment.first;
+        subframe_signals.assign(assignment.second.begin(), assignment.second.end());
+      }
+    }
+  }
+
+  FLACBitWriter w;
+  uint8_t block_size_code = flac_block_size_code(num_frames);
+  uint8_t sample_rate_code = flac_sample_rate_code(this->sample_rate);
+  w.write(0xFFF8, 16); // Sync code; fixed block size
+  w.write(block_size_code, 4);
+  w.write(sample_rate_code, 4);
+  w.write(channel_assignment, 4);
+  w.write(flac_sample_size_code(this->bits_per_sample), 3);
+  w.write(0, 1);
+
+  // The block number is encoded like a UTF-8 character (extended to 36 bits)
+  if (block_number < 0x80) {
+    w.write(block_number, 8);
+  } else {
+    size_t num_extra_bytes = 1;
+    while ((num_extra_bytes < 6) && (block_number >= (1ULL << (5 * num_extra_bytes + 6)))) {
+      num_extra_bytes++;
+    }
+    uint8_t first_byte_mask = 0xFF00 >> (num_extra_bytes + 1);
+    w.write(first_byte_mask | (block_number >> (6 * num_extra_bytes)), 8);
+    for (size_t z = num_extra_bytes; z > 0; z--) {
+      w.write(0x80 | ((block_number >> (6 * (z - 1))) & 0x3F), 8);
+    }
+  }
+
+  if (block_size_code == 6) {
+    w.write(num_frames - 1, 8);
+  } else if (block_size_code == 7) {
+    w.write(num_frames - 1, 16);
+  }
+  if (sample_rate_code == 12) {
+    w.write(this->sample_rate / 1000, 8);
+  } else if (sample_rate_code == 13) {
+    w.write(this->sample_rate, 16);
+  } else if (sample_rate_code == 14) {
+    w.write(this->sample_rate / 10, 16);
+  }
+  w.write(flac_crc8(w.str().data(), w.str().size()), 8);
+
+  for (size_t s : subframe_signals) {
+    write_subframe(w, signals[s].data(), num_frames, signal_bps[s], plans[s], residuals);
+  }
+  w.align();
+  w.write(flac_crc16(w.str().data(), w.str().size()), 16);
+  return move(w.str());
+}
+
+
+
+WAVToFLACConverter::WAVToFLACConverter(
+    const AudioEncodingOptions& options, FLACEncoder::WriteFn write_fn)
+  : options(options),
+    write_fn(write_fn),
+    num_channels(0),
+    bits_per_sample(0),
+    data_bytes_remaining(0) { }
+
+void WAVToFLACConverter::write(const void* data, size_t size) {
+  if (this->encoder) {
+    this->write_samples(reinterpret_cast<const uint8_t*>(data), size);
+    return;
+  }
+
+  this->pending.append(reinterpret_cast<const char*>(data), size);
+  this->parse_header();
+  if (this->encoder) {
+    string remaining = move(this->pending);
+    this->pending.clear();
+    this->write_samples(reinterpret_cast<const uint8_t*>(remaining.data()), remaining.size());
+  } else if (this->pending.size() > 0x100000) {
+    throw runtime_error("WAV file does not have a data chunk");
+  }
+}
+
+void WAVToFLACConverter::parse_header() {
+  // This is called each time more data arrives until the data chunk is found,
+  // so it returns without doing anything if the header is incomplete
+  StringReader r(this->pending);
+  if (r.size() < 12) {
+    return;
+  }
+  uint32_t riff_magic = r.get_u32b();
+  r.skip(4); // File size
+  if ((riff_magic != 0x52494646) || (r.get_u32b() != 0x57415645)) {
+    throw runtime_error("data is not a WAV file");
+  }
+
+  uint32_t sample_rate = 0;
+  uint32_t loop_start_bytes = 0;
+  uint32_t loop_end_bytes = 0;
+  while (r.remaining() >= 8) {
+    uint32_t chunk_magic = r.get_u32b();
+    uint32_t chunk_size = r.get_u32l();
+
+    if (chunk_magic == 0x64617461) { // 'data'
+      if (!this->num_channels) {
+        throw runtime_error("WAV file does not have a format chunk before its data");
+      }
+      this->data_bytes_remaining = chunk_size;
+      size_t frame_bytes = this->num_channels * (this->bits_per_sample / 8);
+      vector<pair<string, string>> tags;
+      if (loop_end_bytes > loop_start_bytes) {
+        // Loop offsets are per-channel byte offsets, as written by the sound
+        // decoders
+        size_t sample_bytes = this->bits_per_sample / 8;
+        tags.emplace_back("LOOPSTART", string_printf("%zu", loop_start_bytes / sample_bytes));
+        tags.emplace_back("LOOPLENGTH", string_printf("%zu", (loop_end_bytes - loop_start_bytes) / sample_bytes));
+      }
+      this->encoder = make_unique<FLACEncoder>(this->num_channels, sample_rate,
+          this->bits_per_sample, chunk_size / frame_bytes, this->options,
+          this->write_fn, tags);
+      this->pending = this->pending.substr(r.where());
+      return;
+    }
+
+    size_t padded_size = chunk_size + (chunk_size & 1);
+    if (r.remaining() < padded_size) {
+      return;
+    }
+    StringReader chunk_r = r.sub(r.where(), chunk_size);
+    r.skip(padded_size);
+
+    if (chunk_magic == 0x666D7420) { // 'fmt '
+      if (chunk_r.get_u16l() != 1) {
+        throw runtime_error("WAV file is not PCM");
+      }
+      this->num_channels = chunk_r.get_u16l();
+      sample_rate = chunk_r.get_u32l();
+      chunk_r.skip(6);
+      this->bits_per_sample = chunk_r.get_u16l();
+      if ((this->bits_per_sample != 8) && (this->bits_per_sample != 16) &&
+          (this->bits_per_sample != 24)) {
+        throw runtime_error(string_printf(
+            "WAV files with %hu bits per sample cannot be converted", this->bits_per_sample));
+      }
+      if (this->num_channels == 0) {
+        throw runtime_error("WAV file has no channels");
+      }
+    } else if ((chunk_magic == 0x736D706C) && (chunk_size >= 52)) { // 'smpl'
+      chunk_r.skip(28);
+      if (chunk_r.get_u32l() > 0) { // Number of loops
+        chunk_r.skip(12);
+        loop_start_bytes = chunk_r.get_u32l();
+        loop_end_bytes = chunk_r.get_u32l();
+      }
+    }
+  }
+}
+
+void WAVToFLACConverter::write_samples(const uint8_t* data, size_t size) {
+  // Anything after the data chunk (e.g. other chunks) is ignored
+  size = min<uint64_t>(size, this->data_bytes_remaining);
+  this->data_bytes_remaining -= size;
+
+  // Complete the partial frame from the previous call first, if there is one
+  size_t frame_bytes = this->num_channels * (this->bits_per_sample / 8);
+  if (!this->pending.empty()) {
+    size_t needed = min<size_t>(frame_bytes - this->pending.size(), size);
+    this->pending.append(reinterpret_cast<const char*>(data), needed);
+    data += needed;
+    size -= needed;
+    if (this->pending.size() < frame_bytes) {
+      return;
+    }
+    this->convert_frames(reinterpret_cast<const uint8_t*>(this->pending.data()), 1);
+    this->pending.clear();
+  }
+
+  size_t num_frames = size / frame_bytes;
+  if (num_frames) {
+    this->convert_frames(data, num_frames);
+  }
+  this->pending.assign(reinterpret_cast<const char*>(data) + num_frames * frame_bytes,
+      size - num_frames * frame_bytes);
+}
+
+void WAVToFLACConverter::convert_frames(const uint8_t* data, size_t num_frames) {
+  size_t num_samples = num_frames * this->num_channels;
+  this->convert_buffer.resize(num_samples);
+  int32_t* out = this->convert_buffer.data();
+  if (this->bits_per_sample == 8) {
+    // 8-bit WAV samples are unsigned
+    for (size_t z = 0; z < num_samples; z++) {
+      out[z] = static_cast<int32_t>(data[z]) - 0x80;
+    }
+  } else if (this->bits_per_sample == 16) {
+    for (size_t z = 0; z < num_samples; z++) {
+      out[z] = static_cast<int16_t>(data[2 * z] | (data[2 * z + 1] << 8));
+    }
+  } else {
+    for (size_t z = 0; z < num_samples; z++) {
+      const uint8_t* s = &data[3 * z];
+      out[z] = static_cast<int32_t>((static_cast<uint32_t>(s[0]) << 8) |
+          (static_cast<uint32_t>(s[1]) << 16) | (static_cast<uint32_t>(s[2]) << 24)) >> 8;
+    }
+  }
+  this->encoder->write(out, num_frames);
+}
+
+void WAVToFLACConverter::finish() {
+  if (!this->encoder) {
+    throw runtime_error("WAV file ended before its data chunk");
+  }
+  if (this->data_bytes_remaining || !this->pending.empty()) {
+    throw runtime_error("WAV file is incomplete");
+  }
+  this->encoder->finish();
+}
+
+string encode_flac_from_wav(const string& wav_data, const AudioEncodingOptions& options) {
+  string ret;
+  WAVToFLACConverter converter(options, [&](const void* data, size_t size) -> void {
+    ret.append(reinterpret_cast<const char*>(data), size);
+  });
+  converter.write(wav_data.data(), wav_data.size());
+  converter.finish();
+  return ret;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+
+enum class AudioFormat {
+  WAV = 0,
+  FLAC,
+};
+
+struct AudioEncodingOptions {
+  AudioFormat format = AudioFormat::WAV;
+  // Frames per FLAC block. Every block is encoded independently, so several
+  // can be encoded at once.
+  size_t flac_block_frames = 4096;
+  // Number of threads that encode FLAC blocks for each sound (0 means one per
+  // core). Blocks are always written in order.
+  size_t flac_threads = 1;
+};
+
+// Returns "wav" or "flac" (without a leading dot).
+const char* file_extension_for_audio_format(AudioFormat format);
+// Parses "wav" or "flac"; throws invalid_argument for anything else.
+AudioFormat audio_format_for_name(const std::string& name);
+
+// If filename ends in .wav, returns it with the extension for the given format
+// instead. Other filenames are returned unchanged.
+std::string filename_for_audio_format(const std::string& filename,
+    AudioFormat format);
+
+
+
+// Streaming lossless FLAC encoder. The stream header is written when the
+// encoder is created; after that, blocks are written as soon as enough samples
+// have been added to fill them (or, if multiple threads are used, enough to
+// keep all the threads busy), so the whole sound is never held in memory.
+//
+// Each channel of each block is encoded with whichever fixed predictor (order
+// 0 through 4) gives the smallest partitioned Rice coding, or verbatim or as a
+// constant if that's smaller. Stereo blocks also try the left/side,
+// right/side, and mid/side channel decorrelations. The stream's MD5 signature
+// is left blank (which means that it's unknown).
+class FLACEncoder {
+public:
+  using WriteFn = std::function<void(const void* data, size_t size)>;
+
+  // bits_per_sample may be from 4 to 24. If total_frames is 0, the stream's
+  // length is unknown; otherwise finish() checks that exactly that many frames
+  // were added. tags are written in a VORBIS_COMMENT block, if there are any.
+  FLACEncoder(
+      uint16_t num_channels,
+      uint32_t sample_rate,
+      uint16_t bits_per_sample,
+      uint64_t total_frames,
+      const AudioEncodingOptions& options,
+      WriteFn write_fn,
+      const std::vector<std::pair<std::string, std::string>>& tags = {});
+  ~FLACEncoder() = default;
+
+  // Adds num_frames frames of interleaved samples. Samples must be signed and
+  // fit in bits_per_sample bits.
+  void write(const int32_t* samples, size_t num_frames);
+  // Writes the last (possibly partial) block. No frames may be added after
+  // this is called.
+  void finish();
+
+private:
+  uint16_t num_channels;
+  uint32_t sample_rate;
+  uint16_t bits_per_sample;
+  uint64_t total_frames;
+  size_t block_frames;
+  size_t num_threads;
+  size_t batch_blocks;
+  WriteFn write_fn;
+
+  std::vector<int32_t> pending_samples; // Interleaved
+  uint64_t frames_written;
+  uint64_t next_block_number;
+  bool finished;
+
+  void write_stream_header(
+      const std::vector<std::pair<std::string, std::string>>& tags);
+  // Encodes and writes all complete blocks in pending_samples (and the last
+  // partial block, if final is true)
+  void flush_blocks(bool final);
+  std::string encode_block(const int32_t* samples, size_t num_frames,
+      uint64_t block_number) const;
+};
+
+// Converts a WAV file (as produced by the sound decoders in ResourceFile) to a
+// FLAC file as it's streamed in. The WAV file's loop (from its smpl chunk), if
+// it has one, is kept as LOOPSTART and LOOPLENGTH tags, in frames.
+class WAVToFLACConverter {
+public:
+  WAVToFLACConverter(const AudioEncodingOptions& options,
+      FLACEncoder::WriteFn write_fn);
+  ~WAVToFLACConverter() = default;
+
+  // Adds the next size bytes of the WAV file
+  void write(const void* data, size_t size);
+  // Throws if the WAV file was incomplete
+  void finish();
+
+private:
+  AudioEncodingOptions options;
+  FLACEncoder::WriteFn write_fn;
+  std::unique_ptr<FLACEncoder> encoder;
+
+  // WAV data before the start of the data chunk, and then the part of the last
+  // frame that was incomplete
+  std::string pending;
+  uint16_t num_channels;
+  uint16_t bits_per_sample;
+  uint64_t data_bytes_remaining;
+  std::vector<int32_t> convert_buffer;
+
+  void parse_header();
+  void write_samples(const uint8_t* data, size_t size);
+  void convert_frames(const uint8_t* data, size_t num_frames);
+};
+
+// Converts a complete WAV file to a complete FLAC file.
+std::string encode_flac_from_wav(const std::string& wav_data,
+    const AudioEncodingOptions& options);
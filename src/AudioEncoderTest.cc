@@ -0,0 +1,670 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <functional>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "AudioEncoder.hh"
+
+using namespace std;
+
+
+
+// A straightforward FLAC decoder, written from the format's description. It
+// only supports what FLACEncoder writes (fixed-blocksize streams with
+// constant, verbatim, and fixed-predictor subframes), and checks everything
+// it reads.
+
+class FLACTestBitReader {
+public:
+  FLACTestBitReader(const string& data, size_t byte_offset)
+    : data(data), offset(byte_offset * 8) { }
+
+  void seek(size_t byte_offset) {
+    this->offset = byte_offset * 8;
+  }
+
+  uint64_t read(uint8_t bits) {
+    uint64_t ret = 0;
+    for (; bits; bits--, this->offset++) {
+      if (this->offset >= this->data.size() * 8) {
+        throw out_of_range("FLAC data is truncated");
+      }
+      uint8_t byte = this->data[this->offset >> 3];
+      ret = (ret << 1) | ((byte >> (7 - (this->offset & 7))) & 1);
+    }
+    return ret;
+  }
+
+  int64_t read_signed(uint8_t bits) {
+    uint64_t v = this->read(bits);
+    return (v & (1ULL << (bits - 1))) ? static_cast<int64_t>(v - (1ULL << bits)) : static_cast<int64_t>(v);
+  }
+
+  uint64_t read_unary() {
+    uint64_t ret = 0;
+    while (!this->read(1)) {
+      ret++;
+    }
+    return ret;
+  }
+
+  void align() {
+    this->offset = (this->offset + 7) & ~7;
+  }
+
+  size_t byte_offset() const {
+    return this->offset >> 3;
+  }
+
+private:
+  const string& data;
+  size_t offset;
+};
+
+static uint8_t reference_crc8(const string& data, size_t start, size_t end) {
+  uint8_t crc = 0;
+  for (size_t z = start; z < end; z++) {
+    crc ^= static_cast<uint8_t>(data[z]);
+    for (size_t b = 0; b < 8; b++) {
+      crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+static uint16_t reference_crc16(const string& data, size_t start, size_t end) {
+  uint16_t crc = 0;
+  for (size_t z = start; z < end; z++) {
+    crc ^= static_cast<uint16_t>(static_cast<uint8_t>(data[z])) << 8;
+    for (size_t b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? ((crc << 1) ^ 0x8005) : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+struct DecodedFLAC {
+  uint16_t num_channels = 0;
+  uint32_t sample_rate = 0;
+  uint16_t bits_per_sample = 0;
+  uint64_t total_frames = 0;
+  uint16_t block_frames = 0;
+  vector<pair<string, string>> tags;
+  vector<int32_t> samples; // Interleaved
+  vector<size_t> frame_sizes; // In frames (that is, samples per channel)
+  uint32_t channel_assignments_used = 0; // Bit N is set if assignment N was used
+  uint32_t subframe_types_used = 0; // Bit N is set if subframe type N was used
+};
+
+static vector<int64_t> decode_subframe(FLACTestBitReader& r, size_t n,
+    uint8_t bps, DecodedFLAC& ret) {
+  expect_eq(0, r.read(1)); // Padding
+  uint8_t type = r.read(6);
+  expect_eq(0, r.read(1)); // Wasted bits flag
+  ret.subframe_types_used |= (1 << min<uint8_t>(type, 31));
+
+  vector<int64_t> x;
+  if (type == 0x00) { // Constant
+    x.assign(n, r.read_signed(bps));
+
+  } else if (type == 0x01) { // Verbatim
+    for (size_t z = 0; z < n; z++) {
+      x.emplace_back(r.read_signed(bps));
+    }
+
+  } else if ((type >= 0x08) && (type <= 0x0C)) { // Fixed predictor
+    uint8_t order = type & 7;
+    for (size_t z = 0; z < order; z++) {
+      x.emplace_back(r.read_signed(bps));
+    }
+
+    uint8_t coding_method = r.read(2);
+    expect(coding_method < 2);
+    uint8_t param_bits = coding_method ? 5 : 4;
+    uint8_t escape_param = coding_method ? 0x1F : 0x0F;
+    uint8_t partition_order = r.read(4);
+    size_t partition_size = n >> partition_order;
+    expect_eq(n, partition_size << partition_order);
+    for (size_t p = 0; p < (1U << partition_order); p++) {
+      uint8_t k = r.read(param_bits);
+      expect(k != escape_param); // FLACEncoder never writes escaped partitions
+      size_t count = partition_size - ((p == 0) ? order : 0);
+      for (size_t z = 0; z < count; z++) {
+        uint64_t v = (r.read_unary() << k) | r.read(k);
+        int64_t residual = (v & 1) ? -static_cast<int64_t>(v >> 1) - 1 : static_cast<int64_t>(v >> 1);
+        size_t i = x.size();
+        int64_t prediction;
+        switch (order) {
+          case 0:
+            prediction = 0;
+            break;
+          case 1:
+            prediction = x[i - 1];
+            break;
+          case 2:
+            prediction = 2 * x[i - 1] - x[i - 2];
+            break;
+          case 3:
+            prediction = 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3];
+            break;
+          default:
+            prediction = 4 * x[i - 1] - 6 * x[i - 2] + 4 * x[i - 3] - x[i - 4];
+            break;
+        }
+        x.emplace_back(prediction + residual);
+      }
+    }
+
+  } else {
+    throw runtime_error(string_printf("unexpected subframe type %02hhX", type));
+  }
+  return x;
+}
+
+static DecodedFLAC decode_flac(const string& data) {
+  DecodedFLAC ret;
+  expect_eq(string("fLaC"), data.substr(0, 4));
+
+  // Metadata blocks
+  FLACTestBitReader r(data, 4);
+  bool is_last_block = false;
+  bool has_streaminfo = false;
+  while (!is_last_block) {
+    is_last_block = r.read(1);
+    uint8_t type = r.read(7);
+    size_t size = r.read(24);
+    size_t block_end = r.byte_offset() + size;
+    if (type == 0) { // STREAMINFO
+      expect(!has_streaminfo);
+      has_streaminfo = true;
+      expect_eq(34, size);
+      ret.block_frames = r.read(16);
+      expect_eq(ret.block_frames, r.read(16)); // Max block size
+      r.read(24); // Min frame size
+      r.read(24); // Max frame size
+      ret.sample_rate = r.read(20);
+      ret.num_channels = r.read(3) + 1;
+      ret.bits_per_sample = r.read(5) + 1;
+      ret.total_frames = r.read(36);
+      for (size_t z = 0; z < 16; z++) {
+        expect_eq(0, r.read(8)); // MD5 signature (unknown)
+      }
+    } else if (type == 4) { // VORBIS_COMMENT
+      StringReader comment_r(data.data() + r.byte_offset(), size);
+      comment_r.skip(comment_r.get_u32l()); // Vendor string
+      size_t num_tags = comment_r.get_u32l();
+      for (size_t z = 0; z < num_tags; z++) {
+        string tag = comment_r.read(comment_r.get_u32l());
+        size_t equals_pos = tag.find('=');
+        expect(equals_pos != string::npos);
+        ret.tags.emplace_back(tag.substr(0, equals_pos), tag.substr(equals_pos + 1));
+      }
+      expect(comment_r.eof());
+    } else {
+      throw runtime_error("unexpected metadata block type");
+    }
+    r.seek(block_end);
+  }
+  expect(has_streaminfo);
+  expect(ret.total_frames > 0);
+
+  // Frames
+  while (r.byte_offset() < data.size()) {
+    size_t frame_start = r.byte_offset();
+    expect_eq(0x3FFE, r.read(14)); // Sync code
+    expect_eq(0, r.read(1)); // Reserved
+    expect_eq(0, r.read(1)); // Fixed block size
+    uint8_t block_size_code = r.read(4);
+    uint8_t sample_rate_code = r.read(4);
+    uint8_t channel_assignment = r.read(4);
+    uint8_t sample_size_code = r.read(3);
+    expect_eq(0, r.read(1)); // Reserved
+
+    // The block number is encoded like a UTF-8 character
+    uint64_t block_number = r.read(8);
+    size_t num_extra_bytes = 0;
+    while ((num_extra_bytes < 7) && (block_number & (0x80 >> num_extra_bytes))) {
+      num_extra_bytes++;
+    }
+    expect(num_extra_bytes != 1);
+    if (num_extra_bytes) {
+      num_extra_bytes--;
+      block_number &= (0x7F >> (num_extra_bytes + 1));
+      for (size_t z = 0; z < num_extra_bytes; z++) {
+        uint8_t byte = r.read(8);
+        expect_eq(0x80, byte & 0xC0);
+        block_number = (block_number << 6) | (byte & 0x3F);
+      }
+    }
+    expect_eq(ret.frame_sizes.size(), block_number);
+
+    size_t num_frames;
+    if (block_size_code == 1) {
+      num_frames = 192;
+    } else if ((block_size_code >= 2) && (block_size_code <= 5)) {
+      num_frames = 576 << (block_size_code - 2);
+    } else if (block_size_code == 6) {
+      num_frames = r.read(8) + 1;
+    } else if (block_size_code == 7) {
+      num_frames = r.read(16) + 1;
+    } else if (block_size_code >= 8) {
+      num_frames = 256 << (block_size_code - 8);
+    } else {
+      throw runtime_error("reserved block size code");
+    }
+
+    static const uint32_t sample_rates[12] = {
+        0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000};
+    uint32_t sample_rate;
+    if (sample_rate_code < 12) {
+      sample_rate = sample_rate_code ? sample_rates[sample_rate_code] : ret.sample_rate;
+    } else if (sample_rate_code == 12) {
+      sample_rate = r.read(8) * 1000;
+    } else if (sample_rate_code == 13) {
+      sample_rate = r.read(16);
+    } else if (sample_rate_code == 14) {
+      sample_rate = r.read(16) * 10;
+    } else {
+      throw runtime_error("invalid sample rate code");
+    }
+    expect_eq(ret.sample_rate, sample_rate);
+
+    static const uint16_t sample_sizes[8] = {0, 8, 12, 0, 16, 20, 24, 0};
+    uint16_t bps = sample_size_code ? sample_sizes[sample_size_code] : ret.bits_per_sample;
+    expect_eq(ret.bits_per_sample, bps);
+
+    size_t header_end = r.byte_offset();
+    expect_eq(reference_crc8(data, frame_start, header_end), r.read(8));
+
+    // Independent channels use assignment (num_channels - 1); the others are
+    // the stereo decorrelations
+    expect((channel_assignment < 8) ? (channel_assignment == ret.num_channels - 1) : (ret.num_channels == 2));
+    expect(channel_assignment <= 10);
+    ret.channel_assignments_used |= (1 << channel_assignment);
+    vector<vector<int64_t>> channels;
+    for (size_t c = 0; c < ret.num_channels; c++) {
+      bool is_side = ((channel_assignment == 8) && (c == 1)) ||
+          ((channel_assignment == 9) && (c == 0)) ||
+          ((channel_assignment == 10) && (c == 1));
+      channels.emplace_back(decode_subframe(r, num_frames, bps + (is_side ? 1 : 0), ret));
+    }
+    for (size_t z = 0; z < num_frames; z++) {
+      if (channel_assignment == 8) { // Left/side
+        channels[1][z] = channels[0][z] - channels[1][z];
+      } else if (channel_assignment == 9) { // Side/right
+        channels[0][z] = channels[0][z] + channels[1][z];
+      } else if (channel_assignment == 10) { // Mid/side
+        int64_t side = channels[1][z];
+        int64_t mid = (channels[0][z] << 1) | (side & 1);
+        channels[0][z] = (mid + side) >> 1;
+        channels[1][z] = (mid - side) >> 1;
+      }
+      for (size_t c = 0; c < ret.num_channels; c++) {
+        ret.samples.emplace_back(channels[c][z]);
+      }
+    }
+
+    r.align();
+    size_t frame_end = r.byte_offset();
+    expect_eq(reference_crc16(data, frame_start, frame_end), r.read(16));
+    ret.frame_sizes.emplace_back(num_frames);
+  }
+
+  expect_eq(ret.total_frames * ret.num_channels, ret.samples.size());
+  return ret;
+}
+
+
+
+static vector<int32_t> make_samples(size_t num_frames, uint16_t num_channels,
+    uint16_t bits_per_sample, uint32_t seed, bool correlated) {
+  int32_t max_value = (1 << (bits_per_sample - 1)) - 1;
+  int32_t min_value = -max_value - 1;
+  vector<int32_t> ret;
+  int32_t value = 0;
+  int32_t delta = 0;
+  for (size_t z = 0; z < num_frames; z++) {
+    // A smooth wave with some noise, with a silent part (which should be
+    // encoded as constant subframes) and a part with only noise at full scale
+    // (which should be encoded verbatim)
+    seed = seed * 1103515245 + 12345;
+    int32_t noise = static_cast<int32_t>((seed >> 8) & 0xFFFF);
+    bool silent = ((z / 256) % 8) == 3;
+    bool random = ((z / 256) % 8) == 6;
+    delta += ((z / 64) & 1) ? 1 : -1;
+    value += delta;
+    for (size_t c = 0; c < num_channels; c++) {
+      int32_t sample;
+      if (silent) {
+        sample = 0;
+      } else if (random) {
+        seed = seed * 1103515245 + 12345;
+        sample = static_cast<int32_t>(seed) >> (32 - bits_per_sample);
+      } else {
+        int64_t v = static_cast<int64_t>(value) << max<int>(bits_per_sample - 12, 0);
+        v += (correlated || (c == 0)) ? ((noise & 0x0F) - 8) : ((noise >> 4) - 0x800);
+        v += c * 3;
+        sample = static_cast<int32_t>(min<int64_t>(max<int64_t>(v, min_value), max_value));
+      }
+      ret.emplace_back(sample);
+    }
+  }
+  return ret;
+}
+
+static string encode_flac(const vector<int32_t>& samples, uint16_t num_channels,
+    uint32_t sample_rate, uint16_t bits_per_sample, size_t block_frames,
+    size_t num_threads, size_t chunk_frames = 0,
+    const vector<pair<string, string>>& tags = {}) {
+  AudioEncodingOptions options;
+  options.format = AudioFormat::FLAC;
+  options.flac_block_frames = block_frames;
+  options.flac_threads = num_threads;
+  size_t num_frames = samples.size() / num_channels;
+
+  string ret;
+  FLACEncoder encoder(num_channels, sample_rate, bits_per_sample, num_frames,
+      options, [&](const void* data, size_t size) -> void {
+    ret.append(reinterpret_cast<const char*>(data), size);
+  }, tags);
+  if (chunk_frames == 0) {
+    encoder.write(samples.data(), num_frames);
+  } else {
+    // Vary the chunk size, so chunks don't line up with blocks
+    for (size_t start = 0, z = 0; start < num_frames; z++) {
+      size_t count = min<size_t>((z % 3) ? chunk_frames : (chunk_frames / 3 + 1), num_frames - start);
+      encoder.write(samples.data() + start * num_channels, count);
+      start += count;
+    }
+  }
+  encoder.finish();
+  return ret;
+}
+
+static void check_flac_round_trip(size_t num_frames, uint16_t num_channels,
+    uint32_t sample_rate, uint16_t bits_per_sample, size_t block_frames,
+    bool correlated) {
+  fprintf(stderr, "-- %zu frames, %hu channels, %" PRIu32 " Hz, %hu bits, %zu-frame blocks\n",
+      num_frames, num_channels, sample_rate, bits_per_sample, block_frames);
+  auto samples = make_samples(num_frames, num_channels, bits_per_sample, num_frames, correlated);
+  string flac = encode_flac(samples, num_channels, sample_rate, bits_per_sample, block_frames, 1);
+
+  DecodedFLAC decoded = decode_flac(flac);
+  expect_eq(num_channels, decoded.num_channels);
+  expect_eq(sample_rate, decoded.sample_rate);
+  expect_eq(bits_per_sample, decoded.bits_per_sample);
+  expect_eq(num_frames, decoded.total_frames);
+  expect_eq(block_frames, decoded.block_frames);
+  expect(decoded.tags.empty());
+  expect(samples == decoded.samples);
+
+  // All blocks are full except the last one
+  expect_eq((num_frames + block_frames - 1) / block_frames, decoded.frame_sizes.size());
+  for (size_t z = 0; z < decoded.frame_sizes.size() - 1; z++) {
+    expect_eq(block_frames, decoded.frame_sizes[z]);
+  }
+  size_t last_block_frames = num_frames % block_frames;
+  expect_eq(last_block_frames ? last_block_frames : block_frames, decoded.frame_sizes.back());
+
+  // The stream is the same when encoded on multiple threads, and when the
+  // samples are written a few at a time
+  expect_eq(flac, encode_flac(samples, num_channels, sample_rate, bits_per_sample, block_frames, 4));
+  expect_eq(flac, encode_flac(samples, num_channels, sample_rate, bits_per_sample, block_frames, 1, 777));
+  expect_eq(flac, encode_flac(samples, num_channels, sample_rate, bits_per_sample, block_frames, 3, 100));
+}
+
+static void put_wav_header(StringWriter& w, uint16_t num_channels,
+    uint32_t sample_rate, uint16_t bits_per_sample, size_t data_size,
+    bool with_loop) {
+  uint16_t frame_bytes = num_channels * (bits_per_sample / 8);
+  w.put_u32b(0x52494646); // 'RIFF'
+  w.put_u32l(4 + 24 + (with_loop ? 68 : 0) + 8 + data_size);
+  w.put_u32b(0x57415645); // 'WAVE'
+
+  w.put_u32b(0x666D7420); // 'fmt '
+  w.put_u32l(16);
+  w.put_u16l(1); // PCM
+  w.put_u16l(num_channels);
+  w.put_u32l(sample_rate);
+  w.put_u32l(sample_rate * frame_bytes);
+  w.put_u16l(frame_bytes);
+  w.put_u16l(bits_per_sample);
+
+  if (with_loop) {
+    w.put_u32b(0x736D706C); // 'smpl'
+    w.put_u32l(60);
+    for (size_t z = 0; z < 7; z++) {
+      w.put_u32l(0); // Manufacturer, product, sample period, MIDI, SMPTE
+    }
+    w.put_u32l(1); // Number of loops
+    w.put_u32l(0); // Sampler data size
+    w.put_u32l(0); // Cue point ID
+    w.put_u32l(0); // Loop type
+    // Loop start and end, as per-channel byte offsets
+    w.put_u32l(100 * (bits_per_sample / 8));
+    w.put_u32l(500 * (bits_per_sample / 8));
+    w.put_u32l(0); // Fraction
+    w.put_u32l(0); // Play count
+  }
+
+  w.put_u32b(0x64617461); // 'data'
+  w.put_u32l(data_size);
+}
+
+static void check_wav_conversion(uint16_t num_channels, uint16_t bits_per_sample,
+    bool with_loop) {
+  fprintf(stderr, "-- WAV conversion with %hu channels, %hu bits%s\n",
+      num_channels, bits_per_sample, with_loop ? ", with loop" : "");
+  static constexpr size_t num_frames = 3000;
+  auto samples = make_samples(num_frames, num_channels, bits_per_sample, 5, false);
+
+  StringWriter w;
+  size_t sample_bytes = bits_per_sample / 8;
+  put_wav_header(w, num_channels, 22050, bits_per_sample, samples.size() * sample_bytes, with_loop);
+  for (int32_t sample : samples) {
+    if (bits_per_sample == 8) {
+      w.put_u8(sample + 0x80); // 8-bit WAV samples are unsigned
+    } else if (bits_per_sample == 16) {
+      w.put_u16l(sample);
+    } else {
+      w.put_u24l(sample);
+    }
+  }
+  const string& wav = w.str();
+
+  AudioEncodingOptions options;
+  options.format = AudioFormat::FLAC;
+  options.flac_block_frames = 1024;
+  string flac = encode_flac_from_wav(wav, options);
+  DecodedFLAC decoded = decode_flac(flac);
+  expect_eq(num_channels, decoded.num_channels);
+  expect_eq(22050, decoded.sample_rate);
+  expect_eq(bits_per_sample, decoded.bits_per_sample);
+  expect_eq(num_frames, decoded.total_frames);
+  expect(samples == decoded.samples);
+  if (with_loop) {
+    expect_eq(2, decoded.tags.size());
+    expect_eq(string("LOOPSTART"), decoded.tags[0].first);
+    expect_eq(string("100"), decoded.tags[0].second);
+    expect_eq(string("LOOPLENGTH"), decoded.tags[1].first);
+    expect_eq(string("400"), decoded.tags[1].second);
+  } else {
+    expect(decoded.tags.empty());
+  }
+
+  // The result is the same when the WAV data arrives in small pieces, which
+  // often split the header and frames
+  string streamed_flac;
+  WAVToFLACConverter converter(options, [&](const void* data, size_t size) -> void {
+    streamed_flac.append(reinterpret_cast<const char*>(data), size);
+  });
+  for (size_t offset = 0; offset < wav.size(); offset += 7) {
+    converter.write(wav.data() + offset, min<size_t>(7, wav.size() - offset));
+  }
+  converter.finish();
+  expect_eq(flac, streamed_flac);
+
+  // An incomplete WAV file can't be converted
+  bool failed = false;
+  try {
+    encode_flac_from_wav(wav.substr(0, wav.size() - 1), options);
+  } catch (const runtime_error&) {
+    failed = true;
+  }
+  expect(failed);
+}
+
+int main(int, char**) {
+  check_flac_round_trip(10000, 1, 44100, 16, 4096, false);
+  check_flac_round_trip(10000, 2, 44100, 16, 4096, true);
+  check_flac_round_trip(10000, 2, 32000, 16, 1152, false);
+  check_flac_round_trip(5000, 1, 22050, 8, 4096, false);
+  check_flac_round_trip(5000, 2, 48000, 24, 4096, true);
+  check_flac_round_trip(5000, 3, 96000, 12, 4096, false);
+  check_flac_round_trip(4096, 1, 8000, 16, 4096, false);
+  // Short blocks, so block numbers need more than one byte
+  check_flac_round_trip(3000, 2, 11025, 16, 16, true);
+  // Sample rates that are written in the frame headers
+  check_flac_round_trip(2000, 1, 22000, 16, 192, false);
+  check_flac_round_trip(2000, 1, 655350, 16, 256, false);
+
+  fprintf(stderr, "-- subframe types\n");
+  {
+    // A polynomial of degree N is predicted exactly by the fixed predictor of
+    // order N + 1, so that's the cheapest one
+    auto make_mono = [](function<int32_t(int32_t)> fn) -> vector<int32_t> {
+      vector<int32_t> ret;
+      for (int32_t t = 0; t < 192; t++) {
+        ret.emplace_back(fn(t));
+      }
+      return ret;
+    };
+    uint32_t seed = 1;
+    auto noise = [&](uint8_t bits) -> int32_t {
+      seed = seed * 1103515245 + 12345;
+      return static_cast<int32_t>(seed) >> (32 - bits);
+    };
+    vector<pair<vector<int32_t>, uint8_t>> cases = {
+        {make_mono([](int32_t) { return -12345; }), 0x00},
+        {make_mono([&](int32_t) { return noise(24); }), 0x01},
+        {make_mono([&](int32_t) { return noise(4); }), 0x08},
+        {make_mono([&, v = 0](int32_t) mutable { return v += (noise(4) * 1000); }), 0x09},
+        {make_mono([](int32_t t) { return t * 1000 - 100000; }), 0x0A},
+        {make_mono([](int32_t t) { return t * t * 100 - 1000000; }), 0x0B},
+        {make_mono([](int32_t t) { return t * t * t - 3 * t * t; }), 0x0C},
+    };
+    for (const auto& [samples, expected_type] : cases) {
+      auto decoded = decode_flac(encode_flac(samples, 1, 44100, 24, 4096, 1));
+      expect(samples == decoded.samples);
+      expect_eq(static_cast<uint32_t>(1 << expected_type), decoded.subframe_types_used);
+    }
+  }
+
+  fprintf(stderr, "-- stereo decorrelation\n");
+  {
+    // The cheapest pair of channels is the two that have the least noise
+    static constexpr size_t num_frames = 4096;
+    uint32_t seed = 1;
+    auto noise = [&]() -> int32_t {
+      seed = seed * 1103515245 + 12345;
+      return static_cast<int32_t>(seed) >> 20;
+    };
+    auto make_stereo = [&](function<pair<int32_t, int32_t>(int32_t, int32_t)> fn) -> vector<int32_t> {
+      vector<int32_t> ret;
+      for (size_t z = 0; z < num_frames; z++) {
+        int32_t smooth = static_cast<int32_t>(z * 3) - 6000;
+        auto [l, r] = fn(smooth, noise());
+        ret.emplace_back(l);
+        ret.emplace_back(r);
+      }
+      return ret;
+    };
+    vector<pair<vector<int32_t>, uint8_t>> cases = {
+        // Only right is noisy, so every other pair includes a noisy channel
+        {make_stereo([](int32_t s, int32_t n) { return make_pair(s, n); }), 1},
+        // Right is left plus noise
+        {make_stereo([](int32_t s, int32_t n) { return make_pair(s, s + n); }), 8},
+        // Left is right plus noise
+        {make_stereo([](int32_t s, int32_t n) { return make_pair(s + n, s); }), 9},
+        // Mid is smooth, but left and right aren't
+        {make_stereo([](int32_t s, int32_t n) { return make_pair(s + n, s - n); }), 10},
+    };
+    for (const auto& [samples, expected_assignment] : cases) {
+      auto decoded = decode_flac(encode_flac(samples, 2, 44100, 16, 4096, 1));
+      expect(samples == decoded.samples);
+      expect_eq(static_cast<uint32_t>(1 << expected_assignment), decoded.channel_assignments_used);
+    }
+  }
+
+  fprintf(stderr, "-- tags\n");
+  {
+    auto samples = make_samples(100, 1, 16, 1, false);
+    string flac = encode_flac(samples, 1, 44100, 16, 4096, 1, 0,
+        {{"TITLE", "Test"}, {"LOOPSTART", "5"}});
+    auto decoded = decode_flac(flac);
+    expect_eq(2, decoded.tags.size());
+    expect_eq(string("TITLE"), decoded.tags[0].first);
+    expect_eq(string("Test"), decoded.tags[0].second);
+    expect_eq(string("LOOPSTART"), decoded.tags[1].first);
+    expect_eq(string("5"), decoded.tags[1].second);
+    expect(samples == decoded.samples);
+  }
+
+  fprintf(stderr, "-- declared length is enforced\n");
+  {
+    AudioEncodingOptions options;
+    options.format = AudioFormat::FLAC;
+    auto write_fn = [](const void*, size_t) -> void { };
+    vector<int32_t> samples(200, 0);
+
+    FLACEncoder short_encoder(1, 44100, 16, 201, options, write_fn);
+    short_encoder.write(samples.data(), samples.size());
+    bool failed = false;
+    try {
+      short_encoder.finish();
+    } catch (const runtime_error&) {
+      failed = true;
+    }
+    expect(failed);
+
+    FLACEncoder long_encoder(1, 44100, 16, 199, options, write_fn);
+    failed = false;
+    try {
+      long_encoder.write(samples.data(), samples.size());
+    } catch (const runtime_error&) {
+      failed = true;
+    }
+    expect(failed);
+  }
+
+  check_wav_conversion(1, 8, false);
+  check_wav_conversion(2, 16, true);
+  check_wav_conversion(2, 24, true);
+
+  fprintf(stderr, "-- format names and filenames\n");
+  {
+    expect(AudioFormat::WAV == audio_format_for_name("wav"));
+    expect(AudioFormat::FLAC == audio_format_for_name("flac"));
+    bool failed = false;
+    try {
+      audio_format_for_name("mp3");
+    } catch (const invalid_argument&) {
+      failed = true;
+    }
+    expect(failed);
+
+    expect_eq(string("a/b_128.flac"), filename_for_audio_format("a/b_128.wav", AudioFormat::FLAC));
+    expect_eq(string("a/b_128.wav"), filename_for_audio_format("a/b_128.wav", AudioFormat::WAV));
+    expect_eq(string("a/b_128.txt"), filename_for_audio_format("a/b_128.txt", AudioFormat::FLAC));
+  }
+
+  printf("AudioEncoderTest: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,383 @@
+#include "Blitter.hh"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#include <arm_neon.h>
+#define BLITTER_USE_NEON
+#endif
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+
+
+// Returns x / 0xFF, rounded down, for 0 <= x <= 0xFF * 0xFF. This is the same
+// result as the division the renderers did per pixel before, so images don't
+// change when they're drawn with these functions instead.
+static inline uint8_t div255(uint32_t x) {
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+static inline void blit_pixel(uint8_t* dest, const uint8_t* src,
+    const BlitOptions& options) {
+  if ((options.dest_alpha_filter >= 0) && (dest[3] != options.dest_alpha_filter)) {
+    return;
+  }
+
+  uint8_t coverage;
+  switch (options.mode) {
+    case BlitMode::OPAQUE:
+      coverage = 0xFF;
+      break;
+    case BlitMode::MASKED:
+      if ((src[0] == ((options.transparent_color >> 24) & 0xFF)) &&
+          (src[1] == ((options.transparent_color >> 16) & 0xFF)) &&
+          (src[2] == ((options.transparent_color >> 8) & 0xFF))) {
+        return;
+      }
+      coverage = options.opacity;
+      break;
+    case BlitMode::ALPHA:
+      if (src[3] == 0) {
+        return;
+      }
+      coverage = div255(src[3] * options.opacity);
+      break;
+    default:
+      return;
+  }
+
+  if (coverage == 0xFF) {
+    memcpy(dest, src, 4);
+  } else {
+    for (size_t z = 0; z < 4; z++) {
+      dest[z] = div255(src[z] * coverage + dest[z] * (0xFF - coverage));
+    }
+  }
+  if (options.output_alpha >= 0) {
+    dest[3] = options.output_alpha;
+  }
+}
+
+void blit_pixel_row(uint8_t* dest, const uint8_t* src, size_t count,
+    const BlitOptions& options) {
+  size_t z = 0;
+
+  // Both vector implementations load four pixels at a time as 32-bit lanes.
+  // Since the buffers are little-endian, red is the low byte of each lane and
+  // alpha is the high byte.
+  uint32_t transparent_value =
+      ((options.transparent_color >> 24) & 0xFF) |
+      (((options.transparent_color >> 16) & 0xFF) << 8) |
+      (((options.transparent_color >> 8) & 0xFF) << 16);
+  uint32_t filter_value = static_cast<uint32_t>(options.dest_alpha_filter & 0xFF) << 24;
+  uint32_t output_alpha_value = static_cast<uint32_t>(options.output_alpha & 0xFF) << 24;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i all_ones = _mm_set1_epi32(-1);
+  const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+  const __m128i transparent = _mm_set1_epi32(transparent_value);
+  const __m128i filter = _mm_set1_epi32(filter_value);
+  const __m128i output_alpha = _mm_set1_epi32(output_alpha_value);
+  const __m128i opacity8 = _mm_set1_epi8(static_cast<char>(options.opacity));
+  const __m128i opacity32 = _mm_set1_epi32(options.opacity);
+  const __m128i one16 = _mm_set1_epi16(1);
+  const __m128i one32 = _mm_set1_epi32(1);
+  const __m128i max16 = _mm_set1_epi16(0xFF);
+  auto blend_half = [&](__m128i s, __m128i d, __m128i c) -> __m128i {
+    __m128i x = _mm_add_epi16(_mm_mullo_epi16(s, c),
+        _mm_mullo_epi16(d, _mm_sub_epi16(max16, c)));
+    return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, one16), _mm_srli_epi16(x, 8)), 8);
+  };
+
+  for (; z + 4 <= count; z += 4) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + z * 4));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest + z * 4));
+
+    __m128i draw, c;
+    switch (options.mode) {
+      case BlitMode::OPAQUE:
+        draw = all_ones;
+        c = all_ones;
+        break;
+      case BlitMode::MASKED:
+        draw = _mm_xor_si128(_mm_cmpeq_epi32(_mm_andnot_si128(alpha_mask, s), transparent), all_ones);
+        c = opacity8;
+        break;
+      case BlitMode::ALPHA: {
+        __m128i sa = _mm_srli_epi32(s, 24);
+        draw = _mm_xor_si128(_mm_cmpeq_epi32(sa, zero), all_ones);
+        // The product fits in the low 16 bits of each lane, so a 16-bit
+        // multiply is enough (SSE2 has no 32-bit one)
+        __m128i c32 = _mm_mullo_epi16(sa, opacity32);
+        c32 = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(c32, one32), _mm_srli_epi32(c32, 8)), 8);
+        c32 = _mm_or_si128(c32, _mm_slli_epi32(c32, 8));
+        c = _mm_or_si128(c32, _mm_slli_epi32(c32, 16));
+        break;
+      }
+      default:
+        draw = zero;
+        c = zero;
+    }
+    if (options.dest_alpha_filter >= 0) {
+      draw = _mm_and_si128(draw, _mm_cmpeq_epi32(_mm_and_si128(d, alpha_mask), filter));
+    }
+    uint32_t draw_mask = _mm_movemask_epi8(draw);
+    if (draw_mask == 0) {
+      continue;
+    }
+
+    __m128i result;
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(c, all_ones)) == 0xFFFF) {
+      result = s;
+    } else {
+      __m128i lo = blend_half(_mm_unpacklo_epi8(s, zero),
+          _mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(c, zero));
+      __m128i hi = blend_half(_mm_unpackhi_epi8(s, zero),
+          _mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(c, zero));
+      result = _mm_packus_epi16(lo, hi);
+    }
+    if (options.output_alpha >= 0) {
+      result = _mm_or_si128(_mm_andnot_si128(alpha_mask, result), output_alpha);
+    }
+    if (draw_mask != 0xFFFF) {
+      result = _mm_or_si128(_mm_and_si128(draw, result), _mm_andnot_si128(draw, d));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + z * 4), result);
+  }
+
+#elif defined(BLITTER_USE_NEON)
+  const uint32x4_t zero = vdupq_n_u32(0);
+  const uint32x4_t all_ones = vdupq_n_u32(0xFFFFFFFF);
+  const uint32x4_t alpha_mask = vdupq_n_u32(0xFF000000);
+  const uint32x4_t rgb_mask = vdupq_n_u32(0x00FFFFFF);
+  const uint32x4_t transparent = vdupq_n_u32(transparent_value);
+  const uint32x4_t filter = vdupq_n_u32(filter_value);
+  const uint32x4_t output_alpha = vdupq_n_u32(output_alpha_value);
+  const uint16x8_t one16 = vdupq_n_u16(1);
+  auto blend_half = [&](uint8x8_t s, uint8x8_t d, uint8x8_t c) -> uint8x8_t {
+    uint16x8_t x = vmlal_u8(vmull_u8(s, c), d, vmvn_u8(c));
+    return vmovn_u16(vshrq_n_u16(vaddq_u16(vaddq_u16(x, one16), vshrq_n_u16(x, 8)), 8));
+  };
+
+  for (; z + 4 <= count; z += 4) {
+    uint8x16_t s8 = vld1q_u8(src + z * 4);
+    uint8x16_t d8 = vld1q_u8(dest + z * 4);
+    uint32x4_t s = vreinterpretq_u32_u8(s8);
+    uint32x4_t d = vreinterpretq_u32_u8(d8);
+
+    uint32x4_t draw;
+    uint8x16_t c;
+    switch (options.mode) {
+      case BlitMode::OPAQUE:
+        draw = all_ones;
+        c = vdupq_n_u8(0xFF);
+        break;
+      case BlitMode::MASKED:
+        draw = vmvnq_u32(vceqq_u32(vandq_u32(s, rgb_mask), transparent));
+        c = vdupq_n_u8(options.opacity);
+        break;
+      case BlitMode::ALPHA: {
+        uint32x4_t sa = vshrq_n_u32(s, 24);
+        draw = vmvnq_u32(vceqq_u32(sa, zero));
+        uint32x4_t c32 = vmulq_n_u32(sa, options.opacity);
+        c32 = vshrq_n_u32(vaddq_u32(vaddq_u32(c32, vdupq_n_u32(1)), vshrq_n_u32(c32, 8)), 8);
+        c = vreinterpretq_u8_u32(vmulq_n_u32(c32, 0x01010101));
+        break;
+      }
+      default:
+        draw = zero;
+        c = vdupq_n_u8(0);
+    }
+    if (options.dest_alpha_filter >= 0) {
+      draw = vandq_u32(draw, vceqq_u32(vandq_u32(d, alpha_mask), filter));
+    }
+
+    uint8x16_t result = vcombine_u8(
+        blend_half(vget_low_u8(s8), vget_low_u8(d8), vget_low_u8(c)),
+        blend_half(vget_high_u8(s8), vget_high_u8(d8), vget_high_u8(c)));
+    if (options.output_alpha >= 0) {
+      result = vreinterpretq_u8_u32(vorrq_u32(
+          vandq_u32(vreinterpretq_u32_u8(result), rgb_mask), output_alpha));
+    }
+    vst1q_u8(dest + z * 4, vbslq_u8(vreinterpretq_u8_u32(draw), result, d8));
+  }
+#else
+  (void)transparent_value;
+  (void)filter_value;
+  (void)output_alpha_value;
+#endif
+
+  for (; z < count; z++) {
+    blit_pixel(dest + z * 4, src + z * 4, options);
+  }
+}
+
+void blend_bytes_with_coverage(uint8_t* dest, const uint8_t* src,
+    const uint8_t* coverage, size_t size) {
+  size_t offset = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi8(static_cast<char>(0xFF));
+  const __m128i max16 = _mm_set1_epi16(0xFF);
+  const __m128i round16 = _mm_set1_epi16(0x80);
+  auto blend_half = [&](__m128i s, __m128i d, __m128i c) -> __m128i {
+    __m128i x = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(s, c),
+          _mm_mullo_epi16(d, _mm_sub_epi16(max16, c))),
+        round16);
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+  };
+  for (; offset + 16 <= size; offset += 16) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(coverage + offset));
+    // Most pixels in masked tiles are either fully drawn or not drawn at all,
+    // so skip the arithmetic when an entire block is one or the other
+    uint32_t full_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(c, full));
+    if (full_mask == 0xFFFF) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + offset),
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + offset)));
+      continue;
+    }
+    uint32_t empty_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(c, zero));
+    if (empty_mask == 0xFFFF) {
+      continue;
+    }
+
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + offset));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest + offset));
+    __m128i lo = blend_half(_mm_unpacklo_epi8(s, zero),
+        _mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(c, zero));
+    __m128i hi = blend_half(_mm_unpackhi_epi8(s, zero),
+        _mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(c, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + offset),
+        _mm_packus_epi16(lo, hi));
+  }
+
+#elif defined(BLITTER_USE_NEON)
+  const uint16x8_t round16 = vdupq_n_u16(0x80);
+  auto blend_half = [&](uint8x8_t s, uint8x8_t d, uint8x8_t c) -> uint8x8_t {
+    uint16x8_t x = vaddq_u16(vmlal_u8(vmull_u8(s, c), d, vmvn_u8(c)), round16);
+    return vmovn_u16(vshrq_n_u16(vaddq_u16(x, vshrq_n_u16(x, 8)), 8));
+  };
+  for (; offset + 16 <= size; offset += 16) {
+    uint8x16_t c = vld1q_u8(coverage + offset);
+    uint8x16_t s = vld1q_u8(src + offset);
+    uint8x16_t d = vld1q_u8(dest + offset);
+    vst1q_u8(dest + offset, vcombine_u8(
+        blend_half(vget_low_u8(s), vget_low_u8(d), vget_low_u8(c)),
+        blend_half(vget_high_u8(s), vget_high_u8(d), vget_high_u8(c))));
+  }
+#endif
+
+  for (; offset < size; offset++) {
+    uint8_t c = coverage[offset];
+    if (c == 0xFF) {
+      dest[offset] = src[offset];
+    } else if (c != 0) {
+      uint32_t x = src[offset] * c + dest[offset] * (0xFF - c) + 0x80;
+      dest[offset] = (x + (x >> 8)) >> 8;
+    }
+  }
+}
+
+
+
+void blit_pixels(Image& dest, const Image& source, ssize_t x, ssize_t y,
+    ssize_t w, ssize_t h, ssize_t sx, ssize_t sy, const BlitOptions& options) {
+  // Clip to both images
+  if (x < 0) {
+    sx -= x;
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    sy -= y;
+    h += y;
+    y = 0;
+  }
+  if (sx < 0) {
+    x -= sx;
+    w += sx;
+    sx = 0;
+  }
+  if (sy < 0) {
+    y -= sy;
+    h += sy;
+    sy = 0;
+  }
+  ssize_t dest_w = dest.get_width();
+  ssize_t dest_h = dest.get_height();
+  ssize_t source_w = source.get_width();
+  ssize_t source_h = source.get_height();
+  w = min<ssize_t>(w, min<ssize_t>(dest_w - x, source_w - sx));
+  h = min<ssize_t>(h, min<ssize_t>(dest_h - y, source_h - sy));
+  if ((w <= 0) || (h <= 0)) {
+    return;
+  }
+
+  bool dest_has_alpha = dest.get_has_alpha();
+  bool source_has_alpha = source.get_has_alpha();
+  size_t dest_channels = dest_has_alpha ? 4 : 3;
+  size_t source_channels = source_has_alpha ? 4 : 3;
+  uint8_t* dest_data = reinterpret_cast<uint8_t*>(dest.get_data());
+  const uint8_t* source_data = reinterpret_cast<const uint8_t*>(source.get_data());
+
+  // Opaque copies between images with the same format are just memcpys; the
+  // alpha filter and alpha override need to look at each pixel
+  bool is_plain_copy = (options.mode == BlitMode::OPAQUE) &&
+      (options.dest_alpha_filter < 0) && (options.output_alpha < 0) &&
+      (dest_has_alpha == source_has_alpha);
+
+  // Rows in images without alpha are converted to RGBA and back, so the row
+  // functions only have to handle one format
+  vector<uint8_t> source_row;
+  vector<uint8_t> dest_row;
+  if (!is_plain_copy) {
+    if (!source_has_alpha) {
+      source_row.resize(w * 4);
+    }
+    if (!dest_has_alpha) {
+      dest_row.resize(w * 4);
+    }
+  }
+
+  for (ssize_t yy = 0; yy < h; yy++) {
+    uint8_t* dest_ptr = dest_data + ((y + yy) * dest_w + x) * dest_channels;
+    const uint8_t* source_ptr = source_data + ((sy + yy) * source_w + sx) * source_channels;
+    if (is_plain_copy) {
+      memcpy(dest_ptr, source_ptr, w * dest_channels);
+      continue;
+    }
+
+    const uint8_t* source_rgba = source_ptr;
+    if (!source_has_alpha) {
+      for (ssize_t xx = 0; xx < w; xx++) {
+        memcpy(&source_row[xx * 4], source_ptr + xx * 3, 3);
+        source_row[xx * 4 + 3] = 0xFF;
+      }
+      source_rgba = source_row.data();
+    }
+    uint8_t* dest_rgba = dest_ptr;
+    if (!dest_has_alpha) {
+      for (ssize_t xx = 0; xx < w; xx++) {
+        memcpy(&dest_row[xx * 4], dest_ptr + xx * 3, 3);
+        dest_row[xx * 4 + 3] = 0xFF;
+      }
+      dest_rgba = dest_row.data();
+    }
+
+    blit_pixel_row(dest_rgba, source_rgba, w, options);
+
+    if (!dest_has_alpha) {
+      for (ssize_t xx = 0; xx < w; xx++) {
+        memcpy(dest_ptr + xx * 3, &dest_row[xx * 4], 3);
+      }
+    }
+  }
+}
@@ -0,0 +1,181 @@
+#include "DecodeStats.hh"
+
+#include <phosg/JSON.hh>
+#include <phosg/Strings.hh>
+
+#include "ResourceFile.hh"
+
+using namespace std;
+
+
+
+void DecodeStats::record_decode(uint32_t type, bool success, uint64_t usecs,
+    size_t input_bytes) {
+  lock_guard<mutex> g(this->lock);
+  auto& totals = this->decodes[type];
+  totals.count++;
+  if (!success) {
+    totals.failures++;
+  }
+  totals.usecs += usecs;
+  totals.input_bytes += input_bytes;
+}
+
+void DecodeStats::record_decompression(const string& implementation,
+    bool success, uint64_t usecs, uint64_t emulated_cycles, size_t input_bytes,
+    size_t output_bytes) {
+  lock_guard<mutex> g(this->lock);
+  auto& totals = this->decompressions[implementation];
+  totals.count++;
+  if (success) {
+    totals.output_bytes += output_bytes;
+  } else {
+    totals.failures++;
+  }
+  totals.usecs += usecs;
+  totals.emulated_cycles += emulated_cycles;
+  totals.input_bytes += input_bytes;
+}
+
+void DecodeStats::record_cache_lookups(const string& cache_name, size_t hits,
+    size_t misses) {
+  lock_guard<mutex> g(this->lock);
+  auto& totals = this->caches[cache_name];
+  totals.hits += hits;
+  totals.misses += misses;
+}
+
+void DecodeStats::record_output(size_t bytes) {
+  lock_guard<mutex> g(this->lock);
+  this->output_files++;
+  this->output_bytes += bytes;
+}
+
+void DecodeStats::record_stage(const string& stage, uint64_t usecs) {
+  lock_guard<mutex> g(this->lock);
+  auto& totals = this->stages[stage];
+  totals.count++;
+  totals.usecs += usecs;
+}
+
+void DecodeStats::set_memory_totals(const MemoryTotals& totals) {
+  lock_guard<mutex> g(this->lock);
+  this->memory = totals;
+}
+
+map<uint32_t, DecodeStats::DecodeTotals> DecodeStats::decode_totals() const {
+  lock_guard<mutex> g(this->lock);
+  return this->decodes;
+}
+
+map<string, DecodeStats::DecompressionTotals> DecodeStats::decompression_totals() const {
+  lock_guard<mutex> g(this->lock);
+  return this->decompressions;
+}
+
+map<string, DecodeStats::CacheTotals> DecodeStats::cache_totals() const {
+  lock_guard<mutex> g(this->lock);
+  return this->caches;
+}
+
+size_t DecodeStats::output_file_count() const {
+  lock_guard<mutex> g(this->lock);
+  return this->output_files;
+}
+
+size_t DecodeStats::output_byte_count() const {
+  lock_guard<mutex> g(this->lock);
+  return this->output_bytes;
+}
+
+map<string, DecodeStats::StageTotals> DecodeStats::stage_totals() const {
+  lock_guard<mutex> g(this->lock);
+  return this->stages;
+}
+
+DecodeStats::MemoryTotals DecodeStats::memory_totals() const {
+  lock_guard<mutex> g(this->lock);
+  return this->memory;
+}
+
+static JSONObject* json_int(uint64_t v) {
+  return new JSONObject(static_cast<int64_t>(v));
+}
+
+string DecodeStats::json() const {
+  lock_guard<mutex> g(this->lock);
+
+  JSONObject::dict_type decode_dict;
+  for (const auto& it : this->decodes) {
+    JSONObject::dict_type d;
+    d.emplace("count", json_int(it.second.count));
+    d.emplace("failures", json_int(it.second.failures));
+    d.emplace("usecs", json_int(it.second.usecs));
+    d.emplace("input_bytes", json_int(it.second.input_bytes));
+    decode_dict.emplace(string_for_resource_type(it.first), new JSONObject(move(d)));
+  }
+
+  JSONObject::dict_type decompression_dict;
+  for (const auto& it : this->decompressions) {
+    JSONObject::dict_type d;
+    d.emplace("count", json_int(it.second.count));
+    d.emplace("failures", json_int(it.second.failures));
+    d.emplace("usecs", json_int(it.second.usecs));
+    d.emplace("emulated_cycles", json_int(it.second.emulated_cycles));
+    d.emplace("input_bytes", json_int(it.second.input_bytes));
+    d.emplace("output_bytes", json_int(it.second.output_bytes));
+    decompression_dict.emplace(it.first, new JSONObject(move(d)));
+  }
+
+  JSONObject::dict_type cache_dict;
+  for (const auto& it : this->caches) {
+    JSONObject::dict_type d;
+    size_t total = it.second.hits + it.second.misses;
+    d.emplace("hits", json_int(it.second.hits));
+    d.emplace("misses", json_int(it.second.misses));
+    d.emplace("hit_rate", new JSONObject(total
+        ? (static_cast<double>(it.second.hits) / total) : 0.0));
+    cache_dict.emplace(it.first, new JSONObject(move(d)));
+  }
+
+  JSONObject::dict_type output_dict;
+  output_dict.emplace("files", json_int(this->output_files));
+  output_dict.emplace("bytes", json_int(this->output_bytes));
+
+  JSONObject::dict_type stage_dict;
+  for (const auto& it : this->stages) {
+    JSONObject::dict_type d;
+    d.emplace("count", json_int(it.second.count));
+    d.emplace("usecs", json_int(it.second.usecs));
+    stage_dict.emplace(it.first, new JSONObject(move(d)));
+  }
+
+  JSONObject::dict_type memory_dict;
+  memory_dict.emplace("peak_rss_bytes", json_int(this->memory.peak_rss_bytes));
+  memory_dict.emplace("allocations", json_int(this->memory.allocations));
+  memory_dict.emplace("allocated_bytes", json_int(this->memory.allocated_bytes));
+
+  JSONObject::dict_type root;
+  root.emplace("decode", new JSONObject(move(decode_dict)));
+  root.emplace("decompression", new JSONObject(move(decompression_dict)));
+  root.emplace("caches", new JSONObject(move(cache_dict)));
+  root.emplace("output", new JSONObject(move(output_dict)));
+  root.emplace("stages", new JSONObject(move(stage_dict)));
+  root.emplace("memory", new JSONObject(move(memory_dict)));
+  return JSONObject(move(root)).format();
+}
+
+
+
+static shared_ptr<DecodeStats> global_decode_stats;
+static mutex global_decode_stats_lock;
+
+void set_decode_stats(shared_ptr<DecodeStats> stats) {
+  lock_guard<mutex> g(global_decode_stats_lock);
+  global_decode_stats = stats;
+}
+
+shared_ptr<DecodeStats> get_decode_stats() {
+  lock_guard<mutex> g(global_decode_stats_lock);
+  return global_decode_stats;
+}
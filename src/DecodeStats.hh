@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+
+
+// Collects counts, times, and byte totals for a batch of work: resources
+// decoded (by type), resources decompressed (by implementation), cache
+// lookups (by cache name), output files written, time spent in each stage of
+// processing (by stage name), and the process's memory usage. All functions
+// are thread-safe. Times are in microseconds.
+class DecodeStats {
+public:
+  struct DecodeTotals {
+    size_t count = 0;
+    size_t failures = 0;
+    uint64_t usecs = 0;
+    size_t input_bytes = 0;
+  };
+  struct DecompressionTotals {
+    size_t count = 0;
+    size_t failures = 0;
+    uint64_t usecs = 0;
+    uint64_t emulated_cycles = 0; // Zero for internal implementations
+    size_t input_bytes = 0;
+    size_t output_bytes = 0;
+  };
+  struct CacheTotals {
+    size_t hits = 0;
+    size_t misses = 0;
+  };
+  struct StageTotals {
+    size_t count = 0;
+    uint64_t usecs = 0;
+  };
+  struct MemoryTotals {
+    uint64_t peak_rss_bytes = 0;
+    uint64_t allocations = 0; // Zero if allocations weren't counted
+    uint64_t allocated_bytes = 0;
+  };
+
+  DecodeStats() = default;
+  DecodeStats(const DecodeStats&) = delete;
+  DecodeStats(DecodeStats&&) = delete;
+  DecodeStats& operator=(const DecodeStats&) = delete;
+  DecodeStats& operator=(DecodeStats&&) = delete;
+  ~DecodeStats() = default;
+
+  void record_decode(uint32_t type, bool success, uint64_t usecs,
+      size_t input_bytes);
+  // implementation describes what did the decompression, e.g. "internal:dcmp2"
+  // or "emulated:ncmp 128" (see decompress_resource). output_bytes is ignored
+  // if success is false.
+  void record_decompression(const std::string& implementation, bool success,
+      uint64_t usecs, uint64_t emulated_cycles, size_t input_bytes,
+      size_t output_bytes);
+  // Adds to the totals for the named cache. Caches that keep their own
+  // counters can add them all at once when the batch is done.
+  void record_cache_lookups(const std::string& cache_name, size_t hits,
+      size_t misses);
+  void record_output(size_t bytes);
+  // Adds to the total time of the named stage (e.g. "parse" or "encode").
+  // Stages may overlap each other if they run on different threads.
+  void record_stage(const std::string& stage, uint64_t usecs);
+  // Replaces the memory totals. This is generally called once, when the batch
+  // is done, since peak RSS can only be measured for the whole process.
+  void set_memory_totals(const MemoryTotals& totals);
+
+  std::map<uint32_t, DecodeTotals> decode_totals() const;
+  std::map<std::string, DecompressionTotals> decompression_totals() const;
+  std::map<std::string, CacheTotals> cache_totals() const;
+  size_t output_file_count() const;
+  size_t output_byte_count() const;
+  std::map<std::string, StageTotals> stage_totals() const;
+  MemoryTotals memory_totals() const;
+
+  // Returns all of the above as a JSON object. Resource types are keys in the
+  // "decode" dict, formatted with string_for_resource_type.
+  std::string json() const;
+
+private:
+  mutable std::mutex lock;
+  std::map<uint32_t, DecodeTotals> decodes;
+  std::map<std::string, DecompressionTotals> decompressions;
+  std::map<std::string, CacheTotals> caches;
+  std::map<std::string, StageTotals> stages;
+  MemoryTotals memory;
+  size_t output_files = 0;
+  size_t output_bytes = 0;
+};
+
+// Sets the collector that the library (currently decompress_resource) reports
+// to, or disables collection if stats is null. Like
+// set_decompression_result_cache, this may be called at any time, but stats
+// from decompressions already in progress go to the previous collector.
+void set_decode_stats(std::shared_ptr<DecodeStats> stats);
+std::shared_ptr<DecodeStats> get_decode_stats();
@@ -0,0 +1,126 @@
+#include "DecodedImageCache.hh"
+
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+using namespace std;
+
+
+
+DecodedImageCache::DecodedImageCache(size_t max_size)
+  : max_size(max_size), current_size(0), hits(0), misses(0) { }
+
+bool DecodedImageCache::Key::operator==(const Key& other) const {
+  return (this->rf == other.rf) && (this->type == other.type) &&
+      (this->id == other.id) && (this->variant == other.variant);
+}
+
+size_t DecodedImageCache::KeyHash::operator()(const Key& k) const {
+  size_t h = hash<const void*>()(k.rf);
+  h ^= ((static_cast<uint64_t>(k.type) << 32) | (static_cast<uint16_t>(k.id) << 16)) +
+      k.variant + 0x9E3779B97F4A7C15 + (h << 6) + (h >> 2);
+  return h;
+}
+
+size_t DecodedImageCache::size_for_image(const Image& img) {
+  return img.get_width() * img.get_height() * (img.get_has_alpha() ? 4 : 3);
+}
+
+shared_ptr<const Image> DecodedImageCache::get(const ResourceFile& rf,
+    uint32_t type, int16_t id, uint32_t variant,
+    const function<shared_ptr<const Image>()>& decode) {
+  Key key = {&rf, type, id, variant};
+  {
+    lock_guard<mutex> g(this->lock);
+    auto it = this->index.find(key);
+    if (it != this->index.end()) {
+      this->lru.splice(this->lru.begin(), this->lru, it->second);
+      this->hits++;
+      return it->second->image;
+    }
+    this->misses++;
+  }
+
+  shared_ptr<const Image> image = decode();
+  if (!image) {
+    return nullptr;
+  }
+
+  size_t entry_size = DecodedImageCache::size_for_image(*image);
+  if (entry_size > this->max_size) {
+    return image;
+  }
+
+  lock_guard<mutex> g(this->lock);
+  // Another thread may have decoded the same image while this one was; if so,
+  // use the existing one so all callers share the same copy
+  auto it = this->index.find(key);
+  if (it != this->index.end()) {
+    this->lru.splice(this->lru.begin(), this->lru, it->second);
+    return it->second->image;
+  }
+  while (!this->lru.empty() && (this->current_size + entry_size > this->max_size)) {
+    const auto& last = this->lru.back();
+    this->current_size -= last.size;
+    this->index.erase(last.key);
+    this->lru.pop_back();
+  }
+  this->lru.emplace_front(Entry{key, image, entry_size});
+  this->index.emplace(key, this->lru.begin());
+  this->current_size += entry_size;
+  return image;
+}
+
+shared_ptr<const Image> DecodedImageCache::get_PICT(ResourceFile& rf,
+    int16_t id, bool white_is_transparent) {
+  return this->get(rf, RESOURCE_TYPE_PICT, id, white_is_transparent ? 1 : 0,
+      [&]() -> shared_ptr<const Image> {
+    if (!rf.resource_exists(RESOURCE_TYPE_PICT, id)) {
+      return nullptr;
+    }
+    auto decode_result = rf.decode_PICT(id);
+    if (!decode_result.embedded_image_format.empty()) {
+      throw runtime_error(string_printf("PICT %hd is an embedded image", id));
+    }
+    if (white_is_transparent) {
+      decode_result.image.set_has_alpha(true);
+      decode_result.image.set_alpha_from_mask_color(0xFFFFFFFF);
+    }
+    return make_shared<Image>(move(decode_result.image));
+  });
+}
+
+void DecodedImageCache::erase(const ResourceFile& rf) {
+  lock_guard<mutex> g(this->lock);
+  for (auto it = this->lru.begin(); it != this->lru.end();) {
+    if (it->key.rf == &rf) {
+      this->current_size -= it->size;
+      this->index.erase(it->key);
+      it = this->lru.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+void DecodedImageCache::clear() {
+  lock_guard<mutex> g(this->lock);
+  this->index.clear();
+  this->lru.clear();
+  this->current_size = 0;
+}
+
+size_t DecodedImageCache::get_current_size() const {
+  lock_guard<mutex> g(this->lock);
+  return this->current_size;
+}
+
+size_t DecodedImageCache::hit_count() const {
+  lock_guard<mutex> g(this->lock);
+  return this->hits;
+}
+
+size_t DecodedImageCache::miss_count() const {
+  lock_guard<mutex> g(this->lock);
+  return this->misses;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <phosg/Image.hh>
+#include <unordered_map>
+
+#include "ResourceFile.hh"
+
+
+
+// Remembers images decoded from resources, so renderers that use the same
+// PICTs in many levels only decode each one once. Entries are keyed by the
+// ResourceFile they came from, the resource's type and ID, and a variant value
+// that distinguishes different images produced from the same resource (e.g. a
+// flipped or transparent version). Variants below FIRST_CALLER_VARIANT are
+// used by get_PICT; callers that produce their own variants should use values
+// at or above it. When the total size of the cached images would exceed
+// max_size, the least recently used entries are discarded. Callers may still
+// hold references to discarded images; they are freed when the last reference
+// goes away. This class is thread-safe.
+//
+// ResourceFiles are identified by address, so if a ResourceFile is destroyed
+// while the cache is still in use, call erase() with it first.
+class DecodedImageCache {
+public:
+  static constexpr size_t DEFAULT_MAX_SIZE = 512 * 1024 * 1024;
+  static constexpr uint32_t FIRST_CALLER_VARIANT = 0x100;
+
+  explicit DecodedImageCache(size_t max_size = DEFAULT_MAX_SIZE);
+  DecodedImageCache(const DecodedImageCache&) = delete;
+  DecodedImageCache(DecodedImageCache&&) = delete;
+  DecodedImageCache& operator=(const DecodedImageCache&) = delete;
+  DecodedImageCache& operator=(DecodedImageCache&&) = delete;
+  ~DecodedImageCache() = default;
+
+  // Returns the cached image for the given key, or calls decode to produce it
+  // if it isn't cached. decode is called without holding the cache's lock, so
+  // multiple threads can decode different images at the same time. If decode
+  // returns nullptr, nothing is cached and nullptr is returned.
+  std::shared_ptr<const Image> get(const ResourceFile& rf, uint32_t type,
+      int16_t id, uint32_t variant,
+      const std::function<std::shared_ptr<const Image>()>& decode);
+
+  // Returns the decoded PICT with the given ID, or nullptr if rf doesn't
+  // contain it. If white_is_transparent is true, the returned image has an
+  // alpha channel in which white pixels are transparent. Throws runtime_error
+  // if the PICT decodes to an embedded image (e.g. a JPEG) instead of pixels.
+  std::shared_ptr<const Image> get_PICT(ResourceFile& rf, int16_t id,
+      bool white_is_transparent = false);
+
+  // Discards all entries associated with rf.
+  void erase(const ResourceFile& rf);
+  void clear();
+
+  static size_t size_for_image(const Image& img);
+
+  inline size_t get_max_size() const {
+    return this->max_size;
+  }
+  size_t get_current_size() const;
+  size_t hit_count() const;
+  size_t miss_count() const;
+
+private:
+  struct Key {
+    const ResourceFile* rf;
+    uint32_t type;
+    int16_t id;
+    uint32_t variant;
+
+    bool operator==(const Key& other) const;
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const;
+  };
+  struct Entry {
+    Key key;
+    std::shared_ptr<const Image> image;
+    size_t size;
+  };
+
+  mutable std::mutex lock;
+  size_t max_size;
+  size_t current_size;
+  std::list<Entry> lru; // Most recently used first
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+  size_t hits;
+  size_t misses;
+};
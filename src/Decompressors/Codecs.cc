@@ -0,0 +1,458 @@
+#include "Codecs.hh"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <map>
+#include <mutex>
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+
+
+// Copies count bytes from distance bytes before out + w to out + w. The source
+// and destination overlap when distance < count; in that case the copy repeats
+// the last distance bytes, so it can't be done with a single memcpy.
+static inline void copy_backreference(uint8_t* out, size_t w, size_t distance,
+    size_t count) {
+  const uint8_t* src = out + w - distance;
+  uint8_t* dest = out + w;
+  if (distance >= count) {
+    memcpy(dest, src, count);
+  } else if (distance == 1) {
+    memset(dest, *src, count);
+  } else {
+    for (size_t z = 0; z < count; z++) {
+      dest[z] = src[z];
+    }
+  }
+}
+
+static void check_decompressed_size(size_t decompressed_size, size_t out_size,
+    size_t input_size, size_t max_ratio) {
+  if (decompressed_size != out_size) {
+    throw logic_error("output buffer size does not match decompressed size");
+  }
+  // This catches corrupt headers before a huge output buffer is allocated
+  if (decompressed_size > input_size * max_ratio) {
+    throw runtime_error("decompressed size is too large for the input data");
+  }
+}
+
+
+
+void decompress_flashback_lzss_into(void* vout, size_t out_size,
+    const void* data, size_t size) {
+  StringReader r(data, size);
+  // Each control byte is followed by at most 8 2-byte backreferences, which
+  // produce at most 18 bytes each
+  check_decompressed_size(r.get_u32b(), out_size, size, 9);
+
+  uint8_t* out = reinterpret_cast<uint8_t*>(vout);
+  size_t w = 0;
+  while (w < out_size) {
+    uint8_t control_bits = r.get_u8();
+    // Fast path for 8 literal bytes in a row, which is common in data that
+    // doesn't compress well
+    if ((control_bits == 0) && (out_size - w >= 8)) {
+      memcpy(out + w, r.getv(8), 8);
+      w += 8;
+      continue;
+    }
+    for (size_t x = 0; (x < 8) && (w < out_size); x++, control_bits >>= 1) {
+      if (control_bits & 1) {
+        uint16_t args = r.get_u16b();
+        size_t distance = (args & 0x0FFF) + 1;
+        size_t count = ((args >> 12) & 0x000F) + 3;
+        if (distance > w) {
+          throw runtime_error("backreference out of bounds");
+        }
+        // The last backreference may extend past the end of the output; the
+        // extra bytes are discarded
+        count = min<size_t>(count, out_size - w);
+        copy_backreference(out, w, distance, count);
+        w += count;
+      } else {
+        out[w++] = r.get_u8();
+      }
+    }
+  }
+}
+
+void decompress_macski_RUN4_into(void* vout, size_t out_size,
+    const void* data, size_t size) {
+  StringReader r(data, size);
+  if (r.get_u32b() != 0x52554E34) { // 'RUN4'
+    throw invalid_argument("data is not RUN4 compressed");
+  }
+  // The longest run is 255 bytes, from a 3-byte command
+  check_decompressed_size(r.get_u32b(), out_size, size, 128);
+
+  uint8_t repeat_3_command = r.get_u8();
+  uint8_t repeat_4_command = r.get_u8();
+  uint8_t repeat_5_command = r.get_u8();
+  uint8_t repeat_var_command = r.get_u8();
+
+  uint8_t* out = reinterpret_cast<uint8_t*>(vout);
+  size_t w = 0;
+  while (w < out_size) {
+    uint8_t command = r.get_u8();
+    size_t count;
+
+    if (command == repeat_3_command) {
+      count = 3;
+      command = r.get_u8();
+    } else if (command == repeat_4_command) {
+      count = 4;
+      command = r.get_u8();
+    } else if (command == repeat_5_command) {
+      count = 5;
+      command = r.get_u8();
+    } else if (command == repeat_var_command) {
+      count = r.get_u8();
+      command = r.get_u8();
+    } else {
+      out[w++] = command;
+      continue;
+    }
+
+    if (count > out_size - w) {
+      throw runtime_error("decompression produced too much data");
+    }
+    memset(out + w, command, count);
+    w += count;
+  }
+}
+
+void decompress_macski_COOK_CO2K_into(void* vout, size_t out_size,
+    const void* data, size_t size) {
+  StringReader r(data, size);
+  uint32_t type = r.get_u32b();
+  if ((type != 0x434F324B) && (type != 0x434F4F4B)) { // 'CO2K' or 'COOK'
+    throw invalid_argument("data is not COOK or CO2K compressed");
+  }
+  bool is_CO2K = (type == 0x434F324B);
+
+  // The longest backreference is 255 bytes, from a 2-byte command
+  check_decompressed_size(r.get_u32b(), out_size, size, 128);
+
+  uint8_t copy_3_command;
+  uint8_t copy_4_command;
+  uint8_t copy_5_command;
+  uint8_t copy_var_command;
+  uint8_t copy_4_command_far = 0;
+  uint8_t copy_5_command_far = 0;
+  uint8_t copy_command_far = 0;
+
+  if (is_CO2K) {
+    uint8_t version = r.get_u8();
+    if (version < 1) {
+      throw invalid_argument("version 0 is not valid");
+    }
+    if (version > 2) {
+      throw invalid_argument("versions beyond 2 not supported");
+    }
+
+    if (version <= 1) {
+      is_CO2K = false;
+    } else {
+      copy_command_far = r.get_u8();
+      copy_5_command_far = r.get_u8();
+      copy_4_command_far = r.get_u8();
+    }
+  }
+
+  copy_3_command = r.get_u8();
+  copy_4_command = r.get_u8();
+  copy_5_command = r.get_u8();
+  copy_var_command = r.get_u8();
+
+  if (!is_CO2K) {
+    copy_command_far = copy_5_command_far = copy_4_command_far = copy_var_command;
+  }
+
+  uint8_t* out = reinterpret_cast<uint8_t*>(vout);
+  size_t w = 0;
+  while (w < out_size) {
+    uint8_t command = r.get_u8();
+    size_t count;
+
+    if (command == copy_3_command) {
+      count = 3;
+
+    } else if ((command == copy_var_command) || (command == copy_command_far)) {
+      count = r.get_u8();
+
+    } else if (command == copy_4_command) {
+      count = 4;
+
+    } else if (command == copy_5_command) {
+      count = 5;
+
+    } else if (command == copy_4_command_far) {
+      if (r.get_u8(false) == 0) {
+        r.skip(1);
+        count = 0;
+      } else {
+        count = 4;
+      }
+
+    } else if (command == copy_5_command_far) {
+      if (r.get_u8(false) == 0) {
+        r.skip(1);
+        count = 0;
+      } else {
+        count = 5;
+      }
+
+    } else {
+      count = 0;
+    }
+
+    if (count == 0) {
+      out[w++] = command;
+      continue;
+    }
+
+    size_t distance = 0;
+    if (is_CO2K && ((command == copy_4_command_far) || (command == copy_5_command_far) || (command == copy_command_far))) {
+      distance = r.get_u8() << 8;
+    }
+    distance += r.get_u8();
+
+    if (distance == 0) {
+      out[w++] = command;
+      continue;
+    }
+    if (distance > w) {
+      throw runtime_error("backreference out of bounds");
+    }
+    if (count > out_size - w) {
+      throw runtime_error("decompression produced too much data");
+    }
+    copy_backreference(out, w, distance, count);
+    w += count;
+  }
+}
+
+
+
+static size_t system_decompressed_size(const CompressedResourceHeader* header,
+    const void*, size_t) {
+  if (!header) {
+    throw invalid_argument("system decompressors require a compressed resource header");
+  }
+  return header->decompressed_size;
+}
+
+static size_t flashback_lzss_decompressed_size(const CompressedResourceHeader*,
+    const void* data, size_t size) {
+  return StringReader(data, size).pget_u32b(0);
+}
+
+// RUN4, COOK, and CO2K all have the decompressed size right after the magic
+static size_t macski_decompressed_size(const CompressedResourceHeader*,
+    const void* data, size_t size) {
+  return StringReader(data, size).pget_u32b(4);
+}
+
+static void flashback_lzss_decompress_into(const CompressedResourceHeader*,
+    void* out, size_t out_size, const void* data, size_t size) {
+  decompress_flashback_lzss_into(out, out_size, data, size);
+}
+
+static void macski_RUN4_decompress_into(const CompressedResourceHeader*,
+    void* out, size_t out_size, const void* data, size_t size) {
+  decompress_macski_RUN4_into(out, out_size, data, size);
+}
+
+static void macski_COOK_CO2K_decompress_into(const CompressedResourceHeader*,
+    void* out, size_t out_size, const void* data, size_t size) {
+  decompress_macski_COOK_CO2K_into(out, out_size, data, size);
+}
+
+static const vector<DecompressionCodec> codecs({
+  {"dcmp0", 0, 0, &system_decompressed_size, nullptr, &decompress_system0},
+  {"dcmp1", 0, 1, &system_decompressed_size, nullptr, &decompress_system1},
+  {"dcmp2", 0, 2, &system_decompressed_size, nullptr, &decompress_system2},
+  {"dcmp3", 0, 3, &system_decompressed_size, nullptr, &decompress_system3},
+  {"run4", 0x52554E34, -1, &macski_decompressed_size, &macski_RUN4_decompress_into, nullptr},
+  {"cook", 0x434F4F4B, -1, &macski_decompressed_size, &macski_COOK_CO2K_decompress_into, nullptr},
+  {"co2k", 0x434F324B, -1, &macski_decompressed_size, &macski_COOK_CO2K_decompress_into, nullptr},
+  {"flashback-lzss", 0, -1, &flashback_lzss_decompressed_size, &flashback_lzss_decompress_into, nullptr},
+});
+
+const vector<DecompressionCodec>& all_decompression_codecs() {
+  return codecs;
+}
+
+const DecompressionCodec* find_codec(const string& name) {
+  for (const auto& codec : codecs) {
+    if (name == codec.name) {
+      return &codec;
+    }
+  }
+  return nullptr;
+}
+
+const DecompressionCodec* find_codec_for_dcmp(int16_t dcmp_id) {
+  if (dcmp_id < 0) {
+    return nullptr;
+  }
+  for (const auto& codec : codecs) {
+    if (codec.dcmp_id == dcmp_id) {
+      return &codec;
+    }
+  }
+  return nullptr;
+}
+
+const DecompressionCodec* find_codec_for_data(const void* data, size_t size) {
+  if (size < 4) {
+    return nullptr;
+  }
+  uint32_t magic = *reinterpret_cast<const be_uint32_t*>(data);
+  for (const auto& codec : codecs) {
+    if (codec.magic && (codec.magic == magic)) {
+      return &codec;
+    }
+  }
+  return nullptr;
+}
+
+string decompress_with_codec(const DecompressionCodec& codec,
+    const void* data, size_t size, const CompressedResourceHeader* header) {
+  if (!codec.decompress_into) {
+    if (!header) {
+      throw invalid_argument(string_printf(
+          "codec %s requires a compressed resource header", codec.name));
+    }
+    return codec.decompress(*header, data, size);
+  }
+  string ret(codec.decompressed_size(header, data, size), '\0');
+  codec.decompress_into(header, ret.data(), ret.size(), data, size);
+  return ret;
+}
+
+string decompress_with_detected_codecs(const void* data, size_t size) {
+  string ret;
+  while (const auto* codec = find_codec_for_data(data, size)) {
+    ret = decompress_with_codec(*codec, data, size);
+    data = ret.data();
+    size = ret.size();
+  }
+  if (data != ret.data()) {
+    ret.assign(reinterpret_cast<const char*>(data), size);
+  }
+  return ret;
+}
+
+
+
+uint64_t fingerprint_for_decompressor(const void* code, size_t size) {
+  // FNV-1a, since fingerprints are saved in files and must be the same across
+  // runs and platforms
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(code);
+  uint64_t hash = 0xCBF29CE484222325;
+  for (size_t z = 0; z < size; z++) {
+    hash = (hash ^ bytes[z]) * 0x00000100000001B3;
+  }
+  return hash ^ size;
+}
+
+struct FingerprintRegistry {
+  mutex lock;
+  bool system_decompressors_registered = false;
+  unordered_map<uint64_t, const DecompressionCodec*> fingerprint_to_codec;
+  map<uint64_t, size_t> hits;
+};
+
+static FingerprintRegistry fingerprint_registry;
+
+static void register_fingerprint_locked(uint64_t fingerprint,
+    const DecompressionCodec* codec) {
+  if (!codec || (codec->dcmp_id < 0)) {
+    throw invalid_argument("only dcmp codecs can be registered by fingerprint");
+  }
+  fingerprint_registry.fingerprint_to_codec[fingerprint] = codec;
+}
+
+// The system dcmps and ncmps are the reference implementations of the system
+// codecs, so applications that contain copies of them can use the codecs too.
+// These are loaded the first time any fingerprint is looked up, since
+// system_dcmps/ is relative to the working directory.
+static void register_system_decompressors_locked() {
+  if (fingerprint_registry.system_decompressors_registered) {
+    return;
+  }
+  fingerprint_registry.system_decompressors_registered = true;
+  for (const auto& codec : codecs) {
+    if (codec.dcmp_id < 0) {
+      continue;
+    }
+    for (char type_ch : {'d', 'n'}) {
+      try {
+        string code = load_file(string_printf("system_dcmps/%ccmp_%hd.bin",
+            type_ch, codec.dcmp_id));
+        register_fingerprint_locked(
+            fingerprint_for_decompressor(code.data(), code.size()), &codec);
+      } catch (const cannot_open_file&) { }
+    }
+  }
+}
+
+void register_decompressor_fingerprint(uint64_t fingerprint,
+    const DecompressionCodec* codec) {
+  lock_guard<mutex> g(fingerprint_registry.lock);
+  register_fingerprint_locked(fingerprint, codec);
+}
+
+const DecompressionCodec* find_codec_for_decompressor(const void* code,
+    size_t size, uint64_t* fingerprint) {
+  uint64_t fp = fingerprint_for_decompressor(code, size);
+  if (fingerprint) {
+    *fingerprint = fp;
+  }
+  lock_guard<mutex> g(fingerprint_registry.lock);
+  register_system_decompressors_locked();
+  auto it = fingerprint_registry.fingerprint_to_codec.find(fp);
+  return (it == fingerprint_registry.fingerprint_to_codec.end()) ? nullptr : it->second;
+}
+
+void record_decompressor_fingerprint_hit(uint64_t fingerprint) {
+  lock_guard<mutex> g(fingerprint_registry.lock);
+  fingerprint_registry.hits[fingerprint]++;
+}
+
+vector<pair<uint64_t, size_t>> decompressor_fingerprint_hits() {
+  lock_guard<mutex> g(fingerprint_registry.lock);
+  return vector<pair<uint64_t, size_t>>(
+      fingerprint_registry.hits.begin(), fingerprint_registry.hits.end());
+}
+
+void load_decompressor_fingerprints(const string& filename) {
+  string contents = load_file(filename);
+  size_t line_num = 0;
+  for (const auto& line : split(contents, '\n')) {
+    line_num++;
+    string stripped = line;
+    strip_whitespace(stripped);
+    if (stripped.empty() || (stripped[0] == '#')) {
+      continue;
+    }
+    auto tokens = split(stripped, ' ');
+    const DecompressionCodec* codec = (tokens.size() == 2) ? find_codec(tokens[1]) : nullptr;
+    if (!codec || (codec->dcmp_id < 0)) {
+      throw runtime_error(string_printf("%s:%zu: invalid fingerprint line", filename.c_str(), line_num));
+    }
+    uint64_t fingerprint = stoull(tokens[0], nullptr, 16);
+    register_decompressor_fingerprint(fingerprint, codec);
+  }
+}
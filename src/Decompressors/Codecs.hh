@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "System.hh"
+
+
+
+// Decompressors that are implemented natively (without emulating a dcmp or
+// ncmp resource). There are two kinds: system dcmps, which decompress the data
+// after a CompressedResourceHeader and are used by decompress_resource, and
+// application-specific formats like those used by MacSki and Flashback, which
+// have their own headers (or none) and are used as preprocessors.
+struct DecompressionCodec {
+  const char* name;
+  // If nonzero, data in this format begins with this big-endian value, so the
+  // codec can be chosen automatically (see find_codec_for_data)
+  uint32_t magic;
+  // If nonnegative, this codec implements the system dcmp with this ID
+  int16_t dcmp_id;
+
+  // Returns the size of the data that decompress_into will produce. header is
+  // null except for system dcmps, for which it's required.
+  size_t (*decompressed_size)(const CompressedResourceHeader* header,
+      const void* data, size_t size);
+  // Decompresses data into out, which is exactly the size returned by
+  // decompressed_size. Throws if the input is invalid or would produce more or
+  // less data than that. This is null for codecs that can only produce a
+  // string (via decompress), like the system dcmps.
+  void (*decompress_into)(const CompressedResourceHeader* header, void* out,
+      size_t out_size, const void* data, size_t size);
+  std::string (*decompress)(const CompressedResourceHeader& header,
+      const void* data, size_t size);
+};
+
+const std::vector<DecompressionCodec>& all_decompression_codecs();
+// These return null if there's no matching codec.
+const DecompressionCodec* find_codec(const std::string& name);
+const DecompressionCodec* find_codec_for_dcmp(int16_t dcmp_id);
+const DecompressionCodec* find_codec_for_data(const void* data, size_t size);
+
+// Decompresses data with the given codec. The output buffer is allocated at
+// its final size before decompression begins. header is required for system
+// dcmps and ignored for other codecs.
+std::string decompress_with_codec(const DecompressionCodec& codec,
+    const void* data, size_t size,
+    const CompressedResourceHeader* header = nullptr);
+// Decompresses data repeatedly, as long as it begins with the magic value of
+// one of the codecs. Data that doesn't begin with any codec's magic value is
+// returned unchanged.
+std::string decompress_with_detected_codecs(const void* data, size_t size);
+
+// Many applications contain their own copies of common dcmp and ncmp
+// resources, which would otherwise have to be emulated. These functions map a
+// fingerprint of a decompressor's code to a codec that implements the same
+// algorithm natively; decompress_resource uses the codec instead of emulating
+// the decompressor when the fingerprint is known. The system dcmps and ncmps
+// in system_dcmps/ (if present) are registered automatically as the system
+// codecs. Only codecs with a dcmp_id can be registered, since the others don't
+// decompress data that has a CompressedResourceHeader. These functions are
+// thread-safe.
+uint64_t fingerprint_for_decompressor(const void* code, size_t size);
+void register_decompressor_fingerprint(uint64_t fingerprint,
+    const DecompressionCodec* codec);
+// Returns null if the decompressor's fingerprint isn't registered. If
+// fingerprint is not null, it's set to the decompressor's fingerprint either
+// way.
+const DecompressionCodec* find_codec_for_decompressor(const void* code,
+    size_t size, uint64_t* fingerprint = nullptr);
+// decompress_resource calls this each time it uses a codec found by
+// fingerprint. decompressor_fingerprint_hits returns the number of times this
+// was called for each fingerprint, sorted by fingerprint.
+void record_decompressor_fingerprint_hit(uint64_t fingerprint);
+std::vector<std::pair<uint64_t, size_t>> decompressor_fingerprint_hits();
+// Reads fingerprints from a text file, with one "FINGERPRINT CODEC" pair per
+// line (e.g. "0123456789ABCDEF dcmp2"), and registers them. Blank lines and
+// lines beginning with # are ignored. Throws runtime_error if any line is
+// invalid.
+void load_decompressor_fingerprints(const std::string& filename);
+
+// Application-specific formats. Each of these data buffers includes the
+// format's header.
+void decompress_flashback_lzss_into(void* out, size_t out_size,
+    const void* data, size_t size);
+void decompress_macski_RUN4_into(void* out, size_t out_size,
+    const void* data, size_t size);
+void decompress_macski_COOK_CO2K_into(void* out, size_t out_size,
+    const void* data, size_t size);
@@ -1,6 +1,7 @@
 #include "System.hh"
 
 #include <stdint.h>
+#include <string.h>
 
 #include <phosg/Strings.hh>
 #include <stdexcept>
@@ -72,15 +73,50 @@ static uint32_t read_encoded_int(StringReader& r) {
   return (ret & 0x4000) ? (ret | 0xFFFF8000) : ret;
 }
 
+// Output is built directly in a std::string rather than through StringWriter,
+// so runs and memoized strings can be written with a single resize and copy
+static inline void put_u16b(string& w, uint16_t v) {
+  w.push_back(v >> 8);
+  w.push_back(v & 0xFF);
+}
+
+static inline void put_u32b(string& w, uint32_t v) {
+  put_u16b(w, v >> 16);
+  put_u16b(w, v & 0xFFFF);
+}
+
+static inline void write_raw(string& w, StringReader& r, size_t size) {
+  w.append(reinterpret_cast<const char*>(r.getv(size)), size);
+}
+
+// Memoized strings are always copies of earlier parts of the output, so we
+// refer to them by offset instead of storing a copy of each one
+struct MemoString {
+  size_t offset;
+  size_t size;
+};
+
+static inline void write_raw_memoized(
+    string& w, StringReader& r, size_t size, vector<MemoString>& memo) {
+  memo.emplace_back(MemoString{w.size(), size});
+  write_raw(w, r, size);
+}
+
+static inline void write_memo(string& w, const MemoString& m) {
+  size_t offset = w.size();
+  w.resize(offset + m.size);
+  memcpy(w.data() + offset, w.data() + m.offset, m.size);
+}
+
 string decompress_system01(
     const CompressedResourceHeader& header,
     const void* source,
     size_t size,
     bool is_system1) {
   StringReader r(source, size);
-  StringWriter w;
+  string w;
   // Allocate an extra byte (see comment at the end for why)
-  w.str().reserve(header.decompressed_size + 1);
+  w.reserve(header.decompressed_size + 1);
 
   // In the original code, the working buffer is formatted like this:
   // uint16_t offset_offset; // offset to the next slot in the buffer (4 at start)
@@ -96,8 +132,9 @@ string decompress_system01(
   //
   // length[x] is string_start_offset[x] - string_start_offset[x + 1]
   //
-  // We replace this with a vector<string>, since that's what it really is.
-  vector<string> memo;
+  // We replace this with a vector of output ranges, since that's what it
+  // really is.
+  vector<MemoString> memo;
 
   // Note: Why do we & 0xFFFF in a bunch of places? The original code uses the
   // dbf instruction, which operates only on the lower 16 bits of the register
@@ -105,7 +142,7 @@ string decompress_system01(
   // garbage data in the high 16 bits of a 32-bit count field! To use the
   // correct count, we have to mask out the high bits.
 
-  auto execute_extension_command = +[](StringReader& r, StringWriter& w) {
+  auto execute_extension_command = +[](StringReader& r, string& w) {
     switch (r.get_u8()) {
       case 0: { // <segnum> <count-1> <index>... - export table
         uint16_t index = 6;
@@ -113,14 +150,14 @@ string decompress_system01(
         uint32_t count = read_encoded_int(r) & 0xFFFF;
         for (uint32_t x = 0; x < count; x++) {
           index += (read_encoded_int(r) - 6);
-          w.put_u16b(0x3F3C);
-          w.put_u16b(segment_num);
-          w.put_u16b(0xA9F0);
-          w.put_u16b(index);
+          put_u16b(w, 0x3F3C);
+          put_u16b(w, segment_num);
+          put_u16b(w, 0xA9F0);
+          put_u16b(w, index);
         }
-        w.put_u16b(0x3F3C);
-        w.put_u16b(segment_num);
-        w.put_u16b(0xA9F0);
+        put_u16b(w, 0x3F3C);
+        put_u16b(w, segment_num);
+        put_u16b(w, 0xA9F0);
         break;
       }
 
@@ -139,26 +176,28 @@ string decompress_system01(
               a5_offset += a5_offset_delta;
             }
           }
-          w.put_u16b(0x6100);
-          w.put_u16b(target_offset);
-          w.put_u16b(0x4EED);
-          w.put_u16b(a5_offset);
+          put_u16b(w, 0x6100);
+          put_u16b(w, target_offset);
+          put_u16b(w, 0x4EED);
+          put_u16b(w, a5_offset);
         }
         break;
       }
 
       case 2: { // <value> <count> - run-length encoded bytes
         uint8_t v = read_encoded_int(r);
-        for (uint32_t count = (read_encoded_int(r) & 0xFFFF) + 1; count; count--) {
-          w.put_u8(v);
-        }
+        w.append((read_encoded_int(r) & 0xFFFF) + 1, v);
         break;
       }
 
       case 3: { // <value> <count> - run-length encoded words
         uint16_t v = read_encoded_int(r);
-        for (uint32_t count = (read_encoded_int(r) & 0xFFFF) + 1; count; count--) {
-          w.put_u16b(v);
+        uint32_t count = (read_encoded_int(r) & 0xFFFF) + 1;
+        size_t offset = w.size();
+        w.resize(offset + count * 2);
+        for (uint32_t x = 0; x < count; x++) {
+          w[offset + 2 * x] = v >> 8;
+          w[offset + 2 * x + 1] = v & 0xFF;
         }
         break;
       }
@@ -174,7 +213,7 @@ string decompress_system01(
             }
             v += delta;
           }
-          w.put_u16b(v);
+          put_u16b(w, v);
         }
         break;
       }
@@ -186,7 +225,7 @@ string decompress_system01(
           if (x) {
             v += read_encoded_int(r);
           }
-          w.put_u16b(v);
+          put_u16b(w, v);
         }
         break;
       }
@@ -198,7 +237,7 @@ string decompress_system01(
           if (x) {
             v += read_encoded_int(r);
           }
-          w.put_u32b(v);
+          put_u32b(w, v);
         }
         break;
       }
@@ -209,25 +248,23 @@ string decompress_system01(
     for (;;) {
       uint8_t command = r.get_u8();
       if (command < 0x10) { // <data> - raw data (fixed size)
-        w.write(r.read(command + 1));
+        write_raw(w, r, command + 1);
       } else if (command < 0x20) { // <data> - raw data (fixed size), memoize
-        memo.emplace_back(r.read(command - 0x0F));
-        w.write(memo.back());
+        write_raw_memoized(w, r, command - 0x0F, memo);
       } else if (command < 0xD0) { // write memo string, fixed slot
-        w.write(memo.at(command - 0x20));
+        write_memo(w, memo.at(command - 0x20));
       } else if (command == 0xD0) { // <size> <data> - raw data
-        w.write(r.read(read_encoded_int(r)));
+        write_raw(w, r, read_encoded_int(r));
       } else if (command == 0xD1) { // <size> <data> - raw data, memoize
-        memo.emplace_back(r.read(read_encoded_int(r)));
-        w.write(memo.back());
+        write_raw_memoized(w, r, read_encoded_int(r), memo);
       } else if (command == 0xD2) { // <slot8> - write memo string, slot + 0xB0
-        w.write(memo.at(r.get_u8() + 0xB0));
+        write_memo(w, memo.at(r.get_u8() + 0xB0));
       } else if (command == 0xD3) { // <slot8> - write memo string, slot + 0x1B0
-        w.write(memo.at(r.get_u8() + 0x1B0));
+        write_memo(w, memo.at(r.get_u8() + 0x1B0));
       } else if (command == 0xD4) { // <slot16> - write memo string, slot + 0xB0
-        w.write(memo.at(r.get_u16b() + 0xB0));
+        write_memo(w, memo.at(r.get_u16b() + 0xB0));
       } else if (command < 0xFE) { // write const word
-        w.put_u16b(const_table1.at(command - 0xD5));
+        put_u16b(w, const_table1.at(command - 0xD5));
       } else if (command == 0xFE) { // extensions
         execute_extension_command(r, w);
       } else if (command == 0xFF) { // end of stream
@@ -240,25 +277,23 @@ string decompress_system01(
     for (;;) {
       uint8_t command = r.get_u8();
       if (command == 0) { // <size> <data> - raw data; size is in words
-        w.write(r.read(read_encoded_int(r) * 2));
+        write_raw(w, r, read_encoded_int(r) * 2);
       } else if (command < 0x10) { // <data> - raw data (fixed size)
-        w.write(r.read(command * 2));
+        write_raw(w, r, command * 2);
       } else if (command == 0x10) { // <size16> <data> - raw data, memoize
-        memo.emplace_back(r.read(read_encoded_int(r) * 2));
-        w.write(memo.back());
+        write_raw_memoized(w, r, read_encoded_int(r) * 2, memo);
       } else if (command < 0x20) { // <data> - raw data (fixed size), memoize
-        memo.emplace_back(r.read((command - 0x10) * 2));
-        w.write(memo.back());
+        write_raw_memoized(w, r, (command - 0x10) * 2, memo);
       } else if (command == 0x20) { // <slot8> - write memo string, slot + 0x28
-        w.write(memo.at(r.get_u8() + 0x28));
+        write_memo(w, memo.at(r.get_u8() + 0x28));
       } else if (command == 0x21) { // <slot8> - write memo string, slot + 0x128
-        w.write(memo.at(r.get_u8() + 0x128));
+        write_memo(w, memo.at(r.get_u8() + 0x128));
       } else if (command == 0x22) { // <slot16> - write memo string, slot + 0x28
-        w.write(memo.at(r.get_u16b() + 0x28));
+        write_memo(w, memo.at(r.get_u16b() + 0x28));
       } else if (command < 0x4B) { // write memo string, fixed slot
-        w.write(memo.at(command - 0x23));
+        write_memo(w, memo.at(command - 0x23));
       } else if (command < 0xFE) { // write const word
-        w.put_u16b(const_table0.at(command - 0x4B));
+        put_u16b(w, const_table0.at(command - 0x4B));
       } else if (command == 0xFE) { // extensions
         execute_extension_command(r, w);
       } else if (command == 0xFF) { // end of stream
@@ -275,11 +310,11 @@ string decompress_system01(
   // probably technically a buffer overflow on actual classic Mac systems,
   // unless the Resource Manager explicitly allocates extra space for
   // decompression buffers. We just trim off the excess.
-  if (w.str().size() > header.decompressed_size) {
-    w.str().resize(header.decompressed_size);
+  if (w.size() > header.decompressed_size) {
+    w.resize(header.decompressed_size);
   }
 
-  return w.str();
+  return w;
 }
 
 string decompress_system0(
@@ -1,7 +1,9 @@
 #include "System.hh"
 
 #include <stdint.h>
+#include <string.h>
 
+#include <phosg/Encoding.hh>
 #include <phosg/Strings.hh>
 #include <stdexcept>
 #include <string>
@@ -65,11 +67,11 @@ string decompress_system2(
     const void* source,
     size_t size) {
   StringReader r(source, size);
-  StringWriter w;
-  w.str().reserve(header.decompressed_size);
 
-  vector<uint16_t> custom_const_words;
-  const vector<uint16_t>* const_words;
+  // Build a table of the const words in big-endian order, so each one can be
+  // copied directly to the output. Entries past num_const_words are invalid.
+  be_uint16_t const_words[0x100];
+  size_t num_const_words;
   if (header.version.v9.param2 & 1) {
     // The original implementation copies the const words into the decompressor
     // itself! They probably did this because the table could be shorter than
@@ -79,43 +81,64 @@ string decompress_system2(
     // could technically refer to parts of a previous one's const words table,
     // depending on the order in which they were decompressed. We don't support
     // such behavior here, of course.
-    size_t num_const_words = header.version.v9.param1 + 1;
-    while (custom_const_words.size() < num_const_words) {
-      custom_const_words.emplace_back(r.get_u16b());
+    num_const_words = header.version.v9.param1 + 1;
+    for (size_t z = 0; z < num_const_words; z++) {
+      const_words[z] = r.get_u16b();
     }
-    const_words = &custom_const_words;
   } else {
-    const_words = &default_const_words;
+    num_const_words = default_const_words.size();
+    for (size_t z = 0; z < num_const_words; z++) {
+      const_words[z] = default_const_words[z];
+    }
   }
 
+  // The output is presized, so the loops below just fill it in. The number of
+  // words written is determined by the same condition the original loop used
+  // (continue while the output is shorter than half the decompressed size).
+  size_t num_words = ((header.decompressed_size >> 1) + 1) >> 1;
+  string ret(num_words * 2 + (header.decompressed_size & 1), '\0');
+  uint8_t* out = reinterpret_cast<uint8_t*>(ret.data());
+
   if (header.version.v9.param2 & 2) {
     // Result is not composed entirely of const words. There's a bitstream
     // specifying for each word whether it's a const word or not, as well as the
     // const word indexes and raw data for non-const words.
     uint8_t source_types = 0;
-    while (w.str().size() < (header.decompressed_size >> 1)) {
-      if ((w.str().size() & 15) == 0) {
+    for (size_t z = 0; z < num_words; z++) {
+      if ((z & 7) == 0) {
         source_types = r.get_u8();
       }
       if (source_types & 0x80) {
-        w.put_u16b(const_words->at(r.get_u8()));
+        uint8_t index = r.get_u8();
+        if (index >= num_const_words) {
+          throw out_of_range("const word index out of range");
+        }
+        memcpy(out + z * 2, &const_words[index], 2);
       } else {
-        w.put_u8(r.get_u8());
-        w.put_u8(r.get_u8());
+        memcpy(out + z * 2, r.getv(2), 2);
       }
       source_types <<= 1;
     }
 
   } else {
-    // Result is composed entirely of const words.
-    while (w.str().size() < (header.decompressed_size >> 1)) {
-      w.put_u16b(const_words->at(r.get_u8()));
+    // Result is composed entirely of const words. The default table has all
+    // 0x100 entries, so the bounds check can be skipped in that case.
+    const uint8_t* indexes = reinterpret_cast<const uint8_t*>(r.getv(num_words));
+    if (num_const_words < 0x100) {
+      for (size_t z = 0; z < num_words; z++) {
+        if (indexes[z] >= num_const_words) {
+          throw out_of_range("const word index out of range");
+        }
+      }
+    }
+    for (size_t z = 0; z < num_words; z++) {
+      memcpy(out + z * 2, &const_words[indexes[z]], 2);
     }
   }
 
   if (header.decompressed_size & 1) {
-    w.put_u8(r.get_u8());
+    out[num_words * 2] = r.get_u8();
   }
 
-  return w.str();
+  return ret;
 }
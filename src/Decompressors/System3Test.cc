@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <string>
+
+#include "System.hh"
+
+using namespace std;
+
+
+
+// Compressed data is written here as strings of '0' and '1' characters, which
+// are packed MSB-first (and padded with zero bits) by pack_bits
+static void append_bits(string& bits, uint32_t value, size_t count) {
+  for (size_t z = count; z > 0; z--) {
+    bits.push_back(((value >> (z - 1)) & 1) ? '1' : '0');
+  }
+}
+
+static string pack_bits(const string& bits) {
+  string ret((bits.size() + 7) / 8, '\0');
+  for (size_t z = 0; z < bits.size(); z++) {
+    if (bits[z] == '1') {
+      ret[z / 8] |= (0x80 >> (z % 8));
+    }
+  }
+  return ret;
+}
+
+static string decompress(const string& bits, size_t decompressed_size) {
+  CompressedResourceHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = 0xA89F6572;
+  header.header_version = 9;
+  header.attributes = 1;
+  header.decompressed_size = decompressed_size;
+  header.version.v9.dcmp_resource_id = 3;
+  string data = pack_bits(bits);
+  return decompress_system3(header, data.data(), data.size());
+}
+
+int main(int, char**) {
+  // Literal "abc" (length 0 = 00, then stream length 3 = 101), then a
+  // backreference of 8 bytes at offset 3 (length 5 = 11000, plus 3 since it
+  // follows a short stream; offset 3 = 10 01), which overlaps its own output
+  string bits = "00101";
+  append_bits(bits, 'a', 8);
+  append_bits(bits, 'b', 8);
+  append_bits(bits, 'c', 8);
+  bits += "110001001";
+
+  fprintf(stderr, "-- literals and backreferences\n");
+  {
+    // A 3-byte backreference at offset 11 (length 1 = 01, plus 2; offset 11 =
+    // 11 0), which doesn't overlap its output
+    expect_eq(string("abcabcabcababc"), decompress(bits + "01110", 14));
+  }
+
+  fprintf(stderr, "-- backreference before beginning of output\n");
+  {
+    // Offset 12 (11 1) is one byte before the beginning
+    bool failed = false;
+    try {
+      decompress(bits + "01111", 14);
+    } catch (const runtime_error&) {
+      failed = true;
+    }
+    expect(failed);
+  }
+
+  fprintf(stderr, "-- truncated data\n");
+  {
+    bool failed = false;
+    try {
+      decompress(bits.substr(0, 16), 14);
+    } catch (const out_of_range&) {
+      failed = true;
+    }
+    expect(failed);
+  }
+
+  fprintf(stderr, "-- long offset after 0x670 bytes\n");
+  {
+    // 26 streams of 63 bytes (11111 11111) and one of 10 bytes (1110 010)
+    string expected;
+    string long_bits;
+    while (expected.size() < 0x670) {
+      size_t count = min<size_t>(0x670 - expected.size(), 63);
+      long_bits += "00";
+      if (count == 63) {
+        long_bits += "1111111111";
+      } else {
+        long_bits += "1110";
+        append_bits(long_bits, count - 8, 3);
+      }
+      for (size_t z = 0; z < count; z++) {
+        uint8_t ch = expected.size() * 7;
+        expected.push_back(ch);
+        append_bits(long_bits, ch, 8);
+      }
+    }
+    // A 3-byte backreference (length 0 = 00, plus 3) at offset 0x66F. Offsets
+    // this large use family 7's last form (11, then base 0x281 + x), and at
+    // this output size x has 11 bits (10 would suffice, but the original
+    // implementation uses 11 here).
+    long_bits += "0011";
+    append_bits(long_bits, 0x66F - 0x281, 11);
+    expected += expected.substr(0x670 - 0x66F, 3);
+    expect_eq(expected, decompress(long_bits, expected.size()));
+  }
+
+  printf("System3Test: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,335 @@
+#include "DebuggerExpression.hh"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+using namespace std;
+
+
+
+class DebuggerExpression::Parser {
+public:
+  Parser(const string& text, vector<Instruction>& program)
+    : text(text), offset(0), program(program) { }
+
+  void parse() {
+    this->parse_binary(0);
+    this->skip_whitespace();
+    if (this->offset < this->text.size()) {
+      this->fail("unexpected text");
+    }
+  }
+
+private:
+  const string& text;
+  size_t offset;
+  vector<Instruction>& program;
+
+  struct BinaryOperator {
+    const char* token;
+    size_t level;
+    Opcode op;
+  };
+  // Longer tokens come first, so (for example) && isn't parsed as two &s.
+  // Levels are from lowest to highest precedence; && and || are handled
+  // specially since they short-circuit.
+  static constexpr size_t NUM_LEVELS = 10;
+  static constexpr BinaryOperator BINARY_OPERATORS[] = {
+      {"||", 0, Opcode::BITWISE_OR},
+      {"&&", 1, Opcode::BITWISE_AND},
+      {"==", 5, Opcode::EQUAL},
+      {"!=", 5, Opcode::NOT_EQUAL},
+      {"<=", 6, Opcode::LESS_OR_EQUAL},
+      {">=", 6, Opcode::GREATER_OR_EQUAL},
+      {"<<", 7, Opcode::SHIFT_LEFT},
+      {">>", 7, Opcode::SHIFT_RIGHT},
+      {"|", 2, Opcode::BITWISE_OR},
+      {"^", 3, Opcode::BITWISE_XOR},
+      {"&", 4, Opcode::BITWISE_AND},
+      {"<", 6, Opcode::LESS},
+      {">", 6, Opcode::GREATER},
+      {"+", 8, Opcode::ADD},
+      {"-", 8, Opcode::SUBTRACT},
+      {"*", 9, Opcode::MULTIPLY},
+  };
+
+  [[noreturn]] void fail(const char* what) const {
+    throw invalid_argument(string_printf("%s at position %zu in expression",
+        what, this->offset));
+  }
+
+  void skip_whitespace() {
+    while ((this->offset < this->text.size()) && isspace(this->text[this->offset])) {
+      this->offset++;
+    }
+  }
+
+  bool consume(char ch) {
+    this->skip_whitespace();
+    if ((this->offset < this->text.size()) && (this->text[this->offset] == ch)) {
+      this->offset++;
+      return true;
+    }
+    return false;
+  }
+
+  // Returns the operator at the current position if it's at the given level,
+  // and skips over it. Otherwise, returns null and doesn't move.
+  const BinaryOperator* consume_binary_operator(size_t level) {
+    this->skip_whitespace();
+    for (const auto& op : BINARY_OPERATORS) {
+      size_t len = strlen(op.token);
+      if (!this->text.compare(this->offset, len, op.token)) {
+        if (op.level != level) {
+          return nullptr;
+        }
+        this->offset += len;
+        return &op;
+      }
+    }
+    return nullptr;
+  }
+
+  size_t emit(Opcode op, uint64_t value = 0, uint8_t size = 0, string name = "") {
+    this->program.emplace_back(Instruction{op, size, value, move(name)});
+    return this->program.size() - 1;
+  }
+
+  void parse_binary(size_t level) {
+    if (level == NUM_LEVELS) {
+      this->parse_unary();
+      return;
+    }
+    this->parse_binary(level + 1);
+
+    const BinaryOperator* op;
+    while ((op = this->consume_binary_operator(level))) {
+      if (level <= 1) {
+        // For && (or ||), if the left side is zero (or nonzero), it's also
+        // the result, so skip evaluating the right side
+        this->emit(Opcode::TO_BOOL);
+        size_t jump_index = this->emit((level == 0)
+            ? Opcode::JUMP_IF_NONZERO : Opcode::JUMP_IF_ZERO);
+        this->emit(Opcode::POP);
+        this->parse_binary(level + 1);
+        this->emit(Opcode::TO_BOOL);
+        this->program[jump_index].value = this->program.size();
+      } else {
+        this->parse_binary(level + 1);
+        this->emit(op->op);
+      }
+    }
+  }
+
+  void parse_unary() {
+    if (this->consume('-')) {
+      this->parse_unary();
+      this->emit(Opcode::NEGATE);
+    } else if (this->consume('~')) {
+      this->parse_unary();
+      this->emit(Opcode::BITWISE_NOT);
+    } else if (this->consume('!')) {
+      this->parse_unary();
+      this->emit(Opcode::LOGICAL_NOT);
+    } else {
+      this->parse_primary();
+    }
+  }
+
+  void parse_memory_reference(uint8_t size) {
+    this->parse_binary(0);
+    if (!this->consume(']')) {
+      this->fail("expected ]");
+    }
+    this->emit(Opcode::READ_MEMORY, 0, size);
+  }
+
+  void parse_primary() {
+    this->skip_whitespace();
+    if (this->offset >= this->text.size()) {
+      this->fail("unexpected end");
+    }
+
+    char ch = this->text[this->offset];
+    if (ch == '(') {
+      this->offset++;
+      this->parse_binary(0);
+      if (!this->consume(')')) {
+        this->fail("expected )");
+      }
+
+    } else if (ch == '[') {
+      this->offset++;
+      this->parse_memory_reference(4);
+
+    } else if (isdigit(ch)) {
+      const char* start = this->text.c_str() + this->offset;
+      char* end;
+      uint64_t value = strtoull(start, &end, 16);
+      this->offset += end - start;
+      this->emit(Opcode::CONSTANT, value);
+
+    } else if (isalpha(ch) || (ch == '_')) {
+      size_t start_offset = this->offset;
+      while ((this->offset < this->text.size()) &&
+             (isalnum(this->text[this->offset]) || (this->text[this->offset] == '_'))) {
+        this->offset++;
+      }
+      string name = this->text.substr(start_offset, this->offset - start_offset);
+      if ((this->offset < this->text.size()) && (this->text[this->offset] == '[')) {
+        uint8_t size;
+        if (name == "b") {
+          size = 1;
+        } else if (name == "w") {
+          size = 2;
+        } else if (name == "d") {
+          size = 4;
+        } else {
+          this->fail("invalid memory reference size");
+        }
+        this->offset++;
+        this->parse_memory_reference(size);
+      } else {
+        this->emit(Opcode::REGISTER, 0, 0, move(name));
+      }
+
+    } else {
+      this->fail("unexpected character");
+    }
+  }
+};
+
+
+
+DebuggerExpression::DebuggerExpression(const string& text)
+  : text(text), max_stack_depth(0) {
+  Parser(this->text, this->program).parse();
+
+  // Jumps always go forward to a point where the stack has the same depth as
+  // just after the jump, so this doesn't need to follow them
+  size_t depth = 0;
+  for (const auto& ins : this->program) {
+    switch (ins.op) {
+      case Opcode::CONSTANT:
+      case Opcode::REGISTER:
+        depth++;
+        break;
+      case Opcode::READ_MEMORY:
+      case Opcode::NEGATE:
+      case Opcode::BITWISE_NOT:
+      case Opcode::LOGICAL_NOT:
+      case Opcode::TO_BOOL:
+      case Opcode::JUMP_IF_ZERO:
+      case Opcode::JUMP_IF_NONZERO:
+        break;
+      default: // Binary operators and POP
+        depth--;
+        break;
+    }
+    this->max_stack_depth = max<size_t>(this->max_stack_depth, depth);
+  }
+}
+
+uint64_t DebuggerExpression::evaluate(
+    const function<uint64_t(const string&)>& get_register,
+    const function<uint64_t(uint32_t, uint8_t)>& read_memory) const {
+  vector<uint64_t> stack(this->max_stack_depth);
+  size_t sp = 0;
+  for (size_t pc = 0; pc < this->program.size(); pc++) {
+    const auto& ins = this->program[pc];
+    switch (ins.op) {
+      case Opcode::CONSTANT:
+        stack[sp++] = ins.value;
+        break;
+      case Opcode::REGISTER:
+        stack[sp++] = get_register(ins.name);
+        break;
+      case Opcode::READ_MEMORY:
+        stack[sp - 1] = read_memory(stack[sp - 1], ins.size);
+        break;
+      case Opcode::NEGATE:
+        stack[sp - 1] = -stack[sp - 1];
+        break;
+      case Opcode::BITWISE_NOT:
+        stack[sp - 1] = ~stack[sp - 1];
+        break;
+      case Opcode::LOGICAL_NOT:
+        stack[sp - 1] = !stack[sp - 1];
+        break;
+      case Opcode::TO_BOOL:
+        stack[sp - 1] = !!stack[sp - 1];
+        break;
+      case Opcode::JUMP_IF_ZERO:
+        if (!stack[sp - 1]) {
+          pc = ins.value - 1;
+        }
+        break;
+      case Opcode::JUMP_IF_NONZERO:
+        if (stack[sp - 1]) {
+          pc = ins.value - 1;
+        }
+        break;
+      case Opcode::POP:
+        sp--;
+        break;
+      default: {
+        uint64_t right = stack[--sp];
+        uint64_t& left = stack[sp - 1];
+        switch (ins.op) {
+          case Opcode::MULTIPLY:
+            left *= right;
+            break;
+          case Opcode::ADD:
+            left += right;
+            break;
+          case Opcode::SUBTRACT:
+            left -= right;
+            break;
+          case Opcode::SHIFT_LEFT:
+            left = (right >= 64) ? 0 : (left << right);
+            break;
+          case Opcode::SHIFT_RIGHT:
+            left = (right >= 64) ? 0 : (left >> right);
+            break;
+          case Opcode::LESS:
+            left = (left < right);
+            break;
+          case Opcode::LESS_OR_EQUAL:
+            left = (left <= right);
+            break;
+          case Opcode::GREATER:
+            left = (left > right);
+            break;
+          case Opcode::GREATER_OR_EQUAL:
+            left = (left >= right);
+            break;
+          case Opcode::EQUAL:
+            left = (left == right);
+            break;
+          case Opcode::NOT_EQUAL:
+            left = (left != right);
+            break;
+          case Opcode::BITWISE_AND:
+            left &= right;
+            break;
+          case Opcode::BITWISE_XOR:
+            left ^= right;
+            break;
+          case Opcode::BITWISE_OR:
+            left |= right;
+            break;
+          default:
+            throw logic_error("invalid opcode in debugger expression");
+        }
+      }
+    }
+  }
+  if (sp != 1) {
+    throw logic_error("debugger expression left an incorrect stack depth");
+  }
+  return stack[0];
+}
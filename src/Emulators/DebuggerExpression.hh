@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "MemoryContext.hh"
+
+
+
+// An integer expression over registers and memory, used for conditional
+// breakpoints. The text is parsed once into a postfix program, so evaluating
+// the expression doesn't involve any parsing. The syntax is:
+// - Numbers are in hex (like all other numbers in the debugger) and must begin
+//   with a digit, so they can't be confused with register names; for example,
+//   0A0 is a number but A0 is a register.
+// - Register names are the same as for the setreg command (e.g. D0, A7, r3,
+//   eax). The name is looked up when the expression is evaluated, so an
+//   invalid name causes an error at that point rather than when parsing.
+// - [EXPR] reads a 32-bit value from memory in the emulated CPU's byte order;
+//   b[EXPR] and w[EXPR] read 8-bit and 16-bit values, and d[EXPR] is the same
+//   as [EXPR].
+// - The operators are the same as in C, with the same precedence: unary - ~ !,
+//   then * + - << >> < <= > >= == != & ^ | && ||. && and || short-circuit, so
+//   (for example) "A0 && [A0] == 5" doesn't read memory if A0 is zero.
+// All arithmetic is done with unsigned 64-bit integers.
+class DebuggerExpression {
+public:
+  // Throws invalid_argument if the text isn't a valid expression
+  explicit DebuggerExpression(const std::string& text);
+  ~DebuggerExpression() = default;
+
+  inline const std::string& str() const {
+    return this->text;
+  }
+
+  // get_register returns the value of a register by name (throwing if there's
+  // no such register); read_memory returns the value of size bytes at addr.
+  uint64_t evaluate(
+      const std::function<uint64_t(const std::string&)>& get_register,
+      const std::function<uint64_t(uint32_t, uint8_t)>& read_memory) const;
+
+  template <typename EmuT>
+  uint64_t evaluate(EmuT& emu) const {
+    auto& regs = emu.registers();
+    auto mem = emu.memory();
+    return this->evaluate(
+        [&](const std::string& name) -> uint64_t {
+          return regs.get_by_name(name);
+        },
+        [&](uint32_t addr, uint8_t size) -> uint64_t {
+          if (size == 1) {
+            return mem->read_u8(addr);
+          } else if (size == 2) {
+            return EmuT::is_little_endian ? mem->read_u16l(addr) : mem->read_u16b(addr);
+          } else {
+            return EmuT::is_little_endian ? mem->read_u32l(addr) : mem->read_u32b(addr);
+          }
+        });
+  }
+
+private:
+  enum class Opcode : uint8_t {
+    CONSTANT = 0,
+    REGISTER,
+    READ_MEMORY, // Replaces the top value with the value at that address
+    NEGATE,
+    BITWISE_NOT,
+    LOGICAL_NOT,
+    TO_BOOL, // Replaces the top value with 1 if it's nonzero, 0 otherwise
+    MULTIPLY,
+    ADD,
+    SUBTRACT,
+    SHIFT_LEFT,
+    SHIFT_RIGHT,
+    LESS,
+    LESS_OR_EQUAL,
+    GREATER,
+    GREATER_OR_EQUAL,
+    EQUAL,
+    NOT_EQUAL,
+    BITWISE_AND,
+    BITWISE_XOR,
+    BITWISE_OR,
+    // These jump to the instruction at value if the top value is zero (or
+    // nonzero), leaving it on the stack
+    JUMP_IF_ZERO,
+    JUMP_IF_NONZERO,
+    POP,
+  };
+  struct Instruction {
+    Opcode op;
+    uint8_t size; // For READ_MEMORY
+    uint64_t value; // For CONSTANT and the jump opcodes
+    std::string name; // For REGISTER
+  };
+
+  std::string text;
+  std::vector<Instruction> program;
+  size_t max_stack_depth;
+
+  class Parser;
+};
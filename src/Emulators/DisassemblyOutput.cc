@@ -0,0 +1,96 @@
+#include "DisassemblyOutput.hh"
+
+#include <stdarg.h>
+
+#include <array>
+#include <phosg/Filesystem.hh>
+#include <stdexcept>
+
+using namespace std;
+
+
+
+// Two hex digits for each byte value
+static constexpr array<char, 0x200> HEX_BYTE_DIGITS = []() {
+  const char* digits = "0123456789ABCDEF";
+  array<char, 0x200> ret = {};
+  for (size_t z = 0; z < 0x100; z++) {
+    ret[z * 2] = digits[z >> 4];
+    ret[z * 2 + 1] = digits[z & 0x0F];
+  }
+  return ret;
+}();
+
+DisassemblyOutput::DisassemblyOutput()
+  : stream(nullptr), flush_threshold(0) { }
+
+DisassemblyOutput::DisassemblyOutput(string&& initial_contents)
+  : stream(nullptr), flush_threshold(0), buffer(move(initial_contents)) { }
+
+DisassemblyOutput::DisassemblyOutput(FILE* stream, size_t flush_threshold)
+  : stream(stream), flush_threshold(flush_threshold) {
+  this->buffer.reserve(flush_threshold);
+}
+
+DisassemblyOutput::~DisassemblyOutput() {
+  try {
+    this->flush();
+  } catch (const exception&) { }
+}
+
+void DisassemblyOutput::write_hex(uint64_t value, size_t digits) {
+  if (digits > 16) {
+    throw logic_error("too many hex digits requested");
+  }
+  char text[16];
+  size_t z = digits;
+  for (; z >= 2; z -= 2) {
+    const char* pair = &HEX_BYTE_DIGITS[(value & 0xFF) * 2];
+    text[z - 2] = pair[0];
+    text[z - 1] = pair[1];
+    value >>= 8;
+  }
+  if (z) {
+    text[0] = HEX_BYTE_DIGITS[(value & 0x0F) * 2 + 1];
+  }
+  this->write(text, digits);
+}
+
+void DisassemblyOutput::write_printf(const char* fmt, ...) {
+  // Most strings are short, so try formatting directly into the buffer first;
+  // if that wasn't enough space, make enough space and format it again
+  size_t orig_size = this->buffer.size();
+  this->buffer.resize(orig_size + 0x100);
+
+  va_list va;
+  va_start(va, fmt);
+  va_list va_retry;
+  va_copy(va_retry, va);
+  int count = vsnprintf(this->buffer.data() + orig_size, 0x100, fmt, va);
+  va_end(va);
+  if (count < 0) {
+    va_end(va_retry);
+    this->buffer.resize(orig_size);
+    throw runtime_error("cannot format disassembly text");
+  }
+  if (static_cast<size_t>(count) >= 0x100) {
+    this->buffer.resize(orig_size + count + 1);
+    vsnprintf(this->buffer.data() + orig_size, count + 1, fmt, va_retry);
+  }
+  va_end(va_retry);
+  this->buffer.resize(orig_size + count);
+  this->flush_if_needed();
+}
+
+string DisassemblyOutput::take() {
+  string ret = move(this->buffer);
+  this->buffer.clear();
+  return ret;
+}
+
+void DisassemblyOutput::flush() {
+  if (this->stream && !this->buffer.empty()) {
+    fwritex(this->stream, this->buffer);
+    this->buffer.clear();
+  }
+}
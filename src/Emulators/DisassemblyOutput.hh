@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+
+
+// A growable text buffer that the disassemblers write into. Each instruction's
+// text is appended to the same buffer, instead of being built as a separate
+// string and concatenated with all the others at the end, and hex values are
+// formatted from a table computed at compile time instead of with printf.
+//
+// If a stream is given, the buffer's contents are written to it whenever the
+// buffer grows past flush_threshold, so a large image's disassembly never has
+// to be held in memory all at once. Call flush() when done writing; the
+// destructor also flushes, but can't report errors.
+class DisassemblyOutput {
+public:
+  DisassemblyOutput();
+  // Appends to initial_contents, which can be used to put a header before the
+  // disassembly without copying it afterward
+  explicit DisassemblyOutput(std::string&& initial_contents);
+  explicit DisassemblyOutput(FILE* stream, size_t flush_threshold = 0x40000);
+  DisassemblyOutput(const DisassemblyOutput&) = delete;
+  DisassemblyOutput(DisassemblyOutput&&) = default;
+  DisassemblyOutput& operator=(const DisassemblyOutput&) = delete;
+  DisassemblyOutput& operator=(DisassemblyOutput&&) = default;
+  ~DisassemblyOutput();
+
+  inline void write(const char* data, size_t size) {
+    this->buffer.append(data, size);
+    this->flush_if_needed();
+  }
+  inline void write(const std::string& s) {
+    this->write(s.data(), s.size());
+  }
+  inline void write(char ch) {
+    this->buffer.push_back(ch);
+    this->flush_if_needed();
+  }
+  // Writes the low digits hex digits of value (uppercase, zero-padded), as
+  // "%0*X" would. digits must not be more than 16.
+  void write_hex(uint64_t value, size_t digits);
+  void write_printf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+  // Returns the number of bytes in the buffer (not already flushed)
+  inline size_t size() const {
+    return this->buffer.size();
+  }
+  inline const std::string& str() const {
+    return this->buffer;
+  }
+  // Returns the buffer's contents and leaves it empty
+  std::string take();
+
+  // Writes the buffer's contents to the stream, if there is one; otherwise,
+  // does nothing
+  void flush();
+
+private:
+  FILE* stream;
+  size_t flush_threshold;
+  std::string buffer;
+
+  inline void flush_if_needed() {
+    if (this->stream && (this->buffer.size() >= this->flush_threshold)) {
+      this->flush();
+    }
+  }
+};
@@ -3,6 +3,12 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <map>
+#include <thread>
+#include <phosg/Time.hh>
 #include <vector>
 
 #include "EmulatorBase.hh"
@@ -11,25 +17,367 @@ using namespace std;
 
 
 
+ExecutionProfiler::ExecutionProfiler(uint64_t sample_interval)
+  : sample_interval(sample_interval ? sample_interval : 1),
+    countdown(this->sample_interval) { }
+
+ExecutionProfiler::SyscallScope::SyscallScope(
+    ExecutionProfiler* profiler, uint32_t syscall)
+  : profiler(profiler), syscall(syscall), start(chrono::steady_clock::now()) { }
+
+ExecutionProfiler::SyscallScope::~SyscallScope() {
+  if (!this->profiler) {
+    return;
+  }
+  uint64_t nsecs = chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now() - this->start).count();
+  auto& stats = this->profiler->syscall_stats[this->syscall];
+  stats.count++;
+  stats.total_nsecs += nsecs;
+  stats.max_nsecs = max<uint64_t>(stats.max_nsecs, nsecs);
+}
+
+static string profile_frame_name(const LabelIndex& symbols, uint32_t pc) {
+  string name = symbols.describe_addr(pc);
+  return name.empty() ? "[unknown]" : name;
+}
+
+void ExecutionProfiler::write_folded_stacks(FILE* stream, const EmulatorBase& emu) const {
+  const auto& symbols = emu.memory()->symbol_index();
+
+  // Semicolons separate frames in this format, so they can't appear in names
+  auto clean_name = +[](string name) -> string {
+    for (char& ch : name) {
+      if ((ch == ';') || (ch == ' ')) {
+        ch = '_';
+      }
+    }
+    return name;
+  };
+
+  map<uint32_t, uint64_t> sorted_samples(this->pc_samples.begin(), this->pc_samples.end());
+  for (const auto& it : sorted_samples) {
+    const auto* func = symbols.nearest_at_or_before(it.first);
+    if (!func) {
+      fprintf(stream, "%08" PRIX32 " %" PRIu64 "\n", it.first, it.second);
+    } else {
+      fprintf(stream, "%s;%08" PRIX32 " %" PRIu64 "\n",
+          clean_name(*func->name).c_str(), it.first, it.second);
+    }
+  }
+}
+
+void ExecutionProfiler::print_summary(
+    FILE* stream, const EmulatorBase& emu, size_t max_pcs) const {
+  const auto& symbols = emu.memory()->symbol_index();
+
+  uint64_t total_samples = 0;
+  vector<pair<uint32_t, uint64_t>> samples(this->pc_samples.begin(), this->pc_samples.end());
+  for (const auto& it : samples) {
+    total_samples += it.second;
+  }
+  sort(samples.begin(), samples.end(), [](const auto& a, const auto& b) -> bool {
+    return (a.second > b.second) || ((a.second == b.second) && (a.first < b.first));
+  });
+  fprintf(stream, "profile: %" PRIu64 " samples (1 per %" PRIu64 " instructions)\n",
+      total_samples, this->sample_interval);
+  for (size_t z = 0; (z < samples.size()) && (z < max_pcs); z++) {
+    string name = profile_frame_name(symbols, samples[z].first);
+    fprintf(stream, "  %08" PRIX32 " %6.2f%% %" PRIu64 " %s\n",
+        samples[z].first, (samples[z].second * 100.0) / total_samples,
+        samples[z].second, name.c_str());
+  }
+
+  vector<pair<uint32_t, SyscallStats>> syscalls(this->syscall_stats.begin(), this->syscall_stats.end());
+  sort(syscalls.begin(), syscalls.end(), [](const auto& a, const auto& b) -> bool {
+    return (a.second.total_nsecs > b.second.total_nsecs) ||
+        ((a.second.total_nsecs == b.second.total_nsecs) && (a.first < b.first));
+  });
+  if (!syscalls.empty()) {
+    fprintf(stream, "profile: syscalls (count, total usecs, average usecs, max usecs)\n");
+  }
+  for (const auto& it : syscalls) {
+    string name = emu.name_for_syscall(it.first);
+    fprintf(stream, "  %-24s %8" PRIu64 " %12.3f %10.3f %10.3f\n", name.c_str(),
+        it.second.count, it.second.total_nsecs / 1000.0,
+        (it.second.total_nsecs / 1000.0) / it.second.count,
+        it.second.max_nsecs / 1000.0);
+  }
+}
+
+
+
+void DisassemblyChunk::add_line(uint32_t pc, uint32_t next_pc,
+    const map<uint32_t, bool>& line_branch_targets) {
+  size_t text_offset = this->lines.empty()
+      ? 0 : (this->lines.back().text_offset + this->lines.back().text_size);
+  this->lines.emplace_back(DisassemblyLine{
+      pc, next_pc, text_offset, this->text.size() - text_offset});
+  this->branch_targets.insert(this->branch_targets.end(),
+      line_branch_targets.begin(), line_branch_targets.end());
+  this->branch_targets_end.emplace_back(this->branch_targets.size());
+}
+
+// Chunks smaller than this aren't worth the cost of a thread
+static constexpr size_t MIN_DISASSEMBLY_CHUNK_SIZE = 0x4000;
+
+DisassemblyResult disassemble_chunked(
+    uint32_t start_address,
+    size_t size,
+    const LabelIndex& labels,
+    size_t num_threads,
+    uint32_t alignment,
+    bool split_at_labels_only,
+    bool any_call_is_function,
+    function<uint32_t(DisassemblyChunk&, uint32_t)> disassemble_one) {
+  if (num_threads == 0) {
+    num_threads = max<size_t>(thread::hardware_concurrency(), 1);
+  }
+  uint64_t end_pc = static_cast<uint64_t>(start_address) + size;
+
+  // Choose the chunk boundaries. There are a few more chunks than threads, so
+  // a chunk that takes longer than the others doesn't leave threads idle.
+  vector<uint32_t> chunk_starts({start_address});
+  size_t target_num_chunks = min<size_t>(num_threads * 4, size / MIN_DISASSEMBLY_CHUNK_SIZE);
+  if ((num_threads > 1) && (target_num_chunks > 1)) {
+    uint64_t target_chunk_size = size / target_num_chunks;
+    if (split_at_labels_only) {
+      uint64_t next_boundary = start_address + target_chunk_size;
+      for (auto it = labels.upper_bound(start_address);
+           (it != labels.end()) && (it->addr < end_pc);
+           it++) {
+        if ((it->addr >= next_boundary) &&
+            (it->addr != chunk_starts.back()) &&
+            !((it->addr - start_address) % alignment)) {
+          chunk_starts.emplace_back(it->addr);
+          next_boundary = it->addr + target_chunk_size;
+        }
+      }
+    } else {
+      target_chunk_size -= target_chunk_size % alignment;
+      for (size_t z = 1; z < target_num_chunks; z++) {
+        chunk_starts.emplace_back(start_address + z * target_chunk_size);
+      }
+    }
+  }
+  auto chunk_end_pc = [&](size_t chunk_index) -> uint64_t {
+    return (chunk_index + 1 < chunk_starts.size())
+        ? chunk_starts[chunk_index + 1] : end_pc;
+  };
+
+  vector<DisassemblyChunk> chunks(chunk_starts.size());
+  auto disassemble_chunk = [&](size_t chunk_index) {
+    auto& chunk = chunks[chunk_index];
+    uint64_t chunk_end = chunk_end_pc(chunk_index);
+    for (uint64_t pc = chunk_starts[chunk_index]; pc < chunk_end;) {
+      pc = disassemble_one(chunk, pc);
+    }
+  };
+  if (chunks.size() == 1) {
+    disassemble_chunk(0);
+  } else {
+    atomic<size_t> next_chunk_index(0);
+    vector<exception_ptr> exceptions(chunks.size());
+    vector<thread> threads;
+    for (size_t z = 0; z < min<size_t>(num_threads, chunks.size()); z++) {
+      threads.emplace_back([&]() {
+        size_t chunk_index;
+        while ((chunk_index = next_chunk_index++) < chunks.size()) {
+          try {
+            disassemble_chunk(chunk_index);
+          } catch (...) {
+            exceptions[chunk_index] = current_exception();
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    for (const auto& e : exceptions) {
+      if (e) {
+        rethrow_exception(e);
+      }
+    }
+  }
+
+  // Merge the chunks, resynchronizing at each boundary if needed
+  DisassemblyResult ret;
+  vector<pair<uint32_t, bool>> all_branch_targets;
+  auto add_lines = [&](DisassemblyChunk& chunk, size_t first_line) {
+    size_t targets_begin = first_line ? chunk.branch_targets_end[first_line - 1] : 0;
+    all_branch_targets.insert(all_branch_targets.end(),
+        chunk.branch_targets.begin() + targets_begin, chunk.branch_targets.end());
+    if (first_line >= chunk.lines.size()) {
+      return;
+    }
+    // The chunk's lines are contiguous in its text, so they can be copied into
+    // the result's text all at once
+    size_t text_begin = chunk.lines[first_line].text_offset;
+    size_t ret_text_begin = ret.text.size();
+    ret.text.append(chunk.text.str(), text_begin, string::npos);
+    for (auto it = chunk.lines.begin() + first_line; it != chunk.lines.end(); it++) {
+      auto& line = ret.lines.emplace_back(*it);
+      line.text_offset = line.text_offset - text_begin + ret_text_begin;
+    }
+  };
+  uint64_t pc = start_address;
+  for (size_t z = 0; z < chunks.size(); z++) {
+    auto& chunk = chunks[z];
+    uint64_t chunk_end = chunk_end_pc(z);
+    size_t first_line = 0;
+    if (pc != chunk_starts[z]) {
+      DisassemblyChunk resync_chunk;
+      auto first_line_it = chunk.lines.begin();
+      for (;;) {
+        first_line_it = lower_bound(first_line_it, chunk.lines.end(), pc,
+            [](const DisassemblyLine& line, uint64_t pc) { return line.pc < pc; });
+        if ((pc >= chunk_end) || ((first_line_it != chunk.lines.end()) && (first_line_it->pc == pc))) {
+          break;
+        }
+        pc = disassemble_one(resync_chunk, pc);
+      }
+      first_line = first_line_it - chunk.lines.begin();
+      add_lines(resync_chunk, 0);
+    }
+    add_lines(chunk, first_line);
+    if (!ret.lines.empty()) {
+      pc = ret.lines.back().next_pc;
+    }
+  }
+
+  // Combine the branch targets into a sorted list. The sort is stable so that
+  // the first reference to each address (in address order) comes first.
+  stable_sort(all_branch_targets.begin(), all_branch_targets.end(),
+      [](const pair<uint32_t, bool>& a, const pair<uint32_t, bool>& b) {
+    return a.first < b.first;
+  });
+  for (const auto& it : all_branch_targets) {
+    if (!ret.branch_targets.empty() && (ret.branch_targets.back().first == it.first)) {
+      if (any_call_is_function) {
+        ret.branch_targets.back().second |= it.second;
+      }
+    } else {
+      ret.branch_targets.emplace_back(it);
+    }
+  }
+
+  return ret;
+}
+
+void write_disassembly_label(DisassemblyOutput& out,
+    const LabelIndex::Label& label, uint32_t pc) {
+  out.write(*label.name);
+  if (label.addr != pc) {
+    out.write(": // at ", 8);
+    out.write_hex(label.addr, 8);
+    out.write(" (misaligned)\n", 14);
+  } else {
+    out.write(":\n", 2);
+  }
+}
+
+void write_disassembly_branch_target_label(DisassemblyOutput& out,
+    uint32_t addr, bool is_function, uint32_t pc) {
+  if (is_function) {
+    out.write("fn", 2);
+  } else {
+    out.write("label", 5);
+  }
+  out.write_hex(addr, 8);
+  if (addr != pc) {
+    out.write(": // (misaligned)\n", 18);
+  } else {
+    out.write(":\n", 2);
+  }
+}
+
+
+
 EmulatorBase::EmulatorBase(shared_ptr<MemoryContext> mem)
-  : mem(mem), instructions_executed(0), log_memory_access(false) { }
+  : mem(mem),
+    instructions_executed(0),
+    max_cycles(0),
+    deadline(0),
+    next_execution_limit_check(UINT64_MAX),
+    jit_enabled(false),
+    log_memory_access(false) { }
+
+void EmulatorBase::set_execution_limits(uint64_t max_cycles, uint64_t deadline) {
+  this->max_cycles = max_cycles;
+  this->deadline = deadline;
+  this->next_execution_limit_check = UINT64_MAX;
+  this->on_execution_limit_check();
+}
+
+void EmulatorBase::on_execution_limit_check() {
+  if (this->max_cycles && (this->instructions_executed >= this->max_cycles)) {
+    throw budget_exceeded(string_printf(
+        "emulation exceeded the limit of %" PRIu64 " cycles", this->max_cycles));
+  }
+  if (this->deadline && (now() >= this->deadline)) {
+    throw budget_exceeded("emulation exceeded the time limit");
+  }
+  uint64_t next = UINT64_MAX;
+  if (this->deadline) {
+    next = this->instructions_executed + EXECUTION_DEADLINE_CHECK_INTERVAL;
+  }
+  if (this->max_cycles) {
+    next = min<uint64_t>(next, this->max_cycles);
+  }
+  this->next_execution_limit_check = next;
+}
+
+void EmulatorBase::import_image(const string& filename) {
+  string cpu_state = this->mem->import_image(filename);
+  auto f = fmemopen_unique(cpu_state.data(), cpu_state.size());
+  this->import_cpu_state(f.get());
+}
+
+void EmulatorBase::export_image(const string& filename, bool compress) const {
+  char* cpu_state_data = nullptr;
+  size_t cpu_state_size = 0;
+  FILE* cpu_state_stream = open_memstream(&cpu_state_data, &cpu_state_size);
+  if (!cpu_state_stream) {
+    throw runtime_error("cannot create CPU state buffer");
+  }
+  string cpu_state;
+  try {
+    this->export_cpu_state(cpu_state_stream);
+    fclose(cpu_state_stream);
+  } catch (...) {
+    fclose(cpu_state_stream);
+    ::free(cpu_state_data);
+    throw;
+  }
+  cpu_state.assign(cpu_state_data, cpu_state_size);
+  ::free(cpu_state_data);
+  this->mem->export_image(filename, cpu_state, compress);
+}
 
 void EmulatorBase::set_behavior_by_name(const string&) {
   throw logic_error("this CPU engine does not implement multiple behaviors");
 }
 
 vector<EmulatorBase::MemoryAccess> EmulatorBase::get_and_clear_memory_access_log() {
-  vector<EmulatorBase::MemoryAccess> ret;
-  ret.swap(this->memory_access_log);
-  return ret;
+  return this->memory_access_log.drain();
+}
+
+void EmulatorBase::set_memory_access_trace_file(const string& filename) {
+  this->memory_access_log.stream_to_file(filename);
+  this->log_memory_access = true;
 }
 
 void EmulatorBase::report_mem_access(uint32_t addr, uint8_t size, bool is_write) {
   if (this->log_memory_access) {
-    this->memory_access_log.push_back({addr, size, is_write});
+    this->memory_access_log.push({this->instructions_executed, addr, size, is_write});
   }
 }
 
+string EmulatorBase::name_for_syscall(uint32_t syscall) const {
+  return string_printf("syscall_%" PRIX32, syscall);
+}
+
 void EmulatorBase::set_time_base(uint64_t) {
   throw logic_error("this CPU engine does not implement a time base");
 }
@@ -39,9 +387,98 @@ void EmulatorBase::set_time_base(const std::vector<uint64_t>&) {
 
 
 
+bool BreakpointSet::add(uint32_t addr) {
+  if (this->page_bits.empty()) {
+    this->page_bits.resize((0x100000000 >> PAGE_BITS) / 64, 0);
+  }
+  uint32_t page_num = addr >> PAGE_BITS;
+  auto& page = this->pages[page_num];
+  this->page_bits[page_num >> 6] |= (1ULL << (page_num & 0x3F));
+
+  uint32_t offset = addr & PAGE_MASK;
+  uint64_t mask = 1ULL << (offset & 0x3F);
+  if (page.bits[offset >> 6] & mask) {
+    return false;
+  }
+  page.bits[offset >> 6] |= mask;
+  page.count++;
+  return true;
+}
+
+bool BreakpointSet::remove(uint32_t addr) {
+  if (!this->contains(addr)) {
+    return false;
+  }
+  uint32_t page_num = addr >> PAGE_BITS;
+  auto page_it = this->pages.find(page_num);
+  uint32_t offset = addr & PAGE_MASK;
+  page_it->second.bits[offset >> 6] &= ~(1ULL << (offset & 0x3F));
+  if (--page_it->second.count == 0) {
+    this->pages.erase(page_it);
+    this->page_bits[page_num >> 6] &= ~(1ULL << (page_num & 0x3F));
+  }
+  return true;
+}
+
+vector<uint32_t> BreakpointSet::all() const {
+  vector<uint32_t> ret;
+  for (const auto& [page_num, page] : this->pages) {
+    for (uint32_t offset = 0; offset <= PAGE_MASK; offset++) {
+      if ((page.bits[offset >> 6] >> (offset & 0x3F)) & 1) {
+        ret.emplace_back((page_num << PAGE_BITS) | offset);
+      }
+    }
+  }
+  sort(ret.begin(), ret.end());
+  return ret;
+}
+
+void CycleBreakpointSet::add(uint64_t cycle) {
+  this->cycles.emplace(cycle);
+  this->next_cycle = *this->cycles.begin();
+}
+
+bool CycleBreakpointSet::remove(uint64_t cycle) {
+  if (!this->cycles.erase(cycle)) {
+    return false;
+  }
+  this->next_cycle = this->cycles.empty() ? UINT64_MAX : *this->cycles.begin();
+  return true;
+}
+
+bool CycleBreakpointSet::on_reached(uint64_t cycle) {
+  this->cycles.erase(this->cycles.begin(), this->cycles.upper_bound(cycle));
+  this->next_cycle = this->cycles.empty() ? UINT64_MAX : *this->cycles.begin();
+  return true;
+}
+
 EmulatorDebuggerState::EmulatorDebuggerState()
   : max_cycles(0),
     mode(DebuggerMode::NONE),
     trace_period(0x100),
     print_state_headers(true),
     print_memory_accesses(true) { }
+
+void EmulatorDebuggerState::add_breakpoint(uint32_t addr, const string& condition) {
+  // Parse the condition first, so the breakpoint isn't changed if it's invalid
+  if (condition.empty()) {
+    this->breakpoint_conditions.erase(addr);
+  } else {
+    DebuggerExpression expr(condition);
+    this->breakpoint_conditions.erase(addr);
+    this->breakpoint_conditions.emplace(addr, move(expr));
+  }
+  this->breakpoints.add(addr);
+}
+
+bool EmulatorDebuggerState::remove_breakpoint(uint32_t addr) {
+  this->breakpoint_conditions.erase(addr);
+  return this->breakpoints.remove(addr);
+}
+
+bool EmulatorDebuggerState::needs_debug_hook() const {
+  return (this->mode != DebuggerMode::NONE) ||
+      !this->breakpoints.empty() ||
+      !this->cycle_breakpoints.empty() ||
+      this->max_cycles;
+}
@@ -4,14 +4,26 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
 #include <vector>
 #include <phosg/Strings.hh>
 #include <phosg/Filesystem.hh>
 #include <set>
 #include <string>
 #include <stdexcept>
-
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "DebuggerExpression.hh"
+#include "DisassemblyOutput.hh"
+#include "LabelIndex.hh"
+#include "MemoryAccessLog.hh"
 #include "MemoryContext.hh"
+#include "../ResourceBudget.hh"
 
 
 
@@ -23,6 +35,126 @@ constexpr T msb_for_type = (1 << (bits_for_type<T> - 1));
 
 
 
+class EmulatorBase;
+
+// Collects a histogram of sampled PC values and the number of calls to and
+// total time spent in each syscall. Emulators only call into this when a
+// profiler is set, so there's no cost when profiling is off.
+class ExecutionProfiler {
+public:
+  // The PC is recorded once every sample_interval instructions.
+  explicit ExecutionProfiler(uint64_t sample_interval = 1);
+  ~ExecutionProfiler() = default;
+
+  inline void on_instruction(uint32_t pc) {
+    if (--this->countdown == 0) {
+      this->countdown = this->sample_interval;
+      this->pc_samples[pc]++;
+    }
+  }
+
+  // Emulators create one of these around each syscall handler call, so the
+  // time is recorded even if the handler throws.
+  class SyscallScope {
+  public:
+    SyscallScope(ExecutionProfiler* profiler, uint32_t syscall);
+    ~SyscallScope();
+  private:
+    ExecutionProfiler* profiler;
+    uint32_t syscall;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  // Writes the PC samples in the folded-stack format used by flamegraph.pl.
+  // Each sample's stack is the nearest symbol at or before the PC, then the
+  // PC itself.
+  void write_folded_stacks(FILE* stream, const EmulatorBase& emu) const;
+  // Prints the most frequently-sampled PCs and the syscall counts and times.
+  void print_summary(FILE* stream, const EmulatorBase& emu, size_t max_pcs = 20) const;
+
+private:
+  struct SyscallStats {
+    uint64_t count;
+    uint64_t total_nsecs;
+    uint64_t max_nsecs;
+  };
+
+  uint64_t sample_interval;
+  uint64_t countdown;
+  std::unordered_map<uint32_t, uint64_t> pc_samples;
+  std::unordered_map<uint32_t, SyscallStats> syscall_stats;
+};
+
+
+
+// Chunked disassembly. Large inputs are split into chunks which are
+// disassembled on separate threads and then merged. For variable-length
+// instruction sets, chunks only begin at labels (e.g. CODE jump table entries
+// or exported functions), since those are the only places an instruction is
+// known to begin. If the last instruction in a chunk runs past the start of
+// the next chunk, the merge disassembles serially from there until it reaches
+// an instruction that the next chunk also produced, so the result is always
+// the same as it would be if the input were disassembled in one pass.
+//
+// The lines' text isn't stored in separate strings; each chunk (and the
+// result) has a single text buffer, and each line refers to a range within it.
+struct DisassemblyLine {
+  uint32_t pc;
+  uint32_t next_pc;
+  size_t text_offset;
+  size_t text_size;
+};
+
+struct DisassemblyChunk {
+  std::vector<DisassemblyLine> lines;
+  DisassemblyOutput text;
+  // The branch targets referenced by all lines, in line order. The targets
+  // for lines[z] end at branch_targets[branch_targets_end[z]].
+  std::vector<std::pair<uint32_t, bool>> branch_targets;
+  std::vector<size_t> branch_targets_end;
+
+  // Adds a line whose text is everything written to text since the previous
+  // line was added
+  void add_line(uint32_t pc, uint32_t next_pc,
+      const std::map<uint32_t, bool>& line_branch_targets);
+};
+
+struct DisassemblyResult {
+  // Each line's next_pc is the pc of the following line
+  std::vector<DisassemblyLine> lines;
+  // The text of all lines, in the same order as lines
+  std::string text;
+  // Sorted by address, with no duplicates. The bool is true if the target
+  // should be labeled as a function.
+  std::vector<std::pair<uint32_t, bool>> branch_targets;
+};
+
+// disassemble_one must disassemble the instruction at pc, add it to the chunk
+// with add_line(), and return the address of the following instruction. It is
+// called on multiple threads at once, so it must not modify any shared state.
+// If num_threads is 0, one thread per core is used. If any_call_is_function is
+// true, an address is labeled as a function if any branch to it is a call;
+// otherwise, the first branch to it (in address order) decides.
+DisassemblyResult disassemble_chunked(
+    uint32_t start_address,
+    size_t size,
+    const LabelIndex& labels,
+    size_t num_threads,
+    uint32_t alignment,
+    bool split_at_labels_only,
+    bool any_call_is_function,
+    std::function<uint32_t(DisassemblyChunk&, uint32_t)> disassemble_one);
+
+// Write the label lines that the disassemblers put before instructions. If the
+// label isn't at pc (the address of the following instruction), it's marked as
+// misaligned.
+void write_disassembly_label(DisassemblyOutput& out,
+    const LabelIndex::Label& label, uint32_t pc);
+void write_disassembly_branch_target_label(DisassemblyOutput& out,
+    uint32_t addr, bool is_function, uint32_t pc);
+
+
+
 class EmulatorBase {
 public:
   explicit EmulatorBase(std::shared_ptr<MemoryContext> mem);
@@ -30,10 +162,25 @@ public:
 
   virtual void import_state(FILE* stream) = 0;
   virtual void export_state(FILE* stream) const = 0;
+  // These read and write everything in the state except memory (that is, the
+  // registers and any emulator-specific settings), in the same format as the
+  // beginning of export_state's output
+  virtual void import_cpu_state(FILE* stream) = 0;
+  virtual void export_cpu_state(FILE* stream) const = 0;
+
+  // Like import_state and export_state, but use MemoryContext's image format,
+  // with the CPU state stored as the image's metadata. Loading an image is
+  // much faster than import_state for large memory spaces, since most of the
+  // memory is mapped from the file instead of being read.
+  void import_image(const std::string& filename);
+  void export_image(const std::string& filename, bool compress = false) const;
 
   inline std::shared_ptr<MemoryContext> memory() {
     return this->mem;
   }
+  inline std::shared_ptr<const MemoryContext> memory() const {
+    return this->mem;
+  }
 
   inline uint64_t cycles() const {
     return this->instructions_executed;
@@ -57,9 +204,11 @@ public:
   virtual void set_time_base(uint64_t time_base);
   virtual void set_time_base(const std::vector<uint64_t>& time_overrides);
 
+  // If the memory access log is streaming to a trace file, accesses are
+  // always logged, even if log_memory_access is false.
   inline void set_log_memory_access(bool log_memory_access) {
-    this->log_memory_access = log_memory_access;
-    if (!this->log_memory_access) {
+    this->log_memory_access = log_memory_access || this->memory_access_log.is_streaming();
+    if (!log_memory_access) {
       this->memory_access_log.clear();
     }
   }
@@ -67,30 +216,99 @@ public:
     return this->log_memory_access;
   }
 
-  struct MemoryAccess {
-    uint32_t addr;
-    uint8_t size;
-    bool is_write;
-  };
+  typedef ::MemoryAccess MemoryAccess;
 
+  // Returns all accesses logged since the last call. The log holds at most
+  // MemoryAccessLog::DEFAULT_CAPACITY accesses; if more are logged between
+  // calls, the later ones are dropped (unless the log is streaming).
   std::vector<MemoryAccess> get_and_clear_memory_access_log();
+  // Writes every memory access to a binary trace file from now on, which
+  // memory_trace_dump can convert to text
+  void set_memory_access_trace_file(const std::string& filename);
+
+  inline void set_profiler(std::shared_ptr<ExecutionProfiler> profiler) {
+    this->profiler = profiler;
+  }
+  inline std::shared_ptr<ExecutionProfiler> get_profiler() const {
+    return this->profiler;
+  }
+
+  // Returns a human-readable name for a syscall number, as passed to the
+  // syscall handler. This is used in profiler output.
+  virtual std::string name_for_syscall(uint32_t syscall) const;
 
   virtual void print_source_trace(FILE* stream, const std::string& what, size_t max_depth = 0) const = 0;
 
+  // Limits how long execute() may run. If max_cycles is nonzero, execute()
+  // throws budget_exceeded when cycles() reaches it; if deadline is nonzero,
+  // execute() throws budget_exceeded when now() passes it. The deadline is
+  // only checked every EXECUTION_DEADLINE_CHECK_INTERVAL instructions, so it
+  // costs almost nothing. Zero for both (the default) means no limits.
+  static constexpr uint64_t EXECUTION_DEADLINE_CHECK_INTERVAL = 0x10000;
+  void set_execution_limits(uint64_t max_cycles, uint64_t deadline);
+
+  // Enables the JIT tier, for emulators that have one (currently only
+  // M68KEmulator; the others ignore this). The JIT tier is only used when no
+  // debug hook or profiler is set.
+  inline void set_jit_enabled(bool jit_enabled) {
+    this->jit_enabled = jit_enabled;
+  }
+  inline bool get_jit_enabled() const {
+    return this->jit_enabled;
+  }
+
   virtual void execute() = 0;
 
 protected:
   std::shared_ptr<MemoryContext> mem;
   uint64_t instructions_executed;
 
+  uint64_t max_cycles;
+  uint64_t deadline;
+  // The cycle count at which check_execution_limits next needs to do anything
+  uint64_t next_execution_limit_check;
+  // Emulators call this after each instruction
+  inline void check_execution_limits() {
+    if (this->instructions_executed >= this->next_execution_limit_check) {
+      this->on_execution_limit_check();
+    }
+  }
+  void on_execution_limit_check();
+
+  bool jit_enabled;
+
   bool log_memory_access;
-  std::vector<MemoryAccess> memory_access_log;
+  MemoryAccessLog memory_access_log;
+
+  std::shared_ptr<ExecutionProfiler> profiler;
 
   void report_mem_access(uint32_t addr, uint8_t size, bool is_write);
 };
 
 
 
+// Captures an emulator's registers and memory, so it can be returned to the
+// same state later without reloading the program. Anything not in the
+// registers or memory (e.g. the syscall handler's state) is not included.
+template <typename EmuT>
+class EmulatorSnapshot {
+public:
+  explicit EmulatorSnapshot(EmuT& emu)
+    : memory(emu.memory()->snapshot()),
+      regs(emu.registers()) { }
+
+  void restore(EmuT& emu) const {
+    emu.memory()->restore(*this->memory);
+    emu.registers() = this->regs;
+  }
+
+private:
+  std::shared_ptr<const MemoryContext::Snapshot> memory;
+  std::remove_reference_t<decltype(std::declval<EmuT&>().registers())> regs;
+};
+
+
+
 enum class DebuggerMode {
   NONE,
   PERIODIC_TRACE,
@@ -98,9 +316,82 @@ enum class DebuggerMode {
   STEP,
 };
 
+// A set of execution breakpoints, which the debugger checks before every
+// instruction. Each 4KB page of the address space has one bit in a top-level
+// bitmap, and pages that contain breakpoints have a second bitmap with one
+// bit per address, so checking an address takes at most two bit tests no
+// matter how many breakpoints there are. The top-level bitmap is only
+// allocated when the first breakpoint is added.
+class BreakpointSet {
+public:
+  BreakpointSet() = default;
+  ~BreakpointSet() = default;
+
+  // These return false if the breakpoint already existed (or didn't exist)
+  bool add(uint32_t addr);
+  bool remove(uint32_t addr);
+
+  inline bool contains(uint32_t addr) const {
+    if (this->page_bits.empty()) {
+      return false;
+    }
+    uint32_t page_num = addr >> PAGE_BITS;
+    if (!((this->page_bits[page_num >> 6] >> (page_num & 0x3F)) & 1)) {
+      return false;
+    }
+    const auto& page = this->pages.at(page_num);
+    uint32_t offset = addr & PAGE_MASK;
+    return (page.bits[offset >> 6] >> (offset & 0x3F)) & 1;
+  }
+  inline bool empty() const {
+    return this->pages.empty();
+  }
+  // Returns all breakpoint addresses in increasing order
+  std::vector<uint32_t> all() const;
+
+private:
+  static constexpr uint8_t PAGE_BITS = 12;
+  static constexpr uint32_t PAGE_MASK = (1 << PAGE_BITS) - 1;
+  struct Page {
+    uint64_t bits[(1 << PAGE_BITS) / 64];
+    size_t count;
+  };
+  std::vector<uint64_t> page_bits;
+  std::unordered_map<uint32_t, Page> pages;
+};
+
+// A set of cycle breakpoints. The earliest one is kept separately, so checking
+// whether any breakpoint has been reached is a single comparison.
+class CycleBreakpointSet {
+public:
+  CycleBreakpointSet() : next_cycle(UINT64_MAX) { }
+  ~CycleBreakpointSet() = default;
+
+  void add(uint64_t cycle);
+  bool remove(uint64_t cycle); // False if there was no breakpoint at cycle
+
+  // Returns true if any breakpoint is at or before cycle, and deletes all such
+  // breakpoints
+  inline bool check(uint64_t cycle) {
+    return (cycle >= this->next_cycle) && this->on_reached(cycle);
+  }
+  inline bool empty() const {
+    return this->cycles.empty();
+  }
+
+private:
+  std::set<uint64_t> cycles;
+  uint64_t next_cycle; // UINT64_MAX if there are no breakpoints
+
+  bool on_reached(uint64_t cycle);
+};
+
 struct EmulatorDebuggerState {
-  std::set<uint32_t> breakpoints;
-  std::set<uint64_t> cycle_breakpoints;
+  BreakpointSet breakpoints;
+  // Execution breakpoints in this map only stop execution if the expression's
+  // value is nonzero. Each address here must also be in breakpoints.
+  std::unordered_map<uint32_t, DebuggerExpression> breakpoint_conditions;
+  CycleBreakpointSet cycle_breakpoints;
   uint64_t max_cycles;
   DebuggerMode mode;
   uint64_t trace_period;
@@ -108,6 +399,17 @@ struct EmulatorDebuggerState {
   bool print_memory_accesses;
 
   EmulatorDebuggerState();
+
+  // Adds an execution breakpoint, replacing any existing breakpoint at the
+  // same address. If condition is not empty, it's parsed as a
+  // DebuggerExpression and the breakpoint is conditional.
+  void add_breakpoint(uint32_t addr, const std::string& condition = "");
+  bool remove_breakpoint(uint32_t addr);
+
+  // Returns true if any of the debugger's per-instruction features are in use.
+  // When this is false, the debug hook doesn't need to be installed at all,
+  // which lets the emulators run their faster loops without hooks.
+  bool needs_debug_hook() const;
 };
 
 template <typename EmuT>
@@ -128,6 +430,14 @@ public:
       this->bound_emu = nullptr;
     }
   }
+  // Emulators only check for a debug hook when execution begins, so this
+  // should be called just before then. It unbinds the debugger unless its
+  // state requires the hook.
+  void unbind_if_not_needed() {
+    if (!this->state.needs_debug_hook()) {
+      this->unbind();
+    }
+  }
 
 private:
   bool should_print_state_header;
@@ -138,6 +448,22 @@ private:
     }
   }
 
+  // Evaluates the breakpoint's condition, if it has one. If the condition
+  // can't be evaluated (e.g. it reads unmapped memory), stops anyway.
+  bool should_break_at(EmuT& emu, uint32_t addr) {
+    auto it = this->state.breakpoint_conditions.find(addr);
+    if (it == this->state.breakpoint_conditions.end()) {
+      return true;
+    }
+    try {
+      return it->second.evaluate(emu) != 0;
+    } catch (const std::exception& e) {
+      fprintf(stderr, "cannot evaluate breakpoint condition \"%s\": %s\n",
+          it->second.str().c_str(), e.what());
+      return true;
+    }
+  }
+
   void debug_hook(EmuT& emu) {
     auto mem = emu.memory();
     auto& regs = emu.registers();
@@ -147,10 +473,10 @@ private:
       throw typename EmuT::terminate_emulation();
     }
 
-    if (this->state.cycle_breakpoints.erase(emu.cycles())) {
+    if (this->state.cycle_breakpoints.check(emu.cycles())) {
       fprintf(stderr, "reached cycle breakpoint at %08" PRIX64 "\n", emu.cycles());
       this->state.mode = DebuggerMode::STEP;
-    } else if (this->state.breakpoints.count(regs.pc)) {
+    } else if (this->state.breakpoints.contains(regs.pc) && this->should_break_at(emu, regs.pc)) {
       fprintf(stderr, "reached execution breakpoint at %08" PRIX32 "\n", regs.pc);
       this->state.mode = DebuggerMode::STEP;
     }
@@ -166,20 +492,7 @@ private:
       auto accesses = emu.get_and_clear_memory_access_log();
       if (this->state.print_memory_accesses) {
         for (const auto& acc : accesses) {
-          const char* type_name = "unknown";
-          if (acc.size == 8) {
-            type_name = "byte";
-          } else if (acc.size == 16) {
-            type_name = "word";
-          } else if (acc.size == 32) {
-            type_name = "dword";
-          } else if (acc.size == 64) {
-            type_name = "qword";
-          } else if (acc.size == 128) {
-            type_name = "oword";
-          }
-          fprintf(stderr, "  memory: [%08" PRIX32 "] %s (%s)\n",
-              acc.addr, acc.is_write ? "<=" : "=>", type_name);
+          print_memory_access(stderr, acc);
         }
       }
       emu.print_state(stderr);
@@ -255,10 +568,18 @@ private:
     f DATA\n\
     find DATA\n\
       Search for DATA in all allocated memory.\n\
-    b ADDR\n\
-    break ADDR\n\
+    b ADDR [CONDITION]\n\
+    break ADDR [CONDITION]\n\
       Set an execution breakpoint at ADDR. When the emulator's PC register\n\
-      reaches this address, the emulator switches to single-step mode.\n\
+      reaches this address, the emulator switches to single-step mode. If\n\
+      CONDITION is given, the breakpoint only stops execution if CONDITION is\n\
+      nonzero. CONDITION is an expression like \"D0 == 3 && w[A0 + 4] != 0\";\n\
+      registers are specified by name (as for setreg), numbers are in hex and\n\
+      must begin with a digit, and b[ADDR], w[ADDR], and [ADDR] read 8-, 16-,\n\
+      and 32-bit values from memory. The operators are the same as in C.\n\
+    bl\n\
+    breakpoints\n\
+      List all execution breakpoints.\n\
     bc CYCLE\n\
     break-cycles CYCLE\n\
       Set an execution breakpoint at cycle CYCLE. When given number of opcodes\n\
@@ -283,9 +604,15 @@ private:
     ss FILENAME\n\
     savestate FILENAME\n\
       Save memory and emulation state to a file.\n\
+    si FILENAME [compress]\n\
+    saveimage FILENAME [compress]\n\
+      Save memory and emulation state to a file in the memory image format,\n\
+      which is faster to load. If compress is given, pages are compressed\n\
+      individually when that makes them smaller.\n\
     ls FILENAME\n\
     loadstate FILENAME\n\
-      Load memory and emulation state from a file.\n\
+      Load memory and emulation state from a file saved with either savestate\n\
+      or saveimage.\n\
     st WHAT [MAXDEPTH]\n\
     source-trace WHAT [MAXDEPTH]\n\
       Show where data came from. WHAT may be a register name or memory address.\n\
@@ -317,14 +644,15 @@ private:
           }
           const void* data = mem->template at<void>(addr, size);
 
-          std::multimap<uint32_t, std::string> labels;
-          for (const auto& symbol_it : mem->all_symbols()) {
-            if (symbol_it.second >= addr && symbol_it.second < addr + size) {
-              labels.emplace(symbol_it.second, symbol_it.first);
-            }
+          LabelIndex labels;
+          const auto& symbols = mem->symbol_index();
+          for (auto it = symbols.lower_bound(addr);
+               (it != symbols.end()) && (it->addr < static_cast<uint64_t>(addr) + size);
+               it++) {
+            labels.add(it->addr, *it->name);
           }
           uint32_t pc = regs.pc;
-          labels.emplace(pc, "pc");
+          labels.add(pc, "pc");
 
           std::string disassembly = EmuT::disassemble(data, size, addr, &labels);
           try {
@@ -388,22 +716,34 @@ private:
           emu.print_state(stderr);
 
         } else if ((cmd == "b") || (cmd == "break")) {
-          uint32_t addr = stoul(args, nullptr, 16);
-          this->state.breakpoints.emplace(addr);
+          auto tokens = split(args, ' ', 1);
+          uint32_t addr = stoul(tokens.at(0), nullptr, 16);
+          this->state.add_breakpoint(addr, (tokens.size() > 1) ? tokens[1] : "");
           fprintf(stderr, "added breakpoint at %08" PRIX32 "\n", addr);
 
+        } else if ((cmd == "bl") || (cmd == "breakpoints")) {
+          for (uint32_t addr : this->state.breakpoints.all()) {
+            auto cond_it = this->state.breakpoint_conditions.find(addr);
+            if (cond_it == this->state.breakpoint_conditions.end()) {
+              fprintf(stderr, "breakpoint at %08" PRIX32 "\n", addr);
+            } else {
+              fprintf(stderr, "breakpoint at %08" PRIX32 " if %s\n",
+                  addr, cond_it->second.str().c_str());
+            }
+          }
+
         } else if ((cmd == "bc") || (cmd == "break-cycles")) {
           uint64_t count = stoull(args, nullptr, 16);
           if (count <= emu.cycles()) {
             fprintf(stderr, "cannot add cycle breakpoint at or before current cycle count\n");
           } else {
-            this->state.cycle_breakpoints.emplace(count);
+            this->state.cycle_breakpoints.add(count);
             fprintf(stderr, "added cycle breakpoint at %08" PRIX64 "\n", count);
           }
 
         } else if ((cmd == "u") || (cmd == "unbreak")) {
           uint32_t addr = args.empty() ? regs.pc : stoul(args, nullptr, 16);
-          if (!this->state.breakpoints.erase(addr)) {
+          if (!this->state.remove_breakpoint(addr)) {
             fprintf(stderr, "no breakpoint existed at %08" PRIX32 "\n", addr);
           } else {
             fprintf(stderr, "deleted breakpoint at %08" PRIX32 "\n", addr);
@@ -411,7 +751,7 @@ private:
 
         } else if ((cmd == "uc") || (cmd == "unbreak-cycles")) {
           uint64_t count = stoull(args, nullptr, 16);
-          if (!this->state.cycle_breakpoints.erase(count)) {
+          if (!this->state.cycle_breakpoints.remove(count)) {
             fprintf(stderr, "no cycle breakpoint existed at %08" PRIX64 "\n", count);
           } else {
             fprintf(stderr, "deleted cycle breakpoint at %08" PRIX64 "\n", count);
@@ -427,9 +767,20 @@ private:
           auto f = fopen_unique(args, "wb");
           emu.export_state(f.get());
 
+        } else if ((cmd == "si") || (cmd == "saveimage")) {
+          auto tokens = split(args, ' ');
+          if ((tokens.size() > 2) || ((tokens.size() == 2) && (tokens[1] != "compress"))) {
+            throw std::invalid_argument("invalid arguments");
+          }
+          emu.export_image(tokens.at(0), tokens.size() == 2);
+
         } else if ((cmd == "ls") || (cmd == "loadstate")) {
-          auto f = fopen_unique(args, "rb");
-          emu.import_state(f.get());
+          if (MemoryContext::is_image_file(args)) {
+            emu.import_image(args);
+          } else {
+            auto f = fopen_unique(args, "rb");
+            emu.import_state(f.get());
+          }
           this->print_state_header(emu);
           emu.print_state(stderr);
 
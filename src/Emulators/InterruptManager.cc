@@ -37,9 +37,7 @@ shared_ptr<InterruptManager::PendingCall> InterruptManager::add(
   return ret;
 }
 
-void InterruptManager::on_cycle_start() {
-  this->cycle_count++;
-
+void InterruptManager::run_due_calls() {
   while (this->head.get() && (this->head->at_cycle_count <= this->cycle_count)) {
     shared_ptr<PendingCall> c = this->head;
     this->head = c->next;
@@ -26,11 +26,26 @@ public:
 
   std::shared_ptr<PendingCall> add(uint64_t cycle_count, std::function<bool()> fn);
 
-  void on_cycle_start();
+  // This is called on every emulated cycle, so the common case (no calls are
+  // due yet) is inlined
+  inline void on_cycle_start() {
+    this->cycle_count++;
+    if (this->head.get() && (this->head->at_cycle_count <= this->cycle_count)) {
+      this->run_due_calls();
+    }
+  }
+
+  // Returns true if calling on_cycle_start count more times could run any
+  // calls. Emulators use this to run several instructions as a single step.
+  inline bool has_calls_due_within(uint64_t count) const {
+    return this->head.get() && (this->head->at_cycle_count <= this->cycle_count + count);
+  }
 
   uint64_t cycles() const;
 
 protected:
   uint64_t cycle_count;
   std::shared_ptr<PendingCall> head;
+
+  void run_due_calls();
 };
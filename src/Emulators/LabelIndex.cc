@@ -0,0 +1,111 @@
+#include "LabelIndex.hh"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <phosg/Strings.hh>
+
+using namespace std;
+
+
+
+LabelIndex::LabelIndex(const multimap<uint32_t, string>& labels) {
+  // The multimap is already sorted, so this doesn't need to sort again
+  this->labels.reserve(labels.size());
+  for (const auto& it : labels) {
+    this->add(it.first, it.second);
+  }
+}
+
+LabelIndex::LabelIndex(const LabelIndex& other) {
+  this->add(other);
+}
+
+LabelIndex& LabelIndex::operator=(const LabelIndex& other) {
+  if (this != &other) {
+    this->clear();
+    this->add(other);
+  }
+  return *this;
+}
+
+void LabelIndex::add(uint32_t addr, const string& name) {
+  // The names are stored in a node-based set, so pointers to them remain valid
+  // when the set is rehashed
+  const string* interned_name = &*this->names.emplace(name).first;
+  if (!this->labels.empty() && (this->labels.back().addr > addr)) {
+    this->sorted = false;
+  }
+  this->labels.emplace_back(Label{addr, interned_name});
+}
+
+void LabelIndex::add(const LabelIndex& other) {
+  this->labels.reserve(this->labels.size() + other.size());
+  for (const auto& label : other) {
+    this->add(label.addr, *label.name);
+  }
+}
+
+void LabelIndex::clear() {
+  this->labels.clear();
+  this->names.clear();
+  this->sorted = true;
+}
+
+void LabelIndex::sort() const {
+  if (!this->sorted) {
+    stable_sort(this->labels.begin(), this->labels.end(),
+        [](const Label& a, const Label& b) { return a.addr < b.addr; });
+    this->sorted = true;
+  }
+}
+
+const LabelIndex::Label* LabelIndex::begin() const {
+  this->sort();
+  return this->labels.data();
+}
+
+const LabelIndex::Label* LabelIndex::end() const {
+  this->sort();
+  return this->labels.data() + this->labels.size();
+}
+
+const LabelIndex::Label* LabelIndex::lower_bound(uint32_t addr) const {
+  return std::lower_bound(this->begin(), this->end(), addr,
+      [](const Label& label, uint32_t addr) { return label.addr < addr; });
+}
+
+const LabelIndex::Label* LabelIndex::upper_bound(uint32_t addr) const {
+  return std::upper_bound(this->begin(), this->end(), addr,
+      [](uint32_t addr, const Label& label) { return addr < label.addr; });
+}
+
+pair<const LabelIndex::Label*, const LabelIndex::Label*> LabelIndex::equal_range(
+    uint32_t addr) const {
+  return make_pair(this->lower_bound(addr), this->upper_bound(addr));
+}
+
+const LabelIndex::Label* LabelIndex::nearest_at_or_before(uint32_t addr) const {
+  const Label* it = this->upper_bound(addr);
+  return (it == this->begin()) ? nullptr : (it - 1);
+}
+
+string LabelIndex::describe_addr(uint32_t addr) const {
+  const Label* label = this->nearest_at_or_before(addr);
+  if (!label) {
+    return "";
+  }
+  string ret = *label->name;
+  if (label->addr != addr) {
+    ret += string_printf("+%" PRIX32, addr - label->addr);
+  }
+  return ret;
+}
+
+multimap<uint32_t, string> LabelIndex::as_multimap() const {
+  multimap<uint32_t, string> ret;
+  for (const auto& label : *this) {
+    ret.emplace_hint(ret.end(), label.addr, *label.name);
+  }
+  return ret;
+}
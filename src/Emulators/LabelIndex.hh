@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+
+
+// A sorted, flat index of labels (address/name pairs), used by the
+// disassemblers and for symbolizing addresses. Names are interned, so
+// repeated names are only stored once, and the labels themselves are a single
+// sorted vector, so lookups are binary searches instead of tree walks. Like a
+// multimap, multiple labels may have the same address; they're kept in the
+// order they were added.
+//
+// Labels can be added in any order. The index is sorted (if needed) the next
+// time it's queried, so an index that's being built shouldn't be queried from
+// multiple threads at once; call sort() before sharing it between threads.
+class LabelIndex {
+public:
+  struct Label {
+    uint32_t addr;
+    const std::string* name; // Points into names, so it's never null
+  };
+
+  LabelIndex() = default;
+  explicit LabelIndex(const std::multimap<uint32_t, std::string>& labels);
+  LabelIndex(const LabelIndex& other);
+  LabelIndex(LabelIndex&&) = default;
+  LabelIndex& operator=(const LabelIndex& other);
+  LabelIndex& operator=(LabelIndex&&) = default;
+  ~LabelIndex() = default;
+
+  void add(uint32_t addr, const std::string& name);
+  void add(const LabelIndex& other);
+  void clear();
+
+  inline size_t size() const {
+    return this->labels.size();
+  }
+  inline bool empty() const {
+    return this->labels.empty();
+  }
+
+  // Sorts the index, if any labels were added since the last time it was
+  // sorted. All of the query functions below do this automatically.
+  void sort() const;
+
+  // These behave like the multimap functions of the same names, but return
+  // pointers into a sorted array instead of iterators.
+  const Label* begin() const;
+  const Label* end() const;
+  const Label* lower_bound(uint32_t addr) const;
+  const Label* upper_bound(uint32_t addr) const;
+  std::pair<const Label*, const Label*> equal_range(uint32_t addr) const;
+
+  // Returns the last label whose address is less than or equal to addr (if
+  // there are multiple labels at that address, returns the last one added), or
+  // null if there's no such label.
+  const Label* nearest_at_or_before(uint32_t addr) const;
+
+  // Returns the name of the label at or before addr, with an offset appended
+  // if it's before addr (e.g. "start+1C"), or an empty string if there's no
+  // such label.
+  std::string describe_addr(uint32_t addr) const;
+
+  std::multimap<uint32_t, std::string> as_multimap() const;
+
+private:
+  std::unordered_set<std::string> names;
+  mutable std::vector<Label> labels;
+  mutable bool sorted = true;
+};
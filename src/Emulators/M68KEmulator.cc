@@ -252,6 +252,11 @@ M68KRegisters::M68KRegisters() {
   }
   this->pc = 0;
   this->sr = 0;
+  this->pending_ccr_op = PendingCCROp::NONE;
+  this->pending_ccr_sets_x = false;
+  this->pending_ccr_size = SIZE_LONG;
+  this->pending_ccr_left_value = 0;
+  this->pending_ccr_right_value = 0;
 }
 
 void M68KRegisters::import_state(FILE* stream) {
@@ -267,7 +272,7 @@ void M68KRegisters::import_state(FILE* stream) {
     this->a[x] = freadx<le_uint32_t>(stream);
   }
   this->pc = freadx<le_uint32_t>(stream);
-  this->sr = freadx<le_uint16_t>(stream);
+  this->set_sr(freadx<le_uint16_t>(stream));
   if (version == 0) {
     // Version 0 had two extra registers (debug read and write addresses). These
     // no longer exist, so skip them.
@@ -285,7 +290,7 @@ void M68KRegisters::export_state(FILE* stream) const {
     fwritex<le_uint32_t>(stream, this->a[x]);
   }
   fwritex<le_uint32_t>(stream, this->pc);
-  fwritex<le_uint16_t>(stream, this->sr);
+  fwritex<le_uint16_t>(stream, this->get_sr());
 }
 
 void M68KRegisters::set_by_name(const string& reg_name, uint32_t value) {
@@ -302,6 +307,28 @@ void M68KRegisters::set_by_name(const string& reg_name, uint32_t value) {
   }
 }
 
+uint32_t M68KRegisters::get_by_name(const string& reg_name) const {
+  string name_lower = tolower(reg_name);
+  if (name_lower == "pc") {
+    return this->pc;
+  } else if (name_lower == "sr") {
+    return this->get_sr();
+  } else if (name_lower == "ccr") {
+    return this->get_sr() & 0x1F;
+  }
+  if ((name_lower.size() != 2) || (name_lower[1] < '0') || (name_lower[1] > '7')) {
+    throw invalid_argument("invalid register name");
+  }
+  uint8_t reg_num = name_lower[1] - '0';
+  if (name_lower[0] == 'a') {
+    return this->a[reg_num];
+  } else if (name_lower[0] == 'd') {
+    return this->d[reg_num].u;
+  } else {
+    throw invalid_argument("invalid register name");
+  }
+}
+
 uint32_t M68KRegisters::get_reg_value(bool is_a_reg, uint8_t reg_num) {
   if (is_a_reg) {
     return this->a[reg_num];
@@ -310,8 +337,57 @@ uint32_t M68KRegisters::get_reg_value(bool is_a_reg, uint8_t reg_num) {
   }
 }
 
+uint16_t M68KRegisters::get_sr() const {
+  if (this->pending_ccr_op == PendingCCROp::NONE) {
+    return this->sr;
+  }
+
+  int32_t left_value = sign_extend(this->pending_ccr_left_value, this->pending_ccr_size);
+  int32_t right_value = sign_extend(this->pending_ccr_right_value, this->pending_ccr_size);
+  int32_t result;
+  bool overflow, carry;
+  if (this->pending_ccr_op == PendingCCROp::ADD) {
+    result = sign_extend(left_value + right_value, this->pending_ccr_size);
+    overflow = (((left_value > 0) && (right_value > 0) && (result < 0)) ||
+         ((left_value < 0) && (right_value < 0) && (result > 0)));
+
+    // This looks kind of dumb, but it's necessary to force the compiler not to
+    // sign-extend the 32-bit ints when converting to 64-bit
+    uint64_t left_value_c = static_cast<uint32_t>(left_value);
+    uint64_t right_value_c = static_cast<uint32_t>(right_value);
+    carry = (left_value_c + right_value_c) > 0xFFFFFFFF;
+
+  } else {
+    result = sign_extend(left_value - right_value, this->pending_ccr_size);
+    overflow = (((left_value > 0) && (right_value < 0) && (result < 0)) ||
+         ((left_value < 0) && (right_value > 0) && (result > 0)));
+    carry = (static_cast<uint32_t>(left_value) < static_cast<uint32_t>(right_value));
+  }
+
+  uint16_t flags = ((result < 0) ? Condition::N : 0) |
+      ((result == 0) ? Condition::Z : 0) |
+      (overflow ? Condition::V : 0) |
+      (carry ? Condition::C : 0);
+  if (this->pending_ccr_sets_x) {
+    return (this->sr & 0xFFE0) | (carry ? Condition::X : 0) | flags;
+  } else {
+    return (this->sr & 0xFFF0) | flags;
+  }
+}
+
 void M68KRegisters::set_ccr_flags(int64_t x, int64_t n, int64_t z, int64_t v,
     int64_t c) {
+  if (this->pending_ccr_op != PendingCCROp::NONE) {
+    // If all of the flags the pending operation would set are being replaced,
+    // they never need to be computed
+    if ((n >= 0) && (z >= 0) && (v >= 0) && (c >= 0) &&
+        ((x >= 0) || !this->pending_ccr_sets_x)) {
+      this->pending_ccr_op = PendingCCROp::NONE;
+    } else {
+      this->resolve_sr();
+    }
+  }
+
   uint16_t mask = 0xFFFF;
   uint16_t replace = 0x0000;
 
@@ -328,34 +404,38 @@ void M68KRegisters::set_ccr_flags(int64_t x, int64_t n, int64_t z, int64_t v,
   this->sr = (this->sr & mask) | replace;
 }
 
-void M68KRegisters::set_ccr_flags_integer_add(int32_t left_value,
-    int32_t right_value, uint8_t size) {
-  left_value = sign_extend(left_value, size);
-  right_value = sign_extend(right_value, size);
-  int32_t result = sign_extend(left_value + right_value, size);
-
-  bool overflow = (((left_value > 0) && (right_value > 0) && (result < 0)) ||
-       ((left_value < 0) && (right_value < 0) && (result > 0)));
-
-  // This looks kind of dumb, but it's necessary to force the compiler not to
-  // sign-extend the 32-bit ints when converting to 64-bit
-  uint64_t left_value_c = static_cast<uint32_t>(left_value);
-  uint64_t right_value_c = static_cast<uint32_t>(right_value);
-  bool carry = (left_value_c + right_value_c) > 0xFFFFFFFF;
+static void check_ccr_size(uint8_t size) {
+  if (size > SIZE_LONG) {
+    throw runtime_error("incorrect size in sign_extend");
+  }
+}
 
-  this->set_ccr_flags(-1, (result < 0), (result == 0), overflow, carry);
+void M68KRegisters::set_ccr_flags_integer_add(int32_t left_value,
+    int32_t right_value, uint8_t size, bool update_x) {
+  check_ccr_size(size);
+  // The new operation replaces N, Z, V, and C, but if the pending one would
+  // set X and this one doesn't, X has to be computed first
+  if ((this->pending_ccr_op != PendingCCROp::NONE) && this->pending_ccr_sets_x && !update_x) {
+    this->resolve_sr();
+  }
+  this->pending_ccr_op = PendingCCROp::ADD;
+  this->pending_ccr_sets_x = update_x;
+  this->pending_ccr_size = size;
+  this->pending_ccr_left_value = left_value;
+  this->pending_ccr_right_value = right_value;
 }
 
 void M68KRegisters::set_ccr_flags_integer_subtract(int32_t left_value,
-    int32_t right_value, uint8_t size) {
-  left_value = sign_extend(left_value, size);
-  right_value = sign_extend(right_value, size);
-  int32_t result = sign_extend(left_value - right_value, size);
-
-  bool overflow = (((left_value > 0) && (right_value < 0) && (result < 0)) ||
-       ((left_value < 0) && (right_value > 0) && (result > 0)));
-  bool carry = (static_cast<uint32_t>(left_value) < static_cast<uint32_t>(right_value));
-  this->set_ccr_flags(-1, (result < 0), (result == 0), overflow, carry);
+    int32_t right_value, uint8_t size, bool update_x) {
+  check_ccr_size(size);
+  if ((this->pending_ccr_op != PendingCCROp::NONE) && this->pending_ccr_sets_x && !update_x) {
+    this->resolve_sr();
+  }
+  this->pending_ccr_op = PendingCCROp::SUBTRACT;
+  this->pending_ccr_sets_x = update_x;
+  this->pending_ccr_size = size;
+  this->pending_ccr_left_value = left_value;
+  this->pending_ccr_right_value = right_value;
 }
 
 uint32_t M68KRegisters::pop_u32(shared_ptr<const MemoryContext> mem) {
@@ -452,9 +532,17 @@ void M68KRegisters::write_stack_s8(shared_ptr<MemoryContext> mem, int8_t v) {
 
 
 
-M68KEmulator::M68KEmulator(shared_ptr<MemoryContext> mem) : EmulatorBase(mem) { }
+M68KEmulator::M68KEmulator(shared_ptr<MemoryContext> mem)
+  : EmulatorBase(mem), fetch_range({0, 0, nullptr}),
+    fetch_range_generation(0xFFFFFFFFFFFFFFFF),
+    running_block_start(0),
+    running_block_end(0),
+    running_block_modified(false) { }
 
 M68KRegisters& M68KEmulator::registers() {
+  // Callers (e.g. syscall handlers) may read sr directly, so compute any
+  // pending flags first
+  this->regs.resolve_sr();
   return this->regs;
 }
 
@@ -477,6 +565,7 @@ void M68KEmulator::print_state(FILE* stream) const {
   }
 
   string disassembly = this->disassemble_one(pc_data, pc_data_available, this->regs.pc);
+  uint16_t sr = this->regs.get_sr();
 
   fprintf(stream, "\
 %08" PRIX32 " %08" PRIX32 " %08" PRIX32 " %08" PRIX32 " %08" PRIX32 " %08" PRIX32 " %08" PRIX32 " %08" PRIX32 "  \
@@ -486,9 +575,9 @@ void M68KEmulator::print_state(FILE* stream) const {
       this->regs.d[4].u, this->regs.d[5].u, this->regs.d[6].u, this->regs.d[7].u,
       this->regs.a[0], this->regs.a[1], this->regs.a[2], this->regs.a[3],
       this->regs.a[4], this->regs.a[5], this->regs.a[6], this->regs.a[7],
-      ((this->regs.sr & 0x10) ? 'x' : '-'), ((this->regs.sr & 0x08) ? 'n' : '-'),
-      ((this->regs.sr & 0x04) ? 'z' : '-'), ((this->regs.sr & 0x02) ? 'v' : '-'),
-      ((this->regs.sr & 0x01) ? 'c' : '-'), this->regs.pc, disassembly.c_str());
+      ((sr & 0x10) ? 'x' : '-'), ((sr & 0x08) ? 'n' : '-'),
+      ((sr & 0x04) ? 'z' : '-'), ((sr & 0x02) ? 'v' : '-'),
+      ((sr & 0x01) ? 'c' : '-'), this->regs.pc, disassembly.c_str());
 }
 
 
@@ -522,11 +611,25 @@ uint32_t M68KEmulator::read(const ResolvedAddress& addr, uint8_t size) const {
   } else if (addr.location == ResolvedAddress::Location::MEMORY) {
     return this->read(addr.addr, size);
   } else { // Location::SR
-    return this->regs.sr;
+    return this->regs.get_sr();
   }
 }
 
 uint32_t M68KEmulator::read(uint32_t addr, uint8_t size) const {
+  // In a direct-mapped context, the guest address is just an offset; there's
+  // no need to look up (or check) the arena
+  const uint8_t* direct_base = this->mem->get_direct_base();
+  if (direct_base) {
+    const uint8_t* p = direct_base + addr;
+    if (size == SIZE_BYTE) {
+      return *p;
+    } else if (size == SIZE_WORD) {
+      return *reinterpret_cast<const be_uint16_t*>(p);
+    } else if (size == SIZE_LONG) {
+      return *reinterpret_cast<const be_uint32_t*>(p);
+    }
+  }
+
   if (size == SIZE_BYTE) {
     return this->mem->read_u8(addr);
   } else if (size == SIZE_WORD) {
@@ -562,11 +665,33 @@ void M68KEmulator::write(const ResolvedAddress& addr, uint32_t value, uint8_t si
   } else if (addr.location == ResolvedAddress::Location::MEMORY) {
     this->write(addr.addr, value, size);
   } else { // Location::SR
-    this->regs.sr = value;
+    this->regs.set_sr(value);
   }
 }
 
 void M68KEmulator::write(uint32_t addr, uint32_t value, uint8_t size) {
+  // If a translated block writes to its own code, it has to stop so the
+  // interpreter runs the new code. running_block_end is 0 when no block is
+  // running, so this is false in that case.
+  if ((addr < this->running_block_end) && (addr + (1 << size) > this->running_block_start)) {
+    this->running_block_modified = true;
+  }
+
+  uint8_t* direct_base = this->mem->get_direct_base();
+  if (direct_base) {
+    uint8_t* p = direct_base + addr;
+    if (size == SIZE_BYTE) {
+      *p = value;
+      return;
+    } else if (size == SIZE_WORD) {
+      *reinterpret_cast<be_uint16_t*>(p) = value;
+      return;
+    } else if (size == SIZE_LONG) {
+      *reinterpret_cast<be_uint32_t*>(p) = value;
+      return;
+    }
+  }
+
   if (size == SIZE_BYTE) {
     this->mem->write_u8(addr, value);
   } else if (size == SIZE_WORD) {
@@ -586,19 +711,40 @@ int16_t M68KEmulator::fetch_instruction_word_signed(bool advance) {
   return static_cast<int16_t>(this->fetch_instruction_data(SIZE_WORD, advance));
 }
 
+const uint8_t* M68KEmulator::fetch_ptr(uint32_t addr, size_t size) {
+  const uint8_t* direct_base = this->mem->get_direct_base();
+  if (direct_base) {
+    return direct_base + addr;
+  }
+  if ((this->fetch_range_generation != this->mem->get_layout_generation()) ||
+      (addr < this->fetch_range.addr) ||
+      (static_cast<uint64_t>(addr) + size > this->fetch_range.end_addr)) {
+    this->fetch_range = this->mem->host_range_for_addr(addr);
+    this->fetch_range_generation = this->mem->get_layout_generation();
+    // If the read spans multiple ranges, let MemoryContext throw the
+    // appropriate exception
+    if (static_cast<uint64_t>(addr) + size > this->fetch_range.end_addr) {
+      return this->mem->at<uint8_t>(addr, size);
+    }
+  }
+  return this->fetch_range.host_addr + (addr - this->fetch_range.addr);
+}
+
 uint32_t M68KEmulator::fetch_instruction_data(uint8_t size, bool advance) {
   if (size == SIZE_BYTE) {
-    uint32_t ret = this->mem->read<uint8_t>(this->regs.pc);
+    uint32_t ret = *this->fetch_ptr(this->regs.pc, 1);
     this->regs.pc += (1 * advance);
     return ret;
 
   } else if (size == SIZE_WORD) {
-    uint32_t ret = this->mem->read<be_uint16_t>(this->regs.pc);
+    uint32_t ret = *reinterpret_cast<const be_uint16_t*>(
+        this->fetch_ptr(this->regs.pc, 2));
     this->regs.pc += (2 * advance);
     return ret;
 
   } else if (size == SIZE_LONG) {
-    uint32_t ret = this->mem->read<be_uint32_t>(this->regs.pc);
+    uint32_t ret = *reinterpret_cast<const be_uint32_t*>(
+        this->fetch_ptr(this->regs.pc, 4));
     this->regs.pc += (4 * advance);
     return ret;
   }
@@ -1167,39 +1313,40 @@ string M68KEmulator::dasm_address(StringReader& r, uint32_t opcode_start_address
 
 bool M68KEmulator::check_condition(uint8_t condition) {
   // Bits in the CCR are xnzvc so e.g. 0x16 means x, z, and v are set
+  uint16_t sr = this->regs.resolve_sr();
   switch (condition) {
     case 0x00: // true
       return true;
     case 0x01: // false
       return false;
     case 0x02: // hi (high, unsigned greater; c=0 and z=0)
-      return (this->regs.sr & 0x0005) == 0;
+      return (sr & 0x0005) == 0;
     case 0x03: // ls (low or same, unsigned less or equal; c=1 or z=1)
-      return (this->regs.sr & 0x0005) != 0;
+      return (sr & 0x0005) != 0;
     case 0x04: // cc (carry clear; c=0)
-      return (this->regs.sr & 0x0001) == 0;
+      return (sr & 0x0001) == 0;
     case 0x05: // cs (carry set; c=1)
-      return (this->regs.sr & 0x0001) != 0;
+      return (sr & 0x0001) != 0;
     case 0x06: // ne (not equal; z=0)
-      return (this->regs.sr & 0x0004) == 0;
+      return (sr & 0x0004) == 0;
     case 0x07: // eq (equal; z=1)
-      return (this->regs.sr & 0x0004) != 0;
+      return (sr & 0x0004) != 0;
     case 0x08: // vc (overflow clear; v=0)
-      return (this->regs.sr & 0x0002) == 0;
+      return (sr & 0x0002) == 0;
     case 0x09: // vs (overflow set; v=1)
-      return (this->regs.sr & 0x0002) != 0;
+      return (sr & 0x0002) != 0;
     case 0x0A: // pl (plus; n=0)
-      return (this->regs.sr & 0x0008) == 0;
+      return (sr & 0x0008) == 0;
     case 0x0B: // mi (minus; n=1)
-      return (this->regs.sr & 0x0008) != 0;
+      return (sr & 0x0008) != 0;
     case 0x0C: // ge (greater or equal; n=v)
-      return ((this->regs.sr & 0x000A) == 0x0000) || ((this->regs.sr & 0x000A) == 0x000A);
+      return ((sr & 0x000A) == 0x0000) || ((sr & 0x000A) == 0x000A);
     case 0x0D: // lt (less; n!=v)
-      return ((this->regs.sr & 0x000A) == 0x0008) || ((this->regs.sr & 0x000A) == 0x0002);
+      return ((sr & 0x000A) == 0x0008) || ((sr & 0x000A) == 0x0002);
     case 0x0E: // gt (greater; n=v && z=0)
-      return ((this->regs.sr & 0x000E) == 0x000A) || ((this->regs.sr & 0x000E) == 0x0000);
+      return ((sr & 0x000E) == 0x000A) || ((sr & 0x000E) == 0x0000);
     case 0x0F: // le (less or equal; n!=v || z=1)
-      return ((this->regs.sr & 0x0004) == 0x0004) || ((this->regs.sr & 0x000A) == 0x0008) || ((this->regs.sr & 0x000A) == 0x0002);
+      return ((sr & 0x0004) == 0x0004) || ((sr & 0x000A) == 0x0008) || ((sr & 0x000A) == 0x0002);
     default:
       throw runtime_error("invalid condition code");
   }
@@ -1365,15 +1512,13 @@ void M68KEmulator::exec_0123(uint16_t opcode) {
       break;
 
     case 2: // subi ADDR, IMM
-      this->regs.set_ccr_flags_integer_subtract(mem_value, value, s);
-      this->regs.set_ccr_flags(this->regs.sr & 0x0001, -1, -1, -1, -1);
+      this->regs.set_ccr_flags_integer_subtract(mem_value, value, s, true);
       mem_value -= value;
       this->write(target, mem_value, s);
       break;
 
     case 3: // addi ADDR, IMM
-      this->regs.set_ccr_flags_integer_add(mem_value, value, s);
-      this->regs.set_ccr_flags(this->regs.sr & 0x0001, -1, -1, -1, -1);
+      this->regs.set_ccr_flags_integer_add(mem_value, value, s, true);
       mem_value += value;
       this->write(target, mem_value, s);
       break;
@@ -1570,14 +1715,14 @@ void M68KEmulator::exec_4(uint16_t opcode) {
           this->regs.a[7] += 4;
           return;
         case 6: // trapv
-          if (this->regs.sr & Condition::V) {
+          if (this->regs.resolve_sr() & Condition::V) {
             throw runtime_error("unimplemented: overflow trap");
           }
           return;
         case 7: // rtr
           // The supervisor portion (high byte) of SR is unaffected
-          this->regs.sr = (this->regs.sr & 0xFF00) |
-              (this->read(this->regs.a[7], SIZE_WORD) & 0x00FF);
+          this->regs.set_sr((this->regs.sr & 0xFF00) |
+              (this->read(this->regs.a[7], SIZE_WORD) & 0x00FF));
           this->regs.pc = this->read(this->regs.a[7] + 2, SIZE_LONG);
           this->regs.a[7] += 6;
           return;
@@ -1596,10 +1741,10 @@ void M68KEmulator::exec_4(uint16_t opcode) {
         if (a == 0) { // move.w ADDR, sr
           throw runtime_error("cannot read from sr in user mode");
         } else if (a == 1) { // move.w ccr, ADDR
-          this->regs.sr = (this->regs.sr & 0xFF00) | (this->read(addr, SIZE_WORD) & 0x001F);
+          this->regs.set_sr((this->regs.sr & 0xFF00) | (this->read(addr, SIZE_WORD) & 0x001F));
           return;
         } else if (a == 2) { // move.w ADDR, ccr
-          this->write(addr, this->regs.sr & 0x00FF, SIZE_WORD);
+          this->write(addr, this->regs.resolve_sr() & 0x00FF, SIZE_WORD);
           return;
         } else if (a == 3) { // move.w sr, ADDR
           throw runtime_error("cannot write to sr in user mode");
@@ -2066,15 +2211,17 @@ void M68KEmulator::exec_5(uint16_t opcode) {
     if (op_get_g(opcode)) {
       this->write(addr, mem_value - value, size);
       if (M != 1) {
-        this->regs.set_ccr_flags_integer_subtract(mem_value, value, size);
+        this->regs.set_ccr_flags_integer_subtract(mem_value, value, size, true);
       }
     } else {
       this->write(addr, mem_value + value, size);
       if (M != 1) {
-        this->regs.set_ccr_flags_integer_add(mem_value, value, size);
+        this->regs.set_ccr_flags_integer_add(mem_value, value, size, true);
       }
     }
-    this->regs.set_ccr_flags(this->regs.sr & 0x01, -1, -1, -1, -1);
+    if (M == 1) {
+      this->regs.set_ccr_flags(this->regs.resolve_sr() & 0x01, -1, -1, -1, -1);
+    }
   }
 }
 
@@ -2350,13 +2497,12 @@ void M68KEmulator::exec_9D(uint16_t opcode) {
 
     // TODO: should we sign-extend here? Is this always a long operation?
     if (is_add) {
-      this->regs.set_ccr_flags_integer_add(this->regs.a[dest], mem_value, SIZE_LONG);
+      this->regs.set_ccr_flags_integer_add(this->regs.a[dest], mem_value, SIZE_LONG, true);
       this->regs.a[dest] += mem_value;
     } else {
-      this->regs.set_ccr_flags_integer_subtract(this->regs.a[dest], mem_value, SIZE_LONG);
+      this->regs.set_ccr_flags_integer_subtract(this->regs.a[dest], mem_value, SIZE_LONG, true);
       this->regs.a[dest] -= mem_value;
     }
-    this->regs.set_ccr_flags(this->regs.sr & 0x01, -1, -1, -1, -1);
     return;
   }
 
@@ -2368,24 +2514,23 @@ void M68KEmulator::exec_9D(uint16_t opcode) {
   uint32_t reg_value = this->read({dest, ResolvedAddress::Location::D_REGISTER}, size);
   if (opmode & 4) {
     if (is_add) {
-      this->regs.set_ccr_flags_integer_add(mem_value, reg_value, size);
+      this->regs.set_ccr_flags_integer_add(mem_value, reg_value, size, true);
       mem_value += reg_value;
     } else {
-      this->regs.set_ccr_flags_integer_subtract(mem_value, reg_value, size);
+      this->regs.set_ccr_flags_integer_subtract(mem_value, reg_value, size, true);
       mem_value -= reg_value;
     }
     this->write(addr, mem_value, size);
   } else {
     if (is_add) {
-      this->regs.set_ccr_flags_integer_add(reg_value, mem_value, size);
+      this->regs.set_ccr_flags_integer_add(reg_value, mem_value, size, true);
       reg_value += mem_value;
     } else {
-      this->regs.set_ccr_flags_integer_subtract(reg_value, mem_value, size);
+      this->regs.set_ccr_flags_integer_subtract(reg_value, mem_value, size, true);
       reg_value -= mem_value;
     }
     this->write({dest, ResolvedAddress::Location::D_REGISTER}, reg_value, size);
   }
-  this->regs.set_ccr_flags(this->regs.sr & 0x01, -1, -1, -1, -1);
 }
 
 string M68KEmulator::dasm_9D(StringReader& r, uint32_t start_address, map<uint32_t, bool>&) {
@@ -2433,6 +2578,8 @@ string M68KEmulator::dasm_9D(StringReader& r, uint32_t start_address, map<uint32
 
 void M68KEmulator::exec_A(uint16_t opcode) {
   if (this->syscall_handler) {
+    ExecutionProfiler::SyscallScope scope(this->profiler.get(), opcode);
+    this->regs.resolve_sr();
     this->syscall_handler(*this, opcode);
   } else {
     this->exec_unimplemented(opcode);
@@ -2789,7 +2936,7 @@ void M68KEmulator::exec_E(uint16_t opcode) {
       bool logical_shift = (k & 2);
       bool rotate = (k & 4);
 
-      this->regs.sr &= 0xFFE0;
+      this->regs.set_sr(this->regs.sr & 0xFFE0);
       if (shift_amount == 0) {
         this->regs.set_ccr_flags(-1, is_negative(this->regs.d[Xn].u, SIZE_LONG),
             (this->regs.d[Xn].u == 0), 0, 0);
@@ -3045,6 +3192,8 @@ string M68KEmulator::dasm_E(StringReader& r, uint32_t start_address, map<uint32_
 void M68KEmulator::exec_F(uint16_t opcode) {
   // TODO: Implement floating-point opcodes here
   if (this->syscall_handler) {
+    ExecutionProfiler::SyscallScope scope(this->profiler.get(), opcode);
+    this->regs.resolve_sr();
     this->syscall_handler(*this, opcode);
   } else {
     this->exec_unimplemented(opcode);
@@ -3433,26 +3582,61 @@ string M68KEmulator::disassemble_one(const void* vdata, size_t size,
 }
 
 string M68KEmulator::disassemble(const void* vdata, size_t size,
-    uint32_t start_address, const multimap<uint32_t, string>* labels) {
-  static const multimap<uint32_t, string> empty_labels_map = {};
+    uint32_t start_address, const multimap<uint32_t, string>* labels,
+    size_t num_threads) {
   if (!labels) {
-    labels = &empty_labels_map;
+    return M68KEmulator::disassemble(vdata, size, start_address, static_cast<const LabelIndex*>(nullptr), num_threads);
   }
+  LabelIndex label_index(*labels);
+  return M68KEmulator::disassemble(vdata, size, start_address, &label_index, num_threads);
+}
 
-  map<uint32_t, bool> branch_target_addresses;
-  map<uint32_t, pair<string, uint32_t>> lines; // {pc: (line, next_pc)}
+string M68KEmulator::disassemble(const void* vdata, size_t size,
+    uint32_t start_address, const LabelIndex* labels, size_t num_threads) {
+  DisassemblyOutput out;
+  M68KEmulator::disassemble(out, vdata, size, start_address, labels, num_threads);
+  return out.take();
+}
+
+void M68KEmulator::disassemble(DisassemblyOutput& out, const void* vdata,
+    size_t size, uint32_t start_address, const LabelIndex* labels,
+    size_t num_threads) {
+  static const LabelIndex empty_labels;
+  if (!labels) {
+    labels = &empty_labels;
+  }
+  labels->sort();
 
   // Phase 1: generate the disassembly for each opcode, and collect branch
-  // target addresses
-  StringReader r(vdata, size);
-  while (!r.eof()) {
-    uint32_t pc = r.where() + start_address;
-    string line = string_printf("%08" PRIX32 " ", pc);
-    line += M68KEmulator::disassemble_one(r, start_address, branch_target_addresses);
-    line += '\n';
+  // target addresses. This is the only phase that runs on multiple threads;
+  // chunks begin only at word-aligned labels.
+  auto phase1_result = disassemble_chunked(start_address, size, *labels,
+      num_threads, 2, true, true, [&](DisassemblyChunk& chunk, uint32_t pc) -> uint32_t {
+    StringReader r(vdata, size);
+    r.go(pc - start_address);
+    map<uint32_t, bool> line_branch_target_addresses;
+    chunk.text.write_hex(pc, 8);
+    chunk.text.write(' ');
+    chunk.text.write(M68KEmulator::disassemble_one(r, start_address, line_branch_target_addresses));
+    chunk.text.write('\n');
     uint32_t next_pc = r.where() + start_address;
-    lines.emplace(pc, make_pair(move(line), next_pc));
+    chunk.add_line(pc, next_pc, line_branch_target_addresses);
+    return next_pc;
+  });
+
+  // The phase 1 results are sorted, so these inserts are constant-time
+  map<uint32_t, bool> branch_target_addresses;
+  for (const auto& it : phase1_result.branch_targets) {
+    branch_target_addresses.emplace_hint(branch_target_addresses.end(), it);
+  }
+  // Lines added by backups (below) append their text after phase 1's text
+  map<uint32_t, DisassemblyLine> lines;
+  for (const auto& line : phase1_result.lines) {
+    lines.emplace_hint(lines.end(), line.pc, line);
   }
+  phase1_result.lines.clear();
+  DisassemblyOutput text(move(phase1_result.text));
+  StringReader r(vdata, size);
 
   // Phase 2: handle backups. Because opcodes can be different lengths in the
   // 68K architecture, sometimes we mis-disassemble an opcode because it starts
@@ -3470,7 +3654,7 @@ string M68KEmulator::disassemble(const void* vdata, size_t size,
     }
   }
   for (const auto& label_it : *labels) {
-    uint32_t target_pc = label_it.first;
+    uint32_t target_pc = label_it.addr;
     if (!(target_pc & 1) &&
         (target_pc >= start_address) &&
         (target_pc < start_address + size) &&
@@ -3487,12 +3671,14 @@ string M68KEmulator::disassemble(const void* vdata, size_t size,
     r.go(pc - start_address);
 
     while (!lines.count(pc) && !r.eof()) {
-      string line = string_printf("%08" PRIX32 " ", pc);
+      size_t text_offset = text.size();
+      text.write_hex(pc, 8);
+      text.write(' ');
       map<uint32_t, bool> temp_branch_target_addresses;
-      line += M68KEmulator::disassemble_one(r, start_address, temp_branch_target_addresses);
-      line += '\n';
+      text.write(M68KEmulator::disassemble_one(r, start_address, temp_branch_target_addresses));
+      text.write('\n');
       uint32_t next_pc = r.where() + start_address;
-      lines.emplace(pc, make_pair(move(line), next_pc));
+      lines.emplace(pc, DisassemblyLine{pc, next_pc, text_offset, text.size() - text_offset});
       pc = next_pc;
 
       // If any new branch target addresses were generated, we may need to do
@@ -3512,56 +3698,30 @@ string M68KEmulator::disassemble(const void* vdata, size_t size,
     }
   }
 
-  // Phase 3: generate output lines, including passed-in labels, branch target
+  // Phase 3: write the output lines, including passed-in labels, branch target
   // labels, and alternate disassembly branches
-  size_t ret_bytes = 0;
-  deque<string> ret_lines;
   auto branch_target_it = branch_target_addresses.lower_bound(start_address);
   auto label_it = labels->lower_bound(start_address);
   auto backup_branch_it = backup_branches.begin();
 
-  auto add_line = [&](uint32_t pc, const string& line) {
-    for (; label_it != labels->end() && label_it->first <= pc; label_it++) {
-      string label;
-      if (label_it->first != pc) {
-        label = string_printf("%s: // at %08" PRIX32 " (misaligned)\n",
-              label_it->second.c_str(), label_it->first);
-      } else {
-        label = string_printf("%s:\n", label_it->second.c_str());
-      }
-      ret_bytes += label.size();
-      ret_lines.emplace_back(move(label));
+  auto add_line = [&](const DisassemblyLine& line) {
+    uint32_t pc = line.pc;
+    for (; label_it != labels->end() && label_it->addr <= pc; label_it++) {
+      write_disassembly_label(out, *label_it, pc);
     }
     for (; (branch_target_it != branch_target_addresses.end()) &&
            (branch_target_it->first <= pc);
          branch_target_it++) {
-      string label;
-      const char* label_type = branch_target_it->second ? "fn" : "label";
-      if (branch_target_it->first != pc) {
-        label = string_printf("%s%08" PRIX32 ": // (misaligned)\n",
-            label_type, branch_target_it->first);
-      } else {
-        label = string_printf("%s%08" PRIX32 ":\n",
-            label_type, branch_target_it->first);
-      }
-      ret_bytes += label.size();
-      ret_lines.emplace_back(move(label));
+      write_disassembly_branch_target_label(out, branch_target_it->first,
+          branch_target_it->second, pc);
     }
-
-    ret_bytes += line.size();
-    // TODO: we can eliminate this copy by making ret_lines instead keep
-    // references into the lines map. We can't just move the line contents into
-    // ret_lines here because disassembly lines may appear multiple times in
-    // the output. (Technically this should not be true, but I'm too lazy to
-    // verify as such right now.)
-    ret_lines.emplace_back(line);
+    out.write(text.str().data() + line.text_offset, line.text_size);
   };
 
   for (auto line_it = lines.begin();
        line_it != lines.end();
-       line_it = lines.find(line_it->second.second)) {
+       line_it = lines.find(line_it->second.next_pc)) {
     uint32_t pc = line_it->first;
-    string& line = line_it->second.first;
 
     // Write branches first, if there are any here
     for (; backup_branch_it != backup_branches.end() &&
@@ -3574,34 +3734,20 @@ string M68KEmulator::disassemble(const void* vdata, size_t size,
       branch_target_it = branch_target_addresses.lower_bound(start_pc);
       label_it = labels->lower_bound(start_pc);
 
-      string branch_start_comment = string_printf("// begin alternate branch %08X-%08X\n", start_pc, end_pc);
-      ret_bytes += branch_start_comment.size();
-      ret_lines.emplace_back(move(branch_start_comment));
-
+      out.write_printf("// begin alternate branch %08X-%08X\n", start_pc, end_pc);
       for (auto backup_line_it = lines.find(start_pc);
            (backup_line_it != lines.end()) && (backup_line_it->first != end_pc);
-           backup_line_it = lines.find(backup_line_it->second.second)) {
-        add_line(backup_line_it->first, backup_line_it->second.first);
+           backup_line_it = lines.find(backup_line_it->second.next_pc)) {
+        add_line(backup_line_it->second);
       }
-
-      string branch_end_comment = string_printf("// end alternate branch %08X-%08X\n", start_pc, end_pc);
-      ret_bytes += branch_end_comment.size();
-      ret_lines.emplace_back(move(branch_end_comment));
+      out.write_printf("// end alternate branch %08X-%08X\n", start_pc, end_pc);
 
       branch_target_it = orig_branch_target_it;
       label_it = orig_label_it;
     }
 
-    add_line(pc, line);
+    add_line(line_it->second);
   }
-
-  // Phase 4: assemble the output lines into a single string and return it
-  string ret;
-  ret.reserve(ret_bytes);
-  for (const auto& line : ret_lines) {
-    ret += line;
-  }
-  return ret;
 }
 
 
@@ -3610,29 +3756,191 @@ void M68KEmulator::print_source_trace(FILE*, const string&, size_t) const {
   throw runtime_error("source tracing is not implemented in M68KEmulator");
 }
 
+string M68KEmulator::name_for_syscall(uint32_t syscall) const {
+  if ((syscall & 0xF000) != 0xA000) {
+    return string_printf("F-line %04" PRIX32, syscall);
+  }
+  uint16_t trap_number;
+  uint8_t flags = 0;
+  if (syscall & 0x0800) {
+    trap_number = syscall & 0x0BFF;
+  } else {
+    trap_number = syscall & 0xFF;
+    flags = (syscall >> 8) & 7;
+  }
+  const auto* info = info_for_68k_trap(trap_number, flags);
+  if (info) {
+    return info->name;
+  }
+  return string_printf("trap %03hX", trap_number);
+}
+
+
+
+bool M68KEmulator::ends_basic_block(uint16_t opcode) {
+  return ((opcode & 0xF000) == 0x6000) || // bra/bsr/bCC
+      ((opcode & 0xF0F8) == 0x50C8) || // dbCC
+      ((opcode & 0xFFF0) == 0x4E40) || // trap
+      ((opcode & 0xFFF8) == 0x4E70) || // reset/nop/stop/rte/rtd/rts/trapv/rtr
+      ((opcode & 0xFF80) == 0x4E80) || // jsr/jmp
+      ((opcode & 0xE000) == 0xA000); // A-line and F-line (syscalls)
+}
 
+void M68KEmulator::translate_block(uint32_t addr, TranslatedBlock& block) {
+  block.generation = this->mem->get_layout_generation();
+  block.code.clear();
+  block.instructions.clear();
+  if (block.translation_count++ >= JIT_MAX_TRANSLATIONS) {
+    return;
+  }
+
+  MemoryContext::HostRange range;
+  try {
+    range = this->mem->host_range_for_addr(addr);
+  } catch (const exception&) {
+    return;
+  }
+  if ((addr < range.addr) || (addr >= range.end_addr)) {
+    return;
+  }
+  const uint8_t* code = range.host_addr + (addr - range.addr);
+  StringReader r(code, range.end_addr - addr);
+
+  // The disassembler is used to find each instruction's size. If it's wrong
+  // about an instruction, the block just stops there, since run_translated_block
+  // checks that the pc ends up where it should after each instruction.
+  map<uint32_t, bool> branch_target_addresses;
+  while ((block.instructions.size() < JIT_MAX_BLOCK_INSTRUCTIONS) && (r.remaining() >= 2)) {
+    size_t offset = r.where();
+    uint16_t opcode = r.get_u16b(false);
+    if ((opcode & 0xE000) == 0xA000) {
+      break;
+    }
+    try {
+      this->fns[(opcode >> 12) & 0x000F].dasm(r, addr + offset, branch_target_addresses);
+    } catch (const exception&) {
+      break;
+    }
+    size_t size = r.where() - offset;
+    if ((size < 2) || (size & 1) || (size > 0xFF)) {
+      break;
+    }
+    block.instructions.emplace_back(TranslatedInstruction{
+        this->fns[(opcode >> 12) & 0x000F].exec, opcode, static_cast<uint8_t>(size)});
+    if (ends_basic_block(opcode)) {
+      break;
+    }
+  }
+  block.code.assign(reinterpret_cast<const char*>(code), r.where());
+}
+
+bool M68KEmulator::run_translated_block() {
+  uint32_t addr = this->regs.pc;
+  auto it = this->translated_blocks.find(addr);
+  if (it == this->translated_blocks.end()) {
+    if (++this->block_entry_counts[addr] < JIT_HOT_BLOCK_THRESHOLD) {
+      return false;
+    }
+    this->block_entry_counts.erase(addr);
+    it = this->translated_blocks.emplace(addr, TranslatedBlock{0, 0, "", {}}).first;
+    this->translate_block(addr, it->second);
+  }
+
+  TranslatedBlock& block = it->second;
+  if (block.generation != this->mem->get_layout_generation()) {
+    this->translate_block(addr, block);
+  } else if (!block.code.empty() &&
+      memcmp(this->fetch_ptr(addr, block.code.size()), block.code.data(), block.code.size())) {
+    this->translate_block(addr, block);
+  }
+  if (block.instructions.empty()) {
+    return false;
+  }
+  // Interrupt calls can write to memory directly (not through write()), so
+  // they'd be able to change the block's code without it noticing. If any
+  // could run during the block, the interpreter runs it this time instead.
+  if (this->interrupt_manager->has_calls_due_within(block.instructions.size())) {
+    return false;
+  }
+
+  this->running_block_start = addr;
+  this->running_block_end = addr + block.code.size();
+  this->running_block_modified = false;
+  try {
+    uint32_t inst_addr = addr;
+    for (const auto& inst : block.instructions) {
+      // No interrupt calls are due (see above), so this only counts the cycle
+      this->interrupt_manager->on_cycle_start();
+      this->regs.pc = inst_addr + 2;
+      (this->*inst.exec)(inst.opcode);
+      this->instructions_executed++;
+      this->check_execution_limits();
+
+      inst_addr += inst.size;
+      if ((this->regs.pc != inst_addr) || this->running_block_modified) {
+        break;
+      }
+    }
+  } catch (...) {
+    this->running_block_end = 0;
+    throw;
+  }
+  this->running_block_end = 0;
+  return true;
+}
 
 void M68KEmulator::execute() {
   if (!this->interrupt_manager.get()) {
     this->interrupt_manager.reset(new InterruptManager());
   }
 
+  // The hooks are only checked here, so they must be set before execution
+  // begins (the debug hook may still change its own behavior while running)
+  if (this->debug_hook || this->profiler) {
+    this->execute_loop<true>();
+  } else {
+    this->execute_loop<false>();
+  }
+}
+
+template <bool EnableHooks>
+void M68KEmulator::execute_loop() {
+  // True if the next instruction begins a basic block
+  [[maybe_unused]] bool at_block_start = true;
   for (;;) {
     try {
-      // Call debug hook if present
-      if (this->debug_hook) {
-        this->debug_hook(*this);
+      if constexpr (!EnableHooks) {
+        if (this->jit_enabled && at_block_start && this->run_translated_block()) {
+          continue;
+        }
+      }
+
+      if constexpr (EnableHooks) {
+        // Call debug hook if present
+        if (this->debug_hook) {
+          this->debug_hook(*this);
+        }
       }
 
       // Call any timer interrupt functions scheduled for this cycle
       this->interrupt_manager->on_cycle_start();
 
+      if constexpr (EnableHooks) {
+        if (this->profiler) {
+          this->profiler->on_instruction(this->regs.pc);
+        }
+      }
+
       // Execute a cycle
       uint16_t opcode = this->fetch_instruction_word();
       auto fn = this->fns[(opcode >> 12) & 0x000F].exec;
       (this->*fn)(opcode);
 
       this->instructions_executed++;
+      this->check_execution_limits();
+      if constexpr (!EnableHooks) {
+        at_block_start = ends_basic_block(opcode);
+      }
 
     } catch (const terminate_emulation&) {
       break;
@@ -3641,18 +3949,26 @@ void M68KEmulator::execute() {
 }
 
 void M68KEmulator::import_state(FILE* stream) {
+  this->import_cpu_state(stream);
+  this->mem->import_state(stream);
+}
+
+void M68KEmulator::export_state(FILE* stream) const {
+  this->export_cpu_state(stream);
+  this->mem->export_state(stream);
+}
+
+void M68KEmulator::import_cpu_state(FILE* stream) {
   uint8_t version = freadx<uint8_t>(stream);
   if (version != 0) {
     throw runtime_error("unknown format version");
   }
 
   this->regs.import_state(stream);
-  this->mem->import_state(stream);
 }
 
-void M68KEmulator::export_state(FILE* stream) const {
+void M68KEmulator::export_cpu_state(FILE* stream) const {
   fwritex<uint8_t>(stream, 0); // version
 
   this->regs.export_state(stream);
-  this->mem->export_state(stream);
 }
@@ -8,6 +8,8 @@
 #include <set>
 #include <phosg/Strings.hh>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "EmulatorBase.hh"
 #include "MemoryContext.hh"
@@ -34,7 +36,27 @@ struct M68KRegisters {
   } d[8];
   uint32_t a[8];
   uint32_t pc;
-  uint16_t sr; // Note: low byte of this is the ccr (condition code register)
+  // Note: low byte of this is the ccr (condition code register). The integer
+  // add and subtract flags are computed lazily (see below), so sr may not be
+  // up to date; use get_sr or resolve_sr to read it and set_sr to write it.
+  uint16_t sr;
+
+  // Most instructions overwrite all of the N, Z, V, and C flags, so the flags
+  // set by one add or subtract are usually replaced before anything reads
+  // them. Instead of computing them immediately, set_ccr_flags_integer_add and
+  // set_ccr_flags_integer_subtract record the operation and its operands here,
+  // and the flags are only computed when something reads sr or changes only
+  // some of the flags.
+  enum class PendingCCROp : uint8_t {
+    NONE = 0,
+    ADD,
+    SUBTRACT,
+  };
+  PendingCCROp pending_ccr_op;
+  bool pending_ccr_sets_x;
+  uint8_t pending_ccr_size;
+  int32_t pending_ccr_left_value;
+  int32_t pending_ccr_right_value;
 
   M68KRegisters();
 
@@ -42,6 +64,7 @@ struct M68KRegisters {
   void export_state(FILE* stream) const;
 
   void set_by_name(const std::string& reg_name, uint32_t value);
+  uint32_t get_by_name(const std::string& reg_name) const;
 
   inline uint32_t get_sp() const {
     return this->a[7];
@@ -54,9 +77,31 @@ struct M68KRegisters {
 
   inline void reset_access_flags() const { }
 
+  // Returns sr with any pending flags computed, without changing the state.
+  uint16_t get_sr() const;
+  // Computes any pending flags and stores them in sr, then returns sr.
+  inline uint16_t resolve_sr() {
+    if (this->pending_ccr_op != PendingCCROp::NONE) {
+      this->sr = this->get_sr();
+      this->pending_ccr_op = PendingCCROp::NONE;
+    }
+    return this->sr;
+  }
+  // Replaces sr entirely, discarding any pending flags.
+  inline void set_sr(uint16_t sr) {
+    this->sr = sr;
+    this->pending_ccr_op = PendingCCROp::NONE;
+  }
+
+  // For each flag, a negative value leaves the flag unchanged, zero clears it,
+  // and a positive value sets it.
   void set_ccr_flags(int64_t x, int64_t n, int64_t z, int64_t v, int64_t c);
-  void set_ccr_flags_integer_add(int32_t left_value, int32_t right_value, uint8_t size);
-  void set_ccr_flags_integer_subtract(int32_t left_value, int32_t right_value, uint8_t size);
+  // These set N, Z, V, and C from the result of the operation (lazily), and
+  // also set X to the same value as C if update_x is true.
+  void set_ccr_flags_integer_add(int32_t left_value, int32_t right_value,
+      uint8_t size, bool update_x = false);
+  void set_ccr_flags_integer_subtract(int32_t left_value, int32_t right_value,
+      uint8_t size, bool update_x = false);
 
   uint32_t pop_u32(std::shared_ptr<const MemoryContext> mem);
   int32_t pop_s32(std::shared_ptr<const MemoryContext> mem);
@@ -90,6 +135,8 @@ public:
 
   virtual void import_state(FILE* stream);
   virtual void export_state(FILE* stream) const;
+  virtual void import_cpu_state(FILE* stream);
+  virtual void export_cpu_state(FILE* stream) const;
 
   M68KRegisters& registers();
 
@@ -108,7 +155,23 @@ public:
       const void* vdata,
       size_t size,
       uint32_t start_address = 0,
-      const std::multimap<uint32_t, std::string>* labels = nullptr);
+      const LabelIndex* labels = nullptr,
+      size_t num_threads = 1);
+  // Same as above, but converts labels to a LabelIndex first
+  static std::string disassemble(
+      const void* vdata,
+      size_t size,
+      uint32_t start_address,
+      const std::multimap<uint32_t, std::string>* labels,
+      size_t num_threads = 1);
+  // Same as above, but writes the disassembly to out instead of returning it
+  static void disassemble(
+      DisassemblyOutput& out,
+      const void* vdata,
+      size_t size,
+      uint32_t start_address = 0,
+      const LabelIndex* labels = nullptr,
+      size_t num_threads = 1);
 
   inline void set_syscall_handler(std::function<void(M68KEmulator&, uint16_t)> handler) {
     this->syscall_handler = handler;
@@ -124,6 +187,8 @@ public:
 
   virtual void print_source_trace(FILE* stream, const std::string& what, size_t max_depth = 0) const;
 
+  virtual std::string name_for_syscall(uint32_t syscall) const;
+
   virtual void execute();
 
 private:
@@ -158,11 +223,64 @@ private:
   void write(const ResolvedAddress& addr, uint32_t value, uint8_t size);
   void write(uint32_t addr, uint32_t value, uint8_t size);
 
+  // Instruction fetches read directly from this host range (the arena or
+  // allocated block containing the pc) instead of going through MemoryContext
+  // for every word. The range refers to emulated memory rather than a copy of
+  // it, so self-modifying code works; it's refreshed when the pc leaves it or
+  // when the memory layout changes.
+  MemoryContext::HostRange fetch_range;
+  uint64_t fetch_range_generation;
+  const uint8_t* fetch_ptr(uint32_t addr, size_t size);
+
   uint16_t fetch_instruction_word(bool advance = true);
   int16_t fetch_instruction_word_signed(bool advance = true);
   uint32_t fetch_instruction_data(uint8_t size, bool advance = true);
   int32_t fetch_instruction_data_signed(uint8_t size, bool advance = true);
 
+  // The JIT tier (see EmulatorBase::set_jit_enabled). The execute loop counts
+  // how many times each basic block is entered; once a block has been entered
+  // JIT_HOT_BLOCK_THRESHOLD times, it's translated into a list of predecoded
+  // opcodes and their handlers (threaded code), so the opcode fetch and
+  // dispatch are skipped when the block runs. Host machine code isn't
+  // generated; the handlers still fetch their own extension words. Blocks end
+  // at control flow instructions, and never include A-line or F-line opcodes,
+  // so syscalls always go through the interpreter. A block stops early if
+  // control leaves it (e.g. a taken branch) or if it writes to its own code.
+  // Its instructions' memory writes all go through write(), which checks for
+  // this. A block isn't run if an interrupt call could come due while it runs,
+  // since those can write to memory directly, so nothing else can change the
+  // block's code while it runs (except a trap handler, but traps always end
+  // blocks). Each block keeps a copy of its code, and is translated again if
+  // the code has changed when it's next entered; blocks that keep changing
+  // are left to the interpreter.
+  struct TranslatedInstruction {
+    void (M68KEmulator::*exec)(uint16_t);
+    uint16_t opcode;
+    uint8_t size;
+  };
+  struct TranslatedBlock {
+    uint64_t generation;
+    size_t translation_count;
+    std::string code;
+    // Empty if the block can't be translated
+    std::vector<TranslatedInstruction> instructions;
+  };
+  static constexpr uint32_t JIT_HOT_BLOCK_THRESHOLD = 16;
+  static constexpr size_t JIT_MAX_BLOCK_INSTRUCTIONS = 64;
+  static constexpr size_t JIT_MAX_TRANSLATIONS = 4;
+  std::unordered_map<uint32_t, uint32_t> block_entry_counts;
+  std::unordered_map<uint32_t, TranslatedBlock> translated_blocks;
+  // The code range of the block that's running, if any (end is 0 otherwise)
+  uint32_t running_block_start;
+  uint32_t running_block_end;
+  bool running_block_modified;
+
+  static bool ends_basic_block(uint16_t opcode);
+  void translate_block(uint32_t addr, TranslatedBlock& block);
+  // Returns false if there's no translated block at the pc (the interpreter
+  // should run the next instruction instead)
+  bool run_translated_block();
+
   uint32_t resolve_address_extension(uint16_t ext);
   uint32_t resolve_address_control(uint8_t M, uint8_t Xn);
   uint32_t resolve_address_jump(uint8_t M, uint8_t Xn);
@@ -229,4 +347,9 @@ private:
       std::map<uint32_t, bool>& branch_target_addresses);
 
   void execute_next_opcode();
+
+  // EnableHooks = false omits the debug hook and profiler checks; execute()
+  // uses that version when neither is set
+  template <bool EnableHooks>
+  void execute_loop();
 };
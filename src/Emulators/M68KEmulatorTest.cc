@@ -0,0 +1,156 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "M68KEmulator.hh"
+
+using namespace std;
+
+
+
+// These match the definitions in M68KEmulator.cc
+static constexpr uint8_t SIZE_BYTE = 0;
+static constexpr uint8_t SIZE_WORD = 1;
+static constexpr uint8_t SIZE_LONG = 2;
+
+static constexpr uint16_t C = 0x01;
+static constexpr uint16_t V = 0x02;
+static constexpr uint16_t Z = 0x04;
+static constexpr uint16_t N = 0x08;
+static constexpr uint16_t X = 0x10;
+
+static void check_add(uint32_t left, uint32_t right, uint8_t size, uint16_t expected_flags) {
+  M68KRegisters regs;
+  regs.set_sr(0x2700);
+  regs.set_ccr_flags_integer_add(left, right, size);
+  expect_eq(expected_flags, regs.get_sr() & 0x1F);
+  expect_eq(0x2700 | expected_flags, regs.resolve_sr());
+  expect_eq(0x2700 | expected_flags, regs.sr);
+
+  // With update_x, X is the same as C
+  regs.set_sr(0x2700);
+  regs.set_ccr_flags_integer_add(left, right, size, true);
+  expect_eq(expected_flags | ((expected_flags & C) ? X : 0), regs.get_sr() & 0x1F);
+}
+
+static void check_subtract(uint32_t left, uint32_t right, uint8_t size, uint16_t expected_flags) {
+  M68KRegisters regs;
+  regs.set_sr(0x2700);
+  regs.set_ccr_flags_integer_subtract(left, right, size);
+  expect_eq(expected_flags, regs.get_sr() & 0x1F);
+  expect_eq(0x2700 | expected_flags, regs.resolve_sr());
+
+  regs.set_sr(0x2700);
+  regs.set_ccr_flags_integer_subtract(left, right, size, true);
+  expect_eq(expected_flags | ((expected_flags & C) ? X : 0), regs.get_sr() & 0x1F);
+}
+
+// Runs an add whose flags are read by Scc instructions. The add's source and
+// one Scc's destination are in memory, so this also covers the emulator's
+// direct-mapped memory accesses when direct_mapped is true.
+static void check_execution(bool direct_mapped) {
+  static constexpr uint32_t code_addr = 0x1000;
+  static constexpr uint32_t data_addr = 0x2000;
+  // add.b (a0), d1; scs d2; svs d3; seq d4; seq (a0); (syscall)
+  static const string code("\xD2\x10\x55\xC2\x59\xC3\x57\xC4\x57\xD0\xA0\x00", 12);
+
+  auto mem = make_shared<MemoryContext>(direct_mapped);
+  expect_eq(direct_mapped, mem->get_direct_base() != nullptr);
+  mem->allocate_at(code_addr, 0x1000);
+  mem->write(code_addr, code);
+  mem->allocate_at(data_addr, 0x1000);
+  mem->write_u8(data_addr, 0x01);
+
+  // The syscall stops emulation. There's no debug hook, since reading the
+  // registers from one would compute the pending flags after every opcode.
+  M68KEmulator emu(mem);
+  auto& regs = emu.registers();
+  regs.pc = code_addr;
+  regs.set_sr(0x2700);
+  regs.a[0] = data_addr;
+  regs.d[1].u = 0x000000FF;
+  regs.d[2].u = 0x12345600;
+  regs.d[3].u = 0x12345600;
+  regs.d[4].u = 0x12345600;
+  emu.set_syscall_handler([&](M68KEmulator&, uint16_t) {
+    throw M68KEmulator::terminate_emulation();
+  });
+  emu.execute();
+
+  expect_eq(code_addr + code.size(), regs.pc);
+  expect_eq(0x00000000, regs.d[1].u);
+  expect_eq(0x123456FF, regs.d[2].u);
+  expect_eq(0x12345600, regs.d[3].u);
+  expect_eq(0x123456FF, regs.d[4].u);
+  expect_eq(0xFF, mem->read_u8(data_addr));
+  expect_eq(X | Z | C, emu.registers().sr & 0x1F);
+}
+
+int main(int, char**) {
+  fprintf(stderr, "-- add flags\n");
+  check_add(0x00000001, 0x00000002, SIZE_LONG, 0);
+  check_add(0x0000007F, 0x00000001, SIZE_BYTE, N | V);
+  check_add(0x000000FF, 0x00000001, SIZE_BYTE, Z | C);
+  check_add(0x00008000, 0x0000FFFF, SIZE_WORD, V | C);
+  check_add(0xFFFFFFFF, 0xFFFFFFFF, SIZE_LONG, N | C);
+  // Only the low bits of each operand are used
+  check_add(0x12345601, 0xABCDEF02, SIZE_BYTE, 0);
+
+  fprintf(stderr, "-- subtract flags\n");
+  check_subtract(0x00000000, 0x00000001, SIZE_BYTE, N | C);
+  check_subtract(0x00000080, 0x00000001, SIZE_BYTE, V);
+  check_subtract(0x00001234, 0x00001234, SIZE_WORD, Z);
+  check_subtract(0x7FFFFFFF, 0xFFFFFFFF, SIZE_LONG, N | V | C);
+
+  fprintf(stderr, "-- X is unchanged unless update_x is true\n");
+  {
+    M68KRegisters regs;
+    regs.set_sr(X);
+    regs.set_ccr_flags_integer_add(1, 2, SIZE_BYTE);
+    expect_eq(X, regs.get_sr() & 0x1F);
+    regs.set_sr(0);
+    regs.set_ccr_flags_integer_add(0xFF, 1, SIZE_BYTE);
+    expect_eq(Z | C, regs.get_sr() & 0x1F);
+
+    // A pending operation that sets X, followed by one that doesn't, keeps the
+    // first operation's X
+    regs.set_sr(0);
+    regs.set_ccr_flags_integer_add(0xFF, 1, SIZE_BYTE, true);
+    regs.set_ccr_flags_integer_subtract(2, 1, SIZE_BYTE);
+    expect_eq(X, regs.get_sr() & 0x1F);
+  }
+
+  fprintf(stderr, "-- set_ccr_flags after a pending operation\n");
+  {
+    M68KRegisters regs;
+    regs.set_sr(0);
+    // Changing only some flags keeps the others from the pending operation
+    regs.set_ccr_flags_integer_subtract(0, 1, SIZE_BYTE);
+    regs.set_ccr_flags(-1, -1, -1, 1, -1);
+    expect_eq(N | V | C, regs.get_sr() & 0x1F);
+
+    // Replacing all of them discards the pending operation
+    regs.set_sr(0);
+    regs.set_ccr_flags_integer_subtract(0, 1, SIZE_BYTE);
+    regs.set_ccr_flags(-1, 0, 1, 0, 0);
+    expect_eq(Z, regs.get_sr() & 0x1F);
+
+    // set_sr discards the pending operation too
+    regs.set_ccr_flags_integer_add(0x7F, 1, SIZE_BYTE);
+    regs.set_sr(0x2704);
+    expect_eq(0x2704, regs.get_sr());
+  }
+
+  fprintf(stderr, "-- condition checks use pending flags\n");
+  check_execution(false);
+
+  fprintf(stderr, "-- execution with direct-mapped memory\n");
+  check_execution(true);
+
+  printf("M68KEmulatorTest: all tests passed\n");
+  return 0;
+}
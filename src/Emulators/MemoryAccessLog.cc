@@ -0,0 +1,130 @@
+#include "MemoryAccessLog.hh"
+
+#include <inttypes.h>
+
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+using namespace std;
+
+
+
+static constexpr uint32_t TRACE_MAGIC = 0x4D415452; // 'MATR'
+static constexpr uint32_t TRACE_VERSION = 1;
+
+void print_memory_access(FILE* stream, const MemoryAccess& acc) {
+  const char* type_name = "unknown";
+  if (acc.size == 8) {
+    type_name = "byte";
+  } else if (acc.size == 16) {
+    type_name = "word";
+  } else if (acc.size == 32) {
+    type_name = "dword";
+  } else if (acc.size == 64) {
+    type_name = "qword";
+  } else if (acc.size == 128) {
+    type_name = "oword";
+  }
+  fprintf(stream, "  memory: [%08" PRIX32 "] %s (%s)\n",
+      acc.addr, acc.is_write ? "<=" : "=>", type_name);
+}
+
+
+
+MemoryAccessLog::MemoryAccessLog(size_t capacity)
+  : head(0), tail(0), num_dropped(0) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  this->entries.resize(size);
+}
+
+MemoryAccessLog::~MemoryAccessLog() {
+  this->flush();
+}
+
+template <typename FnT>
+void MemoryAccessLog::consume(FnT&& fn) {
+  size_t tail = this->tail.load(memory_order_relaxed);
+  size_t head = this->head.load(memory_order_acquire);
+  size_t mask = this->entries.size() - 1;
+  for (; tail != head; tail++) {
+    const auto& acc = this->entries[tail & mask];
+    if (this->stream) {
+      MemoryAccessTraceRecord rec;
+      rec.cycle = acc.cycle;
+      rec.addr = acc.addr;
+      rec.size = acc.size;
+      rec.is_write = acc.is_write;
+      fwritex(this->stream.get(), &rec, sizeof(rec));
+    }
+    fn(acc);
+  }
+  this->tail.store(tail, memory_order_release);
+}
+
+vector<MemoryAccess> MemoryAccessLog::drain() {
+  vector<MemoryAccess> ret;
+  this->consume([&](const MemoryAccess& acc) {
+    ret.emplace_back(acc);
+  });
+  return ret;
+}
+
+void MemoryAccessLog::clear() {
+  this->consume([](const MemoryAccess&) { });
+}
+
+void MemoryAccessLog::flush() {
+  if (this->stream) {
+    this->consume([](const MemoryAccess&) { });
+    fflush(this->stream.get());
+  }
+}
+
+void MemoryAccessLog::stream_to_file(const string& filename) {
+  this->flush();
+  this->stream.reset();
+  auto f = fopen_unique(filename, "wb");
+  MemoryAccessTraceHeader header;
+  header.magic = TRACE_MAGIC;
+  header.version = TRACE_VERSION;
+  fwritex(f.get(), &header, sizeof(header));
+  this->stream = move(f);
+}
+
+
+
+void read_memory_access_trace(FILE* f,
+    const function<void(const MemoryAccess&)>& fn) {
+  MemoryAccessTraceHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1) {
+    throw runtime_error("file is too small to be a memory access trace");
+  }
+  if (header.magic != TRACE_MAGIC) {
+    throw runtime_error("file is not a memory access trace");
+  }
+  if (header.version != TRACE_VERSION) {
+    throw runtime_error(string_printf(
+        "unsupported memory access trace version %" PRIu32,
+        header.version.load()));
+  }
+
+  // Read records in large batches, since traces can be very long
+  vector<MemoryAccessTraceRecord> recs(0x1000);
+  for (;;) {
+    size_t bytes_read = fread(recs.data(), 1, recs.size() * sizeof(recs[0]), f);
+    size_t count = bytes_read / sizeof(recs[0]);
+    for (size_t z = 0; z < count; z++) {
+      const auto& rec = recs[z];
+      fn({rec.cycle, rec.addr, rec.size, (rec.is_write != 0)});
+    }
+    if (bytes_read != count * sizeof(recs[0])) {
+      throw runtime_error("memory access trace is truncated");
+    }
+    if (bytes_read < recs.size() * sizeof(recs[0])) {
+      break;
+    }
+  }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <string>
+#include <vector>
+
+
+
+struct MemoryAccess {
+  uint64_t cycle; // The emulator's cycle count when the access happened
+  uint32_t addr;
+  uint8_t size; // In bits
+  bool is_write;
+};
+
+// Writes an access in the format used by the debugger's trace output, e.g.
+// "  memory: [0001F000] => (word)" (including the trailing newline).
+void print_memory_access(FILE* stream, const MemoryAccess& acc);
+
+
+
+// A fixed-capacity ring buffer of memory accesses. One thread (the emulator's)
+// adds entries and one thread drains them; neither ever blocks or allocates
+// memory. If the buffer fills up, new entries are dropped (and counted) unless
+// the log is streaming to a trace file, in which case the buffer is written to
+// the file to make room. When streaming, every entry is written to the file
+// exactly once, whether it's drained or flushed to make room, so the log must
+// only be drained from the emulator's thread in that case.
+class MemoryAccessLog {
+public:
+  static constexpr size_t DEFAULT_CAPACITY = 0x1000;
+
+  // capacity is rounded up to a power of 2
+  explicit MemoryAccessLog(size_t capacity = DEFAULT_CAPACITY);
+  MemoryAccessLog(const MemoryAccessLog&) = delete;
+  MemoryAccessLog& operator=(const MemoryAccessLog&) = delete;
+  ~MemoryAccessLog();
+
+  inline void push(const MemoryAccess& acc) {
+    size_t head = this->head.load(std::memory_order_relaxed);
+    if (head - this->tail.load(std::memory_order_acquire) >= this->entries.size()) {
+      if (!this->stream) {
+        this->num_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      this->flush();
+    }
+    this->entries[head & (this->entries.size() - 1)] = acc;
+    this->head.store(head + 1, std::memory_order_release);
+  }
+
+  // Removes all entries from the buffer and returns them in order. If the log
+  // is streaming, they're also written to the trace file.
+  std::vector<MemoryAccess> drain();
+  // Removes all entries from the buffer. If the log is streaming, they're
+  // written to the trace file; otherwise, they're discarded.
+  void clear();
+
+  // Returns the number of entries dropped because the buffer was full
+  inline uint64_t dropped_count() const {
+    return this->num_dropped.load(std::memory_order_relaxed);
+  }
+
+  // Starts writing all entries to a binary trace file, which can be converted
+  // to text with memory_trace_dump (or read_memory_access_trace). Any existing
+  // trace file is closed first. Entries already in the buffer are written to
+  // the new file when they're drained.
+  void stream_to_file(const std::string& filename);
+  inline bool is_streaming() const {
+    return this->stream.get() != nullptr;
+  }
+  // Writes all buffered entries to the trace file. Does nothing if the log
+  // isn't streaming.
+  void flush();
+
+private:
+  std::vector<MemoryAccess> entries;
+  std::atomic<size_t> head; // Next entry to write
+  std::atomic<size_t> tail; // Next entry to read
+  std::atomic<uint64_t> num_dropped;
+  std::unique_ptr<FILE, fclose_deleter> stream;
+
+  template <typename FnT>
+  void consume(FnT&& fn);
+};
+
+
+
+// Binary trace file format. The file is a header followed by records until
+// the end of the file.
+struct MemoryAccessTraceHeader {
+  be_uint32_t magic; // 'MATR'
+  le_uint32_t version; // 1
+} __attribute__((packed));
+
+struct MemoryAccessTraceRecord {
+  le_uint64_t cycle;
+  le_uint32_t addr;
+  uint8_t size;
+  uint8_t is_write;
+} __attribute__((packed));
+
+// Calls fn for each access in a trace file, in order. Throws runtime_error if
+// the file isn't a trace file or is truncated.
+void read_memory_access_trace(FILE* f,
+    const std::function<void(const MemoryAccess&)>& fn);
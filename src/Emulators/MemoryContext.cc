@@ -5,18 +5,27 @@
 #include <stdint.h>
 #include <sys/mman.h>
 
+#include <zlib.h>
+
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 
+#include "../MappedFile.hh"
+
 using namespace std;
 
 
-MemoryContext::MemoryContext()
+MemoryContext::MemoryContext(bool direct_mapped)
   : page_size(sysconf(_SC_PAGESIZE)),
+    direct_base(nullptr),
     size(0),
     allocated_bytes(0),
     free_bytes(0),
-    strict(false) {
+    strict(false),
+    layout_generation(0),
+    at_cache({0, 0, nullptr}),
+    at_cache_generation(0xFFFFFFFFFFFFFFFF),
+    symbol_index_valid(true) {
 
   if (this->page_size == 0) {
     throw invalid_argument("system page size is zero");
@@ -39,6 +48,33 @@ MemoryContext::MemoryContext()
   this->total_pages = (0x100000000 >> this->page_bits) - 1;
   this->arena_for_page_number.clear();
   this->arena_for_page_number.resize(total_pages, nullptr);
+
+  if (direct_mapped) {
+    if (sizeof(void*) < 8) {
+      throw runtime_error("direct-mapped memory requires a 64-bit host");
+    }
+    // The last page of the guest address space is never part of any arena
+    // (total_pages excludes it), and the extra page after the end of the
+    // reservation catches accesses that start in the last page and extend
+    // past the end of the address space
+    this->direct_reservation = make_shared<DirectReservation>(
+        0x100000000 + this->page_size);
+    this->direct_base = this->direct_reservation->base;
+  }
+}
+
+MemoryContext::DirectReservation::DirectReservation(size_t size)
+  : base(nullptr), size(size) {
+  void* ret = mmap(nullptr, this->size, PROT_NONE,
+      MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  if (ret == MAP_FAILED) {
+    throw runtime_error("cannot reserve address space for direct-mapped memory");
+  }
+  this->base = reinterpret_cast<uint8_t*>(ret);
+}
+
+MemoryContext::DirectReservation::~DirectReservation() {
+  munmap(this->base, this->size);
 }
 
 uint32_t MemoryContext::allocate(size_t requested_size) {
@@ -56,24 +92,21 @@ uint32_t MemoryContext::allocate_within(
   // blocks start at odd addresses.
   requested_size = (requested_size + 3) & (~3);
 
-  // Find the arena with the smallest amount of free space that can accept this
-  // block. Only look in arenas that are completely within the requested range.
-  // TODO: make this not linear time in the arena count somehow
+  // Find the smallest free block that can accept this block. Only use blocks
+  // in arenas that are completely within the requested range. For allocate(),
+  // the first candidate is always usable; for narrower ranges, we may have to
+  // skip some blocks in arenas outside the range.
   uint32_t block_addr = 0;
   shared_ptr<Arena> arena = nullptr;
-  {
-    size_t smallest_block = 0xFFFFFFFF;
-    for (auto arena_it = this->arenas_by_addr.lower_bound(addr_low);
-         (arena_it != this->arenas_by_addr.end()) &&
-           (arena_it->first + arena_it->second->size < addr_high);
-         arena_it++) {
-      auto& a = arena_it->second;
-      auto block_it = a->free_blocks_by_size.lower_bound(requested_size);
-      if ((block_it != a->free_blocks_by_size.end()) &&
-          (block_it->first < smallest_block)) {
-        arena = a;
-        block_addr = block_it->second;
-      }
+  for (auto block_it = this->free_blocks_by_size.lower_bound(make_pair(requested_size, 0));
+       block_it != this->free_blocks_by_size.end();
+       block_it++) {
+    const auto& a = this->arena_for_page_number[this->page_number_for_addr(block_it->second)];
+    if ((a->addr >= addr_low) &&
+        (static_cast<uint64_t>(a->addr) + a->size < addr_high)) {
+      arena = a;
+      block_addr = block_it->second;
+      break;
     }
   }
 
@@ -90,6 +123,7 @@ uint32_t MemoryContext::allocate_within(
   // Update stats
   this->free_bytes -= requested_size;
   this->allocated_bytes += requested_size;
+  this->layout_generation++;
 
   // Uncomment for debugging
   // fprintf(stderr, "[MemoryContext] allocate_within %08" PRIX32 " %08" PRIX32 " %zX => %08" PRIX32 "\n",
@@ -151,6 +185,7 @@ void MemoryContext::allocate_at(uint32_t addr, size_t requested_size) {
   // Update stats
   this->free_bytes -= requested_size;
   this->allocated_bytes += requested_size;
+  this->layout_generation++;
 
   // Uncomment for debugging
   // fprintf(stderr, "[MemoryContext] allocate_at %08" PRIX32 " %zX\n",
@@ -170,23 +205,84 @@ void MemoryContext::preallocate_arena(uint32_t addr, size_t size) {
   }
 }
 
-MemoryContext::Arena::Arena(uint32_t addr, size_t size)
-  : addr(addr),
-    host_addr(mmap(
-      nullptr, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0)),
+void MemoryContext::map_external(uint32_t addr, void* host_ptr, size_t size,
+    bool copy_on_write, shared_ptr<const void> owner) {
+  if (addr & (this->page_size - 1)) {
+    throw invalid_argument("external memory must be mapped on a page boundary");
+  }
+  if (size == 0) {
+    throw invalid_argument("cannot map empty external memory");
+  }
+  if (!host_ptr) {
+    throw invalid_argument("external memory pointer is null");
+  }
+  if (!copy_on_write && !this->direct_base &&
+      (reinterpret_cast<uintptr_t>(host_ptr) & (this->page_size - 1))) {
+    throw invalid_argument("external memory must start on a host page boundary");
+  }
+
+  // create_arena checks that the range doesn't overlap any existing arena
+  shared_ptr<Arena> arena;
+  if (copy_on_write || this->direct_base) {
+    arena = this->create_arena(addr, size);
+    ::memcpy(arena->host_addr, host_ptr, size);
+  } else {
+    arena = this->create_arena(addr, size, host_ptr, move(owner));
+  }
+
+  // Allocate the mapped range, as allocate_at would
+  size_t requested_size = min<size_t>((size + 3) & (~3), arena->size);
+  arena->split_free_block(arena->addr, addr, requested_size);
+  this->free_bytes -= requested_size;
+  this->allocated_bytes += requested_size;
+  this->layout_generation++;
+}
+
+MemoryContext::Arena::Arena(
+    FreeBlockIndex* context_free_blocks_by_size, uint32_t addr, size_t size,
+    shared_ptr<DirectReservation> direct_reservation)
+  : context_free_blocks_by_size(context_free_blocks_by_size),
+    addr(addr),
+    host_addr(direct_reservation
+      ? mmap(direct_reservation->base + addr, size, PROT_READ | PROT_WRITE,
+          MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0)
+      : mmap(nullptr, size, PROT_READ | PROT_WRITE,
+          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0)),
     size(size),
     allocated_bytes(0),
-    free_bytes(size) {
+    free_bytes(size),
+    owns_host_memory(true),
+    direct_reservation(move(direct_reservation)) {
   if (this->host_addr == MAP_FAILED) {
     this->host_addr = nullptr;
     throw runtime_error("cannot mmap arena");
   }
-  this->free_blocks_by_addr.emplace(addr, size);
-  this->free_blocks_by_size.emplace(size, addr);
+  this->add_free_block(addr, size);
+}
+
+MemoryContext::Arena::Arena(
+    FreeBlockIndex* context_free_blocks_by_size, uint32_t addr, size_t size,
+    void* host_addr, shared_ptr<const void> host_owner)
+  : context_free_blocks_by_size(context_free_blocks_by_size),
+    addr(addr),
+    host_addr(host_addr),
+    size(size),
+    allocated_bytes(0),
+    free_bytes(size),
+    owns_host_memory(false),
+    host_owner(move(host_owner)) {
+  this->add_free_block(addr, size);
 }
 
 MemoryContext::Arena::~Arena() {
-  munmap(this->host_addr, this->size);
+  if (this->direct_reservation) {
+    // Replacing the pages (instead of unmapping them) discards their contents
+    // but keeps the range reserved, so nothing else can be mapped there
+    mmap(this->host_addr, this->size, PROT_NONE,
+        MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, -1, 0);
+  } else if (this->owns_host_memory) {
+    munmap(this->host_addr, this->size);
+  }
 }
 
 string MemoryContext::Arena::str() const {
@@ -211,8 +307,15 @@ string MemoryContext::Arena::str() const {
   return ret;
 }
 
+void MemoryContext::Arena::add_free_block(uint32_t addr, uint32_t size) {
+  this->free_blocks_by_addr.emplace(addr, size);
+  this->free_blocks_by_size.emplace(size, addr);
+  this->context_free_blocks_by_size->emplace(size, addr);
+}
+
 void MemoryContext::Arena::delete_free_block(uint32_t addr, uint32_t size) {
   this->free_blocks_by_addr.erase(addr);
+  this->context_free_blocks_by_size->erase(make_pair(size, addr));
   for (auto its = this->free_blocks_by_size.equal_range(size);
        its.first != its.second;) {
     if (its.first->second == addr) {
@@ -253,13 +356,10 @@ void MemoryContext::Arena::split_free_block(
   this->allocated_blocks.emplace(allocate_block_addr, allocate_size);
 
   if (new_free_bytes_before > 0) {
-    this->free_blocks_by_addr.emplace(free_block_addr, new_free_bytes_before);
-    this->free_blocks_by_size.emplace(new_free_bytes_before, free_block_addr);
+    this->add_free_block(free_block_addr, new_free_bytes_before);
   }
   if (new_free_bytes_after > 0) {
-    uint32_t new_free_block_addr = allocate_block_addr + allocate_size;
-    this->free_blocks_by_addr.emplace(new_free_block_addr, new_free_bytes_after);
-    this->free_blocks_by_size.emplace(new_free_bytes_after, new_free_block_addr);
+    this->add_free_block(allocate_block_addr + allocate_size, new_free_bytes_after);
   }
 
   // Update stats
@@ -269,23 +369,35 @@ void MemoryContext::Arena::split_free_block(
 
 uint32_t MemoryContext::find_arena_space(
     uint32_t addr_low, uint32_t addr_high, uint32_t size) const {
-  size_t page_count = this->page_count_for_size(size);
-
-  // TODO: Make this not be linear-time by adding some kind of index
-  size_t start_page_num = this->page_number_for_addr(addr_low);
-  size_t end_page_num = this->page_number_for_addr(addr_high - 1);
-  for (size_t z = start_page_num; z < end_page_num; z++) {
-    if (this->arena_for_page_number[z].get()) {
-      start_page_num = z + 1;
-    } else if (z - start_page_num >= page_count - 1) {
-      break;
+  uint64_t arena_size = this->page_size_for_size(size);
+
+  // Walk the gaps between existing arenas (instead of the page table) until we
+  // find one that's large enough
+  uint64_t candidate_addr = this->page_base_for_addr(addr_low);
+  auto arena_it = this->arenas_by_addr.upper_bound(candidate_addr);
+  if (arena_it != this->arenas_by_addr.begin()) {
+    auto prev_it = arena_it;
+    prev_it--;
+    uint64_t prev_end_addr = static_cast<uint64_t>(prev_it->first) + prev_it->second->size;
+    if (prev_end_addr > candidate_addr) {
+      candidate_addr = prev_end_addr;
     }
   }
-  return (start_page_num << this->page_bits);
+  for (; (arena_it != this->arenas_by_addr.end()) &&
+         (arena_it->first < candidate_addr + arena_size);
+       arena_it++) {
+    candidate_addr = static_cast<uint64_t>(arena_it->first) + arena_it->second->size;
+  }
+
+  if (candidate_addr + arena_size > addr_high) {
+    throw runtime_error("not enough free address space for new arena");
+  }
+  return candidate_addr;
 }
 
 shared_ptr<MemoryContext::Arena> MemoryContext::create_arena(
-    uint32_t addr, size_t size) {
+    uint32_t addr, size_t size, void* external_host_addr,
+    shared_ptr<const void> external_host_owner) {
   // Round size up to a host page boundary
   size = this->page_size_for_size(size);
 
@@ -298,7 +410,14 @@ shared_ptr<MemoryContext::Arena> MemoryContext::create_arena(
   }
 
   // Create the arena and add it to the arenas list
-  shared_ptr<Arena> arena(new Arena(addr, size));
+  shared_ptr<Arena> arena;
+  if (external_host_addr) {
+    arena.reset(new Arena(&this->free_blocks_by_size, addr, size,
+        external_host_addr, move(external_host_owner)));
+  } else {
+    arena.reset(new Arena(&this->free_blocks_by_size, addr, size,
+        this->direct_reservation));
+  }
   this->arenas_by_addr.emplace(arena->addr, arena);
   this->arenas_by_host_addr.emplace(arena->host_addr, arena);
   for (uint32_t z = this->page_number_for_addr(arena->addr); z <= end_page_num; z++) {
@@ -309,6 +428,7 @@ shared_ptr<MemoryContext::Arena> MemoryContext::create_arena(
   this->free_bytes += arena->free_bytes;
   this->allocated_bytes += arena->allocated_bytes;
   this->size += arena->size;
+  this->layout_generation++;
 
   return arena;
 }
@@ -331,12 +451,18 @@ void MemoryContext::delete_arena(shared_ptr<Arena> arena) {
     this->arena_for_page_number[z].reset();
   }
 
+  // Remove the arena's free blocks from the global index
+  for (const auto& it : arena->free_blocks_by_addr) {
+    this->free_blocks_by_size.erase(make_pair(it.second, it.first));
+  }
+
   // Update stats. Note that allocated_bytes may not be zero since free() has a
   // shortcut where it doesn't update structs/stats if the arena is about to be
   // deleted anyway.
   this->size -= arena->size;
   this->allocated_bytes -= arena->allocated_bytes;
   this->free_bytes -= arena->free_bytes;
+  this->layout_generation++;
 }
 
 void MemoryContext::free(uint32_t addr) {
@@ -406,14 +532,14 @@ void MemoryContext::free(uint32_t addr) {
 
     // Create a new free block spanning all the just-deleted free blocks and
     // allocated block
-    arena->free_blocks_by_addr.emplace(new_free_block_addr, new_free_block_size);
-    arena->free_blocks_by_size.emplace(new_free_block_size, new_free_block_addr);
+    arena->add_free_block(new_free_block_addr, new_free_block_size);
 
     // Update stats
     arena->free_bytes += size;
     arena->allocated_bytes -= size;
     this->free_bytes += size;
     this->allocated_bytes -= size;
+    this->layout_generation++;
   }
 
   // Uncomment for debugging
@@ -475,11 +601,13 @@ bool MemoryContext::resize(uint32_t addr, size_t new_size) {
     new_free_block_size = existing_free_block_size + delta;
   }
 
-  if (new_free_block_size > 0) {
+  if (existing_free_block_size > 0) {
     arena->delete_free_block(existing_free_block_addr, existing_free_block_size);
-    arena->free_blocks_by_addr.emplace(new_free_block_addr, new_free_block_size);
-    arena->free_blocks_by_size.emplace(new_free_block_size, new_free_block_addr);
   }
+  if (new_free_block_size > 0) {
+    arena->add_free_block(new_free_block_addr, new_free_block_size);
+  }
+  this->layout_generation++;
   return true;
 }
 
@@ -490,6 +618,7 @@ void MemoryContext::set_symbol_addr(const char* name, uint32_t addr) {
   if (!this->addr_symbols.emplace(addr, name).second) {
     throw logic_error("symbol index is inconsistent");
   }
+  this->symbol_index_valid = false;
 }
 
 void MemoryContext::set_symbol_addr(const string& name, uint32_t addr) {
@@ -501,6 +630,7 @@ void MemoryContext::delete_symbol(const char* name) {
   if (it != this->symbol_addrs.end()) {
     this->addr_symbols.erase(it->second);
     this->symbol_addrs.erase(it);
+    this->symbol_index_valid = false;
   }
 }
 
@@ -513,6 +643,7 @@ void MemoryContext::delete_symbol(uint32_t addr) {
   if (it != this->addr_symbols.end()) {
     this->symbol_addrs.erase(it->second);
     this->addr_symbols.erase(it);
+    this->symbol_index_valid = false;
   }
 }
 
@@ -532,6 +663,18 @@ const unordered_map<string, uint32_t> MemoryContext::all_symbols() const {
   return this->symbol_addrs;
 }
 
+const LabelIndex& MemoryContext::symbol_index() const {
+  if (!this->symbol_index_valid) {
+    this->symbol_index_cache.clear();
+    for (const auto& it : this->addr_symbols) {
+      this->symbol_index_cache.add(it.first, it.second);
+    }
+    this->symbol_index_cache.sort();
+    this->symbol_index_valid = true;
+  }
+  return this->symbol_index_cache;
+}
+
 size_t MemoryContext::get_block_size(uint32_t addr) const {
   auto arena = this->arena_for_page_number.at(this->page_number_for_addr(addr));
   if (!arena.get()) {
@@ -563,6 +706,82 @@ vector<pair<uint32_t, uint32_t>> MemoryContext::allocated_blocks() const {
   return ret;
 }
 
+MemoryContext::HostRange MemoryContext::lookup_range(
+    uint32_t addr, size_t size, bool skip_strict) const {
+  // This breaks if addr == 0 and size == 0. This was originally
+  // unintentional, but it turns out to be useful to detect accidental usage
+  // of memcpy() and the like on empty handles, so we keep this failure mode.
+  size_t start_page_num = this->page_number_for_addr(addr);
+  size_t end_page_num = this->page_number_for_addr(addr + size - 1);
+  const auto& arena = this->arena_for_page_number[start_page_num];
+  if (!arena.get()) {
+    throw out_of_range("address not within any arena");
+  }
+  for (size_t z = start_page_num + 1; z <= end_page_num; z++) {
+    if (this->arena_for_page_number[z] != arena) {
+      if (addr == 0 && size == 0) {
+        throw out_of_range("MemoryContext::at(0, 0)");
+      }
+      throw out_of_range("data not entirely contained within one arena");
+    }
+  }
+
+  HostRange ret;
+  if (this->strict && !skip_strict) {
+    if (!arena->is_within_allocated_block(addr, size)) {
+      throw out_of_range("data is not within an allocated block");
+    }
+    auto it = arena->allocated_blocks.upper_bound(addr);
+    it--;
+    ret.addr = it->first;
+    ret.end_addr = static_cast<uint64_t>(it->first) + it->second;
+  } else {
+    ret.addr = arena->addr;
+    ret.end_addr = static_cast<uint64_t>(arena->addr) + arena->size;
+  }
+  ret.host_addr = reinterpret_cast<uint8_t*>(arena->host_addr) +
+      (ret.addr - arena->addr);
+  return ret;
+}
+
+uint8_t* MemoryContext::at_slow(uint32_t addr, size_t size, bool skip_strict) {
+  HostRange range = this->lookup_range(addr, size, skip_strict);
+  // The cache must hold the allocated block in strict mode, so it can't be
+  // updated when the caller skips the strict check
+  if (!this->strict || !skip_strict) {
+    this->at_cache = range;
+    this->at_cache_generation = this->layout_generation;
+  }
+  return range.host_addr + (addr - range.addr);
+}
+
+MemoryContext::HostRange MemoryContext::host_range_for_addr(
+    uint32_t addr, bool skip_strict) const {
+  const auto& arena = this->arena_for_page_number[this->page_number_for_addr(addr)];
+  if (!arena.get()) {
+    throw out_of_range("address not within any arena");
+  }
+
+  HostRange ret;
+  if (this->strict && !skip_strict) {
+    auto it = arena->allocated_blocks.upper_bound(addr);
+    if (it == arena->allocated_blocks.begin()) {
+      throw out_of_range("data is not within an allocated block");
+    }
+    it--;
+    ret.addr = it->first;
+    ret.end_addr = static_cast<uint64_t>(it->first) + it->second;
+    if (addr >= ret.end_addr) {
+      throw out_of_range("data is not within an allocated block");
+    }
+  } else {
+    ret.addr = arena->addr;
+    ret.end_addr = static_cast<uint64_t>(arena->addr) + arena->size;
+  }
+  ret.host_addr = reinterpret_cast<uint8_t*>(arena->host_addr) + (ret.addr - arena->addr);
+  return ret;
+}
+
 size_t MemoryContext::get_page_size() const {
   return this->page_size;
 }
@@ -605,6 +824,7 @@ void MemoryContext::import_state(FILE* stream) {
   }
   this->symbol_addrs.clear();
   this->addr_symbols.clear();
+  this->symbol_index_valid = false;
 
   uint8_t version = freadx<uint8_t>(stream);
   if (version > 1) {
@@ -662,6 +882,476 @@ void MemoryContext::export_state(FILE* stream) const {
 
 
 
+shared_ptr<const MemoryContext::Snapshot> MemoryContext::snapshot() const {
+  auto ret = make_shared<Snapshot>();
+  ret->page_size = this->page_size;
+  ret->strict = this->strict;
+  for (const auto& it : this->arenas_by_addr) {
+    const auto& arena = it.second;
+    auto& state = ret->arenas[arena->addr];
+    state.size = arena->size;
+    state.allocated_bytes = arena->allocated_bytes;
+    state.free_bytes = arena->free_bytes;
+    state.allocated_blocks = arena->allocated_blocks;
+    state.free_blocks_by_addr = arena->free_blocks_by_addr;
+    state.data.assign(reinterpret_cast<const char*>(arena->host_addr), arena->size);
+  }
+  ret->symbol_addrs = this->symbol_addrs;
+  return ret;
+}
+
+void MemoryContext::restore(const Snapshot& snap) {
+  if (snap.page_size != this->page_size) {
+    throw logic_error("snapshot was made with a different page size");
+  }
+
+  // Delete any arenas that didn't exist when the snapshot was made, or that
+  // have been resized since then
+  for (auto it = this->arenas_by_addr.begin(); it != this->arenas_by_addr.end();) {
+    auto arena = it->second;
+    it++;
+    auto snap_it = snap.arenas.find(arena->addr);
+    if ((snap_it == snap.arenas.end()) || (snap_it->second.size != arena->size)) {
+      this->delete_arena(arena);
+    }
+  }
+
+  // Recreate any missing arenas and restore the contents and allocation state
+  // of all of them. The stats and global free block index are rebuilt below,
+  // so it doesn't matter that create_arena updates them here.
+  for (const auto& snap_it : snap.arenas) {
+    const auto& state = snap_it.second;
+    shared_ptr<Arena> arena;
+    auto arena_it = this->arenas_by_addr.find(snap_it.first);
+    if (arena_it == this->arenas_by_addr.end()) {
+      arena = this->create_arena(snap_it.first, state.size);
+    } else {
+      arena = arena_it->second;
+    }
+
+    // Comparing is faster than copying, and most pages usually haven't changed
+    uint8_t* host_data = reinterpret_cast<uint8_t*>(arena->host_addr);
+    const uint8_t* snap_data = reinterpret_cast<const uint8_t*>(state.data.data());
+    for (size_t offset = 0; offset < state.size; offset += this->page_size) {
+      if (::memcmp(host_data + offset, snap_data + offset, this->page_size)) {
+        ::memcpy(host_data + offset, snap_data + offset, this->page_size);
+      }
+    }
+
+    arena->allocated_bytes = state.allocated_bytes;
+    arena->free_bytes = state.free_bytes;
+    arena->allocated_blocks = state.allocated_blocks;
+    arena->free_blocks_by_addr = state.free_blocks_by_addr;
+    arena->free_blocks_by_size.clear();
+    for (const auto& it : arena->free_blocks_by_addr) {
+      arena->free_blocks_by_size.emplace(it.second, it.first);
+    }
+  }
+
+  this->rebuild_allocation_state();
+
+  this->strict = snap.strict;
+  this->symbol_addrs = snap.symbol_addrs;
+  this->addr_symbols.clear();
+  this->symbol_index_valid = false;
+  for (const auto& it : this->symbol_addrs) {
+    this->addr_symbols.emplace(it.second, it.first);
+  }
+  this->layout_generation++;
+}
+
+void MemoryContext::rebuild_allocation_state() {
+  this->free_blocks_by_size.clear();
+  this->size = 0;
+  this->allocated_bytes = 0;
+  this->free_bytes = 0;
+  for (const auto& it : this->arenas_by_addr) {
+    const auto& arena = it.second;
+    for (const auto& block_it : arena->free_blocks_by_addr) {
+      this->free_blocks_by_size.emplace(block_it.second, block_it.first);
+    }
+    this->size += arena->size;
+    this->allocated_bytes += arena->allocated_bytes;
+    this->free_bytes += arena->free_bytes;
+  }
+}
+
+
+
+// The image file begins with a header, followed by a description of each
+// arena, the symbols, and the metadata. Page data begins at the next multiple
+// of the page size after that: first all the uncompressed pages (so each one
+// is page-aligned and can be mapped directly), then all the compressed pages.
+// All-zero pages have no data at all.
+static constexpr uint32_t IMAGE_MAGIC = 0x4D43494D; // 'MCIM'
+static constexpr uint32_t IMAGE_VERSION = 1;
+static constexpr uint32_t IMAGE_FLAG_STRICT = 0x00000001;
+
+struct ImageHeader {
+  be_uint32_t magic;
+  le_uint32_t version;
+  le_uint32_t page_size;
+  le_uint32_t flags;
+  le_uint32_t arena_count;
+  le_uint32_t symbol_count;
+  le_uint64_t metadata_size;
+  // Size of everything from the beginning of the header to the end of the
+  // metadata
+  le_uint64_t directory_size;
+} __attribute__((packed));
+
+// Followed by allocated_block_count (addr, size) pairs, then free_block_count
+// (addr, size) pairs, then one ImagePage for each page in the arena
+struct ImageArena {
+  le_uint32_t addr;
+  le_uint32_t size;
+  le_uint32_t allocated_block_count;
+  le_uint32_t free_block_count;
+} __attribute__((packed));
+
+struct ImageBlock {
+  le_uint32_t addr;
+  le_uint32_t size;
+} __attribute__((packed));
+
+enum class ImagePageEncoding : uint8_t {
+  ZERO = 0,
+  RAW = 1,
+  DEFLATE = 2,
+};
+
+struct ImagePage {
+  ImagePageEncoding encoding;
+  uint8_t unused[3];
+  le_uint32_t stored_size;
+  le_uint64_t data_offset; // Relative to the beginning of the page data
+} __attribute__((packed));
+
+// Followed by name_length bytes of name
+struct ImageSymbol {
+  le_uint32_t addr;
+  le_uint32_t name_length;
+} __attribute__((packed));
+
+static bool page_is_zero(const uint8_t* data, size_t size) {
+  return (data[0] == 0) && !::memcmp(data, data + 1, size - 1);
+}
+
+void MemoryContext::export_image(const string& filename, const string& metadata,
+    bool compress) const {
+  // Decide how to store each page first, so the directory can contain their
+  // offsets. Compressed pages are kept in memory until the file is written.
+  vector<ImagePage> pages;
+  vector<const uint8_t*> raw_pages;
+  vector<string> compressed_pages;
+  size_t compressed_bytes = 0;
+  string compress_buffer(compressBound(this->page_size), '\0');
+  for (const auto& it : this->arenas_by_addr) {
+    const auto& arena = it.second;
+    const uint8_t* host_data = reinterpret_cast<const uint8_t*>(arena->host_addr);
+    for (size_t offset = 0; offset < arena->size; offset += this->page_size) {
+      const uint8_t* page_data = host_data + offset;
+      ImagePage page;
+      ::memset(&page, 0, sizeof(page));
+      if (page_is_zero(page_data, this->page_size)) {
+        page.encoding = ImagePageEncoding::ZERO;
+        pages.emplace_back(page);
+        continue;
+      }
+
+      if (compress) {
+        uLongf compressed_size = compress_buffer.size();
+        if (compress2(reinterpret_cast<Bytef*>(compress_buffer.data()),
+                &compressed_size, page_data, this->page_size, Z_BEST_SPEED) != Z_OK) {
+          throw runtime_error("cannot compress page");
+        }
+        // Pages that don't compress well are stored uncompressed, since then
+        // they can be mapped directly when the image is loaded
+        if (compressed_size < this->page_size - (this->page_size >> 3)) {
+          page.encoding = ImagePageEncoding::DEFLATE;
+          page.stored_size = compressed_size;
+          page.data_offset = compressed_bytes;
+          compressed_pages.emplace_back(compress_buffer.data(), compressed_size);
+          compressed_bytes += compressed_size;
+          pages.emplace_back(page);
+          continue;
+        }
+      }
+
+      page.encoding = ImagePageEncoding::RAW;
+      page.stored_size = this->page_size;
+      page.data_offset = raw_pages.size() * this->page_size;
+      raw_pages.emplace_back(page_data);
+      pages.emplace_back(page);
+    }
+  }
+  // Compressed pages come after all the raw pages
+  for (auto& page : pages) {
+    if (page.encoding == ImagePageEncoding::DEFLATE) {
+      page.data_offset += raw_pages.size() * this->page_size;
+    }
+  }
+
+  string directory;
+  directory.resize(sizeof(ImageHeader));
+  size_t page_index = 0;
+  for (const auto& it : this->arenas_by_addr) {
+    const auto& arena = it.second;
+    ImageArena arena_header;
+    arena_header.addr = arena->addr;
+    arena_header.size = arena->size;
+    arena_header.allocated_block_count = arena->allocated_blocks.size();
+    arena_header.free_block_count = arena->free_blocks_by_addr.size();
+    directory.append(reinterpret_cast<const char*>(&arena_header), sizeof(arena_header));
+    for (const auto* blocks : {&arena->allocated_blocks, &arena->free_blocks_by_addr}) {
+      for (const auto& block_it : *blocks) {
+        ImageBlock block;
+        block.addr = block_it.first;
+        block.size = block_it.second;
+        directory.append(reinterpret_cast<const char*>(&block), sizeof(block));
+      }
+    }
+    size_t num_pages = arena->size >> this->page_bits;
+    directory.append(reinterpret_cast<const char*>(&pages[page_index]), num_pages * sizeof(ImagePage));
+    page_index += num_pages;
+  }
+  for (const auto& it : this->symbol_addrs) {
+    ImageSymbol sym;
+    sym.addr = it.second;
+    sym.name_length = it.first.size();
+    directory.append(reinterpret_cast<const char*>(&sym), sizeof(sym));
+    directory.append(it.first);
+  }
+  directory.append(metadata);
+
+  auto* header = reinterpret_cast<ImageHeader*>(directory.data());
+  header->magic = IMAGE_MAGIC;
+  header->version = IMAGE_VERSION;
+  header->page_size = this->page_size;
+  header->flags = this->strict ? IMAGE_FLAG_STRICT : 0;
+  header->arena_count = this->arenas_by_addr.size();
+  header->symbol_count = this->symbol_addrs.size();
+  header->metadata_size = metadata.size();
+  header->directory_size = directory.size();
+  directory.resize(this->page_size_for_size(directory.size()), '\0');
+
+  auto f = fopen_unique(filename, "wb");
+  fwritex(f.get(), directory);
+  for (const uint8_t* page_data : raw_pages) {
+    fwritex(f.get(), page_data, this->page_size);
+  }
+  for (const auto& data : compressed_pages) {
+    fwritex(f.get(), data);
+  }
+}
+
+string MemoryContext::import_image(const string& filename) {
+  MappedFile file(filename);
+  StringReader r(file.data(), file.size());
+
+  const auto& header = r.get<ImageHeader>();
+  if (header.magic != IMAGE_MAGIC) {
+    throw runtime_error("file is not a memory image");
+  }
+  if (header.version != IMAGE_VERSION) {
+    throw runtime_error("unknown memory image version");
+  }
+  if (header.page_size != this->page_size) {
+    throw runtime_error("memory image was made with a different page size");
+  }
+  if ((header.directory_size < sizeof(ImageHeader)) || (header.directory_size > file.size())) {
+    throw runtime_error("memory image is truncated");
+  }
+  r.truncate(header.directory_size);
+  size_t data_start = this->page_size_for_size(header.directory_size);
+  size_t data_size = (data_start < file.size()) ? (file.size() - data_start) : 0;
+
+  // Parse and check the entire directory before changing anything, so an
+  // invalid image leaves the context as it was
+  struct ImportArena {
+    const ImageArena* header;
+    const ImageBlock* blocks; // Allocated blocks, then free blocks
+    const ImagePage* pages;
+  };
+  vector<ImportArena> arenas;
+  uint64_t max_end_addr = static_cast<uint64_t>(this->total_pages) << this->page_bits;
+  uint64_t prev_end_addr = 0;
+  for (size_t arena_index = 0; arena_index < header.arena_count; arena_index++) {
+    auto& arena = arenas.emplace_back();
+    arena.header = &r.get<ImageArena>();
+    uint64_t addr = arena.header->addr;
+    uint64_t end_addr = addr + arena.header->size;
+    if ((arena.header->size == 0) || (arena.header->size & (this->page_size - 1))) {
+      throw runtime_error("memory image arena size is not a multiple of the page size");
+    }
+    if ((addr & (this->page_size - 1)) || (end_addr > max_end_addr)) {
+      throw runtime_error("memory image arena address is invalid");
+    }
+    // export_image writes arenas in address order
+    if (addr < prev_end_addr) {
+      throw runtime_error("memory image arenas overlap or are out of order");
+    }
+    prev_end_addr = end_addr;
+
+    // The blocks must cover the entire arena, with no gaps or overlaps
+    size_t block_count = static_cast<size_t>(arena.header->allocated_block_count) +
+        arena.header->free_block_count;
+    arena.blocks = &r.get<ImageBlock>(true, block_count * sizeof(ImageBlock));
+    map<uint32_t, uint32_t> blocks;
+    for (size_t z = 0; z < block_count; z++) {
+      const auto& block = arena.blocks[z];
+      if ((block.size == 0) || (block.addr < addr) ||
+          (static_cast<uint64_t>(block.addr) + block.size > end_addr)) {
+        throw runtime_error("memory image block is outside its arena");
+      }
+      if (!blocks.emplace(block.addr, block.size).second) {
+        throw runtime_error("memory image blocks don\'t cover their arena");
+      }
+    }
+    uint64_t next_block_addr = addr;
+    for (const auto& it : blocks) {
+      if (it.first != next_block_addr) {
+        throw runtime_error("memory image blocks don\'t cover their arena");
+      }
+      next_block_addr += it.second;
+    }
+    if (next_block_addr != end_addr) {
+      throw runtime_error("memory image blocks don\'t cover their arena");
+    }
+
+    size_t num_pages = arena.header->size >> this->page_bits;
+    arena.pages = &r.get<ImagePage>(true, num_pages * sizeof(ImagePage));
+    for (size_t z = 0; z < num_pages; z++) {
+      const auto& page = arena.pages[z];
+      if (page.encoding == ImagePageEncoding::ZERO) {
+        continue;
+      }
+      if ((page.encoding != ImagePageEncoding::RAW) &&
+          (page.encoding != ImagePageEncoding::DEFLATE)) {
+        throw runtime_error("memory image contains an unknown page encoding");
+      }
+      size_t stored_size = (page.encoding == ImagePageEncoding::RAW)
+          ? this->page_size : static_cast<size_t>(page.stored_size);
+      if ((page.data_offset > data_size) || (stored_size > data_size - page.data_offset)) {
+        throw runtime_error("memory image page data is out of range");
+      }
+    }
+  }
+
+  vector<pair<uint32_t, string>> symbols;
+  for (size_t z = 0; z < header.symbol_count; z++) {
+    const auto& sym = r.get<ImageSymbol>();
+    symbols.emplace_back(sym.addr, r.read(sym.name_length));
+  }
+  string metadata = r.read(header.metadata_size);
+
+  // Delete everything before importing new state
+  while (!this->arenas_by_addr.empty()) {
+    this->delete_arena(this->arenas_by_addr.begin()->second);
+  }
+  this->symbol_addrs.clear();
+  this->addr_symbols.clear();
+  this->symbol_index_valid = false;
+
+  try {
+    for (const auto& import_arena : arenas) {
+      auto arena = this->create_arena(import_arena.header->addr, import_arena.header->size);
+
+      // create_arena made the whole arena one free block; replace it with the
+      // image's blocks. The global index is rebuilt after all arenas are loaded.
+      arena->free_blocks_by_addr.clear();
+      arena->free_blocks_by_size.clear();
+      arena->allocated_bytes = 0;
+      arena->free_bytes = 0;
+      size_t allocated_block_count = import_arena.header->allocated_block_count;
+      size_t block_count = allocated_block_count + import_arena.header->free_block_count;
+      for (size_t z = 0; z < block_count; z++) {
+        const auto& block = import_arena.blocks[z];
+        if (z < allocated_block_count) {
+          arena->allocated_blocks.emplace(block.addr, block.size);
+          arena->allocated_bytes += block.size;
+        } else {
+          arena->free_blocks_by_addr.emplace(block.addr, block.size);
+          arena->free_blocks_by_size.emplace(block.size, block.addr);
+          arena->free_bytes += block.size;
+        }
+      }
+
+      // Consecutive raw pages are mapped with one call, since they're usually
+      // also consecutive in the file
+      uint8_t* host_data = reinterpret_cast<uint8_t*>(arena->host_addr);
+      size_t run_offset = 0;
+      size_t run_file_offset = 0;
+      size_t run_size = 0;
+      auto flush_run = [&]() {
+        if (run_size == 0) {
+          return;
+        }
+        if (!file.map_private_at(host_data + run_offset, run_file_offset, run_size)) {
+          ::memcpy(host_data + run_offset,
+              reinterpret_cast<const uint8_t*>(file.data()) + run_file_offset, run_size);
+        }
+        run_size = 0;
+      };
+
+      for (size_t offset = 0; offset < arena->size; offset += this->page_size) {
+        const auto& page = import_arena.pages[offset >> this->page_bits];
+        size_t file_offset = data_start + page.data_offset;
+        if (page.encoding == ImagePageEncoding::ZERO) {
+          continue; // New arenas are already zeroed
+        } else if (page.encoding == ImagePageEncoding::RAW) {
+          if (run_size && (run_offset + run_size == offset) &&
+              (run_file_offset + run_size == file_offset)) {
+            run_size += this->page_size;
+          } else {
+            flush_run();
+            run_offset = offset;
+            run_file_offset = file_offset;
+            run_size = this->page_size;
+          }
+        } else {
+          uLongf decompressed_size = this->page_size;
+          if ((uncompress(host_data + offset, &decompressed_size,
+                  reinterpret_cast<const Bytef*>(file.data()) + file_offset,
+                  page.stored_size) != Z_OK) ||
+              (decompressed_size != this->page_size)) {
+            throw runtime_error("memory image contains an invalid compressed page");
+          }
+        }
+      }
+      flush_run();
+    }
+
+  } catch (const exception&) {
+    // A compressed page's contents can't be checked without decompressing it,
+    // so this can fail after the old state is gone; don't leave the context
+    // with only some of the image's arenas in that case
+    while (!this->arenas_by_addr.empty()) {
+      this->delete_arena(this->arenas_by_addr.begin()->second);
+    }
+    this->rebuild_allocation_state();
+    this->layout_generation++;
+    throw;
+  }
+
+  for (auto& it : symbols) {
+    this->symbol_addrs.emplace(it.second, it.first);
+    this->addr_symbols.emplace(it.first, move(it.second));
+  }
+  this->rebuild_allocation_state();
+  this->strict = (header.flags & IMAGE_FLAG_STRICT);
+  this->layout_generation++;
+  return metadata;
+}
+
+bool MemoryContext::is_image_file(const string& filename) {
+  auto f = fopen_unique(filename, "rb");
+  be_uint32_t magic;
+  return (fread(&magic, sizeof(magic), 1, f.get()) == 1) && (magic == IMAGE_MAGIC);
+}
+
+
+
 void MemoryContext::verify() const {
   if (this->page_size != static_cast<size_t>(1 << this->page_bits)) {
     throw logic_error("page_size is incorrect");
@@ -736,8 +1426,18 @@ void MemoryContext::verify() const {
     }
   }
 
+  size_t expected_free_block_count = 0;
   for (const auto& arena : arenas_for_page_number_coll) {
     arena->verify();
+    for (const auto& it : arena->free_blocks_by_addr) {
+      if (!this->free_blocks_by_size.count(make_pair(it.second, it.first))) {
+        throw logic_error("free block missing from global size index");
+      }
+    }
+    expected_free_block_count += arena->free_blocks_by_addr.size();
+  }
+  if (this->free_blocks_by_size.size() != expected_free_block_count) {
+    throw logic_error("global free block index contains stray blocks");
   }
 }
 
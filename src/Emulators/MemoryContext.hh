@@ -6,47 +6,64 @@
 
 #include <map>
 #include <memory>
+#include <set>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
 #include <phosg/Encoding.hh>
 
+#include "LabelIndex.hh"
+
 
 class MemoryContext {
 public:
-  MemoryContext();
+  // If direct_mapped is true, the context reserves host address space for the
+  // entire 32-bit guest address space up front, and each arena's memory is
+  // placed at (direct base + guest address) within it. Allocation works the
+  // same way in both modes, but in direct-mapped mode, emulators can translate
+  // addresses with a single add (see get_direct_base). Pages that aren't in
+  // any arena are inaccessible, so accessing them through the direct base
+  // crashes the process instead of throwing out_of_range. This mode requires
+  // a 64-bit host.
+  explicit MemoryContext(bool direct_mapped = false);
+  // Arenas point to the context's free block index, so contexts can't be
+  // copied or moved (use snapshot and restore to copy memory contents)
+  MemoryContext(const MemoryContext&) = delete;
+  MemoryContext(MemoryContext&&) = delete;
+  MemoryContext& operator=(const MemoryContext&) = delete;
+  MemoryContext& operator=(MemoryContext&&) = delete;
   ~MemoryContext() = default;
 
   template<typename T>
   T* at(uint32_t addr, size_t size = sizeof(T), bool skip_strict = false) {
-    // This breaks if addr == 0 and size == 0. This was originally
-    // unintentional, but it turns out to be useful to detect accidental usage
-    // of memcpy() and the like on empty handles, so we keep this failure mode.
-    size_t start_page_num = this->page_number_for_addr(addr);
-    size_t end_page_num = this->page_number_for_addr(addr + size - 1);
-    auto arena = this->arena_for_page_number[start_page_num];
-    if (!arena.get()) {
-      throw std::out_of_range("address not within any arena");
-    }
-    for (size_t z = start_page_num + 1; z <= end_page_num; z++) {
-      if (this->arena_for_page_number[z] != arena) {
-        if (addr == 0 && size == 0) {
-          throw std::out_of_range("MemoryContext::at(0, 0)");
-        }
-        throw std::out_of_range("data not entirely contained within one arena");
-      }
+    // Most accesses are near the previous one, so check the last range that
+    // was looked up before going through the page table. The cached range is
+    // never larger than what the lookup below would allow: in strict mode it's
+    // the containing allocated block, otherwise it's the containing arena.
+    if ((this->at_cache_generation == this->layout_generation) &&
+        (size != 0) &&
+        (addr >= this->at_cache.addr) &&
+        (static_cast<uint64_t>(addr) + size <= this->at_cache.end_addr)) {
+      return reinterpret_cast<T*>(this->at_cache.host_addr + (addr - this->at_cache.addr));
     }
-    if (this->strict && !skip_strict && !arena->is_within_allocated_block(addr, size)) {
-      throw std::out_of_range("data is not within an allocated block");
-    }
-    return reinterpret_cast<T*>(
-        reinterpret_cast<uint8_t*>(arena->host_addr) + (addr - arena->addr));
+    return reinterpret_cast<T*>(this->at_slow(addr, size, skip_strict));
   }
+  // The const version checks the cache but never updates it, so multiple
+  // threads can call it at the same time (as long as none of them modify the
+  // context).
   template <typename T>
   const T* at(uint32_t addr, size_t size = sizeof(T), bool skip_strict = false) const {
-    return const_cast<MemoryContext*>(this)->at<T>(addr, size, skip_strict);
+    if ((this->at_cache_generation == this->layout_generation) &&
+        (size != 0) &&
+        (addr >= this->at_cache.addr) &&
+        (static_cast<uint64_t>(addr) + size <= this->at_cache.end_addr)) {
+      return reinterpret_cast<const T*>(this->at_cache.host_addr + (addr - this->at_cache.addr));
+    }
+    HostRange range = this->lookup_range(addr, size, skip_strict);
+    return reinterpret_cast<const T*>(range.host_addr + (addr - range.addr));
   }
 
   inline uint32_t at(const void* host_addr) const {
@@ -66,6 +83,29 @@ public:
     return addr;
   }
 
+  // Like at(), but doesn't check that the data is entirely within one arena or
+  // within an allocated block. This is only for callers that have already
+  // verified the range (e.g. with exists() or host_range_for_addr()); it still
+  // throws if addr itself isn't within any arena.
+  template <typename T>
+  T* at_unchecked(uint32_t addr) {
+    return const_cast<T*>(static_cast<const MemoryContext*>(this)->at_unchecked<T>(addr));
+  }
+  template <typename T>
+  const T* at_unchecked(uint32_t addr) const {
+    if ((this->at_cache_generation == this->layout_generation) &&
+        (addr >= this->at_cache.addr) &&
+        (addr < this->at_cache.end_addr)) {
+      return reinterpret_cast<const T*>(this->at_cache.host_addr + (addr - this->at_cache.addr));
+    }
+    const auto& arena = this->arena_for_page_number[this->page_number_for_addr(addr)];
+    if (!arena.get()) {
+      throw std::out_of_range("address not within any arena");
+    }
+    return reinterpret_cast<const T*>(
+        reinterpret_cast<const uint8_t*>(arena->host_addr) + (addr - arena->addr));
+  }
+
   template <typename T>
   T read(uint32_t addr) const {
     return *this->at<T>(addr);
@@ -223,6 +263,39 @@ public:
 
   void preallocate_arena(uint32_t addr, size_t size);
 
+  // Makes size bytes of host memory accessible at addr, which must be on a
+  // page boundary, as a new arena. The range is allocated as if by
+  // allocate_at(addr, size); the rest of the last page is free space. If
+  // copy_on_write is false, the arena uses host_ptr directly (so writes through
+  // either one are visible through the other); the memory must be writable,
+  // start on a page boundary, and be valid for size bytes rounded up to the
+  // page size, and owner (if given) is kept alive until the arena is deleted.
+  // If copy_on_write is true, the host memory is never modified; the arena gets
+  // its own copy of it instead. To map file data without copying it, pass
+  // memory from MappedFile::map_private with copy_on_write = false, since that
+  // memory is already copy-on-write. In a direct-mapped context, arenas can't
+  // use existing host memory, so the memory is always copied (as if
+  // copy_on_write were true) and owner is released immediately.
+  void map_external(uint32_t addr, void* host_ptr, size_t size,
+      bool copy_on_write, std::shared_ptr<const void> owner = nullptr);
+
+  // Returns the largest range around addr that can be accessed through a single
+  // host pointer. In strict mode (unless skip_strict is true), this is the
+  // allocated block containing addr; otherwise, it's the entire arena. Throws
+  // out_of_range if addr isn't accessible. The result remains valid until
+  // get_layout_generation() returns a different value.
+  struct HostRange {
+    uint32_t addr;
+    uint64_t end_addr; // 64-bit in case the range ends at the top of memory
+    uint8_t* host_addr; // Corresponds to addr, not to the addr passed in
+  };
+  HostRange host_range_for_addr(uint32_t addr, bool skip_strict = false) const;
+
+  // This changes every time any block or arena is allocated, freed, or resized.
+  inline uint64_t get_layout_generation() const {
+    return this->layout_generation;
+  }
+
   void set_symbol_addr(const char* name, uint32_t addr);
   void set_symbol_addr(const std::string& name, uint32_t addr);
   void delete_symbol(const char* name);
@@ -232,11 +305,32 @@ public:
   uint32_t get_symbol_addr(const std::string& name) const;
   const char* get_symbol_at_addr(uint32_t addr) const;
   const std::unordered_map<std::string, uint32_t> all_symbols() const;
+  // Returns all symbols sorted by address, for disassembly and for finding the
+  // nearest symbol before an address. The index is rebuilt (on the next call)
+  // only when a symbol is added or removed; the returned reference is
+  // invalidated at that point.
+  const LabelIndex& symbol_index() const;
 
   size_t get_page_size() const;
 
   inline void set_strict(bool strict) {
     this->strict = strict;
+    this->layout_generation++;
+  }
+
+  // Returns the host address corresponding to guest address 0, or null if the
+  // context isn't direct-mapped or is in strict mode (since strict mode needs
+  // the allocated-block checks that at() does). When this isn't null, the data
+  // at guest address addr is at (base + addr) for every addr in an arena, and
+  // callers may skip bounds checks entirely. Accessing an address that isn't
+  // in any arena through this pointer causes a segmentation fault; the page
+  // after the end of the guest address space is also inaccessible, so
+  // accesses that wrap past 0xFFFFFFFF fault too.
+  inline uint8_t* get_direct_base() const {
+    return this->strict ? nullptr : this->direct_base;
+  }
+  inline bool is_direct_mapped() const {
+    return this->direct_base != nullptr;
   }
 
   void print_state(FILE* stream) const;
@@ -245,6 +339,50 @@ public:
   void import_state(FILE* stream);
   void export_state(FILE* stream) const;
 
+  // Writes all memory contents, allocation state, and symbols to a file in a
+  // page-aligned binary format, along with arbitrary metadata (emulators use
+  // this for register state). All-zero pages take no space in the file. If
+  // compress is true, pages are compressed with zlib individually when that
+  // makes them significantly smaller; other pages are stored at page-aligned
+  // offsets. Unlike export_state, this preserves the exact arena layout and
+  // the strict flag.
+  void export_image(const std::string& filename,
+      const std::string& metadata = "", bool compress = false) const;
+  // Replaces all of the context's state with the contents of an image file,
+  // and returns the image's metadata. Uncompressed pages are mapped directly
+  // from the file (copy-on-write) instead of being read, so this takes time
+  // proportional to the number of arenas and compressed pages rather than to
+  // the total memory size. (This means the file shouldn't be modified while
+  // the context is using it.) The image must have been made on a host with
+  // the same page size. The image's structure is checked before anything is
+  // changed, so if it's invalid, this throws and leaves the context as it
+  // was; if a compressed page turns out to be corrupt, this throws and leaves
+  // the context empty.
+  std::string import_image(const std::string& filename);
+  // Returns true if the file begins with the image format's signature
+  static bool is_image_file(const std::string& filename);
+
+  // A copy of all memory contents, allocation state, and symbols. Restoring a
+  // snapshot is much faster than import_state: arenas that still exist with
+  // the same address and size are reused, and only the pages whose contents
+  // differ from the snapshot are copied.
+  struct Snapshot {
+    struct ArenaState {
+      size_t size;
+      size_t allocated_bytes;
+      size_t free_bytes;
+      std::map<uint32_t, uint32_t> allocated_blocks;
+      std::map<uint32_t, uint32_t> free_blocks_by_addr;
+      std::string data;
+    };
+    size_t page_size;
+    bool strict;
+    std::map<uint32_t, ArenaState> arenas;
+    std::unordered_map<std::string, uint32_t> symbol_addrs;
+  };
+  std::shared_ptr<const Snapshot> snapshot() const;
+  void restore(const Snapshot& snap);
+
   void verify() const;
 
 private:
@@ -252,13 +390,49 @@ private:
   size_t page_size;
   size_t total_pages;
 
+  // The host address space reserved for a direct-mapped context. Arenas hold
+  // a reference to it so it isn't unmapped until all of them are destroyed.
+  struct DirectReservation {
+    uint8_t* base;
+    size_t size;
+
+    explicit DirectReservation(size_t size);
+    DirectReservation(const DirectReservation&) = delete;
+    DirectReservation& operator=(const DirectReservation&) = delete;
+    ~DirectReservation();
+  };
+  std::shared_ptr<DirectReservation> direct_reservation;
+  uint8_t* direct_base;
+
   size_t size;
   size_t allocated_bytes;
   size_t free_bytes;
 
   bool strict;
 
+  uint64_t layout_generation;
+
+  // The range most recently returned by at_slow(), which at() checks first.
+  // This holds only raw pointers; it's valid only while at_cache_generation
+  // matches layout_generation.
+  HostRange at_cache;
+  uint64_t at_cache_generation;
+  // Returns the range that contains [addr, addr + size): the allocated block
+  // in strict mode (unless skip_strict is true), or the arena otherwise. Throws
+  // if the data isn't entirely within it.
+  HostRange lookup_range(uint32_t addr, size_t size, bool skip_strict) const;
+  // Calls lookup_range and caches the result
+  uint8_t* at_slow(uint32_t addr, size_t size, bool skip_strict);
+
+  // All free blocks in all arenas, as (size, addr) pairs. This makes best-fit
+  // allocation logarithmic in the number of free blocks instead of linear in
+  // the number of arenas. Arenas keep this up to date via add_free_block and
+  // delete_free_block.
+  typedef std::set<std::pair<uint32_t, uint32_t>> FreeBlockIndex;
+  FreeBlockIndex free_blocks_by_size;
+
   struct Arena {
+    FreeBlockIndex* context_free_blocks_by_size;
     uint32_t addr;
     void* host_addr;
     size_t size;
@@ -267,8 +441,20 @@ private:
     std::map<uint32_t, uint32_t> allocated_blocks;
     std::map<uint32_t, uint32_t> free_blocks_by_addr;
     std::multimap<uint32_t, uint32_t> free_blocks_by_size;
-
-    Arena(uint32_t addr, size_t size);
+    // If host_owner is null and owns_host_memory is false, the memory belongs
+    // to whoever called map_external
+    bool owns_host_memory;
+    std::shared_ptr<const void> host_owner;
+    // If this is not null, host_addr is within the reservation, and the memory
+    // is returned to it (instead of being unmapped) when the arena is deleted
+    std::shared_ptr<DirectReservation> direct_reservation;
+
+    // If direct_reservation is not null, the arena's memory is mapped at its
+    // guest address within the reservation; otherwise, it's mapped anywhere
+    Arena(FreeBlockIndex* context_free_blocks_by_size, uint32_t addr, size_t size,
+        std::shared_ptr<DirectReservation> direct_reservation = nullptr);
+    Arena(FreeBlockIndex* context_free_blocks_by_size, uint32_t addr, size_t size,
+        void* host_addr, std::shared_ptr<const void> host_owner);
     Arena(const Arena&) = delete;
     Arena(Arena&&);
     Arena& operator=(const Arena&) = delete;
@@ -284,17 +470,18 @@ private:
         uint32_t free_block_addr,
         uint32_t allocate_addr,
         uint32_t allocate_size);
+    void add_free_block(uint32_t addr, uint32_t size);
     void delete_free_block(uint32_t addr, uint32_t size);
   };
 
-  // TODO: We probably should have an index of {free block size: Arena ptr} to
-  // make allocations sub-linear time. I'm not going to implement this just yet.
   std::map<uint32_t, std::shared_ptr<Arena>> arenas_by_addr;
   std::map<const void*, std::shared_ptr<Arena>> arenas_by_host_addr;
   std::vector<std::shared_ptr<Arena>> arena_for_page_number;
 
   std::unordered_map<std::string, uint32_t> symbol_addrs;
   std::unordered_map<uint32_t, std::string> addr_symbols;
+  mutable LabelIndex symbol_index_cache;
+  mutable bool symbol_index_valid;
 
   inline uint32_t page_base_for_addr(uint32_t addr) const {
     return (addr & ~(this->page_size - 1));
@@ -318,6 +505,11 @@ private:
 
   uint32_t find_arena_space(
       uint32_t addr_low, uint32_t addr_high, uint32_t size) const;
-  std::shared_ptr<Arena> create_arena(uint32_t addr, size_t min_size);
+  // Rebuilds the global free block index and the size stats from the arenas'
+  // own block maps, after they've been replaced wholesale
+  void rebuild_allocation_state();
+  std::shared_ptr<Arena> create_arena(uint32_t addr, size_t min_size,
+      void* external_host_addr = nullptr,
+      std::shared_ptr<const void> external_host_owner = nullptr);
   void delete_arena(std::shared_ptr<Arena> arena);
 };
@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <memory>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "MemoryContext.hh"
+
+using namespace std;
+
+
+
+// Offsets of fields in an image with one arena (see the Image* structures in
+// MemoryContext.cc)
+static constexpr size_t ARENA_HEADER_OFFSET = 0x28;
+static constexpr size_t BLOCKS_OFFSET = ARENA_HEADER_OFFSET + 0x10;
+
+static size_t first_page_offset(const string& image) {
+  StringReader r(image);
+  size_t block_count = r.pget_u32l(ARENA_HEADER_OFFSET + 8) + r.pget_u32l(ARENA_HEADER_OFFSET + 12);
+  return BLOCKS_OFFSET + block_count * 8;
+}
+
+// Returns a copy of data with a little-endian integer of the given size
+// replaced at offset
+static string patch_image(const string& data, size_t offset, uint64_t value, size_t size) {
+  string ret = data;
+  for (size_t z = 0; z < size; z++) {
+    ret[offset + z] = static_cast<char>((value >> (z * 8)) & 0xFF);
+  }
+  return ret;
+}
+
+// Imports a modified image into a context that already has other contents, and
+// checks that the import fails without changing them
+static void check_import_fails(const string& filename, const string& image) {
+  save_file(filename, image);
+  MemoryContext mem;
+  mem.allocate_at(0x20000000, 0x1000);
+  mem.write_u32b(0x20000000, 0x01234567);
+  mem.set_symbol_addr("existing", 0x20000000);
+  bool failed = false;
+  try {
+    mem.import_image(filename);
+  } catch (const exception&) {
+    failed = true;
+  }
+  expect(failed);
+  expect_eq(static_cast<uint32_t>(0x01234567), mem.read_u32b(0x20000000));
+  expect_eq(static_cast<uint32_t>(0x20000000), mem.get_symbol_addr("existing"));
+  expect(!mem.exists(0x10000000));
+  mem.verify();
+}
+
+// Checks that memory in a direct-mapped context is at (base + guest address),
+// however it was allocated
+static void check_direct_mapped(const string& image_filename) {
+  MemoryContext mem(true);
+  expect(mem.is_direct_mapped());
+  uint8_t* base = mem.get_direct_base();
+  expect(base != nullptr);
+
+  mem.allocate_at(0x20000000, 0x2000);
+  mem.write_u32b(0x20000004, 0x01020304);
+  expect_eq(base + 0x20000004, mem.at<uint8_t>(0x20000004));
+  expect_eq(0x01, base[0x20000004]);
+  expect_eq(0x04, base[0x20000007]);
+  base[0x20001FFF] = 0x5A;
+  expect_eq(0x5A, mem.read_u8(0x20001FFF));
+
+  uint32_t addr = mem.allocate(0x100);
+  expect(addr != 0);
+  mem.write_u32b(addr, 0xFEEDFACE);
+  expect_eq(0xFE, base[addr]);
+
+  // Freeing and reallocating puts new memory at the same place
+  mem.free(0x20000000);
+  expect(!mem.exists(0x20000000));
+  mem.allocate_at(0x20000000, 0x1000);
+  expect_eq(base + 0x20000000, mem.at<uint8_t>(0x20000000));
+  mem.write_u8(0x20000000, 0x77);
+  expect_eq(0x77, base[0x20000000]);
+
+  // External memory is copied into place, so later changes to it aren't
+  // visible in the context
+  string external(mem.get_page_size(), 'x');
+  mem.map_external(0x30000000, external.data(), external.size(), false);
+  expect_eq(base + 0x30000000, mem.at<uint8_t>(0x30000000));
+  external[0] = 'y';
+  expect_eq('x', static_cast<char>(base[0x30000000]));
+
+  // Strict mode needs the checks in at(), so there's no direct base
+  mem.set_strict(true);
+  expect(mem.get_direct_base() == nullptr);
+  expect(mem.is_direct_mapped());
+  mem.set_strict(false);
+  expect_eq(base, mem.get_direct_base());
+  mem.verify();
+
+  // Imported images are placed at the same addresses as allocated memory
+  MemoryContext imported(true);
+  expect_eq(string("metadata"), imported.import_image(image_filename));
+  expect_eq(0xFE, imported.get_direct_base()[0x10000000]);
+  expect_eq(0xCE, imported.get_direct_base()[0x10000003]);
+  imported.verify();
+}
+
+int main(int, char**) {
+  string filename = string_printf("MemoryContextTest-%d.img", getpid());
+
+  try {
+    string image;
+    {
+      MemoryContext mem;
+      mem.allocate_at(0x10000000, 0x100);
+      mem.write_u32b(0x10000000, 0xFEEDFACE);
+      mem.set_symbol_addr("start", 0x10000000);
+      mem.export_image(filename, "metadata");
+      image = load_file(filename);
+    }
+
+    fprintf(stderr, "-- import a valid image\n");
+    {
+      MemoryContext mem;
+      mem.allocate_at(0x20000000, 0x1000);
+      expect_eq(string("metadata"), mem.import_image(filename));
+      expect_eq(static_cast<uint32_t>(0xFEEDFACE), mem.read_u32b(0x10000000));
+      expect_eq(static_cast<uint32_t>(0x10000000), mem.get_symbol_addr("start"));
+      expect(!mem.exists(0x20000000));
+      mem.verify();
+    }
+
+    fprintf(stderr, "-- direct-mapped context\n");
+    check_direct_mapped(filename);
+
+    fprintf(stderr, "-- page data offset overflows\n");
+    check_import_fails(filename, patch_image(image, first_page_offset(image) + 8, 0xFFFFFFFFFFFFF000, 8));
+
+    fprintf(stderr, "-- page data offset is past the end of the file\n");
+    check_import_fails(filename, patch_image(image, first_page_offset(image) + 8, image.size(), 8));
+
+    fprintf(stderr, "-- block is outside its arena\n");
+    check_import_fails(filename, patch_image(image, BLOCKS_OFFSET, 0x30000000, 4));
+
+    fprintf(stderr, "-- blocks don't cover their arena\n");
+    check_import_fails(filename, patch_image(image, BLOCKS_OFFSET + 4, 0x80, 4));
+
+    fprintf(stderr, "-- arena ends past the end of the address space\n");
+    check_import_fails(filename, patch_image(image, ARENA_HEADER_OFFSET, 0xFFFFF000, 4));
+
+    fprintf(stderr, "-- truncated directory\n");
+    check_import_fails(filename, image.substr(0, first_page_offset(image) + 4));
+
+  } catch (const exception&) {
+    unlink(filename.c_str());
+    throw;
+  }
+  unlink(filename.c_str());
+
+  printf("MemoryContextTest: all tests passed\n");
+  return 0;
+}
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <algorithm>
 #include <forward_list>
 #include <set>
 #include <string>
@@ -1045,6 +1046,9 @@ uint32_t PPC32Emulator::Assembler::asm_bc_mnemonic(const StreamItem& si) {
 void PPC32Emulator::exec_44_sc(uint32_t op) {
   // 010001 00000000000000000000000010
   if (this->syscall_handler) {
+    // PPC syscalls don't have a number in the opcode; r0 conventionally
+    // contains it
+    ExecutionProfiler::SyscallScope scope(this->profiler.get(), this->regs.r[0].u);
     this->syscall_handler(*this);
   } else {
     this->exec_unimplemented(op);
@@ -1154,52 +1158,43 @@ uint32_t PPC32Emulator::Assembler::asm_b_mnemonic(const StreamItem& si) {
 
 
 
-void PPC32Emulator::exec_4C(uint32_t op) {
+PPC32Emulator::ExecFn PPC32Emulator::resolve_exec_4C(uint32_t op) {
   switch (op_get_subopcode(op)) {
     case 0x000:
-      this->exec_4C_000_mcrf(op);
-      break;
+      return &PPC32Emulator::exec_4C_000_mcrf;
     case 0x010:
-      this->exec_4C_010_bclr(op);
-      break;
+      return &PPC32Emulator::exec_4C_010_bclr;
     case 0x021:
-      this->exec_4C_021_crnor(op);
-      break;
+      return &PPC32Emulator::exec_4C_021_crnor;
     case 0x032:
-      this->exec_4C_032_rfi(op);
-      break;
+      return &PPC32Emulator::exec_4C_032_rfi;
     case 0x081:
-      this->exec_4C_081_crandc(op);
-      break;
+      return &PPC32Emulator::exec_4C_081_crandc;
     case 0x096:
-      this->exec_4C_096_isync(op);
-      break;
+      return &PPC32Emulator::exec_4C_096_isync;
     case 0x0C1:
-      this->exec_4C_0C1_crxor(op);
-      break;
+      return &PPC32Emulator::exec_4C_0C1_crxor;
     case 0x0E1:
-      this->exec_4C_0E1_crnand(op);
-      break;
+      return &PPC32Emulator::exec_4C_0E1_crnand;
     case 0x101:
-      this->exec_4C_101_crand(op);
-      break;
+      return &PPC32Emulator::exec_4C_101_crand;
     case 0x121:
-      this->exec_4C_121_creqv(op);
-      break;
+      return &PPC32Emulator::exec_4C_121_creqv;
     case 0x1A1:
-      this->exec_4C_1A1_crorc(op);
-      break;
+      return &PPC32Emulator::exec_4C_1A1_crorc;
     case 0x1C1:
-      this->exec_4C_1C1_cror(op);
-      break;
+      return &PPC32Emulator::exec_4C_1C1_cror;
     case 0x210:
-      this->exec_4C_210_bcctr(op);
-      break;
+      return &PPC32Emulator::exec_4C_210_bcctr;
     default:
       throw runtime_error("invalid 4C subopcode");
   }
 }
 
+void PPC32Emulator::exec_4C(uint32_t op) {
+  (this->*resolve_exec_4C(op))(op);
+}
+
 string PPC32Emulator::dasm_4C(DisassemblerState& s, uint32_t op) {
   switch (op_get_subopcode(op)) {
     case 0x000:
@@ -1886,306 +1881,216 @@ uint32_t PPC32Emulator::Assembler::asm_andis_rec(const StreamItem& si) {
 
 
 
-void PPC32Emulator::exec_7C(uint32_t op) {
+PPC32Emulator::ExecFn PPC32Emulator::resolve_exec_7C(uint32_t op) {
   switch (op_get_subopcode(op)) {
     case 0x000:
-      this->exec_7C_000_cmp(op);
-      break;
+      return &PPC32Emulator::exec_7C_000_cmp;
     case 0x004:
-      this->exec_7C_004_tw(op);
-      break;
+      return &PPC32Emulator::exec_7C_004_tw;
     case 0x008:
-      this->exec_7C_008_208_subfc(op);
-      break;
+      return &PPC32Emulator::exec_7C_008_208_subfc;
     case 0x00A:
-      this->exec_7C_00A_20A_addc(op);
-      break;
+      return &PPC32Emulator::exec_7C_00A_20A_addc;
     case 0x00B:
-      this->exec_7C_00B_mulhwu(op);
-      break;
+      return &PPC32Emulator::exec_7C_00B_mulhwu;
     case 0x013:
-      this->exec_7C_013_mfcr(op);
-      break;
+      return &PPC32Emulator::exec_7C_013_mfcr;
     case 0x014:
-      this->exec_7C_014_lwarx(op);
-      break;
+      return &PPC32Emulator::exec_7C_014_lwarx;
     case 0x017:
-      this->exec_7C_017_lwzx(op);
-      break;
+      return &PPC32Emulator::exec_7C_017_lwzx;
     case 0x018:
-      this->exec_7C_018_slw(op);
-      break;
+      return &PPC32Emulator::exec_7C_018_slw;
     case 0x01A:
-      this->exec_7C_01A_cntlzw(op);
-      break;
+      return &PPC32Emulator::exec_7C_01A_cntlzw;
     case 0x01C:
-      this->exec_7C_01C_and(op);
-      break;
+      return &PPC32Emulator::exec_7C_01C_and;
     case 0x020:
-      this->exec_7C_020_cmpl(op);
-      break;
+      return &PPC32Emulator::exec_7C_020_cmpl;
     case 0x028:
-      this->exec_7C_028_228_subf(op);
-      break;
+      return &PPC32Emulator::exec_7C_028_228_subf;
     case 0x036:
-      this->exec_7C_036_dcbst(op);
-      break;
+      return &PPC32Emulator::exec_7C_036_dcbst;
     case 0x037:
-      this->exec_7C_037_lwzux(op);
-      break;
+      return &PPC32Emulator::exec_7C_037_lwzux;
     case 0x03C:
-      this->exec_7C_03C_andc(op);
-      break;
+      return &PPC32Emulator::exec_7C_03C_andc;
     case 0x04B:
-      this->exec_7C_04B_mulhw(op);
-      break;
+      return &PPC32Emulator::exec_7C_04B_mulhw;
     case 0x053:
-      this->exec_7C_053_mfmsr(op);
-      break;
+      return &PPC32Emulator::exec_7C_053_mfmsr;
     case 0x056:
-      this->exec_7C_056_dcbf(op);
-      break;
+      return &PPC32Emulator::exec_7C_056_dcbf;
     case 0x057:
-      this->exec_7C_057_lbzx(op);
-      break;
+      return &PPC32Emulator::exec_7C_057_lbzx;
     case 0x068:
     case 0x268:
-      this->exec_7C_068_268_neg(op);
-      break;
+      return &PPC32Emulator::exec_7C_068_268_neg;
     case 0x077:
-      this->exec_7C_077_lbzux(op);
-      break;
+      return &PPC32Emulator::exec_7C_077_lbzux;
     case 0x07C:
-      this->exec_7C_07C_nor(op);
-      break;
+      return &PPC32Emulator::exec_7C_07C_nor;
     case 0x088:
     case 0x288:
-      this->exec_7C_088_288_subfe(op);
-      break;
+      return &PPC32Emulator::exec_7C_088_288_subfe;
     case 0x08A:
     case 0x28A:
-      this->exec_7C_08A_28A_adde(op);
-      break;
+      return &PPC32Emulator::exec_7C_08A_28A_adde;
     case 0x090:
-      this->exec_7C_090_mtcrf(op);
-      break;
+      return &PPC32Emulator::exec_7C_090_mtcrf;
     case 0x092:
-      this->exec_7C_092_mtmsr(op);
-      break;
+      return &PPC32Emulator::exec_7C_092_mtmsr;
     case 0x096:
-      this->exec_7C_096_stwcx_rec(op);
-      break;
+      return &PPC32Emulator::exec_7C_096_stwcx_rec;
     case 0x097:
-      this->exec_7C_097_stwx(op);
-      break;
+      return &PPC32Emulator::exec_7C_097_stwx;
     case 0x0B7:
-      this->exec_7C_0B7_stwux(op);
-      break;
+      return &PPC32Emulator::exec_7C_0B7_stwux;
     case 0x0C8:
     case 0x2C8:
-      this->exec_7C_0C8_2C8_subfze(op);
-      break;
+      return &PPC32Emulator::exec_7C_0C8_2C8_subfze;
     case 0x0CA:
     case 0x2CA:
-      this->exec_7C_0CA_2CA_addze(op);
-      break;
+      return &PPC32Emulator::exec_7C_0CA_2CA_addze;
     case 0x0D2:
-      this->exec_7C_0D2_mtsr(op);
-      break;
+      return &PPC32Emulator::exec_7C_0D2_mtsr;
     case 0x0D7:
-      this->exec_7C_0D7_stbx(op);
-      break;
+      return &PPC32Emulator::exec_7C_0D7_stbx;
     case 0x0E8:
     case 0x2E8:
-      this->exec_7C_0E8_2E8_subfme(op);
-      break;
+      return &PPC32Emulator::exec_7C_0E8_2E8_subfme;
     case 0x0EA:
     case 0x2EA:
-      this->exec_7C_0EA_2EA_addme(op);
-      break;
+      return &PPC32Emulator::exec_7C_0EA_2EA_addme;
     case 0x0EB:
     case 0x2EB:
-      this->exec_7C_0EB_2EB_mullw(op);
-      break;
+      return &PPC32Emulator::exec_7C_0EB_2EB_mullw;
     case 0x0F2:
-      this->exec_7C_0F2_mtsrin(op);
-      break;
+      return &PPC32Emulator::exec_7C_0F2_mtsrin;
     case 0x0F6:
-      this->exec_7C_0F6_dcbtst(op);
-      break;
+      return &PPC32Emulator::exec_7C_0F6_dcbtst;
     case 0x0F7:
-      this->exec_7C_0F7_stbux(op);
-      break;
+      return &PPC32Emulator::exec_7C_0F7_stbux;
     case 0x10A:
     case 0x30A:
-      this->exec_7C_10A_30A_add(op);
-      break;
+      return &PPC32Emulator::exec_7C_10A_30A_add;
     case 0x116:
-      this->exec_7C_116_dcbt(op);
-      break;
+      return &PPC32Emulator::exec_7C_116_dcbt;
     case 0x117:
-      this->exec_7C_117_lhzx(op);
-      break;
+      return &PPC32Emulator::exec_7C_117_lhzx;
     case 0x11C:
-      this->exec_7C_11C_eqv(op);
-      break;
+      return &PPC32Emulator::exec_7C_11C_eqv;
     case 0x132:
-      this->exec_7C_132_tlbie(op);
-      break;
+      return &PPC32Emulator::exec_7C_132_tlbie;
     case 0x136:
-      this->exec_7C_136_eciwx(op);
-      break;
+      return &PPC32Emulator::exec_7C_136_eciwx;
     case 0x137:
-      this->exec_7C_137_lhzux(op);
-      break;
+      return &PPC32Emulator::exec_7C_137_lhzux;
     case 0x13C:
-      this->exec_7C_13C_xor(op);
-      break;
+      return &PPC32Emulator::exec_7C_13C_xor;
     case 0x153:
-      this->exec_7C_153_mfspr(op);
-      break;
+      return &PPC32Emulator::exec_7C_153_mfspr;
     case 0x157:
-      this->exec_7C_157_lhax(op);
-      break;
+      return &PPC32Emulator::exec_7C_157_lhax;
     case 0x172:
-      this->exec_7C_172_tlbia(op);
-      break;
+      return &PPC32Emulator::exec_7C_172_tlbia;
     case 0x173:
-      this->exec_7C_173_mftb(op);
-      break;
+      return &PPC32Emulator::exec_7C_173_mftb;
     case 0x177:
-      this->exec_7C_177_lhaux(op);
-      break;
+      return &PPC32Emulator::exec_7C_177_lhaux;
     case 0x197:
-      this->exec_7C_197_sthx(op);
-      break;
+      return &PPC32Emulator::exec_7C_197_sthx;
     case 0x19C:
-      this->exec_7C_19C_orc(op);
-      break;
+      return &PPC32Emulator::exec_7C_19C_orc;
     case 0x1B6:
-      this->exec_7C_1B6_ecowx(op);
-      break;
+      return &PPC32Emulator::exec_7C_1B6_ecowx;
     case 0x1B7:
-      this->exec_7C_1B7_sthux(op);
-      break;
+      return &PPC32Emulator::exec_7C_1B7_sthux;
     case 0x1BC:
-      this->exec_7C_1BC_or(op);
-      break;
+      return &PPC32Emulator::exec_7C_1BC_or;
     case 0x1CB:
     case 0x3CB:
-      this->exec_7C_1CB_3CB_divwu(op);
-      break;
+      return &PPC32Emulator::exec_7C_1CB_3CB_divwu;
     case 0x1D3:
-      this->exec_7C_1D3_mtspr(op);
-      break;
+      return &PPC32Emulator::exec_7C_1D3_mtspr;
     case 0x1D6:
-      this->exec_7C_1D6_dcbi(op);
-      break;
+      return &PPC32Emulator::exec_7C_1D6_dcbi;
     case 0x1DC:
-      this->exec_7C_1DC_nand(op);
-      break;
+      return &PPC32Emulator::exec_7C_1DC_nand;
     case 0x1EB:
     case 0x3EB:
-      this->exec_7C_1EB_3EB_divw(op);
-      break;
+      return &PPC32Emulator::exec_7C_1EB_3EB_divw;
     case 0x200:
-      this->exec_7C_200_mcrxr(op);
-      break;
+      return &PPC32Emulator::exec_7C_200_mcrxr;
     case 0x215:
-      this->exec_7C_215_lswx(op);
-      break;
+      return &PPC32Emulator::exec_7C_215_lswx;
     case 0x216:
-      this->exec_7C_216_lwbrx(op);
-      break;
+      return &PPC32Emulator::exec_7C_216_lwbrx;
     case 0x217:
-      this->exec_7C_217_lfsx(op);
-      break;
+      return &PPC32Emulator::exec_7C_217_lfsx;
     case 0x218:
-      this->exec_7C_218_srw(op);
-      break;
+      return &PPC32Emulator::exec_7C_218_srw;
     case 0x236:
-      this->exec_7C_236_tlbsync(op);
-      break;
+      return &PPC32Emulator::exec_7C_236_tlbsync;
     case 0x237:
-      this->exec_7C_237_lfsux(op);
-      break;
+      return &PPC32Emulator::exec_7C_237_lfsux;
     case 0x253:
-      this->exec_7C_253_mfsr(op);
-      break;
+      return &PPC32Emulator::exec_7C_253_mfsr;
     case 0x255:
-      this->exec_7C_255_lswi(op);
-      break;
+      return &PPC32Emulator::exec_7C_255_lswi;
     case 0x256:
-      this->exec_7C_256_sync(op);
-      break;
+      return &PPC32Emulator::exec_7C_256_sync;
     case 0x257:
-      this->exec_7C_257_lfdx(op);
-      break;
+      return &PPC32Emulator::exec_7C_257_lfdx;
     case 0x277:
-      this->exec_7C_277_lfdux(op);
-      break;
+      return &PPC32Emulator::exec_7C_277_lfdux;
     case 0x293:
-      this->exec_7C_293_mfsrin(op);
-      break;
+      return &PPC32Emulator::exec_7C_293_mfsrin;
     case 0x295:
-      this->exec_7C_295_stswx(op);
-      break;
+      return &PPC32Emulator::exec_7C_295_stswx;
     case 0x296:
-      this->exec_7C_296_stwbrx(op);
-      break;
+      return &PPC32Emulator::exec_7C_296_stwbrx;
     case 0x297:
-      this->exec_7C_297_stfsx(op);
-      break;
+      return &PPC32Emulator::exec_7C_297_stfsx;
     case 0x2B7:
-      this->exec_7C_2B7_stfsux(op);
-      break;
+      return &PPC32Emulator::exec_7C_2B7_stfsux;
     case 0x2E5:
-      this->exec_7C_2E5_stswi(op);
-      break;
+      return &PPC32Emulator::exec_7C_2E5_stswi;
     case 0x2E7:
-      this->exec_7C_2E7_stfdx(op);
-      break;
+      return &PPC32Emulator::exec_7C_2E7_stfdx;
     case 0x2F6:
-      this->exec_7C_2F6_dcba(op);
-      break;
+      return &PPC32Emulator::exec_7C_2F6_dcba;
     case 0x2F7:
-      this->exec_7C_2F7_stfdux(op);
-      break;
+      return &PPC32Emulator::exec_7C_2F7_stfdux;
     case 0x316:
-      this->exec_7C_316_lhbrx(op);
-      break;
+      return &PPC32Emulator::exec_7C_316_lhbrx;
     case 0x318:
-      this->exec_7C_318_sraw(op);
-      break;
+      return &PPC32Emulator::exec_7C_318_sraw;
     case 0x338:
-      this->exec_7C_338_srawi(op);
-      break;
+      return &PPC32Emulator::exec_7C_338_srawi;
     case 0x356:
-      this->exec_7C_356_eieio(op);
-      break;
+      return &PPC32Emulator::exec_7C_356_eieio;
     case 0x396:
-      this->exec_7C_396_sthbrx(op);
-      break;
+      return &PPC32Emulator::exec_7C_396_sthbrx;
     case 0x39A:
-      this->exec_7C_39A_extsh(op);
-      break;
+      return &PPC32Emulator::exec_7C_39A_extsh;
     case 0x3BA:
-      this->exec_7C_3BA_extsb(op);
-      break;
+      return &PPC32Emulator::exec_7C_3BA_extsb;
     case 0x3D6:
-      this->exec_7C_3D6_icbi(op);
-      break;
+      return &PPC32Emulator::exec_7C_3D6_icbi;
     case 0x3D7:
-      this->exec_7C_3D7_stfiwx(op);
-      break;
+      return &PPC32Emulator::exec_7C_3D7_stfiwx;
     case 0x3F6:
-      this->exec_7C_3F6_dcbz(op);
-      break;
+      return &PPC32Emulator::exec_7C_3F6_dcbz;
     default:
       throw runtime_error("invalid 7C subopcode");
   }
 }
 
+void PPC32Emulator::exec_7C(uint32_t op) {
+  (this->*resolve_exec_7C(op))(op);
+}
+
 string PPC32Emulator::dasm_7C(DisassemblerState& s, uint32_t op) {
   switch (op_get_subopcode(op)) {
     case 0x000:
@@ -4657,43 +4562,37 @@ uint32_t PPC32Emulator::Assembler::asm_stfdu(const StreamItem& si) {
 
 
 
-void PPC32Emulator::exec_EC(uint32_t op) {
+PPC32Emulator::ExecFn PPC32Emulator::resolve_exec_EC(uint32_t op) {
   switch (op_get_short_subopcode(op)) {
     case 0x12:
-      this->exec_EC_12_fdivs(op);
-      break;
+      return &PPC32Emulator::exec_EC_12_fdivs;
     case 0x14:
-      this->exec_EC_14_fsubs(op);
-      break;
+      return &PPC32Emulator::exec_EC_14_fsubs;
     case 0x15:
-      this->exec_EC_15_fadds(op);
-      break;
+      return &PPC32Emulator::exec_EC_15_fadds;
     case 0x16:
-      this->exec_EC_16_fsqrts(op);
-      break;
+      return &PPC32Emulator::exec_EC_16_fsqrts;
     case 0x18:
-      this->exec_EC_18_fres(op);
-      break;
+      return &PPC32Emulator::exec_EC_18_fres;
     case 0x19:
-      this->exec_EC_19_fmuls(op);
-      break;
+      return &PPC32Emulator::exec_EC_19_fmuls;
     case 0x1C:
-      this->exec_EC_1C_fmsubs(op);
-      break;
+      return &PPC32Emulator::exec_EC_1C_fmsubs;
     case 0x1D:
-      this->exec_EC_1D_fmadds(op);
-      break;
+      return &PPC32Emulator::exec_EC_1D_fmadds;
     case 0x1E:
-      this->exec_EC_1E_fnmsubs(op);
-      break;
+      return &PPC32Emulator::exec_EC_1E_fnmsubs;
     case 0x1F:
-      this->exec_EC_1F_fnmadds(op);
-      break;
+      return &PPC32Emulator::exec_EC_1F_fnmadds;
     default:
       throw runtime_error("invalid EC subopcode");
   }
 }
 
+void PPC32Emulator::exec_EC(uint32_t op) {
+  (this->*resolve_exec_EC(op))(op);
+}
+
 string PPC32Emulator::dasm_EC(DisassemblerState& s, uint32_t op) {
   switch (op_get_short_subopcode(op)) {
     case 0x12:
@@ -4947,99 +4846,77 @@ uint32_t PPC32Emulator::Assembler::asm_fnmadds(const StreamItem& si) {
 
 
 
-void PPC32Emulator::exec_FC(uint32_t op) {
+PPC32Emulator::ExecFn PPC32Emulator::resolve_exec_FC(uint32_t op) {
   uint8_t short_sub = op_get_short_subopcode(op);
   if (short_sub & 0x10) {
     switch (short_sub) {
       case 0x12:
-        this->exec_FC_12_fdiv(op);
-        break;
+        return &PPC32Emulator::exec_FC_12_fdiv;
       case 0x14:
-        this->exec_FC_14_fsub(op);
-        break;
+        return &PPC32Emulator::exec_FC_14_fsub;
       case 0x15:
-        this->exec_FC_15_fadd(op);
-        break;
+        return &PPC32Emulator::exec_FC_15_fadd;
       case 0x16:
-        this->exec_FC_16_fsqrt(op);
-        break;
+        return &PPC32Emulator::exec_FC_16_fsqrt;
       case 0x17:
-        this->exec_FC_17_fsel(op);
-        break;
+        return &PPC32Emulator::exec_FC_17_fsel;
       case 0x19:
-        this->exec_FC_19_fmul(op);
-        break;
+        return &PPC32Emulator::exec_FC_19_fmul;
       case 0x1A:
-        this->exec_FC_1A_frsqrte(op);
-        break;
+        return &PPC32Emulator::exec_FC_1A_frsqrte;
       case 0x1C:
-        this->exec_FC_1C_fmsub(op);
-        break;
+        return &PPC32Emulator::exec_FC_1C_fmsub;
       case 0x1D:
-        this->exec_FC_1D_fmadd(op);
-        break;
+        return &PPC32Emulator::exec_FC_1D_fmadd;
       case 0x1E:
-        this->exec_FC_1E_fnmsub(op);
-        break;
+        return &PPC32Emulator::exec_FC_1E_fnmsub;
       case 0x1F:
-        this->exec_FC_1F_fnmadd(op);
-        break;
+        return &PPC32Emulator::exec_FC_1F_fnmadd;
       default:
         throw runtime_error("invalid FC subopcode");
     }
   } else {
     switch (op_get_subopcode(op)) {
       case 0x000:
-        this->exec_FC_000_fcmpu(op);
-        break;
+        return &PPC32Emulator::exec_FC_000_fcmpu;
       case 0x00C:
-        this->exec_FC_00C_frsp(op);
-        break;
+        return &PPC32Emulator::exec_FC_00C_frsp;
       case 0x00E:
-        this->exec_FC_00E_fctiw(op);
-        break;
+        return &PPC32Emulator::exec_FC_00E_fctiw;
       case 0x00F:
-        this->exec_FC_00F_fctiwz(op);
-        break;
+        return &PPC32Emulator::exec_FC_00F_fctiwz;
       case 0x020:
-        this->exec_FC_020_fcmpo(op);
-        break;
+        return &PPC32Emulator::exec_FC_020_fcmpo;
       case 0x026:
-        this->exec_FC_026_mtfsb1(op);
-        break;
+        return &PPC32Emulator::exec_FC_026_mtfsb1;
       case 0x028:
-        this->exec_FC_028_fneg(op);
-        break;
+        return &PPC32Emulator::exec_FC_028_fneg;
       case 0x040:
-        this->exec_FC_040_mcrfs(op);
-        break;
+        return &PPC32Emulator::exec_FC_040_mcrfs;
       case 0x046:
-        this->exec_FC_046_mtfsb0(op);
-        break;
+        return &PPC32Emulator::exec_FC_046_mtfsb0;
       case 0x048:
-        this->exec_FC_048_fmr(op);
-        break;
+        return &PPC32Emulator::exec_FC_048_fmr;
       case 0x086:
-        this->exec_FC_086_mtfsfi(op);
-        break;
+        return &PPC32Emulator::exec_FC_086_mtfsfi;
       case 0x088:
-        this->exec_FC_088_fnabs(op);
-        break;
+        return &PPC32Emulator::exec_FC_088_fnabs;
       case 0x108:
-        this->exec_FC_108_fabs(op);
-        break;
+        return &PPC32Emulator::exec_FC_108_fabs;
       case 0x247:
-        this->exec_FC_247_mffs(op);
-        break;
+        return &PPC32Emulator::exec_FC_247_mffs;
       case 0x2C7:
-        this->exec_FC_2C7_mtfsf(op);
-        break;
+        return &PPC32Emulator::exec_FC_2C7_mtfsf;
       default:
         throw runtime_error("invalid FC subopcode");
     }
   }
 }
 
+void PPC32Emulator::exec_FC(uint32_t op) {
+  (this->*resolve_exec_FC(op))(op);
+}
+
 string PPC32Emulator::dasm_FC(DisassemblerState& s, uint32_t op) {
   uint8_t short_sub = op_get_short_subopcode(op);
   if (short_sub & 0x10) {
@@ -6159,6 +6036,34 @@ void PPC32Registers::set_by_name(const std::string& reg_name, uint32_t value) {
   }
 }
 
+uint32_t PPC32Registers::get_by_name(const std::string& reg_name) const {
+  string name_lower = tolower(reg_name);
+
+  if (name_lower == "cr") {
+    return this->cr.u;
+  } else if (name_lower == "fpscr") {
+    return this->fpscr;
+  } else if (name_lower == "xer") {
+    return this->xer.u;
+  } else if (name_lower == "lr") {
+    return this->lr;
+  } else if (name_lower == "ctr") {
+    return this->ctr;
+  } else if (name_lower == "tbr") {
+    return this->tbr;
+  } else if (name_lower == "pc") {
+    return this->pc;
+  } else if ((name_lower.size() >= 2) && (name_lower[0] == 'r')) {
+    int64_t reg_num = strtol(name_lower.data() + 1, nullptr, 10);
+    if (reg_num < 0 || reg_num > 31) {
+      throw invalid_argument("invalid register number");
+    }
+    return this->r[reg_num].u;
+  } else {
+    throw invalid_argument("invalid register name");
+  }
+}
+
 void PPC32Registers::print_header(FILE* stream) {
   fprintf(stream, "---r0---/---r1---/---r2---/---r3---/---r4---/---r5---/"
       "---r6---/---r7---/---r8---/---r9---/--r10---/--r11---/--r12---/"
@@ -6206,7 +6111,228 @@ void PPC32Registers::set_crf_int_result(uint8_t crf_num, int32_t a) {
 
 
 PPC32Emulator::PPC32Emulator(shared_ptr<MemoryContext> mem)
-  : EmulatorBase(mem) { }
+  : EmulatorBase(mem),
+    last_predecoded_page_addr(0),
+    last_predecoded_page(nullptr),
+    predecode_generation(0xFFFFFFFFFFFFFFFF),
+    fetch_range({0, 0, nullptr}),
+    fetch_range_generation(0xFFFFFFFFFFFFFFFF) { }
+
+PPC32Emulator::PredecodedPage::PredecodedPage() {
+  for (size_t z = 0; z < PREDECODE_PAGE_INSTRUCTIONS; z++) {
+    this->instructions[z].op = 0;
+    this->instructions[z].exec = nullptr;
+    this->instructions[z].fused_exec = nullptr;
+    this->instructions[z].fused_ops[0] = 0;
+    this->instructions[z].fused_ops[1] = 0;
+    this->instructions[z].fused_count = 0;
+  }
+}
+
+PPC32Emulator::ExecFn PPC32Emulator::resolve_exec(uint32_t op) {
+  switch (op_get_op(op)) {
+    case 0x13:
+      return PPC32Emulator::resolve_exec_4C(op);
+    case 0x1F:
+      return PPC32Emulator::resolve_exec_7C(op);
+    case 0x3B:
+      return PPC32Emulator::resolve_exec_EC(op);
+    case 0x3F:
+      return PPC32Emulator::resolve_exec_FC(op);
+    default:
+      return PPC32Emulator::fns[op_get_op(op)].exec;
+  }
+}
+
+uint32_t PPC32Emulator::fetch_instruction(uint32_t addr) {
+  uint64_t generation = this->mem->get_layout_generation();
+  if ((this->fetch_range_generation != generation) ||
+      (addr < this->fetch_range.addr) ||
+      (static_cast<uint64_t>(addr) + 4 > this->fetch_range.end_addr)) {
+    this->fetch_range = this->mem->host_range_for_addr(addr);
+    this->fetch_range_generation = generation;
+    // If the opcode spans multiple ranges, let MemoryContext throw the
+    // appropriate exception
+    if (static_cast<uint64_t>(addr) + 4 > this->fetch_range.end_addr) {
+      return this->mem->read<be_uint32_t>(addr);
+    }
+  }
+  return *reinterpret_cast<const be_uint32_t*>(
+      this->fetch_range.host_addr + (addr - this->fetch_range.addr));
+}
+
+PPC32Emulator::PredecodedInstruction& PPC32Emulator::predecoded_instruction(
+    uint32_t addr, uint32_t op) {
+  uint64_t generation = this->mem->get_layout_generation();
+  if (this->predecode_generation != generation) {
+    this->predecoded_pages.clear();
+    this->last_predecoded_page = nullptr;
+    this->predecode_generation = generation;
+  }
+
+  uint32_t page_addr = addr >> PREDECODE_PAGE_BITS;
+  if (!this->last_predecoded_page || (this->last_predecoded_page_addr != page_addr)) {
+    auto& page = this->predecoded_pages[page_addr];
+    if (!page.get()) {
+      page.reset(new PredecodedPage());
+    }
+    this->last_predecoded_page = page.get();
+    this->last_predecoded_page_addr = page_addr;
+  }
+
+  auto& inst = this->last_predecoded_page->instructions[
+      (addr >> 2) & (PREDECODE_PAGE_INSTRUCTIONS - 1)];
+  if (!inst.exec || (inst.op != op)) {
+    // If resolve_exec throws (the opcode is invalid), the entry remains
+    // unused, so the exception is thrown again if it's executed again
+    inst.exec = this->resolve_exec(op);
+    inst.op = op;
+    this->predecode_fusion(inst, addr);
+  }
+  return inst;
+}
+
+PPC32Emulator::ExecFn PPC32Emulator::predecoded_exec(uint32_t addr, uint32_t op) {
+  return this->predecoded_instruction(addr, op).exec;
+}
+
+void PPC32Emulator::predecode_fusion(PredecodedInstruction& inst, uint32_t addr) {
+  inst.fused_exec = nullptr;
+  inst.fused_count = 0;
+
+  uint32_t op = inst.op;
+  uint32_t next_ops[2];
+  try {
+    next_ops[0] = this->fetch_instruction(addr + 4);
+  } catch (const exception&) {
+    return; // The first instruction is the last one in its memory range
+  }
+
+  switch (op_get_op(op)) {
+    case 0x0A: // cmpli (cmplwi)
+    case 0x0B: // cmpi (cmpwi)
+      if (!(op & 0x00600000) && (op_get_op(next_ops[0]) == 0x10)) {
+        inst.fused_exec = (op_get_op(op) == 0x0B)
+            ? &PPC32Emulator::exec_fused_cmpi_bc
+            : &PPC32Emulator::exec_fused_cmpli_bc;
+        inst.fused_count = 2;
+      }
+      break;
+
+    case 0x0F: { // addis (lis if rA is 0)
+      uint8_t rd = op_get_reg1(op);
+      if (op_get_reg2(op) != 0) {
+        break;
+      }
+      // The second instruction must read the register that lis wrote; addi
+      // with rA = 0 would be li instead
+      if ((op_get_op(next_ops[0]) == 0x0E) && (rd != 0) &&
+          (op_get_reg2(next_ops[0]) == rd)) {
+        inst.fused_exec = &PPC32Emulator::exec_fused_lis_addi;
+        inst.fused_count = 2;
+      } else if ((op_get_op(next_ops[0]) == 0x18) &&
+          (op_get_reg1(next_ops[0]) == rd)) {
+        inst.fused_exec = &PPC32Emulator::exec_fused_lis_ori;
+        inst.fused_count = 2;
+      }
+      break;
+    }
+
+    case 0x20: { // lwz (but not lwzu)
+      // This is the sequence used in cross-TOC glue and for calls through
+      // function pointers (transition vectors): lwz rN, X(rM); mtctr rN;
+      // bctr (or bctrl)
+      uint8_t rd = op_get_reg1(op);
+      uint8_t ra = op_get_reg2(op);
+      if ((ra == rd) || ((next_ops[0] & 0xFC1FFFFF) != 0x7C0903A6) ||
+          (op_get_reg1(next_ops[0]) != rd)) {
+        break;
+      }
+      try {
+        next_ops[1] = this->fetch_instruction(addr + 8);
+      } catch (const exception&) {
+        break;
+      }
+      if ((next_ops[1] & 0xFFFFFFFE) == 0x4E800420) {
+        inst.fused_exec = &PPC32Emulator::exec_fused_lwz_mtctr_bctr;
+        inst.fused_ops[1] = next_ops[1];
+        inst.fused_count = 3;
+      }
+      break;
+    }
+  }
+  inst.fused_ops[0] = next_ops[0];
+}
+
+bool PPC32Emulator::can_run_fused(PredecodedInstruction& inst) {
+  // The fused function doesn't check the execution limits or run interrupts
+  // between its instructions, so it can only be used if neither would do
+  // anything until the last instruction in the sequence
+  uint8_t num_skipped = inst.fused_count - 1;
+  if ((this->instructions_executed + num_skipped >= this->next_execution_limit_check) ||
+      this->interrupt_manager->has_calls_due_within(num_skipped)) {
+    return false;
+  }
+
+  // If any of the later instructions were overwritten, look for a sequence
+  // again; the instruction is run by itself this time either way
+  for (size_t z = 0; z < num_skipped; z++) {
+    if (this->fetch_instruction(this->regs.pc + 4 * (z + 1)) != inst.fused_ops[z]) {
+      this->predecode_fusion(inst, this->regs.pc);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Fused functions call this after each instruction except the last (for which
+// execute_loop does the same thing), so the registers and counters are correct
+// if a later instruction throws
+inline void PPC32Emulator::finish_fused_instruction() {
+  this->regs.pc += 4;
+  this->regs.tbr += this->regs.tbr_ticks_per_cycle;
+  this->instructions_executed++;
+  this->interrupt_manager->on_cycle_start();
+}
+
+void PPC32Emulator::exec_fused_lis_addi(uint32_t op1, uint32_t op2, uint32_t) {
+  int32_t high = op_get_imm(op1) << 16;
+  this->regs.r[op_get_reg1(op1)].s = high;
+  this->finish_fused_instruction();
+  this->regs.r[op_get_reg1(op2)].s = high + op_get_imm_ext(op2);
+}
+
+void PPC32Emulator::exec_fused_lis_ori(uint32_t op1, uint32_t op2, uint32_t) {
+  uint32_t high = op_get_imm(op1) << 16;
+  this->regs.r[op_get_reg1(op1)].u = high;
+  this->finish_fused_instruction();
+  this->regs.r[op_get_reg2(op2)].u = high | op_get_imm(op2);
+}
+
+void PPC32Emulator::exec_fused_lwz_mtctr_bctr(uint32_t op1, uint32_t, uint32_t op3) {
+  this->exec_80_84_lwz_lwzu(op1);
+  this->finish_fused_instruction();
+  this->regs.ctr = this->regs.r[op_get_reg1(op1)].u;
+  this->finish_fused_instruction();
+  if (op_get_b_link(op3)) {
+    this->regs.lr = this->regs.pc + 4;
+  }
+  this->regs.pc = (this->regs.ctr & 0xFFFFFFFC) - 4;
+}
+
+void PPC32Emulator::exec_fused_cmpi_bc(uint32_t op1, uint32_t op2, uint32_t) {
+  this->regs.set_crf_int_result(op_get_crf1(op1),
+      this->regs.r[op_get_reg2(op1)].s - op_get_imm_ext(op1));
+  this->finish_fused_instruction();
+  this->exec_40_bc(op2);
+}
+
+void PPC32Emulator::exec_fused_cmpli_bc(uint32_t op1, uint32_t op2, uint32_t) {
+  this->regs.set_crf_int_result(op_get_crf1(op1),
+      this->regs.r[op_get_reg2(op1)].u - op_get_imm(op1));
+  this->finish_fused_instruction();
+  this->exec_40_bc(op2);
+}
 
 void PPC32Emulator::import_state(FILE*) {
   throw runtime_error("PPC32Emulator::import_state is not implemented");
@@ -6216,6 +6342,14 @@ void PPC32Emulator::export_state(FILE*) const {
   throw runtime_error("PPC32Emulator::export_state is not implemented");
 }
 
+void PPC32Emulator::import_cpu_state(FILE*) {
+  throw runtime_error("PPC32Emulator::import_cpu_state is not implemented");
+}
+
+void PPC32Emulator::export_cpu_state(FILE*) const {
+  throw runtime_error("PPC32Emulator::export_cpu_state is not implemented");
+}
+
 void PPC32Emulator::print_state_header(FILE* stream) const {
   this->regs.print_header(stream);
   fprintf(stream, " = OPCODE\n");
@@ -6245,20 +6379,49 @@ void PPC32Emulator::execute() {
     this->interrupt_manager.reset(new InterruptManager());
   }
 
+  // The hooks are only checked here, so they must be set before execution
+  // begins
+  if (this->debug_hook || this->profiler) {
+    this->execute_loop<true>();
+  } else {
+    this->execute_loop<false>();
+  }
+}
+
+template <bool EnableHooks>
+void PPC32Emulator::execute_loop() {
   for (;;) {
     try {
-      if (this->debug_hook) {
-        this->debug_hook(*this);
+      if constexpr (EnableHooks) {
+        if (this->debug_hook) {
+          this->debug_hook(*this);
+        }
       }
 
       this->interrupt_manager->on_cycle_start();
 
-      uint32_t full_op = this->mem->read<be_uint32_t>(this->regs.pc);
-      uint8_t op = op_get_op(full_op);
-      auto fn = this->fns[op].exec;
-      (this->*fn)(full_op);
+      if constexpr (EnableHooks) {
+        if (this->profiler) {
+          this->profiler->on_instruction(this->regs.pc);
+        }
+      }
+
+      uint32_t full_op = this->fetch_instruction(this->regs.pc);
+      if constexpr (EnableHooks) {
+        auto fn = this->predecoded_exec(this->regs.pc, full_op);
+        (this->*fn)(full_op);
+      } else {
+        auto& inst = this->predecoded_instruction(this->regs.pc, full_op);
+        if (inst.fused_exec && this->can_run_fused(inst)) {
+          (this->*inst.fused_exec)(full_op, inst.fused_ops[0], inst.fused_ops[1]);
+        } else {
+          (this->*inst.exec)(full_op);
+        }
+      }
       this->regs.pc += 4;
       this->regs.tbr += this->regs.tbr_ticks_per_cycle;
+      this->instructions_executed++;
+      this->check_execution_limits();
 
     } catch (const terminate_emulation&) {
       break;
@@ -6276,76 +6439,70 @@ string PPC32Emulator::disassemble_one(DisassemblerState& s, uint32_t op) {
 }
 
 string PPC32Emulator::disassemble(const void* data, size_t size, uint32_t start_pc,
-    const multimap<uint32_t, string>* in_labels) {
-  static const multimap<uint32_t, string> empty_labels_map = {};
+    const multimap<uint32_t, string>* in_labels, size_t num_threads) {
+  if (!in_labels) {
+    return PPC32Emulator::disassemble(data, size, start_pc, static_cast<const LabelIndex*>(nullptr), num_threads);
+  }
+  LabelIndex label_index(*in_labels);
+  return PPC32Emulator::disassemble(data, size, start_pc, &label_index, num_threads);
+}
+
+string PPC32Emulator::disassemble(const void* data, size_t size, uint32_t start_pc,
+    const LabelIndex* in_labels, size_t num_threads) {
+  DisassemblyOutput out;
+  PPC32Emulator::disassemble(out, data, size, start_pc, in_labels, num_threads);
+  return out.take();
+}
 
-  DisassemblerState s = {
-    .pc = start_pc,
-    .labels = (in_labels ? in_labels : &empty_labels_map),
-    .branch_target_addresses = {},
-  };
+void PPC32Emulator::disassemble(DisassemblyOutput& out, const void* data,
+    size_t size, uint32_t start_pc, const LabelIndex* in_labels, size_t num_threads) {
+  static const LabelIndex empty_labels;
+  const auto* labels = in_labels ? in_labels : &empty_labels;
+  labels->sort();
 
   const be_uint32_t* opcodes = reinterpret_cast<const be_uint32_t*>(data);
 
   // Phase 1: generate the disassembly for each opcode, and collect branch
-  // target addresses
-  size_t line_count = size / 4;
-  forward_list<string> lines;
-  auto add_line_it = lines.before_begin();
-  for (size_t x = 0; x < line_count; x++, s.pc += 4) {
-    uint32_t opcode = opcodes[x];
-    string line = string_printf("%08X  %08X  ", s.pc, opcode);
-    line += PPC32Emulator::disassemble_one(s, opcode);
-    line += '\n';
-    add_line_it = lines.emplace_after(add_line_it, move(line));
-  }
-
-  // Phase 2: add labels from the passed-in labels dict and from disassembled
-  // branch opcodes; while doing so, count the number of bytes in the output.
-  s.pc = start_pc;
-  size_t ret_bytes = 0;
-  auto branch_target_addresses_it = s.branch_target_addresses.lower_bound(start_pc);
-  auto label_it = s.labels->lower_bound(start_pc);
-  for (auto prev_line_it = lines.before_begin(), line_it = lines.begin();
-       line_it != lines.end();
-       prev_line_it = line_it++, s.pc += 4) {
-    for (; label_it != s.labels->end() && label_it->first <= s.pc + 3; label_it++) {
-      string label;
-      if (label_it->first != s.pc) {
-        label = string_printf("%s: // at %08" PRIX32 " (misaligned)\n",
-              label_it->second.c_str(), label_it->first);
-      } else {
-        label = string_printf("%s:\n", label_it->second.c_str());
-      }
-      ret_bytes += label.size();
-      prev_line_it = lines.emplace_after(prev_line_it, move(label));
+  // target addresses. Opcodes are all the same size, so the chunks can begin
+  // at any opcode.
+  auto phase1_result = disassemble_chunked(start_pc, size & (~3), *labels,
+      num_threads, 4, false, true, [&](DisassemblyChunk& chunk, uint32_t pc) -> uint32_t {
+    DisassemblerState s = {
+      .pc = pc,
+      .labels = labels,
+      .branch_target_addresses = {},
+    };
+    uint32_t opcode = opcodes[(pc - start_pc) >> 2];
+    chunk.text.write_hex(pc, 8);
+    chunk.text.write("  ", 2);
+    chunk.text.write_hex(opcode, 8);
+    chunk.text.write("  ", 2);
+    chunk.text.write(PPC32Emulator::disassemble_one(s, opcode));
+    chunk.text.write('\n');
+    chunk.add_line(pc, pc + 4, s.branch_target_addresses);
+    return pc + 4;
+  });
+  const auto& branch_target_addresses = phase1_result.branch_targets;
+
+  // Phase 2: write the lines, with labels from the passed-in labels dict and
+  // from disassembled branch opcodes
+  auto branch_target_addresses_it = lower_bound(
+      branch_target_addresses.begin(), branch_target_addresses.end(), start_pc,
+      [](const pair<uint32_t, bool>& it, uint32_t addr) { return it.first < addr; });
+  auto label_it = labels->lower_bound(start_pc);
+  for (const auto& line : phase1_result.lines) {
+    uint32_t pc = line.pc;
+    for (; label_it != labels->end() && label_it->addr <= pc + 3; label_it++) {
+      write_disassembly_label(out, *label_it, pc);
     }
-    for (; branch_target_addresses_it != s.branch_target_addresses.end() &&
-           branch_target_addresses_it->first <= s.pc;
+    for (; branch_target_addresses_it != branch_target_addresses.end() &&
+           branch_target_addresses_it->first <= pc;
          branch_target_addresses_it++) {
-      string label;
-      const char* label_type = branch_target_addresses_it->second ? "fn" : "label";
-      if (branch_target_addresses_it->first != s.pc) {
-        label = string_printf("%s%08" PRIX32 ": // (misaligned)\n",
-            label_type, branch_target_addresses_it->first);
-      } else {
-        label = string_printf("%s%08" PRIX32 ":\n",
-            label_type, branch_target_addresses_it->first);
-      }
-      ret_bytes += label.size();
-      prev_line_it = lines.emplace_after(prev_line_it, move(label));
+      write_disassembly_branch_target_label(out, branch_target_addresses_it->first,
+          branch_target_addresses_it->second, pc);
     }
-
-    ret_bytes += line_it->size();
-  }
-
-  // Phase 3: assemble the output lines into a single string and return it
-  string ret;
-  ret.reserve(ret_bytes);
-  for (const auto& line : lines) {
-    ret += line;
+    out.write(phase1_result.text.data() + line.text_offset, line.text_size);
   }
-  return ret;
 }
 
 
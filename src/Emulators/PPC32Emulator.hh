@@ -8,6 +8,7 @@
 #include <memory>
 #include <vector>
 #include <set>
+#include <unordered_map>
 #include <phosg/Strings.hh>
 
 #include "EmulatorBase.hh"
@@ -98,6 +99,7 @@ struct PPC32Registers {
   PPC32Registers();
 
   void set_by_name(const std::string& reg_name, uint32_t value);
+  uint32_t get_by_name(const std::string& reg_name) const;
 
   inline uint32_t get_sp() const {
     return this->r[1].u;
@@ -149,7 +151,23 @@ public:
       const void* data,
       size_t size,
       uint32_t pc = 0,
-      const std::multimap<uint32_t, std::string>* labels = nullptr);
+      const LabelIndex* labels = nullptr,
+      size_t num_threads = 1);
+  // Same as above, but converts labels to a LabelIndex first
+  static std::string disassemble(
+      const void* data,
+      size_t size,
+      uint32_t pc,
+      const std::multimap<uint32_t, std::string>* labels,
+      size_t num_threads = 1);
+  // Same as above, but writes the disassembly to out instead of returning it
+  static void disassemble(
+      DisassemblyOutput& out,
+      const void* data,
+      size_t size,
+      uint32_t pc = 0,
+      const LabelIndex* labels = nullptr,
+      size_t num_threads = 1);
 
   struct AssembleResult {
     std::string code;
@@ -160,6 +178,8 @@ public:
 
   virtual void import_state(FILE* stream);
   virtual void export_state(FILE* stream) const;
+  virtual void import_cpu_state(FILE* stream);
+  virtual void export_cpu_state(FILE* stream) const;
 
   virtual void print_state_header(FILE* stream) const;
   virtual void print_state(FILE* stream) const;
@@ -168,22 +188,89 @@ private:
   PPC32Registers regs;
   std::deque<uint64_t> time_overrides;
 
+  // EnableHooks = false omits the debug hook and profiler checks; execute()
+  // uses that version when neither is set
+  template <bool EnableHooks>
+  void execute_loop();
+
   std::function<void(PPC32Emulator&)> syscall_handler;
   std::function<void(PPC32Emulator&)> debug_hook;
   std::shared_ptr<InterruptManager> interrupt_manager;
 
   struct DisassemblerState {
     uint32_t pc;
-    const std::multimap<uint32_t, std::string>* labels;
+    const LabelIndex* labels;
     std::map<uint32_t, bool> branch_target_addresses;
   };
 
+  typedef void (PPC32Emulator::*ExecFn)(uint32_t);
+
   struct OpcodeImplementation {
-    void (PPC32Emulator::*exec)(uint32_t);
+    ExecFn exec;
     std::string (*dasm)(DisassemblerState&, uint32_t);
   };
   static const OpcodeImplementation fns[0x40];
 
+  // Returns the function that implements the given opcode, looking through
+  // the subopcode tables for 4C, 7C, EC, and FC
+  static ExecFn resolve_exec(uint32_t op);
+  static ExecFn resolve_exec_4C(uint32_t op);
+  static ExecFn resolve_exec_7C(uint32_t op);
+  static ExecFn resolve_exec_EC(uint32_t op);
+  static ExecFn resolve_exec_FC(uint32_t op);
+
+  // Predecoded instructions, indexed by page. Each entry remembers the opcode
+  // it was decoded from; if the word in memory no longer matches (the code was
+  // overwritten), the entry is decoded again, so writes to code pages don't
+  // need to be tracked here. All pages are discarded when the memory layout
+  // changes, since their addresses may now refer to different memory.
+  //
+  // Some sequences of two or three instructions that compilers emit together
+  // (lis + addi/ori, lwz + mtctr + bctr(l), and cmpwi/cmplwi + bc) are also
+  // recognized when they're predecoded, and run as a single superinstruction
+  // by fused_exec. This only happens in execute_loop<false>, so the debug hook
+  // and profiler still see every instruction; the fused functions leave all
+  // registers in the same state as running the instructions individually
+  // would. Since the later instructions in the sequence aren't looked up in
+  // the predecoded pages, their opcodes are stored in fused_ops and checked
+  // against memory before each use (see can_run_fused).
+  typedef void (PPC32Emulator::*FusedExecFn)(uint32_t, uint32_t, uint32_t);
+  struct PredecodedInstruction {
+    uint32_t op;
+    ExecFn exec;
+    FusedExecFn fused_exec; // nullptr if no sequence begins here
+    uint32_t fused_ops[2];
+    uint8_t fused_count; // Including the first instruction
+  };
+  static constexpr size_t PREDECODE_PAGE_BITS = 12;
+  static constexpr size_t PREDECODE_PAGE_INSTRUCTIONS = (1 << PREDECODE_PAGE_BITS) / 4;
+  struct PredecodedPage {
+    PredecodedInstruction instructions[PREDECODE_PAGE_INSTRUCTIONS];
+    PredecodedPage();
+  };
+  std::unordered_map<uint32_t, std::unique_ptr<PredecodedPage>> predecoded_pages;
+  uint32_t last_predecoded_page_addr;
+  PredecodedPage* last_predecoded_page;
+  uint64_t predecode_generation;
+
+  // Instruction words are read directly from this host range (the arena or
+  // allocated block containing the pc); see the analogous fields in
+  // M68KEmulator
+  MemoryContext::HostRange fetch_range;
+  uint64_t fetch_range_generation;
+  uint32_t fetch_instruction(uint32_t addr);
+  PredecodedInstruction& predecoded_instruction(uint32_t addr, uint32_t op);
+  ExecFn predecoded_exec(uint32_t addr, uint32_t op);
+  void predecode_fusion(PredecodedInstruction& inst, uint32_t addr);
+  bool can_run_fused(PredecodedInstruction& inst);
+  void finish_fused_instruction();
+
+  void exec_fused_lis_addi(uint32_t op1, uint32_t op2, uint32_t);
+  void exec_fused_lis_ori(uint32_t op1, uint32_t op2, uint32_t);
+  void exec_fused_lwz_mtctr_bctr(uint32_t op1, uint32_t, uint32_t op3);
+  void exec_fused_cmpi_bc(uint32_t op1, uint32_t op2, uint32_t);
+  void exec_fused_cmpli_bc(uint32_t op1, uint32_t op2, uint32_t);
+
   static std::string disassemble_one(DisassemblerState& s, uint32_t op);
 
   bool should_branch(uint32_t op);
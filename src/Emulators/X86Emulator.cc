@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <array>
 #include <deque>
 #include <forward_list>
@@ -97,7 +98,7 @@ string X86Emulator::DisassemblyState::annotation_for_rm_ea(
       for (auto label_its = labels->equal_range(addr);
            label_its.first != label_its.second;
            label_its.first++) {
-        tokens.emplace_back("label " + label_its.first->second);
+        tokens.emplace_back("label " + *label_its.first->name);
       }
     }
 
@@ -215,6 +216,12 @@ X86Registers::X86Registers() {
   // 0x00000200 (bit 9) = interrupts enabled
   // 0x00000002 (bit 1) = reserved, but apparently always set in EFLAGS
   this->eflags = 0x00200202;
+  this->deferred_flags = 0;
+  this->deferred_op = DeferredFlagsOp::RESULT;
+  this->deferred_a = 0;
+  this->deferred_b = 0;
+  this->deferred_res = 0;
+  this->deferred_msb = 0;
   this->eip = 0;
 }
 
@@ -272,12 +279,35 @@ void X86Registers::set_by_name(const string& reg_name, uint32_t value) {
     this->w_edi(value);
 
   } else if (lower_name == "eflags") {
-    this->eflags = value;
+    this->write_eflags_unreported(value);
   } else {
     throw invalid_argument("unknown x86 register");
   }
 }
 
+uint32_t X86Registers::get_by_name(const string& reg_name) const {
+  static const char* names8[8] = {"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"};
+  static const char* names16[8] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+  static const char* names32[8] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"};
+
+  string lower_name = tolower(reg_name);
+  for (uint8_t z = 0; z < 8; z++) {
+    if (lower_name == names8[z]) {
+      return this->reg_unreported8(z);
+    } else if (lower_name == names16[z]) {
+      return this->reg_unreported16(z).load();
+    } else if (lower_name == names32[z]) {
+      return this->reg_unreported32(z).load();
+    }
+  }
+  if ((lower_name == "eip") || (lower_name == "pc")) {
+    return this->eip;
+  } else if (lower_name == "eflags") {
+    return this->read_eflags_unreported();
+  }
+  throw invalid_argument("unknown x86 register");
+}
+
 uint8_t& X86Registers::reg_unreported8(uint8_t which) {
   if (which & ~7) {
     throw logic_error("invalid register index");
@@ -373,11 +403,13 @@ X86Registers::XMMReg X86Registers::read_xmm_unreported(uint8_t which, uint8_t si
 
 bool X86Registers::read_flag(uint32_t mask) {
   this->mark_flags_read(mask);
+  this->resolve_deferred_flags(mask);
   return this->eflags & mask;
 }
 
 void X86Registers::replace_flag(uint32_t mask, bool value) {
   this->mark_flags_written(mask);
+  this->deferred_flags &= ~mask;
   this->eflags = (this->eflags & ~mask) | (value ? mask : 0);
 }
 
@@ -395,7 +427,7 @@ string X86Registers::flags_str(uint32_t flags) {
 }
 
 string X86Registers::flags_str() const {
-  return this->flags_str(this->eflags);
+  return this->flags_str(this->resolved_eflags());
 }
 
 void X86Registers::mark_flags_read(uint32_t mask) const {
@@ -554,6 +586,172 @@ bool X86Registers::check_condition(uint8_t cc) {
   }
 }
 
+template <typename T>
+void X86Registers::defer_flags(uint32_t mask, DeferredFlagsOp op, T a, T b, T res) {
+  if (!mask) {
+    return;
+  }
+  this->mark_flags_written(mask);
+  // All of the deferred flags refer to the same operation, so any that this
+  // operation doesn't replace have to be computed now
+  this->resolve_deferred_flags(this->deferred_flags & ~mask);
+  this->deferred_flags = mask;
+  this->deferred_op = op;
+  this->deferred_a = a;
+  this->deferred_b = b;
+  this->deferred_res = res;
+  this->deferred_msb = msb_for_type<T>;
+}
+
+uint32_t X86Registers::compute_deferred_flags(uint32_t mask) const {
+  uint32_t a = this->deferred_a;
+  uint32_t b = this->deferred_b;
+  uint32_t res = this->deferred_res;
+  uint32_t msb = this->deferred_msb;
+  uint32_t ret = 0;
+
+  if (mask & PF) {
+    // PF should be set if the number of ones is even. However, x86's PF
+    // apparently only applies to the least-significant byte of the result.
+    bool pf = true;
+    for (uint8_t v = res; v != 0; v >>= 1) {
+      pf ^= (v & 1);
+    }
+    ret |= pf ? PF : 0;
+  }
+
+  if (mask & OF) {
+    bool of;
+    switch (this->deferred_op) {
+      case DeferredFlagsOp::ADD:
+      case DeferredFlagsOp::ADD_WITH_CARRY:
+        // OF should be set if the result overflows the destination location, as
+        // if the operation was signed. Equivalently, OF should be set if a and b
+        // have the same sign and the result has the opposite sign (that is, the
+        // signed result has overflowed).
+        // The same rules apply when adding with carry. The edge cases that seem
+        // like they should require special treatment actually do not, because
+        // adding 1 moves the result away from any critical values, as shown
+        // below.
+        // a  b  c r  OF
+        // 00 00 1 01 0 (0    + 0    + 1 == 1)
+        // 00 7F 1 80 1 (0    + 127  + 1 != -128)
+        // 00 80 1 81 0 (0    + -128 + 1 == -127)
+        // 00 FF 1 00 0 (0    + -1   + 1 == 0)
+        // 7F 7F 1 FF 1 (127  + 127  + 1 != -1)
+        // 7F 80 1 00 0 (127  + -128 + 1 == 0)
+        // 7F FF 1 7F 0 (127  + -1   + 1 == 127)
+        // 80 80 1 01 1 (-128 + -128 + 1 != 1)
+        // 80 FF 1 80 0 (-128 + -1   + 1 == -128)
+        // FF FF 1 FF 0 (-1   + -1   + 1 == -1)
+        of = ((a & msb) == (b & msb)) && ((a & msb) != (res & msb));
+        break;
+      case DeferredFlagsOp::SUBTRACT:
+      case DeferredFlagsOp::SUBTRACT_WITH_BORROW:
+        // OF should be set if the result overflows the destination location, as
+        // if the operation was signed. Subtraction overflow logic is harder to
+        // understand than for addition, but the resulting rule is just as
+        // simple. The following observations apply:
+        // - If the operands are the same sign, overflow cannot occur, because
+        //   there is no way to get a result far enough away from the minuend.
+        // - If the operands are different signs and the result is the opposite
+        //   sign as the minuend, then overflow has occurred. (If the minuend is
+        //   positive, then it should have increased; if it was negative, it
+        //   should have decreased.)
+        // The edge cases are described in the following table:
+        // a  b  r  OF
+        // 00 00 00 0 (0    - 0    == 0)     ++ + 0
+        // 00 7F 81 0 (0    - 127  == -127)  ++ - 0
+        // 00 80 80 1 (0    - -128 != -128)  +- - 1
+        // 00 FF 01 0 (0    - -1   == 1)     +- + 0
+        // 7F 00 7F 0 (127  - 0    == 127)   ++ + 0
+        // 7F 7F 00 0 (127  - 127  == 0)     ++ + 0
+        // 7F 80 FF 1 (127  - -128 != -1)    +- - 1
+        // 7F FF 80 1 (127  - -1   != -128)  +- - 1
+        // 80 00 80 0 (-128 - 0    == -128)  -+ - 0
+        // 80 7F 01 1 (-128 - 127  != 1)     -+ + 1
+        // 80 80 00 0 (-128 - -128 == 0)     -- + 0
+        // 80 FF 81 0 (-128 - -1   == -127)  -- - 0
+        // FF 00 FF 0 (-1   - 0    == -1)    -+ - 0
+        // FF 7F 80 0 (-1   - 127  == -128)  -+ - 0
+        // FF 80 7F 0 (-1   - -128 == 127)   -- + 0
+        // FF FF 00 0 (-1   - -1   == 0)     -- + 0
+        // Perhaps surprisingly, the overflow logic is the same in the borrow
+        // case as in the non-borrow case. This table summarizes the edge cases:
+        // a  b  c r  OF
+        // 00 00 1 FF 0 (0    - 0    - 1 == -1)    ++ - 0
+        // 00 7F 1 80 0 (0    - 127  - 1 == -128)  ++ - 0
+        // 00 80 1 7F 0 (0    - -128 - 1 == 127)   +- + 0
+        // 00 FF 1 00 0 (0    - -1   - 1 == 0)     +- + 0
+        // 7F 00 1 7E 0 (127  - 0    - 1 == 126)   ++ + 0
+        // 7F 7F 1 FF 0 (127  - 127  - 1 == -1)    ++ - 0
+        // 7F 80 1 FE 1 (127  - -128 - 1 != -2)    +- - 1
+        // 7F FF 1 7F 0 (127  - -1   - 1 == 127)   +- + 0
+        // 80 00 1 7F 1 (-128 - 0    - 1 != 127)   -+ + 1
+        // 80 7F 1 00 1 (-128 - 127  - 1 != 0)     -+ + 1
+        // 80 80 1 FF 0 (-128 - -128 - 1 == -1)    -- - 0
+        // 80 FF 1 80 0 (-128 - -1   - 1 == -128)  -- - 0
+        // FF 00 1 FE 0 (-1   - 0    - 1 == -2)    -+ - 0
+        // FF 7E 1 80 0 (-1   - 126  - 1 == -128)  -+ - 0
+        // FF 7F 1 7F 1 (-1   - 127  - 1 != 127)   -+ + 1
+        // FF 80 1 7E 0 (-1   - -128 - 1 != 126)   -- + 0
+        // FF 81 1 7D 0 (-1   - -127 - 1 != 125)   -- + 0
+        // FF FF 1 FF 0 (-1   - -1   - 1 == -1)    -- - 0
+        of = ((a & msb) != (b & msb)) && ((a & msb) != (res & msb));
+        break;
+      default:
+        throw logic_error("OF cannot be deferred for this operation");
+    }
+    ret |= of ? OF : 0;
+  }
+
+  if (mask & AF) {
+    bool af;
+    switch (this->deferred_op) {
+      case DeferredFlagsOp::ADD:
+        // AF should be set if any nonzero bits were carried out of the lowest
+        // nybble. The logic here is similar to the CF logic, but applies only
+        // to the lowest 4 bytes.
+        af = ((res & 0x0F) < (a & 0x0F)) || ((res & 0x0F) < (b & 0x0F));
+        break;
+      case DeferredFlagsOp::ADD_WITH_CARRY:
+        // Similar reasoning as for CF applies here (about why we use <=).
+        af = ((res & 0x0F) <= (a & 0x0F)) || ((res & 0x0F) <= (b & 0x0F));
+        break;
+      case DeferredFlagsOp::SUBTRACT:
+        // AF should be set if any nonzero bits were borrowed into the lowest
+        // nybble. The logic here is similar to the CF logic, but applies only
+        // to the lowest 4 bytes.
+        af = ((res & 0x0F) > (a & 0x0F));
+        break;
+      case DeferredFlagsOp::SUBTRACT_WITH_BORROW:
+        // Again, this is analogous to the CF condition in the borrow case.
+        af = ((res & 0x0F) >= (a & 0x0F));
+        break;
+      default:
+        throw logic_error("AF cannot be deferred for this operation");
+    }
+    ret |= af ? AF : 0;
+  }
+
+  return ret;
+}
+
+void X86Registers::resolve_deferred_flags(uint32_t mask) {
+  mask &= this->deferred_flags;
+  if (mask) {
+    this->eflags = (this->eflags & ~mask) | this->compute_deferred_flags(mask);
+    this->deferred_flags &= ~mask;
+  }
+}
+
+uint32_t X86Registers::resolved_eflags() const {
+  if (!this->deferred_flags) {
+    return this->eflags;
+  }
+  return (this->eflags & ~this->deferred_flags) | this->compute_deferred_flags(this->deferred_flags);
+}
+
 template <typename T, enable_if_t<is_unsigned<T>::value, bool>>
 void X86Registers::set_flags_integer_result(T res, uint32_t apply_mask) {
   if (apply_mask & SF) {
@@ -565,25 +763,21 @@ void X86Registers::set_flags_integer_result(T res, uint32_t apply_mask) {
     this->replace_flag(ZF, (res == 0));
   }
   if (apply_mask & PF) {
-    // PF should be set if the number of ones is even. However, x86's PF
-    // apparently only applies to the least-significant byte of the result.
-    bool pf = true;
-    for (uint8_t v = res; v != 0; v >>= 1) {
-      pf ^= (v & 1);
-    }
-    this->replace_flag(PF, pf);
+    this->defer_flags<T>(PF, DeferredFlagsOp::RESULT, 0, 0, res);
   }
 }
 
 template <typename T, enable_if_t<is_unsigned<T>::value, bool>>
 void X86Registers::set_flags_bitwise_result(T res, uint32_t apply_mask) {
-  this->set_flags_integer_result(res, apply_mask);
+  // OF is replaced before PF is deferred, so a pending OF from an earlier
+  // operation doesn't have to be computed
   if (apply_mask & OF) {
     this->replace_flag(OF, false);
   }
   if (apply_mask & CF) {
     this->replace_flag(CF, false);
   }
+  this->set_flags_integer_result(res, apply_mask);
   // The manuals say that AF is undefined for bitwise operations (so it MAY be
   // changed). We just leave it alone here.
 }
@@ -592,17 +786,9 @@ template <typename T, enable_if_t<is_unsigned<T>::value, bool>>
 T X86Registers::set_flags_integer_add(T a, T b, uint32_t apply_mask) {
   T res = a + b;
 
-  this->set_flags_integer_result(res, apply_mask);
+  this->set_flags_integer_result(res, apply_mask & (SF | ZF));
+  this->defer_flags<T>(apply_mask & (PF | AF | OF), DeferredFlagsOp::ADD, a, b, res);
 
-  if (apply_mask & OF) {
-    // OF should be set if the result overflows the destination location, as if
-    // the operation was signed. Equivalently, OF should be set if a and b have
-    // the same sign and the result has the opposite sign (that is, the signed
-    // result has overflowed).
-    this->replace_flag(OF,
-        ((a & msb_for_type<T>) == (b & msb_for_type<T>)) &&
-        ((a & msb_for_type<T>) != (res & msb_for_type<T>)));
-  }
   if (apply_mask & CF) {
     // CF should be set if any nonzero bits were carried out, as if the
     // operation was unsigned. This is equivalent to the condition that the
@@ -611,12 +797,6 @@ T X86Registers::set_flags_integer_add(T a, T b, uint32_t apply_mask) {
     // one less than would result in a full wrap-around.
     this->replace_flag(CF, (res < a) || (res < b));
   }
-  if (apply_mask & AF) {
-    // AF should be set if any nonzero bits were carried out of the lowest
-    // nybble. The logic here is similar to the CF logic, but applies only to
-    // the lowest 4 bytes.
-    this->replace_flag(AF, ((res & 0x0F) < (a & 0x0F)) || ((res & 0x0F) < (b & 0x0F)));
-  }
 
   return res;
 }
@@ -631,29 +811,9 @@ T X86Registers::set_flags_integer_add_with_carry(T a, T b, uint32_t apply_mask)
 
   T res = a + b + 1;
 
-  this->set_flags_integer_result(res, apply_mask);
+  this->set_flags_integer_result(res, apply_mask & (SF | ZF));
+  this->defer_flags<T>(apply_mask & (PF | AF | OF), DeferredFlagsOp::ADD_WITH_CARRY, a, b, res);
 
-  if (apply_mask & OF) {
-    // The same rules as for add-without-carry apply here. The edge cases that
-    // seem like they should require special treatment actually do not, because
-    // adding 1 moves the result away from any critical values, as shown below.
-    // So, we can use the same rule - OF = ((a and b have same sign) and (res
-    // has opposite sign as a and b)).
-    // a  b  c r  OF
-    // 00 00 1 01 0 (0    + 0    + 1 == 1)
-    // 00 7F 1 80 1 (0    + 127  + 1 != -128)
-    // 00 80 1 81 0 (0    + -128 + 1 == -127)
-    // 00 FF 1 00 0 (0    + -1   + 1 == 0)
-    // 7F 7F 1 FF 1 (127  + 127  + 1 != -1)
-    // 7F 80 1 00 0 (127  + -128 + 1 == 0)
-    // 7F FF 1 7F 0 (127  + -1   + 1 == 127)
-    // 80 80 1 01 1 (-128 + -128 + 1 != 1)
-    // 80 FF 1 80 0 (-128 + -1   + 1 == -128)
-    // FF FF 1 FF 0 (-1   + -1   + 1 == -1)
-    this->replace_flag(OF,
-        ((a & msb_for_type<T>) == (b & msb_for_type<T>)) &&
-        ((a & msb_for_type<T>) != (res & msb_for_type<T>)));
-  }
   if (apply_mask & CF) {
     // CF should be set if any nonzero bits were carried out, as if the
     // operation was unsigned. This is equivalent to the condition that the
@@ -662,11 +822,6 @@ T X86Registers::set_flags_integer_add_with_carry(T a, T b, uint32_t apply_mask)
     // than at least one of the input operands because CF was set.
     this->replace_flag(CF, (res <= a) || (res <= b));
   }
-  if (apply_mask & AF) {
-    // AF should be set if any nonzero bits were carried out of the lowest
-    // nybble. Similar reasoning as for CF applies here (about why we use <=).
-    this->replace_flag(AF, ((res & 0x0F) <= (a & 0x0F)) || ((res & 0x0F) <= (b & 0x0F)));
-  }
 
   return res;
 }
@@ -675,41 +830,9 @@ template <typename T, enable_if_t<is_unsigned<T>::value, bool>>
 T X86Registers::set_flags_integer_subtract(T a, T b, uint32_t apply_mask) {
   T res = a - b;
 
-  this->set_flags_integer_result(res, apply_mask);
+  this->set_flags_integer_result(res, apply_mask & (SF | ZF));
+  this->defer_flags<T>(apply_mask & (PF | AF | OF), DeferredFlagsOp::SUBTRACT, a, b, res);
 
-  if (apply_mask & OF) {
-    // OF should be set if the result overflows the destination location, as if
-    // the operation was signed. Subtraction overflow logic is harder to
-    // understand than for addition, but the resulting rule is just as simple.
-    // The following observations apply:
-    // - If the operands are the same sign, overflow cannot occur, because there
-    //   is no way to get a result far enough away from the minuend.
-    // - If the operands are different signs and the result is the opposite sign
-    //   as the minuend, then overflow has occurred. (If the minuend is
-    //   positive, then it should have increased; if it was negative, it should
-    //   have decreased.)
-    // The edge cases are described in the following table:
-    // a  b  r  OF
-    // 00 00 00 0 (0    - 0    == 0)     ++ + 0
-    // 00 7F 81 0 (0    - 127  == -127)  ++ - 0
-    // 00 80 80 1 (0    - -128 != -128)  +- - 1
-    // 00 FF 01 0 (0    - -1   == 1)     +- + 0
-    // 7F 00 7F 0 (127  - 0    == 127)   ++ + 0
-    // 7F 7F 00 0 (127  - 127  == 0)     ++ + 0
-    // 7F 80 FF 1 (127  - -128 != -1)    +- - 1
-    // 7F FF 80 1 (127  - -1   != -128)  +- - 1
-    // 80 00 80 0 (-128 - 0    == -128)  -+ - 0
-    // 80 7F 01 1 (-128 - 127  != 1)     -+ + 1
-    // 80 80 00 0 (-128 - -128 == 0)     -- + 0
-    // 80 FF 81 0 (-128 - -1   == -127)  -- - 0
-    // FF 00 FF 0 (-1   - 0    == -1)    -+ - 0
-    // FF 7F 80 0 (-1   - 127  == -128)  -+ - 0
-    // FF 80 7F 0 (-1   - -128 == 127)   -- + 0
-    // FF FF 00 0 (-1   - -1   == 0)     -- + 0
-    this->replace_flag(OF,
-        ((a & msb_for_type<T>) != (b & msb_for_type<T>)) &&
-        ((a & msb_for_type<T>) != (res & msb_for_type<T>)));
-  }
   if (apply_mask & CF) {
     // CF should be set if any nonzero bits were borrowed in, as if the
     // operation was unsigned. This is equivalent to the condition that the
@@ -718,12 +841,6 @@ T X86Registers::set_flags_integer_subtract(T a, T b, uint32_t apply_mask) {
     // any other value is one less than would result in a full wrap-around.
     this->replace_flag(CF, (res > a));
   }
-  if (apply_mask & AF) {
-    // AF should be set if any nonzero bits were borrowed into the lowest
-    // nybble. The logic here is similar to the CF logic, but applies only to
-    // the lowest 4 bytes.
-    this->replace_flag(AF, ((res & 0x0F) > (a & 0x0F)));
-  }
 
   return res;
 }
@@ -738,34 +855,9 @@ T X86Registers::set_flags_integer_subtract_with_borrow(T a, T b, uint32_t apply_
 
   T res = a - b - 1;
 
-  this->set_flags_integer_result(res, apply_mask);
+  this->set_flags_integer_result(res, apply_mask & (SF | ZF));
+  this->defer_flags<T>(apply_mask & (PF | AF | OF), DeferredFlagsOp::SUBTRACT_WITH_BORROW, a, b, res);
 
-  if (apply_mask & OF) {
-    // Perhaps surprisingly, the overflow logic is the same in the borrow case
-    // as in the non-borrow case. This table summarizes the edge cases:
-    // a  b  c r  OF
-    // 00 00 1 FF 0 (0    - 0    - 1 == -1)    ++ - 0
-    // 00 7F 1 80 0 (0    - 127  - 1 == -128)  ++ - 0
-    // 00 80 1 7F 0 (0    - -128 - 1 == 127)   +- + 0
-    // 00 FF 1 00 0 (0    - -1   - 1 == 0)     +- + 0
-    // 7F 00 1 7E 0 (127  - 0    - 1 == 126)   ++ + 0
-    // 7F 7F 1 FF 0 (127  - 127  - 1 == -1)    ++ - 0
-    // 7F 80 1 FE 1 (127  - -128 - 1 != -2)    +- - 1
-    // 7F FF 1 7F 0 (127  - -1   - 1 == 127)   +- + 0
-    // 80 00 1 7F 1 (-128 - 0    - 1 != 127)   -+ + 1
-    // 80 7F 1 00 1 (-128 - 127  - 1 != 0)     -+ + 1
-    // 80 80 1 FF 0 (-128 - -128 - 1 == -1)    -- - 0
-    // 80 FF 1 80 0 (-128 - -1   - 1 == -128)  -- - 0
-    // FF 00 1 FE 0 (-1   - 0    - 1 == -2)    -+ - 0
-    // FF 7E 1 80 0 (-1   - 126  - 1 == -128)  -+ - 0
-    // FF 7F 1 7F 1 (-1   - 127  - 1 != 127)   -+ + 1
-    // FF 80 1 7E 0 (-1   - -128 - 1 != 126)   -- + 0
-    // FF 81 1 7D 0 (-1   - -127 - 1 != 125)   -- + 0
-    // FF FF 1 FF 0 (-1   - -1   - 1 == -1)    -- - 0
-    this->replace_flag(OF,
-        ((a & msb_for_type<T>) != (b & msb_for_type<T>)) &&
-        ((a & msb_for_type<T>) != (res & msb_for_type<T>)));
-  }
   if (apply_mask & CF) {
     // Analogously to adding with carry, we use the same condition as in the
     // non-borrow case, but use >= instead of >. This is because the result
@@ -773,10 +865,6 @@ T X86Registers::set_flags_integer_subtract_with_borrow(T a, T b, uint32_t apply_
     // subtracted at least 1.
     this->replace_flag(CF, (res >= a));
   }
-  if (apply_mask & AF) {
-    // Again, this is analogous to the AF condition in the non-borrow case.
-    this->replace_flag(AF, ((res & 0x0F) >= (a & 0x0F)));
-  }
 
   return res;
 }
@@ -791,7 +879,7 @@ void X86Registers::import_state(FILE* stream) {
   for (size_t x = 0; x < 8; x++) {
     this->regs[x].u = freadx<le_uint32_t>(stream);
   }
-  this->eflags = freadx<le_uint32_t>(stream);
+  this->write_eflags_unreported(freadx<le_uint32_t>(stream));
   this->eip = freadx<le_uint32_t>(stream);
   if (version >= 1) {
     for (size_t x = 0; x < 8; x++) {
@@ -812,7 +900,7 @@ void X86Registers::export_state(FILE* stream) const {
   for (size_t x = 0; x < 8; x++) {
     fwritex<le_uint32_t>(stream, this->regs[x].u);
   }
-  fwritex<le_uint32_t>(stream, this->eflags);
+  fwritex<le_uint32_t>(stream, this->resolved_eflags());
   fwritex<le_uint32_t>(stream, this->eip);
   for (size_t x = 0; x < 8; x++) {
     fwritex<le_uint64_t>(stream, this->xmm[x].u64[0]);
@@ -871,15 +959,13 @@ void X86Emulator::print_state(FILE* stream) const {
     }
   } catch (const out_of_range&) { }
 
-  this->compute_execution_labels();
-
   DisassemblyState s = {
     StringReader(data),
     this->regs.eip,
     0,
     this->overrides,
     {},
-    &this->execution_labels,
+    &this->mem->symbol_index(),
     this,
   };
   try {
@@ -960,6 +1046,24 @@ X86Emulator::DecodedRM X86Emulator::fetch_and_decode_rm(StringReader& r) {
 }
 
 X86Emulator::DecodedRM X86Emulator::fetch_and_decode_rm() {
+  if (this->replay_inst && (this->regs.eip == this->replay_rm_addr)) {
+    const auto* inst = this->replay_inst;
+    this->replay_inst = nullptr;
+    this->regs.eip += inst->rm_length;
+    return inst->rm;
+  }
+
+  uint32_t rm_addr = this->regs.eip;
+  DecodedRM ret = this->fetch_and_decode_rm_uncached();
+  if (this->record_inst && !this->record_inst->rm_length) {
+    this->record_inst->rm_offset = rm_addr - this->record_inst_addr;
+    this->record_inst->rm_length = this->regs.eip - rm_addr;
+    this->record_inst->rm = ret;
+  }
+  return ret;
+}
+
+X86Emulator::DecodedRM X86Emulator::fetch_and_decode_rm_uncached() {
   uint8_t rm = this->fetch_instruction_byte();
   uint8_t sib = 0;
 
@@ -1234,7 +1338,10 @@ void X86Emulator::report_access(uint32_t addr, uint8_t size, bool is_write, bool
 
 void X86Emulator::report_mem_access(uint32_t addr, uint8_t size, bool is_write, uint64_t value_low, uint64_t value_high) {
   this->EmulatorBase::report_mem_access(addr, size, is_write);
-  this->report_access(addr, size, is_write, false, false, value_low, value_high);
+  // Don't allocate a DataAccess if it would just be discarded
+  if (this->trace_data_sources) {
+    this->report_access(addr, size, is_write, false, false, value_low, value_high);
+  }
 }
 
 void X86Emulator::link_current_accesses() {
@@ -2576,6 +2683,7 @@ string X86Emulator::dasm_C9_leave(DisassemblyState&) {
 void X86Emulator::exec_CC_CD_int(uint8_t opcode) {
   uint8_t int_num = (opcode & 1) ? this->fetch_instruction_byte() : 3;
   if (this->syscall_handler) {
+    ExecutionProfiler::SyscallScope scope(this->profiler.get(), int_num);
     this->syscall_handler(*this, int_num);
   } else {
     this->exec_unimplemented(opcode);
@@ -3620,9 +3728,21 @@ X86Emulator::X86Emulator(shared_ptr<MemoryContext> mem)
   : EmulatorBase(mem),
     behavior(Behavior::SPECIFICATION),
     tsc_offset(0),
-    execution_labels_computed(false),
     trace_data_sources(false),
-    trace_data_source_addrs(false) { }
+    trace_data_source_addrs(false),
+    last_predecoded_page_addr(0),
+    last_predecoded_page(nullptr),
+    predecode_generation(0xFFFFFFFFFFFFFFFF),
+    replay_inst(nullptr),
+    replay_rm_addr(0),
+    record_inst(nullptr),
+    record_inst_addr(0) { }
+
+X86Emulator::PredecodedPage::PredecodedPage() {
+  for (auto& inst : this->instructions) {
+    inst.length = 0;
+  }
+}
 
 const X86Emulator::OpcodeImplementation X86Emulator::fns[0x100] = {
   // 00
@@ -4238,29 +4358,54 @@ const char* X86Overrides::overridden_segment_name() const {
 
 
 void X86Emulator::execute() {
-  this->execution_labels_computed = false;
+  // The hooks are only checked here, so they must be set before execution
+  // begins
+  if (this->debug_hook || this->profiler || this->trace_data_sources || this->log_memory_access) {
+    this->execute_loop<true>();
+  } else {
+    this->execute_loop<false>();
+  }
+}
+
+template <bool EnableHooks>
+void X86Emulator::execute_loop() {
   for (;;) {
-    // Call debug hook if present
-    if (this->debug_hook) {
-      try {
-        this->debug_hook(*this);
-        // The debug hook can modify registers, and we don't want to erroneously
-        // assign these changes to the next opcode.
-        this->regs.reset_access_flags();
-      } catch (const terminate_emulation&) {
-        break;
+    if constexpr (EnableHooks) {
+      // Call debug hook if present
+      if (this->debug_hook) {
+        try {
+          this->debug_hook(*this);
+          // The debug hook can modify registers, and we don't want to
+          // erroneously assign these changes to the next opcode.
+          this->regs.reset_access_flags();
+        } catch (const terminate_emulation&) {
+          break;
+        }
+      }
+
+      if (this->profiler) {
+        this->profiler->on_instruction(this->regs.eip);
       }
     }
 
+    if constexpr (!EnableHooks) {
+      this->execute_one_predecoded();
+      this->instructions_executed++;
+      this->check_execution_limits();
+      continue;
+    }
+
     // Execute a cycle. This is a loop because prefix bytes are implemented as
     // separate opcodes, so we want to call the prefix handler and the opcode
     // handler as if they were a single opcode.
     for (bool should_execute_again = true; should_execute_again;) {
       uint8_t opcode = this->fetch_instruction_byte();
       auto fn = this->fns[opcode].exec;
-      if (this->trace_data_sources) {
-        this->prev_regs = this->regs;
-        this->prev_regs.reset_access_flags();
+      if constexpr (EnableHooks) {
+        if (this->trace_data_sources) {
+          this->prev_regs = this->regs;
+          this->prev_regs.reset_access_flags();
+        }
       }
       if (fn) {
         (this->*fn)(opcode);
@@ -4273,20 +4418,103 @@ void X86Emulator::execute() {
     }
 
     this->instructions_executed++;
+    this->check_execution_limits();
+  }
+}
+
+X86Emulator::PredecodedInstruction& X86Emulator::predecoded_instruction(uint32_t addr) {
+  uint64_t generation = this->mem->get_layout_generation();
+  if (this->predecode_generation != generation) {
+    this->predecoded_pages.clear();
+    this->last_predecoded_page = nullptr;
+    this->predecode_generation = generation;
+  }
+
+  uint32_t page_addr = addr >> PREDECODE_PAGE_BITS;
+  if (!this->last_predecoded_page || (this->last_predecoded_page_addr != page_addr)) {
+    auto& page = this->predecoded_pages[page_addr];
+    if (!page.get()) {
+      page.reset(new PredecodedPage());
+    }
+    this->last_predecoded_page = page.get();
+    this->last_predecoded_page_addr = page_addr;
   }
-  this->execution_labels.clear();
+  return this->last_predecoded_page->instructions[addr & ((1 << PREDECODE_PAGE_BITS) - 1)];
 }
 
+void X86Emulator::execute_one_predecoded() {
+  uint32_t start_addr = this->regs.eip;
+  auto& inst = this->predecoded_instruction(start_addr);
+
+  if (inst.length && !memcmp(this->mem->at<uint8_t>(start_addr, inst.length), inst.bytes, inst.length)) {
+    this->overrides = inst.overrides;
+    this->regs.eip = start_addr + inst.opcode_end_offset;
+    if (inst.rm_length) {
+      this->replay_inst = &inst;
+      this->replay_rm_addr = start_addr + inst.rm_offset;
+    }
+    try {
+      (this->*inst.exec)(inst.opcode);
+    } catch (...) {
+      this->replay_inst = nullptr;
+      throw;
+    }
+    this->replay_inst = nullptr;
+    // Nothing is recorded in current_reads or current_writes, since tracing is
+    // off
+    this->regs.reset_access_flags();
+    this->overrides.on_opcode_complete();
+    return;
+  }
+
+  // The entry is missing or stale, so run the instruction normally and record
+  // it. The bytes are copied before executing, since the instruction may
+  // overwrite itself.
+  inst.length = 0;
+  inst.rm_length = 0;
+  auto range = this->mem->host_range_for_addr(start_addr);
+  size_t available_bytes = min<uint64_t>(sizeof(inst.bytes), range.end_addr - start_addr);
+  memcpy(inst.bytes, range.host_addr + (start_addr - range.addr), available_bytes);
+  this->record_inst = &inst;
+  this->record_inst_addr = start_addr;
 
+  try {
+    for (bool should_execute_again = true; should_execute_again;) {
+      X86Overrides overrides_before = this->overrides;
+      uint8_t opcode = this->fetch_instruction_byte();
+      uint32_t opcode_end_addr = this->regs.eip;
+      auto fn = this->fns[opcode].exec;
+      if (fn) {
+        (this->*fn)(opcode);
+      } else {
+        this->exec_unimplemented(opcode);
+      }
+      this->regs.reset_access_flags();
+      should_execute_again = !this->overrides.should_clear;
 
-void X86Emulator::compute_execution_labels() const {
-  if (!this->execution_labels_computed) {
-    this->execution_labels.clear();
-    for (const auto& symbol_it : this->mem->all_symbols()) {
-      this->execution_labels.emplace(symbol_it.second, symbol_it.first);
+      if (!should_execute_again) {
+        size_t length = opcode_end_addr - start_addr;
+        if (inst.rm_length) {
+          length = max<size_t>(length, inst.rm_offset + inst.rm_length);
+        }
+        // For prefix opcodes, on_opcode_complete only sets should_clear, so
+        // this is the state that the final opcode's handler saw
+        overrides_before.should_clear = true;
+        if (length <= available_bytes) {
+          inst.overrides = overrides_before;
+          inst.opcode_end_offset = opcode_end_addr - start_addr;
+          inst.opcode = opcode;
+          inst.exec = fn;
+          inst.length = length;
+        }
+      }
+      this->overrides.on_opcode_complete();
     }
-    this->execution_labels_computed = true;
+  } catch (...) {
+    this->record_inst = nullptr;
+    throw;
   }
+  this->record_inst = nullptr;
 }
 
 
@@ -4317,92 +4545,85 @@ string X86Emulator::disassemble(
     const void* vdata,
     size_t size,
     uint32_t start_address,
-    const multimap<uint32_t, string>* labels) {
-  static const multimap<uint32_t, string> empty_labels_map = {};
+    const multimap<uint32_t, string>* labels,
+    size_t num_threads) {
   if (!labels) {
-    labels = &empty_labels_map;
+    return X86Emulator::disassemble(vdata, size, start_address, static_cast<const LabelIndex*>(nullptr), num_threads);
   }
+  LabelIndex label_index(*labels);
+  return X86Emulator::disassemble(vdata, size, start_address, &label_index, num_threads);
+}
 
-  DisassemblyState s = {
-    StringReader(vdata, size),
-    start_address,
-    0,
-    X86Overrides(),
-    {},
-    labels,
-    nullptr,
-  };
+string X86Emulator::disassemble(
+    const void* vdata,
+    size_t size,
+    uint32_t start_address,
+    const LabelIndex* labels,
+    size_t num_threads) {
+  DisassemblyOutput out;
+  X86Emulator::disassemble(out, vdata, size, start_address, labels, num_threads);
+  return out.take();
+}
 
-  // Generate disassembly lines for each opcode
-  map<uint32_t, pair<string, uint32_t>> lines; // {pc: (line, next_pc)}
-  while (!s.r.eof()) {
-    uint32_t pc = s.start_address + s.r.where();
-    string line = string_printf("%08" PRIX32 " ", pc);
-    line += X86Emulator::disassemble_one(s) + "\n";
+void X86Emulator::disassemble(
+    DisassemblyOutput& out,
+    const void* vdata,
+    size_t size,
+    uint32_t start_address,
+    const LabelIndex* labels,
+    size_t num_threads) {
+  static const LabelIndex empty_labels;
+  if (!labels) {
+    labels = &empty_labels;
+  }
+  labels->sort();
+
+  // Generate disassembly lines for each opcode. Chunks begin only at labels;
+  // the first branch to each address determines whether it's labeled as a
+  // function, as it would if this were done in one pass.
+  auto result = disassemble_chunked(start_address, size, *labels,
+      num_threads, 1, true, false, [&](DisassemblyChunk& chunk, uint32_t pc) -> uint32_t {
+    DisassemblyState s = {
+      StringReader(vdata, size),
+      start_address,
+      0,
+      X86Overrides(),
+      {},
+      labels,
+      nullptr,
+    };
+    s.r.go(pc - start_address);
+    chunk.text.write_hex(pc, 8);
+    chunk.text.write(' ');
+    chunk.text.write(X86Emulator::disassemble_one(s));
+    chunk.text.write('\n');
     uint32_t next_pc = s.start_address + s.r.where();
-    lines.emplace(pc, make_pair(move(line), next_pc));
-    s.overrides.on_opcode_complete();
-  }
+    chunk.add_line(pc, next_pc, s.branch_target_addresses);
+    return next_pc;
+  });
+  const auto& branch_target_addresses = result.branch_targets;
 
   // TODO: Implement backups like we do in M68KEmulator::disassemble
 
-  // Generate output lines, including passed-in labels and branch target labels
-  size_t ret_bytes = 0;
-  deque<string> ret_lines;
-  auto branch_target_it = s.branch_target_addresses.lower_bound(start_address);
+  // Write the lines, including passed-in labels and branch target labels
+  auto branch_target_it = lower_bound(
+      branch_target_addresses.begin(), branch_target_addresses.end(), start_address,
+      [](const pair<uint32_t, bool>& it, uint32_t addr) { return it.first < addr; });
   auto label_it = labels->lower_bound(start_address);
 
-  for (auto line_it = lines.begin();
-       line_it != lines.end();
-       line_it = lines.find(line_it->second.second)) {
-    uint32_t pc = line_it->first;
-    string& line = line_it->second.first;
-
-    // TODO: Deduplicate this functionality (label iteration + line assembly)
-    // across the various emulator implementations
-    for (; label_it != labels->end() && label_it->first <= pc; label_it++) {
-      string label;
-      if (label_it->first != pc) {
-        label = string_printf("%s: // at %08" PRIX32 " (misaligned)\n",
-              label_it->second.c_str(), label_it->first);
-      } else {
-        label = string_printf("%s:\n", label_it->second.c_str());
-      }
-      ret_bytes += label.size();
-      ret_lines.emplace_back(move(label));
+  for (const auto& line : result.lines) {
+    uint32_t pc = line.pc;
+    for (; label_it != labels->end() && label_it->addr <= pc; label_it++) {
+      write_disassembly_label(out, *label_it, pc);
     }
-    for (; (branch_target_it != s.branch_target_addresses.end()) &&
+    for (; (branch_target_it != branch_target_addresses.end()) &&
            (branch_target_it->first <= pc);
          branch_target_it++) {
-      string label;
-      const char* label_type = branch_target_it->second ? "fn" : "label";
-      if (branch_target_it->first != pc) {
-        label = string_printf("%s%08" PRIX32 ": // (misaligned)\n",
-            label_type, branch_target_it->first);
-      } else {
-        label = string_printf("%s%08" PRIX32 ":\n",
-            label_type, branch_target_it->first);
-      }
-      ret_bytes += label.size();
-      ret_lines.emplace_back(move(label));
+      write_disassembly_branch_target_label(out, branch_target_it->first,
+          branch_target_it->second, pc);
     }
-
-    ret_bytes += line.size();
-    // TODO: we can eliminate this copy by making ret_lines instead keep
-    // references into the lines map. We can't just move the line contents into
-    // ret_lines here because disassembly lines may appear multiple times in
-    // the output. (Technically this should not be true, but I'm too lazy to
-    // verify as such right now.)
-    ret_lines.emplace_back(line);
+    out.write(result.text.data() + line.text_offset, line.text_size);
   }
-
-  // Phase 4: assemble the output lines into a single string and return it
-  string ret;
-  ret.reserve(ret_bytes);
-  for (const auto& line : ret_lines) {
-    ret += line;
-  }
-  return ret;
 }
 
 
@@ -4516,6 +4737,16 @@ void X86Emulator::print_source_trace(FILE* stream, const string& what, size_t ma
 
 
 void X86Emulator::import_state(FILE* stream) {
+  this->import_cpu_state(stream);
+  this->mem->import_state(stream);
+}
+
+void X86Emulator::export_state(FILE* stream) const {
+  this->export_cpu_state(stream);
+  this->mem->export_state(stream);
+}
+
+void X86Emulator::import_cpu_state(FILE* stream) {
   uint8_t version = freadx<uint8_t>(stream);
   if (version > 2) {
     throw runtime_error("unknown format version");
@@ -4535,7 +4766,6 @@ void X86Emulator::import_state(FILE* stream) {
   }
 
   this->regs.import_state(stream);
-  this->mem->import_state(stream);
 
   for (auto& it : this->current_reg_sources) {
     it.source32.reset();
@@ -4551,7 +4781,7 @@ void X86Emulator::import_state(FILE* stream) {
   this->memory_data_sources.clear();
 }
 
-void X86Emulator::export_state(FILE* stream) const {
+void X86Emulator::export_cpu_state(FILE* stream) const {
   fwritex<uint8_t>(stream, 1); // version
 
   fwritex<Behavior>(stream, this->behavior);
@@ -4562,5 +4792,4 @@ void X86Emulator::export_state(FILE* stream) const {
   }
 
   this->regs.export_state(stream);
-  this->mem->export_state(stream);
 }
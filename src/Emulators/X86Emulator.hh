@@ -7,11 +7,13 @@
 #include <deque>
 #include <functional>
 #include <map>
+#include <memory>
 #include <phosg/Strings.hh>
 #include <set>
 #include <stdexcept>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "MemoryContext.hh"
@@ -282,13 +284,15 @@ public:
   inline void w_esi(uint32_t v) { this->write<le_uint32_t>(6, v); }
   inline void w_edi(uint32_t v) { this->write<le_uint32_t>(7, v); }
 
-  inline uint32_t read_eflags() const { this->mark_flags_read(0xFFFFFFFF); return this->eflags; }
-  inline void write_eflags(uint32_t v) { this->mark_flags_written(0xFFFFFFFF); this->eflags = v; }
+  inline uint32_t read_eflags() const { this->mark_flags_read(0xFFFFFFFF); return this->resolved_eflags(); }
+  inline void write_eflags(uint32_t v) { this->mark_flags_written(0xFFFFFFFF); this->eflags = v; this->deferred_flags = 0; }
 
-  inline uint32_t read_eflags_unreported() const { return this->eflags; }
-  inline void write_eflags_unreported(uint32_t v) { this->eflags = v; }
+  inline uint32_t read_eflags_unreported() const { return this->resolved_eflags(); }
+  inline void write_eflags_unreported(uint32_t v) { this->eflags = v; this->deferred_flags = 0; }
 
   void set_by_name(const std::string& reg_name, uint32_t value);
+  // Unlike the r_* functions, this doesn't mark the register as read
+  uint32_t get_by_name(const std::string& reg_name) const;
 
   inline uint32_t get_sp() const {
     return this->r_esp();
@@ -337,6 +341,33 @@ private:
 
   uint32_t eflags;
 
+  // PF, AF, and OF are expensive to compute relative to how often they're
+  // read, so the arithmetic functions above don't compute them immediately.
+  // Instead, they record the operation, its operands, and its result here, and
+  // the flags are only computed when something reads them. deferred_flags
+  // specifies which flags in eflags are out of date (a subset of PF, AF, and
+  // OF); all of them refer to the same operation. (The access flags used by
+  // trace_data_sources are still updated when the flags are written.)
+  enum class DeferredFlagsOp : uint8_t {
+    RESULT = 0, // Only PF can be deferred
+    ADD,
+    ADD_WITH_CARRY, // CF was set
+    SUBTRACT,
+    SUBTRACT_WITH_BORROW, // CF was set
+  };
+  uint32_t deferred_flags;
+  DeferredFlagsOp deferred_op;
+  uint32_t deferred_a;
+  uint32_t deferred_b;
+  uint32_t deferred_res;
+  uint32_t deferred_msb;
+
+  template <typename T>
+  void defer_flags(uint32_t mask, DeferredFlagsOp op, T a, T b, T res);
+  uint32_t compute_deferred_flags(uint32_t mask) const;
+  void resolve_deferred_flags(uint32_t mask);
+  uint32_t resolved_eflags() const;
+
   mutable std::array<uint32_t, 8> regs_read;
   mutable std::array<uint32_t, 8> regs_written;
   mutable std::array<XMMReg, 8> xmm_regs_read;
@@ -362,6 +393,8 @@ public:
 
   virtual void import_state(FILE* stream);
   virtual void export_state(FILE* stream) const;
+  virtual void import_cpu_state(FILE* stream);
+  virtual void export_cpu_state(FILE* stream) const;
 
   inline X86Registers& registers() {
     return this->regs;
@@ -374,7 +407,23 @@ public:
       const void* vdata,
       size_t size,
       uint32_t start_address = 0,
-      const std::multimap<uint32_t, std::string>* labels = nullptr);
+      const LabelIndex* labels = nullptr,
+      size_t num_threads = 1);
+  // Same as above, but converts labels to a LabelIndex first
+  static std::string disassemble(
+      const void* vdata,
+      size_t size,
+      uint32_t start_address,
+      const std::multimap<uint32_t, std::string>* labels,
+      size_t num_threads = 1);
+  // Same as above, but writes the disassembly to out instead of returning it
+  static void disassemble(
+      DisassemblyOutput& out,
+      const void* vdata,
+      size_t size,
+      uint32_t start_address = 0,
+      const LabelIndex* labels = nullptr,
+      size_t num_threads = 1);
 
   // NOTE: If the storage size of this enum changes, the format versions
   // implemented in import_state and export_state must also change.
@@ -448,11 +497,6 @@ protected:
   std::function<void(X86Emulator&, uint8_t)> syscall_handler;
   std::function<void(X86Emulator&)> debug_hook;
 
-  mutable bool execution_labels_computed;
-  mutable std::multimap<uint32_t, std::string> execution_labels;
-
-  void compute_execution_labels() const;
-
   struct DataAccess {
     uint64_t cycle_num;
     uint32_t addr;
@@ -497,6 +541,11 @@ protected:
       uint64_t value_low, uint64_t value_high);
   void link_current_accesses();
 
+  // EnableHooks = false omits the debug hook, profiler, and data source
+  // tracing code; execute() uses that version when none of them are enabled
+  template <bool EnableHooks>
+  void execute_loop();
+
   struct DecodedRM {
     int8_t non_ea_reg;
     int8_t ea_reg; // -1 = no reg
@@ -530,7 +579,7 @@ protected:
     uint8_t opcode;
     X86Overrides overrides;
     std::map<uint32_t, bool> branch_target_addresses;
-    const std::multimap<uint32_t, std::string>* labels;
+    const LabelIndex* labels;
     // If not null, the emulator pointer is used for resolving EA addresses
     // based on the emulator's current state (for use in the interactive
     // debugging shell)
@@ -572,8 +621,47 @@ protected:
   }
 
   DecodedRM fetch_and_decode_rm();
+  DecodedRM fetch_and_decode_rm_uncached();
   static DecodedRM fetch_and_decode_rm(StringReader& r);
 
+  // Predecoded instructions, indexed by page, for the execute loop used when
+  // no hooks are enabled. Each entry holds the prefix state and handler for
+  // the instruction's final opcode byte, and the decoded ModRM if the handler
+  // reads one, so the prefix handlers and ModRM decoding are skipped when the
+  // instruction is executed again. Like PPC32Emulator, each entry keeps a copy
+  // of the instruction bytes, and is only used if they still match memory, so
+  // code writes don't need to be tracked. All pages are discarded when the
+  // memory layout changes.
+  struct PredecodedInstruction {
+    uint8_t length; // 0 = entry is not valid
+    uint8_t opcode_end_offset; // Offset of the byte after the final opcode
+    uint8_t rm_offset;
+    uint8_t rm_length; // 0 = handler doesn't read a ModRM
+    uint8_t opcode;
+    uint8_t bytes[15];
+    X86Overrides overrides;
+    DecodedRM rm;
+    void (X86Emulator::*exec)(uint8_t);
+  };
+  static constexpr size_t PREDECODE_PAGE_BITS = 10;
+  struct PredecodedPage {
+    PredecodedInstruction instructions[1 << PREDECODE_PAGE_BITS];
+    PredecodedPage();
+  };
+  std::unordered_map<uint32_t, std::unique_ptr<PredecodedPage>> predecoded_pages;
+  uint32_t last_predecoded_page_addr;
+  PredecodedPage* last_predecoded_page;
+  uint64_t predecode_generation;
+  // The entry being used for the current instruction, if any. At most one of
+  // these is set at a time.
+  const PredecodedInstruction* replay_inst;
+  uint32_t replay_rm_addr;
+  PredecodedInstruction* record_inst;
+  uint32_t record_inst_addr;
+
+  PredecodedInstruction& predecoded_instruction(uint32_t addr);
+  void execute_one_predecoded();
+
   uint32_t get_segment_offset() const;
   uint32_t resolve_mem_ea(const DecodedRM& rm, bool always_trace_sources = false);
   uint32_t resolve_mem_ea_untraced(const DecodedRM& rm) const;
@@ -652,12 +740,16 @@ protected:
   template <typename T>
   T r_mem(uint32_t addr) {
     T value = this->mem->read<T>(addr);
-    this->report_mem_access(addr, bits_for_type<T>, false, value, 0);
+    if (this->log_memory_access || this->trace_data_sources) {
+      this->report_mem_access(addr, bits_for_type<T>, false, value, 0);
+    }
     return value;
   }
   template <typename T>
   void w_mem(uint32_t addr, T value) {
-    this->report_mem_access(addr, bits_for_type<T>, true, value, 0);
+    if (this->log_memory_access || this->trace_data_sources) {
+      this->report_mem_access(addr, bits_for_type<T>, true, value, 0);
+    }
     this->mem->write<T>(addr, value);
   }
 
@@ -0,0 +1,152 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <string>
+
+#include "X86Emulator.hh"
+
+using namespace std;
+
+
+
+static string line_for_address(const string& dasm, uint32_t addr) {
+  string prefix = string_printf("%08" PRIX32 " ", addr);
+  for (const auto& line : split(dasm, '\n')) {
+    if (starts_with(line, prefix)) {
+      return line;
+    }
+  }
+  throw out_of_range(string_printf("no line for address %08" PRIX32, addr));
+}
+
+// Disassembles prefixed followed by next, and checks that next disassembles
+// the same way as it does on its own (that is, prefixed's prefixes don't
+// apply to it)
+static void check_prefix_does_not_leak(const string& prefixed, const string& next) {
+  static constexpr uint32_t start_address = 0x1000;
+  uint32_t next_address = start_address + prefixed.size();
+  string code = prefixed + next;
+  string dasm = X86Emulator::disassemble(code.data(), code.size(), start_address);
+  string expected_dasm = X86Emulator::disassemble(next.data(), next.size(), next_address);
+  expect_eq(line_for_address(expected_dasm, next_address), line_for_address(dasm, next_address));
+}
+
+static constexpr uint32_t CF = X86Registers::CF;
+static constexpr uint32_t PF = X86Registers::PF;
+static constexpr uint32_t AF = X86Registers::AF;
+static constexpr uint32_t ZF = X86Registers::ZF;
+static constexpr uint32_t SF = X86Registers::SF;
+static constexpr uint32_t OF = X86Registers::OF;
+
+// Runs code (which must not branch) until the end, with esp pointing to the
+// end of an empty stack, and returns the emulator
+static shared_ptr<X86Emulator> run_code(const string& code) {
+  static constexpr uint32_t code_addr = 0x00001000;
+  static constexpr uint32_t stack_addr = 0x00010000;
+  static constexpr uint32_t stack_size = 0x1000;
+
+  auto mem = make_shared<MemoryContext>();
+  mem->allocate_at(code_addr, 0x1000);
+  mem->write(code_addr, code);
+  mem->allocate_at(stack_addr, stack_size);
+
+  auto emu = make_shared<X86Emulator>(mem);
+  auto& regs = emu->registers();
+  regs.eip = code_addr;
+  regs.w_esp(stack_addr + stack_size);
+  regs.write_eflags(0x00000202);
+  // The hook only reads eip, so it doesn't cause any deferred flags to be
+  // computed
+  emu->set_debug_hook([&](X86Emulator& emu) {
+    if (emu.registers().eip == code_addr + code.size()) {
+      throw X86Emulator::terminate_emulation();
+    }
+  });
+  emu->execute();
+  return emu;
+}
+
+int main(int, char**) {
+  fprintf(stderr, "-- operand size prefix\n");
+  // mov ax, 0x1234; mov eax, 0x12345678
+  check_prefix_does_not_leak("\x66\xB8\x34\x12", "\xB8\x78\x56\x34\x12");
+
+  fprintf(stderr, "-- segment override prefix\n");
+  // mov eax, cs:[eax]; mov eax, [eax]
+  check_prefix_does_not_leak(string("\x2E\x8B\x00", 3), string("\x8B\x00", 2));
+
+  fprintf(stderr, "-- repeat prefix\n");
+  // rep movsb; movsb
+  check_prefix_does_not_leak("\xF3\xA4", "\xA4");
+
+  fprintf(stderr, "-- flags read by setcc, pushfd, and lahf\n");
+  {
+    auto emu = run_code(string(
+        "\xB0\x7F" // mov al, 0x7F
+        "\x04\x01" // add al, 1 (al = 0x80: SF, AF, OF)
+        "\x0F\x90\xC1" // seto cl
+        "\x0F\x9A\xC2" // setp dl
+        "\x0F\x94\xC6" // sete dh
+        "\x9C" // pushfd
+        "\xB3\x00" // mov bl, 0
+        "\x80\xEB\x01" // sub bl, 1 (bl = 0xFF: CF, PF, AF, SF)
+        "\x9F" // lahf
+        "\x9C", 21)); // pushfd
+    auto& regs = emu->registers();
+    auto mem = emu->memory();
+    expect_eq(0x80, regs.r_al());
+    expect_eq(1, regs.r_cl());
+    expect_eq(0, regs.r_dl());
+    expect_eq(0, regs.r_dh());
+    expect_eq(0xFF, regs.r_bl());
+    uint32_t sp = regs.r_esp();
+    expect_eq(SF | AF | OF, mem->read_u32l(sp + 4) & X86Registers::default_int_flags);
+    expect_eq(CF | PF | AF | SF, mem->read_u32l(sp) & X86Registers::default_int_flags);
+    expect_eq(CF | PF | AF | SF | 0x02, regs.r_ah());
+    expect_eq(CF | PF | AF | SF, regs.read_eflags() & X86Registers::default_int_flags);
+  }
+
+  fprintf(stderr, "-- flags from different operations\n");
+  {
+    // The add sets AF and OF, then the or clears OF and replaces PF but leaves
+    // AF alone, so AF has to come from the add
+    auto emu = run_code(string(
+        "\xB0\x7F" // mov al, 0x7F
+        "\x04\x01" // add al, 1 (al = 0x80: SF, AF, OF)
+        "\x0C\x03" // or al, 3 (al = 0x83: SF)
+        "\x9C", 7)); // pushfd
+    auto& regs = emu->registers();
+    expect_eq(0x83, regs.r_al());
+    expect_eq(SF | AF, emu->memory()->read_u32l(regs.r_esp()) & X86Registers::default_int_flags);
+
+    // Same, but the add's AF is clear and the final result has even parity
+    emu = run_code(string(
+        "\xB0\x70" // mov al, 0x70
+        "\x04\x10" // add al, 0x10 (al = 0x80: SF, OF)
+        "\x0C\x01" // or al, 1 (al = 0x81: SF, PF)
+        "\x9C", 7)); // pushfd
+    expect_eq(SF | PF, emu->memory()->read_u32l(emu->registers().r_esp()) & X86Registers::default_int_flags);
+  }
+
+  fprintf(stderr, "-- flags set directly\n");
+  {
+    // inc replaces all of the add's flags except CF, then clc replaces CF
+    auto emu = run_code(string(
+        "\xB8\xFF\xFF\xFF\xFF" // mov eax, 0xFFFFFFFF
+        "\x05\x01\x00\x00\x00" // add eax, 1 (eax = 0: CF, PF, AF, ZF)
+        "\x40" // inc eax (eax = 1: CF from before)
+        "\xF8" // clc
+        "\x9C", 13)); // pushfd
+    auto& regs = emu->registers();
+    expect_eq(1, regs.r_eax());
+    expect_eq(0, emu->memory()->read_u32l(regs.r_esp()) & X86Registers::default_int_flags);
+  }
+
+  printf("X86EmulatorTest: all tests passed\n");
+  return 0;
+}
@@ -31,22 +31,71 @@ struct DOLHeader {
 } __attribute__((packed));
 
 DOLFile::DOLFile(const char* filename)
-  : filename(filename) {
-  string data = load_file(filename);
-  this->parse(data.data(), data.size());
+  : DOLFile(filename, make_shared<MappedFile>(filename)) { }
+
+DOLFile::DOLFile(const char* filename, shared_ptr<const MappedFile> file)
+  : filename(filename), file(file) {
+  this->parse(this->file->data(), this->file->size());
 }
 
 DOLFile::DOLFile(const char* filename, const string& data)
-  : filename(filename) {
-  this->parse(data.data(), data.size());
+  : filename(filename), owned_data(make_shared<string>(data)) {
+  this->parse(this->owned_data->data(), this->owned_data->size());
 }
 
 DOLFile::DOLFile(const char* filename, const void* data, size_t size)
-  : filename(filename) {
-  this->parse(data, size);
+  : filename(filename),
+    owned_data(make_shared<string>(reinterpret_cast<const char*>(data), size)) {
+  this->parse(this->owned_data->data(), this->owned_data->size());
 }
 
 void DOLFile::load_into(shared_ptr<MemoryContext> mem) const {
+  // Sections can only be mapped if no two of them (or a section and the BSS
+  // section) share a page in memory. Game executables are usually linked with
+  // their sections directly after one another, so this often isn't the case;
+  // then we fall back to copying everything.
+  if (this->file && this->file->is_mapped()) {
+    uint32_t page_mask = mem->get_page_size() - 1;
+    map<uint32_t, uint64_t> page_ranges;
+    bool can_map = true;
+    auto add_page_range = [&](uint32_t addr, size_t size) {
+      uint64_t end_addr = (static_cast<uint64_t>(addr) + size + page_mask) & ~static_cast<uint64_t>(page_mask);
+      if ((addr & page_mask) || !page_ranges.emplace(addr, end_addr).second) {
+        can_map = false;
+      }
+    };
+    for (const auto& sec : this->sections) {
+      if (!sec.data.empty()) {
+        add_page_range(sec.address, sec.data.size());
+      }
+    }
+    if (this->bss_address && this->bss_size) {
+      add_page_range(this->bss_address, this->bss_size);
+    }
+    uint64_t prev_end_addr = 0;
+    for (const auto& it : page_ranges) {
+      if (it.first < prev_end_addr) {
+        can_map = false;
+      }
+      prev_end_addr = it.second;
+    }
+
+    if (can_map) {
+      for (const auto& sec : this->sections) {
+        if (sec.data.empty()) {
+          continue;
+        }
+        auto pages = this->file->map_private(sec.offset, sec.data.size(), sec.data.size());
+        mem->map_external(sec.address, pages.get(), sec.data.size(), false, pages);
+      }
+      if (this->bss_address && this->bss_size) {
+        mem->allocate_at(this->bss_address, this->bss_size);
+        mem->memset(this->bss_address, 0, this->bss_size);
+      }
+      return;
+    }
+  }
+
   uint32_t min_addr = this->bss_address ? this->bss_address : 0xFFFFFFFF;
   uint32_t max_addr = this->bss_address ? (this->bss_address + this->bss_size) : 0;
   for (const auto& sec : this->sections) {
@@ -65,6 +114,15 @@ void DOLFile::load_into(shared_ptr<MemoryContext> mem) const {
   }
 }
 
+// Like StringReader::pread, but returns a view of the reader's data
+static string_view pread_view(const StringReader& r, size_t offset, size_t size) {
+  if (offset >= r.size()) {
+    return string_view();
+  }
+  size = min<size_t>(size, r.size() - offset);
+  return string_view(reinterpret_cast<const char*>(r.pgetv(offset, size)), size);
+}
+
 void DOLFile::parse(const void* data, size_t size) {
   StringReader r(data, size);
 
@@ -75,7 +133,7 @@ void DOLFile::parse(const void* data, size_t size) {
       auto& sec = this->sections.emplace_back();
       sec.offset = header.text_offset[x];
       sec.address = header.text_address[x];
-      sec.data = r.pread(sec.offset, header.text_size[x]);
+      sec.data = pread_view(r, sec.offset, header.text_size[x]);
       sec.section_num = x;
       sec.is_text = true;
     }
@@ -86,7 +144,7 @@ void DOLFile::parse(const void* data, size_t size) {
       auto& sec = this->sections.emplace_back();
       sec.offset = header.data_offset[x];
       sec.address = header.data_address[x];
-      sec.data = r.pread(sec.offset, header.data_size[x]);
+      sec.data = pread_view(r, sec.offset, header.data_size[x]);
       sec.section_num = x;
       sec.is_text = false;
     }
@@ -100,7 +158,8 @@ void DOLFile::parse(const void* data, size_t size) {
 void DOLFile::print(
     FILE* stream,
     const multimap<uint32_t, string>* labels,
-    bool print_hex_view_for_code) const {
+    bool print_hex_view_for_code,
+    size_t disassembly_threads) const {
   fprintf(stream, "[DOL file: %s]\n", this->filename.c_str());
   fprintf(stream, "  BSS section: %08" PRIX32 " in memory, %08" PRIX32 " bytes\n",
       this->bss_address, this->bss_size);
@@ -113,24 +172,26 @@ void DOLFile::print(
 
   fputc('\n', stream);
 
-  multimap<uint32_t, string> effective_labels;
+  LabelIndex effective_labels;
   if (labels) {
-    effective_labels = *labels;
+    effective_labels = LabelIndex(*labels);
   }
-  effective_labels.emplace(this->entrypoint, "start");
+  effective_labels.add(this->entrypoint, "start");
 
   for (const auto& sec : this->sections) {
     fprintf(stream, "\n.%s%hhu:\n", sec.is_text ? "text" : "data", sec.section_num);
     if (sec.is_text) {
-      string disassembly = PPC32Emulator::disassemble(
-          sec.data.data(), sec.data.size(), sec.address, &effective_labels);
-      fwritex(stream, disassembly);
+      DisassemblyOutput out(stream);
+      PPC32Emulator::disassemble(out,
+          sec.data.data(), sec.data.size(), sec.address, &effective_labels,
+          disassembly_threads);
+      out.flush();
       if (print_hex_view_for_code) {
         fprintf(stream, "\n.%s%hhu:\n", sec.is_text ? "text" : "data", sec.section_num);
-        print_data(stream, sec.data, sec.address);
+        print_data(stream, sec.data.data(), sec.data.size(), sec.address);
       }
     } else {
-      print_data(stream, sec.data, sec.address);
+      print_data(stream, sec.data.data(), sec.data.size(), sec.address);
     }
   }
 }
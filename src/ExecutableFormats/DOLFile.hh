@@ -5,32 +5,43 @@
 #include <map>
 #include <phosg/Encoding.hh>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include "../Emulators/MemoryContext.hh"
+#include "../MappedFile.hh"
 
 
 
 class DOLFile {
 public:
+  // Section data refers to the file's contents instead of being copied out of
+  // them. The constructors that take a filename or MappedFile don't copy the
+  // file at all; the others make one copy of the entire file.
   explicit DOLFile(const char* filename);
+  DOLFile(const char* filename, std::shared_ptr<const MappedFile> file);
   DOLFile(const char* filename, const std::string& data);
   DOLFile(const char* filename, const void* data, size_t size);
   ~DOLFile() = default;
 
+  // If the file is memory-mapped and every section (and the BSS section) starts
+  // on a page boundary and has its pages to itself, the sections are mapped
+  // into mem copy-on-write instead of being copied.
   void load_into(std::shared_ptr<MemoryContext> mem) const;
 
   void print(
       FILE* stream,
       const std::multimap<uint32_t, std::string>* labels = nullptr,
-      bool print_hex_view_for_code = false) const;
+      bool print_hex_view_for_code = false,
+      size_t disassembly_threads = 1) const;
 
   const std::string filename;
 
   struct Section {
     uint32_t offset;
     uint32_t address;
-    std::string data;
+    std::string_view data;
     uint8_t section_num;
     bool is_text;
   };
@@ -42,4 +53,8 @@ public:
 
 private:
   void parse(const void* data, size_t size);
+
+  // Section data points into one of these
+  std::shared_ptr<const MappedFile> file;
+  std::shared_ptr<const std::string> owned_data;
 };
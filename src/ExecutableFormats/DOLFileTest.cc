@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <memory>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "DOLFile.hh"
+
+using namespace std;
+
+
+
+static string section_data(size_t size, uint8_t seed) {
+  string ret(size, '\0');
+  for (size_t z = 0; z < size; z++) {
+    ret[z] = static_cast<char>((z * 7 + seed) | 1);
+  }
+  return ret;
+}
+
+int main(int, char**) {
+  // Neither section's file offset is page-aligned, but both addresses are, so
+  // load_into uses MappedFile::map_private for them
+  string text = section_data(0x2010, 0x11);
+  string data = section_data(0x20, 0x55);
+
+  StringWriter w;
+  for (size_t z = 0; z < 7; z++) {
+    w.put_u32b(z ? 0 : 0x100); // text_offset
+  }
+  for (size_t z = 0; z < 11; z++) {
+    w.put_u32b(z ? 0 : 0x100 + text.size()); // data_offset
+  }
+  for (size_t z = 0; z < 7; z++) {
+    w.put_u32b(z ? 0 : 0x80004000); // text_address
+  }
+  for (size_t z = 0; z < 11; z++) {
+    w.put_u32b(z ? 0 : 0x80008000); // data_address
+  }
+  for (size_t z = 0; z < 7; z++) {
+    w.put_u32b(z ? 0 : text.size()); // text_size
+  }
+  for (size_t z = 0; z < 11; z++) {
+    w.put_u32b(z ? 0 : data.size()); // data_size
+  }
+  w.put_u32b(0x80010000); // bss_address
+  w.put_u32b(0x100); // bss_size
+  w.put_u32b(0x80004000); // entrypoint
+  w.extend_to(0x100);
+  w.write(text);
+  w.write(data);
+
+  string filename = string_printf("DOLFileTest-%d.dol", getpid());
+  save_file(filename, w.str());
+
+  try {
+    fprintf(stderr, "-- load sections with unaligned file offsets\n");
+    DOLFile dol(filename.c_str());
+    auto mem = make_shared<MemoryContext>();
+    dol.load_into(mem);
+
+    size_t page_size = mem->get_page_size();
+    expect_eq(text, mem->read(0x80004000, text.size()));
+    expect_eq(data, mem->read(0x80008000, data.size()));
+    expect_eq(static_cast<uint32_t>(0), mem->read_u32b(0x80010000));
+
+    // The rest of each section's last page is zero, and each section's host
+    // memory starts on a page boundary
+    size_t text_pages_size = (text.size() + page_size - 1) & ~(page_size - 1);
+    size_t data_pages_size = (data.size() + page_size - 1) & ~(page_size - 1);
+    const uint8_t* text_mem = mem->at<uint8_t>(0x80004000, text_pages_size);
+    const uint8_t* data_mem = mem->at<uint8_t>(0x80008000, data_pages_size);
+    expect_eq(static_cast<uintptr_t>(0), reinterpret_cast<uintptr_t>(text_mem) & (page_size - 1));
+    expect_eq(static_cast<uintptr_t>(0), reinterpret_cast<uintptr_t>(data_mem) & (page_size - 1));
+    for (size_t z = text.size(); z < text_pages_size; z++) {
+      expect_eq(0, text_mem[z]);
+    }
+    for (size_t z = data.size(); z < data_pages_size; z++) {
+      expect_eq(0, data_mem[z]);
+    }
+
+    // Writes don't affect the file or the parsed sections
+    mem->write_u32b(0x80004000, 0xFFFFFFFF);
+    expect_eq(text, string(dol.sections[0].data));
+    expect_eq(w.str(), load_file(filename));
+
+  } catch (const exception&) {
+    unlink(filename.c_str());
+    throw;
+  }
+  unlink(filename.c_str());
+
+  printf("DOLFileTest: all tests passed\n");
+  return 0;
+}
@@ -18,14 +18,21 @@ using namespace std;
 
 
 
-ELFFile::ELFFile(const char* filename) : ELFFile(filename, load_file(filename)) { }
+ELFFile::ELFFile(const char* filename)
+  : ELFFile(filename, make_shared<MappedFile>(filename)) { }
+
+ELFFile::ELFFile(const char* filename, shared_ptr<const MappedFile> file)
+  : filename(filename), file(file) {
+  this->parse(this->file->data(), this->file->size());
+}
 
 ELFFile::ELFFile(const char* filename, const string& data)
   : ELFFile(filename, data.data(), data.size()) { }
 
 ELFFile::ELFFile(const char* filename, const void* data, size_t size)
-  : filename(filename) {
-  this->parse(data, size);
+  : filename(filename),
+    owned_data(make_shared<string>(reinterpret_cast<const char*>(data), size)) {
+  this->parse(this->owned_data->data(), this->owned_data->size());
 }
 
 void ELFFile::parse(const void* data, size_t size) {
@@ -80,12 +87,20 @@ void ELFFile::parse_t(StringReader& r) {
     sec.info = sec_entry.info;
     sec.alignment = sec_entry.alignment;
     sec.entry_size = sec_entry.entry_size;
-    sec.data = r.pread(sec.offset, sec.physical_size);
+    // Sections without file data (e.g. .bss) may claim to extend past the end
+    // of the file
+    size_t data_size = (sec.offset < r.size())
+        ? min<uint64_t>(sec.physical_size, r.size() - sec.offset) : 0;
+    if (data_size) {
+      sec.data = string_view(reinterpret_cast<const char*>(
+          r.pgetv(sec.offset, data_size)), data_size);
+    }
   }
 
   // Get the names from the names section (if possible)
   try {
-    StringReader names_r(this->sections.at(header.names_section_index).data);
+    const auto& names_data = this->sections.at(header.names_section_index).data;
+    StringReader names_r(names_data.data(), names_data.size());
     for (size_t x = 0; x < this->sections.size(); x++) {
       auto& sec = this->sections[x];
       uint32_t name_offset = sec_name_offsets.at(x);
@@ -284,7 +299,8 @@ static string string_for_section_flags(uint32_t flags) {
 void ELFFile::print(
     FILE* stream,
     const multimap<uint32_t, string>* labels,
-    bool print_hex_view_for_code) const {
+    bool print_hex_view_for_code,
+    size_t disassembly_threads) const {
   fprintf(stream, "[ELF file: %s]\n", this->filename.c_str());
   fprintf(stream, "  width: %02hhX (%s)\n", this->identifier.width, (this->identifier.width == 1) ? "32-bit" : "64-bit");
   fprintf(stream, "  endianness: %02hhX (%s)\n", this->identifier.width, (this->identifier.width == 1) ? "little-endian" : "big-endian");
@@ -317,28 +333,31 @@ void ELFFile::print(
         string disassembly;
         if (this->architecture == 0x0003) { // X86
           disassembly = X86Emulator::disassemble(
-              sec.data.data(), sec.data.size(), sec.virtual_addr, labels);
+              sec.data.data(), sec.data.size(), sec.virtual_addr, labels,
+              disassembly_threads);
         } else if (this->architecture == 0x0004) { // M68K
           disassembly = M68KEmulator::disassemble(
-              sec.data.data(), sec.data.size(), sec.virtual_addr, labels);
+              sec.data.data(), sec.data.size(), sec.virtual_addr, labels,
+              disassembly_threads);
         } else if (this->architecture == 0x0014) { // PPC32
           disassembly = PPC32Emulator::disassemble(
-              sec.data.data(), sec.data.size(), sec.virtual_addr, labels);
+              sec.data.data(), sec.data.size(), sec.virtual_addr, labels,
+              disassembly_threads);
         }
 
         if (disassembly.empty()) {
           fprintf(stream, "[section %zX data] // Architecture not supported for disassembly\n", x);
-          print_data(stream, sec.data, sec.virtual_addr);
+          print_data(stream, sec.data.data(), sec.data.size(), sec.virtual_addr);
         } else {
           fwritex(stream, disassembly);
           if (print_hex_view_for_code) {
             fprintf(stream, "[section %zX data] // Architecture not supported for disassembly\n", x);
-            print_data(stream, sec.data, sec.virtual_addr);
+            print_data(stream, sec.data.data(), sec.data.size(), sec.virtual_addr);
           }
         }
       } else if (!sec.data.empty()) {
         fprintf(stream, "[section %zX data]\n", x);
-        print_data(stream, sec.data, sec.virtual_addr);
+        print_data(stream, sec.data.data(), sec.data.size(), sec.virtual_addr);
       }
     }
   }
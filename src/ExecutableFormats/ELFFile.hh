@@ -7,9 +7,12 @@
 #include <phosg/Encoding.hh>
 #include <phosg/Strings.hh>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include "../Emulators/MemoryContext.hh"
+#include "../MappedFile.hh"
 
 
 
@@ -96,7 +99,11 @@ struct ELFSectionHeaderEntry {
 
 class ELFFile {
 public:
+  // Section data refers to the file's contents instead of being copied out of
+  // them. The constructors that take a filename or MappedFile don't copy the
+  // file at all; the others make one copy of the entire file.
   explicit ELFFile(const char* filename);
+  ELFFile(const char* filename, std::shared_ptr<const MappedFile> file);
   ELFFile(const char* filename, const std::string& data);
   ELFFile(const char* filename, const void* data, size_t size);
   ~ELFFile() = default;
@@ -104,7 +111,8 @@ public:
   void print(
       FILE* stream,
       const std::multimap<uint32_t, std::string>* labels = nullptr,
-      bool print_hex_view_for_code = false) const;
+      bool print_hex_view_for_code = false,
+      size_t disassembly_threads = 1) const;
 
 private:
   void parse(const void* data, size_t size);
@@ -132,9 +140,13 @@ private:
     uint32_t info;
     uint64_t alignment;
     uint64_t entry_size;
-    std::string data;
+    std::string_view data;
   };
 
+  // Section data points into one of these
+  std::shared_ptr<const MappedFile> file;
+  std::shared_ptr<const std::string> owned_data;
+
   std::vector<Section> sections;
 
   // TODO: parse program headers too
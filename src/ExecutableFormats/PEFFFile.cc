@@ -57,19 +57,23 @@ const char* name_for_share_kind(PEFFShareKind k) {
 
 
 
-PEFFFile::PEFFFile(const char* filename) : filename(filename) {
-  const string data = load_file(filename);
-  this->parse(data.data(), data.size());
+PEFFFile::PEFFFile(const char* filename)
+  : PEFFFile(filename, make_shared<MappedFile>(filename)) { }
+
+PEFFFile::PEFFFile(const char* filename, shared_ptr<const MappedFile> file) :
+    filename(filename), file(file) {
+  this->parse(this->file->data(), this->file->size());
 }
 
 PEFFFile::PEFFFile(const char* filename, const string& data) :
-    filename(filename) {
-  this->parse(data.data(), data.size());
+    filename(filename), owned_data(make_shared<string>(data)) {
+  this->parse(this->owned_data->data(), this->owned_data->size());
 }
 
 PEFFFile::PEFFFile(const char* filename, const void* data, size_t size) :
-    filename(filename) {
-  this->parse(data, size);
+    filename(filename),
+    owned_data(make_shared<string>(reinterpret_cast<const char*>(data), size)) {
+  this->parse(this->owned_data->data(), this->owned_data->size());
 }
 
 
@@ -84,9 +88,75 @@ static uint64_t read_pattern_varint(StringReader& r) {
   return ret;
 }
 
-static string decompress_pattern_data(const string& data) {
-  string ret;
+// Pattern data is unpacked in two passes. The first validates the opcodes and
+// computes the exact unpacked size without writing anything; the second writes
+// the data into a buffer of that size, so the output never has to grow (and
+// load_into can unpack directly into emulated memory).
+static size_t pattern_data_unpacked_size(string_view data) {
+  StringReader r(data.data(), data.size());
+  auto skip = [&](uint64_t size) -> void {
+    if (size > r.remaining()) {
+      throw out_of_range("pattern data is truncated");
+    }
+    r.skip(size);
+  };
+
+  uint64_t ret = 0;
+  while (!r.eof()) {
+    uint8_t b = r.get_u8();
+    uint8_t op = (b >> 5) & 0x07;
+    uint32_t count = b & 0x1F;
+    if (count == 0) {
+      count = read_pattern_varint(r);
+    }
+
+    switch (op) {
+      case 0: // zero
+        ret += count;
+        break;
+      case 1: // write block
+        skip(count);
+        ret += count;
+        break;
+      case 2: { // write block repeatedly
+        uint64_t repeat_count = static_cast<uint32_t>(read_pattern_varint(r)) + 1;
+        skip(count);
+        ret += count * repeat_count;
+        break;
+      }
+      case 3: // interleave repeat block with write block
+      case 4: { // interleave zero with write block
+        uint64_t custom_size = static_cast<uint32_t>(read_pattern_varint(r));
+        uint64_t custom_section_count = static_cast<uint32_t>(read_pattern_varint(r));
+        if (op == 3) {
+          skip(count);
+        }
+        skip(custom_size * custom_section_count);
+        ret += count * (custom_section_count + 1) + custom_size * custom_section_count;
+        break;
+      }
+      default:
+        throw runtime_error("invalid opcode in pattern data");
+    }
+    if (ret > 0xFFFFFFFF) {
+      throw runtime_error("pattern data is too large");
+    }
+  }
+
+  return ret;
+}
+
+// Unpacks data into dest, which must be exactly the size returned by
+// pattern_data_unpacked_size for the same data
+static void unpack_pattern_data(string_view data, void* vdest, size_t dest_size) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  uint8_t* dest_end = dest + dest_size;
   StringReader r(data.data(), data.size());
+  auto write_block = [&](size_t size) -> void {
+    memcpy(dest, r.getv(size), size);
+    dest += size;
+  };
+
   while (!r.eof()) {
     uint8_t b = r.get_u8();
     uint8_t op = (b >> 5) & 0x07;
@@ -97,16 +167,28 @@ static string decompress_pattern_data(const string& data) {
 
     switch (op) {
       case 0: // zero
-        ret.resize(ret.size() + count, '\0');
+        memset(dest, 0, count);
+        dest += count;
         break;
       case 1: // write block
-        ret.append(r.read(count));
+        write_block(count);
         break;
       case 2: { // write block repeatedly
-        uint32_t repeat_count = read_pattern_varint(r) + 1;
-        string data = r.read(count);
-        for (; repeat_count; repeat_count--) {
-          ret.append(data);
+        size_t total_size = static_cast<size_t>(count) *
+            (static_cast<uint32_t>(read_pattern_varint(r)) + 1);
+        if (count == 1) {
+          memset(dest, r.get_u8(), total_size);
+          dest += total_size;
+        } else if (count != 0) {
+          // Copy the block once, then keep doubling the copied region, so
+          // this takes O(log(repeat_count)) memcpy calls
+          write_block(count);
+          for (size_t written = count; written < total_size;) {
+            size_t copy_size = min<size_t>(written, total_size - written);
+            memcpy(dest, dest - written, copy_size);
+            dest += copy_size;
+            written += copy_size;
+          }
         }
         break;
       }
@@ -114,12 +196,14 @@ static string decompress_pattern_data(const string& data) {
         uint32_t common_size = count;
         uint32_t custom_size = read_pattern_varint(r);
         uint32_t custom_section_count = read_pattern_varint(r);
-        string common_data = r.read(common_size);
+        const void* common_data = r.getv(common_size);
         for (; custom_section_count; custom_section_count--) {
-          ret.append(common_data);
-          ret.append(r.read(custom_size));
+          memcpy(dest, common_data, common_size);
+          dest += common_size;
+          write_block(custom_size);
         }
-        ret.append(common_data);
+        memcpy(dest, common_data, common_size);
+        dest += common_size;
         break;
       }
       case 4: { // interleave zero with write block
@@ -127,10 +211,12 @@ static string decompress_pattern_data(const string& data) {
         uint32_t custom_size = read_pattern_varint(r);
         uint32_t custom_section_count = read_pattern_varint(r);
         for (; custom_section_count; custom_section_count--) {
-          ret.resize(ret.size() + zero_size, '\0');
-          ret.append(r.read(custom_size));
+          memset(dest, 0, zero_size);
+          dest += zero_size;
+          write_block(custom_size);
         }
-        ret.resize(ret.size() + zero_size, '\0');
+        memset(dest, 0, zero_size);
+        dest += zero_size;
         break;
       }
       default:
@@ -138,10 +224,18 @@ static string decompress_pattern_data(const string& data) {
     }
   }
 
+  if (dest != dest_end) {
+    throw logic_error("pattern data unpacked to incorrect size");
+  }
+}
+
+static string decompress_pattern_data(string_view data, size_t unpacked_size) {
+  string ret(unpacked_size, '\0');
+  unpack_pattern_data(data, ret.data(), ret.size());
   return ret;
 }
 
-static void disassemble_relocation_program(FILE* stream, const string& data) {
+static void disassemble_relocation_program(FILE* stream, string_view data) {
   StringReader r(data.data(), data.size());
 
   while (!r.eof()) {
@@ -310,7 +404,7 @@ void PEFFFile::parse_loader_section(const void* data, size_t size) {
     if (!this->sections[rel.section_index].relocation_program.empty()) {
       throw runtime_error("section has multiple relocation programs");
     }
-    this->sections[rel.section_index].relocation_program = string(
+    this->sections[rel.section_index].relocation_program = string_view(
         reinterpret_cast<const char*>(data)
           + header.rel_commands_offset + rel.start_offset,
         rel.word_count * 2);
@@ -376,18 +470,29 @@ void PEFFFile::parse(const void* data, size_t size) {
 
     auto sec_kind = static_cast<PEFFSectionKind>(sec_header.section_kind);
 
-    auto sec_data = r.pread(sec_header.container_offset, sec_header.packed_size);
+    // Like StringReader::pread, this truncates the section if it extends past
+    // the end of the file
+    size_t sec_data_size = (sec_header.container_offset < r.size())
+        ? min<size_t>(sec_header.packed_size, r.size() - sec_header.container_offset)
+        : 0;
+    string_view sec_data;
+    if (sec_data_size) {
+      sec_data = string_view(reinterpret_cast<const char*>(
+          r.pgetv(sec_header.container_offset, sec_data_size)), sec_data_size);
+    }
+
+    size_t data_size = sec_data.size();
     if (sec_kind == PEFFSectionKind::PATTERN_DATA) {
-      string decompressed_data = decompress_pattern_data(sec_data);
-      sec_data = move(decompressed_data);
+      data_size = pattern_data_unpacked_size(sec_data);
     } else if (sec_kind == PEFFSectionKind::LOADER) {
       this->parse_loader_section(sec_data.data(), sec_data.size());
-      sec_data.clear();
+      sec_data = string_view();
+      data_size = 0;
     }
 
     string name;
     if (sec_header.name_offset >= 0) {
-      name = sec_data.data() + section_name_table_offset + sec_header.name_offset;
+      name = r.pget_cstr(section_name_table_offset + sec_header.name_offset);
     }
 
     Section sec;
@@ -399,7 +504,8 @@ void PEFFFile::parse(const void* data, size_t size) {
     sec.section_kind = sec_kind,
     sec.share_kind = static_cast<PEFFShareKind>(sec_header.share_kind),
     sec.alignment = sec_header.alignment,
-    sec.data = move(sec_data);
+    sec.data = sec_data;
+    sec.data_size = data_size;
     this->sections.emplace_back(move(sec));
   }
 }
@@ -423,7 +529,8 @@ void PEFFFile::ImportSymbol::print(FILE* stream) const {
 void PEFFFile::print(
     FILE* stream,
     const multimap<uint32_t, string>* labels,
-    bool print_hex_view_for_code) const {
+    bool print_hex_view_for_code,
+    size_t disassembly_threads) const {
   fprintf(stream, "[PEFF file: %s]\n", this->filename.c_str());
   fprintf(stream, "  file_timestamp: %08" PRIX32 "\n", this->file_timestamp);
   fprintf(stream, "  old_def_version: %08" PRIX32 "\n", this->old_def_version);
@@ -437,8 +544,10 @@ void PEFFFile::print(
   fputs("\n  term: ", stream);
   this->term_symbol.print(stream);
 
-  // TODO: Add export symbols as labels in the disassembly
-
+  LabelIndex base_labels;
+  if (labels) {
+    base_labels = LabelIndex(*labels);
+  }
   for (size_t x = 0; x < this->sections.size(); x++) {
     const auto& sec = this->sections[x];
     fprintf(stream, "\n[section %zX header]\n", x);
@@ -450,19 +559,38 @@ void PEFFFile::print(
     fprintf(stream, "  section_kind %s\n", name_for_section_kind(sec.section_kind));
     fprintf(stream, "  share_kind %s\n", name_for_share_kind(sec.share_kind));
     fprintf(stream, "  alignment %02hhX\n", sec.alignment);
+
+    string unpacked_data;
+    string_view sec_data = sec.data;
+    if (sec.section_kind == PEFFSectionKind::PATTERN_DATA) {
+      unpacked_data = decompress_pattern_data(sec.data, sec.data_size);
+      sec_data = unpacked_data;
+    }
     if (sec.section_kind == PEFFSectionKind::EXECUTABLE_READONLY || 
         sec.section_kind == PEFFSectionKind::EXECUTABLE_READWRITE) {
-      auto disassemble = this->arch_is_ppc ? PPC32Emulator::disassemble : M68KEmulator::disassemble;
-      string disassembly = disassemble(sec.data.data(), sec.data.size(), 0, labels);
+      // Exported symbols in this section are labeled, which also gives the
+      // disassembler places to split the section when using multiple threads
+      LabelIndex sec_labels = base_labels;
+      for (const auto& it : this->export_symbols) {
+        if (it.second.section_index == x) {
+          sec_labels.add(it.second.value, it.second.name);
+        }
+      }
       fprintf(stream, "[section %zX disassembly]\n", x);
-      fwritex(stream, disassembly);
+      DisassemblyOutput out(stream);
+      if (this->arch_is_ppc) {
+        PPC32Emulator::disassemble(out, sec_data.data(), sec_data.size(), 0, &sec_labels, disassembly_threads);
+      } else {
+        M68KEmulator::disassemble(out, sec_data.data(), sec_data.size(), 0, &sec_labels, disassembly_threads);
+      }
+      out.flush();
       if (print_hex_view_for_code) {
         fprintf(stream, "[section %zX data]\n", x);
-        print_data(stream, sec.data);
+        print_data(stream, sec_data.data(), sec_data.size());
       }
-    } else if (!sec.data.empty()) {
+    } else if (!sec_data.empty()) {
       fprintf(stream, "[section %zX data]\n", x);
-      print_data(stream, sec.data);
+      print_data(stream, sec_data.data(), sec_data.size());
     }
     if (!sec.relocation_program.empty()) {
       fprintf(stream, "[section %zX relocation program disassembly]\n", x);
@@ -496,7 +624,7 @@ void PEFFFile::load_into(const string& lib_name, shared_ptr<MemoryContext> mem,
     uint32_t base_addr) {
   vector<uint32_t> section_addrs;
   for (const auto& section : this->sections) {
-    if (section.total_size < section.data.size()) {
+    if (section.total_size < section.data_size) {
       throw runtime_error("section total size is smaller than data size");
     }
     if (section.total_size == 0) {
@@ -504,7 +632,8 @@ void PEFFFile::load_into(const string& lib_name, shared_ptr<MemoryContext> mem,
       continue;
     }
 
-    // Data was already unpacked; just copy it in and zero the extra space
+    // Copy (or unpack) the data directly into the section's memory, and zero
+    // the extra space
     uint32_t section_addr;
     if (base_addr == 0) {
       section_addr = mem->allocate(section.total_size);
@@ -518,149 +647,203 @@ void PEFFFile::load_into(const string& lib_name, shared_ptr<MemoryContext> mem,
       throw runtime_error("cannot allocate memory for section");
     }
 
-    void* section_mem = mem->at<void>(section_addr, section.data.size());
-    memcpy(section_mem, section.data.data(), section.data.size());
-    memset(reinterpret_cast<uint8_t*>(section_mem) + section.data.size(), 0,
-        section.total_size - section.data.size());
+    void* section_mem = mem->at<void>(section_addr, section.total_size);
+    if (section.section_kind == PEFFSectionKind::PATTERN_DATA) {
+      unpack_pattern_data(section.data, section_mem, section.data_size);
+    } else {
+      memcpy(section_mem, section.data.data(), section.data_size);
+    }
+    memset(reinterpret_cast<uint8_t*>(section_mem) + section.data_size, 0,
+        section.total_size - section.data_size);
     section_addrs.emplace_back(section_addr);
   }
 
-  auto get_import_symbol_addr = [&](uint32_t index) -> uint32_t {
-    const auto& sym = this->import_symbols.at(index);
-    string name = sym.lib_name + ":" + sym.name;
+  // Resolve each imported symbol once, rather than once per reference. Missing
+  // weak imports resolve to zero; missing strong imports are only an error if
+  // a relocation refers to them.
+  vector<uint32_t> import_addrs(this->import_symbols.size(), 0);
+  vector<bool> import_missing(this->import_symbols.size(), false);
+  for (size_t x = 0; x < this->import_symbols.size(); x++) {
+    const auto& sym = this->import_symbols[x];
     try {
-      return mem->get_symbol_addr(name.c_str());
+      import_addrs[x] = mem->get_symbol_addr(sym.lib_name + ":" + sym.name);
     } catch (const out_of_range&) {
-      if (!(sym.flags & PEFFLoaderImportSymbolFlags::WEAK)) {
-        throw;
-      } else {
-        return 0;
-      }
+      import_missing[x] = !(sym.flags & PEFFLoaderImportSymbolFlags::WEAK);
     }
+  }
+  auto get_import_symbol_addr = [&](uint32_t index) -> uint32_t {
+    if (index >= import_addrs.size()) {
+      throw out_of_range("relocation refers to nonexistent import symbol");
+    }
+    if (import_missing[index]) {
+      const auto& sym = this->import_symbols[index];
+      throw out_of_range(string_printf("import symbol %s:%s is not defined",
+          sym.lib_name.c_str(), sym.name.c_str()));
+    }
+    return import_addrs[index];
   };
 
-  auto add_at_addr = [&](uint32_t addr, uint32_t delta) -> void {
-    uint32_t value = mem->read<be_uint32_t>(addr);
-    mem->write<be_uint32_t>(addr, value + delta);
-  };
-
-  // Run relocation programs
+  // Run relocation programs. Each section's memory is looked up only once, so
+  // relocating a word only costs a bounds check (done once per run of words).
   for (size_t x = 0; x < this->sections.size(); x++) {
     auto& section = this->sections[x];
-    StringReader r(section.relocation_program.data(), section.relocation_program.size());
-
+    if (section.relocation_program.empty()) {
+      continue;
+    }
     uint32_t section_addr = section_addrs[x];
+    if (section_addr == 0) {
+      throw runtime_error("relocation program refers to uninstantiated section");
+    }
+    uint8_t* section_data = mem->at<uint8_t>(section_addr, section.total_size);
+    size_t section_size = section.total_size;
+
+    const be_uint16_t* program = reinterpret_cast<const be_uint16_t*>(
+        section.relocation_program.data());
+    size_t program_size = section.relocation_program.size() / 2;
+    size_t pc = 0;
+    auto next_word = [&]() -> uint16_t {
+      if (pc >= program_size) {
+        throw out_of_range("relocation program ends during command");
+      }
+      return program[pc++];
+    };
+
     uint32_t pending_repeat_count = 0;
-    uint32_t reloc_address = section_addr;
+    size_t reloc_offset = 0;
     uint32_t import_index = 0;
     // TODO: either of these can be initialized to zero if the relevant section
     // is missing or not instantiated
     uint32_t section_c = section_addrs[0] - this->sections[0].default_address;
     uint32_t section_d = section_addrs[1] - this->sections[1].default_address;
 
-    while (!r.eof()) {
-      uint16_t cmd = r.get_u16b();
+    // Returns the host address of the word at reloc_offset, after checking
+    // that count entries of entry_size bytes, stride bytes apart, all fit in
+    // the section
+    auto check_run = [&](size_t count, size_t stride, size_t entry_size) -> uint8_t* {
+      if (count && (reloc_offset + (count - 1) * stride + entry_size > section_size)) {
+        throw out_of_range("relocation is beyond end of section");
+      }
+      return section_data + reloc_offset;
+    };
+    auto add_run = [&](size_t count, uint32_t delta) -> void {
+      uint8_t* p = check_run(count, 4, 4);
+      for (size_t z = 0; z < count; z++, p += 4) {
+        auto* w = reinterpret_cast<be_uint32_t*>(p);
+        *w = *w + delta;
+      }
+      reloc_offset += count * 4;
+    };
+    auto add_pair_run = [&](size_t count, size_t stride, uint32_t delta0,
+        uint32_t delta1) -> void {
+      uint8_t* p = check_run(count, stride, delta1 ? 8 : 4);
+      for (size_t z = 0; z < count; z++, p += stride) {
+        auto* w = reinterpret_cast<be_uint32_t*>(p);
+        w[0] = w[0] + delta0;
+        if (delta1) {
+          w[1] = w[1] + delta1;
+        }
+      }
+      reloc_offset += count * stride;
+    };
 
-      if ((cmd & 0xC000) == 0x0000) {
+    while (pc < program_size) {
+      uint16_t cmd = program[pc++];
+
+      if ((cmd & 0xC000) == 0x0000) { // RelocBySectDWithSkip
         uint8_t count = cmd & 0x3F;
         uint8_t skip_count = (cmd >> 6) & 0xFF;
-        reloc_address += skip_count * 4;
-        for (; count; count--, reloc_address += 4) {
-          add_at_addr(reloc_address, section_d);
-        }
+        reloc_offset += skip_count * 4;
+        add_run(count, section_d);
       } else if ((cmd & 0xE000) == 0x4000) {
         uint16_t count = (cmd & 0x01FF) + 1;
-        if ((cmd & 0x1E00) == 0x0000) {
-          for (; count; count--, reloc_address += 4) {
-            add_at_addr(reloc_address, section_c);
-          }
-        } else if ((cmd & 0x1E00) == 0x0200) {
-          for (; count; count--, reloc_address += 4) {
-            add_at_addr(reloc_address, section_d);
-          }
-        } else if ((cmd & 0x1E00) == 0x0400) {
-          for (; count; count--, reloc_address += 12) {
-            add_at_addr(reloc_address, section_c);
-            add_at_addr(reloc_address + 4, section_d);
-          }
-        } else if ((cmd & 0x1E00) == 0x0600) {
-          for (; count; count--, reloc_address += 8) {
-            add_at_addr(reloc_address, section_c);
-            add_at_addr(reloc_address + 4, section_d);
-          }
-        } else if ((cmd & 0x1E00) == 0x0800) {
-          for (; count; count--, reloc_address += 8) {
-            add_at_addr(reloc_address, section_d);
-          }
-        } else if ((cmd & 0x1E00) == 0x0A00) {
-          for (; count; count--, reloc_address += 4, import_index++) {
-            add_at_addr(reloc_address, get_import_symbol_addr(import_index));
+        if ((cmd & 0x1E00) == 0x0000) { // RelocBySectC
+          add_run(count, section_c);
+        } else if ((cmd & 0x1E00) == 0x0200) { // RelocBySectD
+          add_run(count, section_d);
+        } else if ((cmd & 0x1E00) == 0x0400) { // RelocTVector12
+          add_pair_run(count, 12, section_c, section_d);
+        } else if ((cmd & 0x1E00) == 0x0600) { // RelocTVector8
+          add_pair_run(count, 8, section_c, section_d);
+        } else if ((cmd & 0x1E00) == 0x0800) { // RelocVTable8
+          add_pair_run(count, 8, section_d, 0);
+        } else if ((cmd & 0x1E00) == 0x0A00) { // RelocImportRun
+          uint8_t* p = check_run(count, 4, 4);
+          for (; count; count--, p += 4, import_index++) {
+            auto* w = reinterpret_cast<be_uint32_t*>(p);
+            *w = *w + get_import_symbol_addr(import_index);
           }
+          reloc_offset = p - section_data;
         } else {
           throw runtime_error("invalid relocation command");
         }
       } else if ((cmd & 0xE000) == 0x6000) {
         uint16_t index = cmd & 0x01FF;
-        if ((cmd & 0x1E00) == 0x0000) {
-          add_at_addr(reloc_address, get_import_symbol_addr(index));
-          reloc_address += 4;
+        if ((cmd & 0x1E00) == 0x0000) { // RelocSmByImport
+          add_run(1, get_import_symbol_addr(index));
           import_index = index + 1;
-        } else if ((cmd & 0x1E00) == 0x0200) {
+        } else if ((cmd & 0x1E00) == 0x0200) { // RelocSmSetSectC
           section_c = section_addrs.at(index);
-        } else if ((cmd & 0x1E00) == 0x0400) {
+        } else if ((cmd & 0x1E00) == 0x0400) { // RelocSmSetSectD
           section_d = section_addrs.at(index);
-        } else if ((cmd & 0x1E00) == 0x0600) {
-          add_at_addr(reloc_address, section_addrs.at(index));
+        } else if ((cmd & 0x1E00) == 0x0600) { // RelocSmBySection
+          add_run(1, section_addrs.at(index));
         } else {
           throw runtime_error("invalid relocation command");
         }
-      } else if ((cmd & 0xF000) == 0x8000) {
-        uint16_t delta = (cmd & 0x0FFF) + 1;
-        reloc_address += delta;
-      } else if ((cmd & 0xF000) == 0x9000) {
+      } else if ((cmd & 0xF000) == 0x8000) { // RelocIncrPosition
+        reloc_offset += (cmd & 0x0FFF) + 1;
+      } else if ((cmd & 0xF000) == 0x9000) { // RelocSmRepeat
         uint8_t blocks = ((cmd >> 8) & 0x0F) + 1;
         uint16_t times = (cmd & 0x00FF) + 1;
         if (pending_repeat_count == 0) {
           pending_repeat_count = times;
-          r.go(r.where() - 2 * blocks);
         } else if (pending_repeat_count != 1) {
           pending_repeat_count--;
-          r.go(r.where() - 2 * blocks);
         } else {
           pending_repeat_count = 0;
         }
-      } else if ((cmd & 0xFC00) == 0xA000) {
-        uint32_t offset = ((cmd & 0x03FF) << 16) | r.get_u16b();
-        reloc_address = section_addr + offset;
-      } else if ((cmd & 0xFC00) == 0xA400) {
-        uint32_t index = ((cmd & 0x03FF) << 16) | r.get_u16b();
-        add_at_addr(reloc_address, get_import_symbol_addr(index));
-        reloc_address += 4;
+        if (pending_repeat_count) {
+          if (static_cast<size_t>(blocks) + 1 > pc) {
+            throw out_of_range("repeat command refers to before start of program");
+          }
+          pc -= blocks + 1;
+        }
+      } else if ((cmd & 0xFC00) == 0xA000) { // RelocSetPosition
+        reloc_offset = ((cmd & 0x03FF) << 16) | next_word();
+      } else if ((cmd & 0xFC00) == 0xA400) { // RelocLgByImport
+        uint32_t index = ((cmd & 0x03FF) << 16) | next_word();
+        add_run(1, get_import_symbol_addr(index));
         import_index = index + 1;
-      } else if ((cmd & 0xFC00) == 0xB000) {
+      } else if ((cmd & 0xFC00) == 0xB000) { // RelocLgRepeat
         uint8_t blocks = ((cmd >> 6) & 0x0F) + 1;
-        uint32_t times = ((cmd & 0x003F) << 16) | r.get_u16b();
+        uint32_t times = ((cmd & 0x003F) << 16) | next_word();
         if (pending_repeat_count == 0) {
           pending_repeat_count = times;
-          r.go(r.where() - 2 * blocks);
         } else if (pending_repeat_count != 1) {
           pending_repeat_count--;
-          r.go(r.where() - 2 * blocks);
         } else {
           pending_repeat_count = 0;
         }
+        if (pending_repeat_count) {
+          if (static_cast<size_t>(blocks) + 2 > pc) {
+            throw out_of_range("repeat command refers to before start of program");
+          }
+          pc -= blocks + 2;
+        }
       } else if ((cmd & 0xFC00) == 0xB400) {
         uint8_t subcmd = (cmd >> 6) & 0x0F;
-        uint32_t index = ((cmd & 0x003F) << 16) | r.get_u16b();
-        if (subcmd == 0x0) {
-          add_at_addr(reloc_address, section_addrs.at(index));
-        } else if (subcmd == 0x1) {
+        uint32_t index = ((cmd & 0x003F) << 16) | next_word();
+        if (subcmd == 0x0) { // RelocLgBySection
+          add_run(1, section_addrs.at(index));
+        } else if (subcmd == 0x1) { // RelocLgSetSectC
           section_c = section_addrs.at(index);
-        } else if (subcmd == 0x2) {
+        } else if (subcmd == 0x2) { // RelocLgSetSectD
           section_d = section_addrs.at(index);
         } else {
           throw runtime_error("invalid relocation command");
         }
+      } else {
+        throw runtime_error("invalid relocation command");
       }
     }
   }
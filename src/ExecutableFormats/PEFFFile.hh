@@ -5,9 +5,12 @@
 #include <map>
 #include <phosg/Encoding.hh>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include "../Emulators/MemoryContext.hh"
+#include "../MappedFile.hh"
 
 
 
@@ -192,7 +195,13 @@ struct PEFFLoaderExportSymbol {
 
 class PEFFFile {
 public:
+  // Section data refers to the file's contents instead of being copied out of
+  // them. Pattern-initialized sections are validated during parsing but aren't
+  // unpacked until they're needed; load_into unpacks them directly into the
+  // section's memory. The constructors that take a filename or MappedFile don't
+  // copy the file at all; the others make one copy of the entire file.
   explicit PEFFFile(const char* filename);
+  PEFFFile(const char* filename, std::shared_ptr<const MappedFile> file);
   PEFFFile(const char* filename, const std::string& data);
   PEFFFile(const char* filename, const void* data, size_t size);
   ~PEFFFile() = default;
@@ -200,7 +209,8 @@ public:
   void print(
       FILE* stream,
       const std::multimap<uint32_t, std::string>* labels = nullptr,
-      bool print_hex_view_for_code = false) const;
+      bool print_hex_view_for_code = false,
+      size_t disassembly_threads = 1) const;
 
   void load_into(const std::string& lib_name, std::shared_ptr<MemoryContext> mem,
       uint32_t base_addr = 0);
@@ -258,10 +268,18 @@ private:
     PEFFSectionKind section_kind;
     PEFFShareKind share_kind;
     uint8_t alignment;
-    std::string data;
-    std::string relocation_program;
+    // For pattern-initialized sections, this is the packed data, and
+    // data_size is the size after unpacking; for all other sections,
+    // data_size is the same as data.size()
+    std::string_view data;
+    size_t data_size;
+    std::string_view relocation_program;
   };
 
+  // Section data points into one of these
+  std::shared_ptr<const MappedFile> file;
+  std::shared_ptr<const std::string> owned_data;
+
   uint32_t file_timestamp;
   uint32_t old_def_version;
   uint32_t old_imp_version;
@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <memory>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "PEFFFile.hh"
+
+using namespace std;
+
+
+
+static constexpr size_t CODE_SIZE = 0x10;
+static constexpr size_t DATA_WORDS = 12;
+
+// Builds a container with a code section, a data section whose words are
+// initially 0 through DATA_WORDS - 1, and a loader section with two imports
+// (Lib:a and Lib:b) and the given relocation program for the data section
+static string make_peff(const vector<uint16_t>& program) {
+  StringWriter loader_w;
+  PEFFLoaderSectionHeader loader_header;
+  memset(&loader_header, 0, sizeof(loader_header));
+  loader_header.main_symbol_section_index = -1;
+  loader_header.init_symbol_section_index = -1;
+  loader_header.term_symbol_section_index = -1;
+  loader_header.imported_lib_count = 1;
+  loader_header.imported_symbol_count = 2;
+  loader_header.rel_section_count = 1;
+  loader_header.rel_commands_offset = sizeof(PEFFLoaderSectionHeader) +
+      sizeof(PEFFLoaderImportLibrary) + 2 * sizeof(PEFFLoaderImportSymbol) +
+      sizeof(PEFFLoaderRelocationHeader);
+  loader_header.string_table_offset = loader_header.rel_commands_offset + program.size() * 2;
+  loader_header.export_hash_offset = loader_header.string_table_offset + 8;
+  loader_w.put(loader_header);
+
+  PEFFLoaderImportLibrary lib;
+  memset(&lib, 0, sizeof(lib));
+  lib.name_offset = 0;
+  lib.imported_symbol_count = 2;
+  lib.start_index = 0;
+  loader_w.put(lib);
+  loader_w.put_u32b(4); // a (CODE)
+  loader_w.put_u32b(6); // b (CODE)
+
+  PEFFLoaderRelocationHeader rel;
+  memset(&rel, 0, sizeof(rel));
+  rel.section_index = 1;
+  rel.word_count = program.size();
+  rel.start_offset = 0;
+  loader_w.put(rel);
+  for (uint16_t cmd : program) {
+    loader_w.put_u16b(cmd);
+  }
+  loader_w.write("Lib\0a\0b\0", 8);
+  loader_w.put_u32b(0); // One empty export hash chain
+
+  string code(CODE_SIZE, '\0');
+  StringWriter data_w;
+  for (size_t z = 0; z < DATA_WORDS; z++) {
+    data_w.put_u32b(z);
+  }
+  vector<string> section_datas({code, data_w.str(), loader_w.str()});
+  vector<uint8_t> section_kinds({
+      static_cast<uint8_t>(PEFFSectionKind::EXECUTABLE_READONLY),
+      static_cast<uint8_t>(PEFFSectionKind::UNPACKED_DATA),
+      static_cast<uint8_t>(PEFFSectionKind::LOADER)});
+
+  StringWriter w;
+  PEFFHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic1 = 0x4A6F7921; // 'Joy!'
+  header.magic2 = 0x70656666; // 'peff'
+  header.arch = 0x70777063; // 'pwpc'
+  header.format_version = 1;
+  header.section_count = 3;
+  header.inst_section_count = 2;
+  w.put(header);
+
+  uint32_t offset = sizeof(PEFFHeader) + 3 * sizeof(PEFFSectionHeader);
+  for (size_t z = 0; z < 3; z++) {
+    PEFFSectionHeader sec;
+    memset(&sec, 0, sizeof(sec));
+    sec.name_offset = -1;
+    sec.total_size = (z == 2) ? 0 : section_datas[z].size();
+    sec.unpacked_size = section_datas[z].size();
+    sec.packed_size = section_datas[z].size();
+    sec.container_offset = offset;
+    sec.section_kind = section_kinds[z];
+    sec.share_kind = PEFFShareKind::PROCESS;
+    sec.alignment = 4;
+    w.put(sec);
+    offset += section_datas[z].size();
+  }
+  for (const auto& data : section_datas) {
+    w.write(data);
+  }
+  return move(w.str());
+}
+
+static constexpr uint32_t IMPORT_A_ADDR = 0x11110000;
+static constexpr uint32_t IMPORT_B_ADDR = 0x22220000;
+
+static shared_ptr<MemoryContext> make_memory() {
+  auto mem = make_shared<MemoryContext>();
+  mem->set_symbol_addr("Lib:a", IMPORT_A_ADDR);
+  mem->set_symbol_addr("Lib:b", IMPORT_B_ADDR);
+  return mem;
+}
+
+int main(int, char**) {
+  fprintf(stderr, "-- relocation commands\n");
+  {
+    PEFFFile peff("Test", make_peff({
+        0x0002, // RelocBySectDWithSkip (skip 0, count 2): words 0-1
+        0x4000, // RelocBySectC (count 1): word 2
+        0x4A01, // RelocImportRun (count 2): words 3-4 (a, b)
+        0x6600, // RelocSmBySection (section 0): word 5
+        0x4000, // RelocBySectC (count 1)
+        0x9001, // RelocSmRepeat (1 block, 2 more times): words 6-8
+        0xA000, 0x0028, // RelocSetPosition (word 10)
+        0x6001, // RelocSmByImport (b): word 10
+    }));
+    auto mem = make_memory();
+    peff.load_into("Test", mem);
+
+    uint32_t code_addr = mem->get_symbol_addr("Test:section:0");
+    uint32_t data_addr = mem->get_symbol_addr("Test:section:1");
+    vector<uint32_t> expected({
+        data_addr + 0, data_addr + 1, code_addr + 2, IMPORT_A_ADDR + 3,
+        IMPORT_B_ADDR + 4, code_addr + 5, code_addr + 6, code_addr + 7,
+        code_addr + 8, 9, IMPORT_B_ADDR + 10, 11});
+    for (size_t z = 0; z < DATA_WORDS; z++) {
+      expect_eq(expected[z], mem->read_u32b(data_addr + z * 4));
+    }
+  }
+
+  fprintf(stderr, "-- relocation past end of section\n");
+  {
+    // RelocSetPosition (word 11), then RelocBySectC (count 2)
+    PEFFFile peff("Test", make_peff({0xA000, 0x002C, 0x4001}));
+    bool failed = false;
+    try {
+      peff.load_into("Test", make_memory());
+    } catch (const out_of_range&) {
+      failed = true;
+    }
+    expect(failed);
+  }
+
+  fprintf(stderr, "-- invalid relocation command\n");
+  {
+    PEFFFile peff("Test", make_peff({0x4C00}));
+    bool failed = false;
+    try {
+      peff.load_into("Test", make_memory());
+    } catch (const runtime_error&) {
+      failed = true;
+    }
+    expect(failed);
+  }
+
+  fprintf(stderr, "-- missing import\n");
+  {
+    PEFFFile peff("Test", make_peff({0x6000})); // RelocSmByImport (a)
+    auto mem = make_shared<MemoryContext>();
+    bool failed = false;
+    try {
+      peff.load_into("Test", mem);
+    } catch (const out_of_range&) {
+      failed = true;
+    }
+    expect(failed);
+  }
+
+  printf("PEFFFileTest: all tests passed\n");
+  return 0;
+}
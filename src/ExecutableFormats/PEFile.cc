@@ -16,17 +16,62 @@ using namespace std;
 
 
 
-PEFile::PEFile(const char* filename) : PEFile(filename, load_file(filename)) { }
+PEFile::PEFile(const char* filename)
+  : PEFile(filename, make_shared<MappedFile>(filename)) { }
+
+PEFile::PEFile(const char* filename, shared_ptr<const MappedFile> file)
+  : filename(filename), file(file) {
+  this->parse(this->file->data(), this->file->size());
+}
 
 PEFile::PEFile(const char* filename, const string& data)
   : PEFile(filename, data.data(), data.size()) { }
 
 PEFile::PEFile(const char* filename, const void* data, size_t size)
-  : filename(filename) {
-  this->parse(data, size);
+  : filename(filename),
+    owned_data(make_shared<string>(reinterpret_cast<const char*>(data), size)) {
+  this->parse(this->owned_data->data(), this->owned_data->size());
 }
 
 void PEFile::load_into(shared_ptr<MemoryContext> mem) {
+  // Sections can be mapped directly from the file if each one starts on a page
+  // boundary and doesn't share its last page with the next section
+  if (this->file && this->file->is_mapped()) {
+    uint32_t page_mask = mem->get_page_size() - 1;
+    map<uint32_t, const Section*> sections_by_addr;
+    bool can_map = true;
+    for (const auto& section : this->sections) {
+      if (section.size == 0) {
+        continue;
+      }
+      if ((section.address & page_mask) ||
+          !sections_by_addr.emplace(section.address, &section).second) {
+        can_map = false;
+        break;
+      }
+    }
+    uint64_t prev_end_addr = 0;
+    for (const auto& it : sections_by_addr) {
+      if (it.first < prev_end_addr) {
+        can_map = false;
+        break;
+      }
+      prev_end_addr = (static_cast<uint64_t>(it.first) + it.second->size + page_mask) & ~static_cast<uint64_t>(page_mask);
+    }
+
+    if (can_map) {
+      for (const auto& it : sections_by_addr) {
+        const auto& section = *it.second;
+        // Uninitialized sections' file offsets may not be meaningful
+        size_t bytes_to_map = min<size_t>(section.size, section.data.size());
+        size_t file_offset = bytes_to_map ? section.file_offset : 0;
+        auto pages = this->file->map_private(file_offset, bytes_to_map, section.size);
+        mem->map_external(section.address, pages.get(), section.size, false, pages);
+      }
+      return;
+    }
+  }
+
   // Since we may be loading on a system with a larger page size than the system
   // the PE was compiled for, preallocate an arena for the entire thing because
   // we may have to do fixed-address allocations across arena boundaries if we
@@ -56,15 +101,15 @@ void PEFile::load_into(shared_ptr<MemoryContext> mem) {
   }
 }
 
-multimap<uint32_t, string> PEFile::labels_for_loaded_imports() const {
-  multimap<uint32_t, string> ret;
+LabelIndex PEFile::labels_for_loaded_imports() const {
+  LabelIndex ret;
   for (const auto& lib_it : this->import_libs) {
     const auto& lib = lib_it.second;
     for (const auto& imp : lib.imports) {
       string name = imp.name.empty()
           ? string_printf("%s:<Ordinal%04hX>", lib.name.c_str(), imp.ordinal)
           : string_printf("%s:%s", lib.name.c_str(), imp.name.c_str());
-      ret.emplace(imp.addr_rva + this->header.image_base, move(name));
+      ret.add(imp.addr_rva + this->header.image_base, name);
     }
   }
   return ret;
@@ -125,7 +170,9 @@ void PEFile::parse(const void* data, size_t size) {
     strip_trailing_zeroes(sec.name);
     sec.address = sec_header.rva + this->header.image_base;
     sec.size = sec_header.loaded_size;
-    sec.data = r.preadx(sec_header.file_data_rva, sec_header.file_data_size);
+    sec.data = string_view(reinterpret_cast<const char*>(
+        r.pgetv(sec_header.file_data_rva, sec_header.file_data_size)),
+        sec_header.file_data_size);
 
     this->sections.emplace_back(move(sec));
   }
@@ -458,7 +505,8 @@ static const char* name_for_magic(uint16_t magic) {
 void PEFile::print(
     FILE* stream,
     const multimap<uint32_t, string>* labels,
-    bool print_hex_view_for_code) const {
+    bool print_hex_view_for_code,
+    size_t disassembly_threads) const {
   fprintf(stream, "[PE file: %s]\n", this->filename.c_str());
   fprintf(stream, "  architecture: %04hX (%s)\n", this->header.architecture.load(), name_for_architecture(this->header.architecture));
   fprintf(stream, "  num_sections: %04hX\n", this->header.num_sections.load());
@@ -528,10 +576,10 @@ void PEFile::print(
     }
   }
 
-  multimap<uint32_t, string> all_labels = this->labels_for_loaded_imports();
+  LabelIndex all_labels = this->labels_for_loaded_imports();
   if (labels) {
     for (const auto& it : *labels) {
-      all_labels.emplace(it.first, it.second);
+      all_labels.add(it.first, it.second);
     }
   }
 
@@ -552,16 +600,18 @@ void PEFile::print(
 
     if (!sec.data.empty()) {
       if ((this->header.architecture == 0x014C) && (sec.flags & 0x00000020)) {
-        string disassembly = X86Emulator::disassemble(sec.data.data(), sec.data.size(), sec.address, &all_labels);
         fprintf(stream, "[section %zX disassembly]\n", x);
-        fwritex(stream, disassembly);
+        DisassemblyOutput out(stream);
+        X86Emulator::disassemble(out, sec.data.data(), sec.data.size(), sec.address,
+            &all_labels, disassembly_threads);
+        out.flush();
         if (print_hex_view_for_code) {
           fprintf(stream, "[section %zX data]\n", x);
-          print_data(stream, sec.data, sec.address);
+          print_data(stream, sec.data.data(), sec.data.size(), sec.address);
         }
       } else if (!sec.data.empty()) {
         fprintf(stream, "[section %zX data]\n", x);
-        print_data(stream, sec.data, sec.address);
+        print_data(stream, sec.data.data(), sec.data.size(), sec.address);
       }
     }
   }
@@ -7,9 +7,13 @@
 #include <phosg/Encoding.hh>
 #include <phosg/Strings.hh>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
+#include "../Emulators/LabelIndex.hh"
 #include "../Emulators/MemoryContext.hh"
+#include "../MappedFile.hh"
 
 
 
@@ -169,21 +173,29 @@ struct PEExportTableHeader {
 
 class PEFile {
 public:
+  // Section data refers to the file's contents instead of being copied out of
+  // them. The constructors that take a filename or MappedFile don't copy the
+  // file at all; the others make one copy of the entire file.
   explicit PEFile(const char* filename);
+  PEFile(const char* filename, std::shared_ptr<const MappedFile> file);
   PEFile(const char* filename, const std::string& data);
   PEFile(const char* filename, const void* data, size_t size);
   ~PEFile() = default;
 
+  // If the file is memory-mapped and every section starts on a page boundary
+  // (which is usually the case, unless the host's pages are larger than 4KB),
+  // the sections are mapped into mem copy-on-write instead of being copied.
   void load_into(std::shared_ptr<MemoryContext> mem);
 
-  std::multimap<uint32_t, std::string> labels_for_loaded_imports() const;
+  LabelIndex labels_for_loaded_imports() const;
 
   const PEHeader& unloaded_header() const;
 
   void print(
       FILE* stream,
       const std::multimap<uint32_t, std::string>* labels = nullptr,
-      bool print_hex_view_for_code = false) const;
+      bool print_hex_view_for_code = false,
+      size_t disassembly_threads = 1) const;
 
   StringReader read_from_rva(uint32_t rva, uint32_t size = 0xFFFFFFFF) const;
 
@@ -198,7 +210,7 @@ private:
     std::string name;
     uint32_t address;
     uint32_t size;
-    std::string data;
+    std::string_view data;
 
     uint32_t rva;
     uint32_t file_offset;
@@ -219,6 +231,10 @@ private:
     std::vector<Function> imports;
   };
 
+  // Section data points into one of these
+  std::shared_ptr<const MappedFile> file;
+  std::shared_ptr<const std::string> owned_data;
+
   std::vector<Section> sections;
   std::unordered_map<std::string, ImportLibrary> import_libs;
 
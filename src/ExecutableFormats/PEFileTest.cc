@@ -0,0 +1,117 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <memory>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "PEFile.hh"
+
+using namespace std;
+
+
+
+static string section_data(size_t size, uint8_t seed) {
+  string ret(size, '\0');
+  for (size_t z = 0; z < size; z++) {
+    ret[z] = static_cast<char>((z * 7 + seed) | 1);
+  }
+  return ret;
+}
+
+int main(int, char**) {
+  // Neither section's file offset is page-aligned, but both addresses are, so
+  // load_into uses MappedFile::map_private for them. The second section is
+  // larger in memory than in the file.
+  string text = section_data(0x1010, 0x11);
+  string data = section_data(0x30, 0x55);
+  static constexpr uint32_t image_base = 0x00400000;
+  static constexpr uint32_t text_rva = 0x00010000;
+  static constexpr uint32_t data_rva = 0x00020000;
+  static constexpr uint32_t data_loaded_size = 0x3000;
+
+  MZHeader mz;
+  memset(&mz, 0, sizeof(mz));
+  mz.signature = 0x4D5A;
+  mz.pe_header_offset = sizeof(MZHeader);
+
+  PEHeader pe;
+  memset(&pe, 0, sizeof(pe));
+  pe.signature = 0x50450000;
+  pe.architecture = 0x014C;
+  pe.num_sections = 2;
+  pe.optional_header_size = sizeof(PEHeader) - offsetof(PEHeader, magic);
+  pe.flags = 0x0002;
+  pe.magic = 0x010B;
+  pe.image_base = image_base;
+
+  PESectionHeader secs[2];
+  memset(secs, 0, sizeof(secs));
+  size_t text_offset = 0x200;
+  size_t data_offset = text_offset + text.size();
+  strncpy(secs[0].name, ".text", sizeof(secs[0].name));
+  secs[0].loaded_size = text.size();
+  secs[0].rva = text_rva;
+  secs[0].file_data_size = text.size();
+  secs[0].file_data_rva = text_offset;
+  strncpy(secs[1].name, ".data", sizeof(secs[1].name));
+  secs[1].loaded_size = data_loaded_size;
+  secs[1].rva = data_rva;
+  secs[1].file_data_size = data.size();
+  secs[1].file_data_rva = data_offset;
+
+  StringWriter w;
+  w.put(mz);
+  w.put(pe);
+  w.put(secs[0]);
+  w.put(secs[1]);
+  w.extend_to(text_offset);
+  w.write(text);
+  w.write(data);
+
+  string filename = string_printf("PEFileTest-%d.exe", getpid());
+  save_file(filename, w.str());
+
+  try {
+    fprintf(stderr, "-- load sections with unaligned file offsets\n");
+    PEFile pe_file(filename.c_str());
+    auto mem = make_shared<MemoryContext>();
+    pe_file.load_into(mem);
+
+    size_t page_size = mem->get_page_size();
+    expect_eq(text, mem->read(image_base + text_rva, text.size()));
+    expect_eq(data, mem->read(image_base + data_rva, data.size()));
+
+    // The rest of each section (and of its last page) is zero, and each
+    // section's host memory starts on a page boundary
+    size_t text_pages_size = (text.size() + page_size - 1) & ~(page_size - 1);
+    size_t data_pages_size = (data_loaded_size + page_size - 1) & ~(page_size - 1);
+    const uint8_t* text_mem = mem->at<uint8_t>(image_base + text_rva, text_pages_size);
+    const uint8_t* data_mem = mem->at<uint8_t>(image_base + data_rva, data_pages_size);
+    expect_eq(static_cast<uintptr_t>(0), reinterpret_cast<uintptr_t>(text_mem) & (page_size - 1));
+    expect_eq(static_cast<uintptr_t>(0), reinterpret_cast<uintptr_t>(data_mem) & (page_size - 1));
+    for (size_t z = text.size(); z < text_pages_size; z++) {
+      expect_eq(0, text_mem[z]);
+    }
+    for (size_t z = data.size(); z < data_pages_size; z++) {
+      expect_eq(0, data_mem[z]);
+    }
+
+    // Writes don't affect the file
+    mem->write_u32l(image_base + text_rva, 0xFFFFFFFF);
+    expect_eq(w.str(), load_file(filename));
+
+  } catch (const exception&) {
+    unlink(filename.c_str());
+    throw;
+  }
+  unlink(filename.c_str());
+
+  printf("PEFileTest: all tests passed\n");
+  return 0;
+}
@@ -55,19 +55,22 @@ const char* RELRelocationInstruction::name_for_type(Type type) {
 
 
 RELFile::RELFile(const char* filename)
-  : filename(filename) {
-  string data = load_file(filename);
-  this->parse(data.data(), data.size());
+  : RELFile(filename, make_shared<MappedFile>(filename)) { }
+
+RELFile::RELFile(const char* filename, shared_ptr<const MappedFile> file)
+  : filename(filename), file(file) {
+  this->parse(this->file->data(), this->file->size());
 }
 
 RELFile::RELFile(const char* filename, const string& data)
-  : filename(filename) {
-  this->parse(data.data(), data.size());
+  : filename(filename), owned_data(make_shared<string>(data)) {
+  this->parse(this->owned_data->data(), this->owned_data->size());
 }
 
 RELFile::RELFile(const char* filename, const void* data, size_t size)
-  : filename(filename) {
-  this->parse(data, size);
+  : filename(filename),
+    owned_data(make_shared<string>(reinterpret_cast<const char*>(data), size)) {
+  this->parse(this->owned_data->data(), this->owned_data->size());
 }
 
 void RELFile::parse(const void* data, size_t size) {
@@ -91,7 +94,8 @@ void RELFile::parse(const void* data, size_t size) {
     sec.size = sec_header.size;
     sec.has_code = sec_header.has_code();
     if (sec.offset) {
-      sec.data = r.preadx(sec.offset, sec.size);
+      sec.data = string_view(reinterpret_cast<const char*>(
+          r.pgetv(sec.offset, sec.size)), sec.size);
     }
   }
 
@@ -116,7 +120,8 @@ void RELFile::parse(const void* data, size_t size) {
 void RELFile::print(
     FILE* stream,
     const multimap<uint32_t, string>* labels,
-    bool print_hex_view_for_code) const {
+    bool print_hex_view_for_code,
+    size_t disassembly_threads) const {
   fprintf(stream, "[REL file: %s]\n", this->filename.c_str());
   fprintf(stream, "  module id: %08" PRIX32 "\n", this->header.module_id.load());
   if (this->name.empty()) {
@@ -141,20 +146,20 @@ void RELFile::print(
   }
   fputc('\n', stream);
 
-  multimap<uint32_t, string> effective_labels;
+  LabelIndex effective_labels;
   if (labels) {
-    effective_labels = *labels;
+    effective_labels = LabelIndex(*labels);
   }
   if (this->header.on_load_section) {
-    effective_labels.emplace(
+    effective_labels.add(
         this->sections.at(this->header.on_load_section).offset + this->header.on_load_offset, "on_load");
   }
   if (this->header.on_unload_section) {
-    effective_labels.emplace(
+    effective_labels.add(
         this->sections.at(this->header.on_unload_section).offset + this->header.on_unload_offset, "on_unload");
   }
   if (this->header.on_missing_section) {
-    effective_labels.emplace(
+    effective_labels.add(
         this->sections.at(this->header.on_missing_section).offset + this->header.on_missing_offset, "on_missing");
   }
 
@@ -187,7 +192,7 @@ void RELFile::print(
         size_t patch_offset = this->sections.at(current_section).offset + offset;
         string label_name = string_printf("reloc_mod%08" PRIX32 "_%02hhX_%08" PRIX32 "_%s",
             module_id, inst.section_index, inst.offset.load(), type_name);
-        effective_labels.emplace(patch_offset, move(label_name));
+        effective_labels.add(patch_offset, label_name);
       }
     }
   }
@@ -198,16 +203,18 @@ void RELFile::print(
         section.has_code ? "code" : "data", section.size);
     if (!section.data.empty()) {
       if (section.has_code) {
-        string disassembly = PPC32Emulator::disassemble(
-            section.data.data(), section.data.size(), section.offset, &effective_labels);
-        fwritex(stream, disassembly);
+        DisassemblyOutput out(stream);
+        PPC32Emulator::disassemble(out,
+            section.data.data(), section.data.size(), section.offset, &effective_labels,
+            disassembly_threads);
+        out.flush();
         if (print_hex_view_for_code) {
           fprintf(stream, "\n[Section %02" PRIX32 " (%s): %" PRIX32 " bytes]\n", section.index,
               section.has_code ? "code" : "data", section.size);
-          print_data(stream, section.data, section.offset);
+          print_data(stream, section.data.data(), section.data.size(), section.offset);
         }
       } else {
-        print_data(stream, section.data, section.offset);
+        print_data(stream, section.data.data(), section.data.size(), section.offset);
       }
     }
   }
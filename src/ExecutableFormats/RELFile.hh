@@ -6,8 +6,11 @@
 #include <unordered_map>
 #include <phosg/Encoding.hh>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
+#include "../MappedFile.hh"
 
 
 struct RELHeader {
@@ -86,7 +89,11 @@ struct RELRelocationInstruction {
 
 class RELFile {
 public:
+  // Section data refers to the file's contents instead of being copied out of
+  // them. The constructors that take a filename or MappedFile don't copy the
+  // file at all; the others make one copy of the entire file.
   explicit RELFile(const char* filename);
+  RELFile(const char* filename, std::shared_ptr<const MappedFile> file);
   RELFile(const char* filename, const std::string& data);
   RELFile(const char* filename, const void* data, size_t size);
   ~RELFile() = default;
@@ -94,21 +101,46 @@ public:
   void print(
       FILE* stream,
       const std::multimap<uint32_t, std::string>* labels = nullptr,
-      bool print_hex_view_for_code = false) const;
-
-private:
-  void parse(const void* data, size_t size);
-
-  const std::string filename;
+      bool print_hex_view_for_code = false,
+      size_t disassembly_threads = 1) const;
 
   struct Section {
     uint32_t index;
-    uint32_t offset;
+    uint32_t offset; // 0 if the section has no data in the file (e.g. BSS)
     uint32_t size;
     bool has_code;
-    std::string data;
+    std::string_view data;
   };
 
+  inline uint32_t module_id() const {
+    return this->header.module_id;
+  }
+  inline const std::string& get_filename() const {
+    return this->filename;
+  }
+  inline const std::string& get_name() const {
+    return this->name;
+  }
+  inline const RELHeader& get_header() const {
+    return this->header;
+  }
+  inline const std::vector<Section>& get_sections() const {
+    return this->sections;
+  }
+  // Keyed by the module ID that the relocations refer to (0 is the DOL)
+  inline const std::unordered_map<uint32_t, std::vector<RELRelocationInstruction>>& get_import_table() const {
+    return this->import_table;
+  }
+
+private:
+  void parse(const void* data, size_t size);
+
+  const std::string filename;
+
+  // Section data points into one of these
+  std::shared_ptr<const MappedFile> file;
+  std::shared_ptr<const std::string> owned_data;
+
   std::string name;
   std::vector<Section> sections;
   RELHeader header;
@@ -0,0 +1,291 @@
+#include "RELLinker.hh"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <phosg/Encoding.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <stdexcept>
+
+#include "../ParallelTasks.hh"
+
+using namespace std;
+
+
+
+void RELLinker::add_dol(shared_ptr<const DOLFile> dol) {
+  if (this->dol) {
+    throw logic_error("a DOL has already been added");
+  }
+  this->dol = dol;
+}
+
+void RELLinker::add_module(shared_ptr<const RELFile> rel) {
+  if (rel->module_id() == 0) {
+    throw invalid_argument("REL module ID 0 is reserved for the DOL");
+  }
+  for (const auto& other : this->modules) {
+    if (other->module_id() == rel->module_id()) {
+      throw invalid_argument(string_printf(
+          "duplicate REL module ID %08" PRIX32, rel->module_id()));
+    }
+  }
+  this->modules.emplace_back(rel);
+}
+
+static string module_name_for_filename(const string& filename) {
+  size_t slash_pos = filename.rfind('/');
+  string ret = (slash_pos == string::npos) ? filename : filename.substr(slash_pos + 1);
+  size_t dot_pos = ret.rfind('.');
+  if ((dot_pos != string::npos) && (dot_pos > 0)) {
+    ret.resize(dot_pos);
+  }
+  return ret;
+}
+
+RELLinker::LinkStats RELLinker::link(
+    shared_ptr<MemoryContext> mem, const Options& options) {
+  LinkStats stats;
+  stats.num_modules = this->modules.size();
+  uint64_t start_time = now();
+
+  if (this->dol) {
+    this->dol->load_into(mem);
+  }
+
+  // Lay out every module's sections and BSS in one block of memory, and get
+  // host pointers to them. The host pointers are used during relocation so the
+  // worker threads don't have to call MemoryContext::at (which isn't
+  // thread-safe, since it updates a cache).
+  this->module_infos.clear();
+  this->module_index_for_id.clear();
+  vector<vector<uint8_t*>> section_host_addrs(this->modules.size());
+  for (size_t module_index = 0; module_index < this->modules.size(); module_index++) {
+    const auto& rel = this->modules[module_index];
+    const auto& header = rel->get_header();
+    const auto& sections = rel->get_sections();
+
+    uint32_t alignment = (header.format_version > 1) ? header.alignment.load() : 0x20;
+    uint32_t bss_alignment = (header.format_version > 1) ? header.bss_alignment.load() : 0x20;
+    alignment = max<uint32_t>(alignment, 4);
+    bss_alignment = max<uint32_t>(bss_alignment, 4);
+    if ((alignment & (alignment - 1)) || (bss_alignment & (bss_alignment - 1))) {
+      throw runtime_error(string_printf(
+          "REL module %08" PRIX32 " has an invalid alignment", rel->module_id()));
+    }
+
+    // Sections with data come first (in order), then sections without data
+    // (BSS), as OSLink lays them out
+    vector<uint32_t> section_offsets(sections.size(), 0);
+    uint64_t size = 0;
+    for (size_t pass = 0; pass < 2; pass++) {
+      uint32_t pass_alignment = pass ? bss_alignment : alignment;
+      for (const auto& sec : sections) {
+        if ((sec.size == 0) || ((sec.offset == 0) != (pass == 1))) {
+          continue;
+        }
+        size = (size + pass_alignment - 1) & ~static_cast<uint64_t>(pass_alignment - 1);
+        section_offsets[sec.index] = size;
+        size += sec.size;
+      }
+    }
+    if (size > options.max_address - options.min_address) {
+      throw runtime_error(string_printf(
+          "REL module %08" PRIX32 " is too large", rel->module_id()));
+    }
+
+    uint32_t base_addr = 0;
+    if (size) {
+      uint32_t block_alignment = max<uint32_t>(alignment, bss_alignment);
+      uint32_t block_addr = mem->allocate_within(
+          options.min_address, options.max_address, size + block_alignment - 1);
+      base_addr = (block_addr + block_alignment - 1) & ~(block_alignment - 1);
+    }
+
+    auto& info = this->module_infos.emplace_back();
+    info.module_id = rel->module_id();
+    info.name = module_name_for_filename(rel->get_filename());
+    info.sections.resize(sections.size(), SectionLocation{0, 0, false});
+    auto& host_addrs = section_host_addrs[module_index];
+    host_addrs.resize(sections.size(), nullptr);
+    for (const auto& sec : sections) {
+      if (sec.size == 0) {
+        continue;
+      }
+      uint32_t addr = base_addr + section_offsets[sec.index];
+      info.sections[sec.index] = SectionLocation{addr, sec.size, sec.has_code};
+      uint8_t* host_addr = mem->at<uint8_t>(addr, sec.size);
+      if (sec.data.empty()) {
+        memset(host_addr, 0, sec.size);
+      } else {
+        memcpy(host_addr, sec.data.data(), min<size_t>(sec.data.size(), sec.size));
+      }
+      host_addrs[sec.index] = host_addr;
+    }
+
+    auto function_addr = [&](uint8_t section_index, uint32_t offset) -> uint32_t {
+      if (section_index == 0) {
+        return 0;
+      }
+      if (section_index >= info.sections.size() || !info.sections[section_index].address) {
+        throw runtime_error(string_printf(
+            "REL module %08" PRIX32 " has a function in a missing section", rel->module_id()));
+      }
+      return info.sections[section_index].address + offset;
+    };
+    info.on_load_addr = function_addr(header.on_load_section, header.on_load_offset);
+    info.on_unload_addr = function_addr(header.on_unload_section, header.on_unload_offset);
+    info.on_missing_addr = function_addr(header.on_missing_section, header.on_missing_offset);
+    if (info.on_load_addr) {
+      mem->set_symbol_addr(info.name + "_on_load", info.on_load_addr);
+    }
+    if (info.on_unload_addr) {
+      mem->set_symbol_addr(info.name + "_on_unload", info.on_unload_addr);
+    }
+    if (info.on_missing_addr) {
+      mem->set_symbol_addr(info.name + "_on_missing", info.on_missing_addr);
+    }
+
+    this->module_index_for_id.emplace(info.module_id, module_index);
+  }
+
+  uint64_t layout_end_time = now();
+  stats.layout_usecs = layout_end_time - start_time;
+
+  vector<pair<size_t, size_t>> results(this->modules.size());
+  run_parallel_tasks(this->modules.size(), options.num_threads, [&](size_t module_index, FILE*) -> void {
+    results[module_index] = this->relocate_module(module_index, section_host_addrs[module_index]);
+  });
+  for (const auto& result : results) {
+    stats.num_relocations += result.first;
+    stats.num_unresolved_relocations += result.second;
+  }
+
+  stats.relocation_usecs = now() - layout_end_time;
+  return stats;
+}
+
+const RELLinker::ModuleInfo& RELLinker::get_module(uint32_t module_id) const {
+  return this->module_infos.at(this->module_index_for_id.at(module_id));
+}
+
+uint32_t RELLinker::resolve(uint32_t module_id, uint8_t section_index, uint32_t offset) const {
+  if (module_id == 0) {
+    return offset;
+  }
+  const auto& info = this->get_module(module_id);
+  if (section_index >= info.sections.size() || !info.sections[section_index].address) {
+    throw out_of_range(string_printf(
+        "REL module %08" PRIX32 " does not have section %02hhX", module_id, section_index));
+  }
+  return info.sections[section_index].address + offset;
+}
+
+pair<size_t, size_t> RELLinker::relocate_module(
+    size_t module_index, const vector<uint8_t*>& section_host_addrs) const {
+  const auto& rel = this->modules[module_index];
+  const auto& info = this->module_infos[module_index];
+
+  size_t num_applied = 0;
+  size_t num_unresolved = 0;
+  for (const auto& imp_it : rel->get_import_table()) {
+    uint32_t from_module_id = imp_it.first;
+    if ((from_module_id != 0) && !this->module_index_for_id.count(from_module_id)) {
+      num_unresolved += imp_it.second.size();
+      continue;
+    }
+    if ((from_module_id == 0) && !this->dol) {
+      num_unresolved += imp_it.second.size();
+      continue;
+    }
+
+    size_t current_section = 0;
+    uint32_t offset = 0;
+    for (const auto& inst : imp_it.second) {
+      offset += inst.offset;
+
+      size_t patch_size;
+      switch (inst.type) {
+        case RELRelocationInstruction::Type::NONE:
+        case RELRelocationInstruction::Type::NOP:
+          continue;
+        case RELRelocationInstruction::Type::SECTION:
+          current_section = inst.section_index;
+          offset = 0;
+          continue;
+        case RELRelocationInstruction::Type::STOP:
+          throw logic_error("STOP instruction in parsed relocation table");
+        case RELRelocationInstruction::Type::ADDR16:
+        case RELRelocationInstruction::Type::ADDR16L:
+        case RELRelocationInstruction::Type::ADDR16H:
+        case RELRelocationInstruction::Type::ADDR16S:
+          patch_size = 2;
+          break;
+        case RELRelocationInstruction::Type::ADDR32:
+        case RELRelocationInstruction::Type::ADDR24:
+        case RELRelocationInstruction::Type::ADDR14:
+        case RELRelocationInstruction::Type::ADDR14T:
+        case RELRelocationInstruction::Type::ADDR14N:
+        case RELRelocationInstruction::Type::REL24:
+        case RELRelocationInstruction::Type::REL14:
+          patch_size = 4;
+          break;
+        default:
+          throw runtime_error(string_printf(
+              "REL module %08" PRIX32 " has unknown relocation type %02hhX",
+              info.module_id, static_cast<uint8_t>(inst.type)));
+      }
+
+      if ((current_section >= section_host_addrs.size()) ||
+          !section_host_addrs[current_section] ||
+          (static_cast<uint64_t>(offset) + patch_size > info.sections[current_section].size)) {
+        throw out_of_range(string_printf(
+            "REL module %08" PRIX32 " has a relocation outside of its sections (%02zX:%08" PRIX32 ")",
+            info.module_id, current_section, offset));
+      }
+      uint8_t* host_addr = section_host_addrs[current_section] + offset;
+      uint32_t patch_addr = info.sections[current_section].address + offset;
+      uint32_t target = this->resolve(from_module_id, inst.section_index, inst.symbol_offset);
+
+      auto* p16 = reinterpret_cast<be_uint16_t*>(host_addr);
+      auto* p32 = reinterpret_cast<be_uint32_t*>(host_addr);
+      switch (inst.type) {
+        case RELRelocationInstruction::Type::ADDR32:
+          *p32 = target;
+          break;
+        case RELRelocationInstruction::Type::ADDR24:
+          *p32 = (*p32 & 0xFC000003) | (target & 0x03FFFFFC);
+          break;
+        case RELRelocationInstruction::Type::ADDR16:
+        case RELRelocationInstruction::Type::ADDR16L:
+          *p16 = target & 0xFFFF;
+          break;
+        case RELRelocationInstruction::Type::ADDR16H:
+          *p16 = target >> 16;
+          break;
+        case RELRelocationInstruction::Type::ADDR16S:
+          // The low half is used as a signed immediate (e.g. by addi), so the
+          // high half has to be adjusted if it's negative
+          *p16 = (target + 0x8000) >> 16;
+          break;
+        case RELRelocationInstruction::Type::ADDR14:
+        case RELRelocationInstruction::Type::ADDR14T:
+        case RELRelocationInstruction::Type::ADDR14N:
+          *p32 = (*p32 & 0xFFFF0003) | (target & 0x0000FFFC);
+          break;
+        case RELRelocationInstruction::Type::REL24:
+          *p32 = (*p32 & 0xFC000003) | ((target - patch_addr) & 0x03FFFFFC);
+          break;
+        case RELRelocationInstruction::Type::REL14:
+          *p32 = (*p32 & 0xFFFF0003) | ((target - patch_addr) & 0x0000FFFC);
+          break;
+        default:
+          throw logic_error("unhandled relocation type");
+      }
+      num_applied++;
+    }
+  }
+
+  return make_pair(num_applied, num_unresolved);
+}
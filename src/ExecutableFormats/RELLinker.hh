@@ -0,0 +1,103 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../Emulators/MemoryContext.hh"
+#include "DOLFile.hh"
+#include "RELFile.hh"
+
+
+
+// Loads a DOL executable and a set of REL modules into one MemoryContext and
+// links them, as the GameCube/Wii OSLink function does for each module when
+// it's loaded at runtime.
+//
+// Linking happens in two phases. First, every module's sections and BSS are
+// laid out in memory (on the calling thread), which produces a global index of
+// where each (module ID, section) pair lives; module 0 is the DOL, whose
+// symbols are absolute addresses. Second, each module's import table is
+// applied to its own sections. Since relocations only ever patch the module
+// that contains them, and every relocation target can be found in the index
+// without looking at other modules' data, the modules are relocated in
+// parallel.
+class RELLinker {
+public:
+  struct Options {
+    // Modules are placed in free space in this address range
+    uint32_t min_address = 0x80000000;
+    uint32_t max_address = 0x81800000;
+    // 0 = one thread per core
+    size_t num_threads = 0;
+  };
+
+  struct SectionLocation {
+    uint32_t address;
+    uint32_t size;
+    bool has_code;
+  };
+
+  struct ModuleInfo {
+    uint32_t module_id;
+    std::string name; // The module's internal name, or its filename
+    // Indexed by section number; sections that don't exist in memory (e.g.
+    // section 0, which is always empty) have address 0
+    std::vector<SectionLocation> sections;
+    // Addresses of the module's prolog/epilog/unresolved functions, or 0 if
+    // the module doesn't have them
+    uint32_t on_load_addr;
+    uint32_t on_unload_addr;
+    uint32_t on_missing_addr;
+  };
+
+  struct LinkStats {
+    size_t num_modules = 0;
+    size_t num_relocations = 0;
+    // Relocations that refer to modules that aren't in the set; these are left
+    // unpatched (OSLink would patch them when the other module is loaded)
+    size_t num_unresolved_relocations = 0;
+    uint64_t layout_usecs = 0;
+    uint64_t relocation_usecs = 0;
+  };
+
+  RELLinker() = default;
+  ~RELLinker() = default;
+
+  // Adds the DOL, whose sections are loaded directly at their addresses when
+  // link() is called. At most one DOL may be added.
+  void add_dol(std::shared_ptr<const DOLFile> dol);
+  // Adds a REL module. Module IDs must be unique and nonzero.
+  void add_module(std::shared_ptr<const RELFile> rel);
+
+  // Loads all the added files into mem and applies their relocations. Symbols
+  // named <module>_on_load, <module>_on_unload, and <module>_on_missing are
+  // also created in mem for each module that has those functions.
+  LinkStats link(std::shared_ptr<MemoryContext> mem, const Options& options);
+
+  // These are only valid after link() returns
+  const ModuleInfo& get_module(uint32_t module_id) const;
+  inline const std::vector<ModuleInfo>& get_modules() const {
+    return this->module_infos;
+  }
+  // Returns the address of the given offset within a section of a loaded
+  // module, as a relocation referring to it would compute. For module 0 (the
+  // DOL), the section is ignored and the offset is returned unchanged.
+  uint32_t resolve(uint32_t module_id, uint8_t section_index, uint32_t offset) const;
+
+private:
+  std::shared_ptr<const DOLFile> dol;
+  std::vector<std::shared_ptr<const RELFile>> modules;
+
+  std::vector<ModuleInfo> module_infos;
+  std::unordered_map<uint32_t, size_t> module_index_for_id;
+
+  // Applies all of the module's relocations, writing through the host
+  // pointers to its sections. Returns the number of relocations applied and
+  // the number that referred to modules not in the set.
+  std::pair<size_t, size_t> relocate_module(size_t module_index,
+      const std::vector<uint8_t*>& section_host_addrs) const;
+};
@@ -0,0 +1,254 @@
+#include "GlyphAtlas.hh"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+using namespace std;
+
+
+
+GlyphAtlas::GlyphAtlas(const ResourceFile::DecodedFontResource& font,
+    uint8_t style_flags)
+  : style_flags(style_flags),
+    ascent(font.max_ascent),
+    descent(font.max_descent),
+    leading(font.leading),
+    first_char(font.first_char),
+    mask_height(font.rect_height),
+    mask_top(-static_cast<ssize_t>(font.max_ascent)) {
+  this->glyphs.resize(font.glyphs.size());
+  for (size_t x = 0; x < font.glyphs.size(); x++) {
+    this->add_glyph(this->glyphs[x], font, font.glyphs[x]);
+  }
+  this->add_glyph(this->missing_glyph, font, font.missing_glyph);
+  // The missing glyph is drawn for nonexistent characters, so it always exists
+  this->missing_glyph.exists = true;
+}
+
+void GlyphAtlas::add_glyph(Glyph& glyph,
+    const ResourceFile::DecodedFontResource& font,
+    const ResourceFile::DecodedFontResource::Glyph& src) {
+  glyph.mask_offset = this->masks.size();
+  glyph.mask_width = 0;
+  glyph.left = 0;
+  glyph.advance = 0;
+  glyph.exists = !((src.offset == -1) && (src.width == 0xFF));
+  if (!glyph.exists) {
+    return;
+  }
+
+  // Collect the glyph's pixels relative to the pen, applying the style's
+  // horizontal transformations as we go
+  bool bold = this->style_flags & ResourceFile::TextStyleFlag::BOLD;
+  bool italic = this->style_flags & ResourceFile::TextStyleFlag::ITALIC;
+  vector<pair<ssize_t, size_t>> points;
+  ssize_t image_left = font.max_kerning + src.offset;
+  for (size_t y = 0; y < this->mask_height; y++) {
+    // Italic text is slanted by one pixel for every two rows above the
+    // baseline (and the other way below it)
+    ssize_t italic_shift = 0;
+    if (italic) {
+      ssize_t distance = this->ascent - 1 - static_cast<ssize_t>(y);
+      italic_shift = (distance >= 0) ? (distance / 2) : -((1 - distance) / 2);
+    }
+    for (size_t x = 0; x < src.bitmap_width; x++) {
+      ssize_t sx = src.bitmap_offset + x;
+      if ((sx >= static_cast<ssize_t>(font.strike.get_width())) ||
+          (y >= font.strike.get_height())) {
+        continue;
+      }
+      // The strike is monochrome, so any non-white pixel is part of a glyph
+      if ((font.strike.read_pixel(sx, y) & 0xFFFFFF00) == 0xFFFFFF00) {
+        continue;
+      }
+      ssize_t px = image_left + x + italic_shift;
+      points.emplace_back(px, y);
+      if (bold) {
+        points.emplace_back(px + 1, y);
+      }
+    }
+  }
+
+  ssize_t advance = src.width;
+  if (bold) {
+    advance++;
+  }
+  if (this->style_flags & ResourceFile::TextStyleFlag::EXTENDED) {
+    advance++;
+  }
+  if (this->style_flags & ResourceFile::TextStyleFlag::CONDENSED) {
+    advance--;
+  }
+  glyph.advance = max<ssize_t>(advance, 0);
+
+  if (points.empty()) {
+    return;
+  }
+  ssize_t min_x = points[0].first;
+  ssize_t max_x = points[0].first;
+  for (const auto& pt : points) {
+    min_x = min<ssize_t>(min_x, pt.first);
+    max_x = max<ssize_t>(max_x, pt.first);
+  }
+  glyph.left = min_x;
+  glyph.mask_width = max_x - min_x + 1;
+  this->masks.resize(this->masks.size() + glyph.mask_width * this->mask_height, 0);
+  for (const auto& pt : points) {
+    this->masks[glyph.mask_offset + pt.second * glyph.mask_width + (pt.first - min_x)] = 0xFF;
+  }
+}
+
+const GlyphAtlas::Glyph& GlyphAtlas::glyph_for_char(uint8_t ch) const {
+  if (ch >= this->first_char) {
+    size_t index = ch - this->first_char;
+    if ((index < this->glyphs.size()) && this->glyphs[index].exists) {
+      return this->glyphs[index];
+    }
+  }
+  return this->missing_glyph;
+}
+
+size_t GlyphAtlas::text_width(const string& text) const {
+  size_t ret = 0;
+  for (uint8_t ch : text) {
+    ret += this->glyph_for_char(ch).advance;
+  }
+  return ret;
+}
+
+struct GlyphAtlas::DrawTarget {
+  uint8_t* data;
+  ssize_t width;
+  ssize_t height;
+  size_t channels;
+
+  explicit DrawTarget(Image& img)
+    : data(reinterpret_cast<uint8_t*>(img.get_data())),
+      width(img.get_width()),
+      height(img.get_height()),
+      channels(img.get_has_alpha() ? 4 : 3) { }
+
+  // Blends color's RGB into the pixel at p with the given coverage (0-0xFF).
+  // If the image has an alpha channel, coverage is also added to it.
+  inline void blend(uint8_t* p, uint32_t color, uint8_t coverage) const {
+    uint8_t rgb[3] = {
+        static_cast<uint8_t>(color >> 24),
+        static_cast<uint8_t>(color >> 16),
+        static_cast<uint8_t>(color >> 8)};
+    if (coverage == 0xFF) {
+      p[0] = rgb[0];
+      p[1] = rgb[1];
+      p[2] = rgb[2];
+      if (this->channels == 4) {
+        p[3] = 0xFF;
+      }
+    } else {
+      for (size_t z = 0; z < this->channels; z++) {
+        uint32_t v = (z < 3 ? rgb[z] : 0xFF) * coverage + p[z] * (0xFF - coverage) + 0x80;
+        p[z] = (v + (v >> 8)) >> 8;
+      }
+    }
+  }
+};
+
+ssize_t GlyphAtlas::draw_text(DrawTarget& target, ssize_t x, ssize_t y,
+    const string& text, uint32_t color) const {
+  uint8_t color_alpha = color & 0xFF;
+  if (color_alpha == 0) {
+    return x + this->text_width(text);
+  }
+
+  ssize_t start_x = x;
+  for (uint8_t ch : text) {
+    const Glyph& glyph = this->glyph_for_char(ch);
+    ssize_t gx = x + glyph.left;
+    ssize_t col_start = max<ssize_t>(0, -gx);
+    ssize_t col_end = min<ssize_t>(glyph.mask_width, target.width - gx);
+    if (col_start < col_end) {
+      for (size_t row = 0; row < this->mask_height; row++) {
+        ssize_t py = y + this->mask_top + row;
+        if ((py < 0) || (py >= target.height)) {
+          continue;
+        }
+        const uint8_t* mask_row = &this->masks[glyph.mask_offset + row * glyph.mask_width];
+        uint8_t* p = target.data + (py * target.width + gx + col_start) * target.channels;
+        for (ssize_t col = col_start; col < col_end; col++, p += target.channels) {
+          uint8_t m = mask_row[col];
+          if (m) {
+            target.blend(p, color, (color_alpha == 0xFF) ? m : ((m * color_alpha + 0x7F) / 0xFF));
+          }
+        }
+      }
+    }
+    x += glyph.advance;
+  }
+
+  // The underline is one pixel below the baseline, under the whole run
+  ssize_t underline_y = y + 1;
+  if ((this->style_flags & ResourceFile::TextStyleFlag::UNDERLINE) &&
+      (underline_y >= 0) && (underline_y < target.height)) {
+    ssize_t line_start = max<ssize_t>(start_x, 0);
+    ssize_t line_end = min<ssize_t>(x, target.width);
+    uint8_t* p = target.data + (underline_y * target.width + line_start) * target.channels;
+    for (ssize_t px = line_start; px < line_end; px++, p += target.channels) {
+      target.blend(p, color, color_alpha);
+    }
+  }
+
+  return x;
+}
+
+ssize_t GlyphAtlas::draw_text(Image& dest, ssize_t x, ssize_t y,
+    const string& text, uint32_t color) const {
+  DrawTarget target(dest);
+  return this->draw_text(target, x, y, text, color);
+}
+
+void GlyphAtlas::draw_text_runs(Image& dest, const vector<TextRun>& runs) const {
+  DrawTarget target(dest);
+  for (const auto& run : runs) {
+    this->draw_text(target, run.x, run.y, run.text, run.color);
+  }
+}
+
+
+
+GlyphAtlasCache::GlyphAtlasCache(ResourceFile& rf) : rf(rf) { }
+
+shared_ptr<const GlyphAtlas> GlyphAtlasCache::get(int16_t font_id,
+    uint16_t size, uint8_t style_flags) {
+  lock_guard<mutex> g(this->lock);
+  auto key = make_tuple(font_id, size, style_flags);
+  auto it = this->atlases.find(key);
+  if (it != this->atlases.end()) {
+    return it->second;
+  }
+
+  // Missing fonts are remembered too, so callers don't have to look them up
+  // again for every string
+  shared_ptr<const GlyphAtlas> atlas;
+  int32_t res_id = static_cast<int32_t>(font_id) * 128 + size;
+  if ((font_id >= 0) && (size > 0) && (size < 128) && (res_id <= 0x7FFF)) {
+    if (this->rf.resource_exists(RESOURCE_TYPE_NFNT, res_id)) {
+      atlas = make_shared<GlyphAtlas>(this->rf.decode_NFNT(res_id), style_flags);
+    } else if (this->rf.resource_exists(RESOURCE_TYPE_FONT, res_id)) {
+      atlas = make_shared<GlyphAtlas>(this->rf.decode_FONT(res_id), style_flags);
+    }
+  }
+  this->atlases.emplace(key, atlas);
+  return atlas;
+}
+
+string GlyphAtlasCache::name_for_font_id(int16_t font_id) {
+  int32_t res_id = static_cast<int32_t>(font_id) * 128;
+  if ((font_id >= 0) && (res_id <= 0x7FFF) &&
+      this->rf.resource_exists(RESOURCE_TYPE_FONT, res_id)) {
+    const auto& name = this->rf.get_resource_metadata(RESOURCE_TYPE_FONT, res_id)->name;
+    if (!name.empty()) {
+      return name;
+    }
+  }
+  const char* standard_name = ::name_for_font_id(font_id);
+  return standard_name ? standard_name : "";
+}
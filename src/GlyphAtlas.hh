@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <phosg/Image.hh>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "ResourceFile.hh"
+
+
+
+// A bitmap font's glyphs, prepared for drawing text. Each glyph is stored as
+// an alpha mask (one byte per pixel) in one shared buffer, with the requested
+// style (a combination of ResourceFile::TextStyleFlag values) already applied.
+// Bold, italic, underline, condensed, and extended are synthesized the way
+// QuickDraw does it; outline and shadow are ignored.
+//
+// Text is given as Mac OS Roman bytes, as it appears in resources. Atlases are
+// not modified after construction, so they can be shared between threads.
+class GlyphAtlas {
+public:
+  GlyphAtlas(const ResourceFile::DecodedFontResource& font, uint8_t style_flags = 0);
+  ~GlyphAtlas() = default;
+
+  struct TextRun {
+    ssize_t x; // Left end of the baseline
+    ssize_t y;
+    std::string text;
+    uint32_t color; // 0xRRGGBBAA
+  };
+
+  inline int16_t get_ascent() const {
+    return this->ascent;
+  }
+  inline int16_t get_descent() const {
+    return this->descent;
+  }
+  inline int16_t get_leading() const {
+    return this->leading;
+  }
+  inline size_t line_height() const {
+    return this->ascent + this->descent + this->leading;
+  }
+  inline uint8_t get_style_flags() const {
+    return this->style_flags;
+  }
+
+  // Returns the horizontal distance the pen moves when drawing text.
+  size_t text_width(const std::string& text) const;
+
+  // Draws text into dest with the left end of its baseline at (x, y), clipped
+  // to dest's bounds, and returns the pen's x position after the last glyph.
+  // Pixels are blended with dest if color's alpha isn't 0xFF.
+  ssize_t draw_text(Image& dest, ssize_t x, ssize_t y, const std::string& text,
+      uint32_t color) const;
+  // Draws several runs of text. This is faster than calling draw_text for each
+  // one, since dest's pixel layout only needs to be looked up once.
+  void draw_text_runs(Image& dest, const std::vector<TextRun>& runs) const;
+
+private:
+  struct Glyph {
+    size_t mask_offset; // Index of the mask's first byte in masks
+    uint16_t mask_width; // Masks are always mask_height rows tall
+    int16_t left; // Mask's x position relative to the pen
+    uint16_t advance;
+    bool exists;
+  };
+
+  void add_glyph(Glyph& glyph, const ResourceFile::DecodedFontResource& font,
+      const ResourceFile::DecodedFontResource::Glyph& src);
+  const Glyph& glyph_for_char(uint8_t ch) const;
+
+  struct DrawTarget;
+  ssize_t draw_text(DrawTarget& target, ssize_t x, ssize_t y,
+      const std::string& text, uint32_t color) const;
+
+  uint8_t style_flags;
+  int16_t ascent;
+  int16_t descent;
+  int16_t leading;
+  uint16_t first_char;
+  size_t mask_height;
+  ssize_t mask_top; // Masks' top row relative to the baseline
+  std::vector<Glyph> glyphs; // Index 0 is first_char
+  Glyph missing_glyph;
+  std::vector<uint8_t> masks;
+};
+
+// Builds glyph atlases for the fonts in a ResourceFile on demand, and keeps
+// them for the cache's lifetime. This class is thread-safe, though the
+// ResourceFile must not be modified while it's in use.
+class GlyphAtlasCache {
+public:
+  explicit GlyphAtlasCache(ResourceFile& rf);
+  ~GlyphAtlasCache() = default;
+
+  // Returns the atlas for the given font family and size, or nullptr if the
+  // ResourceFile has no bitmap font for them. The font is found the way the
+  // classic Font Manager finds it: NFNT or FONT ID (font_id * 128) + size.
+  std::shared_ptr<const GlyphAtlas> get(int16_t font_id, uint16_t size,
+      uint8_t style_flags = 0);
+
+  // Returns the font family's name. If the ResourceFile has a family name
+  // resource (a FONT with size 0) it is used; otherwise, this returns the
+  // same thing as name_for_font_id.
+  std::string name_for_font_id(int16_t font_id);
+
+private:
+  ResourceFile& rf;
+  std::mutex lock;
+  std::map<std::tuple<int16_t, uint16_t, uint8_t>,
+      std::shared_ptr<const GlyphAtlas>> atlases;
+};
@@ -0,0 +1,55 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Process.hh>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+using namespace std;
+
+
+
+// Runs hypercard_dasm (whose path is passed as the first argument) on a stack
+// file, so it can check options that only affect main()
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: HyperCardDasmTest <path-to-hypercard_dasm>\n");
+    return 1;
+  }
+
+  // The smallest stack hypercard_dasm accepts: a lone STAK block that's all
+  // zeroes after its header, so it has no cards, backgrounds or script
+  StringWriter w;
+  w.put_u32b(0x601); // size
+  w.put_u32b(0x5354414B); // 'STAK'
+  w.put_u32b(0xFFFFFFFF); // id
+  w.extend_to(0x601);
+
+  string filename = string_printf("HyperCardDasmTest-%d.stak", getpid());
+  string out_dir = filename + ".out";
+  save_file(filename, w.str());
+
+  try {
+    fprintf(stderr, "-- --dump-raw-blocks doesn't affect parsing\n");
+    auto result = run_process({argv[1], "--dump-raw-blocks", filename, out_dir}, nullptr, false);
+    if (result.exit_status != 0) {
+      fwritex(stderr, result.stderr_contents);
+    }
+    expect_eq(0, result.exit_status);
+    expect_eq(w.str(), load_file(out_dir + "/STAK_-1_0.bin"));
+    expect(isfile(out_dir + "/stack.txt"));
+
+  } catch (const exception&) {
+    unlink(filename.c_str());
+    unlink(out_dir, true);
+    throw;
+  }
+  unlink(filename.c_str());
+  unlink(out_dir, true);
+
+  printf("HyperCardDasmTest: all tests passed\n");
+  return 0;
+}
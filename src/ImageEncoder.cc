@@ -0,0 +1,206 @@
+#include "ImageEncoder.hh"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+
+
+const char* file_extension_for_image_format(ImageFormat format) {
+  switch (format) {
+    case ImageFormat::BMP:
+      return "bmp";
+    case ImageFormat::PNG:
+      return "png";
+    default:
+      throw invalid_argument("unknown image format");
+  }
+}
+
+ImageFormat image_format_for_name(const string& name) {
+  if (name == "bmp") {
+    return ImageFormat::BMP;
+  } else if (name == "png") {
+    return ImageFormat::PNG;
+  } else {
+    throw invalid_argument("unknown image format: " + name);
+  }
+}
+
+string filename_for_image_format(const string& filename, ImageFormat format) {
+  if ((format == ImageFormat::BMP) || !ends_with(filename, ".bmp")) {
+    return filename;
+  }
+  return filename.substr(0, filename.size() - 3) + file_extension_for_image_format(format);
+}
+
+
+
+static void put_u32b(string& s, uint32_t v) {
+  s.push_back(v >> 24);
+  s.push_back(v >> 16);
+  s.push_back(v >> 8);
+  s.push_back(v);
+}
+
+static void write_png_chunk(string& out, const char* type, const void* data,
+    size_t size) {
+  put_u32b(out, size);
+  size_t crc_start = out.size();
+  out.append(type, 4);
+  if (size) {
+    out.append(reinterpret_cast<const char*>(data), size);
+  }
+  uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(out.data() + crc_start), size + 4);
+  put_u32b(out, crc);
+}
+
+static inline uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
+  int p = static_cast<int>(a) + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if ((pa <= pb) && (pa <= pc)) {
+    return a;
+  }
+  return (pb <= pc) ? b : c;
+}
+
+// Writes the filtered row (including its filter type byte) to out. prev is the
+// previous row's unfiltered data, or null for the first row. If adaptive is
+// true, all five filters are tried and the one with the smallest sum of
+// absolute values is used (the heuristic suggested by the PNG spec); otherwise
+// the row isn't filtered.
+static void filter_png_row(uint8_t* out, const uint8_t* row, const uint8_t* prev,
+    size_t row_bytes, size_t bpp, bool adaptive, vector<uint8_t>& scratch) {
+  if (!adaptive) {
+    out[0] = 0;
+    memcpy(out + 1, row, row_bytes);
+    return;
+  }
+
+  scratch.resize(row_bytes * 5);
+  uint64_t best_score = UINT64_MAX;
+  uint8_t best_filter = 0;
+  for (uint8_t filter = 0; filter < 5; filter++) {
+    uint8_t* dest = &scratch[row_bytes * filter];
+    uint64_t score = 0;
+    for (size_t x = 0; x < row_bytes; x++) {
+      uint8_t a = (x >= bpp) ? row[x - bpp] : 0;
+      uint8_t b = prev ? prev[x] : 0;
+      uint8_t c = (prev && (x >= bpp)) ? prev[x - bpp] : 0;
+      uint8_t v;
+      switch (filter) {
+        case 0:
+          v = row[x];
+          break;
+        case 1:
+          v = row[x] - a;
+          break;
+        case 2:
+          v = row[x] - b;
+          break;
+        case 3:
+          v = row[x] - ((static_cast<uint16_t>(a) + b) >> 1);
+          break;
+        default:
+          v = row[x] - paeth_predictor(a, b, c);
+          break;
+      }
+      dest[x] = v;
+      score += (v < 0x80) ? v : (0x100 - v);
+    }
+    if (score < best_score) {
+      best_score = score;
+      best_filter = filter;
+    }
+  }
+  out[0] = best_filter;
+  memcpy(out + 1, &scratch[row_bytes * best_filter], row_bytes);
+}
+
+static string encode_png(const Image& img, int level) {
+  if ((level < 0) || (level > 9)) {
+    throw invalid_argument("PNG compression level must be between 0 and 9");
+  }
+  size_t w = img.get_width();
+  size_t h = img.get_height();
+  size_t bpp = img.get_has_alpha() ? 4 : 3;
+  size_t row_bytes = w * bpp;
+  const uint8_t* pixels = reinterpret_cast<const uint8_t*>(img.get_data());
+
+  string ret("\x89PNG\r\n\x1A\n", 8);
+
+  string ihdr;
+  put_u32b(ihdr, w);
+  put_u32b(ihdr, h);
+  ihdr.push_back(8); // Bit depth
+  ihdr.push_back(img.get_has_alpha() ? 6 : 2); // Color type (RGBA or RGB)
+  ihdr.push_back(0); // Compression method
+  ihdr.push_back(0); // Filter method
+  ihdr.push_back(0); // Interlace method
+  write_png_chunk(ret, "IHDR", ihdr.data(), ihdr.size());
+
+  // Rows are filtered and compressed one at a time, so the filtered image is
+  // never in memory all at once. The output buffer is allocated at its
+  // maximum possible size up front, so deflate never runs out of space.
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (deflateInit(&z, level) != Z_OK) {
+    throw runtime_error("cannot initialize zlib");
+  }
+  string idat(deflateBound(&z, h * (row_bytes + 1)), '\0');
+  z.next_out = reinterpret_cast<Bytef*>(idat.data());
+  z.avail_out = idat.size();
+
+  bool adaptive = (level >= 4);
+  vector<uint8_t> filtered_row(row_bytes + 1);
+  vector<uint8_t> scratch;
+  for (size_t y = 0; y < h; y++) {
+    const uint8_t* row = pixels + y * row_bytes;
+    const uint8_t* prev = y ? (row - row_bytes) : nullptr;
+    filter_png_row(filtered_row.data(), row, prev, row_bytes, bpp, adaptive, scratch);
+    z.next_in = filtered_row.data();
+    z.avail_in = filtered_row.size();
+    if (deflate(&z, (y == h - 1) ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) {
+      deflateEnd(&z);
+      throw runtime_error("cannot compress image data");
+    }
+  }
+  if (h == 0) {
+    deflate(&z, Z_FINISH);
+  }
+  idat.resize(z.total_out);
+  deflateEnd(&z);
+  write_png_chunk(ret, "IDAT", idat.data(), idat.size());
+
+  write_png_chunk(ret, "IEND", nullptr, 0);
+  return ret;
+}
+
+string encode_image(const Image& img, const ImageEncodingOptions& options) {
+  switch (options.format) {
+    case ImageFormat::BMP:
+      return img.save(Image::Format::WINDOWS_BITMAP);
+    case ImageFormat::PNG:
+      return encode_png(img, options.png_level);
+    default:
+      throw invalid_argument("unknown image format");
+  }
+}
+
+void save_image(const Image& img, const string& filename,
+    const ImageEncodingOptions& options) {
+  if (options.format == ImageFormat::BMP) {
+    img.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
+  } else {
+    save_file(filename, encode_image(img, options));
+  }
+}
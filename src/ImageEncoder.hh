@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <phosg/Image.hh>
+#include <string>
+
+
+
+enum class ImageFormat {
+  BMP = 0,
+  PNG,
+};
+
+struct ImageEncodingOptions {
+  ImageFormat format = ImageFormat::BMP;
+  // zlib compression level for PNGs, from 0 to 9. Level 0 stores the pixel
+  // data uncompressed, which is much faster to write but makes large files;
+  // levels 1-3 also skip the row filters, which cost more time than they save
+  // at low levels.
+  int png_level = 6;
+};
+
+// Returns "bmp" or "png" (without a leading dot).
+const char* file_extension_for_image_format(ImageFormat format);
+// Parses "bmp" or "png"; throws invalid_argument for anything else.
+ImageFormat image_format_for_name(const std::string& name);
+
+// If filename ends in .bmp, returns it with the extension for the given format
+// instead. Other filenames are returned unchanged.
+std::string filename_for_image_format(const std::string& filename,
+    ImageFormat format);
+
+// Encodes an image in the given format. The result is the complete contents of
+// an image file.
+std::string encode_image(const Image& img, const ImageEncodingOptions& options);
+// Encodes an image and writes it to the given file. Throws runtime_error (or
+// phosg's io_error) if the file can't be written.
+void save_image(const Image& img, const std::string& filename,
+    const ImageEncodingOptions& options);
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <phosg/Image.hh>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ImageEncoder.hh"
+
+using namespace std;
+
+
+
+// A gradient with some noise, so that every filter type is useful somewhere
+static Image make_image(size_t w, size_t h, bool has_alpha) {
+  Image img(w, h, has_alpha);
+  uint32_t seed = 1;
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      seed = seed * 1103515245 + 12345;
+      uint8_t noise = (seed >> 16) & 0x0F;
+      img.write_pixel(x, y, (x * 4 + noise) & 0xFF, (y * 3) & 0xFF,
+          ((x ^ y) + noise) & 0xFF, (x + y) & 0xFF);
+    }
+  }
+  return img;
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int p = static_cast<int>(a) + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if ((pa <= pb) && (pa <= pc)) {
+    return a;
+  }
+  return (pb <= pc) ? b : c;
+}
+
+// Parses and decodes a PNG written by encode_image, checking its structure
+// along the way. Returns the unfiltered pixel data; the set of filter types
+// used is returned in filters_used (bit N is set if filter N was used).
+static string decode_png(const string& data, size_t expected_w,
+    size_t expected_h, bool expected_alpha, uint8_t* filters_used) {
+  StringReader r(data);
+  expect_eq(string("\x89PNG\r\n\x1A\n", 8), r.read(8));
+
+  vector<string> chunk_types;
+  string idat;
+  while (!r.eof()) {
+    uint32_t size = r.get_u32b();
+    string type_and_data = r.readx(size + 4);
+    expect_eq(crc32(0, reinterpret_cast<const Bytef*>(type_and_data.data()), type_and_data.size()),
+        r.get_u32b());
+    string type = type_and_data.substr(0, 4);
+    chunk_types.emplace_back(type);
+
+    StringReader chunk_r(type_and_data.data() + 4, size);
+    if (type == "IHDR") {
+      expect_eq(13, size);
+      expect_eq(expected_w, chunk_r.get_u32b());
+      expect_eq(expected_h, chunk_r.get_u32b());
+      expect_eq(8, chunk_r.get_u8()); // Bit depth
+      expect_eq(expected_alpha ? 6 : 2, chunk_r.get_u8()); // Color type
+      expect_eq(0, chunk_r.get_u8()); // Compression method
+      expect_eq(0, chunk_r.get_u8()); // Filter method
+      expect_eq(0, chunk_r.get_u8()); // Interlace method
+    } else if (type == "IDAT") {
+      idat += type_and_data.substr(4);
+    } else if (type == "IEND") {
+      expect_eq(0, size);
+    }
+  }
+  expect_eq(static_cast<size_t>(3), chunk_types.size());
+  expect_eq(string("IHDR"), chunk_types[0]);
+  expect_eq(string("IDAT"), chunk_types[1]);
+  expect_eq(string("IEND"), chunk_types[2]);
+  // The IEND chunk is always the same 12 bytes
+  expect_eq(string("\0\0\0\0IEND\xAE\x42\x60\x82", 12), data.substr(data.size() - 12));
+
+  size_t bpp = expected_alpha ? 4 : 3;
+  size_t row_bytes = expected_w * bpp;
+  string filtered(expected_h * (row_bytes + 1), '\0');
+  uLongf filtered_size = filtered.size();
+  expect_eq(Z_OK, uncompress(reinterpret_cast<Bytef*>(filtered.data()), &filtered_size,
+      reinterpret_cast<const Bytef*>(idat.data()), idat.size()));
+  expect_eq(filtered.size(), filtered_size);
+
+  string ret(expected_h * row_bytes, '\0');
+  *filters_used = 0;
+  for (size_t y = 0; y < expected_h; y++) {
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(&filtered[y * (row_bytes + 1)]);
+    uint8_t* out = reinterpret_cast<uint8_t*>(&ret[y * row_bytes]);
+    const uint8_t* prev = y ? (out - row_bytes) : nullptr;
+    uint8_t filter = in[0];
+    expect(filter < 5);
+    *filters_used |= (1 << filter);
+    for (size_t x = 0; x < row_bytes; x++) {
+      uint8_t a = (x >= bpp) ? out[x - bpp] : 0;
+      uint8_t b = prev ? prev[x] : 0;
+      uint8_t c = (prev && (x >= bpp)) ? prev[x - bpp] : 0;
+      uint8_t v = in[x + 1];
+      switch (filter) {
+        case 0:
+          out[x] = v;
+          break;
+        case 1:
+          out[x] = v + a;
+          break;
+        case 2:
+          out[x] = v + b;
+          break;
+        case 3:
+          out[x] = v + ((static_cast<uint16_t>(a) + b) >> 1);
+          break;
+        default:
+          out[x] = v + paeth(a, b, c);
+          break;
+      }
+    }
+  }
+  return ret;
+}
+
+static void check_png_round_trip(size_t w, size_t h, bool has_alpha, int level) {
+  fprintf(stderr, "-- %zux%zu %s at level %d\n", w, h, has_alpha ? "RGBA" : "RGB", level);
+  Image img = make_image(w, h, has_alpha);
+  ImageEncodingOptions options;
+  options.format = ImageFormat::PNG;
+  options.png_level = level;
+  string png = encode_image(img, options);
+
+  uint8_t filters_used;
+  string pixels = decode_png(png, w, h, has_alpha, &filters_used);
+  expect_eq(img.get_data_size(), pixels.size());
+  expect(!memcmp(img.get_data(), pixels.data(), pixels.size()));
+
+  // Low levels don't filter rows; higher levels choose a filter per row
+  if (level < 4) {
+    expect_eq(1, filters_used);
+  } else if (h > 1) {
+    expect(filters_used != 1);
+  }
+}
+
+int main(int, char**) {
+  for (bool has_alpha : {false, true}) {
+    for (int level : {0, 1, 6, 9}) {
+      check_png_round_trip(37, 23, has_alpha, level);
+    }
+  }
+  check_png_round_trip(1, 1, false, 6);
+
+  fprintf(stderr, "-- invalid compression level\n");
+  {
+    Image img = make_image(4, 4, false);
+    for (int level : {-1, 10}) {
+      ImageEncodingOptions options;
+      options.format = ImageFormat::PNG;
+      options.png_level = level;
+      bool failed = false;
+      try {
+        encode_image(img, options);
+      } catch (const invalid_argument&) {
+        failed = true;
+      }
+      expect(failed);
+    }
+  }
+
+  fprintf(stderr, "-- format names and filenames\n");
+  {
+    expect(ImageFormat::BMP == image_format_for_name("bmp"));
+    expect(ImageFormat::PNG == image_format_for_name("png"));
+    bool failed = false;
+    try {
+      image_format_for_name("gif");
+    } catch (const invalid_argument&) {
+      failed = true;
+    }
+    expect(failed);
+
+    expect_eq(string("a/b_128.png"), filename_for_image_format("a/b_128.bmp", ImageFormat::PNG));
+    expect_eq(string("a/b_128.bmp"), filename_for_image_format("a/b_128.bmp", ImageFormat::BMP));
+    expect_eq(string("a/b_128.txt"), filename_for_image_format("a/b_128.txt", ImageFormat::PNG));
+  }
+
+  printf("ImageEncoderTest: all tests passed\n");
+  return 0;
+}
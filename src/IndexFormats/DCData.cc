@@ -25,16 +25,30 @@ struct ResourceEntry {
   be_int16_t id;
 } __attribute__((packed));
 
-ResourceFile parse_dc_data(const string& data) {
-  StringReader r(data);
+static ResourceFile parse_dc_data(
+    StringReader& r, shared_ptr<const MappedFile> file) {
   const auto& h = r.get<ResourceHeader>();
 
   ResourceFile ret(IndexFormat::DC_DATA);
   for (size_t x = 0; x < h.resource_count; x++) {
     const auto& e = r.get<ResourceEntry>();
-    string data = r.preadx(e.offset, e.size);
-    ret.add(ResourceFile::Resource(e.type, e.id, move(data)));
+    if (file.get()) {
+      ret.add(ResourceFile::Resource(e.type, e.id, 0, "", file, e.offset, e.size));
+    } else {
+      string data = r.preadx(e.offset, e.size);
+      ret.add(ResourceFile::Resource(e.type, e.id, move(data)));
+    }
   }
 
   return ret;
 }
+
+ResourceFile parse_dc_data(const string& data) {
+  StringReader r(data);
+  return parse_dc_data(r, nullptr);
+}
+
+ResourceFile parse_dc_data(shared_ptr<const MappedFile> file) {
+  StringReader r(file->data(), file->size());
+  return parse_dc_data(r, file);
+}
@@ -1,16 +1,80 @@
 #pragma once
 
+#include <memory>
 #include <string>
 
+#include "../MappedFile.hh"
 #include "../ResourceFile.hh"
 
 
 
+// Each format has two parse functions. The string versions copy all resource
+// data into the returned ResourceFile. The MappedFile versions don't copy any
+// resource data until each resource is first accessed via get_resource(); the
+// returned ResourceFile keeps a reference to the MappedFile until then.
+
 ResourceFile parse_resource_fork(const std::string& data);
+ResourceFile parse_resource_fork(std::shared_ptr<const MappedFile> file);
 std::string serialize_resource_fork(const ResourceFile& rf);
+// Writes the same data that serialize_resource_fork returns to fd, without
+// building it all in memory first. Resource data that hasn't been loaded from
+// a MappedFile is written directly from the mapping, so the MappedFile must
+// not refer to the file being written. Returns the number of bytes written.
+size_t write_resource_fork(int fd, const ResourceFile& rf);
+// Writes the same data to filename, computing the layout before the file is
+// modified, so filename is left unchanged if that fails. If atomic is true, the
+// data is written to a temporary file in the same directory, which is then
+// renamed over filename. Paths that refer to a file's resource fork (e.g.
+// file/..namedfork/rsrc) can't be renamed over, so for those, atomic must be
+// false; the file is then overwritten in place and truncated afterward.
+// Unlike write_resource_fork, this works if rf's MappedFile refers to filename
+// when atomic is true. Returns the number of bytes written.
+size_t save_resource_fork(const std::string& filename, const ResourceFile& rf,
+    bool atomic = true);
 
+// The Mohawk and HIRF parsers read only the archive's index (for Mohawk, the
+// type, resource, and file tables; for HIRF, the chain of resource headers),
+// so listing or extracting a few resources from a large archive doesn't touch
+// the rest of the file.
 ResourceFile parse_mohawk(const std::string& data);
+ResourceFile parse_mohawk(std::shared_ptr<const MappedFile> file);
 
 ResourceFile parse_hirf(const std::string& data);
+ResourceFile parse_hirf(std::shared_ptr<const MappedFile> file);
 
 ResourceFile parse_dc_data(const std::string& data);
+ResourceFile parse_dc_data(std::shared_ptr<const MappedFile> file);
+
+// Sidecar indexes are compact binary copies of a parsed index, so large
+// archives can be reopened without parsing their indexes again. Each sidecar
+// has (type, id, flags, name, data offset, and data size) for each resource,
+// and records the source file's size and modification time; a sidecar is only
+// used if both still match. Neither reading nor writing a sidecar reads any
+// resource data from the source file.
+
+// Writes a sidecar for rf, which must have just been parsed from file (which
+// was opened from source_filename). Returns false without writing anything if
+// rf can't be described by a sidecar; this happens if any resource's data
+// isn't a range of file (e.g. because it was already loaded or modified).
+bool write_sidecar_index(
+    const std::string& sidecar_filename,
+    const std::string& source_filename,
+    const ResourceFile& rf,
+    std::shared_ptr<const MappedFile> file);
+// Returns the ResourceFile described by a sidecar. Throws if the sidecar is
+// missing or corrupt, if it's for a different index format, or if
+// source_filename has changed since the sidecar was written.
+ResourceFile parse_sidecar_index(
+    const std::string& sidecar_filename,
+    const std::string& source_filename,
+    std::shared_ptr<const MappedFile> file,
+    IndexFormat expected_format);
+// Parses file in the given format, using the sidecar for source_filename in
+// directory if it's up to date, or parsing the file and writing a new sidecar
+// there if not. Sidecars are named by a hash of the format and
+// source_filename, so one directory can hold sidecars for many files.
+ResourceFile parse_with_sidecar_index(
+    const std::string& directory,
+    const std::string& source_filename,
+    std::shared_ptr<const MappedFile> file,
+    IndexFormat format);
@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <exception>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
@@ -39,9 +40,8 @@ struct HIRFTopLevelResourceHeader {
 
 
 
-ResourceFile parse_hirf(const string& data) {
-  StringReader r(data.data(), data.size());
-
+static ResourceFile parse_hirf(
+    StringReader& r, shared_ptr<const MappedFile> file) {
   const auto& header = r.get<HIRFFileHeader>();
   if (header.magic != 0x4952455A) {
     throw runtime_error("file is not a HIRF archive");
@@ -50,17 +50,43 @@ ResourceFile parse_hirf(const string& data) {
     throw runtime_error("unsupported HIRF version");
   }
 
+  // Only the resource headers are read here; in the MappedFile version, each
+  // resource's data stays in the file until it's accessed. The headers form a
+  // chain, so each one must be after the previous one, or the chain would
+  // never end.
   ResourceFile ret(IndexFormat::HIRF);
   while (!r.eof()) {
+    size_t res_header_offset = r.where();
     const auto& res_header = r.get<HIRFTopLevelResourceHeader>();
     string name = r.read(res_header.name_length);
     uint32_t size = r.get_u32b();
-
-    ResourceFile::Resource res(res_header.type, res_header.id, r.read(size));
-    ret.add(move(res));
-
-    r.go(res_header.next_res_offset);
+    if (size > r.remaining()) {
+      throw out_of_range("resource data extends beyond end of file");
+    }
+
+    if (file.get()) {
+      ret.add(ResourceFile::Resource(
+          res_header.type, res_header.id, 0, move(name), file, r.where(), size));
+    } else {
+      ret.add(ResourceFile::Resource(
+          res_header.type, res_header.id, 0, move(name), r.read(size)));
+    }
+
+    if (res_header.next_res_offset <= res_header_offset) {
+      throw runtime_error("resource chain does not advance");
+    }
+    r.go(min<size_t>(res_header.next_res_offset, r.size()));
   }
 
   return ret;
 }
+
+ResourceFile parse_hirf(const string& data) {
+  StringReader r(data.data(), data.size());
+  return parse_hirf(r, nullptr);
+}
+
+ResourceFile parse_hirf(shared_ptr<const MappedFile> file) {
+  StringReader r(file->data(), file->size());
+  return parse_hirf(r, file);
+}
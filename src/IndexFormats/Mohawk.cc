@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <exception>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
@@ -91,6 +92,12 @@ struct ResourceFileTable {
 
 
 
+struct ResourceDataHeader {
+  be_uint32_t signature;
+  be_uint32_t size;
+  be_uint32_t type;
+} __attribute__((packed));
+
 struct ResourceEntry {
   uint32_t type;
   uint16_t id;
@@ -101,6 +108,46 @@ struct ResourceEntry {
       type(type), id(id), offset(offset), size(size) { }
 };
 
+// Returns the size of each file table entry's data, including its
+// ResourceDataHeader. The file table's sizes are only 24 bits, so they're
+// truncated for resources of 16MB or more. That can only happen if there are
+// at least 16MB between the start of the resource and the next file entry (or
+// the resource directory, or the end of the file), so only for those entries
+// is the size read from the resource's own header instead; for all others,
+// none of the resource bodies have to be read.
+static vector<uint32_t> get_file_entry_sizes(StringReader& r,
+    const ResourceFileTable* file_table, uint32_t file_table_count,
+    uint32_t resource_dir_offset) {
+  vector<uint64_t> boundaries;
+  boundaries.reserve(file_table_count + 2);
+  for (size_t z = 0; z < file_table_count; z++) {
+    boundaries.emplace_back(file_table->entries[z].data_offset);
+  }
+  boundaries.emplace_back(resource_dir_offset);
+  boundaries.emplace_back(r.size());
+  sort(boundaries.begin(), boundaries.end());
+
+  vector<uint32_t> ret;
+  ret.reserve(file_table_count);
+  for (size_t z = 0; z < file_table_count; z++) {
+    const auto& entry = file_table->entries[z];
+    auto next_it = upper_bound(boundaries.begin(), boundaries.end(), entry.data_offset);
+    uint64_t max_size = (next_it == boundaries.end())
+        ? 0 : (*next_it - entry.data_offset);
+    if ((max_size >= 0x1000000) &&
+        (static_cast<uint64_t>(entry.data_offset) + sizeof(ResourceDataHeader) <= r.size())) {
+      // The header's size includes the type field, but not the signature or
+      // the size field itself
+      uint64_t size = static_cast<uint64_t>(
+          r.pget<ResourceDataHeader>(entry.data_offset).size.load()) + 8;
+      ret.emplace_back(min<uint64_t>(size, 0xFFFFFFFF));
+    } else {
+      ret.emplace_back(entry.size());
+    }
+  }
+  return ret;
+}
+
 static vector<ResourceEntry> load_index(StringReader& r) {
   MohawkFileHeader h = r.get<MohawkFileHeader>();
   if (h.signature != 0x4D48574B) {
@@ -118,6 +165,8 @@ static vector<ResourceEntry> load_index(StringReader& r) {
   uint32_t file_table_count = r.pget_u32b(file_table_offset);
   string file_table_data = r.pread(file_table_offset, ResourceFileTable::size_for_count(file_table_count));
   const ResourceFileTable* file_table = reinterpret_cast<ResourceFileTable*>(file_table_data.data());
+  vector<uint32_t> file_entry_sizes = get_file_entry_sizes(
+      r, file_table, file_table_count, h.resource_dir_offset);
 
   vector<ResourceEntry> ret;
   for (size_t type_index = 0; type_index < type_table.count; type_index++) {
@@ -136,7 +185,7 @@ static vector<ResourceEntry> load_index(StringReader& r) {
       }
       const auto& file_entry = file_table->entries[res_entry.file_table_index - 1];
       ret.emplace_back(type_table_entry.type, res_entry.resource_id,
-          file_entry.data_offset, file_entry.size());
+          file_entry.data_offset, file_entry_sizes[res_entry.file_table_index - 1]);
     }
   }
 
@@ -145,29 +194,52 @@ static vector<ResourceEntry> load_index(StringReader& r) {
 
 
 
-struct ResourceDataHeader {
-  be_uint32_t signature;
-  be_uint32_t size;
-  be_uint32_t type;
-} __attribute__((packed));
-
-string get_resource_data(StringReader& r, const ResourceEntry& e) {
-  const auto& h = r.pget<ResourceDataHeader>(e.offset);
-  return r.pread(e.offset + sizeof(ResourceDataHeader), h.size - 4);
+// Returns the offset and size of a resource's data, without its
+// ResourceDataHeader. This uses the sizes from get_file_entry_sizes, so the
+// index can be parsed without touching most of the resource bodies; for large
+// archives (e.g. Myst and Riven) reading every header would mean faulting in a
+// page per resource, scattered over hundreds of megabytes. The file table size
+// includes the header, so for well-formed archives this is the same as the
+// header's size field minus 4. Like pread, this truncates the data if it extends beyond the
+// end of the file.
+static pair<size_t, size_t> get_resource_data_range(
+    const ResourceEntry& e, size_t file_size) {
+  if ((e.offset > file_size) || (file_size - e.offset < sizeof(ResourceDataHeader)) ||
+      (e.size < sizeof(ResourceDataHeader))) {
+    throw out_of_range("resource data header is out of range");
+  }
+  size_t data_offset = e.offset + sizeof(ResourceDataHeader);
+  size_t data_size = min<size_t>(e.size - sizeof(ResourceDataHeader),
+      file_size - data_offset);
+  return make_pair(data_offset, data_size);
 }
 
 
 
-ResourceFile parse_mohawk(const string& data) {
-  StringReader r(data.data(), data.size());
-
+static ResourceFile parse_mohawk(
+    StringReader& r, shared_ptr<const MappedFile> file) {
   ResourceFile ret(IndexFormat::MOHAWK);
   vector<ResourceEntry> resource_entries = load_index(r);
   for (const auto& e : resource_entries) {
-    string data = get_resource_data(r, e);
-    ResourceFile::Resource res(e.type, e.id, move(data));
-    ret.add(move(res));
+    auto range = get_resource_data_range(e, r.size());
+    if (file.get()) {
+      ret.add(ResourceFile::Resource(
+          e.type, e.id, 0, "", file, range.first, range.second));
+    } else {
+      ResourceFile::Resource res(e.type, e.id, r.pread(range.first, range.second));
+      ret.add(move(res));
+    }
   }
 
   return ret;
 }
+
+ResourceFile parse_mohawk(const string& data) {
+  StringReader r(data.data(), data.size());
+  return parse_mohawk(r, nullptr);
+}
+
+ResourceFile parse_mohawk(shared_ptr<const MappedFile> file) {
+  StringReader r(file->data(), file->size());
+  return parse_mohawk(r, file);
+}
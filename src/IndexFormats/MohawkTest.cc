@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+#include <vector>
+
+#include "Formats.hh"
+
+using namespace std;
+
+
+
+static void write_resource(StringWriter& w, uint32_t type, const string& data) {
+  w.put_u32b(0x44415441); // 'DATA'
+  w.put_u32b(data.size() + 4);
+  w.put_u32b(type);
+  w.write(data);
+}
+
+// Builds an archive with one resource type and one resource per element of
+// datas, with IDs starting at 128. The file table's sizes are 24 bits, like
+// those in real archives.
+static string make_mohawk(uint32_t type, const vector<string>& datas) {
+  StringWriter w;
+  w.put_u32b(0x4D48574B); // 'MHWK'
+  w.put_u32b(0); // remaining_file_size (filled in later)
+  w.put_u32b(0x52535243); // 'RSRC'
+  w.put_u16b(0x0100);
+  w.put_u16b(0);
+  w.put_u32b(0); // file_size (filled in later)
+  w.put_u32b(0); // resource_dir_offset (filled in later)
+  w.put_u16b(0); // file_table_offset (filled in later)
+  w.put_u16b(0);
+
+  vector<uint32_t> offsets;
+  for (const auto& data : datas) {
+    offsets.emplace_back(w.size());
+    write_resource(w, type, data);
+  }
+
+  // Type table, then resource table, then file table
+  uint32_t resource_dir_offset = w.size();
+  w.put_u16b(0); // name_list_offset (unused here)
+  w.put_u16b(1);
+  w.put_u32b(type);
+  w.put_u16b(12); // resource_table_offset
+  w.put_u16b(0); // name_table_offset (unused here)
+  w.put_u16b(datas.size());
+  for (size_t z = 0; z < datas.size(); z++) {
+    w.put_u16b(128 + z);
+    w.put_u16b(z + 1);
+  }
+  uint16_t file_table_offset = w.size() - resource_dir_offset;
+  w.put_u32b(datas.size());
+  for (size_t z = 0; z < datas.size(); z++) {
+    uint32_t size = datas[z].size() + 12;
+    w.put_u32b(offsets[z]);
+    w.put_u16b(size & 0xFFFF);
+    w.put_u8((size >> 16) & 0xFF);
+    w.put_u8(0);
+    w.put_u16b(0);
+  }
+
+  w.pput_u32b(4, w.size() - 8);
+  w.pput_u32b(16, w.size());
+  w.pput_u32b(20, resource_dir_offset);
+  w.pput_u16b(24, file_table_offset);
+  return move(w.str());
+}
+
+int main(int, char**) {
+  fprintf(stderr, "-- small resources\n");
+  {
+    ResourceFile rf = parse_mohawk(make_mohawk(0x54455354, {"abc", "defgh"}));
+    expect_eq(string("abc"), rf.get_resource(0x54455354, 128)->data);
+    expect_eq(string("defgh"), rf.get_resource(0x54455354, 129)->data);
+  }
+
+  fprintf(stderr, "-- resource larger than 16MB\n");
+  {
+    // Its file table size (which only has 24 bits) is 0x124, so the real size
+    // has to come from its header
+    string large_data(0x1000118, 'x');
+    large_data[0] = 'a';
+    large_data.back() = 'z';
+    ResourceFile rf = parse_mohawk(make_mohawk(0x54455354, {large_data, "after"}));
+    expect_eq(large_data.size(), rf.get_resource(0x54455354, 128)->data.size());
+    expect(large_data == rf.get_resource(0x54455354, 128)->data);
+    expect_eq(string("after"), rf.get_resource(0x54455354, 129)->data);
+  }
+
+  printf("MohawkTest: all tests passed\n");
+  return 0;
+}
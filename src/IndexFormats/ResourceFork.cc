@@ -1,5 +1,6 @@
 #include "Formats.hh"
 
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -8,8 +9,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <functional>
+#include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <string>
 
@@ -59,16 +64,15 @@ struct ResourceReferenceListEntry {
 
 
 
-ResourceFile parse_resource_fork(const std::string& data) {
+static ResourceFile parse_resource_fork(
+    StringReader& r, shared_ptr<const MappedFile> file) {
   ResourceFile ret(IndexFormat::RESOURCE_FORK);
 
   // If the resource fork is empty, treat it as a valid index with no contents
-  if (data.empty()) {
+  if (r.size() == 0) {
     return ret;
   }
 
-  StringReader r(data.data(), data.size());
-
   const auto& header = r.pget<ResourceForkHeader>(0);
   const auto& map_header = r.pget<ResourceMapHeader>(header.resource_map_offset);
 
@@ -100,30 +104,67 @@ ResourceFile parse_resource_fork(const std::string& data) {
       size_t data_offset = header.resource_data_offset + (ref_entry.attributes_and_offset & 0x00FFFFFF);
       size_t data_size = r.pget_u32b(data_offset);
       uint8_t attributes = (ref_entry.attributes_and_offset >> 24) & 0xFF;
-      string data = r.preadx(data_offset + 4, data_size);
-      ResourceFile::Resource res(
-          type_list_entry.resource_type,
-          ref_entry.resource_id,
-          attributes,
-          name,
-          move(data));
-
-      ret.add(move(res));
+      if (file.get()) {
+        ResourceFile::Resource res(
+            type_list_entry.resource_type,
+            ref_entry.resource_id,
+            attributes,
+            move(name),
+            file,
+            data_offset + 4,
+            data_size);
+        ret.add(move(res));
+
+      } else {
+        string data = r.preadx(data_offset + 4, data_size);
+        ResourceFile::Resource res(
+            type_list_entry.resource_type,
+            ref_entry.resource_id,
+            attributes,
+            name,
+            move(data));
+        ret.add(move(res));
+      }
     }
   }
 
   return ret;
 }
 
+ResourceFile parse_resource_fork(const std::string& data) {
+  StringReader r(data.data(), data.size());
+  return parse_resource_fork(r, nullptr);
+}
 
+ResourceFile parse_resource_fork(shared_ptr<const MappedFile> file) {
+  StringReader r(file->data(), file->size());
+  return parse_resource_fork(r, file);
+}
+
+
+
+// serialize_resource_fork and write_resource_fork both work in two passes.
+// The first pass computes the offset of each resource's data and builds the
+// resource map, which is small; the second pass writes the header, the data,
+// and the map in order. This way, write_resource_fork never has to hold all
+// the resource data in memory at once.
+struct ResourceForkLayout {
+  ResourceForkHeader header;
+  // The map header, type list, reference list, and name list
+  string map_data;
+  // The resources, in the order their data appears in the data segment
+  vector<shared_ptr<const ResourceFile::Resource>> resources;
+};
+
+static ResourceForkLayout compute_resource_fork_layout(const ResourceFile& rf) {
+  ResourceForkLayout layout;
 
-std::string serialize_resource_fork(const ResourceFile& rf) {
   // We currently parse an empty resource fork as a valid resource map with no
   // resources. It seems this is what Mac OS does too, so it should be safe to
   // serialize an empty ResourceFile as an empty string.
   auto all_res_ids = rf.all_resources();
   if (all_res_ids.empty()) {
-    return "";
+    return layout;
   }
 
   // First, count all resources by type
@@ -147,12 +188,15 @@ std::string serialize_resource_fork(const ResourceFile& rf) {
   type_list_w.put_u16b(type_to_count.size() - 1);
   size_t type_list_bytes = 2 + (8 * type_to_count.size());
 
-  StringWriter data_w;
+  // Resource data isn't loaded here; only its size is needed to compute the
+  // layout
+  size_t data_bytes = 0;
   StringWriter names_w;
   StringWriter reflist_w;
   uint64_t current_type = 0xFFFFFFFFFFFFFFFF;
+  layout.resources.reserve(all_res_ids.size());
   for (const auto& it : all_res_ids) {
-    auto res = rf.get_resource(it.first, it.second);
+    auto res = rf.get_resource_metadata(it.first, it.second);
     if (current_type != res->type) {
       current_type = res->type;
       size_t count = type_to_count.at(res->type);
@@ -178,15 +222,15 @@ std::string serialize_resource_fork(const ResourceFile& rf) {
     reflist_entry.resource_id = res->id;
     reflist_entry.reserved = 0;
 
-    if (data_w.size() > 0x00FFFFFF) {
+    if (data_bytes > 0x00FFFFFF) {
       throw runtime_error("resource data segment is too large");
     }
-    if (res->data.size() > 0xFFFFFFFF) {
+    size_t data_size = res->data_size();
+    if (data_size > 0xFFFFFFFF) {
       throw runtime_error("resource is too large to serialize");
     }
-    reflist_entry.attributes_and_offset = (res->flags << 24) | data_w.size();
-    data_w.put_u32b(res->data.size());
-    data_w.write(res->data);
+    reflist_entry.attributes_and_offset = (res->flags << 24) | data_bytes;
+    data_bytes += 4 + data_size;
 
     if (!res->name.empty()) {
       reflist_entry.name_offset = names_w.size();
@@ -204,32 +248,23 @@ std::string serialize_resource_fork(const ResourceFile& rf) {
     }
 
     reflist_w.put(reflist_entry);
+    layout.resources.emplace_back(move(res));
   }
 
   if (type_list_w.size() != type_list_bytes) {
     throw logic_error("incorrect amount of data produced for type list");
   }
 
-  StringWriter main_w;
-
-  ResourceForkHeader header;
   // Note that a 112-byte reserved header follows the main header, and a
   // 128-byte application zone follows that, so the minimum offsets in the main
   // header's offset fields are 0x00000100. It's not clear if this rule is
   // enforced at load time by the Resource Manager (and we don't enforce it in
   // the parsing function above) but we'll generate the extra space since it's
   // clearly documented in Inside Macintosh.
-  header.resource_data_offset = 0x100;
-  header.resource_map_offset = data_w.size() + header.resource_data_offset;
-  header.resource_data_size = data_w.size();
-  header.resource_map_size = sizeof(ResourceMapHeader) + type_list_w.size() + reflist_w.size() + names_w.size();
-  main_w.put(header);
-  main_w.extend_to(0x100);
-  main_w.write(data_w.str());
-
-  if (main_w.size() != header.resource_map_offset) {
-    throw logic_error("resource map written at incorrect offset");
-  }
+  layout.header.resource_data_offset = 0x100;
+  layout.header.resource_map_offset = data_bytes + layout.header.resource_data_offset;
+  layout.header.resource_data_size = data_bytes;
+  layout.header.resource_map_size = sizeof(ResourceMapHeader) + type_list_w.size() + reflist_w.size() + names_w.size();
 
   size_t name_list_offset = sizeof(ResourceMapHeader) + type_list_w.size() + reflist_w.size();
   if (name_list_offset > 0xFFFF) {
@@ -243,11 +278,97 @@ std::string serialize_resource_fork(const ResourceFile& rf) {
   map_header.attributes = 0; // TODO: Should this be a specific value?
   map_header.resource_type_list_offset = sizeof(map_header);
   map_header.resource_name_list_offset = name_list_offset;
-  main_w.put(map_header);
 
-  main_w.write(type_list_w.str());
-  main_w.write(reflist_w.str());
-  main_w.write(names_w.str());
+  StringWriter map_w;
+  map_w.put(map_header);
+  map_w.write(type_list_w.str());
+  map_w.write(reflist_w.str());
+  map_w.write(names_w.str());
+  layout.map_data = move(map_w.str());
+
+  return layout;
+}
+
+static void write_resource_fork_layout(const ResourceForkLayout& layout,
+    function<void(const void*, size_t)> write) {
+  if (layout.resources.empty()) {
+    return;
+  }
+
+  static const uint8_t header_padding[0x100 - sizeof(ResourceForkHeader)] = {0};
+  write(&layout.header, sizeof(layout.header));
+  write(header_padding, sizeof(header_padding));
+
+  // Resources that haven't been loaded from a MappedFile are written directly
+  // from the mapping
+  for (const auto& res : layout.resources) {
+    be_uint32_t size = res->data_size();
+    write(&size, sizeof(size));
+    if (res->is_data_loaded()) {
+      write(res->data.data(), res->data.size());
+    } else {
+      write(reinterpret_cast<const uint8_t*>(res->data_source->data()) + res->data_source_offset,
+          res->data_source_size);
+    }
+  }
+
+  write(layout.map_data.data(), layout.map_data.size());
+}
+
+std::string serialize_resource_fork(const ResourceFile& rf) {
+  auto layout = compute_resource_fork_layout(rf);
+  string ret;
+  if (!layout.resources.empty()) {
+    ret.reserve(layout.header.resource_map_offset + layout.header.resource_map_size);
+  }
+  write_resource_fork_layout(layout, [&](const void* data, size_t size) {
+    ret.append(reinterpret_cast<const char*>(data), size);
+  });
+  return ret;
+}
 
-  return main_w.str();
+static size_t write_resource_fork_layout(int fd, const ResourceForkLayout& layout) {
+  size_t bytes_written = 0;
+  write_resource_fork_layout(layout, [&](const void* data, size_t size) {
+    writex(fd, data, size);
+    bytes_written += size;
+  });
+  return bytes_written;
+}
+
+size_t write_resource_fork(int fd, const ResourceFile& rf) {
+  return write_resource_fork_layout(fd, compute_resource_fork_layout(rf));
+}
+
+size_t save_resource_fork(const string& filename, const ResourceFile& rf, bool atomic) {
+  // If the layout can't be computed (e.g. because the map would be too large),
+  // this throws before the file is modified
+  auto layout = compute_resource_fork_layout(rf);
+
+  if (!atomic) {
+    // The existing data isn't truncated until the new data has been written
+    scoped_fd fd(filename, O_WRONLY | O_CREAT, 0644);
+    size_t bytes_written = write_resource_fork_layout(fd, layout);
+    if (ftruncate(fd, bytes_written)) {
+      throw runtime_error("cannot truncate resource fork");
+    }
+    return bytes_written;
+  }
+
+  string temp_filename = string_printf("%s.%d.%zX.tmp", filename.c_str(),
+      getpid(), hash<thread::id>()(this_thread::get_id()));
+  try {
+    size_t bytes_written;
+    {
+      scoped_fd fd(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      bytes_written = write_resource_fork_layout(fd, layout);
+    }
+    if (rename(temp_filename.c_str(), filename.c_str())) {
+      throw runtime_error("cannot rename resource fork into place");
+    }
+    return bytes_written;
+  } catch (const exception&) {
+    unlink(temp_filename.c_str());
+    throw;
+  }
 }
@@ -0,0 +1,224 @@
+#include "Formats.hh"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <functional>
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../ResourceFile.hh"
+
+using namespace std;
+
+
+
+// The sidecar file is a header, followed by one entry per resource, followed
+// by the names of all the resources (each name's offset and size is in its
+// entry). Everything is little-endian except the magic number and resource
+// types, so they're readable in a hex dump.
+struct SidecarIndexHeader {
+  be_uint32_t magic; // 'RSIX'
+  le_uint32_t version; // 2
+  le_uint64_t source_size;
+  le_uint64_t source_mtime_nsec;
+  le_uint32_t index_format; // IndexFormat
+  le_uint32_t resource_count;
+  le_uint64_t names_size;
+} __attribute__((packed));
+
+struct SidecarIndexEntry {
+  be_uint32_t type;
+  le_int16_t id;
+  le_uint16_t flags;
+  le_uint32_t name_offset; // Relative to the start of the names
+  le_uint32_t name_size;
+  le_uint64_t data_offset; // Within the source file
+  le_uint64_t data_size;
+} __attribute__((packed));
+
+static constexpr uint32_t SIDECAR_MAGIC = 0x52534958; // 'RSIX'
+static constexpr uint32_t SIDECAR_VERSION = 1;
+
+static uint64_t fnv1a64(const void* data, size_t size) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  uint64_t hash = 0xCBF29CE484222325;
+  for (size_t z = 0; z < size; z++) {
+    hash = (hash ^ bytes[z]) * 0x00000100000001B3;
+  }
+  return hash;
+}
+
+// Returns the source file's size and modification time (in nanoseconds), or
+// throws cannot_stat_file if it doesn't exist
+static pair<uint64_t, uint64_t> source_file_identity(const string& filename) {
+  struct stat st;
+  if (::stat(filename.c_str(), &st)) {
+    throw cannot_stat_file(filename);
+  }
+  uint64_t mtime_nsec = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  return make_pair(st.st_size, mtime_nsec);
+}
+
+
+
+bool write_sidecar_index(
+    const string& sidecar_filename,
+    const string& source_filename,
+    const ResourceFile& rf,
+    shared_ptr<const MappedFile> file) {
+  string entries_data;
+  string names;
+  size_t resource_count = 0;
+  for (const auto& it : rf.all_resources()) {
+    auto res = rf.get_resource_metadata(it.first, it.second);
+    // Only resources whose data is still exactly a range of the source file
+    // can be described by the sidecar
+    if (res->data_source.get() != file.get()) {
+      return false;
+    }
+
+    SidecarIndexEntry entry;
+    entry.type = res->type;
+    entry.id = res->id;
+    entry.flags = res->flags;
+    entry.name_offset = names.size();
+    entry.name_size = res->name.size();
+    entry.data_offset = res->data_source_offset;
+    entry.data_size = res->data_source_size;
+    entries_data.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+    names += res->name;
+    resource_count++;
+  }
+
+  auto identity = source_file_identity(source_filename);
+  if (identity.first != file->size()) {
+    // The file changed after it was parsed, so the index may not match it
+    return false;
+  }
+
+  SidecarIndexHeader header;
+  header.magic = SIDECAR_MAGIC;
+  header.version = SIDECAR_VERSION;
+  header.source_size = identity.first;
+  header.source_mtime_nsec = identity.second;
+  header.index_format = static_cast<uint32_t>(rf.index_format());
+  header.resource_count = resource_count;
+  header.names_size = names.size();
+
+  // Write to a temporary file and rename it into place, so processes reading
+  // the sidecar never see a partially-written one
+  string temp_filename = string_printf("%s.%d.%zX.tmp", sidecar_filename.c_str(),
+      getpid(), hash<thread::id>()(this_thread::get_id()));
+  try {
+    auto f = fopen_unique(temp_filename, "wb");
+    fwritex(f.get(), &header, sizeof(header));
+    fwritex(f.get(), entries_data);
+    fwritex(f.get(), names);
+    f.reset();
+    if (rename(temp_filename.c_str(), sidecar_filename.c_str())) {
+      throw runtime_error("cannot rename sidecar index into place");
+    }
+  } catch (const exception&) {
+    unlink(temp_filename.c_str());
+    throw;
+  }
+  return true;
+}
+
+ResourceFile parse_sidecar_index(
+    const string& sidecar_filename,
+    const string& source_filename,
+    shared_ptr<const MappedFile> file,
+    IndexFormat expected_format) {
+  MappedFile sidecar(sidecar_filename);
+  StringReader r(sidecar.data(), sidecar.size());
+
+  const auto& header = r.get<SidecarIndexHeader>();
+  if (header.magic != SIDECAR_MAGIC) {
+    throw runtime_error("file is not a sidecar index");
+  }
+  if (header.version != SIDECAR_VERSION) {
+    throw runtime_error(string_printf(
+        "unsupported sidecar index version %" PRIu32, header.version.load()));
+  }
+  if (header.index_format != static_cast<uint32_t>(expected_format)) {
+    throw runtime_error("sidecar index is for a different index format");
+  }
+  auto identity = source_file_identity(source_filename);
+  if ((header.source_size != identity.first) ||
+      (header.source_mtime_nsec != identity.second) ||
+      (header.source_size != file->size())) {
+    throw runtime_error("sidecar index is out of date");
+  }
+
+  size_t names_offset = r.where() + header.resource_count * sizeof(SidecarIndexEntry);
+  StringReader names_r = r.subx(names_offset, header.names_size);
+
+  ResourceFile ret(static_cast<IndexFormat>(header.index_format.load()));
+  for (size_t z = 0; z < header.resource_count; z++) {
+    const auto& entry = r.get<SidecarIndexEntry>();
+    if ((entry.data_offset > file->size()) ||
+        (entry.data_size > file->size() - entry.data_offset)) {
+      throw out_of_range("sidecar index refers to data beyond end of file");
+    }
+    ResourceFile::Resource res(
+        entry.type,
+        entry.id,
+        entry.flags,
+        names_r.preadx(entry.name_offset, entry.name_size),
+        file,
+        entry.data_offset,
+        entry.data_size);
+    ret.add(move(res));
+  }
+  return ret;
+}
+
+ResourceFile parse_with_sidecar_index(
+    const string& directory,
+    const string& source_filename,
+    shared_ptr<const MappedFile> file,
+    IndexFormat format) {
+  string key_str = string_printf("%d:%s", static_cast<int>(format), source_filename.c_str());
+  string sidecar_filename = string_printf("%s/%016" PRIX64 ".rsix",
+      directory.c_str(), fnv1a64(key_str.data(), key_str.size()));
+
+  // A missing, corrupt, or stale sidecar just means the file has to be parsed
+  // again; the sidecar is then replaced
+  try {
+    return parse_sidecar_index(sidecar_filename, source_filename, file, format);
+  } catch (const exception&) { }
+
+  ResourceFile ret;
+  switch (format) {
+    case IndexFormat::RESOURCE_FORK:
+      ret = parse_resource_fork(file);
+      break;
+    case IndexFormat::MOHAWK:
+      ret = parse_mohawk(file);
+      break;
+    case IndexFormat::HIRF:
+      ret = parse_hirf(file);
+      break;
+    case IndexFormat::DC_DATA:
+      ret = parse_dc_data(file);
+      break;
+    default:
+      throw logic_error("invalid index format");
+  }
+
+  // Failing to write the sidecar isn't fatal; the file was still parsed
+  try {
+    write_sidecar_index(sidecar_filename, source_filename, ret, file);
+  } catch (const exception&) { }
+  return ret;
+}
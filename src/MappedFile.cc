@@ -0,0 +1,126 @@
+#include "MappedFile.hh"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <phosg/Filesystem.hh>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+
+
+MappedFile::MappedFile(const string& filename)
+  : map_data(nullptr), map_size(0), mapped(false) {
+  scoped_fd fd(filename, O_RDONLY);
+
+  struct stat st;
+  if (::fstat(fd, &st)) {
+    throw io_error(fd);
+  }
+  this->map_size = st.st_size;
+
+  // mmap() fails for empty files, but they're valid (e.g. an empty resource
+  // fork), so just leave data() as nullptr in that case
+  if (this->map_size == 0) {
+    return;
+  }
+
+  void* map_data = mmap(nullptr, this->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map_data != MAP_FAILED) {
+    this->map_data = map_data;
+    this->mapped = true;
+    // Keep the file open so map_private can make more mappings of it
+    this->fd = move(fd);
+  } else {
+    this->fallback_data.resize(this->map_size);
+    readx(fd, this->fallback_data.data(), this->map_size);
+    this->map_data = this->fallback_data.data();
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (this->mapped) {
+    munmap(const_cast<void*>(this->map_data), this->map_size);
+  }
+}
+
+string MappedFile::read(size_t offset, size_t size) const {
+  if ((offset > this->map_size) || (size > this->map_size - offset)) {
+    throw out_of_range("range extends beyond end of file");
+  }
+  return string(reinterpret_cast<const char*>(this->map_data) + offset, size);
+}
+
+shared_ptr<void> MappedFile::map_private(size_t offset, size_t size,
+    size_t total_size) const {
+  if ((offset > this->map_size) || (size > this->map_size - offset)) {
+    throw out_of_range("range extends beyond end of file");
+  }
+  if (total_size < size) {
+    throw invalid_argument("total size is smaller than range size");
+  }
+  if (!this->mapped || (total_size == 0)) {
+    return nullptr;
+  }
+
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t region_size = (total_size + (page_size - 1)) & ~(page_size - 1);
+
+  // Pages past the end of the range come from an anonymous mapping, since the
+  // file may not extend that far. Reserve the whole region this way first,
+  // then map the file's pages over the beginning of it.
+  void* region = mmap(nullptr, region_size, PROT_READ | PROT_WRITE,
+      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (region == MAP_FAILED) {
+    throw runtime_error("cannot reserve memory for private mapping");
+  }
+
+  if (offset & (page_size - 1)) {
+    // mmap() can only map the file at page-aligned offsets, and the returned
+    // memory always starts on a page boundary, so the range has to be copied
+    memcpy(region, reinterpret_cast<const uint8_t*>(this->map_data) + offset, size);
+  } else {
+    size_t file_region_size = min<size_t>(
+        region_size, (size + (page_size - 1)) & ~(page_size - 1));
+    if (file_region_size && (mmap(region, file_region_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED, this->fd, offset) == MAP_FAILED)) {
+      munmap(region, region_size);
+      throw runtime_error("cannot map file pages");
+    }
+    // The last file page may contain data beyond the range; clear it so the
+    // memory looks as if only the range had been copied there
+    if (size < file_region_size) {
+      memset(reinterpret_cast<uint8_t*>(region) + size, 0, file_region_size - size);
+    }
+  }
+
+  return shared_ptr<void>(region, [region_size](void* p) {
+    munmap(p, region_size);
+  });
+}
+
+bool MappedFile::map_private_at(void* dest, size_t offset, size_t size) const {
+  if ((offset > this->map_size) || (size > this->map_size - offset)) {
+    throw out_of_range("range extends beyond end of file");
+  }
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  if ((reinterpret_cast<uintptr_t>(dest) | offset | size) & (page_size - 1)) {
+    throw invalid_argument("private mapping is not page-aligned");
+  }
+  if (!this->mapped) {
+    return false;
+  }
+  if (size && (mmap(dest, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+      this->fd, offset) == MAP_FAILED)) {
+    throw runtime_error("cannot map file pages");
+  }
+  return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <phosg/Filesystem.hh>
+#include <string>
+
+
+
+// A read-only view of an entire file's contents. The file is memory-mapped if
+// possible; if it can't be mapped (for example, resource forks on some
+// filesystems don't support mmap), its contents are read into memory instead.
+// Index format parsers can use this to avoid copying resource data until it's
+// actually needed; see the parse_* functions in IndexFormats/Formats.hh.
+
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& filename);
+  MappedFile(const MappedFile&) = delete;
+  MappedFile(MappedFile&&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  MappedFile& operator=(MappedFile&&) = delete;
+  ~MappedFile();
+
+  inline const void* data() const {
+    return this->map_data;
+  }
+  inline size_t size() const {
+    return this->map_size;
+  }
+  inline bool is_mapped() const {
+    return this->mapped;
+  }
+
+  // Returns a copy of the given range. Throws out_of_range if any part of the
+  // range is beyond the end of the file.
+  std::string read(size_t offset, size_t size) const;
+
+  // Maps the given range of the file into new private, writable memory and
+  // returns a pointer to the range's first byte. Writes to this memory are
+  // copy-on-write, so they don't affect the file or data(). The returned
+  // pointer is always page-aligned, and the memory is valid for total_size
+  // bytes (which must be at least size) rounded up to the page size; the bytes
+  // after the range are zero, even if the file has more data there. If offset
+  // isn't a multiple of the page size, the file can't be mapped at that offset,
+  // so the range is copied into the memory instead. The memory is unmapped when
+  // the last copy of the returned pointer is destroyed. Returns nullptr if the
+  // file isn't memory-mapped (see is_mapped).
+  std::shared_ptr<void> map_private(size_t offset, size_t size,
+      size_t total_size) const;
+  // Maps the given range of the file over existing memory at dest, replacing
+  // whatever was mapped there, as private copy-on-write pages (as for
+  // map_private). dest, offset, and size must all be multiples of the page
+  // size. The memory stays mapped until the caller unmaps it or maps something
+  // else over it. Returns false without changing anything if the file isn't
+  // memory-mapped; the caller should copy the data from data() instead.
+  bool map_private_at(void* dest, size_t offset, size_t size) const;
+
+private:
+  const void* map_data;
+  size_t map_size;
+  bool mapped;
+  scoped_fd fd; // Only open if mapped is true
+  std::string fallback_data;
+};
@@ -0,0 +1,669 @@
+#include "OutputSink.hh"
+
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+
+
+static uint64_t fnv1a64(const void* data, size_t size) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  uint64_t hash = 0xCBF29CE484222325;
+  for (size_t z = 0; z < size; z++) {
+    hash = (hash ^ bytes[z]) * 0x00000100000001B3;
+  }
+  return hash;
+}
+
+// Returns the raw deflate stream (without a zlib header, as used in zip files)
+// for data, or an empty string if it wouldn't be smaller than data
+static string deflate_if_smaller(const string& data, int level) {
+  if ((level == 0) || data.empty()) {
+    return string();
+  }
+
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw runtime_error("cannot initialize zlib");
+  }
+  string ret(deflateBound(&z, data.size()), '\0');
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  z.avail_in = data.size();
+  z.next_out = reinterpret_cast<Bytef*>(ret.data());
+  z.avail_out = ret.size();
+  int result = deflate(&z, Z_FINISH);
+  size_t compressed_size = z.total_out;
+  deflateEnd(&z);
+  if (result != Z_STREAM_END) {
+    throw runtime_error("cannot compress output");
+  }
+  if (compressed_size >= data.size()) {
+    return string();
+  }
+  ret.resize(compressed_size);
+  return ret;
+}
+
+// Opens filename for writing, or returns stdout (without taking ownership of
+// it) if filename is "-"
+static FILE* open_archive_file(
+    unique_ptr<FILE, fclose_deleter>& owned_file, const string& filename) {
+  if (filename == "-") {
+    return stdout;
+  }
+  owned_file = fopen_unique(filename, "wb");
+  return owned_file.get();
+}
+
+
+
+void OutputSink::ensure_directories_exist(const string&) { }
+
+void OutputSink::close() { }
+
+bool OutputSink::is_file_tree() const {
+  return false;
+}
+
+
+
+void FileTreeOutputSink::ensure_directories_exist(const string& filename) {
+  size_t slash_pos = filename.rfind('/');
+  if ((slash_pos == string::npos) || (slash_pos == 0)) {
+    return;
+  }
+  string parent_dir = filename.substr(0, slash_pos);
+  {
+    lock_guard<mutex> g(this->created_dirs_lock);
+    if (this->created_dirs.count(parent_dir)) {
+      return;
+    }
+  }
+
+  vector<string> tokens = split(parent_dir, '/');
+  string dir;
+  bool first_token = true;
+  for (const string& token : tokens) {
+    if (!first_token) {
+      dir.push_back('/');
+    } else {
+      first_token = false;
+    }
+    dir += token;
+    // dir can be / if filename is an absolute path; just skip it
+    if (dir != "/" && !isdir(dir)) {
+      ::mkdir(dir.c_str(), 0777);
+    }
+  }
+
+  lock_guard<mutex> g(this->created_dirs_lock);
+  this->created_dirs.emplace(move(parent_dir));
+}
+
+void FileTreeOutputSink::write(const string& filename, const string& data) {
+  save_file(filename, data);
+}
+
+bool FileTreeOutputSink::is_file_tree() const {
+  return true;
+}
+
+
+
+void DiscardOutputSink::write(const string&, const string&) { }
+
+
+
+struct TarHeader {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char type;
+  char link_name[100];
+  char magic[6];
+  char version[2];
+  char user_name[32];
+  char group_name[32];
+  char device_major[8];
+  char device_minor[8];
+  char prefix[155];
+  char unused[12];
+} __attribute__((packed));
+
+// Writes value as a zero-padded octal number that fills the field, including
+// its terminating null
+static void set_tar_octal_field(char* field, size_t field_size, uint64_t value) {
+  if (value >> ((field_size - 1) * 3)) {
+    throw runtime_error("value too large for tar header field");
+  }
+  string s = string_printf("%0*" PRIo64, static_cast<int>(field_size - 1), value);
+  memcpy(field, s.data(), field_size - 1);
+  field[field_size - 1] = '\0';
+}
+
+static string tar_header(const string& name, uint64_t size, char type, uint64_t mtime) {
+  TarHeader header;
+  memset(&header, 0, sizeof(header));
+
+  // Names up to 100 bytes fit in the name field. Longer names can be split
+  // across the prefix and name fields at a slash; the caller is responsible
+  // for using an extended header if neither works.
+  if (name.size() <= sizeof(header.name)) {
+    memcpy(header.name, name.data(), name.size());
+  } else {
+    size_t slash_pos = name.rfind('/', sizeof(header.prefix));
+    if ((slash_pos == string::npos) || (name.size() - slash_pos - 1 > sizeof(header.name))) {
+      throw logic_error("tar name is too long for ustar header");
+    }
+    memcpy(header.prefix, name.data(), slash_pos);
+    memcpy(header.name, name.data() + slash_pos + 1, name.size() - slash_pos - 1);
+  }
+
+  set_tar_octal_field(header.mode, sizeof(header.mode), 0644);
+  set_tar_octal_field(header.uid, sizeof(header.uid), 0);
+  set_tar_octal_field(header.gid, sizeof(header.gid), 0);
+  set_tar_octal_field(header.size, sizeof(header.size), size);
+  set_tar_octal_field(header.mtime, sizeof(header.mtime), mtime);
+  header.type = type;
+  memcpy(header.magic, "ustar", 6);
+  memcpy(header.version, "00", 2);
+
+  // The checksum is computed as if the checksum field were all spaces
+  memset(header.checksum, ' ', sizeof(header.checksum));
+  uint32_t checksum = 0;
+  const uint8_t* header_bytes = reinterpret_cast<const uint8_t*>(&header);
+  for (size_t z = 0; z < sizeof(header); z++) {
+    checksum += header_bytes[z];
+  }
+  string checksum_str = string_printf("%06" PRIo32, checksum);
+  memcpy(header.checksum, checksum_str.data(), 6);
+  header.checksum[6] = '\0';
+
+  return string(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+static bool fits_in_ustar_header(const string& name) {
+  if (name.size() <= 100) {
+    return true;
+  }
+  size_t slash_pos = name.rfind('/', 155);
+  return (slash_pos != string::npos) && (name.size() - slash_pos - 1 <= 100);
+}
+
+static void append_tar_padding(string& s) {
+  s.resize((s.size() + 0x1FF) & (~0x1FF), '\0');
+}
+
+TarOutputSink::TarOutputSink(const string& filename)
+  : file(open_archive_file(this->owned_file, filename)),
+    mtime(::time(nullptr)),
+    closed(false) { }
+
+TarOutputSink::~TarOutputSink() {
+  try {
+    this->close();
+  } catch (const exception& e) {
+    fprintf(stderr, "warning: failed to finish tar output: %s\n", e.what());
+  }
+}
+
+void TarOutputSink::write(const string& filename, const string& data) {
+  string header;
+  if (fits_in_ustar_header(filename)) {
+    header = tar_header(filename, data.size(), '0', this->mtime);
+  } else {
+    // Each pax record is "LENGTH path=NAME\n", where LENGTH includes itself,
+    // so its number of digits has to be found by trial
+    size_t record_size = filename.size() + 7; // " path=" and "\n"
+    size_t length = record_size;
+    while (string_printf("%zu", length).size() + record_size != length) {
+      length = string_printf("%zu", length).size() + record_size;
+    }
+    string pax_data = string_printf("%zu path=", length) + filename + "\n";
+    header = tar_header("././@PaxHeader", pax_data.size(), 'x', this->mtime);
+    header += pax_data;
+    append_tar_padding(header);
+    // The ustar name is only used by readers that don't understand pax
+    // headers, so it's just the end of the real name
+    header += tar_header(filename.substr(filename.size() - 100),
+        data.size(), '0', this->mtime);
+  }
+  static const char zeroes[0x200] = {0};
+  size_t padding_size = (0x200 - (data.size() & 0x1FF)) & 0x1FF;
+
+  lock_guard<mutex> g(this->lock);
+  if (this->closed) {
+    throw logic_error("tar output is already closed");
+  }
+  fwritex(this->file, header);
+  fwritex(this->file, data);
+  fwritex(this->file, zeroes, padding_size);
+}
+
+void TarOutputSink::close() {
+  lock_guard<mutex> g(this->lock);
+  if (this->closed) {
+    return;
+  }
+  this->closed = true;
+  // The end of the archive is marked by two empty blocks
+  static const char zeroes[0x400] = {0};
+  fwritex(this->file, zeroes, sizeof(zeroes));
+  if (fflush(this->file)) {
+    throw runtime_error("cannot write tar output");
+  }
+  this->owned_file.reset();
+}
+
+
+
+struct ZipLocalFileHeader {
+  le_uint32_t signature; // 0x04034B50
+  le_uint16_t version_needed;
+  le_uint16_t flags;
+  le_uint16_t method;
+  le_uint16_t mod_time;
+  le_uint16_t mod_date;
+  le_uint32_t crc32;
+  le_uint32_t compressed_size;
+  le_uint32_t uncompressed_size;
+  le_uint16_t filename_size;
+  le_uint16_t extra_size;
+} __attribute__((packed));
+
+struct ZipCentralDirectoryEntry {
+  le_uint32_t signature; // 0x02014B50
+  le_uint16_t version_made_by;
+  le_uint16_t version_needed;
+  le_uint16_t flags;
+  le_uint16_t method;
+  le_uint16_t mod_time;
+  le_uint16_t mod_date;
+  le_uint32_t crc32;
+  le_uint32_t compressed_size;
+  le_uint32_t uncompressed_size;
+  le_uint16_t filename_size;
+  le_uint16_t extra_size;
+  le_uint16_t comment_size;
+  le_uint16_t disk_number;
+  le_uint16_t internal_attributes;
+  le_uint32_t external_attributes;
+  le_uint32_t local_header_offset; // 0xFFFFFFFF if in the zip64 extra field
+} __attribute__((packed));
+
+struct Zip64OffsetExtraField {
+  le_uint16_t header_id; // 0x0001
+  le_uint16_t size; // 8
+  le_uint64_t local_header_offset;
+} __attribute__((packed));
+
+struct Zip64EndOfCentralDirectory {
+  le_uint32_t signature; // 0x06064B50
+  le_uint64_t record_size; // Not including signature or this field
+  le_uint16_t version_made_by;
+  le_uint16_t version_needed;
+  le_uint32_t disk_number;
+  le_uint32_t central_directory_disk_number;
+  le_uint64_t num_entries_on_disk;
+  le_uint64_t num_entries;
+  le_uint64_t central_directory_size;
+  le_uint64_t central_directory_offset;
+} __attribute__((packed));
+
+struct Zip64EndOfCentralDirectoryLocator {
+  le_uint32_t signature; // 0x07064B50
+  le_uint32_t end_disk_number;
+  le_uint64_t end_offset;
+  le_uint32_t num_disks;
+} __attribute__((packed));
+
+struct ZipEndOfCentralDirectory {
+  le_uint32_t signature; // 0x06054B50
+  le_uint16_t disk_number;
+  le_uint16_t central_directory_disk_number;
+  le_uint16_t num_entries_on_disk;
+  le_uint16_t num_entries;
+  le_uint32_t central_directory_size;
+  le_uint32_t central_directory_offset;
+  le_uint16_t comment_size;
+} __attribute__((packed));
+
+// Version 2.0 supports deflate; 4.5 adds zip64. The high byte of
+// version_made_by (3) means Unix, so external_attributes is a Unix mode.
+static constexpr uint16_t ZIP_VERSION_DEFLATE = 20;
+static constexpr uint16_t ZIP_VERSION_ZIP64 = 45;
+static constexpr uint16_t ZIP_VERSION_MADE_BY = 0x0300 | ZIP_VERSION_ZIP64;
+static constexpr uint16_t ZIP_FLAG_UTF8_FILENAME = 0x0800;
+
+ZipOutputSink::ZipOutputSink(const string& filename, int compression_level)
+  : file(open_archive_file(this->owned_file, filename)),
+    compression_level(compression_level),
+    bytes_written(0),
+    num_entries(0),
+    closed(false) {
+  // All entries get the time the archive was created, in local time (since
+  // that's what the format specifies)
+  time_t now = ::time(nullptr);
+  struct tm tm;
+  localtime_r(&now, &tm);
+  this->dos_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec >> 1);
+  this->dos_date = (max<int>(tm.tm_year - 80, 0) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+ZipOutputSink::~ZipOutputSink() {
+  try {
+    this->close();
+  } catch (const exception& e) {
+    fprintf(stderr, "warning: failed to finish zip output: %s\n", e.what());
+  }
+}
+
+void ZipOutputSink::write(const string& filename, const string& data) {
+  if (data.size() >= 0xFFFFFFFF) {
+    throw runtime_error("file too large for zip output");
+  }
+  if (filename.size() > 0xFFFF) {
+    throw runtime_error("filename too long for zip output");
+  }
+
+  string compressed_data = deflate_if_smaller(data, this->compression_level);
+  const string& stored_data = compressed_data.empty() ? data : compressed_data;
+  uint32_t crc = ::crc32(0, reinterpret_cast<const Bytef*>(data.data()), data.size());
+
+  ZipLocalFileHeader header;
+  header.signature = 0x04034B50;
+  header.version_needed = ZIP_VERSION_DEFLATE;
+  header.flags = ZIP_FLAG_UTF8_FILENAME;
+  header.method = compressed_data.empty() ? 0 : 8;
+  header.mod_time = this->dos_time;
+  header.mod_date = this->dos_date;
+  header.crc32 = crc;
+  header.compressed_size = stored_data.size();
+  header.uncompressed_size = data.size();
+  header.filename_size = filename.size();
+  header.extra_size = 0;
+
+  ZipCentralDirectoryEntry entry;
+  entry.signature = 0x02014B50;
+  entry.version_made_by = ZIP_VERSION_MADE_BY;
+  entry.version_needed = ZIP_VERSION_DEFLATE;
+  entry.flags = header.flags;
+  entry.method = header.method;
+  entry.mod_time = header.mod_time;
+  entry.mod_date = header.mod_date;
+  entry.crc32 = crc;
+  entry.compressed_size = header.compressed_size;
+  entry.uncompressed_size = header.uncompressed_size;
+  entry.filename_size = filename.size();
+  entry.comment_size = 0;
+  entry.disk_number = 0;
+  entry.internal_attributes = 0;
+  entry.external_attributes = 0100644 << 16;
+
+  lock_guard<mutex> g(this->lock);
+  if (this->closed) {
+    throw logic_error("zip output is already closed");
+  }
+
+  uint64_t offset = this->bytes_written;
+  fwritex(this->file, &header, sizeof(header));
+  fwritex(this->file, filename);
+  fwritex(this->file, stored_data);
+  this->bytes_written += sizeof(header) + filename.size() + stored_data.size();
+  this->num_entries++;
+
+  if (offset >= 0xFFFFFFFF) {
+    entry.version_needed = ZIP_VERSION_ZIP64;
+    entry.extra_size = sizeof(Zip64OffsetExtraField);
+    entry.local_header_offset = 0xFFFFFFFF;
+  } else {
+    entry.extra_size = 0;
+    entry.local_header_offset = offset;
+  }
+  this->central_directory.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+  this->central_directory += filename;
+  if (offset >= 0xFFFFFFFF) {
+    Zip64OffsetExtraField extra;
+    extra.header_id = 0x0001;
+    extra.size = sizeof(extra) - 4;
+    extra.local_header_offset = offset;
+    this->central_directory.append(reinterpret_cast<const char*>(&extra), sizeof(extra));
+  }
+}
+
+void ZipOutputSink::close() {
+  lock_guard<mutex> g(this->lock);
+  if (this->closed) {
+    return;
+  }
+  this->closed = true;
+
+  uint64_t cd_offset = this->bytes_written;
+  uint64_t cd_size = this->central_directory.size();
+  fwritex(this->file, this->central_directory);
+  this->bytes_written += cd_size;
+  this->central_directory.clear();
+
+  bool use_zip64 = (this->num_entries >= 0xFFFF) ||
+      (cd_offset >= 0xFFFFFFFF) || (cd_size >= 0xFFFFFFFF);
+  if (use_zip64) {
+    Zip64EndOfCentralDirectory end64;
+    end64.signature = 0x06064B50;
+    end64.record_size = sizeof(end64) - 12;
+    end64.version_made_by = ZIP_VERSION_MADE_BY;
+    end64.version_needed = ZIP_VERSION_ZIP64;
+    end64.disk_number = 0;
+    end64.central_directory_disk_number = 0;
+    end64.num_entries_on_disk = this->num_entries;
+    end64.num_entries = this->num_entries;
+    end64.central_directory_size = cd_size;
+    end64.central_directory_offset = cd_offset;
+
+    Zip64EndOfCentralDirectoryLocator locator;
+    locator.signature = 0x07064B50;
+    locator.end_disk_number = 0;
+    locator.end_offset = this->bytes_written;
+    locator.num_disks = 1;
+
+    fwritex(this->file, &end64, sizeof(end64));
+    fwritex(this->file, &locator, sizeof(locator));
+    this->bytes_written += sizeof(end64) + sizeof(locator);
+  }
+
+  // In zip64 archives, these fields are all-ones, so readers look for the
+  // zip64 record instead
+  ZipEndOfCentralDirectory end;
+  end.signature = 0x06054B50;
+  end.disk_number = 0;
+  end.central_directory_disk_number = 0;
+  end.num_entries_on_disk = use_zip64 ? 0xFFFF : this->num_entries;
+  end.num_entries = use_zip64 ? 0xFFFF : this->num_entries;
+  end.central_directory_size = use_zip64 ? 0xFFFFFFFF : cd_size;
+  end.central_directory_offset = use_zip64 ? 0xFFFFFFFF : cd_offset;
+  end.comment_size = 0;
+  fwritex(this->file, &end, sizeof(end));
+  this->bytes_written += sizeof(end);
+
+  if (fflush(this->file)) {
+    throw runtime_error("cannot write zip output");
+  }
+  this->owned_file.reset();
+}
+
+
+
+static constexpr uint32_t PACK_MAGIC = 0x5250414B; // 'RPAK'
+static constexpr uint32_t PACK_VERSION = 1;
+static constexpr uint32_t PACK_FLAG_DEFLATED = 1;
+
+PackOutputSink::PackOutputSink(const string& filename, int compression_level)
+  : compression_level(compression_level),
+    bytes_written(0),
+    num_files(0),
+    closed(false) {
+  if (filename == "-") {
+    throw invalid_argument("pack output can\'t be written to stdout");
+  }
+  this->file = fopen_unique(filename, "w+b");
+
+  PackHeader header;
+  header.magic = PACK_MAGIC;
+  header.version = PACK_VERSION;
+  fwritex(this->file.get(), &header, sizeof(header));
+  this->bytes_written = sizeof(header);
+}
+
+PackOutputSink::~PackOutputSink() {
+  try {
+    this->close();
+  } catch (const exception& e) {
+    fprintf(stderr, "warning: failed to finish pack output: %s\n", e.what());
+  }
+}
+
+void PackOutputSink::write(const string& filename, const string& data) {
+  if (filename.size() > 0xFFFFFFFF) {
+    throw runtime_error("filename too long for pack output");
+  }
+
+  uint64_t hash = fnv1a64(data.data(), data.size());
+  string compressed_data = deflate_if_smaller(data, this->compression_level);
+  const string& stored_data = compressed_data.empty() ? data : compressed_data;
+  uint32_t flags = compressed_data.empty() ? 0 : PACK_FLAG_DEFLATED;
+
+  lock_guard<mutex> g(this->lock);
+  if (this->closed) {
+    throw logic_error("pack output is already closed");
+  }
+
+  // Compression is deterministic, so identical outputs have identical stored
+  // data; comparing that is enough to be sure they're the same
+  const Blob* blob = nullptr;
+  auto its = this->hash_to_blob_index.equal_range(hash);
+  for (auto it = its.first; it != its.second; it++) {
+    const auto& candidate = this->blobs[it->second];
+    if ((candidate.size != data.size()) || (candidate.flags != flags) ||
+        (candidate.stored_size != stored_data.size())) {
+      continue;
+    }
+    fflush(this->file.get());
+    string existing_data = preadx(fileno(this->file.get()),
+        candidate.stored_size, candidate.offset);
+    if (existing_data == stored_data) {
+      blob = &candidate;
+      break;
+    }
+  }
+
+  if (!blob) {
+    fwritex(this->file.get(), stored_data);
+    this->hash_to_blob_index.emplace(hash, this->blobs.size());
+    blob = &this->blobs.emplace_back(Blob{
+        this->bytes_written, stored_data.size(), data.size(), hash, flags});
+    this->bytes_written += stored_data.size();
+  }
+
+  PackIndexEntry entry;
+  entry.offset = blob->offset;
+  entry.stored_size = blob->stored_size;
+  entry.size = blob->size;
+  entry.hash = blob->hash;
+  entry.flags = blob->flags;
+  entry.filename_size = filename.size();
+  this->index.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+  this->index += filename;
+  this->num_files++;
+}
+
+void PackOutputSink::close() {
+  lock_guard<mutex> g(this->lock);
+  if (this->closed) {
+    return;
+  }
+  this->closed = true;
+
+  PackTrailer trailer;
+  trailer.index_offset = this->bytes_written;
+  trailer.num_files = this->num_files;
+  trailer.num_blobs = this->blobs.size();
+  trailer.magic = PACK_MAGIC;
+  trailer.version = PACK_VERSION;
+
+  fwritex(this->file.get(), this->index);
+  fwritex(this->file.get(), &trailer, sizeof(trailer));
+  this->bytes_written += this->index.size() + sizeof(trailer);
+  this->index.clear();
+  if (fflush(this->file.get())) {
+    throw runtime_error("cannot write pack output");
+  }
+  this->file.reset();
+}
+
+
+
+OutputArchiveFormat output_archive_format_for_name(const string& name) {
+  if (name == "files") {
+    return OutputArchiveFormat::FILE_TREE;
+  } else if (name == "tar") {
+    return OutputArchiveFormat::TAR;
+  } else if (name == "zip") {
+    return OutputArchiveFormat::ZIP;
+  } else if (name == "pack") {
+    return OutputArchiveFormat::PACK;
+  } else if (name == "none") {
+    return OutputArchiveFormat::DISCARD;
+  } else {
+    throw invalid_argument("unknown output archive format: " + name);
+  }
+}
+
+const char* file_extension_for_output_archive_format(OutputArchiveFormat format) {
+  switch (format) {
+    case OutputArchiveFormat::FILE_TREE:
+      return "";
+    case OutputArchiveFormat::TAR:
+      return "tar";
+    case OutputArchiveFormat::ZIP:
+      return "zip";
+    case OutputArchiveFormat::PACK:
+      return "pack";
+    case OutputArchiveFormat::DISCARD:
+      return "";
+    default:
+      throw logic_error("invalid output archive format");
+  }
+}
+
+shared_ptr<OutputSink> make_output_sink(OutputArchiveFormat format,
+    const string& filename, int compression_level) {
+  switch (format) {
+    case OutputArchiveFormat::FILE_TREE:
+      return make_shared<FileTreeOutputSink>();
+    case OutputArchiveFormat::TAR:
+      return make_shared<TarOutputSink>(filename);
+    case OutputArchiveFormat::ZIP:
+      return make_shared<ZipOutputSink>(filename, compression_level);
+    case OutputArchiveFormat::PACK:
+      return make_shared<PackOutputSink>(filename, compression_level);
+    case OutputArchiveFormat::DISCARD:
+      return make_shared<DiscardOutputSink>();
+    default:
+      throw logic_error("invalid output archive format");
+  }
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <mutex>
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+
+
+// Destinations for resource_dasm's output files. The default sink writes each
+// output as a file on disk; the others write all the outputs into a single
+// archive file, which is much faster on filesystems where creating files is
+// expensive (e.g. network filesystems and object stores). Filenames are paths
+// separated by slashes, and become the paths of the files within an archive.
+//
+// All sinks may be used from multiple threads at once. Slow work (compressing
+// and hashing the data) happens before the sink's lock is taken, so when
+// outputs are written on several threads (see OutputWriter in resource_dasm),
+// several files can be compressed at once.
+class OutputSink {
+public:
+  virtual ~OutputSink() = default;
+
+  // Creates the directories that contain filename, if needed. Archives don't
+  // have directories, so by default this does nothing.
+  virtual void ensure_directories_exist(const std::string& filename);
+  // Writes a complete file. Throws if it can't be written.
+  virtual void write(const std::string& filename, const std::string& data) = 0;
+  // Finishes writing the output (for archives, this writes the archive's
+  // directory). Nothing may be written after calling this. Calling it more
+  // than once has no effect.
+  virtual void close();
+
+  // Returns true if each output is an ordinary file at its own filename, so it
+  // can be opened, linked to, or read back after it's written.
+  virtual bool is_file_tree() const;
+};
+
+class FileTreeOutputSink : public OutputSink {
+public:
+  FileTreeOutputSink() = default;
+  virtual ~FileTreeOutputSink() = default;
+
+  // This remembers which directories already exist, so each output doesn't
+  // cost a stat() for every path component.
+  virtual void ensure_directories_exist(const std::string& filename);
+  virtual void write(const std::string& filename, const std::string& data);
+  virtual bool is_file_tree() const;
+
+private:
+  std::mutex created_dirs_lock;
+  std::unordered_set<std::string> created_dirs;
+};
+
+// Discards everything written to it. This is used for measuring how long
+// exporting takes without measuring the filesystem too (see resource_dasm_perf).
+class DiscardOutputSink : public OutputSink {
+public:
+  DiscardOutputSink() = default;
+  virtual ~DiscardOutputSink() = default;
+
+  virtual void write(const std::string& filename, const std::string& data);
+};
+
+// Writes a POSIX (pax) tar stream. Paths too long for the ustar header are
+// written with extended headers. If the filename is "-", the stream is written
+// to stdout, so it can be piped directly into another program.
+class TarOutputSink : public OutputSink {
+public:
+  explicit TarOutputSink(const std::string& filename);
+  virtual ~TarOutputSink();
+
+  virtual void write(const std::string& filename, const std::string& data);
+  virtual void close();
+
+private:
+  std::mutex lock;
+  std::unique_ptr<FILE, fclose_deleter> owned_file;
+  FILE* file;
+  uint64_t mtime;
+  bool closed;
+};
+
+// Writes a zip archive. Each file is deflated with the given zlib level (0-9)
+// unless that doesn't make it smaller, in which case it's stored. Zip64
+// records are used when there are too many files or too much data for the
+// original format. If the filename is "-", the archive is written to stdout.
+class ZipOutputSink : public OutputSink {
+public:
+  ZipOutputSink(const std::string& filename, int compression_level);
+  virtual ~ZipOutputSink();
+
+  virtual void write(const std::string& filename, const std::string& data);
+  virtual void close();
+
+private:
+  std::mutex lock;
+  std::unique_ptr<FILE, fclose_deleter> owned_file;
+  FILE* file;
+  int compression_level;
+  uint16_t dos_time;
+  uint16_t dos_date;
+  uint64_t bytes_written;
+  uint64_t num_entries;
+  std::string central_directory;
+  bool closed;
+};
+
+// Writes a content-addressed pack file: the contents of each distinct output
+// are stored only once, no matter how many filenames they're written to, and
+// an index at the end maps filenames to the stored contents. Contents are
+// deflated (like zip entries) if that makes them smaller. Since resources are
+// often duplicated across many files, this can be much smaller than a tar or
+// zip archive. The format is:
+//   PackHeader
+//   Contents of each distinct output, in the order they were first written
+//   For each filename: PackIndexEntry, followed by the filename
+//   PackTrailer
+// Outputs with the same hash are compared byte-for-byte before being shared,
+// so the file is written with random access and can't be written to stdout.
+class PackOutputSink : public OutputSink {
+public:
+  PackOutputSink(const std::string& filename, int compression_level);
+  virtual ~PackOutputSink();
+
+  virtual void write(const std::string& filename, const std::string& data);
+  virtual void close();
+
+  struct PackHeader {
+    be_uint32_t magic; // 'RPAK'
+    le_uint32_t version; // 1
+  } __attribute__((packed));
+  struct PackIndexEntry {
+    le_uint64_t offset; // Of the stored contents, from the start of the file
+    le_uint64_t stored_size;
+    le_uint64_t size; // After inflating, if compressed
+    le_uint64_t hash; // FNV-1a (64-bit) of the uncompressed contents
+    le_uint32_t flags; // 1 = deflated
+    le_uint32_t filename_size;
+  } __attribute__((packed));
+  struct PackTrailer {
+    le_uint64_t index_offset;
+    le_uint64_t num_files;
+    le_uint64_t num_blobs;
+    be_uint32_t magic; // 'RPAK'
+    le_uint32_t version; // 1
+  } __attribute__((packed));
+
+private:
+  struct Blob {
+    uint64_t offset;
+    uint64_t stored_size;
+    uint64_t size;
+    uint64_t hash;
+    uint32_t flags;
+  };
+
+  std::mutex lock;
+  std::unique_ptr<FILE, fclose_deleter> file;
+  int compression_level;
+  uint64_t bytes_written;
+  std::vector<Blob> blobs;
+  std::unordered_multimap<uint64_t, size_t> hash_to_blob_index;
+  std::string index;
+  uint64_t num_files;
+  bool closed;
+};
+
+enum class OutputArchiveFormat {
+  FILE_TREE = 0,
+  TAR,
+  ZIP,
+  PACK,
+  DISCARD,
+};
+
+// Parses "files", "tar", "zip", "pack", or "none" (DISCARD); throws
+// invalid_argument for anything else.
+OutputArchiveFormat output_archive_format_for_name(const std::string& name);
+// Returns "tar", "zip", or "pack" (without a leading dot), or an empty string
+// for FILE_TREE and DISCARD.
+const char* file_extension_for_output_archive_format(OutputArchiveFormat format);
+
+// Creates a sink of the given format. For FILE_TREE the filename is ignored,
+// since outputs are written to their own filenames; for DISCARD it's also
+// ignored, since nothing is written.
+std::shared_ptr<OutputSink> make_output_sink(OutputArchiveFormat format,
+    const std::string& filename, int compression_level = 6);
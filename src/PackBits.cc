@@ -0,0 +1,122 @@
+#include "PackBits.hh"
+
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+
+
+// Decodes one row. The row's segments are read until the input position
+// reaches src_end (as in QuickDraw, a segment may extend past it; the next
+// row begins wherever the last segment ended). Returns the position after the
+// row, or null if the row is invalid or doesn't decode to exactly dest_size
+// bytes.
+static const uint8_t* unpack_bits_row(uint8_t* dest, size_t dest_size,
+    const uint8_t* src, const uint8_t* src_end, const uint8_t* src_limit,
+    bool chunks_are_words) {
+  size_t offset = 0;
+  size_t unit = chunks_are_words ? 2 : 1;
+  while (src < src_end) {
+    int8_t count = static_cast<int8_t>(*(src++));
+    if (count < 0) { // RLE segment
+      size_t bytes = static_cast<size_t>(1 - count) * unit;
+      if ((dest_size - offset < bytes) || (static_cast<size_t>(src_limit - src) < unit)) {
+        return nullptr;
+      }
+      if (chunks_are_words) {
+        fill_word_run(dest + offset, (src[0] << 8) | src[1], 1 - count);
+      } else {
+        memset(dest + offset, src[0], bytes);
+      }
+      src += unit;
+      offset += bytes;
+    } else { // Direct segment
+      size_t bytes = static_cast<size_t>(count + 1) * unit;
+      if ((dest_size - offset < bytes) || (static_cast<size_t>(src_limit - src) < bytes)) {
+        return nullptr;
+      }
+      copy_literal_run(dest + offset, src, bytes);
+      src += bytes;
+      offset += bytes;
+    }
+  }
+  return (offset == dest_size) ? src : nullptr;
+}
+
+// Decodes up to max_rows rows; returns the number of rows that decoded
+// successfully (stopping at the first failure) and sets *src_pos to the
+// position after the last successful row.
+static size_t unpack_bits_rows_partial(uint8_t* dest, size_t row_bytes,
+    size_t max_rows, const uint8_t* src, const uint8_t* src_limit,
+    bool sizes_are_words, bool chunks_are_words, const uint8_t** src_pos) {
+  size_t y = 0;
+  for (; y < max_rows; y++) {
+    size_t size_bytes = sizes_are_words ? 2 : 1;
+    if (static_cast<size_t>(src_limit - src) < size_bytes) {
+      break;
+    }
+    size_t packed_size = sizes_are_words ? ((src[0] << 8) | src[1]) : src[0];
+    const uint8_t* row_src = src + size_bytes;
+    if (static_cast<size_t>(src_limit - row_src) < packed_size) {
+      break;
+    }
+    const uint8_t* next = unpack_bits_row(dest + y * row_bytes, row_bytes,
+        row_src, row_src + packed_size, src_limit, chunks_are_words);
+    if (!next) {
+      break;
+    }
+    src = next;
+  }
+  *src_pos = src;
+  return y;
+}
+
+size_t unpack_bits_rows(uint8_t* dest, size_t row_bytes, size_t row_count,
+    const void* vsrc, size_t src_size, bool sizes_are_words,
+    bool chunks_are_words) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  const uint8_t* end;
+  size_t rows = unpack_bits_rows_partial(dest, row_bytes, row_count, src,
+      src + src_size, sizes_are_words, chunks_are_words, &end);
+  if (rows != row_count) {
+    throw runtime_error(string_printf(
+        "packed data is invalid on row %zu at offset %zX (with %s row sizes)",
+        rows, static_cast<size_t>(end - src), sizes_are_words ? "16-bit" : "8-bit"));
+  }
+  return end - src;
+}
+
+size_t unpack_bits_rows(uint8_t* dest, size_t row_bytes, size_t row_count,
+    const void* src, size_t src_size, bool chunks_are_words) {
+  // This many rows decoding correctly is enough to choose a size width; the
+  // other width almost never produces exactly the right row lengths that many
+  // times in a row
+  static constexpr size_t DETECTION_ROWS = 4;
+  size_t detection_rows = (row_count < DETECTION_ROWS) ? row_count : DETECTION_ROWS;
+
+  bool preferred_words = (row_bytes > 250);
+  bool first_choice = preferred_words;
+  const uint8_t* src_bytes = reinterpret_cast<const uint8_t*>(src);
+  const uint8_t* end;
+  if (unpack_bits_rows_partial(dest, row_bytes, detection_rows, src_bytes,
+          src_bytes + src_size, preferred_words, chunks_are_words, &end) != detection_rows) {
+    first_choice = !preferred_words;
+  }
+
+  // Rows that were already decoded are decoded again here, but that's only a
+  // few rows, and it keeps this simple
+  string failure_strs[2];
+  for (bool sizes_are_words : {first_choice, !first_choice}) {
+    try {
+      return unpack_bits_rows(dest, row_bytes, row_count, src, src_size,
+          sizes_are_words, chunks_are_words);
+    } catch (const exception& e) {
+      failure_strs[sizes_are_words] = e.what();
+    }
+  }
+  throw runtime_error(string_printf(
+      "failed to unpack data with either byte sizes (%s) or word sizes (%s)",
+      failure_strs[0].c_str(), failure_strs[1].c_str()));
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+
+// Run-length decoding helpers, shared by the PackBits decoder below and other
+// run-length formats (like HyperCard's bitmaps). All of these write into
+// buffers that are already the right size, instead of appending to strings.
+
+// Copies a literal run. Runs in these formats are short (usually well under
+// 128 bytes), so for runs of 16 bytes or more, unaligned 16-byte copies are
+// faster than calling memcpy.
+inline void copy_literal_run(uint8_t* dest, const uint8_t* src, size_t count) {
+#ifdef __SSE2__
+  size_t z = 0;
+  for (; z + 16 <= count; z += 16) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + z),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + z)));
+  }
+  if (z < count) {
+    memcpy(dest + z, src + z, count - z);
+  }
+#else
+  memcpy(dest, src, count);
+#endif
+}
+
+// Writes count copies of the big-endian 16-bit value to dest (count * 2
+// bytes).
+inline void fill_word_run(uint8_t* dest, uint16_t value, size_t count) {
+  uint8_t hi = value >> 8;
+  uint8_t lo = value;
+  if (hi == lo) {
+    memset(dest, hi, count * 2);
+    return;
+  }
+  for (size_t z = 0; z < count; z++) {
+    dest[z * 2] = hi;
+    dest[z * 2 + 1] = lo;
+  }
+}
+
+// Decodes PackBits data (as used in PICTs and pixel maps) with row_count
+// rows, each of which decodes to row_bytes bytes and is preceded by its packed
+// size. If sizes_are_words is true, the sizes are 16-bit; otherwise they're
+// 8-bit. If chunks_are_words is true, runs are made of 16-bit values instead
+// of bytes (as in 16-bit pixel maps). dest must have space for exactly
+// row_bytes * row_count bytes. Returns the number of input bytes used. Throws
+// runtime_error if the data is invalid or a row doesn't decode to exactly
+// row_bytes bytes.
+size_t unpack_bits_rows(uint8_t* dest, size_t row_bytes, size_t row_count,
+    const void* src, size_t src_size, bool sizes_are_words,
+    bool chunks_are_words);
+
+// Same as above, but determines whether the row sizes are 8-bit or 16-bit.
+// Only the first few rows are decoded both ways (and only if the preferred
+// size, which is 16-bit for rows over 250 bytes, doesn't work for them); the
+// rest are then decoded with the size that worked. The whole image is only
+// decoded a second time if the first rows are ambiguous.
+size_t unpack_bits_rows(uint8_t* dest, size_t row_bytes, size_t row_count,
+    const void* src, size_t src_size, bool chunks_are_words);
@@ -0,0 +1,112 @@
+#include "ParallelTasks.hh"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <phosg/Filesystem.hh>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+
+
+static thread_local FILE* active_log_stream = nullptr;
+
+TaskLogScope::TaskLogScope(FILE* stream) : prev_stream(active_log_stream) {
+  active_log_stream = stream;
+}
+
+TaskLogScope::~TaskLogScope() {
+  active_log_stream = this->prev_stream;
+}
+
+FILE* current_task_log_stream() {
+  return active_log_stream ? active_log_stream : stderr;
+}
+
+void run_parallel_tasks(size_t count, size_t num_threads,
+    const function<void(size_t, FILE*)>& fn) {
+  if (num_threads == 0) {
+    num_threads = max<size_t>(thread::hardware_concurrency(), 1);
+  }
+  num_threads = min<size_t>(num_threads, count);
+  // If this is itself running as part of a task, the buffered logs go to that
+  // task's log instead of directly to stderr
+  FILE* parent_log_stream = current_task_log_stream();
+  if (num_threads <= 1) {
+    for (size_t z = 0; z < count; z++) {
+      fn(z, parent_log_stream);
+    }
+    return;
+  }
+
+  atomic<size_t> next_index(0);
+  atomic<bool> failed(false);
+  mutex output_lock;
+  vector<string> log_contents(count);
+  vector<bool> task_done(count, false);
+  vector<exception_ptr> exceptions(count);
+  size_t next_output_index = 0;
+
+  auto run_worker = [&]() -> void {
+    while (!failed) {
+      size_t index = next_index++;
+      if (index >= count) {
+        break;
+      }
+
+      char* log_data = nullptr;
+      size_t log_size = 0;
+      FILE* log_stream = open_memstream(&log_data, &log_size);
+      if (!log_stream) {
+        exceptions[index] = make_exception_ptr(runtime_error("cannot create log buffer"));
+      } else {
+        try {
+          TaskLogScope log_scope(log_stream);
+          fn(index, log_stream);
+        } catch (...) {
+          exceptions[index] = current_exception();
+        }
+        fclose(log_stream);
+        log_contents[index].assign(log_data, log_size);
+        free(log_data);
+      }
+      if (exceptions[index]) {
+        failed = true;
+      }
+
+      lock_guard<mutex> g(output_lock);
+      task_done[index] = true;
+      while ((next_output_index < count) && task_done[next_output_index]) {
+        fwritex(parent_log_stream, log_contents[next_output_index]);
+        log_contents[next_output_index].clear();
+        next_output_index++;
+      }
+    }
+  };
+
+  vector<thread> threads;
+  for (size_t z = 0; z < num_threads; z++) {
+    threads.emplace_back(run_worker);
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  // Tasks after a failed one may not have run at all, so their logs stop at
+  // the first gap
+  for (; next_output_index < count && task_done[next_output_index]; next_output_index++) {
+    fwritex(parent_log_stream, log_contents[next_output_index]);
+  }
+  for (const auto& e : exceptions) {
+    if (e) {
+      rethrow_exception(e);
+    }
+  }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <functional>
+
+
+
+// While a TaskLogScope exists on a thread, current_task_log_stream returns its
+// stream on that thread. Library code that may run as part of a task (e.g.
+// decoders and decompressors) should write its log output to
+// current_task_log_stream() instead of stderr, so the output stays with the
+// task's buffered log. Scopes may be nested; the innermost one applies.
+class TaskLogScope {
+public:
+  explicit TaskLogScope(FILE* stream);
+  TaskLogScope(const TaskLogScope&) = delete;
+  TaskLogScope(TaskLogScope&&) = delete;
+  TaskLogScope& operator=(const TaskLogScope&) = delete;
+  TaskLogScope& operator=(TaskLogScope&&) = delete;
+  ~TaskLogScope();
+
+private:
+  FILE* prev_stream;
+};
+
+// Returns the current thread's task log stream, or stderr if there's no
+// active scope.
+FILE* current_task_log_stream();
+
+// Calls fn(index, log_stream) for each index in [0, count) on up to
+// num_threads threads (0 means one thread per core). fn should write its log
+// output to log_stream instead of stderr; each call's log output is buffered
+// and written to current_task_log_stream() in index order, so the log is the
+// same as it would be if only one thread were used. (With one thread,
+// log_stream is current_task_log_stream() and nothing is buffered.) Each call
+// runs within a TaskLogScope for its log_stream. If any call throws, no
+// further calls are started, and the exception from the lowest-indexed
+// failing call is rethrown after the running calls finish.
+void run_parallel_tasks(size_t count, size_t num_threads,
+    const std::function<void(size_t, FILE*)>& fn);
@@ -1,24 +1,33 @@
 #include "QuickDrawEngine.hh"
 
 #include <inttypes.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <exception>
+#include <limits>
+#include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Image.hh>
 #include <phosg/Strings.hh>
 #include <phosg/Time.hh>
 #include <phosg/Filesystem.hh>
 #include <stdexcept>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <string>
 
+#include "PackBits.hh"
+#include "ParallelTasks.hh"
 #include "QuickDrawFormats.hh"
+#include "ResourceBudget.hh"
+#include "ScratchArena.hh"
 
 using namespace std;
 
@@ -66,18 +75,167 @@ union PictSubheader {
 
 
 
+void QuickDrawPortInterface::write_span(
+    ssize_t x, ssize_t y, const uint8_t* rgb, size_t count) {
+  for (size_t z = 0; z < count; z++) {
+    this->write_pixel(x + z, y, rgb[z * 3], rgb[z * 3 + 1], rgb[z * 3 + 2]);
+  }
+}
+
+
+
+ImagePort::ImagePort(size_t x, size_t y,
+    function<vector<ColorTableEntry>(int16_t)> clut_resolver)
+  : bounds(0, 0, y, x),
+    clip_region(this->bounds),
+    foreground_color(0xFFFF, 0xFFFF, 0xFFFF),
+    background_color(0x0000, 0x0000, 0x0000),
+    highlight_color(0xFFFF, 0x0000, 0xFFFF), // TODO: use the right color here
+    op_color(0xFFFF, 0xFFFF, 0x0000), // TODO: use the right color here
+    extra_space_nonspace(0),
+    extra_space_space(0, 0),
+    pen_loc(0, 0),
+    pen_loc_frac(0),
+    pen_size(1, 1),
+    pen_mode(0), // TODO
+    pen_visibility(0), // visible
+    text_font(0), // TODO
+    text_mode(0), // TODO
+    text_size(0), // TODO
+    text_style(0),
+    foreground_color_index(0),
+    background_color_index(0),
+    pen_pixel_pattern(0, 0),
+    fill_pixel_pattern(0, 0),
+    background_pixel_pattern(0, 0),
+    pen_mono_pattern(0xFFFFFFFFFFFFFFFF),
+    fill_mono_pattern(0xAA55AA55AA55AA55),
+    background_mono_pattern(0x0000000000000000),
+    clut_resolver(clut_resolver),
+    img(0, 0) {
+  if (x >= 0x10000 || y >= 0x10000) {
+    throw runtime_error("PICT resources cannot specify images larger than 65535x65535");
+  }
+  this->img = Image(x, y);
+}
+
+
+
+QuickDrawEngine::QuickDrawEngine()
+  : port(nullptr),
+    image_port(nullptr),
+    max_render_threads(0),
+    recording(false),
+    display_list_bandable(true) { }
+
 void QuickDrawEngine::set_port(QuickDrawPortInterface* port) {
   this->port = port;
+  this->image_port = dynamic_cast<ImagePort*>(port);
+}
+
+void QuickDrawEngine::set_max_render_threads(size_t max_threads) {
+  this->max_render_threads = max_threads;
 }
 
 
 
-void QuickDrawEngine::write_canvas_pixel(ssize_t x, ssize_t y, uint64_t r,
-    uint64_t g, uint64_t b) {
-  if (!this->port->get_clip_region().contains(x, y) || !this->port->get_bounds().contains(x, y)) {
+QuickDrawEngine::CanvasClip::CanvasClip(QuickDrawPortInterface* port)
+  : bounds(port->get_bounds()),
+    clip_region(port->get_clip_region()),
+    clip_region_is_rect(this->clip_region.scanlines.empty()) { }
+
+const shared_ptr<const QuickDrawEngine::CanvasClip>& QuickDrawEngine::get_current_clip() {
+  if (!this->current_clip.get()) {
+    this->current_clip = make_shared<CanvasClip>(this->port);
+  }
+  return this->current_clip;
+}
+
+void QuickDrawEngine::draw(RasterOp&& op, bool bandable) {
+  if (this->recording) {
+    this->display_list.emplace_back(move(op));
+    this->display_list_bandable &= bandable;
+  } else {
+    op(numeric_limits<ssize_t>::min(), numeric_limits<ssize_t>::max());
+  }
+}
+
+void QuickDrawEngine::render_display_list() {
+  size_t num_threads = this->max_render_threads
+      ? this->max_render_threads : thread::hardware_concurrency();
+  ssize_t height = this->pict_bounds.height();
+  num_threads = min<size_t>(num_threads, (height + 63) / 64);
+
+  if (!this->display_list_bandable || (num_threads <= 1) ||
+      !this->port->supports_concurrent_row_writes()) {
+    for (const auto& op : this->display_list) {
+      op(numeric_limits<ssize_t>::min(), numeric_limits<ssize_t>::max());
+    }
+
+  } else {
+    // Each thread draws every op, but only within its own band, so the ops
+    // are still applied in order within each band
+    mutex exc_lock;
+    exception_ptr exc;
+    vector<thread> threads;
+    for (size_t z = 0; z < num_threads; z++) {
+      ssize_t y1 = this->pict_bounds.y1 + (height * z) / num_threads;
+      ssize_t y2 = this->pict_bounds.y1 + (height * (z + 1)) / num_threads;
+      threads.emplace_back([&, y1, y2]() -> void {
+        try {
+          for (const auto& op : this->display_list) {
+            op(y1, y2);
+          }
+        } catch (...) {
+          lock_guard<mutex> g(exc_lock);
+          if (!exc) {
+            exc = current_exception();
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    if (exc) {
+      rethrow_exception(exc);
+    }
+  }
+  this->display_list.clear();
+}
+
+void QuickDrawEngine::write_canvas_span(const CanvasClip& clip, ssize_t x,
+    ssize_t y, const uint8_t* rgb, size_t count) {
+  if (this->image_port) {
+    this->write_canvas_span_to(this->image_port, clip, x, y, rgb, count);
+  } else {
+    this->write_canvas_span_to(this->port, clip, x, y, rgb, count);
+  }
+}
+
+template <typename PortT>
+void QuickDrawEngine::write_canvas_span_to(PortT* port, const CanvasClip& clip,
+    ssize_t x, ssize_t y, const uint8_t* rgb, size_t count) {
+  // Clip to the bounds and the clip region's rect first; if the clip region is
+  // just a rect, this is all the clipping that's needed
+  ssize_t x1 = max<ssize_t>(x, max<ssize_t>(clip.bounds.x1, clip.clip_region.rect.x1));
+  ssize_t x2 = min<ssize_t>(x + count, min<ssize_t>(clip.bounds.x2, clip.clip_region.rect.x2));
+  if ((x1 >= x2) || (y < clip.bounds.y1) || (y >= clip.bounds.y2) ||
+      (y < clip.clip_region.rect.y1) || (y >= clip.clip_region.rect.y2)) {
     return;
   }
-  this->port->write_pixel(x - this->pict_bounds.x1, y - this->pict_bounds.y1, r, g, b);
+
+  if (clip.clip_region_is_rect) {
+    port->write_span(x1 - this->pict_bounds.x1, y - this->pict_bounds.y1,
+        rgb + (x1 - x) * 3, x2 - x1);
+    return;
+  }
+
+  // Write each run of pixels that's inside the clip region with one call
+  clip.clip_region.for_each_span_in_row(y, x1, x2, [&](ssize_t span_x1, ssize_t span_x2) -> void {
+    port->write_span(span_x1 - this->pict_bounds.x1, y - this->pict_bounds.y1,
+        rgb + (span_x1 - x) * 3, span_x2 - span_x1);
+  });
 }
 
 pair<Pattern, Image> QuickDrawEngine::pict_read_pixel_pattern(StringReader& r) {
@@ -141,6 +299,7 @@ void QuickDrawEngine::pict_unimplemented_opcode(StringReader& r, uint16_t opcode
 void QuickDrawEngine::pict_set_clipping_region(StringReader& r, uint16_t) {
   Region rgn(r);
   this->port->set_clip_region(move(rgn));
+  this->current_clip.reset();
 }
 
 void QuickDrawEngine::pict_set_font_number(StringReader& r, uint16_t) {
@@ -290,25 +449,69 @@ void QuickDrawEngine::pict_set_default_highlight_color(StringReader&, uint16_t)
 
 // Simple shape opcodes
 
-void QuickDrawEngine::pict_fill_current_rect_with_pattern(const Pattern& pat, const Image& pixel_pat) {
-  if (pixel_pat.get_width() && pixel_pat.get_height()) {
-    for (ssize_t y = this->pict_last_rect.y1; y < this->pict_last_rect.y2; y++) {
-      for (ssize_t x = this->pict_last_rect.x1; x < this->pict_last_rect.x2; x++) {
+QuickDrawEngine::PatternSpans::PatternSpans(const Pattern& pat,
+    const Image& pixel_pat, const Rect& pict_bounds, ssize_t x1, ssize_t x2)
+  : x1(x1), width(x2 - x1) {
+  // Expand the pattern to a tile of RGB pixels
+  bool use_pixel_pat = pixel_pat.get_width() && pixel_pat.get_height();
+  size_t tile_width = use_pixel_pat ? pixel_pat.get_width() : 8;
+  this->tile_height = use_pixel_pat ? pixel_pat.get_height() : 8;
+  ssize_t origin_x = use_pixel_pat ? 0 : static_cast<ssize_t>(pict_bounds.x1);
+  this->origin_y = use_pixel_pat ? 0 : static_cast<ssize_t>(pict_bounds.y1);
+  vector<uint8_t> tile(tile_width * this->tile_height * 3);
+  uint8_t* pixel = tile.data();
+  for (size_t y = 0; y < this->tile_height; y++) {
+    for (size_t x = 0; x < tile_width; x++, pixel += 3) {
+      if (use_pixel_pat) {
         uint64_t r, g, b;
-        pixel_pat.read_pixel(x % pixel_pat.get_width(), y % pixel_pat.get_height(), &r, &g, &b);
-        this->write_canvas_pixel(x, y, r, g, b);
+        pixel_pat.read_pixel(x, y, &r, &g, &b);
+        pixel[0] = r;
+        pixel[1] = g;
+        pixel[2] = b;
+      } else {
+        uint8_t value = pat.pixel_at(x, y) ? 0x00 : 0xFF;
+        pixel[0] = value;
+        pixel[1] = value;
+        pixel[2] = value;
       }
     }
-  } else {
-    for (ssize_t y = this->pict_last_rect.y1; y < this->pict_last_rect.y2; y++) {
-      for (ssize_t x = this->pict_last_rect.x1; x < this->pict_last_rect.x2; x++) {
-        uint8_t value = pat.pixel_at(x - this->pict_bounds.x1, y - this->pict_bounds.y1) ? 0x00 : 0xFF;
-        this->write_canvas_pixel(x, y, value, value, value);
-      }
+  }
+
+  // Repeat each tile row across the span, starting at the tile column that
+  // corresponds to x1
+  check_resource_memory(this->width * this->tile_height * 3, "pattern fill");
+  this->rows.resize(this->width * this->tile_height * 3);
+  ssize_t start_tx = (x1 - origin_x) % static_cast<ssize_t>(tile_width);
+  if (start_tx < 0) {
+    start_tx += tile_width;
+  }
+  for (size_t y = 0; y < this->tile_height; y++) {
+    const uint8_t* tile_row = tile.data() + y * tile_width * 3;
+    uint8_t* row = this->rows.data() + y * this->width * 3;
+    size_t tx = start_tx;
+    for (size_t x = 0; x < this->width;) {
+      size_t count = min<size_t>(tile_width - tx, this->width - x);
+      memcpy(row + x * 3, tile_row + tx * 3, count * 3);
+      x += count;
+      tx = 0;
     }
   }
 }
 
+void QuickDrawEngine::pict_fill_current_rect_with_pattern(const Pattern& pat, const Image& pixel_pat) {
+  Rect rect = this->pict_last_rect;
+  if (rect.x2 <= rect.x1) {
+    return;
+  }
+  auto clip = this->get_current_clip();
+  auto spans = make_shared<PatternSpans>(pat, pixel_pat, this->pict_bounds, rect.x1, rect.x2);
+  this->draw([this, rect, spans, clip](ssize_t y1, ssize_t y2) -> void {
+    for (ssize_t y = max<ssize_t>(rect.y1, y1); y < min<ssize_t>(rect.y2, y2); y++) {
+      this->write_canvas_span(*clip, rect.x1, y, spans->row(y, rect.x1), rect.x2 - rect.x1);
+    }
+  });
+}
+
 void QuickDrawEngine::pict_erase_last_rect(StringReader&, uint16_t) {
   this->pict_fill_current_rect_with_pattern(this->port->get_background_mono_pattern(),
       this->port->get_background_pixel_pattern());
@@ -331,22 +534,53 @@ void QuickDrawEngine::pict_fill_rect(StringReader& r, uint16_t opcode) {
 }
 
 void QuickDrawEngine::pict_fill_last_oval(StringReader&, uint16_t) {
-  double x_center = static_cast<double>(this->pict_last_rect.x2 + this->pict_last_rect.x1) / 2.0;
-  double y_center = static_cast<double>(this->pict_last_rect.y2 + this->pict_last_rect.y1) / 2.0;
-  double width = this->pict_last_rect.x2 - this->pict_last_rect.x1;
-  double height = this->pict_last_rect.y2 - this->pict_last_rect.y1;
-  auto fill_pat = this->port->get_fill_mono_pattern();
-  for (ssize_t y = this->pict_last_rect.y1; y < this->pict_last_rect.y2; y++) {
-    for (ssize_t x = this->pict_last_rect.x1; x < this->pict_last_rect.x2; x++) {
-      double x_dist = (static_cast<double>(x) - x_center) / width;
+  Rect rect = this->pict_last_rect;
+  if (rect.x2 <= rect.x1) {
+    return;
+  }
+  auto clip = this->get_current_clip();
+  auto spans = make_shared<PatternSpans>(this->port->get_fill_mono_pattern(),
+      Image(0, 0), this->pict_bounds, rect.x1, rect.x2);
+  this->draw([this, rect, spans, clip](ssize_t y1, ssize_t y2) -> void {
+    double x_center = static_cast<double>(rect.x2 + rect.x1) / 2.0;
+    double y_center = static_cast<double>(rect.y2 + rect.y1) / 2.0;
+    double width = rect.x2 - rect.x1;
+    double height = rect.y2 - rect.y1;
+    for (ssize_t y = max<ssize_t>(rect.y1, y1); y < min<ssize_t>(rect.y2, y2); y++) {
       double y_dist = (static_cast<double>(y) - y_center) / height;
-      if (x_dist * x_dist + y_dist * y_dist > 0.25) {
+      auto is_inside = [&](ssize_t x) -> bool {
+        double x_dist = (static_cast<double>(x) - x_center) / width;
+        return (x_dist * x_dist + y_dist * y_dist <= 0.25);
+      };
+
+      // Each row of the oval is a single span. Estimate its ends, then move
+      // them until they agree with is_inside exactly, so the result is the
+      // same as testing every pixel.
+      double y_remaining = 0.25 - y_dist * y_dist;
+      if (y_remaining < 0) {
         continue;
       }
-      uint8_t value = fill_pat.pixel_at(x - this->pict_bounds.x1, y - this->pict_bounds.y1) ? 0x00 : 0xFF;
-      this->write_canvas_pixel(x, y, value, value, value);
+      double half_span = sqrt(y_remaining) * width;
+      ssize_t span_x1 = clamp<ssize_t>(ceil(x_center - half_span), rect.x1, rect.x2);
+      ssize_t span_x2 = clamp<ssize_t>(floor(x_center + half_span) + 1, rect.x1, rect.x2);
+      while ((span_x1 > rect.x1) && is_inside(span_x1 - 1)) {
+        span_x1--;
+      }
+      while ((span_x1 < rect.x2) && !is_inside(span_x1)) {
+        span_x1++;
+      }
+      span_x2 = max<ssize_t>(span_x2, span_x1);
+      while ((span_x2 < rect.x2) && is_inside(span_x2)) {
+        span_x2++;
+      }
+      while ((span_x2 > span_x1) && !is_inside(span_x2 - 1)) {
+        span_x2--;
+      }
+      if (span_x2 > span_x1) {
+        this->write_canvas_span(*clip, span_x1, y, spans->row(y, span_x1), span_x2 - span_x1);
+      }
     }
-  }
+  });
 }
 
 void QuickDrawEngine::pict_fill_oval(StringReader& r, uint16_t opcode) {
@@ -377,62 +611,36 @@ struct PictCopyBitsMonochromeArgs {
  * };
  */
 
-string QuickDrawEngine::unpack_bits(StringReader& r, size_t row_count,
+pmr::string QuickDrawEngine::unpack_bits(StringReader& r, size_t row_count,
     uint16_t row_bytes, bool sizes_are_words, bool chunks_are_words) {
-  string ret;
   size_t expected_size = row_bytes * row_count;
-  ret.reserve(expected_size);
-
-  for (size_t y = 0; y < row_count; y++) {
-    uint16_t packed_row_bytes = sizes_are_words ? r.get_u16b() : r.get_u8();
-    for (size_t row_end_offset = r.where() + packed_row_bytes; r.where() < row_end_offset;) {
-      int16_t count = r.get_s8();
-      if (count < 0) { // RLE segment
-        if (chunks_are_words) {
-          uint16_t value = r.get_u16b();
-          for (ssize_t x = 0; x < -(count - 1); x++) {
-            ret.push_back((value >> 8) & 0xFF);
-            ret.push_back(value & 0xFF);
-          }
-        } else {
-          ret.insert(ret.size(), -(count - 1), r.get_u8());
-        }
-      } else { // Direct segment
-        if (chunks_are_words) {
-          ret += r.read((count + 1) * 2);
-        } else {
-          ret += r.read(count + 1);
-        }
-      }
-    }
-    if (ret.size() != static_cast<size_t>(row_bytes * (y + 1))) {
-      throw runtime_error(string_printf("packed data size is incorrect on row %zu at offset %zX (expected %zX, have %zX)",
-          y, r.where(), row_bytes * (y + 1), ret.size()));
-    }
-  }
-  if (row_bytes * row_count != ret.size()) {
-    throw runtime_error(string_printf("unpacked data size is incorrect (expected %zX, have %zX)",
-        row_bytes * row_count, ret.size()));
-  }
+  check_resource_memory(expected_size, "PICT pixel data");
+  pmr::string ret(expected_size, '\0', scratch_memory_resource());
+  size_t remaining = r.remaining();
+  size_t consumed = unpack_bits_rows(reinterpret_cast<uint8_t*>(ret.data()),
+      row_bytes, row_count, r.getv(remaining, false), remaining,
+      sizes_are_words, chunks_are_words);
+  r.skip(consumed);
   return ret;
 }
 
-string QuickDrawEngine::unpack_bits(StringReader& r, size_t row_count,
+pmr::string QuickDrawEngine::unpack_bits(StringReader& r, size_t row_count,
     uint16_t row_bytes, bool chunks_are_words) {
-  size_t start_offset = r.where();
-  string failure_strs[2];
-  for (size_t x = 0; x < 2; x++) {
-    try {
-      // If row_bytes > 250, word sizes are most likely to be correct, so try
-      // that first
-      return unpack_bits(r, row_count, row_bytes, x ^ (row_bytes > 250), chunks_are_words);
-    } catch (const exception& e) {
-      failure_strs[x ^ (row_bytes > 250)] = e.what();
-      r.go(start_offset);
-    }
-  }
-  throw runtime_error(string_printf("failed to unpack data with either byte sizes (%s) or word sizes (%s)",
-      failure_strs[0].c_str(), failure_strs[1].c_str()));
+  size_t expected_size = row_bytes * row_count;
+  check_resource_memory(expected_size, "PICT pixel data");
+  pmr::string ret(expected_size, '\0', scratch_memory_resource());
+  size_t remaining = r.remaining();
+  size_t consumed = unpack_bits_rows(reinterpret_cast<uint8_t*>(ret.data()),
+      row_bytes, row_count, r.getv(remaining, false), remaining,
+      chunks_are_words);
+  r.skip(consumed);
+  return ret;
+}
+
+static pmr::string read_scratch(StringReader& r, size_t size) {
+  pmr::string ret(scratch_memory_resource());
+  ret.assign(reinterpret_cast<const char*>(r.getv(size)), size);
+  return ret;
 }
 
 void QuickDrawEngine::pict_copy_bits_indexed_color(StringReader& r, uint16_t opcode) {
@@ -471,9 +679,9 @@ void QuickDrawEngine::pict_copy_bits_indexed_color(StringReader& r, uint16_t opc
     }
 
     uint16_t row_bytes = header.flags_row_bytes & 0x7FFF;
-    string data = is_packed ?
+    pmr::string data = is_packed ?
         unpack_bits(r, header.bounds.height(), row_bytes, header.pixel_size == 0x10) :
-        r.read(header.bounds.height() * row_bytes);
+        read_scratch(r, header.bounds.height() * row_bytes);
     const PixelMapData* pixel_map = reinterpret_cast<const PixelMapData*>(data.data());
 
     source_image = decode_color_image(header, *pixel_map, &ctable);
@@ -499,35 +707,46 @@ void QuickDrawEngine::pict_copy_bits_indexed_color(StringReader& r, uint16_t opc
       mask_region.reset(new Region(r));
     }
 
-    string data = is_packed ?
+    pmr::string data = is_packed ?
         unpack_bits(r, args.header.bounds.height(), args.header.flags_row_bytes, false) :
-        r.read(args.header.bounds.height() * args.header.flags_row_bytes);
+        read_scratch(r, args.header.bounds.height() * args.header.flags_row_bytes);
     source_image = decode_monochrome_image(data.data(), data.size(),
         args.header.bounds.width(), args.header.bounds.height(),
         args.header.flags_row_bytes);
   }
 
   // TODO: the clipping region should apply here
+  auto source = make_shared<Image>(move(source_image));
   if (mask_region.get() && !mask_region_rect.is_empty()) {
     if (mask_region_rect != source_rect) {
       throw runtime_error("mask region rect " + mask_region_rect.str() + " is not same as source rect " + source_rect.str());
     }
-    this->port->blit(source_image,
-        dest_rect.x1 - this->pict_bounds.x1,
-        dest_rect.y1 - this->pict_bounds.y1,
-        source_rect.x2 - source_rect.x1,
-        source_rect.y2 - source_rect.y1,
-        source_rect.x1 - bounds.x1,
-        source_rect.y1 - bounds.y1,
-        mask_region);
+    // The mask applies to the whole source rect, so this can't be split up
+    this->draw([this, source, bounds, source_rect, dest_rect, mask_region](ssize_t, ssize_t) -> void {
+      this->port->blit(*source,
+          dest_rect.x1 - this->pict_bounds.x1,
+          dest_rect.y1 - this->pict_bounds.y1,
+          source_rect.x2 - source_rect.x1,
+          source_rect.y2 - source_rect.y1,
+          source_rect.x1 - bounds.x1,
+          source_rect.y1 - bounds.y1,
+          mask_region);
+    }, false);
   } else {
-    this->port->blit(source_image,
-        dest_rect.x1 - this->pict_bounds.x1,
-        dest_rect.y1 - this->pict_bounds.y1,
-        source_rect.x2 - source_rect.x1,
-        source_rect.y2 - source_rect.y1,
-        source_rect.x1 - bounds.x1,
-        source_rect.y1 - bounds.y1);
+    this->draw([this, source, bounds, source_rect, dest_rect](ssize_t y1, ssize_t y2) -> void {
+      ssize_t start_y = max<ssize_t>(dest_rect.y1, y1);
+      ssize_t end_y = min<ssize_t>(dest_rect.y1 + source_rect.height(), y2);
+      if (start_y >= end_y) {
+        return;
+      }
+      this->port->blit(*source,
+          dest_rect.x1 - this->pict_bounds.x1,
+          start_y - this->pict_bounds.y1,
+          source_rect.x2 - source_rect.x1,
+          end_y - start_y,
+          source_rect.x1 - bounds.x1,
+          source_rect.y1 - bounds.y1 + (start_y - dest_rect.y1));
+    });
   }
 }
 
@@ -578,52 +797,75 @@ void QuickDrawEngine::pict_packed_copy_bits_direct_color(StringReader& r, uint16
     throw runtime_error("only 8-bit and 5-bit channels are supported");
   }
   size_t row_bytes = args.header.bounds.width() * bytes_per_pixel;
-  string data = unpack_bits(r, args.header.bounds.height(), row_bytes, args.header.pixel_size == 0x10);
+  pmr::string data = unpack_bits(r, args.header.bounds.height(), row_bytes, args.header.pixel_size == 0x10);
 
   if (mask_img.get() && (mask_region_rect != args.source_rect)) {
     throw runtime_error("mask region rect is not same as source rect");
   }
 
-  for (ssize_t y = 0; y < args.source_rect.height(); y++) {
-    size_t row_offset = row_bytes * y;
-    for (ssize_t x = 0; x < args.source_rect.width(); x++) {
-      if (mask_img.get()) {
-        uint64_t r, g, b;
-        mask_img->read_pixel(x + args.source_rect.x1 - mask_region_rect.x1,
-            y + args.source_rect.y1 - mask_region_rect.y1, &r, &g, &b);
-        if (r || g || b) {
+  auto clip = this->get_current_clip();
+  auto shared_data = make_shared<pmr::string>(move(data));
+  auto header = args.header;
+  Rect source_rect = args.source_rect;
+  Rect dest_rect = args.dest_rect;
+  this->draw([this, clip, shared_data, header, source_rect, dest_rect, row_bytes,
+      mask_img, mask_region_rect](ssize_t y1, ssize_t y2) -> void {
+    const pmr::string& data = *shared_data;
+    ssize_t width = source_rect.width();
+    vector<uint8_t> row(width * 3);
+    ssize_t start_y = max<ssize_t>(0, y1 - dest_rect.y1);
+    ssize_t end_y = min<ssize_t>(source_rect.height(), y2 - dest_rect.y1);
+    for (ssize_t y = start_y; y < end_y; y++) {
+      size_t row_offset = row_bytes * y;
+      // Masked-out pixels end the current span
+      ssize_t span_start = 0;
+      for (ssize_t x = 0; x <= width; x++) {
+        bool masked = (x == width);
+        if (!masked && mask_img.get()) {
+          uint64_t r, g, b;
+          mask_img->read_pixel(x + source_rect.x1 - mask_region_rect.x1,
+              y + source_rect.y1 - mask_region_rect.y1, &r, &g, &b);
+          masked = (r || g || b);
+        }
+        if (masked) {
+          if (x > span_start) {
+            this->write_canvas_span(*clip, span_start + dest_rect.x1,
+                y + dest_rect.y1, row.data() + span_start * 3, x - span_start);
+          }
+          span_start = x + 1;
           continue;
         }
-      }
 
-      uint8_t r_value, g_value, b_value;
-      if ((args.header.component_size == 8) && (args.header.component_count == 3)) {
-        r_value = data[row_offset + x];
-        g_value = data[row_offset + (row_bytes / 3) + x];
-        b_value = data[row_offset + (2 * row_bytes / 3) + x];
-
-      } else if ((args.header.component_size == 8) && (args.header.component_count == 4)) {
-        // The first component is ignored
-        r_value = data[row_offset + (row_bytes / 4) + x];
-        g_value = data[row_offset + (2 * row_bytes / 4) + x];
-        b_value = data[row_offset + (3 * row_bytes / 4) + x];
-
-      } else if (args.header.component_size == 5) {
-        // xrgb1555. See decode_color_image for an explanation of the bit
-        // manipulation below
-        uint16_t value = *reinterpret_cast<const be_uint16_t*>(&data[row_offset + 2 * x]);
-        r_value = ((value >> 7) & 0xF8) | ((value >> 12) & 0x07);
-        g_value = ((value >> 2) & 0xF8) | ((value >> 7) & 0x07);
-        b_value = ((value << 3) & 0xF8) | ((value >> 2) & 0x07);
+        uint8_t r_value, g_value, b_value;
+        if ((header.component_size == 8) && (header.component_count == 3)) {
+          r_value = data[row_offset + x];
+          g_value = data[row_offset + (row_bytes / 3) + x];
+          b_value = data[row_offset + (2 * row_bytes / 3) + x];
+
+        } else if ((header.component_size == 8) && (header.component_count == 4)) {
+          // The first component is ignored
+          r_value = data[row_offset + (row_bytes / 4) + x];
+          g_value = data[row_offset + (2 * row_bytes / 4) + x];
+          b_value = data[row_offset + (3 * row_bytes / 4) + x];
+
+        } else if (header.component_size == 5) {
+          // xrgb1555. See decode_color_image for an explanation of the bit
+          // manipulation below
+          uint16_t value = *reinterpret_cast<const be_uint16_t*>(&data[row_offset + 2 * x]);
+          r_value = ((value >> 7) & 0xF8) | ((value >> 12) & 0x07);
+          g_value = ((value >> 2) & 0xF8) | ((value >> 7) & 0x07);
+          b_value = ((value << 3) & 0xF8) | ((value >> 2) & 0x07);
 
-      } else {
-        throw logic_error("unimplemented channel width");
-      }
+        } else {
+          throw logic_error("unimplemented channel width");
+        }
 
-      this->write_canvas_pixel(x + args.dest_rect.x1, y + args.dest_rect.y1,
-          r_value, g_value, b_value);
+        row[x * 3] = r_value;
+        row[x * 3 + 1] = g_value;
+        row[x * 3 + 2] = b_value;
+      }
     }
-  }
+  });
 }
 
 
@@ -950,6 +1192,175 @@ Image QuickDrawEngine::pict_decode_rpza(
   return ret;
 }
 
+static uint8_t quicktime_pixel_bits(uint16_t bit_depth) {
+  // Depths 33-40 are grayscale with (depth - 32) bits per pixel
+  uint8_t bits = (bit_depth > 32) ? (bit_depth - 32) : bit_depth;
+  if ((bit_depth <= 40) &&
+      ((bits == 1) || (bits == 2) || (bits == 4) || (bits == 8) ||
+       ((bit_depth <= 32) && ((bits == 16) || (bits == 24) || (bits == 32))))) {
+    return bits;
+  }
+  throw runtime_error(string_printf(
+      "QuickTime image has unsupported bit depth %hu", bit_depth));
+}
+
+Image QuickDrawEngine::pict_convert_quicktime_pixels(
+    const PictQuickTimeImageDescription& desc,
+    const vector<ColorTableEntry>& clut,
+    const string& data,
+    size_t row_bytes) {
+  uint8_t bits = quicktime_pixel_bits(desc.bit_depth);
+  bool is_gray = (desc.bit_depth > 32);
+  if (data.size() < row_bytes * desc.height) {
+    throw runtime_error("QuickTime image data is too small");
+  }
+
+  Image ret(desc.width, desc.height);
+  for (size_t y = 0; y < desc.height; y++) {
+    const uint8_t* row = reinterpret_cast<const uint8_t*>(data.data()) + y * row_bytes;
+    for (size_t x = 0; x < desc.width; x++) {
+      if (bits == 16) {
+        Color8 c = decode_rgb555((row[x * 2] << 8) | row[x * 2 + 1]);
+        ret.write_pixel(x, y, c.r, c.g, c.b, 0xFF);
+      } else if (bits == 24) {
+        ret.write_pixel(x, y, row[x * 3], row[x * 3 + 1], row[x * 3 + 2], 0xFF);
+      } else if (bits == 32) {
+        // Pixels are ARGB, but the alpha channel is usually unused
+        ret.write_pixel(x, y, row[x * 4 + 1], row[x * 4 + 2], row[x * 4 + 3], 0xFF);
+      } else {
+        size_t bit_offset = x * bits;
+        uint8_t mask = (1 << bits) - 1;
+        uint8_t index = (row[bit_offset >> 3] >> (8 - bits - (bit_offset & 7))) & mask;
+        if (is_gray || clut.empty()) {
+          // Grayscale images go from white (0) to black (the highest value);
+          // this also covers 1-bit images with no color table
+          uint8_t v = 0xFF - (index * 0xFF) / mask;
+          ret.write_pixel(x, y, v, v, v, 0xFF);
+        } else {
+          const auto& color = clut.at(index);
+          ret.write_pixel(x, y, color.c.r / 0x0101, color.c.g / 0x0101,
+              color.c.b / 0x0101, 0xFF);
+        }
+      }
+    }
+  }
+  return ret;
+}
+
+Image QuickDrawEngine::pict_decode_raw(
+    const PictQuickTimeImageDescription& desc,
+    const vector<ColorTableEntry>& clut,
+    const string& data) {
+  uint8_t bits = quicktime_pixel_bits(desc.bit_depth);
+  size_t min_row_bytes = (desc.width * bits + 7) / 8;
+  // Rows are usually padded to an even number of bytes, but not always, so
+  // use the size of the data to determine the row size if possible
+  size_t row_bytes = (min_row_bytes + 1) & ~1;
+  if (desc.height && (data.size() % desc.height == 0) &&
+      (data.size() / desc.height >= min_row_bytes)) {
+    row_bytes = data.size() / desc.height;
+  }
+  return this->pict_convert_quicktime_pixels(desc, clut, data, row_bytes);
+}
+
+Image QuickDrawEngine::pict_decode_rle(
+    const PictQuickTimeImageDescription& desc,
+    const vector<ColorTableEntry>& clut,
+    const string& data) {
+  uint8_t bits = quicktime_pixel_bits(desc.bit_depth);
+  // Skips and runs are measured in units of this many bytes. This is one pixel
+  // at depths of 16 bits and above; at lower depths, it's a group of pixels.
+  size_t unit_size = (bits == 1) ? 2 : ((bits <= 8) ? 4 : (bits / 8));
+  size_t row_bytes = (desc.width * bits + 7) / 8;
+  row_bytes = ((row_bytes + unit_size - 1) / unit_size) * unit_size;
+  string pixels(row_bytes * desc.height, '\0');
+
+  auto check_range = [&](int64_t offset, size_t size) {
+    if ((offset < 0) || (static_cast<size_t>(offset) + size > pixels.size())) {
+      throw runtime_error("rle-encoded image writes beyond end of output image");
+    }
+  };
+
+  StringReader r(data.data(), data.size());
+  // A chunk smaller than the header means nothing changed from the previous
+  // frame; since there's only one frame, the image is blank
+  if ((r.get_u32b() & 0x3FFFFFFF) < 8) {
+    return this->pict_convert_quicktime_pixels(desc, clut, pixels, row_bytes);
+  }
+  uint16_t header = r.get_u16b();
+  size_t start_line = 0;
+  size_t num_lines = desc.height;
+  if (header & 0x0008) {
+    start_line = r.get_u16b();
+    r.skip(2);
+    num_lines = r.get_u16b();
+    r.skip(2);
+  }
+
+  if (bits == 1) {
+    // 1-bit images have a different structure: each run is preceded by a skip
+    // count, whose high bit means to advance to the next line first
+    int64_t row_offset = (static_cast<int64_t>(start_line) - 1) * row_bytes;
+    int64_t offset = row_offset;
+    for (size_t lines_remaining = num_lines + 1; lines_remaining;) {
+      uint8_t skip = r.get_u8();
+      int8_t rle_code = r.get_s8();
+      if (rle_code == 0) {
+        break;
+      }
+      if (skip & 0x80) {
+        lines_remaining--;
+        row_offset += row_bytes;
+        offset = row_offset + (skip & 0x7F) * unit_size;
+      } else {
+        offset += skip * unit_size;
+      }
+
+      if (rle_code < 0) {
+        const void* unit = r.getv(unit_size);
+        for (; rle_code < 0; rle_code++) {
+          check_range(offset, unit_size);
+          memcpy(pixels.data() + offset, unit, unit_size);
+          offset += unit_size;
+        }
+      } else {
+        size_t size = rle_code * unit_size;
+        check_range(offset, size);
+        memcpy(pixels.data() + offset, r.getv(size), size);
+        offset += size;
+      }
+    }
+
+  } else {
+    for (size_t y = start_line; y < start_line + num_lines; y++) {
+      // Skip counts are biased by 1
+      int64_t offset = y * row_bytes + (static_cast<int64_t>(r.get_u8()) - 1) * unit_size;
+      for (;;) {
+        int8_t rle_code = r.get_s8();
+        if (rle_code == -1) { // End of line
+          break;
+        } else if (rle_code == 0) { // Skip
+          offset += (static_cast<int64_t>(r.get_u8()) - 1) * unit_size;
+        } else if (rle_code < 0) { // Repeat one unit
+          const void* unit = r.getv(unit_size);
+          for (; rle_code < 0; rle_code++) {
+            check_range(offset, unit_size);
+            memcpy(pixels.data() + offset, unit, unit_size);
+            offset += unit_size;
+          }
+        } else { // Copy units directly
+          size_t size = rle_code * unit_size;
+          check_range(offset, size);
+          memcpy(pixels.data() + offset, r.getv(size), size);
+          offset += size;
+        }
+      }
+    }
+  }
+
+  return this->pict_convert_quicktime_pixels(desc, clut, pixels, row_bytes);
+}
+
 void QuickDrawEngine::pict_write_quicktime_data(StringReader& r, uint16_t opcode) {
   bool is_compressed = !(opcode & 0x01);
 
@@ -974,7 +1385,7 @@ void QuickDrawEngine::pict_write_quicktime_data(StringReader& r, uint16_t opcode
   if (matte_size) {
     // The next header is always word-aligned, so if the matte image is an odd
     // number of bytes, round up
-    fprintf(stderr, "warning: skipping matte image (%u bytes) from QuickTime data\n", matte_size);
+    fprintf(current_task_log_stream(), "warning: skipping matte image (%u bytes) from QuickTime data\n", matte_size);
     r.go((r.where() + matte_size + 1) & ~1);
   }
 
@@ -1008,6 +1419,20 @@ void QuickDrawEngine::pict_write_quicktime_data(StringReader& r, uint16_t opcode
       decoded = this->pict_decode_smc(desc, clut, encoded_data);
     } else if (desc.codec == 0x72707A61) { // kVideoCodecType
       decoded = this->pict_decode_rpza(desc, encoded_data);
+    } else if ((desc.codec == 0x72617720) || (desc.codec == 0x726C6520)) { // kRawCodecType, kAnimationCodecType
+      if (clut.empty() && (desc.bit_depth <= 8)) {
+        // The image uses the standard color table for its depth. Files rarely
+        // have their own copy of it (it's in the System file), so if this one
+        // doesn't, use the built-in one.
+        try {
+          clut = this->port->read_clut(desc.bit_depth);
+        } catch (const out_of_range&) {
+          clut = standard_clut_for_depth(desc.bit_depth);
+        }
+      }
+      decoded = (desc.codec == 0x72617720)
+          ? this->pict_decode_raw(desc, clut, encoded_data)
+          : this->pict_decode_rle(desc, clut, encoded_data);
     } else if (desc.codec == 0x67696620) { // kGIFCodecType
       throw pict_contains_undecodable_quicktime("gif", move(encoded_data));
     } else if (desc.codec == 0x6A706567) { // kJPEGCodecType
@@ -1029,7 +1454,15 @@ void QuickDrawEngine::pict_write_quicktime_data(StringReader& r, uint16_t opcode
       throw runtime_error("decoded QuickTIme image dimensions do not match port dimensions");
     }
 
-    this->port->blit(decoded, 0, 0, decoded.get_width(), decoded.get_height());
+    auto decoded_shared = make_shared<Image>(move(decoded));
+    this->draw([this, decoded_shared](ssize_t y1, ssize_t y2) -> void {
+      ssize_t start_y = max<ssize_t>(0, y1 - this->pict_bounds.y1);
+      ssize_t end_y = min<ssize_t>(decoded_shared->get_height(), y2 - this->pict_bounds.y1);
+      if (start_y < end_y) {
+        this->port->blit(*decoded_shared, 0, start_y, decoded_shared->get_width(),
+            end_y - start_y, 0, start_y);
+      }
+    });
 
   } else {
     // "Uncompressed" QuickTime data has a subordinate opcode at this position
@@ -1241,8 +1674,40 @@ void QuickDrawEngine::render_pict(const void* vdata, size_t size) {
   this->pict_version = 1;
   this->pict_highlight_flag = false;
   this->pict_last_rect = Rect(0, 0, 0, 0);
+  this->current_clip.reset();
+
+  // Only record a display list if the picture is large enough that drawing it
+  // in parallel is likely to be worth the overhead
+  static constexpr size_t min_recorded_canvas_pixels = 0x400000;
+  size_t canvas_pixels = static_cast<size_t>(max<ssize_t>(this->pict_bounds.width(), 0)) *
+      static_cast<size_t>(max<ssize_t>(this->pict_bounds.height(), 0));
+  check_resource_memory(canvas_pixels * 3, "PICT canvas");
+  this->recording = (this->max_render_threads != 1) &&
+      (canvas_pixels >= min_recorded_canvas_pixels);
+  this->display_list_bandable = true;
+  this->display_list.clear();
+
+  try {
+    this->render_pict_opcodes(r);
+  } catch (const exception&) {
+    this->recording = false;
+    this->display_list.clear();
+    throw;
+  }
+
+  if (this->recording) {
+    this->recording = false;
+    this->render_display_list();
+  }
+}
+
+void QuickDrawEngine::render_pict_opcodes(StringReader& r) {
+  for (size_t num_opcodes = 0; !r.eof(); num_opcodes++) {
+    // Checking the clock is cheap, but not free, and most opcodes are faster
+    if ((num_opcodes & 0x3F) == 0) {
+      check_resource_deadline("PICT rendering");
+    }
 
-  while (!r.eof()) {
     // In v2 pictures, opcodes are word-aligned
     if ((this->pict_version == 2) && (r.where() & 1)) {
       r.get_u8();
@@ -3,7 +3,11 @@
 #include <stdint.h>
 
 #include <functional>
+#include <memory>
+#include <memory_resource>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include <phosg/Image.hh>
 #include <phosg/Strings.hh>
@@ -20,9 +24,22 @@ public:
   virtual size_t width() const = 0;
   virtual size_t height() const = 0;
   virtual void write_pixel(ssize_t x, ssize_t y, uint8_t r, uint8_t g, uint8_t b) = 0;
+  // Writes count pixels starting at (x, y) and going right; rgb contains 3
+  // bytes per pixel. The default implementation calls write_pixel for each
+  // pixel, but ports should override this if they can do better.
+  virtual void write_span(ssize_t x, ssize_t y, const uint8_t* rgb, size_t count);
   virtual void blit(const Image& src, ssize_t dest_x, ssize_t dest_y,
       size_t w, size_t h, ssize_t src_x = 0, ssize_t src_y = 0,
       std::shared_ptr<Region> mask = nullptr) = 0;
+  // Returns true if write_pixel, write_span, and blit may be called from
+  // multiple threads at once, as long as the calls write to different rows.
+  // QuickDrawEngine only draws large pictures in parallel bands on ports that
+  // return true; the default is false, so ports that keep other state (or
+  // write through to something that isn't thread-safe) are always drawn on
+  // one thread.
+  virtual bool supports_concurrent_row_writes() const {
+    return false;
+  }
 
   // External resource data accessors
   virtual std::vector<ColorTableEntry> read_clut(int16_t id) = 0;
@@ -91,6 +108,262 @@ protected:
 
 
 
+// A port that draws into an Image. Since this is the port used in almost all
+// cases, QuickDrawEngine checks for it and calls its pixel functions directly
+// (it's final, so those calls aren't virtual and can be inlined); other ports
+// still work through the virtual interface.
+class ImagePort final : public QuickDrawPortInterface {
+public:
+  ImagePort(size_t x, size_t y,
+      std::function<std::vector<ColorTableEntry>(int16_t)> clut_resolver);
+  virtual ~ImagePort() = default;
+
+  const Image& image() const {
+    return this->img;
+  }
+
+  // Image data accessors (Image, pixel map, or bitmap)
+  virtual size_t width() const {
+    return this->img.get_width();
+  }
+  virtual size_t height() const {
+    return this->img.get_height();
+  }
+  virtual void write_pixel(ssize_t x, ssize_t y, uint8_t r, uint8_t g, uint8_t b) {
+    this->img.write_pixel(x, y, r, g, b);
+  }
+  virtual void write_span(ssize_t x, ssize_t y, const uint8_t* rgb, size_t count) {
+    for (size_t z = 0; z < count; z++, rgb += 3) {
+      this->img.write_pixel(x + z, y, rgb[0], rgb[1], rgb[2]);
+    }
+  }
+  virtual void blit(const Image& src, ssize_t dest_x, ssize_t dest_y,
+      size_t w, size_t h, ssize_t src_x = 0, ssize_t src_y = 0,
+      std::shared_ptr<Region> mask = nullptr) {
+    if (mask.get()) {
+      this->img.mask_blit(src, dest_x, dest_y, w, h, src_x, src_y, mask->render());
+    } else {
+      this->img.blit(src, dest_x, dest_y, w, h, src_x, src_y);
+    }
+  }
+  // Each row of the image is separate memory, and nothing else is modified
+  virtual bool supports_concurrent_row_writes() const {
+    return true;
+  }
+
+  // External resource data accessors
+  virtual std::vector<ColorTableEntry> read_clut(int16_t id) {
+    return this->clut_resolver(id);
+  }
+
+  // QuickDraw state accessors
+  Rect bounds;
+  virtual const Rect& get_bounds() const {
+    return this->bounds;
+  }
+  virtual void set_bounds(Rect z) {
+    this->bounds = z;
+  }
+
+  Region clip_region;
+  virtual const Region& get_clip_region() const {
+    return this->clip_region;
+  }
+  virtual void set_clip_region(Region&& z) {
+    this->clip_region = std::move(z);
+  }
+
+  Color foreground_color;
+  virtual Color get_foreground_color() const {
+    return this->foreground_color;
+  }
+  virtual void set_foreground_color(Color z) {
+    this->foreground_color = z;
+  }
+
+  Color background_color;
+  virtual Color get_background_color() const {
+    return this->background_color;
+  }
+  virtual void set_background_color(Color z) {
+    this->background_color = z;
+  }
+
+  Color highlight_color;
+  virtual Color get_highlight_color() const {
+    return this->highlight_color;
+  }
+  virtual void set_highlight_color(Color z) {
+    this->highlight_color = z;
+  }
+
+  Color op_color;
+  virtual Color get_op_color() const {
+    return this->op_color;
+  }
+  virtual void set_op_color(Color z) {
+    this->op_color = z;
+  }
+
+  int16_t extra_space_nonspace;
+  virtual int16_t get_extra_space_nonspace() const {
+    return this->extra_space_nonspace;
+  }
+  virtual void set_extra_space_nonspace(int16_t z) {
+    this->extra_space_nonspace = z;
+  }
+
+  Fixed extra_space_space;
+  virtual Fixed get_extra_space_space() const {
+    return this->extra_space_space;
+  }
+  virtual void set_extra_space_space(Fixed z) {
+    this->extra_space_space = z;
+  }
+
+  Point pen_loc;
+  virtual Point get_pen_loc() const {
+    return this->pen_loc;
+  }
+  virtual void set_pen_loc(Point z) {
+    this->pen_loc = z;
+  }
+
+  int16_t pen_loc_frac;
+  virtual int16_t get_pen_loc_frac() const {
+    return this->pen_loc_frac;
+  }
+  virtual void set_pen_loc_frac(int16_t z) {
+    this->pen_loc_frac = z;
+  }
+
+  Point pen_size;
+  virtual Point get_pen_size() const {
+    return this->pen_size;
+  }
+  virtual void set_pen_size(Point z) {
+    this->pen_size = z;
+  }
+
+  int16_t pen_mode;
+  virtual int16_t get_pen_mode() const {
+    return this->pen_mode;
+  }
+  virtual void set_pen_mode(int16_t z) {
+    this->pen_mode = z;
+  }
+
+  int16_t pen_visibility;
+  virtual int16_t get_pen_visibility() const {
+    return this->pen_visibility;
+  }
+  virtual void set_pen_visibility(int16_t z) {
+    this->pen_visibility = z;
+  }
+
+  int16_t text_font;
+  virtual int16_t get_text_font() const {
+    return this->text_font;
+  }
+  virtual void set_text_font(int16_t z) {
+    this->text_font = z;
+  }
+
+  int16_t text_mode;
+  virtual int16_t get_text_mode() const {
+    return this->text_mode;
+  }
+  virtual void set_text_mode(int16_t z) {
+    this->text_mode = z;
+  }
+
+  int16_t text_size;
+  virtual int16_t get_text_size() const {
+    return this->text_size;
+  }
+  virtual void set_text_size(int16_t z) {
+    this->text_size = z;
+  }
+
+  uint8_t text_style;
+  virtual uint8_t get_text_style() const {
+    return this->text_style;
+  }
+  virtual void set_text_style(uint8_t z) {
+    this->text_style = z;
+  }
+
+  int16_t foreground_color_index;
+  virtual int16_t get_foreground_color_index() const {
+    return this->foreground_color_index;
+  }
+  virtual void set_foreground_color_index(int16_t z) {
+    this->foreground_color_index = z;
+  }
+
+  int16_t background_color_index;
+  virtual int16_t get_background_color_index() const {
+    return this->background_color_index;
+  }
+  virtual void set_background_color_index(int16_t z) {
+    this->background_color_index = z;
+  }
+
+  Image pen_pixel_pattern;
+  virtual const Image& get_pen_pixel_pattern() const {
+    return this->pen_pixel_pattern;
+  }
+  virtual void set_pen_pixel_pattern(Image&& z) {
+    this->pen_pixel_pattern = std::move(z);
+  }
+
+  Image fill_pixel_pattern;
+  virtual const Image& get_fill_pixel_pattern() const {
+    return this->fill_pixel_pattern;
+  }
+  virtual void set_fill_pixel_pattern(Image&& z) {
+    this->fill_pixel_pattern = std::move(z);
+  }
+
+  Image background_pixel_pattern;
+  virtual const Image& get_background_pixel_pattern() const {
+    return this->background_pixel_pattern;
+  }
+  virtual void set_background_pixel_pattern(Image&& z) {
+    this->background_pixel_pattern = std::move(z);
+  }
+
+  Pattern pen_mono_pattern;
+  virtual Pattern get_pen_mono_pattern() const {
+    return this->pen_mono_pattern;
+  }
+  virtual void set_pen_mono_pattern(Pattern z) {
+    this->pen_mono_pattern = z;
+  }
+
+  Pattern fill_mono_pattern;
+  virtual Pattern get_fill_mono_pattern() const {
+    return this->fill_mono_pattern;
+  }
+  virtual void set_fill_mono_pattern(Pattern z) {
+    this->fill_mono_pattern = z;
+  }
+
+  Pattern background_mono_pattern;
+  virtual Pattern get_background_mono_pattern() const {
+    return this->background_mono_pattern;
+  }
+  virtual void set_background_mono_pattern(Pattern z) {
+    this->background_mono_pattern = z;
+  }
+
+protected:
+  std::function<std::vector<ColorTableEntry>(int16_t)> clut_resolver;
+  Image img;
+};
+
+
+
 class pict_contains_undecodable_quicktime : public std::exception {
 public:
   pict_contains_undecodable_quicktime(std::string&& ext, std::string&& data);
@@ -102,17 +375,52 @@ public:
 
 class QuickDrawEngine {
 public:
-  QuickDrawEngine() = default;
+  QuickDrawEngine();
   ~QuickDrawEngine() = default;
 
   void set_port(QuickDrawPortInterface* port);
 
+  // For large pictures, the drawing operations are recorded while the opcodes
+  // are parsed, then the canvas is split into horizontal bands which are drawn
+  // in parallel. This sets the maximum number of threads to use; 0 (the
+  // default) means to use one per CPU core, and 1 disables this. Pictures are
+  // only drawn in bands if the port's supports_concurrent_row_writes returns
+  // true.
+  void set_max_render_threads(size_t max_threads);
+
   void render_pict(const void* data, size_t size);
 
 protected:
   QuickDrawPortInterface* port;
+  // Same as port if it's an ImagePort; otherwise null
+  ImagePort* image_port;
   Color default_highlight_color;
 
+  // The port state that affects where pixels may be drawn. Drawing operations
+  // keep a reference to the state at the time they were recorded, since they
+  // may not run until after it has changed.
+  struct CanvasClip {
+    Rect bounds;
+    Region clip_region;
+    bool clip_region_is_rect;
+
+    explicit CanvasClip(QuickDrawPortInterface* port);
+  };
+  std::shared_ptr<const CanvasClip> current_clip;
+  const std::shared_ptr<const CanvasClip>& get_current_clip();
+
+  // A drawing operation, which only draws the canvas rows in [y1, y2). Ops
+  // that can't be limited to a range of rows (bandable = false) cause the
+  // entire display list to be drawn on one thread.
+  using RasterOp = std::function<void(ssize_t y1, ssize_t y2)>;
+  size_t max_render_threads;
+  bool recording;
+  bool display_list_bandable;
+  std::vector<RasterOp> display_list;
+  void draw(RasterOp&& op, bool bandable = true);
+  void render_display_list();
+  void render_pict_opcodes(StringReader& r);
+
   Rect pict_bounds;
   Point pict_oval_size;
   Point pict_origin;
@@ -122,7 +430,11 @@ protected:
   bool pict_highlight_flag;
   Rect pict_last_rect;
 
-  void write_canvas_pixel(ssize_t x, ssize_t y, uint64_t r, uint64_t g, uint64_t b);
+  void write_canvas_span(const CanvasClip& clip, ssize_t x, ssize_t y,
+      const uint8_t* rgb, size_t count);
+  template <typename PortT>
+  void write_canvas_span_to(PortT* port, const CanvasClip& clip, ssize_t x,
+      ssize_t y, const uint8_t* rgb, size_t count);
 
   static std::pair<Pattern, Image> pict_read_pixel_pattern(StringReader& r);
   static std::shared_ptr<Region> pict_read_mask_region(StringReader& r,
@@ -166,6 +478,33 @@ protected:
   void pict_set_op_color(StringReader& r, uint16_t opcode);
   void pict_set_default_highlight_color(StringReader& r, uint16_t opcode);
 
+  // A fill pattern expanded to RGB pixels for a range of columns [x1, x2), so
+  // filling part of a row is a copy instead of a pattern lookup per pixel.
+  // The pattern is first expanded to a tile (8x8 for mono patterns, or the
+  // pixel pattern's size), then each row of the tile is repeated across the
+  // range. Mono patterns are aligned to the picture's bounds and pixel
+  // patterns to the canvas origin, as the per-pixel code did.
+  struct PatternSpans {
+    ssize_t x1;
+    size_t width;
+    size_t tile_height;
+    ssize_t origin_y;
+    std::vector<uint8_t> rows; // tile_height rows of width pixels
+
+    PatternSpans(const Pattern& pat, const Image& pixel_pat,
+        const Rect& pict_bounds, ssize_t x1, ssize_t x2);
+
+    // Returns the pixels for row y, starting at column x (which must be
+    // within [x1, x2))
+    inline const uint8_t* row(ssize_t y, ssize_t x) const {
+      ssize_t ty = (y - this->origin_y) % static_cast<ssize_t>(this->tile_height);
+      if (ty < 0) {
+        ty += this->tile_height;
+      }
+      return this->rows.data() + (ty * this->width + (x - this->x1)) * 3;
+    }
+  };
+
   void pict_fill_current_rect_with_pattern(const Pattern& pat, const Image& pixel_pat);
   void pict_erase_last_rect(StringReader& r, uint16_t opcode);
   void pict_erase_rect(StringReader& r, uint16_t opcode);
@@ -174,9 +513,10 @@ protected:
   void pict_fill_last_oval(StringReader& r, uint16_t opcode);
   void pict_fill_oval(StringReader& r, uint16_t opcode);
 
-  static std::string unpack_bits(StringReader& r, size_t row_count,
+  // These return buffers allocated from scratch_memory_resource()
+  static std::pmr::string unpack_bits(StringReader& r, size_t row_count,
       uint16_t row_bytes, bool sizes_are_words, bool chunks_are_words);
-  static std::string unpack_bits(StringReader& r, size_t row_count,
+  static std::pmr::string unpack_bits(StringReader& r, size_t row_count,
       uint16_t row_bytes, bool chunks_are_words);
 
   void pict_copy_bits_indexed_color(StringReader& r, uint16_t opcode);
@@ -191,6 +531,21 @@ protected:
   Image pict_decode_rpza(
       const PictQuickTimeImageDescription& desc,
       const std::string& data);
+  // Converts rows of packed pixels (in the format used by the raw and rle
+  // codecs) to an image
+  static Image pict_convert_quicktime_pixels(
+      const PictQuickTimeImageDescription& desc,
+      const std::vector<ColorTableEntry>& clut,
+      const std::string& data,
+      size_t row_bytes);
+  Image pict_decode_raw(
+      const PictQuickTimeImageDescription& desc,
+      const std::vector<ColorTableEntry>& clut,
+      const std::string& data);
+  Image pict_decode_rle(
+      const PictQuickTimeImageDescription& desc,
+      const std::vector<ColorTableEntry>& clut,
+      const std::string& data);
 
   void pict_write_quicktime_data(StringReader& r, uint16_t opcode);
 
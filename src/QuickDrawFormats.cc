@@ -8,7 +8,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <exception>
+#include <iterator>
+#include <map>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
@@ -18,6 +21,8 @@
 #include <vector>
 #include <string>
 
+#include "ResourceBudget.hh"
+
 using namespace std;
 
 
@@ -133,6 +138,8 @@ Region::Region(StringReader& r) : rendered(0, 0) {
   if (r.where() != start_offset + size) {
     throw runtime_error("region ends before all data is parsed");
   }
+
+  this->compute_scanlines();
 }
 
 Region::Region(const Rect& r) : rect(r), rendered(0, 0) { }
@@ -187,62 +194,95 @@ bool Region::is_inversion_point(int16_t x, int16_t y) const {
   return this->inversions.count(this->signature_for_inversion_point(x, y));
 }
 
+void Region::compute_scanlines() {
+  map<int16_t, vector<int16_t>> xs_for_row;
+  for (int32_t pt : this->inversions) {
+    xs_for_row[pt & 0xFFFF].emplace_back((pt >> 16) & 0xFFFF);
+  }
+
+  // Each row's xs is the symmetric difference of the previous row's xs and the
+  // inversion points in this row. Both lists are sorted, so this is a merge.
+  this->scanlines.clear();
+  vector<int16_t> prev_xs;
+  for (auto& it : xs_for_row) {
+    auto& row_xs = it.second;
+    sort(row_xs.begin(), row_xs.end());
+
+    auto& scanline = this->scanlines.emplace_back();
+    scanline.y = it.first;
+    scanline.xs.reserve(prev_xs.size() + row_xs.size());
+    set_symmetric_difference(prev_xs.begin(), prev_xs.end(),
+        row_xs.begin(), row_xs.end(), back_inserter(scanline.xs));
+    prev_xs = scanline.xs;
+  }
+}
+
 const Image& Region::render() const {
   size_t width = this->rect.width();
   size_t height = this->rect.height();
   if (this->rendered.get_width() != width || this->rendered.get_height() != height) {
+    check_resource_memory(width * height * 3, "region");
     this->rendered = Image(width, height);
-    this->rendered.clear(0xFF, 0xFF, 0xFF);
-
-    // TODO: there's probably a lower-time-complexity way to do this
-    for (int32_t pt : this->inversions) {
-      int16_t x = (pt >> 16) & 0xFFFF;
-      int16_t y = pt & 0xFFFF;
-      for (size_t yy = y; yy < height; yy++) {
-        for (size_t xx = x; xx < width; xx++) {
-          uint64_t r;
-          this->rendered.read_pixel(xx, yy, &r, nullptr, nullptr);
-          this->rendered.write_pixel(xx, yy, r ^ 0xFF, r ^ 0xFF, r ^ 0xFF);
+
+    // Fill each row span by span, using the scanline that applies to it
+    auto scanline_it = this->scanlines.begin();
+    const vector<int16_t>* xs = nullptr;
+    for (size_t yy = 0; yy < height; yy++) {
+      int32_t y = this->rect.y1 + yy;
+      while ((scanline_it != this->scanlines.end()) && (scanline_it->y <= y)) {
+        xs = &scanline_it->xs;
+        scanline_it++;
+      }
+
+      uint8_t v = 0xFF;
+      size_t xx = 0;
+      if (xs) {
+        for (int16_t inversion_x : *xs) {
+          int32_t end_xx = static_cast<int32_t>(inversion_x) - this->rect.x1;
+          if (end_xx > static_cast<int32_t>(width)) {
+            end_xx = width;
+          }
+          for (; static_cast<int32_t>(xx) < end_xx; xx++) {
+            this->rendered.write_pixel(xx, yy, v, v, v);
+          }
+          v ^= 0xFF;
         }
       }
+      for (; xx < width; xx++) {
+        this->rendered.write_pixel(xx, yy, v, v, v);
+      }
     }
   }
 
   return this->rendered;
 }
 
+const vector<int16_t>* Region::xs_for_row(int16_t y) const {
+  // Find the last scanline at or above y
+  auto scanline_it = upper_bound(this->scanlines.begin(), this->scanlines.end(), y,
+      [](int16_t y, const Scanline& s) -> bool {
+    return y < s.y;
+  });
+  if (scanline_it == this->scanlines.begin()) {
+    return nullptr;
+  }
+  scanline_it--;
+  return &scanline_it->xs;
+}
+
 bool Region::contains(int16_t x, int16_t y) const {
   if (x < this->rect.x1 || x >= this->rect.x2 ||
       y < this->rect.y1 || y >= this->rect.y2) {
     return false;
   }
 
-  // We could render the region, or we could count the number of inversions that
-  // are both above and to the left of the point in question. Rendering is slow
-  // the first time, but makes each subsequent contains() call constant-time,
-  // whereas counting is linear every time contains() is called. As a heuristic,
-  // if the bounds rect area is 1 million pixels or more, we assume that
-  // checking inversion points will be faster on average than rendering.
-  // Notably, some PICTs have insanely large clip regions defined for packed
-  // copy_bits opcodes, even though the PICT's overall bounds rect is fairly
-  // small - this heuristic makes those fast to render.
-  if (this->rect.width() * this->rect.height() >= 1000000) {
-    bool contained = true;
-    for (int32_t pt : this->inversions) {
-      int16_t pt_x = (pt >> 16) & 0xFFFF;
-      int16_t pt_y = pt & 0xFFFF;
-      if (pt_x <= x && pt_y <= y) {
-        contained = !contained;
-      }
-    }
-    return contained;
-
-  } else {
-    this->render();
-    uint64_t r;
-    this->rendered.read_pixel(x - this->rect.x1, y - this->rect.y1, &r, nullptr, nullptr);
-    return (r != 0);
+  // Count the inversions in the row that are at or to the left of x
+  const auto* xs = this->xs_for_row(y);
+  if (!xs) {
+    return true;
   }
+  size_t count = upper_bound(xs->begin(), xs->end(), x) - xs->begin();
+  return !(count & 1);
 }
 
 
@@ -506,6 +546,159 @@ const ColorTableEntry* ColorTable::get_entry(int16_t id) const {
   return nullptr;
 }
 
+static vector<ColorTableEntry> clut_from_colors(const vector<Color>& colors) {
+  vector<ColorTableEntry> ret;
+  for (const auto& c : colors) {
+    auto& entry = ret.emplace_back();
+    entry.color_num = ret.size() - 1;
+    entry.c = c;
+  }
+  return ret;
+}
+
+const vector<ColorTableEntry>& standard_clut_for_depth(uint8_t bits) {
+  static const vector<ColorTableEntry> clut1 = clut_from_colors({
+      Color(0xFFFF, 0xFFFF, 0xFFFF), Color(0x0000, 0x0000, 0x0000)});
+  static const vector<ColorTableEntry> clut2 = clut_from_colors({
+      Color(0xFFFF, 0xFFFF, 0xFFFF), Color(0xACAC, 0xACAC, 0xACAC),
+      Color(0x5555, 0x5555, 0x5555), Color(0x0000, 0x0000, 0x0000)});
+  static const vector<ColorTableEntry> clut4 = clut_from_colors({
+      Color(0xFFFF, 0xFFFF, 0xFFFF), // White
+      Color(0xFC00, 0xF37D, 0x052F), // Yellow
+      Color(0xFFFF, 0x648A, 0x028C), // Orange
+      Color(0xDD6B, 0x08C2, 0x06A2), // Red
+      Color(0xF2D7, 0x0856, 0x84EC), // Magenta
+      Color(0x46E3, 0x0000, 0xA53E), // Purple
+      Color(0x0000, 0x0000, 0xD400), // Blue
+      Color(0x0241, 0xAB54, 0xEAFF), // Cyan
+      Color(0x1F21, 0xB793, 0x1413), // Green
+      Color(0x0000, 0x64AF, 0x11B0), // Dark green
+      Color(0x5600, 0x2C9D, 0x0524), // Brown
+      Color(0x90D7, 0x7160, 0x3A34), // Tan
+      Color(0xC000, 0xC000, 0xC000), // Light gray
+      Color(0x8000, 0x8000, 0x8000), // Medium gray
+      Color(0x4000, 0x4000, 0x4000), // Dark gray
+      Color(0x0000, 0x0000, 0x0000), // Black
+  });
+  static const vector<ColorTableEntry> clut8 = []() {
+    // The 6x6x6 color cube (without black), then ramps of the other 10 levels
+    // of red, green, blue, and gray, then black
+    vector<Color> colors;
+    for (uint16_t r = 0; r < 6; r++) {
+      for (uint16_t g = 0; g < 6; g++) {
+        for (uint16_t b = 0; b < 6; b++) {
+          if ((r != 5) || (g != 5) || (b != 5)) {
+            colors.emplace_back(0xFFFF - r * 0x3333, 0xFFFF - g * 0x3333, 0xFFFF - b * 0x3333);
+          }
+        }
+      }
+    }
+    static const uint16_t ramp_levels[10] = {
+        0xEEEE, 0xDDDD, 0xBBBB, 0xAAAA, 0x8888, 0x7777, 0x5555, 0x4444, 0x2222, 0x1111};
+    for (uint16_t v : ramp_levels) {
+      colors.emplace_back(v, 0, 0);
+    }
+    for (uint16_t v : ramp_levels) {
+      colors.emplace_back(0, v, 0);
+    }
+    for (uint16_t v : ramp_levels) {
+      colors.emplace_back(0, 0, v);
+    }
+    for (uint16_t v : ramp_levels) {
+      colors.emplace_back(v, v, v);
+    }
+    colors.emplace_back(0, 0, 0);
+    return clut_from_colors(colors);
+  }();
+
+  switch (bits) {
+    case 1:
+      return clut1;
+    case 2:
+      return clut2;
+    case 4:
+      return clut4;
+    case 8:
+      return clut8;
+    default:
+      throw invalid_argument(string_printf(
+          "there is no standard color table for depth %hhu", bits));
+  }
+}
+
+// Row converters for decode_color_image. Each of these converts one row of a
+// pixel map to RGBA8888 values (as used by Image::write_pixel), and is
+// specialized on the pixel format so that the inner loops have no per-pixel
+// dispatch. The direct-color loops have no dependencies between pixels, so the
+// compiler can vectorize them.
+
+// For indexed-color images, the color table is expanded to one of these for
+// every possible pixel value, so it doesn't have to be searched for each pixel
+struct IndexedColorLUTEntry {
+  enum class Type : uint8_t {
+    MISSING = 0,
+    COLOR,
+    IMPLICIT_BLACK, // Not in the color table; not affected by the mask
+  };
+  uint32_t rgba;
+  Type type;
+};
+
+template <uint16_t PixelSize>
+static inline uint8_t indexed_pixel_value(const uint8_t* row, size_t x) {
+  if constexpr (PixelSize == 1) {
+    return (row[x / 8] >> (7 - (x & 7))) & 1;
+  } else if constexpr (PixelSize == 2) {
+    return (row[x / 4] >> (6 - ((x & 3) * 2))) & 3;
+  } else if constexpr (PixelSize == 4) {
+    return (row[x / 2] >> (4 - ((x & 1) * 4))) & 15;
+  } else {
+    static_assert(PixelSize == 8, "indexed pixel size must be 1, 2, 4, or 8");
+    return row[x];
+  }
+}
+
+template <uint16_t PixelSize>
+static void decode_indexed_row(uint32_t* out, const uint8_t* row,
+    const uint8_t* mask_row, size_t width, const IndexedColorLUTEntry* lut) {
+  for (size_t x = 0; x < width; x++) {
+    uint8_t color_id = indexed_pixel_value<PixelSize>(row, x);
+    const auto& e = lut[color_id];
+    if (e.type == IndexedColorLUTEntry::Type::COLOR) {
+      if (mask_row && !((mask_row[x / 8] >> (7 - (x & 7))) & 1)) {
+        out[x] = e.rgba & 0xFFFFFF00;
+      } else {
+        out[x] = e.rgba;
+      }
+    } else if (e.type == IndexedColorLUTEntry::Type::IMPLICIT_BLACK) {
+      out[x] = e.rgba;
+    } else {
+      throw runtime_error(string_printf("color %" PRIX32 " not found in color map", color_id));
+    }
+  }
+}
+
+static void decode_xrgb1555_row(uint32_t* out, const uint8_t* row, size_t width) {
+  const be_uint16_t* pixels = reinterpret_cast<const be_uint16_t*>(row);
+  for (size_t x = 0; x < width; x++) {
+    // We cheat by filling the lower 3 bits of each channel with the upper 3
+    // bits; this makes white (1F) actually white and black actually black when
+    // expanded to 8-bit channels
+    uint32_t c = pixels[x];
+    uint32_t r = ((c >> 7) & 0xF8) | ((c >> 12) & 0x07);
+    uint32_t g = ((c >> 2) & 0xF8) | ((c >> 7) & 0x07);
+    uint32_t b = ((c << 3) & 0xF8) | ((c >> 2) & 0x07);
+    out[x] = (r << 24) | (g << 16) | (b << 8) | 0xFF;
+  }
+}
+
+static void decode_xrgb8888_row(uint32_t* out, const uint8_t* row, size_t width) {
+  const be_uint32_t* pixels = reinterpret_cast<const be_uint32_t*>(row);
+  for (size_t x = 0; x < width; x++) {
+    out[x] = (pixels[x] << 8) | 0xFF;
+  }
+}
+
 Image decode_color_image(const PixelMapHeader& header,
     const PixelMapData& pixel_map, const ColorTable* ctable,
     const PixelMapData* mask_map, size_t mask_row_bytes) {
@@ -532,48 +725,99 @@ Image decode_color_image(const PixelMapHeader& header,
 
   size_t width = header.bounds.width();
   size_t height = header.bounds.height();
+  size_t row_bytes = header.flags_row_bytes & 0x3FFF;
   Image img(width, height, (mask_map != nullptr));
-  for (size_t y = 0; y < height; y++) {
-    for (size_t x = 0; x < width; x++) {
-      uint32_t color_id = pixel_map.lookup_entry(header.pixel_size,
-          header.flags_row_bytes & 0x3FFF, x, y);
-
-      if (header.pixel_type == 0) {
-        const auto* e = ctable->get_entry(color_id);
-        if (e) {
-          uint8_t alpha = 0xFF;
-          if (mask_map) {
-            alpha = mask_map->lookup_entry(1, mask_row_bytes, x, y) ? 0xFF : 0x00;
-          }
-          img.write_pixel(x, y, e->c.r >> 8, e->c.g >> 8, e->c.b >> 8, alpha);
 
-        // Some rare pixmaps appear to use 0xFF as black, so we handle that
-        // manually here. TODO: figure out if this is the right behavior
-        } else if (color_id == static_cast<uint32_t>((1 << header.pixel_size) - 1)) {
-          img.write_pixel(x, y, 0, 0, 0, 0xFF);
+  bool is_indexed = (header.pixel_type == 0);
+  uint16_t pixel_size = header.pixel_size;
+
+  // Build the color lookup table for indexed images
+  IndexedColorLUTEntry lut[0x100];
+  if (is_indexed && (pixel_size <= 8)) {
+    uint32_t num_colors = 1 << pixel_size;
+    for (uint32_t color_id = 0; color_id < num_colors; color_id++) {
+      const auto* e = ctable->get_entry(color_id);
+      if (e) {
+        lut[color_id].rgba = ((e->c.r >> 8) << 24) | ((e->c.g >> 8) << 16) |
+            ((e->c.b >> 8) << 8) | 0xFF;
+        lut[color_id].type = IndexedColorLUTEntry::Type::COLOR;
+
+      // Some rare pixmaps appear to use 0xFF as black, so we handle that
+      // manually here. TODO: figure out if this is the right behavior
+      } else if (color_id == num_colors - 1) {
+        lut[color_id].rgba = 0x000000FF;
+        lut[color_id].type = IndexedColorLUTEntry::Type::IMPLICIT_BLACK;
 
+      } else {
+        lut[color_id].rgba = 0;
+        lut[color_id].type = IndexedColorLUTEntry::Type::MISSING;
+      }
+    }
+  }
+
+  void (*decode_direct_row)(uint32_t*, const uint8_t*, size_t) = nullptr;
+  void (*decode_indexed_row_fn)(uint32_t*, const uint8_t*, const uint8_t*,
+      size_t, const IndexedColorLUTEntry*) = nullptr;
+  if (is_indexed) {
+    switch (pixel_size) {
+      case 1:
+        decode_indexed_row_fn = &decode_indexed_row<1>;
+        break;
+      case 2:
+        decode_indexed_row_fn = &decode_indexed_row<2>;
+        break;
+      case 4:
+        decode_indexed_row_fn = &decode_indexed_row<4>;
+        break;
+      case 8:
+        decode_indexed_row_fn = &decode_indexed_row<8>;
+        break;
+    }
+  } else if (pixel_size == 0x0010 && header.component_size == 5) {
+    decode_direct_row = &decode_xrgb1555_row;
+  } else if (pixel_size == 0x0020 && header.component_size == 8) {
+    decode_direct_row = &decode_xrgb8888_row;
+  }
+
+  if (!decode_direct_row && !decode_indexed_row_fn) {
+    // Unusual pixel sizes (e.g. indexed images with more than 8 bits per
+    // pixel) go through the generic per-pixel path
+    for (size_t y = 0; y < height; y++) {
+      for (size_t x = 0; x < width; x++) {
+        uint32_t color_id = pixel_map.lookup_entry(pixel_size, row_bytes, x, y);
+        if (is_indexed) {
+          const auto* e = ctable->get_entry(color_id);
+          if (e) {
+            uint8_t alpha = 0xFF;
+            if (mask_map) {
+              alpha = mask_map->lookup_entry(1, mask_row_bytes, x, y) ? 0xFF : 0x00;
+            }
+            img.write_pixel(x, y, e->c.r >> 8, e->c.g >> 8, e->c.b >> 8, alpha);
+          } else if (color_id == static_cast<uint32_t>((1 << pixel_size) - 1)) {
+            img.write_pixel(x, y, 0, 0, 0, 0xFF);
+          } else {
+            throw runtime_error(string_printf("color %" PRIX32 " not found in color map", color_id));
+          }
         } else {
-          throw runtime_error(string_printf("color %" PRIX32 " not found in color map", color_id));
+          throw runtime_error("unsupported pixel format");
         }
-
-      } else if (header.pixel_size == 0x0010 && header.component_size == 5) {
-        // xrgb1555. We cheat by filling the lower 3 bits of each channel with
-        // the upper 3 bits; this makes white (1F) actually white and black
-        // actually black when expanded to 8-bit channels
-        uint8_t r = ((color_id >> 7) & 0xF8) | ((color_id >> 12) & 0x07);
-        uint8_t g = ((color_id >> 2) & 0xF8) | ((color_id >> 7) & 0x07);
-        uint8_t b = ((color_id << 3) & 0xF8) | ((color_id >> 2) & 0x07);
-        img.write_pixel(x, y, r, g, b, 0xFF);
-
-      } else if (header.pixel_size == 0x0020 && header.component_size == 8) {
-        // xrgb8888
-        img.write_pixel(x, y, (color_id >> 16) & 0xFF, (color_id >> 8) & 0xFF,
-            color_id & 0xFF, 0xFF);
-
-      } else {
-        throw runtime_error("unsupported pixel format");
       }
     }
+    return img;
+  }
+
+  vector<uint32_t> row_colors(width);
+  for (size_t y = 0; y < height; y++) {
+    const uint8_t* row = pixel_map.data + y * row_bytes;
+    if (decode_indexed_row_fn) {
+      const uint8_t* mask_row = mask_map ? (mask_map->data + y * mask_row_bytes) : nullptr;
+      decode_indexed_row_fn(row_colors.data(), row, mask_row, width, lut);
+    } else {
+      decode_direct_row(row_colors.data(), row, width);
+    }
+    for (size_t x = 0; x < width; x++) {
+      img.write_pixel(x, y, row_colors[x]);
+    }
   }
   return img;
 }
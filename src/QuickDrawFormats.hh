@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <phosg/Image.hh>
 #include <phosg/Strings.hh>
 #include <unordered_set>
@@ -111,6 +112,17 @@ struct Region {
   std::unordered_set<int32_t> inversions;
   mutable Image rendered;
 
+  // The inversion points, organized by row. Each entry applies to all rows
+  // from y until the next entry's y, and xs contains the x coordinates of the
+  // inversion points in all rows up to and including y, with pairs at the same
+  // x cancelled out (so it's sorted, and a point (x, y) is in the region iff an
+  // even number of entries in xs are <= x).
+  struct Scanline {
+    int16_t y;
+    std::vector<int16_t> xs;
+  };
+  std::vector<Scanline> scanlines;
+
   Region(StringReader& r);
   Region(const Rect& r);
 
@@ -121,9 +133,47 @@ struct Region {
 
   bool is_inversion_point(int16_t x, int16_t y) const;
 
+  void compute_scanlines();
+
   const Image& render() const;
 
+  // Returns the inversion points that apply to row y (see Scanline), or null
+  // if y is above all of them (so the entire row within rect is inside)
+  const std::vector<int16_t>* xs_for_row(int16_t y) const;
+
   bool contains(int16_t x, int16_t y) const;
+
+  // Calls fn(span_x1, span_x2) for each run of pixels [span_x1, span_x2) in
+  // row y that's inside the region and within [x1, x2), from left to right.
+  // This looks up the row's inversion points only once, so it's much faster
+  // than calling contains() for each pixel.
+  template <typename FnT>
+  void for_each_span_in_row(ssize_t y, ssize_t x1, ssize_t x2, FnT&& fn) const {
+    x1 = std::max<ssize_t>(x1, this->rect.x1);
+    x2 = std::min<ssize_t>(x2, this->rect.x2);
+    if ((x1 >= x2) || (y < this->rect.y1) || (y >= this->rect.y2)) {
+      return;
+    }
+    const auto* xs = this->xs_for_row(y);
+    if (!xs) {
+      fn(x1, x2);
+      return;
+    }
+    // A pixel is inside iff an even number of points in xs are <= its x
+    auto it = std::upper_bound(xs->begin(), xs->end(), x1);
+    bool inside = !((it - xs->begin()) & 1);
+    ssize_t span_x1 = x1;
+    for (; (it != xs->end()) && (*it < x2); it++) {
+      if (inside) {
+        fn(span_x1, static_cast<ssize_t>(*it));
+      }
+      span_x1 = *it;
+      inside = !inside;
+    }
+    if (inside) {
+      fn(span_x1, x2);
+    }
+  }
 };
 
 
@@ -223,6 +273,11 @@ struct ColorTable {
   const ColorTableEntry* get_entry(int16_t id) const;
 } __attribute__((packed));
 
+// Returns the standard color table for the given depth (1, 2, 4, or 8 bits per
+// pixel), which is the same as the System file's clut resource with that ID.
+// Throws invalid_argument for other depths.
+const std::vector<ColorTableEntry>& standard_clut_for_depth(uint8_t bits);
+
 
 
 struct PaletteEntry {
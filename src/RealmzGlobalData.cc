@@ -64,8 +64,8 @@ RealmzGlobalData::RealmzGlobalData(const string& dir) : dir(dir) {
       (this->dir + "/Portraits/..namedfork/rsrc"),
       (this->dir + "/PORTRAITS/..namedfork/rsrc")});
 
-  this->global_rsf = parse_resource_fork(load_file(the_family_jewels_name));
-  this->portraits_rsf = parse_resource_fork(load_file(portraits_name));
+  this->global_rsf = parse_resource_fork(make_shared<MappedFile>(the_family_jewels_name));
+  this->portraits_rsf = parse_resource_fork(make_shared<MappedFile>(portraits_name));
   this->load_default_tilesets();
 }
 
@@ -95,6 +95,57 @@ void RealmzGlobalData::load_default_tilesets() {
   }
 }
 
+shared_ptr<const Image> RealmzGlobalData::decode_PICT_cached(
+    ResourceFile& rf, int16_t id) {
+  // get_PICT decodes on a cache miss, so it has to be called with the lock
+  // held. Most calls are hits (the map renderers' patterns are decoded before
+  // they start), so this rarely waits.
+  shared_ptr<const Image> ret;
+  {
+    lock_guard<mutex> g(this->decode_lock);
+    ret = this->image_cache.get_PICT(rf, id);
+  }
+  if (!ret) {
+    throw out_of_range(string_printf("PICT %hd is missing", id));
+  }
+  return ret;
+}
+
+shared_ptr<const Image> RealmzGlobalData::decode_cicn_cached(
+    ResourceFile& rf, int16_t id) {
+  auto ret = this->image_cache.get(rf, RESOURCE_TYPE_cicn, id, 0,
+      [&]() -> shared_ptr<const Image> {
+    lock_guard<mutex> g(this->decode_lock);
+    if (!rf.resource_exists(RESOURCE_TYPE_cicn, id)) {
+      return nullptr;
+    }
+    return make_shared<Image>(move(rf.decode_cicn(id).image));
+  });
+  if (!ret) {
+    throw out_of_range(string_printf("cicn %hd is missing", id));
+  }
+  return ret;
+}
+
+shared_ptr<const TileAtlas> RealmzGlobalData::get_tile_atlas(
+    const ResourceFile& rf, uint32_t type, int16_t id, uint32_t variant,
+    const function<shared_ptr<const TileAtlas>()>& build) {
+  auto key = make_tuple(&rf, type, id, variant);
+  {
+    lock_guard<mutex> g(this->tile_atlases_lock);
+    auto it = this->tile_atlases.find(key);
+    if (it != this->tile_atlases.end()) {
+      return it->second;
+    }
+  }
+
+  // Build the atlas without holding the lock; if another thread built the
+  // same one in the meantime, use that one instead
+  auto atlas = build();
+  lock_guard<mutex> g(this->tile_atlases_lock);
+  return this->tile_atlases.emplace(key, atlas).first->second;
+}
+
 static unordered_map<string, int16_t> land_type_to_resource_id({
   {"outdoor",  300},
   {"dungeon",  302},
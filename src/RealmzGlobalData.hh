@@ -4,13 +4,20 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <phosg/Image.hh>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <string>
 
+#include "DecodedImageCache.hh"
 #include "ResourceFile.hh"
+#include "TileAtlas.hh"
 
 
 
@@ -49,10 +56,38 @@ struct RealmzGlobalData {
 
   void load_default_tilesets();
 
+  // Returns the decoded PICT from rf, which should be global_rsf or a
+  // scenario's resource file. Decoded PICTs are shared between the global data
+  // and all scenarios that use it, since the same patterns are used in many
+  // maps. Throws out_of_range if rf doesn't contain the PICT. This and
+  // decode_cicn_cached may be called from multiple threads (the map renderers
+  // run in parallel); decoding is serialized, so this doesn't rely on
+  // ResourceFile supporting concurrent use.
+  std::shared_ptr<const Image> decode_PICT_cached(ResourceFile& rf, int16_t id);
+  // Like decode_PICT_cached, but for cicn resources (used for masked tiles and
+  // map annotations).
+  std::shared_ptr<const Image> decode_cicn_cached(ResourceFile& rf, int16_t id);
+
+  // Returns the tile atlas built from the given resource, calling build to
+  // make it if it doesn't exist yet. variant distinguishes different atlases
+  // built from the same resource. Atlases are kept for the lifetime of this
+  // object, since there are only as many as there are tilesets and cicns.
+  std::shared_ptr<const TileAtlas> get_tile_atlas(const ResourceFile& rf,
+      uint32_t type, int16_t id, uint32_t variant,
+      const std::function<std::shared_ptr<const TileAtlas>()>& build);
+
   std::string dir;
   ResourceFile global_rsf;
   ResourceFile portraits_rsf;
   std::unordered_map<std::string, TileSetDefinition> land_type_to_tileset_definition;
+  DecodedImageCache image_cache;
+
+private:
+  // Held while decoding resources for the image cache
+  std::mutex decode_lock;
+  std::mutex tile_atlases_lock;
+  std::map<std::tuple<const ResourceFile*, uint32_t, int16_t, uint32_t>,
+      std::shared_ptr<const TileAtlas>> tile_atlases;
 };
 
 std::string first_file_that_exists(const std::vector<std::string>& names);
@@ -18,6 +18,7 @@
 #include <vector>
 
 #include "IndexFormats/Formats.hh"
+#include "ParallelTasks.hh"
 #include "ResourceFile.hh"
 
 using namespace std;
@@ -123,7 +124,7 @@ RealmzScenarioData::RealmzScenarioData(
     this->global_metadata = this->load_global_metadata(global_metadata_name);
   }
   this->scenario_metadata = this->load_scenario_metadata(scenario_metadata_name);
-  this->scenario_rsf = parse_resource_fork(load_file(scenario_resources_name));
+  this->scenario_rsf = parse_resource_fork(make_shared<MappedFile>(scenario_resources_name));
 
   // Load layout separately because it doesn't have to exist
   {
@@ -234,15 +235,17 @@ Image RealmzScenarioData::render_party_map(size_t index) {
     if (!a.icon_id) {
       continue;
     }
-    Image cicn;
+    shared_ptr<const Image> cicn_img;
     try {
-      cicn = this->scenario_rsf.decode_cicn(a.icon_id).image;
+      cicn_img = this->global.decode_cicn_cached(this->scenario_rsf, a.icon_id);
     } catch (const out_of_range&) { }
     try {
-      cicn = this->global.global_rsf.decode_cicn(a.icon_id).image;
+      cicn_img = this->global.decode_cicn_cached(this->global.global_rsf, a.icon_id);
     } catch (const out_of_range&) { }
+    static const Image empty_cicn;
+    const Image& cicn = cicn_img ? *cicn_img : empty_cicn;
     if (cicn.get_width() == 0 || cicn.get_height() == 0) {
-      fprintf(stderr, "warning: map refers to missing cicn %hd\n", a.icon_id.load());
+      fprintf(current_task_log_stream(), "warning: map refers to missing cicn %hd\n", a.icon_id.load());
     } else {
       // It appears that annotations should render centered on the tile on which
       // they are defined, so we may need to adjust dest x/y is the cicn size
@@ -1944,6 +1947,11 @@ string RealmzScenarioData::disassemble_all_level_aps(bool dungeon) {
 ////////////////////////////////////////////////////////////////////////////////
 // DATA DL
 
+// Variants for RealmzGlobalData::get_tile_atlas
+static constexpr uint32_t TILE_ATLAS_VARIANT_LAND = 0;
+static constexpr uint32_t TILE_ATLAS_VARIANT_DUNGEON = 1;
+static constexpr uint32_t TILE_ATLAS_VARIANT_CICN = 2;
+
 static uint16_t location_sig(uint8_t x, uint8_t y) {
   return ((uint16_t)x << 8) | y;
 }
@@ -1974,14 +1982,37 @@ Image RealmzScenarioData::generate_dungeon_map(int16_t level_num, uint8_t x0,
   }
 
   Image map(w * 16, h * 16);
-  size_t pattern_x = 576, pattern_y = 320;
+  map.fill_rect(0, 0, w * 16, h * 16, 0x000000FF);
 
   unordered_map<uint16_t, vector<int>> loc_to_ap_nums;
   for (size_t x = 0; x < aps.size(); x++) {
     loc_to_ap_nums[location_sig(aps[x].get_x(), aps[x].get_y())].push_back(x);
   }
 
-  Image dungeon_pattern = this->global.global_rsf.decode_PICT(302).image;
+  // The dungeon tiles are 16x16 images in the lower-right corner of PICT 302,
+  // drawn over a black background with white as the transparent color
+  static const vector<pair<uint16_t, pair<size_t, size_t>>> dungeon_tile_sources({
+    {DUNGEON_TILE_WALL,         {576 + 0,  320 + 0}},
+    {DUNGEON_TILE_VERT_DOOR,    {576 + 16, 320 + 0}},
+    {DUNGEON_TILE_HORIZ_DOOR,   {576 + 32, 320 + 0}},
+    {DUNGEON_TILE_STAIRS,       {576 + 48, 320 + 0}},
+    {DUNGEON_TILE_COLUMNS,      {576 + 0,  320 + 16}},
+    {DUNGEON_TILE_SECRET_UP,    {576 + 0,  320 + 32}},
+    {DUNGEON_TILE_SECRET_RIGHT, {576 + 16, 320 + 32}},
+    {DUNGEON_TILE_SECRET_DOWN,  {576 + 32, 320 + 32}},
+    {DUNGEON_TILE_SECRET_LEFT,  {576 + 48, 320 + 32}},
+  });
+  auto dungeon_atlas = this->global.get_tile_atlas(this->global.global_rsf,
+      RESOURCE_TYPE_PICT, 302, TILE_ATLAS_VARIANT_DUNGEON,
+      [&]() -> shared_ptr<const TileAtlas> {
+    auto dungeon_pattern = this->global.decode_PICT_cached(this->global.global_rsf, 302);
+    auto atlas = make_shared<TileAtlas>(false);
+    for (const auto& it : dungeon_tile_sources) {
+      atlas->add_masked_tile(*dungeon_pattern, it.second.first,
+          it.second.second, 16, 16, 0xFFFFFFFF);
+    }
+    return atlas;
+  });
 
   for (ssize_t y = y0 + h - 1; y >= y0; y--) {
     for (ssize_t x = x0 + w - 1; x >= x0; x--) {
@@ -1989,42 +2020,10 @@ Image RealmzScenarioData::generate_dungeon_map(int16_t level_num, uint8_t x0,
 
       size_t xp = (x - x0) * 16;
       size_t yp = (y - y0) * 16;
-      map.fill_rect(xp, yp, 16, 16, 0x000000FF);
-      if (data & DUNGEON_TILE_WALL) {
-        map.mask_blit(dungeon_pattern, xp, yp, 16, 16, pattern_x + 0,
-            pattern_y + 0, 0xFFFFFFFF);
-      }
-      if (data & DUNGEON_TILE_VERT_DOOR) {
-        map.mask_blit(dungeon_pattern, xp, yp, 16, 16, pattern_x + 16,
-            pattern_y + 0, 0xFFFFFFFF);
-      }
-      if (data & DUNGEON_TILE_HORIZ_DOOR) {
-        map.mask_blit(dungeon_pattern, xp, yp, 16, 16, pattern_x + 32,
-            pattern_y + 0, 0xFFFFFFFF);
-      }
-      if (data & DUNGEON_TILE_STAIRS) {
-        map.mask_blit(dungeon_pattern, xp, yp, 16, 16, pattern_x + 48,
-            pattern_y + 0, 0xFFFFFFFF);
-      }
-      if (data & DUNGEON_TILE_COLUMNS) {
-        map.mask_blit(dungeon_pattern, xp, yp, 16, 16, pattern_x + 0,
-            pattern_y + 16, 0xFFFFFFFF);
-      }
-      if (data & DUNGEON_TILE_SECRET_UP) {
-        map.mask_blit(dungeon_pattern, xp, yp, 16, 16, pattern_x + 0,
-            pattern_y + 32, 0xFFFFFFFF);
-      }
-      if (data & DUNGEON_TILE_SECRET_RIGHT) {
-        map.mask_blit(dungeon_pattern, xp, yp, 16, 16, pattern_x + 16,
-            pattern_y + 32, 0xFFFFFFFF);
-      }
-      if (data & DUNGEON_TILE_SECRET_DOWN) {
-        map.mask_blit(dungeon_pattern, xp, yp, 16, 16, pattern_x + 32,
-            pattern_y + 32, 0xFFFFFFFF);
-      }
-      if (data & DUNGEON_TILE_SECRET_LEFT) {
-        map.mask_blit(dungeon_pattern, xp, yp, 16, 16, pattern_x + 48,
-            pattern_y + 32, 0xFFFFFFFF);
+      for (size_t z = 0; z < dungeon_tile_sources.size(); z++) {
+        if (data & dungeon_tile_sources[z].first) {
+          dungeon_atlas->draw(map, z, xp, yp);
+        }
       }
 
       size_t text_xp = xp + 1;
@@ -2098,7 +2097,7 @@ Image RealmzScenarioData::generate_land_map(int16_t level_num, uint8_t x0,
     try {
       n = this->layout.get_level_neighbors(level_num);
     } catch (const runtime_error& e) {
-      fprintf(stderr, "warning: can\'t get neighbors for level (%s)\n", e.what());
+      fprintf(current_task_log_stream(), "warning: can\'t get neighbors for level (%s)\n", e.what());
     }
   }
 
@@ -2162,12 +2161,29 @@ Image RealmzScenarioData::generate_land_map(int16_t level_num, uint8_t x0,
     }
   }
 
-  // Load the positive pattern
+  // Load the positive pattern. Tile N (1-200) is at ((N - 1) % 20) * 32,
+  // ((N - 1) / 20) * 32 in the pattern.
   int16_t resource_id = resource_id_for_land_type(metadata.land_type);
-  Image positive_pattern =
+  ResourceFile& pattern_rsf =
       this->scenario_rsf.resource_exists(RESOURCE_TYPE_PICT, resource_id)
-      ? this->scenario_rsf.decode_PICT(resource_id).image
-      : this->global.global_rsf.decode_PICT(resource_id).image;
+      ? this->scenario_rsf : this->global.global_rsf;
+  auto positive_atlas = this->global.get_tile_atlas(pattern_rsf,
+      RESOURCE_TYPE_PICT, resource_id, TILE_ATLAS_VARIANT_LAND,
+      [&]() -> shared_ptr<const TileAtlas> {
+    auto positive_pattern = this->global.decode_PICT_cached(pattern_rsf, resource_id);
+    auto atlas = make_shared<TileAtlas>(false);
+    atlas->add_tile_grid(*positive_pattern, 32, 32, 20, 200);
+    return atlas;
+  });
+  auto get_cicn_atlas = [&](ResourceFile& rf, int16_t id) -> shared_ptr<const TileAtlas> {
+    return this->global.get_tile_atlas(rf, RESOURCE_TYPE_cicn, id,
+        TILE_ATLAS_VARIANT_CICN, [&]() -> shared_ptr<const TileAtlas> {
+      auto cicn = this->global.decode_cicn_cached(rf, id);
+      auto atlas = make_shared<TileAtlas>(false);
+      atlas->add_tile(*cicn, 0, 0, cicn->get_width(), cicn->get_height());
+      return atlas;
+    });
+  };
 
   for (size_t y = y0; y < y0 + h; y++) {
     for (size_t x = x0; x < x0 + w; x++) {
@@ -2184,24 +2200,25 @@ Image RealmzScenarioData::generate_land_map(int16_t level_num, uint8_t x0,
 
       // Draw the tile itself
       if (data < 0 || data > 200) { // Masked tile
-        Image cicn;
+        shared_ptr<const TileAtlas> cicn_atlas;
         if (this->scenario_rsf.resource_exists(RESOURCE_TYPE_cicn, data)) {
-          cicn = this->scenario_rsf.decode_cicn(data).image;
+          cicn_atlas = get_cicn_atlas(this->scenario_rsf, data);
         } else if (this->global.global_rsf.resource_exists(RESOURCE_TYPE_cicn, data)) {
-          cicn = this->global.global_rsf.decode_cicn(data).image;
+          cicn_atlas = get_cicn_atlas(this->global.global_rsf, data);
         }
 
         // If neither cicn was valid, draw an error tile
-        if (cicn.get_width() == 0 || cicn.get_height() == 0) {
+        if (!cicn_atlas || cicn_atlas->tile_width(0) == 0 ||
+            cicn_atlas->tile_height(0) == 0) {
           map.fill_rect(xp, yp, 32, 32, 0x000000FF);
           map.draw_text(xp + 2, yp + 30 - 9, 0xFFFFFFFF, 0x000000FF, "%04hX", data);
 
         } else {
           if (tileset->base_tile_id) {
             size_t source_id = tileset->base_tile_id - 1;
-            size_t sxp = (source_id % 20) * 32;
-            size_t syp = (source_id / 20) * 32;
-            map.blit(positive_pattern, xp, yp, 32, 32, sxp, syp);
+            if (source_id < positive_atlas->size()) {
+              positive_atlas->draw(map, source_id, xp, yp);
+            }
           } else {
             map.fill_rect(xp, yp, 32, 32, 0x000000FF);
           }
@@ -2209,21 +2226,18 @@ Image RealmzScenarioData::generate_land_map(int16_t level_num, uint8_t x0,
           // Negative tile images may be >32px in either dimension, and are
           // anchored at the lower-right corner, so we have to adjust the
           // destination x/y appropriately
-          map.blit(
-              cicn,
-              xp - (cicn.get_width() - 32),
-              yp - (cicn.get_height() - 32),
-              cicn.get_width(),
-              cicn.get_height(),
+          cicn_atlas->draw(
+              map,
               0,
-              0);
+              xp - (cicn_atlas->tile_width(0) - 32),
+              yp - (cicn_atlas->tile_height(0) - 32));
         }
 
       } else if (data <= 200) { // Standard tile
         size_t source_id = data - 1;
-        size_t sxp = (source_id % 20) * 32;
-        size_t syp = (source_id / 20) * 32;
-        map.blit(positive_pattern, xp, yp, 32, 32, sxp, syp);
+        if (source_id < positive_atlas->size()) {
+          positive_atlas->draw(map, source_id, xp, yp);
+        }
 
         // If it's a path, shade it red
         if (tileset->tiles[data].is_path) {
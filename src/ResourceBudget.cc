@@ -0,0 +1,47 @@
+#include "ResourceBudget.hh"
+
+#include <inttypes.h>
+
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+using namespace std;
+
+
+
+static thread_local const ResourceBudget* active_budget = nullptr;
+static thread_local uint64_t active_deadline = 0;
+
+ResourceBudgetScope::ResourceBudgetScope(const ResourceBudget& budget)
+  : prev_budget(active_budget), prev_deadline(active_deadline) {
+  active_budget = &budget;
+  active_deadline = budget.max_usecs ? (now() + budget.max_usecs) : 0;
+}
+
+ResourceBudgetScope::~ResourceBudgetScope() {
+  active_budget = this->prev_budget;
+  active_deadline = this->prev_deadline;
+}
+
+const ResourceBudget* current_resource_budget() {
+  return active_budget;
+}
+
+uint64_t current_resource_deadline() {
+  return active_deadline;
+}
+
+void check_resource_deadline(const char* what) {
+  if (active_deadline && (now() >= active_deadline)) {
+    throw budget_exceeded(string_printf("%s exceeded the time limit of %" PRIu64 " usecs",
+        what, active_budget->max_usecs));
+  }
+}
+
+void check_resource_memory(size_t bytes, const char* what) {
+  if (active_budget && active_budget->max_memory_bytes &&
+      (bytes > active_budget->max_memory_bytes)) {
+    throw budget_exceeded(string_printf("%s needs %zu bytes, which exceeds the memory limit of %zu bytes",
+        what, bytes, active_budget->max_memory_bytes));
+  }
+}
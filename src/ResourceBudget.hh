@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <stdexcept>
+#include <string>
+
+
+
+// Limits on the work done for one resource, so a pathological resource (e.g.
+// an emulated decompressor stuck in a loop, or a PICT with enormous bounds)
+// can't stall a batch. Each limit is disabled if it's zero.
+struct ResourceBudget {
+  // Instructions executed by each emulated decompressor
+  uint64_t max_emulated_cycles = 0;
+  // Wall-clock time for everything done within the ResourceBudgetScope
+  uint64_t max_usecs = 0;
+  // Largest single allocation that a decoder or decompressor may make (e.g.
+  // an emulated decompressor's memory or a PICT's canvas)
+  size_t max_memory_bytes = 0;
+
+  inline bool is_unlimited() const {
+    return !this->max_emulated_cycles && !this->max_usecs && !this->max_memory_bytes;
+  }
+};
+
+// Thrown when a budget limit is reached. decompress_resource handles this by
+// marking the resource with FLAG_DECOMPRESSION_FAILED instead of trying other
+// decompressors; decoders let it propagate to their callers.
+class budget_exceeded : public std::runtime_error {
+public:
+  explicit budget_exceeded(const std::string& what) : runtime_error(what) { }
+  ~budget_exceeded() = default;
+};
+
+// While a ResourceBudgetScope exists on a thread, the library enforces its
+// budget for work done on that thread. The wall-clock limit is measured from
+// when the scope is created. Scopes may be nested; the innermost one applies.
+class ResourceBudgetScope {
+public:
+  explicit ResourceBudgetScope(const ResourceBudget& budget);
+  ResourceBudgetScope(const ResourceBudgetScope&) = delete;
+  ResourceBudgetScope(ResourceBudgetScope&&) = delete;
+  ResourceBudgetScope& operator=(const ResourceBudgetScope&) = delete;
+  ResourceBudgetScope& operator=(ResourceBudgetScope&&) = delete;
+  ~ResourceBudgetScope();
+
+private:
+  const ResourceBudget* prev_budget;
+  uint64_t prev_deadline;
+};
+
+// Returns the current thread's budget, or null if there's no active scope.
+const ResourceBudget* current_resource_budget();
+// Returns the time (as from phosg's now()) at which the current budget's
+// wall-clock limit expires, or 0 if there's no limit.
+uint64_t current_resource_deadline();
+
+// These throw budget_exceeded if the current budget's wall-clock limit has
+// passed, or if an allocation of the given size would exceed its memory
+// limit. what describes the work being done, for the error message.
+void check_resource_deadline(const char* what);
+void check_resource_memory(size_t bytes, const char* what);
@@ -1,19 +1,32 @@
 #include "ResourceCompression.hh"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <exception>
+#include <mutex>
 #include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
 #include <phosg/Time.hh>
+#include <thread>
+#include <unordered_set>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
 #include "Emulators/M68KEmulator.hh"
 #include "Emulators/PPC32Emulator.hh"
+#include "Decompressors/Codecs.hh"
 #include "Decompressors/System.hh"
+#include "DecodeStats.hh"
+#include "ParallelTasks.hh"
+#include "ResourceBudget.hh"
 
 using namespace std;
 using Resource = ResourceFile::Resource;
@@ -23,6 +36,9 @@ using Resource = ResourceFile::Resource;
 shared_ptr<const Resource> get_system_decompressor(
     bool use_ncmp, int16_t resource_id) {
   static unordered_map<uint64_t, shared_ptr<const Resource>> id_to_res;
+  // resource_dasm may decompress resources on multiple threads (--jobs)
+  static mutex id_to_res_lock;
+  lock_guard<mutex> g(id_to_res_lock);
 
   // If it's already in the cache, just return it verbatim
   uint32_t resource_type = use_ncmp ? RESOURCE_TYPE_ncmp : RESOURCE_TYPE_dcmp;
@@ -83,6 +99,241 @@ struct PPC32DecompressorInputHeader {
 
 
 
+static shared_ptr<LoadedDecompressor> load_decompressor(
+    shared_ptr<const Resource> dcmp_res, bool verbose) {
+  shared_ptr<LoadedDecompressor> ret(new LoadedDecompressor());
+  ret->dcmp_res = dcmp_res;
+  ret->mem.reset(new MemoryContext());
+  ret->entry_pc = 0;
+  ret->entry_r2 = 0;
+
+  if (dcmp_res->type == RESOURCE_TYPE_dcmp) {
+    ret->is_ppc = false;
+
+    // Figure out where in the dcmp to start execution. There appear to be
+    // two formats: one that has 'dcmp' in bytes 4-8 where execution appears
+    // to just start at byte 0 (usually it's a branch opcode), and one where
+    // the first three words appear to be offsets to various functions,
+    // followed by code. The second word appears to be the main entry point
+    // in this format, so we use that to determine where to start execution.
+    // TODO: It looks like the decompression implementation in ResEdit
+    // assumes the second format (with the three offsets) if and only if the
+    // compressed resource has header format 9. This feels kind of bad
+    // because... shouldn't the dcmp format be a property of the dcmp
+    // resource, not the resource being decompressed? We use a heuristic
+    // here instead, which seems correct for all decompressors I've seen.
+    // TODO: Call init and exit for decompressors that have them. It's not
+    // clear (yet) what the arguments to init and exit should be... they
+    // each apparently take one argument based on how the adjust the stack
+    // before returning, but every decompressor I've seen ignores the
+    // argument.
+    uint32_t entry_offset;
+    if (dcmp_res->data.size() < 10) {
+      throw runtime_error("decompressor resource is too short");
+    }
+    if (dcmp_res->data.substr(4, 4) == "dcmp") {
+      entry_offset = 0;
+    } else {
+      entry_offset = *reinterpret_cast<const be_uint16_t*>(
+          dcmp_res->data.data() + 2);
+    }
+
+    // Load the dcmp into emulated memory
+    size_t code_region_size = dcmp_res->data.size();
+    uint32_t code_addr = 0xF0000000;
+    ret->mem->allocate_at(code_addr, code_region_size);
+    ret->mem->memcpy(code_addr, dcmp_res->data.data(), dcmp_res->data.size());
+
+    ret->entry_pc = code_addr + entry_offset;
+    if (verbose) {
+      fprintf(current_task_log_stream(), "loaded code at %08" PRIX32 ":%zX\n", code_addr, code_region_size);
+      fprintf(current_task_log_stream(), "dcmp entry offset is %08" PRIX32 " (loaded at %" PRIX32 ")\n",
+          entry_offset, ret->entry_pc);
+    }
+
+  } else if (dcmp_res->type == RESOURCE_TYPE_ncmp) {
+    PEFFFile f("<ncmp>", dcmp_res->data);
+    f.load_into("<ncmp>", ret->mem, 0xF0000000);
+    ret->is_ppc = f.is_ppc();
+
+    // ncmp decompressors don't appear to define any of the standard export
+    // symbols (init/main/term); instead, they define a single export symbol
+    // in the export table.
+    if (!f.init().name.empty()) {
+      throw runtime_error("ncmp decompressor has init symbol");
+    }
+    if (!f.main().name.empty()) {
+      throw runtime_error("ncmp decompressor has main symbol");
+    }
+    if (!f.term().name.empty()) {
+      throw runtime_error("ncmp decompressor has term symbol");
+    }
+    const auto& exports = f.exports();
+    if (exports.size() != 1) {
+      throw runtime_error("ncmp decompressor does not export exactly one symbol");
+    }
+
+    // The start symbol is actually a transition vector, which is the code
+    // addr followed by the desired value in r2
+    string start_symbol_name = "<ncmp>:" + exports.begin()->second.name;
+    uint32_t start_symbol_addr = ret->mem->get_symbol_addr(start_symbol_name.c_str());
+    ret->entry_pc = ret->mem->read_u32b(start_symbol_addr);
+    ret->entry_r2 = ret->mem->read_u32b(start_symbol_addr + 4);
+
+    if (verbose) {
+      fprintf(current_task_log_stream(), "ncmp entry pc is %08" PRIX32 " with r2 = %08" PRIX32 "\n",
+          ret->entry_pc, ret->entry_r2);
+    }
+
+  } else {
+    throw runtime_error("decompressor resource is not dcmp or ncmp");
+  }
+
+  ret->stack_addr = 0x10000000;
+  ret->stack_size = 1024 * 16; // 16KB should be enough
+  ret->mem->allocate_at(ret->stack_addr, ret->stack_size);
+
+  ret->initial_state = ret->mem->snapshot();
+  return ret;
+}
+
+void LoadedDecompressor::reset() {
+  this->mem->restore(*this->initial_state);
+}
+
+DecompressorCache::DecompressorCache() : hits(0), misses(0) { }
+
+shared_ptr<LoadedDecompressor> DecompressorCache::get(
+    shared_ptr<const Resource> dcmp_res, bool verbose) {
+  {
+    lock_guard<mutex> g(this->lock);
+    auto it = this->available.find(dcmp_res.get());
+    if ((it != this->available.end()) && !it->second.empty()) {
+      auto ret = move(it->second.back());
+      it->second.pop_back();
+      this->hits++;
+      ret->reset();
+      return ret;
+    }
+  }
+
+  // Loading may take a while, so it's done without holding the lock
+  this->misses++;
+  return load_decompressor(dcmp_res, verbose);
+}
+
+void DecompressorCache::put(shared_ptr<LoadedDecompressor> loaded) {
+  lock_guard<mutex> g(this->lock);
+  this->available[loaded->dcmp_res.get()].emplace_back(move(loaded));
+}
+
+
+
+static uint64_t fnv1a64(const void* data, size_t size,
+    uint64_t hash = 0xCBF29CE484222325) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  for (size_t z = 0; z < size; z++) {
+    hash = (hash ^ bytes[z]) * 0x00000100000001B3;
+  }
+  return hash;
+}
+
+// Each entry file is this header, followed by the identity, followed by the
+// decompressed data
+struct DecompressionResultCacheEntryHeader {
+  be_uint32_t magic; // 'DRC1'
+  be_uint32_t decompressed_size;
+  be_uint64_t key;
+  be_uint64_t identity_size;
+} __attribute__((packed));
+
+static constexpr uint32_t DECOMPRESSION_RESULT_CACHE_MAGIC = 0x44524331; // 'DRC1'
+
+DecompressionResultCache::DecompressionResultCache(const string& directory)
+  : directory(directory), hits(0), misses(0) {
+  if (mkdir(this->directory.c_str(), 0777) && (errno != EEXIST)) {
+    throw runtime_error("cannot create decompression cache directory " + this->directory);
+  }
+}
+
+string DecompressionResultCache::filename_for_key(uint64_t key) const {
+  // Entries are spread over 256 subdirectories, so no single directory gets
+  // too large
+  return string_printf("%s/%02" PRIX64 "/%016" PRIX64 ".bin",
+      this->directory.c_str(), key >> 56, key);
+}
+
+bool DecompressionResultCache::get(
+    uint64_t key, const string& identity, size_t expected_size, string& data) {
+  string contents;
+  try {
+    contents = load_file(this->filename_for_key(key));
+  } catch (const exception&) {
+    this->misses++;
+    return false;
+  }
+
+  const auto* header = reinterpret_cast<const DecompressionResultCacheEntryHeader*>(contents.data());
+  size_t data_offset = sizeof(DecompressionResultCacheEntryHeader) + identity.size();
+  if ((contents.size() != data_offset + expected_size) ||
+      (header->magic != DECOMPRESSION_RESULT_CACHE_MAGIC) ||
+      (header->decompressed_size != expected_size) ||
+      (header->key != key) ||
+      (header->identity_size != identity.size()) ||
+      contents.compare(sizeof(DecompressionResultCacheEntryHeader), identity.size(), identity)) {
+    this->misses++;
+    return false;
+  }
+
+  this->hits++;
+  data = contents.substr(data_offset);
+  return true;
+}
+
+void DecompressionResultCache::put(
+    uint64_t key, const string& identity, const string& data) {
+  string filename = this->filename_for_key(key);
+  string dir = filename.substr(0, filename.rfind('/'));
+  mkdir(dir.c_str(), 0777);
+
+  DecompressionResultCacheEntryHeader header;
+  header.magic = DECOMPRESSION_RESULT_CACHE_MAGIC;
+  header.decompressed_size = data.size();
+  header.key = key;
+  header.identity_size = identity.size();
+  string contents(reinterpret_cast<const char*>(&header), sizeof(header));
+  contents += identity;
+  contents += data;
+
+  // Failing to write the cache isn't fatal; the resource was still
+  // decompressed successfully
+  string temp_filename = string_printf("%s.%d.%zX.tmp", filename.c_str(),
+      getpid(), hash<thread::id>()(this_thread::get_id()));
+  try {
+    save_file(temp_filename, contents);
+    if (rename(temp_filename.c_str(), filename.c_str())) {
+      unlink(temp_filename.c_str());
+    }
+  } catch (const exception&) {
+    unlink(temp_filename.c_str());
+  }
+}
+
+static shared_ptr<DecompressionResultCache> decompression_result_cache;
+static mutex decompression_result_cache_lock;
+
+void set_decompression_result_cache(shared_ptr<DecompressionResultCache> cache) {
+  lock_guard<mutex> g(decompression_result_cache_lock);
+  decompression_result_cache = cache;
+}
+
+shared_ptr<DecompressionResultCache> get_decompression_result_cache() {
+  lock_guard<mutex> g(decompression_result_cache_lock);
+  return decompression_result_cache;
+}
+
+
+
 void decompress_resource(
     shared_ptr<Resource> res,
     uint64_t decompress_flags,
@@ -138,7 +389,7 @@ void decompress_resource(
   // In order of priority, we try:
   // 1. dcmp resource from the context ResourceFile
   // 2. ncmp resource from the context ResourceFile
-  // 3. internal implementation from src/Decompressors/SystemN.cc
+  // 3. internal implementation (see Decompressors/Codecs.hh)
   // 4. system dcmp from system_dcmps/dcmp_N.bin
   // 5. system ncmp from system_dcmps/ncmp_N.bin
   // As an awful hack, we use nullptr to represent the internal implementation,
@@ -159,7 +410,7 @@ void decompress_resource(
     }
   }
   if (!(decompress_flags & DecompressionFlag::SKIP_INTERNAL)) {
-    if ((dcmp_resource_id >= 0) && (dcmp_resource_id <= 3)) {
+    if (find_codec_for_dcmp(dcmp_resource_id)) {
       dcmp_resources.emplace_back(nullptr);
     }
   }
@@ -179,150 +430,188 @@ void decompress_resource(
   }
 
   if (verbose) {
-    fprintf(stderr, "using dcmp/ncmp %hd (%zu implementation(s) available)\n",
+    fprintf(current_task_log_stream(), "using dcmp/ncmp %hd (%zu implementation(s) available)\n",
         dcmp_resource_id, dcmp_resources.size());
-    fprintf(stderr, "note: data size is %zu (0x%zX); decompressed data size is %" PRIu32 " (0x%" PRIX32 ") bytes\n",
+    fprintf(current_task_log_stream(), "note: data size is %zu (0x%zX); decompressed data size is %" PRIu32 " (0x%" PRIX32 ") bytes\n",
         res->data.size(), res->data.size(),
         header.decompressed_size.load(), header.decompressed_size.load());
   }
 
+  // If the resource is over budget, don't try any of the decompressors; the
+  // resource is treated as if decompression failed, so callers can still use
+  // its raw data
+  auto mark_over_budget = [&](const budget_exceeded& e) -> void {
+    if (verbose) {
+      fprintf(current_task_log_stream(), "decompression stopped: %s\n", e.what());
+    }
+    res->flags |= ResourceFlag::FLAG_DECOMPRESSION_FAILED;
+  };
+  try {
+    check_resource_memory(header.decompressed_size, "decompressed resource");
+  } catch (const budget_exceeded& e) {
+    mark_over_budget(e);
+    return;
+  }
+
+  // Check the result cache before loading or running any decompressors. If
+  // the first decompressor to try is internal (or has a native implementation),
+  // it's fast enough (and almost always succeeds) that caching its results
+  // would only waste disk space.
+  auto cache = get_decompression_result_cache();
+  uint64_t cache_key = 0;
+  string cache_identity;
+  if (cache.get() && dcmp_resources[0].get() &&
+      ((decompress_flags & DecompressionFlag::SKIP_INTERNAL) ||
+       !find_codec_for_decompressor(dcmp_resources[0]->data.data(), dcmp_resources[0]->data.size()))) {
+    // The identity is each decompressor's type, ID, and data (or a marker for
+    // the internal implementation), followed by the compressed data
+    for (const auto& dcmp_res : dcmp_resources) {
+      if (dcmp_res.get()) {
+        uint64_t id = (static_cast<uint64_t>(dcmp_res->type) << 16) | static_cast<uint16_t>(dcmp_res->id);
+        uint64_t size = dcmp_res->data.size();
+        cache_identity.push_back('D');
+        cache_identity.append(reinterpret_cast<const char*>(&id), sizeof(id));
+        cache_identity.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        cache_identity += dcmp_res->data;
+      } else {
+        cache_identity.push_back('I');
+      }
+    }
+    cache_identity += res->data;
+    cache_key = fnv1a64(cache_identity.data(), cache_identity.size());
+
+    string cached_data;
+    if (cache->get(cache_key, cache_identity, header.decompressed_size, cached_data)) {
+      if (verbose) {
+        fprintf(current_task_log_stream(), "note: using cached decompression result %016" PRIX64 " (%zu -> %zu bytes)\n",
+            cache_key, res->data.size(), cached_data.size());
+      }
+      res->data = move(cached_data);
+      res->flags = (res->flags & ~ResourceFlag::FLAG_COMPRESSED) | ResourceFlag::FLAG_DECOMPRESSED;
+      return;
+    }
+  } else {
+    cache.reset();
+  }
+
+  // If a native implementation fails, dcmps with the same fingerprint are
+  // emulated instead, in case the failure is a bug in the native version
+  unordered_set<const DecompressionCodec*> failed_codecs;
+  auto stats = get_decode_stats();
+  size_t compressed_size = res->data.size();
   for (size_t z = 0; z < dcmp_resources.size(); z++) {
     shared_ptr<const Resource> dcmp_res = dcmp_resources[z];
     if (verbose) {
-      fprintf(stderr, "attempting decompression with implementation %zu of %zu\n",
+      fprintf(current_task_log_stream(), "attempting decompression with implementation %zu of %zu\n",
           z + 1, dcmp_resources.size());
     }
 
+    // Use a native implementation if there is one, either because this is the
+    // internal implementation of a system dcmp, or because the dcmp or ncmp
+    // resource is a known decompressor (see Decompressors/Codecs.hh)
+    const DecompressionCodec* codec = nullptr;
+    uint64_t fingerprint = 0;
+    uint64_t attempt_start_time = now();
+    uint64_t emulated_cycles = 0;
+    auto record_stats = [&](bool success, size_t output_bytes) -> void {
+      if (!stats.get()) {
+        return;
+      }
+      string implementation;
+      if (codec) {
+        implementation = string("internal:") + codec->name;
+      } else if (dcmp_res.get()) {
+        implementation = string_printf("emulated:%s %hd",
+            (dcmp_res->type == RESOURCE_TYPE_dcmp) ? "dcmp" : "ncmp", dcmp_res->id);
+      } else {
+        implementation = string_printf("internal:dcmp %hd", dcmp_resource_id);
+      }
+      stats->record_decompression(implementation, success,
+          now() - attempt_start_time, emulated_cycles, compressed_size, output_bytes);
+    };
     try {
+      check_resource_deadline("decompression");
       if (!dcmp_res.get()) {
-        string (*decompress)(
-            const CompressedResourceHeader& header,
-            const void* source,
-            size_t size) = nullptr;
-        if (dcmp_resource_id == 0) {
-          decompress = &decompress_system0;
-        } else if (dcmp_resource_id == 1) {
-          decompress = &decompress_system1;
-        } else if (dcmp_resource_id == 2) {
-          decompress = &decompress_system2;
-        } else if (dcmp_resource_id == 3) {
-          decompress = &decompress_system3;
-        }
-
-        if (!decompress) {
+        codec = find_codec_for_dcmp(dcmp_resource_id);
+        if (!codec) {
           throw logic_error(string_printf(
               "internal implementation of dcmp %hd requested, but does not exist",
               dcmp_resource_id));
-        } else {
-          uint64_t start_time = now();
-          string decompressed_data = decompress(
-              header,
-              res->data.data() + sizeof(CompressedResourceHeader),
-              res->data.size() - sizeof(CompressedResourceHeader));
-          if (decompressed_data.size() != header.decompressed_size) {
-            throw runtime_error(string_printf(
-                "internal decompressor produced the wrong amount of data (%" PRIu32 " bytes expected, %zu bytes received)",
-                header.decompressed_size.load(), decompressed_data.size()));
-          }
-          if (verbose) {
-            float duration = static_cast<float>(now() - start_time) / 1000000.0f;
-            fprintf(stderr, "note: decompressed resource using internal decompressor in %g seconds (%zu -> %zu bytes)\n",
-                duration, res->data.size(), decompressed_data.size());
-          }
-          res->data = move(decompressed_data);
-          res->flags = (res->flags & ~ResourceFlag::FLAG_COMPRESSED) | ResourceFlag::FLAG_DECOMPRESSED;
-          return;
         }
+      } else if (!(decompress_flags & DecompressionFlag::SKIP_INTERNAL)) {
+        codec = find_codec_for_decompressor(
+            dcmp_res->data.data(), dcmp_res->data.size(), &fingerprint);
+        if (failed_codecs.count(codec)) {
+          codec = nullptr;
+        }
+        if (verbose) {
+          fprintf(current_task_log_stream(), "%s %hd has fingerprint %016" PRIX64 " (%s)\n",
+              (dcmp_res->type == RESOURCE_TYPE_dcmp) ? "dcmp" : "ncmp", dcmp_res->id,
+              fingerprint, codec ? codec->name : "unknown; emulating it");
+        }
+      }
 
-      } else {
-        shared_ptr<MemoryContext> mem(new MemoryContext());
-
-        uint32_t entry_pc = 0;
-        uint32_t entry_r2 = 0;
-        bool is_ppc;
-        if (dcmp_res->type == RESOURCE_TYPE_dcmp) {
-          is_ppc = false;
-
-          // Figure out where in the dcmp to start execution. There appear to be
-          // two formats: one that has 'dcmp' in bytes 4-8 where execution appears
-          // to just start at byte 0 (usually it's a branch opcode), and one where
-          // the first three words appear to be offsets to various functions,
-          // followed by code. The second word appears to be the main entry point
-          // in this format, so we use that to determine where to start execution.
-          // TODO: It looks like the decompression implementation in ResEdit
-          // assumes the second format (with the three offsets) if and only if the
-          // compressed resource has header format 9. This feels kind of bad
-          // because... shouldn't the dcmp format be a property of the dcmp
-          // resource, not the resource being decompressed? We use a heuristic
-          // here instead, which seems correct for all decompressors I've seen.
-          // TODO: Call init and exit for decompressors that have them. It's not
-          // clear (yet) what the arguments to init and exit should be... they
-          // each apparently take one argument based on how the adjust the stack
-          // before returning, but every decompressor I've seen ignores the
-          // argument.
-          uint32_t entry_offset;
-          if (dcmp_res->data.size() < 10) {
-            throw runtime_error("decompressor resource is too short");
-          }
-          if (dcmp_res->data.substr(4, 4) == "dcmp") {
-            entry_offset = 0;
-          } else {
-            entry_offset = *reinterpret_cast<const be_uint16_t*>(
-                dcmp_res->data.data() + 2);
-          }
-
-          // Load the dcmp into emulated memory
-          size_t code_region_size = dcmp_res->data.size();
-          uint32_t code_addr = 0xF0000000;
-          mem->allocate_at(code_addr, code_region_size);
-          mem->memcpy(code_addr, dcmp_res->data.data(), dcmp_res->data.size());
-
-          entry_pc = code_addr + entry_offset;
-          if (verbose) {
-            fprintf(stderr, "loaded code at %08" PRIX32 ":%zX\n", code_addr, code_region_size);
-            fprintf(stderr, "dcmp entry offset is %08" PRIX32 " (loaded at %" PRIX32 ")\n",
-                entry_offset, entry_pc);
-          }
-
-        } else if (dcmp_res->type == RESOURCE_TYPE_ncmp) {
-          PEFFFile f("<ncmp>", dcmp_res->data);
-          f.load_into("<ncmp>", mem, 0xF0000000);
-          is_ppc = f.is_ppc();
-
-          // ncmp decompressors don't appear to define any of the standard export
-          // symbols (init/main/term); instead, they define a single export symbol
-          // in the export table.
-          if (!f.init().name.empty()) {
-            throw runtime_error("ncmp decompressor has init symbol");
-          }
-          if (!f.main().name.empty()) {
-            throw runtime_error("ncmp decompressor has main symbol");
-          }
-          if (!f.term().name.empty()) {
-            throw runtime_error("ncmp decompressor has term symbol");
-          }
-          const auto& exports = f.exports();
-          if (exports.size() != 1) {
-            throw runtime_error("ncmp decompressor does not export exactly one symbol");
-          }
-
-          // The start symbol is actually a transition vector, which is the code
-          // addr followed by the desired value in r2
-          string start_symbol_name = "<ncmp>:" + exports.begin()->second.name;
-          uint32_t start_symbol_addr = mem->get_symbol_addr(start_symbol_name.c_str());
-          entry_pc = mem->read_u32b(start_symbol_addr);
-          entry_r2 = mem->read_u32b(start_symbol_addr + 4);
+      if (codec) {
+        uint64_t start_time = now();
+        string decompressed_data = decompress_with_codec(
+            *codec,
+            res->data.data() + sizeof(CompressedResourceHeader),
+            res->data.size() - sizeof(CompressedResourceHeader),
+            &header);
+        if (decompressed_data.size() != header.decompressed_size) {
+          throw runtime_error(string_printf(
+              "internal decompressor produced the wrong amount of data (%" PRIu32 " bytes expected, %zu bytes received)",
+              header.decompressed_size.load(), decompressed_data.size()));
+        }
+        if (verbose) {
+          float duration = static_cast<float>(now() - start_time) / 1000000.0f;
+          fprintf(current_task_log_stream(), "note: decompressed resource using internal decompressor in %g seconds (%zu -> %zu bytes)\n",
+              duration, res->data.size(), decompressed_data.size());
+        }
+        if (dcmp_res.get()) {
+          record_decompressor_fingerprint_hit(fingerprint);
+        }
+        record_stats(true, decompressed_data.size());
+        if (cache.get()) {
+          cache->put(cache_key, cache_identity, decompressed_data);
+        }
+        res->data = move(decompressed_data);
+        res->flags = (res->flags & ~ResourceFlag::FLAG_COMPRESSED) | ResourceFlag::FLAG_DECOMPRESSED;
+        return;
 
+      } else {
+        shared_ptr<LoadedDecompressor> loaded;
+        DecompressorCache* loaded_from_cache = nullptr;
+        if (context_rf) {
+          auto& cache = context_rf->decompressor_cache();
+          loaded = cache.get(dcmp_res, verbose);
+          loaded_from_cache = &cache;
           if (verbose) {
-            fprintf(stderr, "ncmp entry pc is %08" PRIX32 " with r2 = %08" PRIX32 "\n",
-                entry_pc, entry_r2);
+            size_t total = cache.hit_count() + cache.miss_count();
+            fprintf(current_task_log_stream(), "decompressor cache: %zu hits, %zu misses (%g%% hit rate)\n",
+                cache.hit_count(), cache.miss_count(),
+                (cache.hit_count() * 100.0) / total);
           }
-
         } else {
-          throw runtime_error("decompressor resource is not dcmp or ncmp");
+          loaded = load_decompressor(dcmp_res, verbose);
         }
+        // Return the decompressor to the cache when done, even if it fails
+        struct ReturnToCache {
+          DecompressorCache* cache;
+          shared_ptr<LoadedDecompressor> loaded;
+          ~ReturnToCache() {
+            if (this->cache) {
+              this->cache->put(move(this->loaded));
+            }
+          }
+        } return_to_cache{loaded_from_cache, loaded};
+        auto mem = loaded->mem;
+        bool is_ppc = loaded->is_ppc;
+        uint32_t entry_pc = loaded->entry_pc;
+        uint32_t entry_r2 = loaded->entry_r2;
+        uint32_t stack_addr = loaded->stack_addr;
+        size_t stack_region_size = loaded->stack_size;
 
-        size_t stack_region_size = 1024 * 16; // 16KB should be enough
         size_t output_region_size = header.decompressed_size + output_extra_bytes;
         // TODO: Looks like some decompressors expect zero bytes after the
         // compressed input? Find out if this is actually true and fix it if not.
@@ -330,14 +619,14 @@ void decompress_resource(
         // TODO: This is probably way too big; probably we should use
         // ((data.size() * 256) / working_buffer_fractional_size) instead here?
         size_t working_buffer_region_size = res->data.size() * 256;
+        check_resource_memory(
+            output_region_size + input_region_size + working_buffer_region_size + stack_region_size,
+            "emulated decompressor");
+        const ResourceBudget* budget = current_resource_budget();
+        uint64_t max_cycles = budget ? budget->max_emulated_cycles : 0;
 
         // Set up data memory regions. Slightly awkward assumption: decompressed
         // data is never more than 256 times the size of the input data.
-        uint32_t stack_addr = 0x10000000;
-        mem->allocate_at(stack_addr, stack_region_size);
-        if (!stack_addr) {
-          throw runtime_error("cannot allocate stack region");
-        }
         uint32_t output_addr = 0x20000000;
         mem->allocate_at(output_addr, output_region_size);
         if (!output_addr) {
@@ -354,11 +643,11 @@ void decompress_resource(
           throw runtime_error("cannot allocate input region");
         }
         if (verbose) {
-          fprintf(stderr, "memory:\n");
-          fprintf(stderr, "  stack region at %08" PRIX32 ":%zX\n", stack_addr, stack_region_size);
-          fprintf(stderr, "  output region at %08" PRIX32 ":%zX\n", output_addr, output_region_size);
-          fprintf(stderr, "  working region at %08" PRIX32 ":%zX\n", working_buffer_addr, working_buffer_region_size);
-          fprintf(stderr, "  input region at %08" PRIX32 ":%zX\n", input_addr, input_region_size);
+          fprintf(current_task_log_stream(), "memory:\n");
+          fprintf(current_task_log_stream(), "  stack region at %08" PRIX32 ":%zX\n", stack_addr, stack_region_size);
+          fprintf(current_task_log_stream(), "  output region at %08" PRIX32 ":%zX\n", output_addr, output_region_size);
+          fprintf(current_task_log_stream(), "  working region at %08" PRIX32 ":%zX\n", working_buffer_addr, working_buffer_region_size);
+          fprintf(current_task_log_stream(), "  input region at %08" PRIX32 ":%zX\n", input_addr, input_region_size);
         }
         mem->memcpy(input_addr, res->data.data(), res->data.size());
 
@@ -382,6 +671,7 @@ void decompress_resource(
           // Create emulator
           shared_ptr<InterruptManager> interrupt_manager(new InterruptManager());
           PPC32Emulator emu(mem);
+          emu.set_execution_limits(max_cycles, current_resource_deadline());
           emu.set_interrupt_manager(interrupt_manager);
 
           // Set up registers
@@ -395,8 +685,8 @@ void decompress_resource(
           regs.lr = return_addr;
           regs.pc = entry_pc;
           if (verbose) {
-            fprintf(stderr, "initial stack contents (input header data):\n");
-            print_data(stderr, input_header, sizeof(*input_header), regs.r[1].u);
+            fprintf(current_task_log_stream(), "initial stack contents (input header data):\n");
+            print_data(current_task_log_stream(), input_header, sizeof(*input_header), regs.r[1].u);
           }
 
           // Set up debugger
@@ -422,11 +712,13 @@ void decompress_resource(
           execution_start_time = now();
           try {
             emu.execute();
+            emulated_cycles = emu.cycles();
           } catch (const exception& e) {
+            emulated_cycles = emu.cycles();
             if (verbose) {
               uint64_t diff = now() - execution_start_time;
               float duration = static_cast<float>(diff) / 1000000.0f;
-              fprintf(stderr, "powerpc decompressor execution failed (%gsec): %s\n", duration, e.what());
+              fprintf(current_task_log_stream(), "powerpc decompressor execution failed (%gsec): %s\n", duration, e.what());
             }
             throw;
           }
@@ -453,14 +745,16 @@ void decompress_resource(
 
           // Create emulator
           M68KEmulator emu(mem);
+          emu.set_execution_limits(max_cycles, current_resource_deadline());
+          emu.set_jit_enabled(decompress_flags & DecompressionFlag::USE_JIT);
 
           // Set up registers
           auto& regs = emu.registers();
           regs.a[7] = stack_addr + stack_region_size - sizeof(M68KDecompressorInputHeader);
           regs.pc = entry_pc;
           if (verbose) {
-            fprintf(stderr, "initial stack contents (input header data):\n");
-            print_data(stderr, input_header, sizeof(*input_header), regs.a[7]);
+            fprintf(current_task_log_stream(), "initial stack contents (input header data):\n");
+            print_data(current_task_log_stream(), input_header, sizeof(*input_header), regs.a[7]);
           }
 
           // Set up debugger
@@ -509,7 +803,7 @@ void decompress_resource(
               try {
                 regs.a[0] = trap_to_call_stub_addr.at(trap_number);
                 if (verbose) {
-                  fprintf(stderr, "GetTrapAddress: using cached call stub for trap %04hX -> %08" PRIX32 "\n",
+                  fprintf(current_task_log_stream(), "GetTrapAddress: using cached call stub for trap %04hX -> %08" PRIX32 "\n",
                       trap_number, regs.a[0]);
                 }
 
@@ -525,17 +819,17 @@ void decompress_resource(
                 regs.a[0] = call_stub_addr;
 
                 if (verbose) {
-                  fprintf(stderr, "GetTrapAddress: created call stub for trap %04hX -> %08" PRIX32 "\n",
+                  fprintf(current_task_log_stream(), "GetTrapAddress: created call stub for trap %04hX -> %08" PRIX32 "\n",
                       trap_number, regs.a[0]);
                 }
               }
 
             } else if (verbose) {
               if (trap_number & 0x0800) {
-                fprintf(stderr, "warning: skipping unimplemented toolbox trap (num=%hX, auto_pop=%s)\n",
+                fprintf(current_task_log_stream(), "warning: skipping unimplemented toolbox trap (num=%hX, auto_pop=%s)\n",
                     static_cast<uint16_t>(trap_number & 0x0BFF), auto_pop ? "true" : "false");
               } else {
-                fprintf(stderr, "warning: skipping unimplemented os trap (num=%hX, flags=%hhu)\n",
+                fprintf(current_task_log_stream(), "warning: skipping unimplemented os trap (num=%hX, flags=%hhu)\n",
                     static_cast<uint16_t>(trap_number & 0x00FF), flags);
               }
             }
@@ -545,12 +839,14 @@ void decompress_resource(
           execution_start_time = now();
           try {
             emu.execute();
+            emulated_cycles = emu.cycles();
           } catch (const exception& e) {
+            emulated_cycles = emu.cycles();
             if (verbose) {
               uint64_t diff = now() - execution_start_time;
               float duration = static_cast<float>(diff) / 1000000.0f;
-              fprintf(stderr, "m68k decompressor execution failed (%gsec): %s\n", duration, e.what());
-              emu.print_state(stderr);
+              fprintf(current_task_log_stream(), "m68k decompressor execution failed (%gsec): %s\n", duration, e.what());
+              emu.print_state(current_task_log_stream());
             }
             throw;
           }
@@ -559,19 +855,32 @@ void decompress_resource(
         if (verbose) {
           uint64_t diff = now() - execution_start_time;
           float duration = static_cast<float>(diff) / 1000000.0f;
-          fprintf(stderr, "note: decompressed resource using %s %hd in %g seconds (%zu -> %" PRIu32 " bytes)\n",
+          fprintf(current_task_log_stream(), "note: decompressed resource using %s %hd in %g seconds (%zu -> %" PRIu32 " bytes)\n",
               (dcmp_res->type == RESOURCE_TYPE_dcmp) ? "dcmp" : "ncmp", dcmp_res->id,
               duration, res->data.size(), header.decompressed_size.load());
         }
 
         res->data = mem->read(output_addr, header.decompressed_size);
+        record_stats(true, res->data.size());
+        if (cache.get()) {
+          cache->put(cache_key, cache_identity, res->data);
+        }
         res->flags = (res->flags & ~ResourceFlag::FLAG_COMPRESSED) | ResourceFlag::FLAG_DECOMPRESSED;
         return;
       }
 
+    } catch (const budget_exceeded& e) {
+      record_stats(false, 0);
+      mark_over_budget(e);
+      return;
+
     } catch (const exception& e) {
+      record_stats(false, 0);
+      if (codec) {
+        failed_codecs.emplace(codec);
+      }
       if (verbose) {
-        fprintf(stderr, "decompressor implementation %zu of %zu failed: %s\n",
+        fprintf(current_task_log_stream(), "decompressor implementation %zu of %zu failed: %s\n",
             z + 1, dcmp_resources.size(), e.what());
       }
     }
@@ -579,3 +888,38 @@ void decompress_resource(
 
   throw runtime_error("no decompressor succeeded");
 }
+
+vector<string> decompress_resources(
+    const vector<shared_ptr<Resource>>& resources,
+    uint64_t decompress_flags,
+    ResourceFile* context_rf,
+    size_t num_threads) {
+  // Verbose output (and debugging, which is interactive) isn't much use if
+  // multiple decompressors are logging at once
+  if (decompress_flags & (DecompressionFlag::VERBOSE |
+                          DecompressionFlag::TRACE_EXECUTION |
+                          DecompressionFlag::DEBUG_EXECUTION)) {
+    num_threads = 1;
+  }
+
+  // Budget scopes are per-thread, so the caller's budget (if any) has to be
+  // applied on each worker thread explicitly
+  const ResourceBudget* budget = current_resource_budget();
+
+  vector<string> errors(resources.size());
+  run_parallel_tasks(resources.size(), num_threads, [&](size_t z, FILE*) -> void {
+    unique_ptr<ResourceBudgetScope> budget_scope;
+    if (budget) {
+      budget_scope.reset(new ResourceBudgetScope(*budget));
+    }
+    const auto& res = resources[z];
+    try {
+      lock_guard<mutex> g(res->load_lock.lock);
+      res->load_data();
+      decompress_resource(res, decompress_flags, context_rf);
+    } catch (const exception& e) {
+      errors[z] = e.what();
+    }
+  });
+  return errors;
+}
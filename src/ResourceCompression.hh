@@ -2,8 +2,15 @@
 
 #include <stdint.h>
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
+#include "Emulators/MemoryContext.hh"
 #include "ResourceFile.hh"
 
 
@@ -19,12 +26,128 @@ enum DecompressionFlag {
   SKIP_SYSTEM_NCMP = 0x0080, // Don't use system ncmp resources
   SKIP_INTERNAL    = 0x0100, // Don't use internal decompressors
   RETRY            = 0x0200, // Decompress even if res has DECOMPRESSION_FAILED failed
+  USE_JIT          = 0x0400, // Use the emulators' JIT tier (ignored when tracing or debugging)
 };
 
 std::shared_ptr<const ResourceFile::Resource> get_system_decompressor(
     bool use_ncmp, int16_t resource_id);
 
+// A dcmp or ncmp resource that has been loaded into emulated memory and is
+// ready to run. Between runs, memory is restored from initial_state, since some
+// decompressors modify themselves; this only copies the pages that changed.
+struct LoadedDecompressor {
+  std::shared_ptr<const ResourceFile::Resource> dcmp_res;
+  std::shared_ptr<MemoryContext> mem;
+  bool is_ppc;
+  uint32_t entry_pc;
+  uint32_t entry_r2;
+  uint32_t stack_addr;
+  size_t stack_size;
+  std::shared_ptr<const MemoryContext::Snapshot> initial_state;
+
+  // Frees everything allocated since the decompressor was loaded and restores
+  // the contents of the loaded code and data
+  void reset();
+};
+
+// Each ResourceFile has one of these (see ResourceFile::decompressor_cache),
+// so files with many compressed resources that use the same decompressor only
+// pay the cost of loading it once. This is thread-safe: a loaded decompressor
+// is used by only one thread at a time, so get() loads another copy if all the
+// existing copies of the requested decompressor are in use.
+class DecompressorCache {
+public:
+  DecompressorCache();
+  ~DecompressorCache() = default;
+
+  // Returns a loaded decompressor that no other thread is using. Call put()
+  // with it when done, so it can be reused.
+  std::shared_ptr<LoadedDecompressor> get(
+      std::shared_ptr<const ResourceFile::Resource> dcmp_res, bool verbose);
+  void put(std::shared_ptr<LoadedDecompressor> loaded);
+
+  inline size_t hit_count() const {
+    return this->hits;
+  }
+  inline size_t miss_count() const {
+    return this->misses;
+  }
+
+private:
+  // Each LoadedDecompressor holds a reference to its dcmp/ncmp resource, so
+  // these pointers are never reused for a different resource while they have
+  // entries here
+  std::mutex lock;
+  std::unordered_map<const ResourceFile::Resource*,
+      std::vector<std::shared_ptr<LoadedDecompressor>>> available;
+  std::atomic<size_t> hits;
+  std::atomic<size_t> misses;
+};
+
+// An on-disk cache of decompressed resource data, for decompressors that have
+// to be emulated (which is by far the slowest part of decompression). Entries
+// are keyed by a hash of the compressed data and of every decompressor that
+// decompress_resource would try for it, so results from a file's own dcmp are
+// never confused with results from a system dcmp. Since different inputs can
+// have the same key, each entry also stores the data that was hashed (its
+// identity), and it's only used if that matches exactly. Each entry is stored
+// in its own file in the cache directory, named by its key; entries are
+// written to a temporary file and renamed into place, so multiple processes
+// (or threads) can share the same directory. This is safe to use from
+// multiple threads.
+class DecompressionResultCache {
+public:
+  explicit DecompressionResultCache(const std::string& directory);
+  ~DecompressionResultCache() = default;
+
+  // Returns true and sets data if there's an entry for key with the given
+  // identity and the expected size. Corrupt entries are treated as misses.
+  bool get(uint64_t key, const std::string& identity, size_t expected_size,
+      std::string& data);
+  void put(uint64_t key, const std::string& identity, const std::string& data);
+
+  inline size_t hit_count() const {
+    return this->hits;
+  }
+  inline size_t miss_count() const {
+    return this->misses;
+  }
+
+private:
+  std::string directory;
+  std::atomic<size_t> hits;
+  std::atomic<size_t> misses;
+
+  std::string filename_for_key(uint64_t key) const;
+};
+
+// Sets the cache used by decompress_resource for all ResourceFiles (or
+// disables caching, if cache is null). This may be called at any time;
+// decompressions that are already in progress continue to use the cache that
+// was set when they started.
+void set_decompression_result_cache(std::shared_ptr<DecompressionResultCache> cache);
+std::shared_ptr<DecompressionResultCache> get_decompression_result_cache();
+
+// Decompresses res in place if it's compressed. If a ResourceBudgetScope is
+// active (see ResourceBudget.hh) and the resource exceeds its budget, res is
+// marked with FLAG_DECOMPRESSION_FAILED and left compressed instead.
 void decompress_resource(
     std::shared_ptr<ResourceFile::Resource> res,
     uint64_t flags,
     ResourceFile* context_rf);
+
+// Decompresses many resources on up to num_threads threads (0 means one per
+// core), loading their data first if needed. Each emulated decompression runs
+// in its own MemoryContext and emulator (from context_rf's DecompressorCache if
+// context_rf isn't null), and nothing else in the emulation stack is shared
+// between threads except read-only tables and the locked caches above, so
+// this scales with the number of cores. If a ResourceBudgetScope is active on
+// the calling thread, its budget applies to each resource separately. Returns
+// one string per resource: empty if the resource was decompressed (or didn't
+// need to be), or the error message otherwise. With VERBOSE, TRACE_EXECUTION,
+// or DEBUG_EXECUTION, only one thread is used.
+std::vector<std::string> decompress_resources(
+    const std::vector<std::shared_ptr<ResourceFile::Resource>>& resources,
+    uint64_t flags,
+    ResourceFile* context_rf,
+    size_t num_threads = 0);
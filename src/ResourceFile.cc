@@ -8,8 +8,13 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <algorithm>
-#include <deque>
+#include <array>
+#include <bit>
 #include <exception>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
@@ -28,6 +33,9 @@
 #include "Emulators/M68KEmulator.hh"
 #include "Emulators/PPC32Emulator.hh"
 #include "Decompressors/System.hh"
+#include "ParallelTasks.hh"
+#include "ResourceBudget.hh"
+#include "ScratchArena.hh"
 
 using namespace std;
 
@@ -155,23 +163,154 @@ int16_t ResourceFile::id_from_resource_key(uint64_t key) {
   return key & 0xFFFF;
 }
 
-ResourceFile::Resource::Resource() : type(0), id(0), flags(0) { }
+ResourceFile::ResourceKeyIndex::ResourceKeyIndex() : bits(0), count(0) { }
 
-ResourceFile::Resource::Resource(uint32_t type, int16_t id, const string& data)
-  : type(type), id(id), flags(0), data(data) { }
+size_t ResourceFile::ResourceKeyIndex::home_slot(uint64_t key) const {
+  // Fibonacci hashing; the high bits of the product depend on all of the key's
+  // bits, unlike the low bits of the key itself
+  return (key * 0x9E3779B97F4A7C15) >> (64 - this->bits);
+}
 
-ResourceFile::Resource::Resource(uint32_t type, int16_t id, string&& data)
-  : type(type), id(id), flags(0), data(move(data)) { }
+const shared_ptr<ResourceFile::Resource>* ResourceFile::ResourceKeyIndex::find(
+    uint64_t key) const {
+  if (this->slots.empty()) {
+    return nullptr;
+  }
+  size_t mask = this->slots.size() - 1;
+  for (size_t z = this->home_slot(key);; z = (z + 1) & mask) {
+    const auto& slot = this->slots[z];
+    if (slot.key == key) {
+      return &slot.res;
+    }
+    if (slot.key == EMPTY_KEY) {
+      return nullptr;
+    }
+  }
+}
 
-ResourceFile::Resource::Resource(uint32_t type, int16_t id, uint16_t flags, const string& name, const string& data)
-  : type(type), id(id), flags(flags), name(name), data(data) { }
+void ResourceFile::ResourceKeyIndex::insert(uint64_t key, shared_ptr<Resource> res) {
+  if ((this->count + 1) * 2 > this->slots.size()) {
+    this->grow();
+  }
+  size_t mask = this->slots.size() - 1;
+  size_t z = this->home_slot(key);
+  while (this->slots[z].key != EMPTY_KEY) {
+    z = (z + 1) & mask;
+  }
+  this->slots[z].key = key;
+  this->slots[z].res = move(res);
+  this->count++;
+}
+
+bool ResourceFile::ResourceKeyIndex::erase(uint64_t key) {
+  if (this->slots.empty()) {
+    return false;
+  }
+  size_t mask = this->slots.size() - 1;
+  size_t z = this->home_slot(key);
+  for (; this->slots[z].key != key; z = (z + 1) & mask) {
+    if (this->slots[z].key == EMPTY_KEY) {
+      return false;
+    }
+  }
 
-ResourceFile::Resource::Resource(uint32_t type, int16_t id, uint16_t flags, string&& name, string&& data)
-  : type(type), id(id), flags(flags), name(move(name)), data(move(data)) { }
+  // Move later entries in the same run back into the hole if they can't be
+  // found otherwise, so no tombstones are needed
+  for (size_t next = (z + 1) & mask; this->slots[next].key != EMPTY_KEY; next = (next + 1) & mask) {
+    size_t home = this->home_slot(this->slots[next].key);
+    bool can_move = (next > z) ? ((home <= z) || (home > next)) : ((home <= z) && (home > next));
+    if (can_move) {
+      this->slots[z] = move(this->slots[next]);
+      z = next;
+    }
+  }
+  this->slots[z].key = EMPTY_KEY;
+  this->slots[z].res.reset();
+  this->count--;
+  return true;
+}
+
+void ResourceFile::ResourceKeyIndex::grow() {
+  vector<Slot> old_slots;
+  old_slots.swap(this->slots);
+  this->bits = old_slots.empty() ? 4 : (this->bits + 1);
+  this->slots.resize(static_cast<size_t>(1) << this->bits, Slot{EMPTY_KEY, nullptr});
+  this->count = 0;
+  for (auto& slot : old_slots) {
+    if (slot.key != EMPTY_KEY) {
+      this->insert(slot.key, move(slot.res));
+    }
+  }
+}
+
+const shared_ptr<ResourceFile::Resource>& ResourceFile::resource_for_key(
+    uint64_t key) const {
+  auto res = this->key_index.find(key);
+  if (!res) {
+    throw out_of_range("no such resource");
+  }
+  return *res;
+}
+
+ResourceFile::Resource::Resource()
+  : type(0), id(0), flags(0), data_source_offset(0), data_source_size(0) { }
+
+ResourceFile::Resource::Resource(uint32_t type, int16_t id, string data)
+  : type(type), id(id), flags(0), data(move(data)), data_source_offset(0),
+    data_source_size(0) { }
+
+ResourceFile::Resource::Resource(uint32_t type, int16_t id, uint16_t flags, string name, string data)
+  : type(type), id(id), flags(flags), name(move(name)), data(move(data)),
+    data_source_offset(0), data_source_size(0) { }
+
+ResourceFile::Resource::Resource(uint32_t type, int16_t id, uint16_t flags,
+    string name, shared_ptr<const MappedFile> data_source,
+    size_t data_source_offset, size_t data_source_size)
+  : type(type), id(id), flags(flags), name(move(name)),
+    data_source(data_source), data_source_offset(data_source_offset),
+    data_source_size(data_source_size) {
+  // Check the range now so corrupt indexes are still detected at parse time
+  if ((data_source_offset > data_source->size()) ||
+      (data_source_size > data_source->size() - data_source_offset)) {
+    throw out_of_range("resource data extends beyond end of file");
+  }
+}
+
+void ResourceFile::Resource::load_data() {
+  if (this->data_source.get()) {
+    this->data = this->data_source->read(
+        this->data_source_offset, this->data_source_size);
+    this->data_source.reset();
+  }
+}
 
 ResourceFile::ResourceFile() : ResourceFile(IndexFormat::NONE) { }
 
-ResourceFile::ResourceFile(IndexFormat format) : format(format) { }
+// The decompressor cache is created here rather than on first use, so
+// threads decompressing resources at the same time don't race to create it
+ResourceFile::ResourceFile(IndexFormat format)
+  : format(format), decompressor_cache_ptr(make_shared<DecompressorCache>()) { }
+
+ResourceFile::SoundMemo::SoundMemo(const SoundMemo&) : SoundMemo() { }
+
+ResourceFile::SoundMemo& ResourceFile::SoundMemo::operator=(const SoundMemo&) {
+  this->clear();
+  return *this;
+}
+
+ResourceFile::TemplateMemo::TemplateMemo(const TemplateMemo&) : TemplateMemo() { }
+
+ResourceFile::TemplateMemo& ResourceFile::TemplateMemo::operator=(const TemplateMemo&) {
+  lock_guard<mutex> g(this->lock);
+  this->compiled.clear();
+  return *this;
+}
+
+void ResourceFile::SoundMemo::clear() {
+  lock_guard<mutex> g(this->lock);
+  this->instruments.clear();
+  this->sound_metadata.clear();
+}
 
 bool ResourceFile::add(const Resource& res_obj) {
   shared_ptr<Resource> res(new Resource(res_obj));
@@ -187,7 +326,9 @@ bool ResourceFile::add(shared_ptr<Resource> res) {
   uint64_t key = this->make_resource_key(res->type, res->id);
   auto emplace_ret = this->key_to_resource.emplace(key, res);
   if (emplace_ret.second) {
+    this->key_index.insert(key, res);
     this->add_name_index_entry(res);
+    this->sound_memo.clear();
   }
   return emplace_ret.second;
 }
@@ -198,10 +339,16 @@ bool ResourceFile::change_id(uint32_t type, int16_t current_id, int16_t new_id)
   auto it = this->key_to_resource.find(current_key);
   if (it != this->key_to_resource.end()) {
     if (current_id != new_id) {
+      if (this->key_to_resource.count(new_key)) {
+        return false;
+      }
       auto res = it->second;
       this->key_to_resource.erase(it);
+      this->key_index.erase(current_key);
       res->id = new_id;
       this->key_to_resource.emplace(new_key, res);
+      this->key_index.insert(new_key, res);
+      this->sound_memo.clear();
     }
     return true;
   }
@@ -213,9 +360,9 @@ bool ResourceFile::rename(uint32_t type, int16_t id, const string& new_name) {
     throw invalid_argument("name must be 255 bytes or shorter");
   }
   uint64_t key = this->make_resource_key(type, id);
-  auto it = this->key_to_resource.find(key);
-  if (it != this->key_to_resource.end()) {
-    auto& res = it->second;
+  auto res_ptr = this->key_index.find(key);
+  if (res_ptr) {
+    const auto& res = *res_ptr;
     this->delete_name_index_entry(res);
     res->name = new_name;
     this->add_name_index_entry(res);
@@ -230,6 +377,8 @@ bool ResourceFile::remove(uint32_t type, int16_t id) {
   if (it != this->key_to_resource.end()) {
     this->delete_name_index_entry(it->second);
     this->key_to_resource.erase(it);
+    this->key_index.erase(key);
+    this->sound_memo.clear();
     return true;
   }
   return false;
@@ -240,7 +389,7 @@ IndexFormat ResourceFile::index_format() const {
 }
 
 bool ResourceFile::resource_exists(uint32_t type, int16_t id) const {
-  return this->key_to_resource.count(this->make_resource_key(type, id));
+  return this->key_index.find(this->make_resource_key(type, id)) != nullptr;
 }
 
 bool ResourceFile::resource_exists(uint32_t type, const char* name) const {
@@ -255,7 +404,9 @@ bool ResourceFile::resource_exists(uint32_t type, const char* name) const {
 
 shared_ptr<ResourceFile::Resource> ResourceFile::get_resource(
     uint32_t type, int16_t id, uint64_t decompress_flags) {
-  auto res = this->key_to_resource.at(this->make_resource_key(type, id));
+  auto res = this->resource_for_key(this->make_resource_key(type, id));
+  lock_guard<mutex> g(res->load_lock.lock);
+  res->load_data();
   decompress_resource(res, decompress_flags, this);
   return res;
 }
@@ -266,6 +417,8 @@ shared_ptr<ResourceFile::Resource> ResourceFile::get_resource(
   for (; its.first != its.second; its.first++) {
     auto res = its.first->second;
     if (res->type == type) {
+      lock_guard<mutex> g(res->load_lock.lock);
+      res->load_data();
       decompress_resource(res, decompress_flags, this);
       return res;
     }
@@ -275,7 +428,10 @@ shared_ptr<ResourceFile::Resource> ResourceFile::get_resource(
 
 shared_ptr<const ResourceFile::Resource> ResourceFile::get_resource(
     uint32_t type, int16_t id) const {
-  return this->key_to_resource.at(this->make_resource_key(type, id));
+  auto res = this->resource_for_key(this->make_resource_key(type, id));
+  lock_guard<mutex> g(res->load_lock.lock);
+  res->load_data();
+  return res;
 }
 
 shared_ptr<const ResourceFile::Resource> ResourceFile::get_resource(
@@ -284,12 +440,29 @@ shared_ptr<const ResourceFile::Resource> ResourceFile::get_resource(
   for (; its.first != its.second; its.first++) {
     auto res = its.first->second;
     if (res->type == type) {
+      lock_guard<mutex> g(res->load_lock.lock);
+      res->load_data();
       return res;
     }
   }
   throw out_of_range("no such resource");
 }
 
+shared_ptr<const ResourceFile::Resource> ResourceFile::get_resource_metadata(
+    uint32_t type, int16_t id) const {
+  return this->resource_for_key(this->make_resource_key(type, id));
+}
+
+void ResourceFile::load_all_resources(uint64_t decompress_flags, size_t num_threads) {
+  vector<shared_ptr<Resource>> resources;
+  resources.reserve(this->key_to_resource.size());
+  for (const auto& it : this->key_to_resource) {
+    resources.emplace_back(it.second);
+  }
+  // Errors are ignored here; resources that fail to decompress are left as-is
+  decompress_resources(resources, decompress_flags, this, num_threads);
+}
+
 vector<int16_t> ResourceFile::all_resources_of_type(uint32_t type) const {
   vector<int16_t> ret;
   for (auto it = this->key_to_resource.lower_bound(this->make_resource_key(type, 0));
@@ -322,6 +495,10 @@ vector<pair<uint32_t, int16_t>> ResourceFile::all_resources() const {
   return ret;
 }
 
+DecompressorCache& ResourceFile::decompressor_cache() {
+  return *this->decompressor_cache_ptr;
+}
+
 uint32_t ResourceFile::find_resource_by_id(int16_t id,
     const vector<uint32_t>& types) {
   for (uint32_t type : types) {
@@ -610,147 +787,272 @@ ResourceFile::TemplateEntryList ResourceFile::decode_TMPL(const void* data, size
   return ret;
 }
 
-static void disassemble_from_template_inner(
-    deque<string>& lines,
-    StringReader& r,
+using TemplateEntry = ResourceFile::TemplateEntry;
+
+static void compile_template_inner(
+    ResourceFile::CompiledTemplate& ret,
     const ResourceFile::TemplateEntryList& entries,
     size_t indent_level) {
+  using Type = TemplateEntry::Type;
 
-  using Entry = ResourceFile::TemplateEntry;
-  using Type = Entry::Type;
-  using Format = Entry::Format;
+  ret.max_list_depth = max<size_t>(ret.max_list_depth, indent_level);
+  for (const auto& entry : entries) {
+    string prefix(indent_level * 2, ' ');
+    if (entry->type == Type::VOID) {
+      if (entry->name.empty()) {
+        prefix += "# (empty comment)";
+      } else {
+        prefix += "# ";
+        prefix += entry->name;
+      }
+    } else if (!entry->name.empty()) {
+      prefix += entry->name;
+      prefix += ": ";
+    }
 
-  static auto format_string = +[](Entry::Format format, const string& str) -> string {
-    if (format == Format::HEX) {
-      return format_data_string(str);
-    } else if (format == Format::TEXT) {
-      return str;
-    } else {
-      throw logic_error("invalid string display format");
+    size_t op_index = ret.ops.size();
+    ret.ops.emplace_back(ResourceFile::CompiledTemplate::Op{
+        entry.get(), 0, static_cast<uint32_t>(ret.strings.size()), 0});
+    ret.strings.emplace_back(move(prefix));
+
+    if ((entry->type == Type::LIST_ZERO_BYTE) ||
+        (entry->type == Type::LIST_EOF) ||
+        (entry->type == Type::LIST_ZERO_COUNT) ||
+        (entry->type == Type::LIST_ONE_COUNT)) {
+      ret.ops[op_index].item_prefix_index = ret.strings.size();
+      ret.strings.emplace_back(string(indent_level * 2, ' ') + entry->name);
+
+      compile_template_inner(ret, entry->list_entries, indent_level + 1);
+
+      ret.ops[op_index].jump_index = ret.ops.size();
+      ret.ops.emplace_back(ResourceFile::CompiledTemplate::Op{
+          nullptr, static_cast<uint32_t>(op_index), 0, 0});
     }
-  };
+  }
+}
 
-  static auto format_integer = +[](shared_ptr<const Entry> entry, int64_t value) -> string {
-    string case_name_suffix;
-    try {
-      case_name_suffix = string_printf(" (%s)", entry->case_names.at(value).c_str());
-    } catch (const out_of_range&) { }
-
-    switch (entry->format) {
-      case Format::DECIMAL:
-        return string_printf("%" PRId64, value);
-      case Format::HEX:
-      case Format::FLAG:
-        if (entry->width == 1) {
-          if (entry->is_signed && (value & 0x80)) {
-            return string_printf("-0x%02hhX", static_cast<uint8_t>(-value));
-          } else {
-            return string_printf("0x%02hhX", static_cast<uint8_t>(value));
-          }
-        } else if (entry->width == 2) {
-          if (entry->is_signed && (value & 0x8000)) {
-            return string_printf("-0x%04hX", static_cast<uint16_t>(-value));
-          } else {
-            return string_printf("0x%04hX", static_cast<uint16_t>(value));
-          }
-        } else if (entry->width == 4) {
-          if (entry->is_signed && (value & 0x80000000)) {
-            return string_printf("-0x%08X", static_cast<uint32_t>(-value));
-          } else {
-            return string_printf("0x%08X", static_cast<uint32_t>(value));
-          }
+shared_ptr<const ResourceFile::CompiledTemplate> ResourceFile::compile_template(
+    const TemplateEntryList& tmpl) {
+  shared_ptr<CompiledTemplate> ret(new CompiledTemplate());
+  ret->max_list_depth = 0;
+  ret->tmpl = tmpl;
+  compile_template_inner(*ret, ret->tmpl, 0);
+  return ret;
+}
+
+shared_ptr<const ResourceFile::CompiledTemplate> ResourceFile::get_compiled_TMPL(
+    shared_ptr<const Resource> res) {
+  {
+    lock_guard<mutex> g(this->compiled_TMPLs.lock);
+    auto it = this->compiled_TMPLs.compiled.find(res.get());
+    if (it != this->compiled_TMPLs.compiled.end()) {
+      return it->second.second;
+    }
+  }
+  // If two threads compile the same TMPL at once, the first result is kept
+  auto compiled = this->compile_template(this->decode_TMPL(res));
+  lock_guard<mutex> g(this->compiled_TMPLs.lock);
+  return this->compiled_TMPLs.compiled.emplace(
+      res.get(), make_pair(res, compiled)).first->second.second;
+}
+
+static string format_template_string(TemplateEntry::Format format, const string& str) {
+  if (format == TemplateEntry::Format::HEX) {
+    return format_data_string(str);
+  } else if (format == TemplateEntry::Format::TEXT) {
+    return str;
+  } else {
+    throw logic_error("invalid string display format");
+  }
+}
+
+static string format_template_integer(const TemplateEntry* entry, int64_t value) {
+  using Format = TemplateEntry::Format;
+
+  string case_name_suffix;
+  try {
+    case_name_suffix = string_printf(" (%s)", entry->case_names.at(value).c_str());
+  } catch (const out_of_range&) { }
+
+  switch (entry->format) {
+    case Format::DECIMAL:
+      return string_printf("%" PRId64, value);
+    case Format::HEX:
+    case Format::FLAG:
+      if (entry->width == 1) {
+        if (entry->is_signed && (value & 0x80)) {
+          return string_printf("-0x%02hhX", static_cast<uint8_t>(-value));
         } else {
-          throw logic_error("invalid integer width");
+          return string_printf("0x%02hhX", static_cast<uint8_t>(value));
         }
-      case Format::TEXT:
-        if (entry->width == 1) {
-          if (value < 0x20 || value > 0x7E) {
-            return string_printf("0x%02" PRIX64, value);
-          } else {
-            return string_printf("\'%c\' (0x%02" PRIX64 ")",
-                static_cast<char>(value), value);
-          }
-        } else if (entry->width == 2) {
-          char ch1 = static_cast<char>((value >> 8) & 0xFF);
-          char ch2 = static_cast<char>(value & 0xFF);
-          if (ch1 < 0x20 || ch1 > 0x7E || ch2 < 0x20 || ch2 > 0x7E) {
-            return string_printf("0x%04" PRIX64, value);
-          } else {
-            return string_printf("\'%c%c\' (0x%04" PRIX64 ")", ch1, ch2, value);
-          }
-        } else if (entry->width == 4) {
-          char ch1 = static_cast<char>((value >> 24) & 0xFF);
-          char ch2 = static_cast<char>((value >> 16) & 0xFF);
-          char ch3 = static_cast<char>((value >> 8) & 0xFF);
-          char ch4 = static_cast<char>(value & 0xFF);
-          if (ch1 < 0x20 || ch1 > 0x7E || ch2 < 0x20 || ch2 > 0x7E ||
-              ch3 < 0x20 || ch3 > 0x7E || ch4 < 0x20 || ch4 > 0x7E) {
-            return string_printf("0x%08" PRIX64, value);
-          } else {
-            return string_printf("\'%c%c%c%c\' (0x%08" PRIX64 ")", ch1, ch2, ch3, ch4, value);
-          }
+      } else if (entry->width == 2) {
+        if (entry->is_signed && (value & 0x8000)) {
+          return string_printf("-0x%04hX", static_cast<uint16_t>(-value));
+        } else {
+          return string_printf("0x%04hX", static_cast<uint16_t>(value));
+        }
+      } else if (entry->width == 4) {
+        if (entry->is_signed && (value & 0x80000000)) {
+          return string_printf("-0x%08X", static_cast<uint32_t>(-value));
+        } else {
+          return string_printf("0x%08X", static_cast<uint32_t>(value));
+        }
+      } else {
+        throw logic_error("invalid integer width");
+      }
+    case Format::TEXT:
+      if (entry->width == 1) {
+        if (value < 0x20 || value > 0x7E) {
+          return string_printf("0x%02" PRIX64, value);
+        } else {
+          return string_printf("\'%c\' (0x%02" PRIX64 ")",
+              static_cast<char>(value), value);
+        }
+      } else if (entry->width == 2) {
+        char ch1 = static_cast<char>((value >> 8) & 0xFF);
+        char ch2 = static_cast<char>(value & 0xFF);
+        if (ch1 < 0x20 || ch1 > 0x7E || ch2 < 0x20 || ch2 > 0x7E) {
+          return string_printf("0x%04" PRIX64, value);
         } else {
-          throw logic_error("invalid integer width");
+          return string_printf("\'%c%c\' (0x%04" PRIX64 ")", ch1, ch2, value);
         }
-      case Format::DATE: {
-        // Classic Mac timestamps are based on 1904-01-01 instead of 1970-01-01
-        int64_t ts = value - 2082826800;
-        if (ts < 0) {
-          // TODO: Handle this case properly. Probably it's quite rare
-          return string_printf("%" PRId64 " seconds before 1970-01-01 00:00:00 (classic: 0x%08" PRIX64 ")",
-              -ts, value);
+      } else if (entry->width == 4) {
+        char ch1 = static_cast<char>((value >> 24) & 0xFF);
+        char ch2 = static_cast<char>((value >> 16) & 0xFF);
+        char ch3 = static_cast<char>((value >> 8) & 0xFF);
+        char ch4 = static_cast<char>(value & 0xFF);
+        if (ch1 < 0x20 || ch1 > 0x7E || ch2 < 0x20 || ch2 > 0x7E ||
+            ch3 < 0x20 || ch3 > 0x7E || ch4 < 0x20 || ch4 > 0x7E) {
+          return string_printf("0x%08" PRIX64, value);
         } else {
-          return format_time(ts * 1000000) + string_printf(" (classic: 0x%" PRIX64 ")", value);
+          return string_printf("\'%c%c%c%c\' (0x%08" PRIX64 ")", ch1, ch2, ch3, ch4, value);
         }
+      } else {
+        throw logic_error("invalid integer width");
+      }
+    case Format::DATE: {
+      // Classic Mac timestamps are based on 1904-01-01 instead of 1970-01-01
+      int64_t ts = value - 2082826800;
+      if (ts < 0) {
+        // TODO: Handle this case properly. Probably it's quite rare
+        return string_printf("%" PRId64 " seconds before 1970-01-01 00:00:00 (classic: 0x%08" PRIX64 ")",
+            -ts, value);
+      } else {
+        return format_time(ts * 1000000) + string_printf(" (classic: 0x%" PRIX64 ")", value);
       }
-      default:
-        throw logic_error("invalid integer display format");
     }
-  };
+    default:
+      throw logic_error("invalid integer display format");
+  }
+}
 
-  static auto align_to_boundary = +[](StringReader& r, uint8_t boundary, uint8_t offset) {
-    if (boundary == 0) {
-      return; // No alignment requested (for optionally-aligned types like PSTRING)
+static void align_to_boundary(StringReader& r, uint8_t boundary, uint8_t offset) {
+  if (boundary == 0) {
+    return; // No alignment requested (for optionally-aligned types like PSTRING)
+  }
+  // We currently only support offset == 0 or (offset == 1 and boundary == 2)
+  // since those seem to be the only cases supported by the TMPL format.
+  if (offset == 1) {
+    if (boundary != 2) {
+      throw logic_error("boundary must be 2 when offset is 1");
     }
-    // We currently only support offset == 0 or (offset == 1 and boundary == 2)
-    // since those seem to be the only cases supported by the TMPL format.
-    if (offset == 1) {
-      if (boundary != 2) {
-        throw logic_error("boundary must be 2 when offset is 1");
-      }
-      if (!(r.where() & 1)) {
-        r.skip(1);
-      }
-    } else if (offset == 0) {
-      r.go((r.where() + (boundary - 1)) & (~(boundary - 1)));
-    } else {
-      throw logic_error("offset is not 1 or 0");
+    if (!(r.where() & 1)) {
+      r.skip(1);
     }
+  } else if (offset == 0) {
+    r.go((r.where() + (boundary - 1)) & (~(boundary - 1)));
+  } else {
+    throw logic_error("offset is not 1 or 0");
+  }
+}
+
+string ResourceFile::disassemble_from_template(
+    const void* data,
+    size_t size,
+    const TemplateEntryList& tmpl) {
+  return ResourceFile::disassemble_from_template(
+      data, size, *ResourceFile::compile_template(tmpl));
+}
+
+string ResourceFile::disassemble_from_template(
+    const void* data,
+    size_t size,
+    const CompiledTemplate& tmpl) {
+  string ret;
+  ResourceFile::disassemble_from_template(ret, data, size, tmpl);
+  return ret;
+}
+
+void ResourceFile::disassemble_from_template(
+    string& out,
+    const void* data,
+    size_t size,
+    const CompiledTemplate& tmpl) {
+  using Type = TemplateEntry::Type;
+  using Format = TemplateEntry::Format;
+
+  struct ListState {
+    size_t item_index;
+    size_t num_items; // Only used for LIST_ZERO_COUNT and LIST_ONE_COUNT
   };
+  vector<ListState> list_stack;
+  list_stack.reserve(tmpl.max_list_depth);
 
-  for (const auto& entry : entries) {
-    string prefix(indent_level * 2, ' ');
-    if (entry->type == Type::VOID) {
-      if (entry->name.empty()) {
-        lines.emplace_back(prefix + "# (empty comment)");
+  StringReader r(data, size);
+  size_t start_size = out.size();
+
+  // Each line is terminated with a newline here; the last one is removed at
+  // the end, so lines are separated in the same way as join(lines, "\n")
+  auto add_line = [&](const string& prefix, const string& value) -> void {
+    out += prefix;
+    out += value;
+    out.push_back('\n');
+  };
+  auto has_next_item = [&](const TemplateEntry* list_entry, const ListState& state) -> bool {
+    switch (list_entry->type) {
+      case Type::LIST_ZERO_BYTE:
+        return r.get_u8(false);
+      case Type::LIST_EOF:
+        return !r.eof();
+      case Type::LIST_ZERO_COUNT:
+      case Type::LIST_ONE_COUNT:
+        return (state.item_index < state.num_items);
+      default:
+        throw logic_error("list end op does not follow list op");
+    }
+  };
+  auto add_item_line = [&](const CompiledTemplate::Op& list_op, size_t item_index) -> void {
+    out += tmpl.strings[list_op.item_prefix_index];
+    out += string_printf("[%zu]\n", item_index);
+  };
+
+  for (size_t op_index = 0; op_index < tmpl.ops.size(); op_index++) {
+    const auto& op = tmpl.ops[op_index];
+
+    if (!op.entry) {
+      const auto& list_op = tmpl.ops[op.jump_index];
+      auto& state = list_stack.back();
+      state.item_index++;
+      if (has_next_item(list_op.entry, state)) {
+        add_item_line(list_op, state.item_index);
+        op_index = op.jump_index;
       } else {
-        lines.emplace_back(prefix + "# " + entry->name);
+        list_stack.pop_back();
       }
       continue;
     }
 
-    if (!entry->name.empty()) {
-      prefix += entry->name;
-      prefix += ": ";
-    }
-
+    const auto* entry = op.entry;
+    const string& prefix = tmpl.strings[op.prefix_index];
     switch (entry->type) {
-      // Note: Type::VOID is already handled above
+      case Type::VOID:
+        add_line(prefix, "");
+        break;
       case Type::ZERO_FILL:
         if ((entry->width != 1) && (entry->width != 2) && (entry->width != 4)) {
           string data = r.readx(entry->width);
           if (data.find_first_not_of('\0') != string::npos) {
-            lines.emplace_back(prefix + format_data_string(data) + " (type = zero fill in template)");
+            add_line(prefix, format_data_string(data) + " (type = zero fill in template)");
           }
           continue;
         }
@@ -785,9 +1087,9 @@ static void disassemble_from_template_inner(
         }
 
         if (entry->type == Type::INTEGER) {
-          lines.emplace_back(prefix + format_integer(entry, value));
+          add_line(prefix, format_template_integer(entry, value));
         } else if (entry->type == Type::ZERO_FILL && value != 0) {
-          lines.emplace_back(prefix + format_integer(entry, value) + " (type = zero fill in template)");
+          add_line(prefix, format_template_integer(entry, value) + " (type = zero fill in template)");
         }
         break;
       }
@@ -801,9 +1103,9 @@ static void disassemble_from_template_inner(
           double value = (integer_part >= 0)
               ? (integer_part + static_cast<double>(fractional_part) / 65536)
               : (integer_part - static_cast<double>(fractional_part) / 65536);
-          lines.emplace_back(string_printf("%s%lg\n", prefix.c_str(), value));
+          add_line(prefix, string_printf("%lg\n", value));
         } else if (entry->format == Format::HEX) {
-          lines.emplace_back(string_printf("%s%s0x%d.0x%hu\n", prefix.c_str(),
+          add_line(prefix, string_printf("%s0x%d.0x%hu\n",
               integer_part < 0 ? "-" : "",
               (integer_part < 0) ? -integer_part : integer_part,
               fractional_part));
@@ -813,10 +1115,10 @@ static void disassemble_from_template_inner(
         break;
       }
       case Type::EOF_STRING:
-        lines.emplace_back(prefix + format_string(entry->format, r.read(r.remaining())));
+        add_line(prefix, format_template_string(entry->format, r.read(r.remaining())));
         break;
       case Type::STRING:
-        lines.emplace_back(prefix + format_string(entry->format, r.readx(entry->width)));
+        add_line(prefix, format_template_string(entry->format, r.readx(entry->width)));
         break;
       case Type::PSTRING:
       case Type::CSTRING: {
@@ -826,7 +1128,7 @@ static void disassemble_from_template_inner(
         } else {
           data = r.get_cstr();
         }
-        lines.emplace_back(prefix + format_string(entry->format, data));
+        add_line(prefix, format_template_string(entry->format, data));
 
         if (entry->end_alignment == 2) {
           if (((data.size() + 1) & 1) != (entry->align_offset)) {
@@ -842,7 +1144,7 @@ static void disassemble_from_template_inner(
         if (size > entry->width) {
           throw runtime_error("p-string too long for field");
         }
-        lines.emplace_back(prefix + format_string(entry->format, r.readx(size)));
+        add_line(prefix, format_template_string(entry->format, r.readx(size)));
         r.skip(entry->width - size);
         break;
       }
@@ -851,89 +1153,81 @@ static void disassemble_from_template_inner(
         if (data.size() > static_cast<size_t>(entry->width + 1)) {
           throw runtime_error("c-string too long for field");
         }
-        lines.emplace_back(prefix + format_string(entry->format, data));
+        add_line(prefix, format_template_string(entry->format, data));
         r.skip(entry->width - data.size() - 1);
         break;
       }
       case Type::BOOL:
         // Note: Yes, Type::BOOL apparently is actually 2 bytes.
-        lines.emplace_back(prefix + (r.get_u16b() ? "true" : "false"));
+        add_line(prefix, r.get_u16b() ? "true" : "false");
         break;
       case Type::POINT_2D: {
         Point pt = r.get<Point>();
-        string x_str = format_integer(entry, pt.x);
-        string y_str = format_integer(entry, pt.y);
-        lines.emplace_back(prefix + "x=" + x_str + ", y=" + y_str);
+        string x_str = format_template_integer(entry, pt.x);
+        string y_str = format_template_integer(entry, pt.y);
+        add_line(prefix, "x=" + x_str + ", y=" + y_str);
         break;
       }
       case Type::RECT: {
         Rect rect = r.get<Rect>();
-        string x1_str = format_integer(entry, rect.x1);
-        string y1_str = format_integer(entry, rect.y1);
-        string x2_str = format_integer(entry, rect.x2);
-        string y2_str = format_integer(entry, rect.y2);
-        lines.emplace_back(prefix + "x1=" + x1_str + ", y1=" + y1_str + ", x2=" + x2_str + ", y2=" + y2_str);
+        string x1_str = format_template_integer(entry, rect.x1);
+        string y1_str = format_template_integer(entry, rect.y1);
+        string x2_str = format_template_integer(entry, rect.x2);
+        string y2_str = format_template_integer(entry, rect.y2);
+        add_line(prefix, "x1=" + x1_str + ", y1=" + y1_str + ", x2=" + x2_str + ", y2=" + y2_str);
         break;
       }
       case Type::COLOR: {
         Color c = r.get<Color>();
-        string r_str = format_integer(entry, c.r);
-        string g_str = format_integer(entry, c.g);
-        string b_str = format_integer(entry, c.b);
-        lines.emplace_back(prefix + "r=" + r_str + ", g=" + g_str + ", b=" + b_str);
+        string r_str = format_template_integer(entry, c.r);
+        string g_str = format_template_integer(entry, c.g);
+        string b_str = format_template_integer(entry, c.b);
+        add_line(prefix, "r=" + r_str + ", g=" + g_str + ", b=" + b_str);
         break;
       }
       case Type::BITFIELD: {
         uint8_t flags = r.get_u8();
         for (const auto& bit_entry : entry->list_entries) {
-          lines.emplace_back(prefix + bit_entry->name + ": " + ((flags & 0x80) ? "true" : "false"));
+          add_line(prefix, bit_entry->name + ": " + ((flags & 0x80) ? "true" : "false"));
           flags <<= 1;
         }
         break;
       }
       case Type::LIST_ZERO_BYTE:
-        lines.emplace_back(prefix + "(zero-terminated list)");
-        for (size_t z = 0; r.get_u8(false); z++) {
-          string item_prefix(indent_level * 2, ' ');
-          item_prefix += entry->name;
-          lines.emplace_back(item_prefix + string_printf("[%zu]", z));
-          disassemble_from_template_inner(lines, r, entry->list_entries, indent_level + 1);
-        }
-        break;
       case Type::LIST_EOF:
-        lines.emplace_back(prefix + "(EOF-terminated list)");
-        for (size_t z = 0; !r.eof(); z++) {
-          string item_prefix(indent_level * 2, ' ');
-          item_prefix += entry->name;
-          lines.emplace_back(item_prefix + string_printf("[%zu]", z));
-          disassemble_from_template_inner(lines, r, entry->list_entries, indent_level + 1);
-        }
-        break;
       case Type::LIST_ZERO_COUNT:
       case Type::LIST_ONE_COUNT: {
-        size_t num_items;
-        if (entry->width == 2) {
-          num_items = r.get_u16b() + (entry->type == Type::LIST_ZERO_COUNT);
-          // 0xFFFF actually means zero in LIST_ZERO_COUNT
-          if (num_items == 0x10000) {
-            num_items = 0;
-          }
-        } else if (entry->width == 4) {
-          // It's (currently) not possible to get a LIST_ZERO_COUNT with a
-          // 4-byte width field
-          if (entry->type == Type::LIST_ZERO_COUNT) {
-            throw logic_error("4-byte width LIST_ZERO_COUNT");
-          }
-          num_items = r.get_u32b();
+        ListState state = {0, 0};
+        if (entry->type == Type::LIST_ZERO_BYTE) {
+          add_line(prefix, "(zero-terminated list)");
+        } else if (entry->type == Type::LIST_EOF) {
+          add_line(prefix, "(EOF-terminated list)");
         } else {
-          throw logic_error("invalid list length width");
+          if (entry->width == 2) {
+            state.num_items = r.get_u16b() + (entry->type == Type::LIST_ZERO_COUNT);
+            // 0xFFFF actually means zero in LIST_ZERO_COUNT
+            if (state.num_items == 0x10000) {
+              state.num_items = 0;
+            }
+          } else if (entry->width == 4) {
+            // It's (currently) not possible to get a LIST_ZERO_COUNT with a
+            // 4-byte width field
+            if (entry->type == Type::LIST_ZERO_COUNT) {
+              throw logic_error("4-byte width LIST_ZERO_COUNT");
+            }
+            state.num_items = r.get_u32b();
+          } else {
+            throw logic_error("invalid list length width");
+          }
+          add_line(prefix, string_printf("(%zu entries)", state.num_items));
         }
-        lines.emplace_back(prefix + string_printf("(%zu entries)", num_items));
-        for (size_t z = 0; z < num_items; z++) {
-          string item_prefix(indent_level * 2, ' ');
-          item_prefix += entry->name;
-          lines.emplace_back(item_prefix + string_printf("[%zu]", z));
-          disassemble_from_template_inner(lines, r, entry->list_entries, indent_level + 1);
+
+        if (has_next_item(entry, state)) {
+          add_item_line(op, 0);
+          list_stack.emplace_back(state);
+        } else {
+          // Skip the item ops and the list end op
+          op_index = op.jump_index;
         }
         break;
       }
@@ -941,21 +1235,15 @@ static void disassemble_from_template_inner(
         throw logic_error("unknown field type in disassemble_from_template");
     }
   }
-}
 
-string ResourceFile::disassemble_from_template(
-    const void* data,
-    size_t size,
-    const ResourceFile::TemplateEntryList& tmpl) {
-  StringReader r(data, size);
-  deque<string> lines;
-  disassemble_from_template_inner(lines, r, tmpl, 0);
   if (!r.eof()) {
     string extra_data = r.read(r.remaining());
-    lines.emplace_back("\nNote: template did not parse all data in resource; remaining data: "
-        + format_data_string(extra_data));
+    add_line("\nNote: template did not parse all data in resource; remaining data: ",
+        format_data_string(extra_data));
+  }
+  if (out.size() > start_size) {
+    out.pop_back();
   }
-  return join(lines, "\n");
 }
 
 
@@ -1604,7 +1892,7 @@ static ResourceFile::DecodedPattern decode_ppat_data(StringReader& r) {
   // color, but it's not clear if these are ever stored in resources or only
   // used when loaded in memory
   if ((header.type == 0) || (header.type == 2)) {
-    return {monochrome_pattern, monochrome_pattern};
+    return {monochrome_pattern, move(monochrome_pattern)};
   }
   if ((header.type != 1) && (header.type != 3)) {
     throw runtime_error("unknown ppat type");
@@ -1916,278 +2204,6 @@ Image ResourceFile::decode_icmN(const void* data, size_t size) {
   return decode_monochrome_image_masked(data, size, 16, 12);
 }
 
-class QuickDrawResourceDasmPort : public QuickDrawPortInterface {
-public:
-  QuickDrawResourceDasmPort(ResourceFile* rf, size_t x, size_t y)
-    : bounds(0, 0, y, x),
-      clip_region(this->bounds),
-      foreground_color(0xFFFF, 0xFFFF, 0xFFFF),
-      background_color(0x0000, 0x0000, 0x0000),
-      highlight_color(0xFFFF, 0x0000, 0xFFFF), // TODO: use the right color here
-      op_color(0xFFFF, 0xFFFF, 0x0000), // TODO: use the right color here
-      extra_space_nonspace(0),
-      extra_space_space(0, 0),
-      pen_loc(0, 0),
-      pen_loc_frac(0),
-      pen_size(1, 1),
-      pen_mode(0), // TODO
-      pen_visibility(0), // visible
-      text_font(0), // TODO
-      text_mode(0), // TODO
-      text_size(0), // TODO
-      text_style(0),
-      foreground_color_index(0),
-      background_color_index(0),
-      pen_pixel_pattern(0, 0),
-      fill_pixel_pattern(0, 0),
-      background_pixel_pattern(0, 0),
-      pen_mono_pattern(0xFFFFFFFFFFFFFFFF),
-      fill_mono_pattern(0xAA55AA55AA55AA55),
-      background_mono_pattern(0x0000000000000000),
-      rf(rf),
-      img(0, 0) {
-    if (x >= 0x10000 || y >= 0x10000) {
-      throw runtime_error("PICT resources cannot specify images larger than 65535x65535");
-    }
-    this->img = Image(x, y);
-  }
-  virtual ~QuickDrawResourceDasmPort() = default;
-
-  const Image& image() const {
-    return this->img;
-  }
-
-  // Image data accessors (Image, pixel map, or bitmap)
-  virtual size_t width() const {
-    return this->img.get_width();
-  }
-  virtual size_t height() const {
-    return this->img.get_height();
-  }
-  virtual void write_pixel(ssize_t x, ssize_t y, uint8_t r, uint8_t g, uint8_t b) {
-    this->img.write_pixel(x, y, r, g, b);
-  }
-  virtual void blit(const Image& src, ssize_t dest_x, ssize_t dest_y,
-      size_t w, size_t h, ssize_t src_x = 0, ssize_t src_y = 0,
-      shared_ptr<Region> mask = nullptr) {
-    if (mask.get()) {
-      this->img.mask_blit(src, dest_x, dest_y, w, h, src_x, src_y, mask->render());
-    } else {
-      this->img.blit(src, dest_x, dest_y, w, h, src_x, src_y);
-    }
-  }
-
-  // External resource data accessors
-  virtual vector<ColorTableEntry> read_clut(int16_t id) {
-    return this->rf->decode_clut(id);
-  }
-
-  // QuickDraw state accessors
-  Rect bounds;
-  virtual const Rect& get_bounds() const {
-    return this->bounds;
-  }
-  virtual void set_bounds(Rect z) {
-    this->bounds = z;
-  }
-
-  Region clip_region;
-  virtual const Region& get_clip_region() const {
-    return this->clip_region;
-  }
-  virtual void set_clip_region(Region&& z) {
-    this->clip_region = move(z);
-  }
-
-  Color foreground_color;
-  virtual Color get_foreground_color() const {
-    return this->foreground_color;
-  }
-  virtual void set_foreground_color(Color z) {
-    this->foreground_color = z;
-  }
-
-  Color background_color;
-  virtual Color get_background_color() const {
-    return this->background_color;
-  }
-  virtual void set_background_color(Color z) {
-    this->background_color = z;
-  }
-
-  Color highlight_color;
-  virtual Color get_highlight_color() const {
-    return this->highlight_color;
-  }
-  virtual void set_highlight_color(Color z) {
-    this->highlight_color = z;
-  }
-
-  Color op_color;
-  virtual Color get_op_color() const {
-    return this->op_color;
-  }
-  virtual void set_op_color(Color z) {
-    this->op_color = z;
-  }
-
-  int16_t extra_space_nonspace;
-  virtual int16_t get_extra_space_nonspace() const {
-    return this->extra_space_nonspace;
-  }
-  virtual void set_extra_space_nonspace(int16_t z) {
-    this->extra_space_nonspace = z;
-  }
-
-  Fixed extra_space_space;
-  virtual Fixed get_extra_space_space() const {
-    return this->extra_space_space;
-  }
-  virtual void set_extra_space_space(Fixed z) {
-    this->extra_space_space = z;
-  }
-
-  Point pen_loc;
-  virtual Point get_pen_loc() const {
-    return this->pen_loc;
-  }
-  virtual void set_pen_loc(Point z) {
-    this->pen_loc = z;
-  }
-
-  int16_t pen_loc_frac;
-  virtual int16_t get_pen_loc_frac() const {
-    return this->pen_loc_frac;
-  }
-  virtual void set_pen_loc_frac(int16_t z) {
-    this->pen_loc_frac = z;
-  }
-
-  Point pen_size;
-  virtual Point get_pen_size() const {
-    return this->pen_size;
-  }
-  virtual void set_pen_size(Point z) {
-    this->pen_size = z;
-  }
-
-  int16_t pen_mode;
-  virtual int16_t get_pen_mode() const {
-    return this->pen_mode;
-  }
-  virtual void set_pen_mode(int16_t z) {
-    this->pen_mode = z;
-  }
-
-  int16_t pen_visibility;
-  virtual int16_t get_pen_visibility() const {
-    return this->pen_visibility;
-  }
-  virtual void set_pen_visibility(int16_t z) {
-    this->pen_visibility = z;
-  }
-
-  int16_t text_font;
-  virtual int16_t get_text_font() const {
-    return this->text_font;
-  }
-  virtual void set_text_font(int16_t z) {
-    this->text_font = z;
-  }
-
-  int16_t text_mode;
-  virtual int16_t get_text_mode() const {
-    return this->text_mode;
-  }
-  virtual void set_text_mode(int16_t z) {
-    this->text_mode = z;
-  }
-
-  int16_t text_size;
-  virtual int16_t get_text_size() const {
-    return this->text_size;
-  }
-  virtual void set_text_size(int16_t z) {
-    this->text_size = z;
-  }
-
-  uint8_t text_style;
-  virtual uint8_t get_text_style() const {
-    return this->text_style;
-  }
-  virtual void set_text_style(uint8_t z) {
-    this->text_style = z;
-  }
-
-  int16_t foreground_color_index;
-  virtual int16_t get_foreground_color_index() const {
-    return this->foreground_color_index;
-  }
-  virtual void set_foreground_color_index(int16_t z) {
-    this->foreground_color_index = z;
-  }
-
-  int16_t background_color_index;
-  virtual int16_t get_background_color_index() const {
-    return this->background_color_index;
-  }
-  virtual void set_background_color_index(int16_t z) {
-    this->background_color_index = z;
-  }
-
-  Image pen_pixel_pattern;
-  virtual const Image& get_pen_pixel_pattern() const {
-    return this->pen_pixel_pattern;
-  }
-  virtual void set_pen_pixel_pattern(Image&& z) {
-    this->pen_pixel_pattern = move(z);
-  }
-
-  Image fill_pixel_pattern;
-  virtual const Image& get_fill_pixel_pattern() const {
-    return this->fill_pixel_pattern;
-  }
-  virtual void set_fill_pixel_pattern(Image&& z) {
-    this->fill_pixel_pattern = move(z);
-  }
-
-  Image background_pixel_pattern;
-  virtual const Image& get_background_pixel_pattern() const {
-    return this->background_pixel_pattern;
-  }
-  virtual void set_background_pixel_pattern(Image&& z) {
-    this->background_pixel_pattern = move(z);
-  }
-
-  Pattern pen_mono_pattern;
-  virtual Pattern get_pen_mono_pattern() const {
-    return this->pen_mono_pattern;
-  }
-  virtual void set_pen_mono_pattern(Pattern z) {
-    this->pen_mono_pattern = z;
-  }
-
-  Pattern fill_mono_pattern;
-  virtual Pattern get_fill_mono_pattern() const {
-    return this->fill_mono_pattern;
-  }
-  virtual void set_fill_mono_pattern(Pattern z) {
-    this->fill_mono_pattern = z;
-  }
-
-  Pattern background_mono_pattern;
-  virtual Pattern get_background_mono_pattern() const {
-    return this->background_mono_pattern;
-  }
-  virtual void set_background_mono_pattern(Pattern z) {
-    this->background_mono_pattern = z;
-  }
-
-protected:
-  ResourceFile* rf;
-  Image img;
-};
-
 ResourceFile::DecodedPictResource ResourceFile::decode_PICT(int16_t id, uint32_t type) {
   return this->decode_PICT(this->get_resource(type, id));
 }
@@ -2196,7 +2212,7 @@ ResourceFile::DecodedPictResource ResourceFile::decode_PICT(shared_ptr<const Res
   try {
     return this->decode_PICT_internal(res);
   } catch (const exception& e) {
-    fprintf(stderr, "warning: PICT rendering failed (%s); attempting rendering using picttoppm\n", e.what());
+    fprintf(current_task_log_stream(), "warning: PICT rendering failed (%s); attempting rendering using picttoppm\n", e.what());
     return {this->decode_PICT_external(res), "", ""};
   }
 }
@@ -2213,14 +2229,19 @@ ResourceFile::DecodedPictResource ResourceFile::decode_PICT_internal(shared_ptr<
   try {
     StringReader r(res->data);
     const auto& header = r.get<PictHeader>();
-    QuickDrawResourceDasmPort port(this, header.bounds.width(), header.bounds.height());
+    check_resource_memory(static_cast<size_t>(max<ssize_t>(header.bounds.width(), 0)) *
+        static_cast<size_t>(max<ssize_t>(header.bounds.height(), 0)) * 3, "PICT canvas");
+    ImagePort port(header.bounds.width(), header.bounds.height(), [this](int16_t id) {
+      return this->decode_clut(id);
+    });
     QuickDrawEngine eng;
     eng.set_port(&port);
     eng.render_pict(res->data.data(), res->data.size());
     return {move(port.image()), "", ""};
 
-  } catch (const pict_contains_undecodable_quicktime& e) {
-    return {Image(0, 0), e.extension, e.data};
+  } catch (pict_contains_undecodable_quicktime& e) {
+    // The embedded data can be large, so move it out of the exception
+    return {Image(0, 0), move(e.extension), move(e.data)};
   }
 }
 
@@ -2608,9 +2629,55 @@ struct SoundResourceCompressedBuffer {
   uint8_t data[0];
 } __attribute__((packed));
 
-static ResourceFile::DecodedSoundResource decode_snd_data(
+// Sounds are decoded and written in blocks of about this many samples, so the
+// streaming decoders use a bounded amount of memory regardless of the length of
+// the sound
+static const size_t snd_stream_block_samples = 0x10000;
+
+// Adapts decode_ulaw and decode_alaw to the MACEDecoder/IMA4Decoder interface
+struct LogarithmicPCMDecoder {
+  bool is_alaw;
+
+  inline size_t frame_size() const {
+    return 1;
+  }
+  inline size_t output_samples(size_t size) const {
+    return size;
+  }
+  inline void decode(const void* data, size_t size, le_int16_t* out) {
+    if (this->is_alaw) {
+      decode_alaw(data, size, out);
+    } else {
+      decode_ulaw(data, size, out);
+    }
+  }
+};
+
+template <typename DecoderT>
+static void stream_decoded_samples(DecoderT& decoder, const void* vdata,
+    size_t size, const ResourceFile::SoundWriteFn& write_fn) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+
+  size_t frame_size = decoder.frame_size();
+  size_t block_size = max<size_t>(snd_stream_block_samples /
+      decoder.output_samples(frame_size), 1) * frame_size;
+  vector<le_int16_t> samples(decoder.output_samples(min(block_size, size)));
+  for (size_t offset = 0; offset < size; offset += block_size) {
+    size_t block_bytes = min(block_size, size - offset);
+    decoder.decode(data + offset, block_bytes, samples.data());
+    write_fn(samples.data(), decoder.output_samples(block_bytes) * sizeof(le_int16_t));
+  }
+}
+
+// Parses a snd resource and writes the resulting WAV or MP3 file to write_fn.
+// begin_fn is called with the sound's metadata just before the first call to
+// write_fn, after the header has been validated. If metadata_only is true,
+// neither callback is called.
+static ResourceFile::DecodedSoundResource stream_snd_data(
     const void* vdata, size_t size, bool metadata_only, bool hirf_semantics,
-    bool decompress_ysnd = false) {
+    bool decompress_ysnd,
+    const ResourceFile::SoundBeginFn& begin_fn,
+    const ResourceFile::SoundWriteFn& write_fn) {
   if (size < 4) {
     throw runtime_error("snd doesn\'t even contain a format code");
   }
@@ -2639,20 +2706,24 @@ static ResourceFile::DecodedSoundResource decode_snd_data(
         if (data_header.sample_bits != 8) {
           throw runtime_error("MHK snd does not have 8-bit samples");
         }
-        WaveFileHeader wav(
-            data_header.num_samples,
-            data_header.num_channels,
-            data_header.sample_rate,
-            data_header.sample_bits);
-        StringWriter w;
-        w.write(&wav, wav.size());
-        w.write(r.readx(data_header.num_samples));
-        return {
+        const void* samples = r.getv(data_header.num_samples);
+        ResourceFile::DecodedSoundResource ret = {
           .is_mp3 = false,
           .sample_rate = data_header.sample_rate,
           .base_note = 0x3C,
-          .data = move(w.str()),
+          .data = "",
         };
+        if (!metadata_only) {
+          WaveFileHeader wav(
+              data_header.num_samples,
+              data_header.num_channels,
+              data_header.sample_rate,
+              data_header.sample_bits);
+          begin_fn(ret);
+          write_fn(&wav, wav.size());
+          write_fn(samples, data_header.num_samples);
+        }
+        return ret;
       }
     }
     throw runtime_error("MHK snd does not contain a Data section");
@@ -2707,11 +2778,17 @@ static ResourceFile::DecodedSoundResource decode_snd_data(
       throw runtime_error("cannot decompress Ysnd-encoded format 3 snd");
     }
 
-    return {
+    ResourceFile::DecodedSoundResource ret = {
         true,
         header.sample_rate >> 16,
         static_cast<uint8_t>(header.base_note ? header.base_note : 0x3C),
-        metadata_only ? "" : r.read(r.remaining())};
+        ""};
+    if (!metadata_only) {
+      begin_fn(ret);
+      size_t data_size = r.remaining();
+      write_fn(r.getv(data_size), data_size);
+    }
+    return ret;
 
   } else {
     throw runtime_error("snd is not format 1 or 2");
@@ -2784,8 +2861,9 @@ static ResourceFile::DecodedSoundResource decode_snd_data(
   uint16_t sample_rate = sample_buffer.sample_rate >> 16;
   uint8_t base_note = sample_buffer.base_note ? sample_buffer.base_note : 0x3C;
 
+  ResourceFile::DecodedSoundResource ret = {false, sample_rate, base_note, ""};
   if (metadata_only) {
-    return {false, sample_rate, base_note, ""};
+    return ret;
   }
 
   if (decompress_ysnd) {
@@ -2796,19 +2874,25 @@ static ResourceFile::DecodedSoundResource decode_snd_data(
     WaveFileHeader wav(sample_buffer.data_bytes, num_channels, sample_rate, 8,
         sample_buffer.loop_start, sample_buffer.loop_end, base_note);
 
-    StringWriter w;
-    w.write(&wav, wav.size());
+    begin_fn(ret);
+    write_fn(&wav, wav.size());
 
-    size_t end_size = sample_buffer.data_bytes + w.size();
+    string block;
+    block.reserve(snd_stream_block_samples);
+    size_t remaining_samples = sample_buffer.data_bytes;
     uint8_t p = 0x80;
-    while (w.str().size() < end_size) {
+    while (remaining_samples > 0) {
+      if (block.size() >= snd_stream_block_samples) {
+        write_fn(block.data(), block.size());
+        block.clear();
+      }
       uint8_t x = r.get_u8();
       uint8_t d1 = (x >> 4) - 8;
       p += (d1 * 2);
       d1 += 8;
       if ((d1 != 0) && (d1 != 0x0F)) {
-        w.put_u8(p);
-        if (w.str().size() >= end_size) {
+        block.push_back(p);
+        if (--remaining_samples == 0) {
           break;
         }
       }
@@ -2816,11 +2900,13 @@ static ResourceFile::DecodedSoundResource decode_snd_data(
       p += (x * 2);
       x += 8;
       if ((x != 0) && (x != 0x0F)) {
-        w.put_u8(p);
+        block.push_back(p);
+        remaining_samples--;
       }
     }
+    write_fn(block.data(), block.size());
 
-    return {false, sample_rate, base_note, move(w.str())};
+    return ret;
   }
 
   // Uncompressed data can be copied verbatim
@@ -2836,10 +2922,11 @@ static ResourceFile::DecodedSoundResource decode_snd_data(
     WaveFileHeader wav(num_samples, num_channels, sample_rate, 8,
         sample_buffer.loop_start, sample_buffer.loop_end, base_note);
 
-    StringWriter w;
-    w.write(&wav, wav.size());
-    w.write(r.readx(num_samples));
-    return {false, sample_rate, base_note, move(w.str())};
+    const void* samples = r.getv(num_samples);
+    begin_fn(ret);
+    write_fn(&wav, wav.size());
+    write_fn(samples, num_samples);
+    return ret;
 
   // Compressed data will need to be decompressed first
   } else if ((sample_buffer.encoding == 0xFE) || (sample_buffer.encoding == 0xFF)) {
@@ -2860,22 +2947,22 @@ static ResourceFile::DecodedSoundResource decode_snd_data(
       case 3:
       case 4: {
         bool is_mace3 = compressed_buffer.compression_id == 3;
-        auto decoded_samples = decode_mace(compressed_buffer.data,
-            compressed_buffer.num_frames * (is_mace3 ? 2 : 1) * num_channels,
-            num_channels == 2, is_mace3);
+        MACEDecoder decoder(num_channels == 2, is_mace3);
+        size_t compressed_size = compressed_buffer.num_frames * decoder.frame_size();
+        size_t num_decoded_samples = decoder.output_samples(compressed_size);
         uint32_t loop_factor = is_mace3 ? 3 : 6;
 
-        WaveFileHeader wav(decoded_samples.size() / num_channels, num_channels,
+        WaveFileHeader wav(num_decoded_samples / num_channels, num_channels,
             sample_rate, 16, sample_buffer.loop_start * loop_factor,
             sample_buffer.loop_end * loop_factor, base_note);
-        if (wav.get_data_size() != 2 * decoded_samples.size()) {
+        if (wav.get_data_size() != 2 * num_decoded_samples) {
           throw runtime_error("computed data size does not match decoded data size");
         }
 
-        StringWriter w;
-        w.write(&wav, wav.size());
-        w.write(decoded_samples.data(), wav.get_data_size());
-        return {false, sample_rate, base_note, move(w.str())};
+        begin_fn(ret);
+        write_fn(&wav, wav.size());
+        stream_decoded_samples(decoder, compressed_buffer.data, compressed_size, write_fn);
+        return ret;
       }
 
       case 0xFFFF:
@@ -2883,31 +2970,36 @@ static ResourceFile::DecodedSoundResource decode_snd_data(
         // to the uncompressed case below. For all others, we'll have to
         // decompress somehow
         if ((compressed_buffer.format != 0x74776F73) && (compressed_buffer.format != 0x736F7774)) {
-          vector<le_int16_t> decoded_samples;
-
           size_t num_frames = compressed_buffer.num_frames;
+          size_t num_decoded_samples;
           uint32_t loop_factor;
+          function<void()> stream_samples;
           if (compressed_buffer.format == 0x696D6134) { // ima4
-            decoded_samples = decode_ima4(
-                compressed_buffer.data,
-                num_frames * 34 * num_channels,
-                (num_channels == 2));
+            size_t compressed_size = num_frames * 34 * num_channels;
+            IMA4Decoder decoder(num_channels == 2);
+            num_decoded_samples = decoder.output_samples(compressed_size);
+            stream_samples = [&, decoder, compressed_size]() mutable {
+              stream_decoded_samples(decoder, compressed_buffer.data, compressed_size, write_fn);
+            };
             loop_factor = 4; // TODO: verify this. I don't actually have any examples right now
 
           } else if ((compressed_buffer.format == 0x4D414333) || (compressed_buffer.format == 0x4D414336)) { // MAC3, MAC6
             bool is_mace3 = compressed_buffer.format == 0x4D414333;
-            decoded_samples = decode_mace(
-                compressed_buffer.data,
-                num_frames * (is_mace3 ? 2 : 1) * num_channels,
-                num_channels == 2, is_mace3);
+            MACEDecoder decoder(num_channels == 2, is_mace3);
+            size_t compressed_size = num_frames * decoder.frame_size();
+            num_decoded_samples = decoder.output_samples(compressed_size);
+            stream_samples = [&, decoder, compressed_size]() mutable {
+              stream_decoded_samples(decoder, compressed_buffer.data, compressed_size, write_fn);
+            };
             loop_factor = is_mace3 ? 3 : 6;
 
-          } else if (compressed_buffer.format == 0x756C6177) { // ulaw
-            decoded_samples = decode_ulaw(compressed_buffer.data, num_frames);
-            loop_factor = 2;
-
-          } else if (compressed_buffer.format == 0x616C6177) { // alaw (guess)
-            decoded_samples = decode_alaw(compressed_buffer.data, num_frames);
+          } else if ((compressed_buffer.format == 0x756C6177) || // ulaw
+                     (compressed_buffer.format == 0x616C6177)) { // alaw (guess)
+            LogarithmicPCMDecoder decoder{compressed_buffer.format == 0x616C6177};
+            num_decoded_samples = num_frames;
+            stream_samples = [&, decoder, num_frames]() mutable {
+              stream_decoded_samples(decoder, compressed_buffer.data, num_frames, write_fn);
+            };
             loop_factor = 2;
 
           } else {
@@ -2915,19 +3007,19 @@ static ResourceFile::DecodedSoundResource decode_snd_data(
                 compressed_buffer.format.load()));
           }
 
-          WaveFileHeader wav(decoded_samples.size() / num_channels, num_channels,
+          WaveFileHeader wav(num_decoded_samples / num_channels, num_channels,
               sample_rate, 16, sample_buffer.loop_start * loop_factor,
               sample_buffer.loop_end * loop_factor, base_note);
-          if (wav.get_data_size() != 2 * decoded_samples.size()) {
+          if (wav.get_data_size() != 2 * num_decoded_samples) {
             throw runtime_error(string_printf(
               "computed data size (%" PRIu32 ") does not match decoded data size (%zu)",
-              wav.get_data_size(), 2 * decoded_samples.size()));
+              wav.get_data_size(), 2 * num_decoded_samples));
           }
 
-          StringWriter w;
-          w.write(&wav, wav.size());
-          w.write(decoded_samples.data(), wav.get_data_size());
-          return {false, sample_rate, base_note, move(w.str())};
+          begin_fn(ret);
+          write_fn(&wav, wav.size());
+          stream_samples();
+          return ret;
         }
 
         [[fallthrough]];
@@ -2957,19 +3049,30 @@ static ResourceFile::DecodedSoundResource decode_snd_data(
               wav.get_data_size(), r.remaining()));
         }
 
+        size_t data_size = wav.get_data_size();
+        const uint8_t* samples = reinterpret_cast<const uint8_t*>(r.getv(data_size));
+        begin_fn(ret);
+        write_fn(&wav, wav.size());
+
         // Byteswap the samples if it's 16-bit and not 'swot'
-        string samples_str = r.readx(wav.get_data_size());
         if ((wav.bits_per_sample == 0x10) && (compressed_buffer.format != 0x736F7774)) {
-          uint16_t* samples = reinterpret_cast<uint16_t*>(samples_str.data());
-          for (uint32_t x = 0; x < samples_str.size() / 2; x++) {
-            samples[x] = bswap16(samples[x]);
+          vector<uint16_t> block(min<size_t>(data_size / 2, snd_stream_block_samples));
+          for (size_t offset = 0; offset < data_size / 2; offset += block.size()) {
+            size_t count = min<size_t>(data_size / 2 - offset, block.size());
+            memcpy(block.data(), samples + offset * 2, count * 2);
+            for (size_t x = 0; x < count; x++) {
+              block[x] = bswap16(block[x]);
+            }
+            write_fn(block.data(), count * 2);
+          }
+          // If the data size is odd, the last byte isn't byteswapped
+          if (data_size & 1) {
+            write_fn(samples + data_size - 1, 1);
           }
+        } else {
+          write_fn(samples, data_size);
         }
-
-        StringWriter w;
-        w.write(&wav, wav.size());
-        w.write(samples_str);
-        return {false, sample_rate, base_note, move(w.str())};
+        return ret;
       }
 
       default:
@@ -2984,6 +3087,36 @@ static ResourceFile::DecodedSoundResource decode_snd_data(
 
 
 
+static ResourceFile::DecodedSoundResource decode_snd_data(
+    const void* vdata, size_t size, bool metadata_only, bool hirf_semantics,
+    bool decompress_ysnd = false) {
+  StringWriter w;
+  auto ret = stream_snd_data(vdata, size, metadata_only, hirf_semantics,
+      decompress_ysnd, [](const ResourceFile::DecodedSoundResource&) { },
+      [&](const void* data, size_t data_size) {
+    w.write(data, data_size);
+  });
+  ret.data = move(w.str());
+  return ret;
+}
+
+
+
+ResourceFile::DecodedSoundResource ResourceFile::decode_sound_metadata_memoized(
+    shared_ptr<const Resource> res, const function<DecodedSoundResource()>& decode) {
+  {
+    lock_guard<mutex> g(this->sound_memo.lock);
+    auto it = this->sound_memo.sound_metadata.find(res.get());
+    if (it != this->sound_memo.sound_metadata.end()) {
+      return it->second.second;
+    }
+  }
+  auto ret = decode();
+  lock_guard<mutex> g(this->sound_memo.lock);
+  this->sound_memo.sound_metadata.emplace(res.get(), make_pair(res, ret));
+  return ret;
+}
+
 ResourceFile::DecodedSoundResource ResourceFile::decode_snd(
     int16_t id, uint32_t type, bool metadata_only) {
   return this->decode_snd(this->get_resource(type, id), metadata_only);
@@ -2991,6 +3124,11 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_snd(
 
 ResourceFile::DecodedSoundResource ResourceFile::decode_snd(
     shared_ptr<const Resource> res, bool metadata_only) {
+  if (metadata_only) {
+    return this->decode_sound_metadata_memoized(res, [&]() {
+      return this->decode_snd(res->data.data(), res->data.size(), true);
+    });
+  }
   return ResourceFile::decode_snd(res->data.data(), res->data.size(), metadata_only);
 }
 
@@ -3168,11 +3306,16 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_csnd(
 
 ResourceFile::DecodedSoundResource ResourceFile::decode_csnd(
     shared_ptr<const Resource> res, bool metadata_only) {
+  if (metadata_only) {
+    return this->decode_sound_metadata_memoized(res, [&]() {
+      return this->decode_csnd(res->data.data(), res->data.size(), true);
+    });
+  }
   return ResourceFile::decode_csnd(res->data.data(), res->data.size(), metadata_only);
 }
 
-ResourceFile::DecodedSoundResource ResourceFile::decode_csnd(
-    const void* data, size_t size, bool metadata_only) {
+// Returns the snd resource contained in a csnd resource
+static string decompress_csnd_data(const void* data, size_t size) {
   StringReader r(data, size);
   uint32_t type_and_size = r.get_u32b();
 
@@ -3232,7 +3375,13 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_csnd(
     }
   }
 
-  // The result is a snd resource, which we can then decode normally
+  // The result is a snd resource, which can then be decoded normally
+  return decompressed;
+}
+
+ResourceFile::DecodedSoundResource ResourceFile::decode_csnd(
+    const void* data, size_t size, bool metadata_only) {
+  string decompressed = decompress_csnd_data(data, size);
   return decode_snd_data(decompressed.data(), decompressed.size(),
       metadata_only, this->index_format() == IndexFormat::HIRF);
 }
@@ -3244,6 +3393,11 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_esnd(
 
 ResourceFile::DecodedSoundResource ResourceFile::decode_esnd(
     shared_ptr<const Resource> res, bool metadata_only) {
+  if (metadata_only) {
+    return this->decode_sound_metadata_memoized(res, [&]() {
+      return this->decode_esnd(res->data.data(), res->data.size(), true);
+    });
+  }
   return ResourceFile::decode_esnd(res->data.data(), res->data.size(), metadata_only);
 }
 
@@ -3261,17 +3415,28 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_ESnd(
 
 ResourceFile::DecodedSoundResource ResourceFile::decode_ESnd(
     shared_ptr<const Resource> res, bool metadata_only) {
+  if (metadata_only) {
+    return this->decode_sound_metadata_memoized(res, [&]() {
+      return this->decode_ESnd(res->data.data(), res->data.size(), true);
+    });
+  }
   return ResourceFile::decode_ESnd(res->data.data(), res->data.size(), metadata_only);
 }
 
-ResourceFile::DecodedSoundResource ResourceFile::decode_ESnd(
-    const void* vdata, size_t size, bool metadata_only) {
+// Returns the snd resource contained in an ESnd resource
+static string decode_ESnd_data(const void* vdata, size_t size) {
   string data(reinterpret_cast<const char*>(vdata), size);
   uint8_t* ptr = reinterpret_cast<uint8_t*>(data.data());
   uint8_t* data_end = ptr + data.size();
   for (uint8_t sample = (*ptr++ ^= 0xFF); ptr != data_end; ptr++) {
     *ptr = (sample += (*ptr ^ 0xFF));
   }
+  return data;
+}
+
+ResourceFile::DecodedSoundResource ResourceFile::decode_ESnd(
+    const void* vdata, size_t size, bool metadata_only) {
+  string data = decode_ESnd_data(vdata, size);
   return decode_snd_data(data.data(), data.size(), metadata_only,
       (this->index_format() == IndexFormat::HIRF));
 }
@@ -3283,6 +3448,11 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_Ysnd(
 
 ResourceFile::DecodedSoundResource ResourceFile::decode_Ysnd(
     shared_ptr<const Resource> res, bool metadata_only) {
+  if (metadata_only) {
+    return this->decode_sound_metadata_memoized(res, [&]() {
+      return this->decode_Ysnd(res->data.data(), res->data.size(), true);
+    });
+  }
   return ResourceFile::decode_Ysnd(res->data.data(), res->data.size(), metadata_only);
 }
 
@@ -3292,6 +3462,64 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_Ysnd(
       (this->index_format() == IndexFormat::HIRF), true);
 }
 
+void ResourceFile::stream_snd(shared_ptr<const Resource> res,
+    const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn) {
+  this->stream_snd(res->data.data(), res->data.size(), begin_fn, write_fn);
+}
+
+void ResourceFile::stream_snd(const void* data, size_t size,
+    const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn) {
+  stream_snd_data(data, size, false, this->index_format() == IndexFormat::HIRF,
+      false, begin_fn, write_fn);
+}
+
+void ResourceFile::stream_csnd(shared_ptr<const Resource> res,
+    const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn) {
+  this->stream_csnd(res->data.data(), res->data.size(), begin_fn, write_fn);
+}
+
+void ResourceFile::stream_csnd(const void* data, size_t size,
+    const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn) {
+  string decompressed = decompress_csnd_data(data, size);
+  stream_snd_data(decompressed.data(), decompressed.size(), false,
+      this->index_format() == IndexFormat::HIRF, false, begin_fn, write_fn);
+}
+
+void ResourceFile::stream_esnd(shared_ptr<const Resource> res,
+    const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn) {
+  this->stream_esnd(res->data.data(), res->data.size(), begin_fn, write_fn);
+}
+
+void ResourceFile::stream_esnd(const void* data, size_t size,
+    const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn) {
+  string decrypted = decrypt_soundmusicsys_data(data, size);
+  stream_snd_data(decrypted.data(), decrypted.size(), false,
+      this->index_format() == IndexFormat::HIRF, false, begin_fn, write_fn);
+}
+
+void ResourceFile::stream_ESnd(shared_ptr<const Resource> res,
+    const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn) {
+  this->stream_ESnd(res->data.data(), res->data.size(), begin_fn, write_fn);
+}
+
+void ResourceFile::stream_ESnd(const void* data, size_t size,
+    const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn) {
+  string decoded = decode_ESnd_data(data, size);
+  stream_snd_data(decoded.data(), decoded.size(), false,
+      this->index_format() == IndexFormat::HIRF, false, begin_fn, write_fn);
+}
+
+void ResourceFile::stream_Ysnd(shared_ptr<const Resource> res,
+    const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn) {
+  this->stream_Ysnd(res->data.data(), res->data.size(), begin_fn, write_fn);
+}
+
+void ResourceFile::stream_Ysnd(const void* data, size_t size,
+    const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn) {
+  stream_snd_data(data, size, false, this->index_format() == IndexFormat::HIRF,
+      true, begin_fn, write_fn);
+}
+
 string ResourceFile::decode_cmid(int16_t id, uint32_t type) {
   return this->decode_cmid(this->get_resource(type, id));
 }
@@ -3390,6 +3618,14 @@ ResourceFile::DecodedInstrumentResource ResourceFile::decode_INST(shared_ptr<con
 
 ResourceFile::DecodedInstrumentResource ResourceFile::decode_INST_recursive(
     shared_ptr<const Resource> res, unordered_set<int16_t>& ids_in_progress) {
+  {
+    lock_guard<mutex> g(this->sound_memo.lock);
+    auto it = this->sound_memo.instruments.find(res.get());
+    if (it != this->sound_memo.instruments.end()) {
+      return it->second.second;
+    }
+  }
+
   if (!ids_in_progress.emplace(res->id).second) {
     throw runtime_error("reference cycle between INST resources");
   }
@@ -3469,6 +3705,9 @@ ResourceFile::DecodedInstrumentResource ResourceFile::decode_INST_recursive(
   ret.author = r.readx(r.get_u8());
 
   ids_in_progress.erase(res->id);
+
+  lock_guard<mutex> g(this->sound_memo.lock);
+  this->sound_memo.instruments.emplace(res.get(), make_pair(res, ret));
   return ret;
 }
 
@@ -4086,11 +4325,68 @@ static const string mac_roman_table_rtf[0x100] = {
   "\\u175?", "\\u728?", "\\u729?", "\\u730?", "\\u184?", "\\u733?", "\\u731?", "\\u711?",
 };
 
+static const array<uint8_t, 0x100> mac_roman_table_lengths = []() {
+  array<uint8_t, 0x100> ret;
+  for (size_t z = 0; z < 0x100; z++) {
+    ret[z] = mac_roman_table[z].size();
+  }
+  return ret;
+}();
+
+// Returns the number of bytes at the beginning of data that decode to
+// themselves (printable ASCII)
+static size_t mac_roman_unchanged_prefix_length(const uint8_t* data, size_t size) {
+  size_t offset = 0;
+#ifdef __SSE2__
+  // The comparisons are signed, so bytes 80-FF fail the first one
+  const __m128i min_exclusive = _mm_set1_epi8(0x1F);
+  const __m128i max_exclusive = _mm_set1_epi8(0x7F);
+  for (; offset + 16 <= size; offset += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+    __m128i unchanged = _mm_and_si128(
+        _mm_cmpgt_epi8(v, min_exclusive), _mm_cmplt_epi8(v, max_exclusive));
+    uint32_t mask = _mm_movemask_epi8(unchanged);
+    if (mask != 0xFFFF) {
+      return offset + countr_one(mask);
+    }
+  }
+#endif
+  for (; offset < size; offset++) {
+    uint8_t ch = data[offset];
+    if ((ch < 0x20) || (ch >= 0x7F)) {
+      break;
+    }
+  }
+  return offset;
+}
+
+void append_decoded_mac_roman(string& out, const char* data, size_t size) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+
+  size_t decoded_size = 0;
+  for (size_t z = 0; z < size; z++) {
+    decoded_size += mac_roman_table_lengths[src[z]];
+  }
+  size_t out_offset = out.size();
+  out.resize(out_offset + decoded_size);
+  char* dest = out.data() + out_offset;
+
+  for (size_t z = 0; z < size;) {
+    size_t unchanged_bytes = mac_roman_unchanged_prefix_length(src + z, size - z);
+    memcpy(dest, src + z, unchanged_bytes);
+    dest += unchanged_bytes;
+    z += unchanged_bytes;
+    if (z < size) {
+      uint8_t ch = src[z++];
+      memcpy(dest, mac_roman_table[ch].data(), mac_roman_table_lengths[ch]);
+      dest += mac_roman_table_lengths[ch];
+    }
+  }
+}
+
 string decode_mac_roman(const char* data, size_t size) {
   string ret;
-  while (size--) {
-    ret += mac_roman_table[static_cast<uint8_t>(*(data++))];
-  }
+  append_decoded_mac_roman(ret, data, size);
   return ret;
 }
 
@@ -4111,11 +4407,14 @@ ResourceFile::DecodedStringSequence ResourceFile::decode_STRN(const void* vdata,
   size_t count = r.get_u16b();
 
   vector<string> ret;
+  ret.reserve(count);
   while (ret.size() < count) {
-    ret.emplace_back(decode_mac_roman(r.readx(r.get_u8())));
+    uint8_t len = r.get_u8();
+    append_decoded_mac_roman(ret.emplace_back(),
+        reinterpret_cast<const char*>(r.getv(len)), len);
   }
 
-  return {ret, r.read(r.remaining())};
+  return {move(ret), r.read(r.remaining())};
 }
 
 ResourceFile::DecodedString ResourceFile::decode_STR(int16_t id, uint32_t type) {
@@ -4132,7 +4431,8 @@ ResourceFile::DecodedString ResourceFile::decode_STR(const void* vdata, size_t s
   }
 
   StringReader r(vdata, size);
-  string s = decode_mac_roman(r.readx(r.get_u8()));
+  uint8_t len = r.get_u8();
+  string s = decode_mac_roman(reinterpret_cast<const char*>(r.getv(len)), len);
   return {move(s), r.read(r.remaining())};
 }
 
@@ -4509,6 +4809,7 @@ ResourceFile::DecodedFontResource ResourceFile::decode_FONT(
 
   ret.missing_glyph = move(ret.glyphs.back());
   ret.glyphs.pop_back();
+  ret.strike = move(glyphs_bitmap);
 
   return ret;
 }
@@ -4569,3 +4870,258 @@ ResourceFile::DecodedROMOverridesResource ResourceFile::decode_ROvN(const void*
   }
   return ret;
 }
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Batch decoding
+
+typedef void (*BatchDecodeFn)(ResourceFile&, shared_ptr<const ResourceFile::Resource>, ResourceFile::DecodedResource&);
+
+static void set_decoded_images(ResourceFile::DecodedResource& out, Image&& img) {
+  out.kind = ResourceFile::DecodedResource::Kind::IMAGES;
+  out.images.emplace_back(move(img));
+}
+
+static void set_decoded_images(ResourceFile::DecodedResource& out, vector<Image>&& imgs) {
+  out.kind = ResourceFile::DecodedResource::Kind::IMAGES;
+  out.images = move(imgs);
+}
+
+static void set_decoded_sound(ResourceFile::DecodedResource& out,
+    ResourceFile::DecodedSoundResource&& decoded) {
+  out.kind = ResourceFile::DecodedResource::Kind::AUDIO;
+  out.is_mp3 = decoded.is_mp3;
+  out.sample_rate = decoded.sample_rate;
+  out.data = move(decoded.data);
+}
+
+static void set_decoded_midi(ResourceFile::DecodedResource& out, string&& data) {
+  out.kind = ResourceFile::DecodedResource::Kind::MIDI;
+  out.data = move(data);
+}
+
+static void set_decoded_text(ResourceFile::DecodedResource& out, string&& text) {
+  out.kind = ResourceFile::DecodedResource::Kind::TEXT;
+  out.text = move(text);
+}
+
+#define DECODE_IMAGE(fn) [](ResourceFile& rf, shared_ptr<const ResourceFile::Resource> res, ResourceFile::DecodedResource& out) { \
+  set_decoded_images(out, rf.fn(res)); \
+}
+#define DECODE_SOUND(fn) [](ResourceFile& rf, shared_ptr<const ResourceFile::Resource> res, ResourceFile::DecodedResource& out) { \
+  set_decoded_sound(out, rf.fn(res)); \
+}
+#define DECODE_MIDI(fn) [](ResourceFile&, shared_ptr<const ResourceFile::Resource> res, ResourceFile::DecodedResource& out) { \
+  set_decoded_midi(out, ResourceFile::fn(res)); \
+}
+
+static void decode_cicn_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  auto decoded = ResourceFile::decode_cicn(res);
+  set_decoded_images(out, move(decoded.image));
+  out.images.emplace_back(move(decoded.bitmap));
+}
+
+static void decode_CURS_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  set_decoded_images(out, move(ResourceFile::decode_CURS(res).bitmap));
+}
+
+static void decode_crsr_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  auto decoded = ResourceFile::decode_crsr(res);
+  set_decoded_images(out, move(decoded.image));
+  out.images.emplace_back(move(decoded.bitmap));
+}
+
+static void decode_ppat_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  auto decoded = ResourceFile::decode_ppat(res);
+  set_decoded_images(out, move(decoded.pattern));
+  out.images.emplace_back(move(decoded.monochrome_pattern));
+}
+
+static void decode_pptN_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  out.kind = ResourceFile::DecodedResource::Kind::IMAGES;
+  for (auto& decoded : ResourceFile::decode_pptN(res)) {
+    out.images.emplace_back(move(decoded.pattern));
+    out.images.emplace_back(move(decoded.monochrome_pattern));
+  }
+}
+
+static void decode_PICT_batch(ResourceFile& rf, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  auto decoded = rf.decode_PICT(res);
+  if (!decoded.embedded_image_format.empty()) {
+    out.kind = ResourceFile::DecodedResource::Kind::EMBEDDED_FILE;
+    out.text = move(decoded.embedded_image_format);
+    out.data = move(decoded.embedded_image_data);
+  } else {
+    set_decoded_images(out, move(decoded.image));
+  }
+}
+
+static void decode_SMSD_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  out.kind = ResourceFile::DecodedResource::Kind::AUDIO;
+  out.sample_rate = 22050;
+  out.data = ResourceFile::decode_SMSD(res);
+}
+
+static void decode_SOUN_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  out.kind = ResourceFile::DecodedResource::Kind::AUDIO;
+  out.sample_rate = 11025;
+  out.data = ResourceFile::decode_SOUN(res);
+}
+
+static void decode_STR_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  set_decoded_text(out, move(ResourceFile::decode_STR(res).str));
+}
+
+static void decode_STRN_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  string text;
+  for (const auto& s : ResourceFile::decode_STRN(res).strs) {
+    text += s;
+    text += '\n';
+  }
+  set_decoded_text(out, move(text));
+}
+
+static void decode_TEXT_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  set_decoded_text(out, ResourceFile::decode_TEXT(res));
+}
+
+static void decode_card_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  set_decoded_text(out, ResourceFile::decode_card(res));
+}
+
+static void decode_CODE_batch(ResourceFile&, shared_ptr<const ResourceFile::Resource> res,
+    ResourceFile::DecodedResource& out) {
+  out.kind = ResourceFile::DecodedResource::Kind::DISASSEMBLY;
+  if (res->id == 0) {
+    auto decoded = ResourceFile::decode_CODE_0(res);
+    out.text = string_printf("# above A5 size: 0x%08X\n# below A5 size: 0x%08X\n",
+        decoded.above_a5_size, decoded.below_a5_size);
+    for (size_t x = 0; x < decoded.jump_table.size(); x++) {
+      const auto& e = decoded.jump_table[x];
+      if (e.code_resource_id || e.offset) {
+        out.text += string_printf("# export %zu [A5 + 0x%zX]: CODE %hd offset 0x%hX\n",
+            x, 0x22 + (x * 8), e.code_resource_id, e.offset);
+      }
+    }
+    return;
+  }
+
+  // Unlike resource_dasm, this doesn't look at CODE 0, so the disassembly
+  // doesn't have jump table labels.
+  auto decoded = ResourceFile::decode_CODE(res);
+  if (decoded.first_jump_table_entry < 0) {
+    out.text = "# far model CODE resource\n";
+  } else {
+    out.text = string_printf("# near model CODE resource\n# jump table entries: %hu starting at %d\n",
+        decoded.num_jump_table_entries, decoded.first_jump_table_entry);
+  }
+  DisassemblyOutput text(move(out.text));
+  M68KEmulator::disassemble(text, decoded.code.data(), decoded.code.size(), 0);
+  out.text = text.take();
+}
+
+static const unordered_map<uint32_t, BatchDecodeFn>& batch_decode_fns() {
+  static const unordered_map<uint32_t, BatchDecodeFn> fns({
+    {RESOURCE_TYPE_card, decode_card_batch},
+    {RESOURCE_TYPE_cicn, decode_cicn_batch},
+    {RESOURCE_TYPE_cmid, DECODE_MIDI(decode_cmid)},
+    {RESOURCE_TYPE_CODE, decode_CODE_batch},
+    {RESOURCE_TYPE_crsr, decode_crsr_batch},
+    {RESOURCE_TYPE_csnd, DECODE_SOUND(decode_csnd)},
+    {RESOURCE_TYPE_CURS, decode_CURS_batch},
+    {RESOURCE_TYPE_ecmi, DECODE_MIDI(decode_ecmi)},
+    {RESOURCE_TYPE_emid, DECODE_MIDI(decode_emid)},
+    {RESOURCE_TYPE_esnd, DECODE_SOUND(decode_esnd)},
+    {RESOURCE_TYPE_ESnd, DECODE_SOUND(decode_ESnd)},
+    {RESOURCE_TYPE_icl4, DECODE_IMAGE(decode_icl4)},
+    {RESOURCE_TYPE_icl8, DECODE_IMAGE(decode_icl8)},
+    {RESOURCE_TYPE_icm4, DECODE_IMAGE(decode_icm4)},
+    {RESOURCE_TYPE_icm8, DECODE_IMAGE(decode_icm8)},
+    {RESOURCE_TYPE_icmN, DECODE_IMAGE(decode_icmN)},
+    {RESOURCE_TYPE_ICNN, DECODE_IMAGE(decode_ICNN)},
+    {RESOURCE_TYPE_ICON, DECODE_IMAGE(decode_ICON)},
+    {RESOURCE_TYPE_ics4, DECODE_IMAGE(decode_ics4)},
+    {RESOURCE_TYPE_ics8, DECODE_IMAGE(decode_ics8)},
+    {RESOURCE_TYPE_icsN, DECODE_IMAGE(decode_icsN)},
+    {RESOURCE_TYPE_kcs4, DECODE_IMAGE(decode_kcs4)},
+    {RESOURCE_TYPE_kcs8, DECODE_IMAGE(decode_kcs8)},
+    {RESOURCE_TYPE_kcsN, DECODE_IMAGE(decode_kcsN)},
+    {RESOURCE_TYPE_PAT, DECODE_IMAGE(decode_PAT)},
+    {RESOURCE_TYPE_PATN, DECODE_IMAGE(decode_PATN)},
+    {RESOURCE_TYPE_PICT, decode_PICT_batch},
+    {RESOURCE_TYPE_ppat, decode_ppat_batch},
+    {RESOURCE_TYPE_pptN, decode_pptN_batch},
+    {RESOURCE_TYPE_SICN, DECODE_IMAGE(decode_SICN)},
+    {RESOURCE_TYPE_SMSD, decode_SMSD_batch},
+    {RESOURCE_TYPE_snd, DECODE_SOUND(decode_snd)},
+    {RESOURCE_TYPE_SOUN, decode_SOUN_batch},
+    {RESOURCE_TYPE_STR, decode_STR_batch},
+    {RESOURCE_TYPE_STRN, decode_STRN_batch},
+    {RESOURCE_TYPE_TEXT, decode_TEXT_batch},
+    {RESOURCE_TYPE_Tune, DECODE_MIDI(decode_Tune)},
+    {RESOURCE_TYPE_Ysnd, DECODE_SOUND(decode_Ysnd)},
+  });
+  return fns;
+}
+
+#undef DECODE_IMAGE
+#undef DECODE_SOUND
+#undef DECODE_MIDI
+
+bool ResourceFile::has_decoder_for_type(uint32_t type) {
+  return batch_decode_fns().count(type);
+}
+
+ResourceFile::DecodedResource ResourceFile::decode_resource(shared_ptr<const Resource> res) {
+  DecodedResource ret;
+  ret.res = res;
+  const auto& fns = batch_decode_fns();
+  auto fn_it = fns.find(res->type);
+  if (fn_it != fns.end()) {
+    fn_it->second(*this, res, ret);
+  }
+  return ret;
+}
+
+void ResourceFile::decode_all(
+    function<bool(uint32_t, int16_t)> filter,
+    function<void(DecodedResource&&)> callback,
+    size_t num_threads,
+    uint64_t decompression_flags) {
+  vector<pair<uint32_t, int16_t>> keys;
+  for (const auto& key : this->all_resources()) {
+    if (!filter || filter(key.first, key.second)) {
+      keys.emplace_back(key);
+    }
+  }
+
+  mutex callback_lock;
+  run_parallel_tasks(keys.size(), num_threads, [&](size_t z, FILE*) -> void {
+    const auto& key = keys[z];
+    DecodedResource result;
+    try {
+      ScratchArenaScope scratch_arena;
+      result = this->decode_resource(this->get_resource(key.first, key.second, decompression_flags));
+    } catch (const exception& e) {
+      result = DecodedResource();
+      result.res = this->get_resource_metadata(key.first, key.second);
+      result.kind = DecodedResource::Kind::ERROR;
+      result.text = e.what();
+    }
+    lock_guard<mutex> g(callback_lock);
+    callback(move(result));
+  });
+}
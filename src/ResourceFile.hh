@@ -7,15 +7,21 @@
 
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <vector>
 
+#include "MappedFile.hh"
 #include "QuickDrawFormats.hh"
 #include "ExecutableFormats/PEFFFile.hh"
 
 
 
+class DecompressorCache; // Defined in ResourceCompression.hh
+
 enum class IndexFormat {
   NONE = 0, // For ResourceFiles constructed in memory
   RESOURCE_FORK,
@@ -249,6 +255,19 @@ public:
   // contents. To parse an existing archive and get a ResourceFile object, use a
   // function defined in one of the headers in the IndexFormats directory. The
   // constructors defined in this class will only create an empty ResourceFile.
+  //
+  // Thread safety: once a ResourceFile is parsed, any number of threads may
+  // look up, load, and decode its resources at the same time (that is, call
+  // get_resource, get_resource_metadata, the all_resource* functions,
+  // get_compiled_TMPL, and the decode_* functions), as long as no thread
+  // modifies the index (via add, remove, change_id, rename, etc.) meanwhile.
+  // Lookups don't take any locks. Each resource's data is loaded and
+  // decompressed only once: the first thread to request it does the work, and
+  // other threads requesting the same resource wait for it. Since resources
+  // are decompressed in place, all threads should use the same decompression
+  // flags, and data_size() on a resource from get_resource_metadata may not
+  // be called while another thread is loading that resource. Decompressors
+  // loaded by decompressor_cache() are not shared between threads.
 
   ResourceFile();
   ResourceFile(IndexFormat format);
@@ -270,10 +289,43 @@ public:
     Resource(Resource&&) = default;
     Resource& operator=(const Resource&) = default;
     Resource& operator=(Resource&&) = default;
-    Resource(uint32_t type, int16_t id, const std::string& data);
-    Resource(uint32_t type, int16_t id, std::string&& data);
-    Resource(uint32_t type, int16_t id, uint16_t flags, const std::string& name, const std::string& data);
-    Resource(uint32_t type, int16_t id, uint16_t flags, std::string&& name, std::string&& data);
+    // The name and data are taken by value, so callers can move either or both
+    // of them in (e.g. a new data buffer with a name copied from another
+    // resource) without copying the one that's moved.
+    Resource(uint32_t type, int16_t id, std::string data);
+    Resource(uint32_t type, int16_t id, uint16_t flags, std::string name, std::string data);
+    // Creates a resource whose data is data_source_size bytes at
+    // data_source_offset within data_source. The data isn't copied until
+    // load_data() is called, which get_resource() does automatically.
+    Resource(uint32_t type, int16_t id, uint16_t flags, std::string name,
+        std::shared_ptr<const MappedFile> data_source, size_t data_source_offset,
+        size_t data_source_size);
+
+    // If data_source is not null, data is empty because it hasn't been copied
+    // out of the source file yet.
+    std::shared_ptr<const MappedFile> data_source;
+    size_t data_source_offset;
+    size_t data_source_size;
+
+    inline bool is_data_loaded() const {
+      return !this->data_source.get();
+    }
+    // Held by get_resource while loading and decompressing the data. Copies
+    // of a Resource get their own lock.
+    struct LoadLock {
+      std::mutex lock;
+      LoadLock() = default;
+      LoadLock(const LoadLock&) { }
+      LoadLock& operator=(const LoadLock&) {
+        return *this;
+      }
+    };
+    mutable LoadLock load_lock;
+    // Returns the size of the resource's data without loading it
+    inline size_t data_size() const {
+      return this->data_source.get() ? this->data_source_size : this->data.size();
+    }
+    void load_data();
   };
 
   // add() does not overwrite a resource if one already exists with the same
@@ -284,6 +336,9 @@ public:
   bool add(Resource&& res);
   bool add(std::shared_ptr<Resource> res);
   bool remove(uint32_t type, int16_t id);
+  // Like add(), change_id() does not overwrite an existing resource; it returns
+  // false (and changes nothing) if the resource doesn't exist or if another
+  // resource of the same type already has new_id.
   bool change_id(uint32_t type, int16_t current_id, int16_t new_id);
   bool rename(uint32_t type, int16_t id, const std::string& new_name);
 
@@ -300,12 +355,30 @@ public:
   // with decompression_flags = DecompressionFlag::DISABLED.
   std::shared_ptr<const Resource> get_resource(uint32_t type, int16_t id) const;
   std::shared_ptr<const Resource> get_resource(uint32_t type, const char* name) const;
+  // Returns a resource without loading its data, if the ResourceFile was
+  // parsed from a MappedFile and the resource hasn't been accessed yet. In
+  // that case res->data is empty; use res->data_size() instead. This is useful
+  // for listing or filtering resources without reading them.
+  std::shared_ptr<const Resource> get_resource_metadata(uint32_t type, int16_t id) const;
+  // Loads (and decompresses, if needed) the data for all resources. After
+  // this, get_resource() and the decode_* functions don't modify the
+  // ResourceFile, so they can be called from multiple threads at once as long
+  // as no resources are added, removed, or changed in the meantime. Resources
+  // that can't be decompressed are skipped; get_resource() still throws for
+  // them, as it would have without this call. If num_threads isn't 1, the
+  // resources are decompressed on that many threads (0 means one per core);
+  // see decompress_resources in ResourceCompression.hh.
+  void load_all_resources(uint64_t decompression_flags = 0, size_t num_threads = 1);
   std::vector<int16_t> all_resources_of_type(uint32_t type) const;
   std::vector<uint32_t> all_resource_types() const;
   std::vector<std::pair<uint32_t, int16_t>> all_resources() const;
 
   uint32_t find_resource_by_id(int16_t id, const std::vector<uint32_t>& types);
 
+  // Returns the loaded dcmp/ncmp contexts used when decompressing this file's
+  // resources. The cache is shared between copies of this ResourceFile.
+  DecompressorCache& decompressor_cache();
+
   struct DecodedCodeFragmentEntry {
     uint32_t architecture;
     uint8_t update_level;
@@ -573,6 +646,9 @@ public:
     };
     Glyph missing_glyph;
     std::vector<Glyph> glyphs;
+    // The font's entire bitmap, with all glyphs side by side. Glyphs' pixels
+    // start at bitmap_offset in this image.
+    Image strike;
   };
 
   enum TextStyleFlag {
@@ -661,13 +737,50 @@ public:
   };
   using TemplateEntryList = std::vector<std::shared_ptr<ResourceFile::TemplateEntry>>;
 
+  // A template flattened into an array of ops, so disassembling many resources
+  // with the same template doesn't walk the TemplateEntry tree or rebuild the
+  // line prefixes each time. The ops for a list's items come immediately after
+  // the list's op, and are followed by a list end op.
+  struct CompiledTemplate {
+    struct Op {
+      // nullptr for list end ops
+      const TemplateEntry* entry;
+      // For list ops, the index of the matching list end op; for list end ops,
+      // the index of the matching list op
+      uint32_t jump_index;
+      // Index in strings of the line prefix (indentation and name), or of the
+      // entire line for VOID entries
+      uint32_t prefix_index;
+      // For list ops, index in strings of the prefix for each item's line
+      uint32_t item_prefix_index;
+    };
+    std::vector<Op> ops;
+    std::vector<std::string> strings;
+    size_t max_list_depth;
+    // The ops point into this tree, so it's kept alive here
+    TemplateEntryList tmpl;
+  };
+
   // Meta resources
   TemplateEntryList decode_TMPL(int16_t id, uint32_t type = RESOURCE_TYPE_TMPL);
   static TemplateEntryList decode_TMPL(std::shared_ptr<const Resource> res);
   static TemplateEntryList decode_TMPL(const void* data, size_t size);
 
+  static std::shared_ptr<const CompiledTemplate> compile_template(
+      const TemplateEntryList& tmpl);
+  // Decodes and compiles a TMPL resource from this file. The result is cached,
+  // so each TMPL is only decoded and compiled once.
+  std::shared_ptr<const CompiledTemplate> get_compiled_TMPL(
+      std::shared_ptr<const Resource> res);
+
   static std::string disassemble_from_template(
       const void* data, size_t size, const TemplateEntryList& tmpl);
+  static std::string disassemble_from_template(
+      const void* data, size_t size, const CompiledTemplate& tmpl);
+  // Same as above, but appends the result to out, so callers disassembling
+  // many resources can reuse the same buffer
+  static void disassemble_from_template(
+      std::string& out, const void* data, size_t size, const CompiledTemplate& tmpl);
 
   // Code metadata resources
   DecodedSizeResource decode_SIZE(int16_t id, uint32_t type = RESOURCE_TYPE_SIZE);
@@ -800,6 +913,9 @@ public:
   // Note: return types may change here in the future to improve structuring and
   // to make it easier for callers of the library to use the returned data in
   // any way other than just saving it to WAV/MIDI files
+  // Decoded INSTs are remembered, since SONGs in the same file usually share
+  // the same instruments. The memo is cleared when resources are added,
+  // removed, or renumbered.
   DecodedInstrumentResource decode_INST(int16_t id, uint32_t type = RESOURCE_TYPE_INST);
   DecodedInstrumentResource decode_INST(std::shared_ptr<const Resource> res);
   // Note: The SONG format depends on the resource index format, so there are no
@@ -808,7 +924,8 @@ public:
   DecodedSongResource decode_SONG(std::shared_ptr<const Resource> res);
   DecodedSongResource decode_SONG(const void* data, size_t size);
   // If metadata_only is true, the .data field in the returned struct will be
-  // empty. This saves time when generating SONG JSONs, for example.
+  // empty. This saves time when generating SONG JSONs, for example. Metadata
+  // decoded from a Resource object is remembered in the same way as INSTs.
   DecodedSoundResource decode_snd(int16_t id, uint32_t type = RESOURCE_TYPE_snd, bool metadata_only = false);
   DecodedSoundResource decode_snd(std::shared_ptr<const Resource> res, bool metadata_only = false);
   DecodedSoundResource decode_snd(const void* data, size_t size, bool metadata_only = false);
@@ -824,6 +941,23 @@ public:
   DecodedSoundResource decode_Ysnd(int16_t id, uint32_t type, bool metadata_only = false);
   DecodedSoundResource decode_Ysnd(std::shared_ptr<const Resource> res, bool metadata_only = false);
   DecodedSoundResource decode_Ysnd(const void* vdata, size_t size, bool metadata_only = false);
+  // Streaming versions of the above. Instead of returning the WAV or MP3 file
+  // in .data, these call begin_fn once with the sound's metadata (and an empty
+  // .data field), then call write_fn with the file's contents in blocks of
+  // bounded size, so long sounds are never entirely decoded in memory. begin_fn
+  // isn't called until the sound's headers have been validated.
+  using SoundBeginFn = std::function<void(const DecodedSoundResource& metadata)>;
+  using SoundWriteFn = std::function<void(const void* data, size_t size)>;
+  void stream_snd(std::shared_ptr<const Resource> res, const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn);
+  void stream_snd(const void* data, size_t size, const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn);
+  void stream_csnd(std::shared_ptr<const Resource> res, const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn);
+  void stream_csnd(const void* data, size_t size, const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn);
+  void stream_esnd(std::shared_ptr<const Resource> res, const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn);
+  void stream_esnd(const void* data, size_t size, const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn);
+  void stream_ESnd(std::shared_ptr<const Resource> res, const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn);
+  void stream_ESnd(const void* data, size_t size, const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn);
+  void stream_Ysnd(std::shared_ptr<const Resource> res, const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn);
+  void stream_Ysnd(const void* data, size_t size, const SoundBeginFn& begin_fn, const SoundWriteFn& write_fn);
   // These function return a string containing a raw WAV file.
   std::string decode_SMSD(int16_t id, uint32_t type = RESOURCE_TYPE_SMSD);
   static std::string decode_SMSD(std::shared_ptr<const Resource> res);
@@ -870,18 +1004,128 @@ public:
   static std::vector<DecodedFontInfo> decode_finf(std::shared_ptr<const Resource> res);
   static std::vector<DecodedFontInfo> decode_finf(const void* data, size_t size);
 
+  // Batch decoding
+
+  // The result of decoding one resource with decode_resource or decode_all.
+  // Which fields are used depends on kind.
+  struct DecodedResource {
+    enum class Kind {
+      RAW = 0, // There's no decoder for this type; see res->data
+      IMAGES, // images (e.g. a cicn produces its color image and its mask)
+      TEXT, // text is UTF-8 text (for STR#, one string per line)
+      AUDIO, // data is a WAV file, or an MP3 file if is_mp3 is true
+      MIDI, // data is a standard MIDI file
+      DISASSEMBLY, // text is the disassembly
+      EMBEDDED_FILE, // data is a file in the format named by text (e.g. a
+                     // PICT that contains a JPEG)
+      ERROR, // Decoding failed; text is the error message
+    };
+    std::shared_ptr<const Resource> res;
+    Kind kind = Kind::RAW;
+    std::vector<Image> images;
+    std::string text;
+    std::string data;
+    // These are only used for AUDIO
+    bool is_mp3 = false;
+    uint32_t sample_rate = 0;
+  };
+  // Returns true if decode_resource has a decoder for this type.
+  static bool has_decoder_for_type(uint32_t type);
+  // Decodes a resource with the decode_* function for its type. Throws if
+  // decoding fails; returns a RAW result if there's no decoder for the type.
+  DecodedResource decode_resource(std::shared_ptr<const Resource> res);
+  // Decodes all resources for which filter(type, id) returns true (or all
+  // resources, if filter is null) on up to num_threads threads (0 means one
+  // thread per core), and calls callback with each result. Resources that
+  // fail to load or decode produce ERROR results instead of stopping the
+  // batch. Calls to callback are serialized, but are not made in any
+  // particular order; if callback throws, no more resources are decoded and
+  // the exception is rethrown.
+  void decode_all(
+      std::function<bool(uint32_t, int16_t)> filter,
+      std::function<void(DecodedResource&&)> callback,
+      size_t num_threads = 1,
+      uint64_t decompression_flags = 0);
+
 private:
   IndexFormat format;
   // Note: It's important that this is not an unordered_map because we expect
   // all_resources to always return resources of the same type contiguously
   std::map<uint64_t, std::shared_ptr<Resource>> key_to_resource;
   std::multimap<std::string, std::shared_ptr<Resource>> name_to_resource;
-  std::unordered_map<int16_t, std::shared_ptr<Resource>> system_dcmp_cache;
+
+  // Hash index of the contents of key_to_resource, which is used for lookups
+  // by type and ID; key_to_resource is only used when the resources must be
+  // visited in order
+  class ResourceKeyIndex {
+  public:
+    ResourceKeyIndex();
+
+    const std::shared_ptr<Resource>* find(uint64_t key) const;
+    // The key must not already be present in the index
+    void insert(uint64_t key, std::shared_ptr<Resource> res);
+    bool erase(uint64_t key);
+
+  private:
+    // Keys are only 48 bits, so this can't be a valid key
+    static constexpr uint64_t EMPTY_KEY = 0xFFFFFFFFFFFFFFFF;
+    struct Slot {
+      uint64_t key;
+      std::shared_ptr<Resource> res;
+    };
+    // Open addressing with linear probing; the number of slots is always zero
+    // or a power of two, and at most half of them are used
+    std::vector<Slot> slots;
+    uint8_t bits;
+    size_t count;
+
+    size_t home_slot(uint64_t key) const;
+    void grow();
+  };
+  ResourceKeyIndex key_index;
+
+  const std::shared_ptr<Resource>& resource_for_key(uint64_t key) const;
+  std::shared_ptr<DecompressorCache> decompressor_cache_ptr;
+  // The cache holds a reference to each TMPL resource, so these pointers are
+  // never reused for a different resource. Like SoundMemo, copies of a
+  // ResourceFile start with an empty cache.
+  struct TemplateMemo {
+    std::mutex lock;
+    std::unordered_map<const Resource*, std::pair<std::shared_ptr<const Resource>,
+        std::shared_ptr<const CompiledTemplate>>> compiled;
+
+    TemplateMemo() = default;
+    TemplateMemo(const TemplateMemo&);
+    TemplateMemo& operator=(const TemplateMemo&);
+  };
+  TemplateMemo compiled_TMPLs;
 
   DecodedInstrumentResource decode_INST_recursive(
       std::shared_ptr<const Resource> res,
       std::unordered_set<int16_t>& ids_in_progress);
 
+  // Memoized results of decode_INST and of the decode_*snd functions with
+  // metadata_only = true, keyed by resource. Like compiled_TMPLs, each entry
+  // holds a reference to its resource, so the keys are never reused. Copies
+  // of a ResourceFile start with an empty memo.
+  struct SoundMemo {
+    std::mutex lock;
+    std::unordered_map<const Resource*, std::pair<std::shared_ptr<const Resource>,
+        DecodedInstrumentResource>> instruments;
+    std::unordered_map<const Resource*, std::pair<std::shared_ptr<const Resource>,
+        DecodedSoundResource>> sound_metadata;
+
+    SoundMemo() = default;
+    SoundMemo(const SoundMemo&);
+    SoundMemo& operator=(const SoundMemo&);
+    void clear();
+  };
+  SoundMemo sound_memo;
+
+  DecodedSoundResource decode_sound_metadata_memoized(
+      std::shared_ptr<const Resource> res,
+      const std::function<DecodedSoundResource()>& decode);
+
   void add_name_index_entry(std::shared_ptr<Resource> res);
   void delete_name_index_entry(std::shared_ptr<Resource> res);
 
@@ -897,6 +1141,8 @@ private:
 
 std::string decode_mac_roman(const char* data, size_t size);
 std::string decode_mac_roman(const std::string& data);
+// Like decode_mac_roman, but appends the decoded text to out
+void append_decoded_mac_roman(std::string& out, const char* data, size_t size);
 
 const char* name_for_region_code(uint16_t region_code);
 const char* name_for_font_id(uint16_t font_id);
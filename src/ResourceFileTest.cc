@@ -0,0 +1,178 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <functional>
+#include <new>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "QuickDrawFormats.hh"
+#include "ResourceFile.hh"
+
+using namespace std;
+
+
+
+static constexpr uint32_t TYPE_TEST = 0x54455354; // 'TEST'
+
+// Allocations of exactly counted_alloc_size bytes are counted, so tests can
+// check that large buffers aren't copied
+static atomic<size_t> counted_alloc_size(0);
+static atomic<size_t> counted_alloc_count(0);
+
+void* operator new(size_t size) {
+  if (size == counted_alloc_size) {
+    counted_alloc_count++;
+  }
+  void* ret = malloc(size ? size : 1);
+  if (!ret) {
+    throw bad_alloc();
+  }
+  return ret;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+// Returns the number of allocations of exactly size bytes made by fn
+static size_t count_allocations(size_t size, function<void()> fn) {
+  counted_alloc_count = 0;
+  counted_alloc_size = size;
+  try {
+    fn();
+  } catch (const exception&) {
+    counted_alloc_size = 0;
+    throw;
+  }
+  counted_alloc_size = 0;
+  return counted_alloc_count;
+}
+
+int main(int, char**) {
+  fprintf(stderr, "-- change_id\n");
+  {
+    ResourceFile rf;
+    expect(rf.add(ResourceFile::Resource(TYPE_TEST, 128, "abc")));
+    expect(rf.add(ResourceFile::Resource(TYPE_TEST, 129, "defgh")));
+
+    expect(rf.change_id(TYPE_TEST, 128, 130));
+    expect(!rf.resource_exists(TYPE_TEST, 128));
+    expect_eq(string("abc"), rf.get_resource(TYPE_TEST, 130)->data);
+    expect_eq(static_cast<int16_t>(130), rf.get_resource(TYPE_TEST, 130)->id);
+
+    // Changing to an ID that's already used fails without changing either
+    // resource
+    expect(!rf.change_id(TYPE_TEST, 130, 129));
+    expect_eq(string("abc"), rf.get_resource(TYPE_TEST, 130)->data);
+    expect_eq(static_cast<int16_t>(130), rf.get_resource(TYPE_TEST, 130)->id);
+    expect_eq(string("defgh"), rf.get_resource(TYPE_TEST, 129)->data);
+    expect_eq(static_cast<int16_t>(129), rf.get_resource(TYPE_TEST, 129)->id);
+
+    expect(!rf.change_id(TYPE_TEST, 128, 131));
+    expect_eq(static_cast<size_t>(2), rf.all_resources().size());
+  }
+
+  fprintf(stderr, "-- moved resource data isn't copied\n");
+  {
+    string name = "name";
+    string data(0x10000, 'x');
+    const char* data_ptr = data.data();
+    // A std::string of this size allocates one more byte, for the terminator
+    expect_eq(0, count_allocations(data.size() + 1, [&]() {
+      ResourceFile::Resource res(TYPE_TEST, 128, 0, name, move(data));
+      expect_eq(data_ptr, res.data.data());
+      expect_eq(static_cast<size_t>(0x10000), res.data.size());
+      expect_eq(string("name"), res.name);
+    }));
+    expect_eq(string("name"), name);
+  }
+
+  fprintf(stderr, "-- decode_STRN doesn't copy its string list\n");
+  {
+    static constexpr size_t num_strs = 37;
+    StringWriter w;
+    w.put_u16b(num_strs);
+    for (size_t z = 0; z < num_strs; z++) {
+      string s = string_printf("s%02zu", z);
+      w.put_u8(s.size());
+      w.write(s);
+    }
+    ResourceFile::DecodedStringSequence decoded;
+    // The strings are short enough to be stored inline, so the only allocation
+    // of this size is the vector's
+    expect_eq(1, count_allocations(num_strs * sizeof(string), [&]() {
+      decoded = ResourceFile::decode_STRN(w.str().data(), w.str().size());
+    }));
+    expect_eq(num_strs, decoded.strs.size());
+    expect_eq(string("s00"), decoded.strs[0]);
+    expect_eq(string("s36"), decoded.strs[36]);
+    expect(decoded.after_data.empty());
+  }
+
+  fprintf(stderr, "-- embedded QuickTime image data isn't copied\n");
+  {
+    static constexpr size_t data_size = 0x12345;
+    StringWriter w;
+    PictHeader header;
+    header.size = 0;
+    header.bounds = Rect(0, 0, 1, 1);
+    w.put(header);
+    w.put_u8(0x11); // Version (a v1 opcode) ...
+    w.put_u8(0x02); // ... 2, so the remaining opcodes are 16-bit
+    w.put_u8(0xFF);
+    w.put_u8(0x00); // Opcodes are word-aligned
+    w.put_u16b(0x8200); // Compressed QuickTime data
+    PictCompressedQuickTimeArgs args;
+    memset(&args, 0, sizeof(args));
+    w.put(args);
+    PictQuickTimeImageDescription desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.size = sizeof(desc);
+    desc.codec = 0x6A706567; // 'jpeg'
+    desc.width = 1;
+    desc.height = 1;
+    desc.data_size = data_size;
+    desc.frame_count = 1;
+    desc.clut_id = 0xFFFF;
+    w.put(desc);
+    string image_data(data_size, 'j');
+    image_data[0] = 0xFF;
+    image_data.back() = 0xD9;
+    w.write(image_data);
+
+    ResourceFile rf;
+    expect(rf.add(ResourceFile::Resource(RESOURCE_TYPE_PICT, 128, move(w.str()))));
+    auto res = rf.get_resource(RESOURCE_TYPE_PICT, 128);
+    // The data is read out of the PICT once, then moved into the exception
+    // and from there into the result
+    expect_eq(1, count_allocations(data_size + 1, [&]() {
+      auto decoded = rf.decode_PICT_internal(res);
+      expect_eq(string("jpeg"), decoded.embedded_image_format);
+      expect(image_data == decoded.embedded_image_data);
+    }));
+  }
+
+  printf("ResourceFileTest: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include "ScratchArena.hh"
+
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+
+
+// Passes allocations through to the heap, counting how many bytes the arena
+// needed beyond its initial block
+class CountingUpstreamResource : public pmr::memory_resource {
+public:
+  size_t bytes_allocated = 0;
+
+private:
+  virtual void* do_allocate(size_t bytes, size_t alignment) {
+    this->bytes_allocated += bytes;
+    return pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+  virtual void do_deallocate(void* p, size_t bytes, size_t alignment) {
+    pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+  virtual bool do_is_equal(const pmr::memory_resource& other) const noexcept {
+    return this == &other;
+  }
+};
+
+struct ScratchArena {
+  static constexpr size_t INITIAL_BLOCK_SIZE = 0x10000;
+  // A thread that decodes one huge resource shouldn't keep that much memory
+  // for the rest of its life, so blocks larger than this aren't kept
+  static constexpr size_t MAX_RETAINED_BLOCK_SIZE = 0x1000000;
+
+  size_t scope_depth = 0;
+  vector<char> block;
+  CountingUpstreamResource upstream;
+  unique_ptr<pmr::monotonic_buffer_resource> resource;
+
+  void begin() {
+    if (this->block.empty()) {
+      this->block.resize(INITIAL_BLOCK_SIZE);
+    }
+    this->upstream.bytes_allocated = 0;
+    this->resource.reset(new pmr::monotonic_buffer_resource(
+        this->block.data(), this->block.size(), &this->upstream));
+  }
+
+  void end() {
+    this->resource->release();
+    this->resource.reset();
+    // If the arena outgrew its block, make the block big enough to hold
+    // everything next time, unless that would be too large to keep around
+    if (this->upstream.bytes_allocated) {
+      size_t new_size = this->block.size() + this->upstream.bytes_allocated;
+      this->block = (new_size > MAX_RETAINED_BLOCK_SIZE)
+          ? vector<char>(INITIAL_BLOCK_SIZE)
+          : vector<char>(new_size);
+    }
+  }
+};
+
+static thread_local ScratchArena arena;
+
+pmr::memory_resource* scratch_memory_resource() {
+  return arena.scope_depth ? arena.resource.get() : pmr::get_default_resource();
+}
+
+ScratchArenaScope::ScratchArenaScope() {
+  if (arena.scope_depth++ == 0) {
+    arena.begin();
+  }
+}
+
+ScratchArenaScope::~ScratchArenaScope() {
+  if (--arena.scope_depth == 0) {
+    arena.end();
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <memory_resource>
+
+
+
+// Decoders create many buffers that only live while a single resource is
+// being decoded (unpacked pixel data, for example). These can be allocated
+// from a per-thread arena instead of the heap: while a ScratchArenaScope
+// exists on a thread, scratch_memory_resource() returns a monotonic arena for
+// that thread, so each allocation is just a pointer bump and nothing is freed
+// until the outermost scope ends. The arena then keeps one block at least as
+// large as the most memory it has used so far (up to 16MB; a larger block is
+// freed and the arena starts over with a small one), so a thread that decodes
+// many small resources soon stops calling malloc for these buffers at all.
+//
+// Without an active scope, scratch_memory_resource() returns the default
+// (heap) resource, so code that uses it works the same either way. Objects
+// allocated from the arena must be destroyed before the scope ends (so they
+// shouldn't be returned to callers), and the arena must only be used by the
+// thread that owns it. Other threads (like QuickDrawEngine's band renderers)
+// have no scope, so they get the heap.
+std::pmr::memory_resource* scratch_memory_resource();
+
+class ScratchArenaScope {
+public:
+  ScratchArenaScope();
+  ScratchArenaScope(const ScratchArenaScope&) = delete;
+  ScratchArenaScope(ScratchArenaScope&&) = delete;
+  ScratchArenaScope& operator=(const ScratchArenaScope&) = delete;
+  ScratchArenaScope& operator=(ScratchArenaScope&&) = delete;
+  ~ScratchArenaScope();
+};
@@ -0,0 +1,759 @@
+#include "SongRenderer.hh"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <thread>
+
+#include "ResourceBudget.hh"
+
+using namespace std;
+
+
+
+// Frames rendered by all lanes before the results are mixed and written
+static constexpr size_t SEGMENT_FRAMES = 0x8000;
+// Length of the fade applied when a note is released
+static constexpr double RELEASE_SECONDS = 0.03;
+// If a lane has more voices than this playing, the oldest ones are stopped
+static constexpr size_t MAX_VOICES_PER_LANE = 32;
+
+struct RenderedWAVHeader {
+  be_uint32_t riff_magic; // 'RIFF'
+  le_uint32_t file_size; // Size of file - 8
+  be_uint32_t wave_magic; // 'WAVE'
+  be_uint32_t fmt_magic; // 'fmt '
+  le_uint32_t fmt_size; // 16
+  le_uint16_t format; // 1 = PCM
+  le_uint16_t num_channels;
+  le_uint32_t sample_rate;
+  le_uint32_t byte_rate;
+  le_uint16_t block_align;
+  le_uint16_t bits_per_sample;
+  be_uint32_t data_magic; // 'data'
+  le_uint32_t data_size;
+} __attribute__((packed));
+
+
+
+SongRenderer::SongRenderer(ResourceFile& rf,
+    const ResourceFile::DecodedSongResource& song, const Options& options)
+  : SongRenderer(rf, &song, SongRenderer::midi_for_song(rf, song), options) { }
+
+SongRenderer::SongRenderer(ResourceFile& rf,
+    const ResourceFile::DecodedSongResource* song, const string& midi_data,
+    const Options& options)
+  : options(options),
+    master_gain(options.gain),
+    semitone_shift(song ? song->semitone_shift : 0),
+    allow_program_change(song ? song->allow_program_change : true),
+    percussion_instrument(song ? song->percussion_instrument : -1),
+    total_frames(0) {
+  if (this->options.sample_rate == 0) {
+    throw invalid_argument("sample rate must not be zero");
+  }
+  if (this->options.block_frames == 0) {
+    this->options.block_frames = 1;
+  }
+  if (song) {
+    if (song->volume_bias) {
+      this->master_gain *= static_cast<double>(song->volume_bias) / 127.0;
+    }
+    this->velocity_override_map = song->velocity_override_map;
+  }
+  this->parse_midi(midi_data, song ? song->tempo_bias : 0);
+  this->load_instruments(rf, song);
+}
+
+string SongRenderer::midi_for_song(ResourceFile& rf,
+    const ResourceFile::DecodedSongResource& song) {
+  static const vector<uint32_t> raw_midi_types({
+      RESOURCE_TYPE_MIDI, RESOURCE_TYPE_Midi, RESOURCE_TYPE_midi});
+  for (uint32_t type : raw_midi_types) {
+    if (rf.resource_exists(type, song.midi_id)) {
+      return rf.get_resource(type, song.midi_id)->data;
+    }
+  }
+  if (rf.resource_exists(RESOURCE_TYPE_cmid, song.midi_id)) {
+    return ResourceFile::decode_cmid(rf.get_resource(RESOURCE_TYPE_cmid, song.midi_id));
+  }
+  if (rf.resource_exists(RESOURCE_TYPE_emid, song.midi_id)) {
+    return ResourceFile::decode_emid(rf.get_resource(RESOURCE_TYPE_emid, song.midi_id));
+  }
+  if (rf.resource_exists(RESOURCE_TYPE_ecmi, song.midi_id)) {
+    return ResourceFile::decode_ecmi(rf.get_resource(RESOURCE_TYPE_ecmi, song.midi_id));
+  }
+  throw runtime_error("SONG refers to missing MIDI");
+}
+
+
+
+static uint32_t read_midi_vlq(StringReader& r) {
+  uint32_t ret = 0;
+  for (size_t z = 0; z < 4; z++) {
+    uint8_t b = r.get_u8();
+    ret = (ret << 7) | (b & 0x7F);
+    if (!(b & 0x80)) {
+      return ret;
+    }
+  }
+  throw runtime_error("MIDI variable-length value is too long");
+}
+
+void SongRenderer::parse_midi(const string& midi_data, uint16_t tempo_bias) {
+  StringReader r(midi_data);
+  if (r.get_u32b() != 0x4D546864) { // 'MThd'
+    throw runtime_error("MIDI data does not begin with a header chunk");
+  }
+  uint32_t header_size = r.get_u32b();
+  if (header_size < 6) {
+    throw runtime_error("MIDI header chunk is too small");
+  }
+  r.get_u16b(); // Format; tracks are merged by time regardless of this
+  uint16_t num_tracks = r.get_u16b();
+  uint16_t division = r.get_u16b();
+  r.skip(header_size - 6);
+  if (division & 0x8000) {
+    throw runtime_error("SMPTE MIDI time divisions are not supported");
+  }
+  if (division == 0) {
+    throw runtime_error("MIDI time division is zero");
+  }
+
+  // Collect the events from all tracks, then sort them by time. Tempo changes
+  // apply to all tracks, so frames can't be computed until the tracks are
+  // merged.
+  struct TickEvent {
+    uint64_t tick;
+    uint8_t status;
+    uint8_t data1;
+    uint8_t data2;
+    uint32_t tempo; // Only used if status is 0xFF
+  };
+  vector<TickEvent> tick_events;
+  for (size_t track_index = 0; (track_index < num_tracks) && !r.eof();) {
+    uint32_t chunk_magic = r.get_u32b();
+    uint32_t chunk_size = r.get_u32b();
+    StringReader tr = r.sub(r.where(), min<size_t>(chunk_size, r.remaining()));
+    r.skip(min<size_t>(chunk_size, r.remaining()));
+    if (chunk_magic != 0x4D54726B) { // 'MTrk'
+      continue;
+    }
+    track_index++;
+
+    uint64_t tick = 0;
+    uint8_t running_status = 0;
+    while (!tr.eof()) {
+      tick += read_midi_vlq(tr);
+      uint8_t status = tr.get_u8(false);
+      if (status & 0x80) {
+        tr.skip(1);
+      } else if (running_status) {
+        status = running_status;
+      } else {
+        throw runtime_error("MIDI data byte without running status");
+      }
+
+      if (status == 0xFF) {
+        uint8_t meta_type = tr.get_u8();
+        uint32_t size = read_midi_vlq(tr);
+        if ((meta_type == 0x51) && (size == 3)) {
+          tick_events.emplace_back(TickEvent{tick, 0xFF, 0, 0, tr.get_u24b()});
+        } else {
+          tr.skip(size);
+        }
+        running_status = 0;
+        if (meta_type == 0x2F) { // End of track
+          break;
+        }
+        continue;
+      }
+      if ((status == 0xF0) || (status == 0xF7)) {
+        tr.skip(read_midi_vlq(tr));
+        running_status = 0;
+        continue;
+      }
+      if (status >= 0xF0) {
+        throw runtime_error(string_printf("unsupported MIDI status byte %02hhX", status));
+      }
+
+      running_status = status;
+      uint8_t type = status & 0xF0;
+      uint8_t data1 = tr.get_u8() & 0x7F;
+      uint8_t data2 = ((type == 0xC0) || (type == 0xD0)) ? 0 : (tr.get_u8() & 0x7F);
+      tick_events.emplace_back(TickEvent{tick, status, data1, data2, 0});
+    }
+  }
+  stable_sort(tick_events.begin(), tick_events.end(), [](const TickEvent& a, const TickEvent& b) {
+    return a.tick < b.tick;
+  });
+
+  // Convert ticks to frames, following the tempo changes. The tempo bias is
+  // a playback speed multiplier, as in the smssynth template.
+  double speed = tempo_bias ? (static_cast<double>(tempo_bias) / 16667.0) : 1.0;
+  double usecs_per_tick = 500000.0 / division;
+  uint64_t prev_tick = 0;
+  double seconds = 0.0;
+  uint64_t last_frame = 0;
+  for (const auto& ev : tick_events) {
+    seconds += (ev.tick - prev_tick) * usecs_per_tick / (1000000.0 * speed);
+    prev_tick = ev.tick;
+    if (ev.status == 0xFF) {
+      usecs_per_tick = static_cast<double>(ev.tempo) / division;
+      continue;
+    }
+    uint64_t frame = llround(seconds * this->options.sample_rate);
+    this->lanes[ev.status & 0x0F].events.emplace_back(Event{frame, ev.status, ev.data1, ev.data2});
+    last_frame = frame;
+  }
+
+  this->total_frames = last_frame + llround(this->options.tail_seconds * this->options.sample_rate);
+}
+
+shared_ptr<const SongRenderer::Sample> SongRenderer::load_sample(
+    ResourceFile& rf, int16_t snd_id, uint32_t snd_type) {
+  ResourceFile::DecodedSoundResource decoded;
+  if (snd_type == RESOURCE_TYPE_csnd) {
+    decoded = rf.decode_csnd(snd_id);
+  } else if (snd_type == RESOURCE_TYPE_esnd) {
+    decoded = rf.decode_esnd(snd_id);
+  } else {
+    decoded = rf.decode_snd(snd_id);
+  }
+  if (decoded.is_mp3) {
+    throw runtime_error("MP3 sounds cannot be used as instrument samples");
+  }
+
+  // The decoders return WAV files; find the format, loop, and data chunks
+  StringReader r(decoded.data);
+  uint32_t riff_magic = r.get_u32b();
+  r.skip(4); // File size
+  if ((riff_magic != 0x52494646) || (r.get_u32b() != 0x57415645)) {
+    throw runtime_error("decoded sound is not a WAV file");
+  }
+  uint16_t num_channels = 0;
+  uint16_t bits_per_sample = 0;
+  uint32_t sample_rate = 0;
+  size_t loop_start_bytes = 0;
+  size_t loop_end_bytes = 0;
+  StringReader data_r;
+  bool has_data = false;
+  while (r.remaining() >= 8) {
+    uint32_t chunk_magic = r.get_u32b();
+    uint32_t chunk_size = r.get_u32l();
+    size_t available = min<size_t>(chunk_size, r.remaining());
+    StringReader chunk_r = r.sub(r.where(), available);
+    r.skip(min<size_t>(available + (chunk_size & 1), r.remaining()));
+    if (chunk_magic == 0x666D7420) { // 'fmt '
+      if (chunk_r.get_u16l() != 1) {
+        throw runtime_error("decoded sound is not PCM");
+      }
+      num_channels = chunk_r.get_u16l();
+      sample_rate = chunk_r.get_u32l();
+      chunk_r.skip(6);
+      bits_per_sample = chunk_r.get_u16l();
+    } else if (chunk_magic == 0x736D706C) { // 'smpl'
+      chunk_r.skip(28);
+      if (chunk_r.get_u32l() > 0) { // Number of loops
+        // Loop offsets are in bytes (per channel), as written by the snd
+        // decoders
+        chunk_r.skip(12);
+        loop_start_bytes = chunk_r.get_u32l();
+        loop_end_bytes = chunk_r.get_u32l();
+      }
+    } else if (chunk_magic == 0x64617461) { // 'data'
+      data_r = chunk_r;
+      has_data = true;
+    }
+  }
+  if (!has_data || !num_channels || !sample_rate ||
+      ((bits_per_sample != 8) && (bits_per_sample != 16))) {
+    throw runtime_error("decoded sound has an unsupported format");
+  }
+
+  // Convert to mono floats
+  auto ret = make_shared<Sample>();
+  size_t bytes_per_sample = bits_per_sample / 8;
+  size_t num_samples = data_r.size() / (bytes_per_sample * num_channels);
+  check_resource_memory(num_samples * sizeof(float), "instrument sample");
+  ret->samples.resize(num_samples);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(data_r.peek(data_r.size()));
+  for (size_t z = 0; z < num_samples; z++) {
+    float value = 0.0f;
+    for (size_t c = 0; c < num_channels; c++) {
+      const uint8_t* sample_data = data + (z * num_channels + c) * bytes_per_sample;
+      if (bits_per_sample == 8) {
+        value += (static_cast<float>(sample_data[0]) - 128.0f) / 128.0f;
+      } else {
+        value += static_cast<float>(static_cast<int16_t>(sample_data[0] | (sample_data[1] << 8))) / 32768.0f;
+      }
+    }
+    ret->samples[z] = value / num_channels;
+  }
+  ret->sample_rate = sample_rate;
+  ret->base_note = decoded.base_note;
+  ret->loop_start = min<size_t>(loop_start_bytes / bytes_per_sample, num_samples);
+  ret->loop_end = min<size_t>(loop_end_bytes / bytes_per_sample, num_samples);
+  return ret;
+}
+
+void SongRenderer::load_instruments(ResourceFile& rf,
+    const ResourceFile::DecodedSongResource* song) {
+  // Find all the programs that the song can use
+  vector<int16_t> programs({0});
+  for (const auto& lane : this->lanes) {
+    for (const auto& ev : lane.events) {
+      if (this->allow_program_change && ((ev.status & 0xF0) == 0xC0)) {
+        programs.emplace_back(ev.data1);
+      }
+    }
+  }
+  if (this->percussion_instrument > 0) {
+    programs.emplace_back(this->percussion_instrument);
+  }
+  sort(programs.begin(), programs.end());
+  programs.erase(unique(programs.begin(), programs.end()), programs.end());
+
+  // Decode each program's INST and the sounds it uses. Sounds are often shared
+  // between instruments, so each is only decoded once.
+  map<pair<uint32_t, int16_t>, shared_ptr<const Sample>> samples;
+  for (int16_t program : programs) {
+    int16_t inst_id = program;
+    if (song) {
+      auto override_it = song->instrument_overrides.find(program);
+      if (override_it != song->instrument_overrides.end()) {
+        inst_id = override_it->second;
+      }
+    }
+    if (!rf.resource_exists(RESOURCE_TYPE_INST, inst_id)) {
+      this->warnings.emplace_back(string_printf(
+          "instrument %hd refers to missing INST %hd", program, inst_id));
+      continue;
+    }
+
+    ResourceFile::DecodedInstrumentResource inst;
+    try {
+      inst = rf.decode_INST(inst_id);
+    } catch (const exception& e) {
+      this->warnings.emplace_back(string_printf(
+          "cannot decode INST %hd: %s", inst_id, e.what()));
+      continue;
+    }
+
+    auto instrument = make_shared<Instrument>();
+    instrument->use_sample_rate = inst.use_sample_rate;
+    instrument->constant_pitch = inst.constant_pitch;
+    for (const auto& rgn : inst.key_regions) {
+      auto key = make_pair(rgn.snd_type, rgn.snd_id);
+      auto sample_it = samples.find(key);
+      if (sample_it == samples.end()) {
+        shared_ptr<const Sample> sample;
+        try {
+          sample = this->load_sample(rf, rgn.snd_id, rgn.snd_type);
+        } catch (const exception& e) {
+          this->warnings.emplace_back(string_printf(
+              "cannot decode sound %hd for INST %hd: %s", rgn.snd_id, inst_id, e.what()));
+        }
+        sample_it = samples.emplace(key, sample).first;
+      }
+      if (!sample_it->second) {
+        continue;
+      }
+
+      // This matches the base note used in the smssynth template
+      uint8_t snd_base_note = sample_it->second->base_note;
+      uint8_t base_note;
+      if (rgn.base_note && snd_base_note) {
+        base_note = rgn.base_note + snd_base_note - 0x3C;
+      } else if (rgn.base_note) {
+        base_note = rgn.base_note;
+      } else if (snd_base_note) {
+        base_note = snd_base_note;
+      } else {
+        base_note = 0x3C;
+      }
+      instrument->key_regions.emplace_back(KeyRegion{
+          rgn.key_low, rgn.key_high, base_note, sample_it->second});
+    }
+    this->instruments.emplace(program, move(instrument));
+  }
+}
+
+
+
+const SongRenderer::Instrument* SongRenderer::instrument_for_lane(size_t lane_index) const {
+  int16_t program = ((lane_index == 9) && (this->percussion_instrument > 0))
+      ? this->percussion_instrument : this->lanes[lane_index].program;
+  auto it = this->instruments.find(program);
+  return (it == this->instruments.end()) ? nullptr : it->second.get();
+}
+
+void SongRenderer::start_note(size_t lane_index, uint8_t note, uint8_t velocity) {
+  const auto* instrument = this->instrument_for_lane(lane_index);
+  if (!instrument) {
+    return;
+  }
+  const KeyRegion* region = nullptr;
+  for (const auto& rgn : instrument->key_regions) {
+    if ((note >= rgn.key_low) && (note <= rgn.key_high)) {
+      region = &rgn;
+      break;
+    }
+  }
+  if (!region) {
+    return;
+  }
+
+  if (!this->velocity_override_map.empty() && (velocity < this->velocity_override_map.size())) {
+    velocity = min<uint16_t>(this->velocity_override_map[velocity], 127);
+  }
+
+  // Instruments that don't use the sounds' sample rates play them at 22050Hz,
+  // as in the smssynth template
+  double source_rate = instrument->use_sample_rate ? region->sample->sample_rate : 22050.0;
+  double semitones = this->semitone_shift;
+  if (!instrument->constant_pitch) {
+    semitones += static_cast<double>(note) - static_cast<double>(region->base_note);
+  }
+
+  auto& lane = this->lanes[lane_index];
+  if (lane.voices.size() >= MAX_VOICES_PER_LANE) {
+    lane.voices.erase(lane.voices.begin());
+  }
+  lane.voices.emplace_back(Voice{
+    .region = region,
+    .sample = region->sample.get(),
+    .note = note,
+    .position = 0.0,
+    .step = (source_rate / this->options.sample_rate) * pow(2.0, semitones / 12.0),
+    .velocity_gain = static_cast<float>(velocity) / 127.0f,
+    .release_level = 1.0f,
+    .released = false,
+    .sustained = false,
+  });
+}
+
+void SongRenderer::release_note(Lane& lane, uint8_t note) {
+  for (auto& voice : lane.voices) {
+    if ((voice.note == note) && !voice.released && !voice.sustained) {
+      if (lane.sustain) {
+        voice.sustained = true;
+      } else {
+        voice.released = true;
+      }
+    }
+  }
+}
+
+void SongRenderer::process_event(size_t lane_index, const Event& ev) {
+  auto& lane = this->lanes[lane_index];
+  switch (ev.status & 0xF0) {
+    case 0x80:
+      this->release_note(lane, ev.data1);
+      break;
+    case 0x90:
+      if (ev.data2 == 0) {
+        this->release_note(lane, ev.data1);
+      } else {
+        this->start_note(lane_index, ev.data1, ev.data2);
+      }
+      break;
+    case 0xB0:
+      switch (ev.data1) {
+        case 7:
+          lane.volume = ev.data2;
+          break;
+        case 10:
+          lane.pan = ev.data2;
+          break;
+        case 11:
+          lane.expression = ev.data2;
+          break;
+        case 64:
+          lane.sustain = (ev.data2 >= 64);
+          if (!lane.sustain) {
+            for (auto& voice : lane.voices) {
+              if (voice.sustained) {
+                voice.sustained = false;
+                voice.released = true;
+              }
+            }
+          }
+          break;
+        case 120: // All sound off
+          lane.voices.clear();
+          break;
+        case 121: // Reset all controllers
+          lane.expression = 127;
+          lane.sustain = false;
+          lane.pitch_bend_factor = 1.0;
+          break;
+        case 123: // All notes off
+          for (auto& voice : lane.voices) {
+            voice.sustained = false;
+            voice.released = true;
+          }
+          break;
+      }
+      break;
+    case 0xC0:
+      if (this->allow_program_change) {
+        lane.program = ev.data1;
+      }
+      break;
+    case 0xE0: {
+      // The bend range is +/- 2 semitones
+      int16_t value = static_cast<int16_t>(ev.data1 | (ev.data2 << 7)) - 0x2000;
+      lane.pitch_bend_factor = pow(2.0, (static_cast<double>(value) / 8192.0) * 2.0 / 12.0);
+      break;
+    }
+  }
+}
+
+void SongRenderer::render_lane(Lane& lane, float* out, size_t count) {
+  float lane_gain = (static_cast<float>(lane.volume) / 127.0f) *
+      (static_cast<float>(lane.expression) / 127.0f);
+  float pan = static_cast<float>(lane.pan) / 127.0f;
+  float left_gain = lane_gain * min<float>(1.0f, 2.0f * (1.0f - pan));
+  float right_gain = lane_gain * min<float>(1.0f, 2.0f * pan);
+  float release_step = 1.0f / (RELEASE_SECONDS * this->options.sample_rate);
+
+  for (auto& voice : lane.voices) {
+    const auto& samples = voice.sample->samples;
+    size_t num_samples = samples.size();
+    size_t loop_start = voice.sample->loop_start;
+    size_t loop_end = voice.sample->loop_end;
+    double step = voice.step * lane.pitch_bend_factor;
+
+    float* out_frame = out;
+    for (size_t z = 0; z < count; z++, out_frame += 2) {
+      bool looping = !voice.released && (loop_end > loop_start);
+      if (looping) {
+        while (voice.position >= loop_end) {
+          voice.position -= (loop_end - loop_start);
+        }
+      } else if (voice.position >= num_samples) {
+        voice.release_level = 0.0f;
+        break;
+      }
+
+      size_t index = voice.position;
+      float frac = voice.position - index;
+      float a = samples[index];
+      float b = (index + 1 < (looping ? loop_end : num_samples))
+          ? samples[index + 1] : (looping ? samples[loop_start] : 0.0f);
+      float value = (a + (b - a) * frac) * voice.velocity_gain;
+      if (voice.released) {
+        value *= voice.release_level;
+        voice.release_level -= release_step;
+        if (voice.release_level <= 0.0f) {
+          voice.release_level = 0.0f;
+          break;
+        }
+      }
+      out_frame[0] += value * left_gain;
+      out_frame[1] += value * right_gain;
+      voice.position += step;
+    }
+  }
+
+  lane.voices.erase(remove_if(lane.voices.begin(), lane.voices.end(), [](const Voice& voice) {
+    return voice.release_level <= 0.0f;
+  }), lane.voices.end());
+}
+
+void SongRenderer::render_lanes(const vector<size_t>& lane_indexes, float* out,
+    uint64_t frame, size_t count) {
+  uint64_t end_frame = frame + count;
+  for (size_t lane_index : lane_indexes) {
+    auto& lane = this->lanes[lane_index];
+    for (uint64_t pos = frame; pos < end_frame;) {
+      while ((lane.next_event_index < lane.events.size()) &&
+             (lane.events[lane.next_event_index].frame <= pos)) {
+        this->process_event(lane_index, lane.events[lane.next_event_index++]);
+      }
+      uint64_t block_end = min<uint64_t>(end_frame, pos + this->options.block_frames);
+      if (lane.next_event_index < lane.events.size()) {
+        block_end = min<uint64_t>(block_end, lane.events[lane.next_event_index].frame);
+      }
+      if (!lane.voices.empty()) {
+        this->render_lane(lane, out + (pos - frame) * 2, block_end - pos);
+      }
+      pos = block_end;
+    }
+  }
+}
+
+void SongRenderer::render(const function<void(const le_int16_t*, size_t)>& write_fn) {
+  size_t num_threads = this->options.num_threads
+      ? this->options.num_threads : max<size_t>(thread::hardware_concurrency(), 1);
+
+  // Divide the lanes that have any events between the threads, balancing the
+  // number of events each thread handles
+  vector<size_t> active_lanes;
+  for (size_t z = 0; z < 16; z++) {
+    if (!this->lanes[z].events.empty()) {
+      active_lanes.emplace_back(z);
+    }
+  }
+  sort(active_lanes.begin(), active_lanes.end(), [&](size_t a, size_t b) {
+    return this->lanes[a].events.size() > this->lanes[b].events.size();
+  });
+  size_t num_groups = max<size_t>(min<size_t>(num_threads, active_lanes.size()), 1);
+  vector<vector<size_t>> groups(num_groups);
+  vector<size_t> group_events(num_groups, 0);
+  for (size_t lane_index : active_lanes) {
+    size_t group_index = min_element(group_events.begin(), group_events.end()) - group_events.begin();
+    groups[group_index].emplace_back(lane_index);
+    group_events[group_index] += this->lanes[lane_index].events.size();
+  }
+
+  for (auto& lane : this->lanes) {
+    lane.next_event_index = 0;
+    lane.voices.clear();
+  }
+
+  vector<vector<float>> group_buffers(num_groups, vector<float>(SEGMENT_FRAMES * 2));
+  vector<exception_ptr> group_exceptions(num_groups);
+  auto render_group = [&](size_t group_index, uint64_t frame, size_t count) -> void {
+    try {
+      auto& buffer = group_buffers[group_index];
+      fill(buffer.begin(), buffer.begin() + count * 2, 0.0f);
+      this->render_lanes(groups[group_index], buffer.data(), frame, count);
+    } catch (...) {
+      group_exceptions[group_index] = current_exception();
+    }
+  };
+
+  // Group 0 is rendered on this thread, and each other group has its own
+  // thread for the whole song. For each segment, this thread starts the other
+  // threads, renders its own group, waits for the others to finish, and then
+  // mixes the results.
+  mutex lock;
+  condition_variable segment_started;
+  condition_variable segment_finished;
+  uint64_t segment_index = 0; // Incremented when a segment is started
+  uint64_t segment_frame = 0;
+  size_t segment_count = 0;
+  size_t num_groups_finished = 0;
+  bool should_exit = false;
+  vector<thread> threads;
+  auto stop_threads = [&]() -> void {
+    {
+      lock_guard<mutex> g(lock);
+      should_exit = true;
+    }
+    segment_started.notify_all();
+    for (auto& t : threads) {
+      t.join();
+    }
+  };
+  for (size_t group_index = 1; group_index < num_groups; group_index++) {
+    threads.emplace_back([&, group_index]() -> void {
+      uint64_t last_segment_index = 0;
+      unique_lock<mutex> g(lock);
+      for (;;) {
+        segment_started.wait(g, [&]() {
+          return should_exit || (segment_index != last_segment_index);
+        });
+        if (should_exit) {
+          return;
+        }
+        last_segment_index = segment_index;
+        uint64_t frame = segment_frame;
+        size_t count = segment_count;
+        g.unlock();
+        render_group(group_index, frame, count);
+        g.lock();
+        if (++num_groups_finished == num_groups - 1) {
+          segment_finished.notify_one();
+        }
+      }
+    });
+  }
+
+  try {
+    vector<le_int16_t> out_samples(SEGMENT_FRAMES * 2);
+    for (uint64_t frame = 0; frame < this->total_frames; frame += SEGMENT_FRAMES) {
+      size_t count = min<uint64_t>(SEGMENT_FRAMES, this->total_frames - frame);
+      {
+        lock_guard<mutex> g(lock);
+        segment_frame = frame;
+        segment_count = count;
+        num_groups_finished = 0;
+        segment_index++;
+      }
+      segment_started.notify_all();
+      render_group(0, frame, count);
+      {
+        unique_lock<mutex> g(lock);
+        segment_finished.wait(g, [&]() {
+          return num_groups_finished == num_groups - 1;
+        });
+      }
+      for (const auto& e : group_exceptions) {
+        if (e) {
+          rethrow_exception(e);
+        }
+      }
+
+      for (size_t z = 0; z < count * 2; z++) {
+        float value = 0.0f;
+        for (const auto& buffer : group_buffers) {
+          value += buffer[z];
+        }
+        value *= this->master_gain * 32767.0f;
+        out_samples[z] = static_cast<int16_t>(lroundf(min<float>(max<float>(value, -32768.0f), 32767.0f)));
+      }
+      write_fn(out_samples.data(), count);
+    }
+  } catch (...) {
+    stop_threads();
+    throw;
+  }
+  stop_threads();
+}
+
+void SongRenderer::render_wav(const function<void(const void*, size_t)>& write_fn) {
+  uint64_t data_size = static_cast<uint64_t>(this->total_frames) * 4;
+  if (data_size > 0xFFFFFFFF - sizeof(RenderedWAVHeader)) {
+    throw runtime_error("song is too long to be written as a WAV file");
+  }
+
+  RenderedWAVHeader header;
+  header.riff_magic = 0x52494646;
+  header.file_size = data_size + sizeof(RenderedWAVHeader) - 8;
+  header.wave_magic = 0x57415645;
+  header.fmt_magic = 0x666D7420;
+  header.fmt_size = 16;
+  header.format = 1;
+  header.num_channels = 2;
+  header.sample_rate = this->options.sample_rate;
+  header.byte_rate = this->options.sample_rate * 4;
+  header.block_align = 4;
+  header.bits_per_sample = 16;
+  header.data_magic = 0x64617461;
+  header.data_size = data_size;
+  write_fn(&header, sizeof(header));
+
+  this->render([&](const le_int16_t* samples, size_t num_frames) -> void {
+    write_fn(samples, num_frames * 4);
+  });
+}
+
+string SongRenderer::render_wav() {
+  check_resource_memory(static_cast<uint64_t>(this->total_frames) * 4, "rendered song");
+  string ret;
+  ret.reserve(sizeof(RenderedWAVHeader) + this->total_frames * 4);
+  this->render_wav([&](const void* data, size_t size) -> void {
+    ret.append(reinterpret_cast<const char*>(data), size);
+  });
+  return ret;
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <phosg/Encoding.hh>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ResourceFile.hh"
+
+
+
+// Renders SONG resources (and other MIDI sequences that use INST resources as
+// their instruments) to 16-bit stereo PCM, without an external synthesizer.
+//
+// All of the song's instruments and their sounds are decoded once, when the
+// renderer is created, so rendering doesn't touch the ResourceFile. Each MIDI
+// channel is a lane with its own voices; the song is rendered in segments, and
+// within each segment the lanes are divided between threads, each of which
+// mixes its lanes a block at a time into its own buffer. The threads' buffers
+// are then summed and passed to the caller in order, so memory use doesn't
+// depend on the song's length.
+//
+// This is a simple sampler: voices play their key region's sound (looping it
+// while the note is held, if the sound has a loop) with linear interpolation,
+// and fade out quickly when released. Note on/off, program change, pitch bend,
+// and the volume, pan, expression, sustain, and all-notes-off controllers are
+// supported; other events are ignored.
+class SongRenderer {
+public:
+  struct Options {
+    uint32_t sample_rate = 44100;
+    // 0 = one thread per core
+    size_t num_threads = 0;
+    // Number of frames rendered between processing each lane's events, at
+    // most (events are always processed at their exact frames)
+    size_t block_frames = 512;
+    // Audio rendered after the last event, so released notes can finish
+    double tail_seconds = 1.0;
+    // Multiplied into every voice, so several voices can play at once without
+    // clipping
+    double gain = 0.5;
+  };
+
+  // Makes a renderer for a SONG resource, using its MIDI sequence, instrument
+  // overrides, and adjustments
+  SongRenderer(ResourceFile& rf, const ResourceFile::DecodedSongResource& song,
+      const Options& options);
+  // Makes a renderer for a MIDI file (e.g. from decode_Tune or decode_cmid),
+  // using the file's INST resources (instrument N is INST N). If song isn't
+  // null, its overrides and adjustments are used, but its MIDI reference is
+  // ignored.
+  SongRenderer(ResourceFile& rf, const ResourceFile::DecodedSongResource* song,
+      const std::string& midi_data, const Options& options);
+  ~SongRenderer() = default;
+
+  // Returns the MIDI file that a SONG refers to, from any of the MIDI resource
+  // types. Throws if the song's MIDI resource is missing.
+  static std::string midi_for_song(ResourceFile& rf,
+      const ResourceFile::DecodedSongResource& song);
+
+  inline uint32_t sample_rate() const {
+    return this->options.sample_rate;
+  }
+  // Returns the number of stereo frames that render() produces
+  inline size_t num_frames() const {
+    return this->total_frames;
+  }
+  // Describes the instruments and sounds that couldn't be loaded; notes that
+  // use them are silent
+  inline const std::vector<std::string>& get_warnings() const {
+    return this->warnings;
+  }
+
+  // Renders the song, calling write_fn with consecutive blocks of interleaved
+  // stereo samples (left, right) until num_frames() frames have been written
+  void render(const std::function<void(const le_int16_t* samples, size_t num_frames)>& write_fn);
+  // Renders the song as a WAV file, calling write_fn with consecutive pieces
+  // of the file (the header first)
+  void render_wav(const std::function<void(const void* data, size_t size)>& write_fn);
+  // Renders the song as a WAV file and returns it
+  std::string render_wav();
+
+private:
+  struct Sample {
+    std::vector<float> samples; // Mono
+    uint32_t sample_rate;
+    uint8_t base_note;
+    // If loop_end > loop_start, the sample loops over [loop_start, loop_end)
+    // while the note is held
+    size_t loop_start;
+    size_t loop_end;
+  };
+
+  struct KeyRegion {
+    uint8_t key_low;
+    uint8_t key_high;
+    uint8_t base_note;
+    std::shared_ptr<const Sample> sample;
+  };
+
+  struct Instrument {
+    std::vector<KeyRegion> key_regions;
+    bool use_sample_rate;
+    bool constant_pitch;
+  };
+
+  struct Event {
+    uint64_t frame;
+    uint8_t status; // Including the channel
+    uint8_t data1;
+    uint8_t data2;
+  };
+
+  struct Voice {
+    const KeyRegion* region;
+    const Sample* sample;
+    uint8_t note;
+    double position; // In source samples
+    double step; // Source samples per output frame, without pitch bend
+    float velocity_gain;
+    // How much of the release fade remains, from 1 to 0; voices are removed
+    // when this reaches 0
+    float release_level;
+    bool released;
+    bool sustained; // Released while the sustain pedal was held
+  };
+
+  struct Lane {
+    std::vector<Event> events;
+    size_t next_event_index = 0;
+    std::vector<Voice> voices;
+    int16_t program = 0;
+    uint8_t volume = 127;
+    uint8_t expression = 127;
+    uint8_t pan = 64;
+    bool sustain = false;
+    double pitch_bend_factor = 1.0;
+  };
+
+  Options options;
+  double master_gain;
+  int16_t semitone_shift;
+  bool allow_program_change;
+  int16_t percussion_instrument;
+  std::vector<uint16_t> velocity_override_map;
+  std::unordered_map<int16_t, std::shared_ptr<const Instrument>> instruments;
+  Lane lanes[16];
+  size_t total_frames;
+  std::vector<std::string> warnings;
+
+  void parse_midi(const std::string& midi_data, uint16_t tempo_bias);
+  void load_instruments(ResourceFile& rf,
+      const ResourceFile::DecodedSongResource* song);
+  static std::shared_ptr<const Sample> load_sample(ResourceFile& rf,
+      int16_t snd_id, uint32_t snd_type);
+
+  const Instrument* instrument_for_lane(size_t lane_index) const;
+  void process_event(size_t lane_index, const Event& event);
+  void start_note(size_t lane_index, uint8_t note, uint8_t velocity);
+  void release_note(Lane& lane, uint8_t note);
+  // Adds count frames of the lane's voices to out (interleaved stereo)
+  void render_lane(Lane& lane, float* out, size_t count);
+  // Renders the lanes in [frame, frame + count) and adds them to out
+  void render_lanes(const std::vector<size_t>& lane_indexes, float* out,
+      uint64_t frame, size_t count);
+};
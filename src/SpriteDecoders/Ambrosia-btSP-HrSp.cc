@@ -9,7 +9,7 @@ using namespace std;
 
 
 
-Image decode_btSP(const string& data, const vector<ColorTableEntry>& clut) {
+void decode_btSP_into(Image& dest, const string& data, const ColorLUT& lut) {
   if (data.size() < 8) {
     throw invalid_argument("not enough data");
   }
@@ -57,7 +57,7 @@ Image decode_btSP(const string& data, const vector<ColorTableEntry>& clut) {
   // Go back to the beginning to actually execute the commands
   r.go(4);
 
-  Image ret(width, height, true);
+  SpriteCanvas canvas(dest, width, height);
   size_t x = 0, y = 0;
   while (!r.eof()) {
     uint8_t cmd = r.get_u8();
@@ -65,26 +65,18 @@ Image decode_btSP(const string& data, const vector<ColorTableEntry>& clut) {
 
       case 1: {
         uint32_t count = r.get_u24b();
-        for (uint32_t z = 0; z < count; z++) {
-          uint8_t v = r.get_u8();
-          auto c = clut.at(v).c.as8();
-          ret.write_pixel(x, y, c.r, c.g, c.b);
-          x++;
-        }
+        const uint8_t* indexes = reinterpret_cast<const uint8_t*>(r.getv(count));
+        canvas.write_indexes(x, y, indexes, count, lut);
+        x += count;
         // Commands are padded to 4-byte boundary
-        while (count & 3) {
-          r.get_u8();
-          count++;
-        }
+        r.skip((4 - (count & 3)) & 3);
         break;
       }
 
       case 2: {
         uint32_t count = r.get_u24b();
-        for (uint32_t z = 0; z < count; z++) {
-          ret.write_pixel(x, y, 0x00, 0x00, 0x00, 0x00);
-          x++;
-        }
+        canvas.fill(x, y, count, 0x00000000);
+        x += count;
         break;
       }
 
@@ -109,13 +101,17 @@ Image decode_btSP(const string& data, const vector<ColorTableEntry>& clut) {
         throw runtime_error(string_printf("unknown command: %02hhX", cmd));
     }
   }
+}
 
+Image decode_btSP(const string& data, const vector<ColorTableEntry>& clut) {
+  Image ret;
+  decode_btSP_into(ret, data, ColorLUT(clut));
   return ret;
 }
 
 
 
-Image decode_HrSp(const string& data, const vector<ColorTableEntry>& clut) {
+void decode_HrSp_into(Image& dest, const string& data, const ColorLUT& lut) {
   if (data.size() < 20) {
     throw invalid_argument("not enough data");
   }
@@ -135,7 +131,7 @@ Image decode_HrSp(const string& data, const vector<ColorTableEntry>& clut) {
   // 02 XX XX XX - write X bytes to current position
   // 03 XX XX XX - write X transparent bytes
 
-  Image ret(width, height, true);
+  SpriteCanvas canvas(dest, width, height);
   size_t x = 0, y = 0;
   size_t next_row_begin_offset = static_cast<size_t>(-1);
   while (!r.eof()) {
@@ -163,26 +159,18 @@ Image decode_HrSp(const string& data, const vector<ColorTableEntry>& clut) {
 
       case 2: {
         uint32_t count = r.get_u24b();
-        for (uint32_t z = 0; z < count; z++) {
-          uint8_t v = r.get_u8();
-          auto c = clut.at(v).c.as8();
-          ret.write_pixel(x, y, c.r, c.g, c.b);
-          x++;
-        }
+        const uint8_t* indexes = reinterpret_cast<const uint8_t*>(r.getv(count));
+        canvas.write_indexes(x, y, indexes, count, lut);
+        x += count;
         // Commands are padded to 4-byte boundary
-        while (count & 3) {
-          r.get_u8();
-          count++;
-        }
+        r.skip((4 - (count & 3)) & 3);
         break;
       }
 
       case 3: {
         uint32_t count = r.get_u24b();
-        for (uint32_t z = 0; z < count; z++) {
-          ret.write_pixel(x, y, 0x00, 0x00, 0x00, 0x00);
-          x++;
-        }
+        canvas.fill(x, y, count, 0x00000000);
+        x += count;
         break;
       }
 
@@ -190,6 +178,10 @@ Image decode_HrSp(const string& data, const vector<ColorTableEntry>& clut) {
         throw runtime_error(string_printf("unknown command: %02hhX", cmd));
     }
   }
+}
 
+Image decode_HrSp(const string& data, const vector<ColorTableEntry>& clut) {
+  Image ret;
+  decode_HrSp_into(ret, data, ColorLUT(clut));
   return ret;
 }
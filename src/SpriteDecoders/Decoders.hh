@@ -6,10 +6,18 @@
 #include <unordered_map>
 
 #include "../QuickDrawFormats.hh"
+#include "SpriteCore.hh"
+
+// The *_into functions decode into an existing Image (reusing its buffer if it
+// already has the right size; see SpriteCanvas) with a ColorLUT that the caller
+// can build once for many sprites. The other functions are equivalent to
+// calling them with a new Image and ColorLUT.
 
 // Ambrosia-btSP-HrSp.cc
 Image decode_btSP(const std::string& data, const std::vector<ColorTableEntry>& clut);
+void decode_btSP_into(Image& dest, const std::string& data, const ColorLUT& lut);
 Image decode_HrSp(const std::string& data, const std::vector<ColorTableEntry>& clut);
+void decode_HrSp_into(Image& dest, const std::string& data, const ColorLUT& lut);
 
 // DarkCastle-DC2.cc
 Image decode_DC2(const std::string& data);
@@ -25,6 +33,7 @@ Image decode_8img(const std::string& data, const std::vector<ColorTableEntry>& p
 
 // Greebles-GSIF.cc
 Image decode_GSIF(const std::string& data, const std::vector<ColorTableEntry>& pltt);
+void decode_GSIF_into(Image& dest, const std::string& data, const ColorLUT& lut);
 
 // Lemmings-PrinceOfPersia-SHPD.cc
 enum class SHPDVersion {
@@ -45,15 +54,20 @@ std::unordered_map<std::string, DecodedSHPDImage> decode_SHPD_collection(
 
 // PrinceOfPersia2-SHAP.cc
 Image decode_SHAP(const std::string& data, const std::vector<ColorTableEntry>& ctbl);
+// lut must be indexed by color_num (see ColorLUT's constructor)
+void decode_SHAP_into(Image& dest, const std::string& data, const ColorLUT& lut);
 
 // SimCity2000-SPRT.cc
 std::vector<Image> decode_SPRT(const std::string& data, const std::vector<ColorTableEntry>& pltt);
+std::vector<Image> decode_SPRT(const std::string& data, const ColorLUT& lut);
 
 // StepOnIt-sssf.cc
 std::vector<Image> decode_sssf(const std::string& data, const std::vector<ColorTableEntry>& clut);
+std::vector<Image> decode_sssf(const std::string& data, const ColorLUT& lut);
 
 // SwampGas-PPic.cc
 std::vector<Image> decode_PPic(const std::string& data, const std::vector<ColorTableEntry>& clut);
 
 // TheZone-Spri.cc
 Image decode_Spri(const std::string& data, const std::vector<ColorTableEntry>& clut);
+void decode_Spri_into(Image& dest, const std::string& data, const ColorLUT& lut);
@@ -21,7 +21,7 @@ struct GSIFHeader {
 
 
 
-Image decode_GSIF(const string& gsif_data, const std::vector<ColorTableEntry>& pltt) {
+void decode_GSIF_into(Image& dest, const string& gsif_data, const ColorLUT& lut) {
   StringReader r(gsif_data);
   const auto& header = r.get<GSIFHeader>();
 
@@ -29,14 +29,9 @@ Image decode_GSIF(const string& gsif_data, const std::vector<ColorTableEntry>& p
     throw runtime_error("incorrect GSIF signature");
   }
 
-  Image ret(header.w, header.h);
+  SpriteCanvas canvas(dest, header.w, header.h, false);
   auto write_pixel = [&](size_t x, size_t y, uint8_t index) {
-    if (!pltt.empty()) {
-      auto c = pltt.at(index).c.as8();
-      ret.write_pixel(x, y, c.r, c.g, c.b);
-    } else {
-      ret.write_pixel(x, y, index, index, index);
-    }
+    canvas.write_pixel(x, y, lut.at(index));
   };
 
   for (size_t y = 0; y < header.h; y++) {
@@ -49,9 +44,10 @@ Image decode_GSIF(const string& gsif_data, const std::vector<ColorTableEntry>& p
 
       // 00-3F: (cmd+1) direct bytes
       if (cmd < 0x40) {
-        for (size_t end_x = x + cmd + 1; x < end_x; x++) {
-          write_pixel(x, y, r.get_u8());
-        }
+        size_t count = cmd + 1;
+        canvas.write_indexes(x, y,
+            reinterpret_cast<const uint8_t*>(r.getv(count)), count, lut);
+        x += count;
 
       // 40-5F: (c-3F) 8-byte 2-color blocks, with bitmask denoting which color
       // to use for each pixel. A 0 in the bitmask means to use the first color.
@@ -106,9 +102,8 @@ Image decode_GSIF(const string& gsif_data, const std::vector<ColorTableEntry>& p
             ? (cmd - 0x7D)
             : ((((cmd - 0xFB) << 8) | r.get_u8()) + 0x7E);
         uint8_t index = r.get_u8();
-        for (size_t end_x = x + count; x < end_x; x++) {
-          write_pixel(x, y, index);
-        }
+        canvas.fill(x, y, count, lut.at(index));
+        x += count;
       }
     }
 
@@ -119,5 +114,11 @@ Image decode_GSIF(const string& gsif_data, const std::vector<ColorTableEntry>& p
       throw runtime_error("row ended at incorrect offset");
     }
   }
+}
+
+Image decode_GSIF(const string& gsif_data, const std::vector<ColorTableEntry>& pltt) {
+  // Without a palette, the indexes are used as grayscale values
+  Image ret;
+  decode_GSIF_into(ret, gsif_data, pltt.empty() ? ColorLUT() : ColorLUT(pltt));
   return ret;
 }
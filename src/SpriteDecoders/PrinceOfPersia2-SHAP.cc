@@ -118,7 +118,7 @@ string decode_rows_rle(const string& data, size_t num_rows, size_t row_bytes) {
   return w.str();
 }
 
-Image decode_SHAP(const std::string& data_with_header, const std::vector<ColorTableEntry>& ctbl) {
+void decode_SHAP_into(Image& dest, const std::string& data_with_header, const ColorLUT& lut) {
   StringReader r(data_with_header);
 
   const auto& header = r.get<SHAPHeader>();
@@ -147,29 +147,22 @@ Image decode_SHAP(const std::string& data_with_header, const std::vector<ColorTa
     throw runtime_error("incorrect data size after decompression");
   }
 
-  // Convert the ctbl array into a map, since they are often discontinuous and
-  // the color IDs matter
-  unordered_map<uint8_t, Color8> ctbl_map;
-  for (const auto& c : ctbl) {
-    ctbl_map.emplace(c.color_num, c.c.as8());
-  }
-
-  Image result(row_bytes, header.height, true);
+  // Color 0 is transparent, and colors missing from the table are white
+  SpriteCanvas canvas(dest, row_bytes, header.height);
+  const uint8_t* pixels = reinterpret_cast<const uint8_t*>(data.data());
   for (size_t y = 0; y < static_cast<size_t>(header.height); y++) {
     for (size_t x = 0; x < row_bytes; x++) {
-      uint8_t v = data.at(y * row_bytes + x);
-      if (v == 0) {
-        result.write_pixel(x, y, 0x00000000);
-      } else {
-        try {
-          const Color8& c = ctbl_map.at(v);
-          result.write_pixel(x, y, c.r, c.g, c.b, 0xFF);
-        } catch (const out_of_range&) {
-          result.write_pixel(x, y, 0xFFFFFFFF);
-        }
+      uint8_t v = pixels[y * row_bytes + x];
+      if (v != 0) {
+        canvas.write_pixel(x, y, lut.get(v, 0xFFFFFFFF));
       }
     }
   }
+}
 
-  return result;
+Image decode_SHAP(const std::string& data_with_header, const std::vector<ColorTableEntry>& ctbl) {
+  // Color tables for SHAPs are often discontinuous, and the color IDs matter
+  Image ret;
+  decode_SHAP_into(ret, data_with_header, ColorLUT(ctbl, true));
+  return ret;
 }
@@ -23,15 +23,15 @@ struct SpriteEntry {
 } __attribute__((packed));
 
 static Image decode_sprite_entry(const void* vdata, uint16_t width,
-    uint16_t height, const vector<ColorTableEntry>& pltt) {
+    uint16_t height, const ColorLUT& lut) {
   const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
 
   // SC2K sprites are encoded as byte streams. Opcodes are 2 bytes; some opcodes
   // are followed by multiple bytes (possibly an odd number), but opcodes are
   // always word-aligned. There are only 5 opcodes.
 
-  Image ret(width, height, true);
-  ret.clear(0xFF, 0xFF, 0xFF, 0x00); // All transparent by default
+  Image ret;
+  SpriteCanvas canvas(ret, width, height, true, 0xFFFFFF00); // All transparent by default
 
   int16_t y = -1;
   int16_t x = 0;
@@ -55,13 +55,14 @@ static Image decode_sprite_entry(const void* vdata, uint16_t width,
         x += (opcode >> 8);
         break;
       case 4: { // write pixels
-        uint16_t end_x = x + (opcode >> 8);
-        for (; x < end_x; x++) {
-          uint8_t color = *(data++);
-          offset++;
-          Color8 c = pltt.at(color).c.as8();
-          ret.write_pixel(x, y, c.r, c.g, c.b, 0xFF);
+        uint16_t count = opcode >> 8;
+        if ((x < 0) || (y < 0)) {
+          throw out_of_range("sprite span is out of range");
         }
+        canvas.write_indexes(x, y, data, count, lut);
+        x += count;
+        data += count;
+        offset += count;
         // Opcodes are always word-aligned, so adjust ptr if needed
         if (opcode & 0x0100) {
           data++;
@@ -74,7 +75,7 @@ static Image decode_sprite_entry(const void* vdata, uint16_t width,
   }
 }
 
-vector<Image> decode_SPRT(const string& data, const vector<ColorTableEntry>& pltt) {
+vector<Image> decode_SPRT(const string& data, const ColorLUT& lut) {
   StringReader r(data);
   uint16_t count = r.get_u16b();
 
@@ -82,8 +83,12 @@ vector<Image> decode_SPRT(const string& data, const vector<ColorTableEntry>& plt
   for (size_t x = 0; x < count; x++) {
     const auto& entry = r.get<SpriteEntry>();
     ret.emplace_back(decode_sprite_entry(
-        data.data() + entry.offset, entry.width, entry.height, pltt));
+        data.data() + entry.offset, entry.width, entry.height, lut));
   }
 
   return ret;
 }
+
+vector<Image> decode_SPRT(const string& data, const vector<ColorTableEntry>& pltt) {
+  return decode_SPRT(data, ColorLUT(pltt));
+}
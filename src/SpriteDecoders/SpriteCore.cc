@@ -0,0 +1,47 @@
+#include "SpriteCore.hh"
+
+#include <string.h>
+
+using namespace std;
+
+
+
+ColorLUT::ColorLUT(const vector<ColorTableEntry>& clut, bool use_color_nums) {
+  memset(this->colors, 0, sizeof(this->colors));
+  memset(this->present, 0, sizeof(this->present));
+
+  auto clut8 = to_color8(clut);
+  for (size_t z = 0; z < clut8.size(); z++) {
+    size_t index = use_color_nums ? static_cast<uint16_t>(clut[z].color_num) : z;
+    if (index >= 0x100) {
+      continue;
+    }
+    const auto& c = clut8[z];
+    this->colors[index] = (c.r << 24) | (c.g << 16) | (c.b << 8) | 0xFF;
+    this->present[index] = true;
+  }
+}
+
+ColorLUT::ColorLUT() {
+  for (size_t z = 0; z < 0x100; z++) {
+    this->colors[z] = (z << 24) | (z << 16) | (z << 8) | 0xFF;
+    this->present[z] = true;
+  }
+}
+
+
+
+SpriteCanvas::SpriteCanvas(Image& dest, size_t w, size_t h, bool has_alpha,
+    uint32_t clear_color)
+  : w(w), h(h), channels(has_alpha ? 4 : 3) {
+  if ((dest.get_width() == w) && (dest.get_height() == h) &&
+      (dest.get_has_alpha() == has_alpha)) {
+    dest.clear(clear_color);
+  } else {
+    dest = Image(w, h, has_alpha);
+    if (clear_color != 0x00000000) {
+      dest.clear(clear_color);
+    }
+  }
+  this->data = reinterpret_cast<uint8_t*>(dest.get_data());
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <phosg/Image.hh>
+#include <stdexcept>
+#include <vector>
+
+#include "../QuickDrawFormats.hh"
+
+
+
+// A color table converted to 0xRRGGBBAA values once, so decoders can look up
+// each pixel's color with one array access instead of converting a
+// ColorTableEntry every time. By default, entries are indexed by their position
+// in the color table (as clut.at(index) does); if use_color_nums is true,
+// they're indexed by their color_num fields instead.
+class ColorLUT {
+public:
+  explicit ColorLUT(const std::vector<ColorTableEntry>& clut,
+      bool use_color_nums = false);
+  // Makes a grayscale LUT, where each index is its own R, G, and B value
+  ColorLUT();
+  ~ColorLUT() = default;
+
+  // Throws out_of_range if the color table has no entry for index.
+  inline uint32_t at(uint8_t index) const {
+    if (!this->present[index]) {
+      throw std::out_of_range("color index is not in color table");
+    }
+    return this->colors[index];
+  }
+  // Returns default_color if the color table has no entry for index.
+  inline uint32_t get(uint8_t index, uint32_t default_color) const {
+    return this->present[index] ? this->colors[index] : default_color;
+  }
+
+private:
+  uint32_t colors[0x100];
+  bool present[0x100];
+};
+
+
+
+// Writes decoded pixels directly into an Image's buffer. Decoders use this
+// instead of Image::write_pixel, which checks bounds and converts the color on
+// every call; here, each span is checked once and then written in a tight
+// loop. Spans that extend past the end of a row or the image throw
+// out_of_range.
+//
+// The canvas can draw into an existing Image. If that Image already has the
+// right size and format, its buffer is reused (and cleared) instead of being
+// reallocated, so callers decoding many frames can keep one Image around.
+class SpriteCanvas {
+public:
+  SpriteCanvas(Image& dest, size_t w, size_t h, bool has_alpha = true,
+      uint32_t clear_color = 0x00000000);
+  ~SpriteCanvas() = default;
+
+  inline size_t width() const {
+    return this->w;
+  }
+  inline size_t height() const {
+    return this->h;
+  }
+
+  // Writes count pixels at (x, y) with colors from lut
+  inline void write_indexes(size_t x, size_t y, const uint8_t* indexes,
+      size_t count, const ColorLUT& lut) {
+    uint8_t* p = this->span(x, y, count);
+    for (size_t z = 0; z < count; z++, p += this->channels) {
+      this->store(p, lut.at(indexes[z]));
+    }
+  }
+  // Writes count pixels of the same color (0xRRGGBBAA) at (x, y)
+  inline void fill(size_t x, size_t y, size_t count, uint32_t color) {
+    uint8_t* p = this->span(x, y, count);
+    if ((color == 0) && (this->channels == 4)) {
+      memset(p, 0, count * 4);
+      return;
+    }
+    for (size_t z = 0; z < count; z++, p += this->channels) {
+      this->store(p, color);
+    }
+  }
+  inline void write_pixel(size_t x, size_t y, uint32_t color) {
+    this->store(this->span(x, y, 1), color);
+  }
+
+private:
+  inline uint8_t* span(size_t x, size_t y, size_t count) const {
+    if ((y >= this->h) || (x > this->w) || (count > this->w - x)) {
+      throw std::out_of_range("sprite span is out of range");
+    }
+    return this->data + (y * this->w + x) * this->channels;
+  }
+  inline void store(uint8_t* p, uint32_t color) const {
+    p[0] = color >> 24;
+    p[1] = color >> 16;
+    p[2] = color >> 8;
+    if (this->channels == 4) {
+      p[3] = color;
+    }
+  }
+
+  uint8_t* data;
+  size_t w;
+  size_t h;
+  size_t channels;
+};
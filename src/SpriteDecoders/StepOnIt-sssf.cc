@@ -10,7 +10,7 @@
 
 using namespace std;
 
-Image decode_sssf_image(StringReader& r, const vector<ColorTableEntry>& clut) {
+static Image decode_sssf_image(StringReader& r, const ColorLUT& lut) {
   uint16_t width = r.get_u16b();
   uint16_t height = r.get_u16b();
   r.skip(4); // apparently unused - both PPC and 68K decoders ignore this
@@ -18,38 +18,29 @@ Image decode_sssf_image(StringReader& r, const vector<ColorTableEntry>& clut) {
 
   StringReader data_r = r.sub(data_stream_offset, r.size() - data_stream_offset);
 
-  string decoded_data;
+  // The canvas starts out transparent, so transparent segments (and zero bytes
+  // in data segments) only need to advance the output position
+  Image ret;
+  SpriteCanvas canvas(ret, width, height);
   size_t target_size = width * height;
-  while (decoded_data.size() < target_size) {
+  size_t pos = 0;
+  while (pos < target_size) {
     uint8_t num_zeroes = r.get_u8();
-    for (size_t x = 0; x < num_zeroes; x++) {
-      if (decoded_data.size() >= target_size) {
-        throw logic_error("exceeded target size during transparent segment");
-      }
-      decoded_data.push_back(0x00);
+    if (num_zeroes > target_size - pos) {
+      throw logic_error("exceeded target size during transparent segment");
     }
-    if (decoded_data.size() >= target_size) {
+    pos += num_zeroes;
+    if (pos >= target_size) {
       break;
     }
     uint8_t num_data_bytes = r.get_u8();
-    for (size_t x = 0; x < num_data_bytes; x++) {
-      if (decoded_data.size() >= target_size) {
-        throw logic_error("exceeded target size during data segment");
-      }
-      decoded_data.push_back(data_r.get_u8());
+    if (num_data_bytes > target_size - pos) {
+      throw logic_error("exceeded target size during data segment");
     }
-  }
-
-  Image ret(width, height, true);
-  StringReader decoded_r(decoded_data.data(), decoded_data.size());
-  for (size_t y = 0; y < height; y++) {
-    for (size_t x = 0; x < width; x++) {
-      uint8_t v = decoded_r.get_u8();
-      if (v == 0) {
-        ret.write_pixel(x, y, 0, 0, 0, 0);
-      } else {
-        auto c = clut.at(v).c.as8();
-        ret.write_pixel(x, y, c.r, c.g, c.b);
+    for (size_t z = 0; z < num_data_bytes; z++, pos++) {
+      uint8_t v = data_r.get_u8();
+      if (v != 0) {
+        canvas.write_pixel(pos % width, pos / width, lut.at(v));
       }
     }
   }
@@ -61,7 +52,7 @@ Image decode_sssf_image(StringReader& r, const vector<ColorTableEntry>& clut) {
 // 128  <- 1001
 // 129  <- 1000
 
-vector<Image> decode_sssf(const string& data, const vector<ColorTableEntry>& clut) {
+vector<Image> decode_sssf(const string& data, const ColorLUT& lut) {
   StringReader r(data);
 
   uint32_t num_images = r.get_u32b();
@@ -89,8 +80,12 @@ vector<Image> decode_sssf(const string& data, const vector<ColorTableEntry>& clu
       end_offset = end_it->first;
     }
     StringReader sub_r = r.sub(it->first, end_offset - it->first);
-    ret[it->second] = decode_sssf_image(sub_r, clut);
+    ret[it->second] = decode_sssf_image(sub_r, lut);
   }
 
   return ret;
 }
+
+vector<Image> decode_sssf(const string& data, const vector<ColorTableEntry>& clut) {
+  return decode_sssf(data, ColorLUT(clut));
+}
@@ -24,7 +24,7 @@ struct SpriHeader {
   // uint8_t blitter_code[...EOF]
 } __attribute__((packed));
 
-Image decode_Spri(const string& spri_data, const vector<ColorTableEntry>& clut) {
+void decode_Spri_into(Image& dest, const string& spri_data, const ColorLUT& lut) {
   StringReader r(spri_data);
 
   const auto& header = r.get<SpriHeader>();
@@ -137,14 +137,18 @@ Image decode_Spri(const string& spri_data, const vector<ColorTableEntry>& clut)
   // these to an Image and return it.
   const uint8_t* output_color = mem->at<const uint8_t>(output_color_addr, header.area);
   const uint8_t* output_alpha = mem->at<const uint8_t>(output_alpha_addr, header.area);
-  Image ret(header.side, header.side, true);
+  SpriteCanvas canvas(dest, header.side, header.side);
   for (size_t y = 0; y < header.side; y++) {
     for (size_t x = 0; x < header.side; x++) {
       size_t z = (y * header.side) + x;
-      auto color = clut.at(output_color[z]).c.as8();
-      ret.write_pixel(x, y, color.r, color.g, color.b, output_alpha[z]);
+      uint32_t color = lut.at(output_color[z]);
+      canvas.write_pixel(x, y, (color & 0xFFFFFF00) | output_alpha[z]);
     }
   }
+}
 
+Image decode_Spri(const string& spri_data, const vector<ColorTableEntry>& clut) {
+  Image ret;
+  decode_Spri_into(ret, spri_data, ColorLUT(clut));
   return ret;
 }
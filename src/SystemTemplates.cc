@@ -894,4 +894,23 @@ const ResourceFile::TemplateEntryList& get_system_template(uint32_t type) {
   } catch (const out_of_range&) {
     return empty_template;
   }
+}
+
+shared_ptr<const ResourceFile::CompiledTemplate> get_compiled_system_template(
+    uint32_t type) {
+  // All the system templates are compiled the first time any of them is used.
+  // This is thread-safe since it's the initialization of a local static.
+  static const unordered_map<uint32_t, shared_ptr<const ResourceFile::CompiledTemplate>> compiled_templates = []() {
+    unordered_map<uint32_t, shared_ptr<const ResourceFile::CompiledTemplate>> ret;
+    for (const auto& it : system_templates) {
+      ret.emplace(it.first, ResourceFile::compile_template(it.second));
+    }
+    return ret;
+  }();
+
+  try {
+    return compiled_templates.at(type);
+  } catch (const out_of_range&) {
+    return nullptr;
+  }
 }
\ No newline at end of file
@@ -13,3 +13,6 @@
 
 
 const ResourceFile::TemplateEntryList& get_system_template(uint32_t type);
+// Returns nullptr if there's no system template for the given type
+std::shared_ptr<const ResourceFile::CompiledTemplate> get_compiled_system_template(
+    uint32_t type);
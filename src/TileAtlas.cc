@@ -0,0 +1,133 @@
+#include "TileAtlas.hh"
+
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "Blitter.hh"
+
+using namespace std;
+
+
+
+TileAtlas::TileAtlas(bool dest_has_alpha)
+  : dest_has_alpha(dest_has_alpha), channels(dest_has_alpha ? 4 : 3) { }
+
+size_t TileAtlas::add_tile_with_coverage(const Image& source, ssize_t sx,
+    ssize_t sy, size_t w, size_t h,
+    const function<uint8_t(uint64_t, uint64_t, uint64_t, uint64_t)>& get_coverage) {
+  Tile& tile = this->tiles.emplace_back();
+  tile.width = w;
+  tile.height = h;
+  tile.pixels.resize(w * h * this->channels, 0);
+
+  vector<uint8_t> coverage(w * h * this->channels, 0);
+  bool opaque = true;
+  ssize_t source_w = source.get_width();
+  ssize_t source_h = source.get_height();
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      size_t offset = (y * w + x) * this->channels;
+      ssize_t px = sx + x;
+      ssize_t py = sy + y;
+      uint8_t c = 0;
+      if ((px >= 0) && (py >= 0) && (px < source_w) && (py < source_h)) {
+        uint64_t r, g, b, a;
+        source.read_pixel(px, py, &r, &g, &b, &a);
+        tile.pixels[offset + 0] = r;
+        tile.pixels[offset + 1] = g;
+        tile.pixels[offset + 2] = b;
+        // The destination's alpha is blended toward opaque, so the "source"
+        // alpha is always 0xFF and the actual alpha goes in the coverage
+        if (this->channels == 4) {
+          tile.pixels[offset + 3] = 0xFF;
+        }
+        c = get_coverage(r, g, b, a);
+      }
+      memset(&coverage[offset], c, this->channels);
+      if (c != 0xFF) {
+        opaque = false;
+      }
+    }
+  }
+
+  if (!opaque) {
+    tile.coverage = move(coverage);
+  }
+  return this->tiles.size() - 1;
+}
+
+size_t TileAtlas::add_tile(const Image& source, ssize_t sx, ssize_t sy,
+    size_t w, size_t h) {
+  bool source_has_alpha = source.get_has_alpha();
+  return this->add_tile_with_coverage(source, sx, sy, w, h,
+      [&](uint64_t, uint64_t, uint64_t, uint64_t a) -> uint8_t {
+    return source_has_alpha ? a : 0xFF;
+  });
+}
+
+size_t TileAtlas::add_masked_tile(const Image& source, ssize_t sx, ssize_t sy,
+    size_t w, size_t h, uint32_t transparent_color) {
+  uint8_t tr = (transparent_color >> 24) & 0xFF;
+  uint8_t tg = (transparent_color >> 16) & 0xFF;
+  uint8_t tb = (transparent_color >> 8) & 0xFF;
+  return this->add_tile_with_coverage(source, sx, sy, w, h,
+      [&](uint64_t r, uint64_t g, uint64_t b, uint64_t) -> uint8_t {
+    return ((r == tr) && (g == tg) && (b == tb)) ? 0x00 : 0xFF;
+  });
+}
+
+size_t TileAtlas::add_tile_grid(const Image& source, size_t w, size_t h,
+    size_t columns, size_t count) {
+  if (columns == 0) {
+    throw invalid_argument("tile grid must have at least one column");
+  }
+  size_t first_index = this->tiles.size();
+  for (size_t z = 0; z < count; z++) {
+    this->add_tile(source, (z % columns) * w, (z / columns) * h, w, h);
+  }
+  return first_index;
+}
+
+size_t TileAtlas::tile_width(size_t index) const {
+  return this->tiles.at(index).width;
+}
+
+size_t TileAtlas::tile_height(size_t index) const {
+  return this->tiles.at(index).height;
+}
+
+bool TileAtlas::tile_is_opaque(size_t index) const {
+  return this->tiles.at(index).coverage.empty();
+}
+
+void TileAtlas::draw(Image& dest, size_t index, ssize_t x, ssize_t y) const {
+  if (dest.get_has_alpha() != this->dest_has_alpha) {
+    throw logic_error("destination pixel format does not match tile atlas");
+  }
+  const Tile& tile = this->tiles.at(index);
+
+  ssize_t dest_w = dest.get_width();
+  ssize_t dest_h = dest.get_height();
+  ssize_t x_start = max<ssize_t>(0, -x);
+  ssize_t y_start = max<ssize_t>(0, -y);
+  ssize_t x_end = min<ssize_t>(tile.width, dest_w - x);
+  ssize_t y_end = min<ssize_t>(tile.height, dest_h - y);
+  if ((x_start >= x_end) || (y_start >= y_end)) {
+    return;
+  }
+
+  uint8_t* dest_data = reinterpret_cast<uint8_t*>(dest.get_data());
+  size_t row_bytes = (x_end - x_start) * this->channels;
+  for (ssize_t yy = y_start; yy < y_end; yy++) {
+    uint8_t* dest_row = dest_data + ((y + yy) * dest_w + x + x_start) * this->channels;
+    size_t src_offset = (yy * tile.width + x_start) * this->channels;
+    if (tile.coverage.empty()) {
+      memcpy(dest_row, &tile.pixels[src_offset], row_bytes);
+    } else {
+      blend_bytes_with_coverage(dest_row, &tile.pixels[src_offset],
+          &tile.coverage[src_offset], row_bytes);
+    }
+  }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <phosg/Image.hh>
+#include <vector>
+
+
+
+// Holds tiles cut from source images (e.g. a tileset PICT) in a form that can
+// be drawn many times without per-pixel Image calls. Each tile is one
+// contiguous buffer in the pixel layout of the images it will be drawn into
+// (RGB or RGBA, chosen when the atlas is created), so opaque tiles are drawn
+// with one memcpy per row. Tiles that have any transparent pixels also have a
+// coverage buffer with one byte per channel, and are blended into the
+// destination instead.
+//
+// Atlases are not modified by draw(), so a finished atlas can be shared
+// between threads.
+class TileAtlas {
+public:
+  explicit TileAtlas(bool dest_has_alpha);
+  ~TileAtlas() = default;
+
+  // Adds a w x h tile copied from (sx, sy) in source, and returns its index.
+  // Pixels outside of source's bounds are transparent; if source has an alpha
+  // channel, its alpha values are used for the other pixels.
+  size_t add_tile(const Image& source, ssize_t sx, ssize_t sy, size_t w,
+      size_t h);
+  // Like add_tile, but pixels of the given color (0xRRGGBBAA; alpha is
+  // ignored) are transparent and all others are opaque, as in
+  // Image::mask_blit.
+  size_t add_masked_tile(const Image& source, ssize_t sx, ssize_t sy,
+      size_t w, size_t h, uint32_t transparent_color);
+  // Adds count w x h tiles in row-major order from a grid with the given
+  // number of columns, and returns the index of the first one.
+  size_t add_tile_grid(const Image& source, size_t w, size_t h,
+      size_t columns, size_t count);
+
+  inline size_t size() const {
+    return this->tiles.size();
+  }
+  inline bool get_dest_has_alpha() const {
+    return this->dest_has_alpha;
+  }
+  size_t tile_width(size_t index) const;
+  size_t tile_height(size_t index) const;
+  bool tile_is_opaque(size_t index) const;
+
+  // Draws a tile into dest with its upper-left corner at (x, y), clipped to
+  // dest's bounds. Throws logic_error if dest's pixel layout doesn't match the
+  // atlas', or out_of_range if index isn't valid.
+  void draw(Image& dest, size_t index, ssize_t x, ssize_t y) const;
+
+private:
+  struct Tile {
+    size_t width;
+    size_t height;
+    std::vector<uint8_t> pixels;
+    // Empty if the tile is opaque
+    std::vector<uint8_t> coverage;
+  };
+
+  size_t add_tile_with_coverage(const Image& source, ssize_t sx, ssize_t sy,
+      size_t w, size_t h,
+      const std::function<uint8_t(uint64_t, uint64_t, uint64_t, uint64_t)>& get_coverage);
+
+  bool dest_has_alpha;
+  size_t channels;
+  std::vector<Tile> tiles;
+};
@@ -4,13 +4,18 @@
 #include <string.h>
 
 #include <algorithm>
+#include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
 #include <phosg/Strings.hh>
 #include <stdexcept>
+#include <unordered_set>
 #include <vector>
 
+#include "Blitter.hh"
+#include "DecodedImageCache.hh"
+#include "ParallelTasks.hh"
 #include "ResourceFile.hh"
 #include "IndexFormats/Formats.hh"
 
@@ -756,28 +761,7 @@ struct FerazelsWandLevel {
 
 
 
-static shared_ptr<Image> decode_PICT_cached(
-    int16_t id,
-    unordered_map<int16_t, shared_ptr<Image>>& cache,
-    ResourceFile& rf) {
-  try {
-    return cache.at(id);
-  } catch (const out_of_range&) {
-    try {
-      const auto decode_result = rf.decode_PICT(id);
-      if (!decode_result.embedded_image_format.empty()) {
-        throw runtime_error(string_printf("PICT %hd is an embedded image", id));
-      }
-      auto emplace_ret = cache.emplace(id, new Image(move(decode_result.image)));
-      return emplace_ret.first->second;
-
-    } catch (const out_of_range&) {
-      return shared_ptr<Image>();
-    }
-  }
-}
-
-static shared_ptr<Image> truncate_whitespace(shared_ptr<Image> img) {
+static shared_ptr<const Image> truncate_whitespace(shared_ptr<const Image> img) {
   // Top rows
   size_t x, y;
   for (y = 0; y < img->get_height(); y++) {
@@ -794,7 +778,7 @@ static shared_ptr<Image> truncate_whitespace(shared_ptr<Image> img) {
   size_t top_rows_to_remove = y;
   if (top_rows_to_remove == img->get_height()) {
     // Entire image is white; remove all of it
-    return shared_ptr<Image>(new Image(0, 0));
+    return make_shared<Image>(0, 0);
   }
 
   // Left columns
@@ -896,7 +880,9 @@ Options:\n\
       Render the parallax foreground at the bottom with the given opacity\n\
       (0-255; default 0).\n\
   --print-unused-pict-ids\n\
-      When done, print the IDs of all the PICT resources that were not used.\n\n");
+      When done, print the IDs of all the PICT resources that were not used.\n\
+  --threads=N\n\
+      Render levels on N threads (0 means one thread per core; default 1).\n\n");
 }
 
 int main(int argc, char** argv) {
@@ -908,6 +894,7 @@ int main(int argc, char** argv) {
   bool render_sprites = true;
   uint8_t parallax_foreground_opacity = 0;
   bool print_unused_pict_ids = false;
+  size_t num_threads = 1;
 
   string levels_filename = "Ferazel\'s Wand World Data";
   string sprites_filename = "Ferazel\'s Wand Sprites";
@@ -944,7 +931,9 @@ int main(int argc, char** argv) {
     } else if (!strcmp(argv[z], "--skip-render-parallax-background")) {
       render_parallax_backgrounds = false;
     } else if (!strcmp(argv[z], "--print-unused-pict-ids")) {
-      print_unused_pict_ids = true;;
+      print_unused_pict_ids = true;
+    } else if (!strncmp(argv[z], "--threads=", 10)) {
+      num_threads = strtoull(&argv[z][10], nullptr, 0);
     } else {
       print_usage();
       throw invalid_argument(string_printf("invalid option: %s", argv[z]));
@@ -955,55 +944,93 @@ int main(int argc, char** argv) {
   const string sprites_resource_filename = sprites_filename + "/..namedfork/rsrc";
   const string backgrounds_resource_filename = backgrounds_filename + "/..namedfork/rsrc";
 
-  ResourceFile levels(parse_resource_fork(load_file(levels_resource_filename.c_str())));
-  ResourceFile sprites(parse_resource_fork(load_file(sprites_resource_filename.c_str())));
-  ResourceFile backgrounds(parse_resource_fork(load_file(backgrounds_resource_filename.c_str())));
+  ResourceFile levels(parse_resource_fork(make_shared<MappedFile>(levels_resource_filename.c_str())));
+  ResourceFile sprites(parse_resource_fork(make_shared<MappedFile>(sprites_resource_filename.c_str())));
+  ResourceFile backgrounds(parse_resource_fork(make_shared<MappedFile>(backgrounds_resource_filename.c_str())));
 
   uint32_t level_resource_type = 0x4D6C766C; // Mlvl
   auto level_resources = levels.all_resources_of_type(level_resource_type);
   sort(level_resources.begin(), level_resources.end());
 
-  unordered_map<int16_t, shared_ptr<Image>> backgrounds_cache;
-  unordered_map<int16_t, shared_ptr<Image>> sprites_cache;
-  unordered_map<int16_t, shared_ptr<Image>> reversed_sprites_cache;
+  // Variants of decoded PICTs that are also cached, in addition to the PICTs
+  // themselves (which use variant 0)
+  static constexpr uint32_t VARIANT_FIRST_FRAME = DecodedImageCache::FIRST_CALLER_VARIANT;
+  static constexpr uint32_t VARIANT_TRUNCATED = DecodedImageCache::FIRST_CALLER_VARIANT + 1;
+  static constexpr uint32_t VARIANT_REVERSED = DecodedImageCache::FIRST_CALLER_VARIANT + 2;
+  DecodedImageCache image_cache;
+  mutex used_pict_ids_lock;
+  unordered_set<int16_t> used_sprite_pict_ids;
+  unordered_set<int16_t> used_background_pict_ids;
+  auto get_sprite_pict = [&](int16_t id) -> shared_ptr<const Image> {
+    {
+      lock_guard<mutex> g(used_pict_ids_lock);
+      used_sprite_pict_ids.emplace(id);
+    }
+    return image_cache.get_PICT(sprites, id);
+  };
+  auto get_background_pict = [&](int16_t id) -> shared_ptr<const Image> {
+    {
+      lock_guard<mutex> g(used_pict_ids_lock);
+      used_background_pict_ids.emplace(id);
+    }
+    return image_cache.get_PICT(backgrounds, id);
+  };
 
+  vector<int16_t> target_level_ids;
   for (int16_t level_id : level_resources) {
-    if (!target_levels.empty() && !target_levels.count(level_id)) {
-      continue;
+    if (target_levels.empty() || target_levels.count(level_id)) {
+      target_level_ids.emplace_back(level_id);
     }
+  }
 
+  // Levels are rendered independently, so they can be rendered in parallel.
+  // The ResourceFiles aren't safe to modify from multiple threads, so load
+  // everything up front in that case.
+  if (num_threads != 1) {
+    levels.load_all_resources();
+    sprites.load_all_resources();
+    backgrounds.load_all_resources();
+  }
+
+  run_parallel_tasks(target_level_ids.size(), num_threads, [&](size_t level_index, FILE* log_stream) -> void {
+    int16_t level_id = target_level_ids[level_index];
     string level_data = levels.get_resource(level_resource_type, level_id)->data;
     const auto* level = reinterpret_cast<const FerazelsWandLevel*>(level_data.data());
 
     if (level->signature != 0x04277DC9) {
-      fprintf(stderr, "... %hd (incorrect signature: %08X)\n", level_id,
+      fprintf(log_stream, "... %hd (incorrect signature: %08X)\n", level_id,
           level->signature.load());
-      continue;
+      return;
     }
 
     Image result(level->width * 32, level->height * 32);
 
     if (render_parallax_backgrounds) {
-      shared_ptr<Image> pxback_pict;
+      shared_ptr<const Image> pxback_pict;
 
       if (level->abstract_background) {
-        fprintf(stderr, "... (Level %hd) abstract background\n", level_id);
+        fprintf(log_stream, "... (Level %hd) abstract background\n", level_id);
         if (level->abstract_background == 1) {
-          pxback_pict = decode_PICT_cached(6000, sprites_cache, sprites);
+          pxback_pict = get_sprite_pict(6000);
         } else if (level->abstract_background == 6) {
           // This one is animated with all frames in one PICT; just pick the
           // first frame
-          shared_ptr<Image> loaded = decode_PICT_cached(357, backgrounds_cache, backgrounds);
-          if (loaded.get()) {
-            pxback_pict.reset(new Image(128, 128));
-            pxback_pict->blit(*loaded, 0, 0, 128, 128, 0, 0);
-          }
+          pxback_pict = image_cache.get(backgrounds, RESOURCE_TYPE_PICT, 357, VARIANT_FIRST_FRAME,
+              [&]() -> shared_ptr<const Image> {
+            shared_ptr<const Image> loaded = get_background_pict(357);
+            if (!loaded.get()) {
+              return nullptr;
+            }
+            auto frame = make_shared<Image>(128, 128);
+            frame->blit(*loaded, 0, 0, 128, 128, 0, 0);
+            return frame;
+          });
         } else if (level->abstract_background != 0) {
           // 2=magic (600? 601?)
           // 3=secret
           // 4-9=bosses
           // the PICTs appear to mostly be around PICT 6000 in the sprites file
-          fprintf(stderr, "error: this level has an abstract background (%hhu); skipping rendering parallax background\n",
+          fprintf(log_stream, "error: this level has an abstract background (%hhu); skipping rendering parallax background\n",
               level->abstract_background);
         }
         if (pxback_pict.get()) {
@@ -1012,17 +1039,15 @@ int main(int argc, char** argv) {
           size_t h = pxback_pict->get_height();
           for (ssize_t y = 0; y < level->height * 32; y += h) {
             for (ssize_t x = 0; x < level->width * 32; x += w) {
-              result.blit(*pxback_pict, x, y, w, h, 0, 0);
+              blit_pixels(result, *pxback_pict, x, y, w, h, 0, 0, BlitOptions());
             }
           }
         }
       } else {
-        pxback_pict = decode_PICT_cached(
-            level->parallax_background_pict_id,
-            backgrounds_cache, backgrounds);
+        pxback_pict = get_background_pict(level->parallax_background_pict_id);
 
         if (pxback_pict.get()) {
-          fprintf(stderr, "... (Level %hd) parallax background\n", level_id);
+          fprintf(log_stream, "... (Level %hd) parallax background\n", level_id);
           // For each row, find the repetition point and truncate the row there
           vector<vector<uint16_t>> parallax_layers;
           for (ssize_t y = 0; y < level->parallax_background_layer_count; y++) {
@@ -1049,7 +1074,7 @@ int main(int argc, char** argv) {
           ssize_t letterbox_height = (level->height * 32 - parallax_height) / 2;
           uint64_t top_r = 0, top_g = 0, top_b = 0, bottom_r = 0, bottom_g = 0, bottom_b = 0;
           if (letterbox_height < 0) {
-            fprintf(stderr, "warning: parallax background height (%zu) exceeds level height (%d); background will be truncated\n",
+            fprintf(log_stream, "warning: parallax background height (%zu) exceeds level height (%d); background will be truncated\n",
                 parallax_height, level->height * 32);
             letterbox_height = 0;
           } else if (letterbox_height > 0 && !parallax_layers.empty()) {
@@ -1119,7 +1144,8 @@ int main(int argc, char** argv) {
               if (y_segnum >= y_segments) {
                 result.fill_rect(x * 128, y * 128 + letterbox_height, 128, 128, 0xFF0000FF);
               } else {
-                result.blit(*pxback_pict, x * 128, y * 128 + letterbox_height, 128, 128, x_segnum * 128, y_segnum * 128);
+                blit_pixels(result, *pxback_pict, x * 128, y * 128 + letterbox_height,
+                    128, 128, x_segnum * 128, y_segnum * 128, BlitOptions());
               }
             }
           }
@@ -1130,44 +1156,32 @@ int main(int argc, char** argv) {
     const auto* foreground_tiles = level->foreground_tiles();
     const auto* background_tiles = level->background_tiles();
     if (foreground_opacity || background_opacity) {
-      shared_ptr<Image> foreground_blend_mask_pict = foreground_opacity
-          ? decode_PICT_cached(185, sprites_cache, sprites)
+      shared_ptr<const Image> foreground_blend_mask_pict = foreground_opacity
+          ? get_sprite_pict(185)
           : nullptr;
       // TODO: are these the right defaults?
-      shared_ptr<Image> foreground_pict = decode_PICT_cached(
-          level->foreground_tile_pict_id.load() ? level->foreground_tile_pict_id.load() : 200,
-          backgrounds_cache, backgrounds);
-      shared_ptr<Image> background_pict = decode_PICT_cached(
-          level->background_tile_pict_id.load() ? level->background_tile_pict_id.load() : 203,
-          backgrounds_cache, backgrounds);
-      shared_ptr<Image> orig_wall_tile_pict = decode_PICT_cached(
-          level->wall_tile_pict_id.load() ? level->wall_tile_pict_id.load() : 206,
-          backgrounds_cache, backgrounds);
-      shared_ptr<Image> wall_tile_pict = orig_wall_tile_pict.get() ? truncate_whitespace(orig_wall_tile_pict) : nullptr;
+      shared_ptr<const Image> foreground_pict = get_background_pict(
+          level->foreground_tile_pict_id.load() ? level->foreground_tile_pict_id.load() : 200);
+      shared_ptr<const Image> background_pict = get_background_pict(
+          level->background_tile_pict_id.load() ? level->background_tile_pict_id.load() : 203);
+      int16_t wall_tile_pict_id = level->wall_tile_pict_id.load() ? level->wall_tile_pict_id.load() : 206;
+      shared_ptr<const Image> wall_tile_pict = image_cache.get(backgrounds, RESOURCE_TYPE_PICT,
+          wall_tile_pict_id, VARIANT_TRUNCATED, [&]() -> shared_ptr<const Image> {
+        shared_ptr<const Image> orig_wall_tile_pict = get_background_pict(wall_tile_pict_id);
+        return orig_wall_tile_pict.get() ? truncate_whitespace(orig_wall_tile_pict) : nullptr;
+      });
 
       if (background_opacity) {
-        fprintf(stderr, "... (Level %hd) background tiles\n", level_id);
+        fprintf(log_stream, "... (Level %hd) background tiles\n", level_id);
         if (!background_pict.get()) {
-          fprintf(stderr, "warning: background pict %hd is missing\n",
+          fprintf(log_stream, "warning: background pict %hd is missing\n",
               level->background_tile_pict_id.load());
 
         } else {
-          auto alpha_blit_pixel_fn = [&](uint64_t& dr, uint64_t& dg, uint64_t& db, uint64_t& da, uint64_t sr, uint64_t sg, uint64_t sb, uint64_t sa) {
-            if (sr == 0xFF && sg == 0xFF && sb == 0xFF) {
-              return;
-            }
-            if (background_opacity == 0xFF) {
-              dr = sr;
-              dg = sg;
-              db = sb;
-              da = sa;
-            } else {
-              dr = ((background_opacity * sr) + (0xFF - background_opacity) * dr) / 0xFF;
-              dg = ((background_opacity * sg) + (0xFF - background_opacity) * dg) / 0xFF;
-              db = ((background_opacity * sb) + (0xFF - background_opacity) * db) / 0xFF;
-              da = ((background_opacity * sa) + (0xFF - background_opacity) * da) / 0xFF;
-            }
-          };
+          BlitOptions blit_options;
+          blit_options.mode = BlitMode::MASKED;
+          blit_options.transparent_color = 0xFFFFFFFF;
+          blit_options.opacity = background_opacity;
 
           for (ssize_t y = 0; y < level->height; y++) {
             for (ssize_t x = 0; x < level->width; x++) {
@@ -1180,8 +1194,8 @@ int main(int argc, char** argv) {
               } else if (bg_tile_type > 0) {
                 uint16_t src_x = ((bg_tile_type - 1) % 8) * 32;
                 uint16_t src_y = ((bg_tile_type - 1) / 8) * 32;
-                result.custom_blit(*background_pict, x * 32, y * 32, 32, 32,
-                    src_x, src_y, alpha_blit_pixel_fn);
+                blit_pixels(result, *background_pict, x * 32, y * 32, 32, 32,
+                    src_x, src_y, blit_options);
               }
             }
           }
@@ -1189,28 +1203,16 @@ int main(int argc, char** argv) {
       }
 
       if (foreground_opacity) {
-        fprintf(stderr, "... (Level %hd) foreground tiles\n", level_id);
+        fprintf(log_stream, "... (Level %hd) foreground tiles\n", level_id);
         if (!foreground_pict.get()) {
-          fprintf(stderr, "warning: background pict %hd is missing\n",
+          fprintf(log_stream, "warning: background pict %hd is missing\n",
               level->background_tile_pict_id.load());
 
         } else {
-          auto alpha_blit_pixel_fn = [&](uint64_t& dr, uint64_t& dg, uint64_t& db, uint64_t& da, uint64_t sr, uint64_t sg, uint64_t sb, uint64_t sa) {
-            if (sr == 0xFF && sg == 0xFF && sb == 0xFF) {
-              return;
-            }
-            if (foreground_opacity == 0xFF) {
-              dr = sr;
-              dg = sg;
-              db = sb;
-              da = sa;
-            } else {
-              dr = ((foreground_opacity * sr) + (0xFF - foreground_opacity) * dr) / 0xFF;
-              dg = ((foreground_opacity * sg) + (0xFF - foreground_opacity) * dg) / 0xFF;
-              db = ((foreground_opacity * sb) + (0xFF - foreground_opacity) * db) / 0xFF;
-              da = ((foreground_opacity * sa) + (0xFF - foreground_opacity) * da) / 0xFF;
-            }
-          };
+          BlitOptions blit_options;
+          blit_options.mode = BlitMode::MASKED;
+          blit_options.transparent_color = 0xFFFFFFFF;
+          blit_options.opacity = foreground_opacity;
 
           for (ssize_t y = 0; y < level->height; y++) {
             for (ssize_t x = 0; x < level->width; x++) {
@@ -1223,8 +1225,8 @@ int main(int argc, char** argv) {
               } else if (fg_tile_type == 0x60 && wall_tile_pict.get()) {
                 uint16_t wall_src_x = (x * 32) % wall_tile_pict->get_width();
                 uint16_t wall_src_y = (y * 32) % wall_tile_pict->get_height();
-                result.custom_blit(*wall_tile_pict, x * 32, y * 32, 32, 32,
-                    wall_src_x, wall_src_y, alpha_blit_pixel_fn);
+                blit_pixels(result, *wall_tile_pict, x * 32, y * 32, 32, 32,
+                    wall_src_x, wall_src_y, blit_options);
               } else if (fg_tile_type > 0) {
                 // The blend mask is indexed by the tile behavior, not by the
                 // tile type.
@@ -1232,8 +1234,8 @@ int main(int argc, char** argv) {
                 uint16_t fore_src_x = ((fg_tile_type - 1) % 8) * 32;
                 uint16_t fore_src_y = ((fg_tile_type - 1) / 8) * 32;
                 if (!wall_tile_pict.get() || (mask_tile_index >= 0x60)) {
-                  result.custom_blit(*foreground_pict, x * 32, y * 32, 32, 32,
-                      fore_src_x, fore_src_y, alpha_blit_pixel_fn);
+                  blit_pixels(result, *foreground_pict, x * 32, y * 32, 32, 32,
+                      fore_src_x, fore_src_y, blit_options);
                 } else {
                   uint16_t mask_src_x = (mask_tile_index % 8) * 32;
                   uint16_t mask_src_y = (mask_tile_index / 8) * 32;
@@ -1276,7 +1278,7 @@ int main(int argc, char** argv) {
     }
 
     if (render_wind) {
-      fprintf(stderr, "... (Level %hd) wind tiles\n", level_id);
+      fprintf(log_stream, "... (Level %hd) wind tiles\n", level_id);
 
       const auto* wind_tiles = level->wind_tiles();
       for (ssize_t y = 0; y < level->height; y++) {
@@ -1321,7 +1323,7 @@ int main(int argc, char** argv) {
 
       // Render destructible tiles
       if (foreground_opacity) {
-        fprintf(stderr, "... (Level %hd) destructible tiles\n", level_id);
+        fprintf(log_stream, "... (Level %hd) destructible tiles\n", level_id);
         for (ssize_t y = 0; y < level->height; y++) {
           for (ssize_t x = 0; x < level->width; x++) {
             size_t tile_index = y * level->width + x;
@@ -1417,7 +1419,7 @@ int main(int argc, char** argv) {
     }
 
     if (render_sprites) {
-      fprintf(stderr, "... (Level %hd) sprites\n", level_id);
+      fprintf(log_stream, "... (Level %hd) sprites\n", level_id);
 
       static const size_t max_sprites = sizeof(level->sprites) / sizeof(level->sprites[0]);
       for (size_t z = 0; z < max_sprites; z++) {
@@ -1461,18 +1463,15 @@ int main(int argc, char** argv) {
           }
 
           int16_t pict_id = sprite_def ? sprite_def->pict_id : sprite.type.load();
-          shared_ptr<Image> sprite_pict = decode_PICT_cached(pict_id,
-              sprites_cache, sprites);
+          shared_ptr<const Image> sprite_pict = get_sprite_pict(pict_id);
 
           if (sprite_pict.get() && sprite_def && sprite_def->reverse_horizontal) {
-            try {
-              sprite_pict = reversed_sprites_cache.at(pict_id);
-            } catch (const out_of_range&) {
-              shared_ptr<Image> reversed_image(new Image(*sprite_pict));
+            sprite_pict = image_cache.get(sprites, RESOURCE_TYPE_PICT, pict_id, VARIANT_REVERSED,
+                [&]() -> shared_ptr<const Image> {
+              auto reversed_image = make_shared<Image>(*sprite_pict);
               reversed_image->reverse_horizontal();
-              reversed_sprites_cache.emplace(pict_id, reversed_image);
-              sprite_pict = reversed_image;
-            }
+              return reversed_image;
+            });
           }
 
           if (sprite_pict.get()) {
@@ -1513,8 +1512,11 @@ int main(int argc, char** argv) {
                 }
               }
             } else {
-              result.mask_blit(*sprite_pict, sprite.x, sprite.y, src_w, src_h,
-                  src_x, src_y, 0xFFFFFFFF);
+              BlitOptions blit_options;
+              blit_options.mode = BlitMode::MASKED;
+              blit_options.transparent_color = 0xFFFFFFFF;
+              blit_pixels(result, *sprite_pict, sprite.x, sprite.y, src_w, src_h,
+                  src_x, src_y, blit_options);
             }
           }
           render_text_as_unknown = !sprite_def || !sprite_pict_def;
@@ -1827,12 +1829,10 @@ int main(int argc, char** argv) {
     }
 
     if (parallax_foreground_opacity > 0) {
-      shared_ptr<Image> pxmid_pict = decode_PICT_cached(
-          level->parallax_middle_pict_id,
-          backgrounds_cache, backgrounds);
+      shared_ptr<const Image> pxmid_pict = get_background_pict(level->parallax_middle_pict_id);
 
       if (pxmid_pict.get()) {
-        fprintf(stderr, "... (Level %hd) parallax foreground\n", level_id);
+        fprintf(log_stream, "... (Level %hd) parallax foreground\n", level_id);
         const uint64_t& a = parallax_foreground_opacity;
 
         ssize_t start_y = level->height * 32 - pxmid_pict->get_height();
@@ -1867,14 +1867,14 @@ int main(int argc, char** argv) {
     string result_filename = string_printf("%s_Level_%hd_%s.bmp",
         levels_filename.c_str(), level_id, sanitized_name.c_str());
     result.save(result_filename.c_str(), Image::Format::WINDOWS_BITMAP);
-    fprintf(stderr, "... (Level %hd) -> %s\n", level_id, result_filename.c_str());
-  }
+    fprintf(log_stream, "... (Level %hd) -> %s\n", level_id, result_filename.c_str());
+  });
 
   if (print_unused_pict_ids) {
     auto sprite_pict_ids = sprites.all_resources_of_type(RESOURCE_TYPE_PICT);
     sort(sprite_pict_ids.begin(), sprite_pict_ids.end());
     for (int16_t pict_id : sprite_pict_ids) {
-      if (!sprites_cache.count(pict_id)) {
+      if (!used_sprite_pict_ids.count(pict_id)) {
         fprintf(stderr, "sprite pict %hd UNUSED\n", pict_id);
       } else {
         fprintf(stderr, "sprite pict %hd used\n", pict_id);
@@ -1883,7 +1883,7 @@ int main(int argc, char** argv) {
     auto background_pict_ids = backgrounds.all_resources_of_type(RESOURCE_TYPE_PICT);
     sort(background_pict_ids.begin(), background_pict_ids.end());
     for (int16_t pict_id : background_pict_ids) {
-      if (!backgrounds_cache.count(pict_id)) {
+      if (!used_background_pict_ids.count(pict_id)) {
         fprintf(stderr, "background pict %hd UNUSED\n", pict_id);
       } else {
         fprintf(stderr, "background pict %hd used\n", pict_id);
@@ -3,60 +3,68 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include <atomic>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
-using namespace std;
+#include "Decompressors/Codecs.hh"
+#include "ParallelTasks.hh"
 
+using namespace std;
 
 
-string decompress_flashback_lzss(const string& data) {
-  StringReader r(data);
-  size_t decompressed_size = r.get_u32b();
 
-  StringWriter w;
-  while (w.size() < decompressed_size) {
-    uint8_t control_bits = r.get_u8();
-    for (size_t x = 0; (x < 8) && (w.size() < decompressed_size); x++) {
-      bool is_backreference = control_bits & 1;
-      control_bits >>= 1;
-      if (is_backreference) {
-        uint16_t args = r.get_u16b();
-        size_t offset = w.size() - ((args & 0x0FFF) + 1);
-        size_t count = ((args >> 12) & 0x000F) + 3;
-        fprintf(stderr, "[%zX => %zX/%zX] backreference %04hX (offset=%zu size=%zu)\n",
-            r.where() - 2, w.str().size(), decompressed_size, args, offset, count);
-        for (size_t x = 0; x < count; x++) {
-          w.put_u8(w.str().at(offset++));
-        }
-      } else {
-        uint8_t v = r.get_u8();
-        fprintf(stderr, "[%zX => %zX/%zX] literal %02hhX\n",
-            r.where() - 1, w.str().size(), decompressed_size, v);
-        w.put_u8(v);
-      }
+int main(int argc, char** argv) {
+  bool multi = false;
+  size_t num_threads = 0;
+  vector<const char*> filenames;
+  for (int x = 1; x < argc; x++) {
+    if (!strcmp(argv[x], "--multi")) {
+      multi = true;
+    } else if (!strncmp(argv[x], "--threads=", 10)) {
+      num_threads = strtoull(&argv[x][10], nullptr, 0);
+    } else {
+      filenames.emplace_back(argv[x]);
     }
   }
 
-  return w.str();
-}
-
-int main(int argc, char** argv) {
-  if (argc < 1 || argc > 3) {
+  if ((!multi && filenames.size() > 2) || (multi && filenames.empty())) {
     fprintf(stderr, "\
 Usage: flashback_decomp [input_filename [output_filename]]\n\
+       flashback_decomp --multi [--threads=N] input_filename [input_filename ...]\n\
 \n\
 If input_filename is omitted or is '-', read from stdin.\n\
 If output_filename is omitted, write to stdout.\n\
+\n\
+With --multi, each input file is decompressed to input_filename.dec. The files\n\
+are decompressed on N threads (by default, one per CPU core).\n\
 ");
     return 2;
   }
 
-  const char* input_filename = (argc > 1) ? argv[1] : nullptr;
-  const char* output_filename = (argc > 2) ? argv[2] : nullptr;
+  const auto& lzss = *find_codec("flashback-lzss");
+
+  if (multi) {
+    atomic<size_t> num_failed(0);
+    run_parallel_tasks(filenames.size(), num_threads, [&](size_t z, FILE* log) {
+      try {
+        string data = load_file(filenames[z]);
+        save_file(string(filenames[z]) + ".dec",
+            decompress_with_codec(lzss, data.data(), data.size()));
+      } catch (const exception& e) {
+        fprintf(log, "failed on %s: %s\n", filenames[z], e.what());
+        num_failed++;
+      }
+    });
+    return num_failed ? 1 : 0;
+  }
+
+  const char* input_filename = (filenames.size() > 0) ? filenames[0] : nullptr;
+  const char* output_filename = (filenames.size() > 1) ? filenames[1] : nullptr;
 
   string input_data;
   if (!input_filename || !strcmp(input_filename, "-")) {
@@ -65,7 +73,7 @@ If output_filename is omitted, write to stdout.\n\
     input_data = load_file(input_filename);
   }
 
-  string data_dec = decompress_flashback_lzss(input_data);
+  string data_dec = decompress_with_codec(lzss, input_data.data(), input_data.size());
 
   if (output_filename) {
     save_file(output_filename, data_dec);
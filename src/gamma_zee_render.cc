@@ -22,8 +22,8 @@ int main(int argc, char** argv) {
   const string game_filename = argv[1];
   const string levels_filename = argv[2];
 
-  ResourceFile game_rf(parse_resource_fork(load_file(game_filename + "/..namedfork/rsrc")));
-  ResourceFile levels_rf(parse_resource_fork(load_file(levels_filename + "/..namedfork/rsrc")));
+  ResourceFile game_rf(parse_resource_fork(make_shared<MappedFile>(game_filename + "/..namedfork/rsrc")));
+  ResourceFile levels_rf(parse_resource_fork(make_shared<MappedFile>(levels_filename + "/..namedfork/rsrc")));
 
   auto info_f = fopen_unique(levels_filename + "_info.txt", "wt");
 
@@ -10,6 +10,9 @@
 #include <stdexcept>
 #include <vector>
 
+#include "Blitter.hh"
+#include "DecodedImageCache.hh"
+#include "ParallelTasks.hh"
 #include "ResourceFile.hh"
 #include "IndexFormats/Formats.hh"
 #include "SpriteDecoders/Decoders.hh"
@@ -344,34 +347,6 @@ static const unordered_map<int16_t, SpriteDefinition> sprite_defs({
 
 
 
-static shared_ptr<Image> decode_PICT_with_transparency_cached(
-    int16_t id,
-    unordered_map<int16_t, shared_ptr<Image>>& cache,
-    ResourceFile& rf) {
-  try {
-    return cache.at(id);
-  } catch (const out_of_range&) {
-    try {
-      auto decode_result = rf.decode_PICT(id);
-      if (!decode_result.embedded_image_format.empty()) {
-        throw runtime_error(string_printf("PICT %hd is an embedded image", id));
-      }
-
-      // Convert white pixels to transparent pixels
-      decode_result.image.set_has_alpha(true);
-      decode_result.image.set_alpha_from_mask_color(0xFFFFFFFF);
-
-      auto emplace_ret = cache.emplace(id, new Image(move(decode_result.image)));
-      return emplace_ret.first->second;
-
-    } catch (const out_of_range&) {
-      return shared_ptr<Image>();
-    }
-  }
-}
-
-
-
 void print_usage() {
   fprintf(stderr, "\
 Usage: harry_render [options]\n\
@@ -393,7 +368,9 @@ Options:\n\
   --skip-render-sprites\n\
       Don\'t render sprites.\n\
   --print-unused-pict-ids\n\
-      When done, print the IDs of all the PICT resources that were not used.\n\n");
+      When done, print the IDs of all the PICT resources that were not used.\n\
+  --threads=N\n\
+      Render levels on N threads (0 means one thread per core; default 1).\n\n");
 }
 
 int main(int argc, char** argv) {
@@ -401,6 +378,7 @@ int main(int argc, char** argv) {
   uint8_t foreground_opacity = 0xFF;
   bool render_background_tiles = true;
   bool render_sprites = true;
+  size_t num_threads = 1;
 
   string levels_filename = "Episode 1";
   string sprites_filename = "Harry Graphics";
@@ -424,6 +402,8 @@ int main(int argc, char** argv) {
       render_background_tiles = false;
     } else if (!strcmp(argv[z], "--skip-render-sprites")) {
       render_sprites = false;
+    } else if (!strncmp(argv[z], "--threads=", 10)) {
+      num_threads = strtoull(&argv[z][10], nullptr, 0);
     } else {
       print_usage();
       throw invalid_argument(string_printf("invalid option: %s", argv[z]));
@@ -437,37 +417,49 @@ int main(int argc, char** argv) {
 
   string clut_data = load_file(clut_filename);
   auto clut = ResourceFile::decode_clut(clut_data.data(), clut_data.size());
+  ColorLUT clut_lut(clut);
 
   const string levels_resource_filename = levels_filename + "/..namedfork/rsrc";
   const string sprites_resource_filename = sprites_filename + "/..namedfork/rsrc";
 
-  ResourceFile levels(parse_resource_fork(load_file(levels_resource_filename.c_str())));
-  ResourceFile sprites(parse_resource_fork(load_file(sprites_resource_filename.c_str())));
+  ResourceFile levels(parse_resource_fork(make_shared<MappedFile>(levels_resource_filename.c_str())));
+  ResourceFile sprites(parse_resource_fork(make_shared<MappedFile>(sprites_resource_filename.c_str())));
 
   uint32_t level_resource_type = 0x486C766C; // Hlvl
   auto level_resources = levels.all_resources_of_type(level_resource_type);
   sort(level_resources.begin(), level_resources.end());
 
-  unordered_map<int16_t, shared_ptr<Image>> world_pict_cache;
-  unordered_map<int16_t, shared_ptr<Image>> sprites_cache;
+  DecodedImageCache image_cache;
 
+  vector<int16_t> target_level_ids;
   for (int16_t level_id : level_resources) {
-    if (!target_levels.empty() && !target_levels.count(level_id)) {
-      continue;
+    if (target_levels.empty() || target_levels.count(level_id)) {
+      target_level_ids.emplace_back(level_id);
     }
+  }
+
+  // Levels are rendered independently, so they can be rendered in parallel.
+  // The ResourceFiles aren't safe to modify from multiple threads, so load
+  // everything up front in that case.
+  if (num_threads != 1) {
+    levels.load_all_resources();
+    sprites.load_all_resources();
+  }
 
+  run_parallel_tasks(target_level_ids.size(), num_threads, [&](size_t level_index, FILE* log_stream) -> void {
+    int16_t level_id = target_level_ids[level_index];
     string level_data = levels.get_resource(level_resource_type, level_id)->data;
     const auto* level = reinterpret_cast<const HarryLevel*>(level_data.data());
 
     Image result(128 * 32, 128 * 32);
 
     if ((foreground_opacity != 0) || render_background_tiles) {
-      shared_ptr<Image> foreground_pict = level->foreground_pict_id ?
-          decode_PICT_with_transparency_cached(level->foreground_pict_id, world_pict_cache, levels) :
-          decode_PICT_with_transparency_cached(181, sprites_cache, sprites);
-      shared_ptr<Image> background_pict = level->background_pict_id ?
-          decode_PICT_with_transparency_cached(level->background_pict_id, world_pict_cache, levels) :
-          decode_PICT_with_transparency_cached(180, sprites_cache, sprites);
+      shared_ptr<const Image> foreground_pict = level->foreground_pict_id ?
+          image_cache.get_PICT(levels, level->foreground_pict_id, true) :
+          image_cache.get_PICT(sprites, 181, true);
+      shared_ptr<const Image> background_pict = level->background_pict_id ?
+          image_cache.get_PICT(levels, level->background_pict_id, true) :
+          image_cache.get_PICT(sprites, 180, true);
       for (size_t y = 0; y < 128; y++) {
         for (size_t x = 0; x < 128; x++) {
           if (render_background_tiles) {
@@ -479,7 +471,8 @@ int main(int argc, char** argv) {
                 result.draw_text(x * 32, y * 32, 0x000000FF, 0xFF0000FF,
                     "%02hhX/%02hhX", bg_tile.unknown, bg_tile.type);
               } else {
-                result.blit(*background_pict, x * 32, y * 32, 32, 32, src_x, src_y);
+                blit_pixels(result, *background_pict, x * 32, y * 32, 32, 32,
+                    src_x, src_y, BlitOptions());
               }
             }
             if (bg_tile.unknown && bg_tile.unknown != 0xFF) {
@@ -497,8 +490,11 @@ int main(int argc, char** argv) {
                 result.draw_text(x * 32, y * 32 + 10, 0x000000FF, 0xFF0000FF,
                     "%02hhX/%02hhX", fg_tile.unknown, fg_tile.type);
               } else {
-                result.blend_blit(*foreground_pict, x * 32, y * 32, 32, 32,
-                    src_x, src_y, foreground_opacity);
+                BlitOptions options;
+                options.mode = BlitMode::ALPHA;
+                options.opacity = foreground_opacity;
+                blit_pixels(result, *foreground_pict, x * 32, y * 32, 32, 32,
+                    src_x, src_y, options);
               }
             }
             if (fg_tile.unknown && fg_tile.unknown != 0xFF) {
@@ -526,25 +522,28 @@ int main(int argc, char** argv) {
           render_text_as_unknown = true;
         }
 
-        shared_ptr<Image> sprite_pict;
+        shared_ptr<const Image> sprite_pict;
         if (sprite_def && sprite_def->hrsp_id) {
-          try {
-            sprite_pict = sprites_cache.at(sprite_def->hrsp_id);
-          } catch (const out_of_range&) {
+          sprite_pict = image_cache.get(sprites, 0x48725370, sprite_def->hrsp_id, 0, // HrSp
+              [&]() -> shared_ptr<const Image> {
             try {
-              const auto& data = sprites.get_resource(0x48725370, sprite_def->hrsp_id)->data; // HrSp
-              sprite_pict.reset(new Image(decode_HrSp(data, clut)));
-              sprites_cache.emplace(sprite_def->hrsp_id, sprite_pict);
-            } catch (const out_of_range&) { }
-          }
+              const auto& data = sprites.get_resource(0x48725370, sprite_def->hrsp_id)->data;
+              auto ret = make_shared<Image>();
+              decode_HrSp_into(*ret, data, clut_lut);
+              return ret;
+            } catch (const out_of_range&) {
+              return nullptr;
+            }
+          });
         }
 
         int16_t sprite_x = sprite.x - 6;
         int16_t sprite_y = sprite.y - 6;
 
         if (sprite_pict.get()) {
-          result.blit(*sprite_pict, sprite_x, sprite_y,
-              sprite_pict->get_width(), sprite_pict->get_height(), 0, 0);
+          blit_pixels(result, *sprite_pict, sprite_x, sprite_y,
+              sprite_pict->get_width(), sprite_pict->get_height(), 0, 0,
+              BlitOptions());
         }
 
         if (render_text_as_unknown) {
@@ -590,8 +589,8 @@ int main(int argc, char** argv) {
     string result_filename = string_printf("Harry_Level_%" PRId16 "_%s.bmp",
         level_id, sanitized_name.c_str());
     result.save(result_filename.c_str(), Image::Format::WINDOWS_BITMAP);
-    fprintf(stderr, "... %s\n", result_filename.c_str());
-  }
+    fprintf(log_stream, "... %s\n", result_filename.c_str());
+  });
 
   return 0;
 }
@@ -7,6 +7,7 @@
 #include <sys/types.h>
 
 #include <exception>
+#include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
@@ -15,21 +16,25 @@
 #include <vector>
 
 #include "IndexFormats/Formats.hh"
+#include "MappedFile.hh"
+#include "PackBits.hh"
+#include "ParallelTasks.hh"
 #include "ResourceFile.hh"
 
 using namespace std;
 
 
 
-void print_extra_data(StringReader& r, size_t end_offset, const char* what) {
+void print_extra_data(StringReader& r, size_t end_offset, const char* what,
+    FILE* log_stream) {
   size_t offset = r.where();
   if (offset > end_offset) {
     throw runtime_error(string_printf("%s parsing extended beyond end", what));
   } else if (offset < end_offset) {
     string extra_data = r.read(end_offset - offset);
     if (extra_data.find_first_not_of('\0') != string::npos) {
-      fprintf(stderr, "warning: extra data after %s ignored:\n", what);
-      print_data(stderr, extra_data, offset);
+      fprintf(log_stream, "warning: extra data after %s ignored:\n", what);
+      print_data(log_stream, extra_data, offset);
     }
   }
 }
@@ -45,8 +50,7 @@ string get_cstr_pad(StringReader& r) {
 
 string trim_and_decode(const string& src) {
   size_t zero_pos = src.find('\0');
-  string ret = (zero_pos != string::npos) ? src.substr(0, zero_pos) : src;
-  return decode_mac_roman(ret);
+  return decode_mac_roman(src.data(), (zero_pos != string::npos) ? zero_pos : src.size());
 }
 
 bool format_is_v2(uint32_t format) {
@@ -56,7 +60,7 @@ bool format_is_v2(uint32_t format) {
   return (format >= 9);
 }
 
-string autoformat_hypertalk(const string& src) {
+string autoformat_hypertalk(const string& src, FILE* log_stream) {
   vector<string> lines = split(src, '\n');
 
   // First, eliminate all continuation characters by combining lines
@@ -154,7 +158,7 @@ string autoformat_hypertalk(const string& src) {
           if (indent >= 2) {
             indent -= 2;
           } else {
-            fprintf(stderr, "warning: autoformatting attempted to unindent past zero on line %zu\n",
+            fprintf(log_stream, "warning: autoformatting attempted to unindent past zero on line %zu\n",
                 line_num + 1);
           }
         }
@@ -207,7 +211,8 @@ struct OSAScriptData {
   }
 };
 
-void print_formatted_script(FILE* f, const string& script, const OSAScriptData& osa_script_data) {
+void print_formatted_script(FILE* f, const string& script,
+    const OSAScriptData& osa_script_data, FILE* log_stream) {
     string extra_header_data;
   if (script.empty()) {
     if (!osa_script_data.extra_header_data.empty()) {
@@ -233,7 +238,7 @@ void print_formatted_script(FILE* f, const string& script, const OSAScriptData&
 
   } else {
     fprintf(f, "----- HyperTalk script -----\n");
-    string formatted_script = autoformat_hypertalk(script);
+    string formatted_script = autoformat_hypertalk(script, log_stream);
     fwritex(f, formatted_script);
   }
 }
@@ -597,7 +602,7 @@ struct CardOrBackgroundBlock {
     OSAScriptData osa_script_data;
     // Format ends with a padding byte if needed to make the size even
 
-    PartEntry(StringReader& r) {
+    PartEntry(StringReader& r, FILE* log_stream) {
       // This format appears to be the same in v1 and v2
       size_t start_offset = r.where();
       // Format exactly matches the struct above
@@ -627,7 +632,7 @@ struct CardOrBackgroundBlock {
         throw runtime_error("alignment byte after part script is not zero");
       }
       // TODO: parse OSA script if present
-      print_extra_data(r, start_offset + this->entry_size, "part entry");
+      print_extra_data(r, start_offset + this->entry_size, "part entry", log_stream);
     }
   };
 
@@ -703,7 +708,7 @@ struct CardOrBackgroundBlock {
   string script;
   OSAScriptData osa_script_data;
 
-  CardOrBackgroundBlock(StringReader& r, uint32_t stack_format) {
+  CardOrBackgroundBlock(StringReader& r, uint32_t stack_format, FILE* log_stream) {
     bool is_v2 = format_is_v2(stack_format);
 
     size_t start_offset = r.where();
@@ -750,7 +755,7 @@ struct CardOrBackgroundBlock {
     uint16_t parts_contents_count = r.get_u16b();
     r.skip(4);
     for (size_t x = 0; x < parts_count; x++) {
-      this->parts.emplace_back(r);
+      this->parts.emplace_back(r, log_stream);
     }
     for (size_t x = 0; x < parts_contents_count; x++) {
       if (is_v2) {
@@ -881,22 +886,43 @@ struct BitmapBlock {
     size_t expanded_bounds_right = ((bounds.x2 + 31) & (~31));
     size_t row_length_bits = expanded_bounds_right - expanded_bounds_left;
     size_t row_length_bytes = row_length_bits >> 3;
-    string data;
+    size_t image_w = expanded_bounds_right - expanded_bounds_left;
+    size_t image_h = bounds.y2 - bounds.y1;
+    size_t image_bits = image_w * image_h;
+    if (image_bits & 3) {
+      throw logic_error("image bits is not divisible by 8");
+    }
+    size_t image_bytes = image_bits >> 3;
 
+    // The output buffer is allocated at its final size; pos is the number of
+    // bytes produced so far. Everything after pos is still zero, so zero runs
+    // only have to advance pos.
+    string data(image_bytes, '\0');
+    size_t pos = 0;
+    auto throw_incorrect_size = [&](size_t produced) {
+      throw runtime_error(string_printf(
+          "decompression produced an incorrect amount of data (%zu bytes produced, (%zu * %zu >> 3) = %zu bytes expected)",
+          produced, image_w, image_h, image_bytes));
+    };
+    auto check_space = [&](size_t bytes) {
+      if (bytes > image_bytes - pos) {
+        throw_incorrect_size(pos + bytes);
+      }
+    };
 
     uint8_t dh = 0, dv = 0;
     auto apply_dh_dv_transform_if_row_end = [&]() {
       // If we aren't at the end of a row or the dh/dv transform would do
       // nothing, then do nothing
-      if ((data.size() % row_length_bytes) || ((dh == 0) && (dv == 0))) {
+      if ((pos % row_length_bytes) || ((dh == 0) && (dv == 0))) {
         return;
       }
 
-      string row = data.substr(data.size() - row_length_bytes);
+      string row = data.substr(pos - row_length_bytes, row_length_bytes);
       string xor_row(row_length_bytes, '\0');
 
       if (dh) {
-        string xor_row = data.substr(data.size() - row_length_bytes);
+        string xor_row = data.substr(pos - row_length_bytes, row_length_bytes);
         for (size_t z = row_length_bits / dh; z > 0; z--) {
           xor_row >>= dh;
           row ^= xor_row;
@@ -905,25 +931,42 @@ struct BitmapBlock {
       if (dv) {
         // Some BMAPs set dv to a nonzero value on the very first row. I assume
         // this just means to not do the dv transform for the first row(s)
-        if (data.size() >= (1 + dv) * row_length_bytes) {
-          row ^= data.substr(data.size() - (1 + dv) * row_length_bytes, row_length_bytes);
+        if (pos >= (1 + dv) * row_length_bytes) {
+          row ^= data.substr(pos - (1 + dv) * row_length_bytes, row_length_bytes);
         }
       }
 
-      memcpy(data.data() + data.size() - row_length_bytes,
+      memcpy(data.data() + pos - row_length_bytes,
           row.data(),
           row_length_bytes);
     };
 
-    uint8_t row_memo_bytes[8] = {0xAA, 0x55, 0xAA, 0x55, 0xAA, 0x55, 0xAA, 0x55};
+    // Writes count zero bytes (if src is null) or count bytes from src. The
+    // span is split at row boundaries, since the dh/dv transform has to be
+    // applied to each row as soon as it's complete.
+    auto write_span = [&](const uint8_t* src, size_t count) {
+      check_space(count);
+      while (count) {
+        size_t chunk = row_length_bytes - (pos % row_length_bytes);
+        if (chunk > count) {
+          chunk = count;
+        }
+        if (src) {
+          copy_literal_run(reinterpret_cast<uint8_t*>(data.data() + pos), src, chunk);
+          src += chunk;
+        }
+        pos += chunk;
+        count -= chunk;
+        apply_dh_dv_transform_if_row_end();
+      }
+    };
+    auto fill_row = [&](uint8_t value) {
+      check_space(row_length_bytes);
+      memset(data.data() + pos, value, row_length_bytes);
+      pos += row_length_bytes;
+    };
 
-    size_t image_w = expanded_bounds_right - expanded_bounds_left;
-    size_t image_h = bounds.y2 - bounds.y1;
-    size_t image_bits = image_w * image_h;
-    if (image_bits & 3) {
-      throw logic_error("image bits is not divisible by 8");
-    }
-    size_t image_bytes = image_bits >> 3;
+    uint8_t row_memo_bytes[8] = {0xAA, 0x55, 0xAA, 0x55, 0xAA, 0x55, 0xAA, 0x55};
 
     StringReader r(compressed_data.data(), compressed_data.size());
     size_t repeat_count = 1;
@@ -931,55 +974,54 @@ struct BitmapBlock {
     // Note: It looks like sometimes there are extra bytes at the end of a BMAP
     // stream. The actual image should always end on an opcode boundary, so we
     // just stop early if we've produced enough bytes.
-    while (!r.eof() && data.size() < image_bytes) {
+    while (!r.eof() && pos < image_bytes) {
       uint8_t opcode = r.get_u8();
       for (; repeat_count > 0; repeat_count--) {
         if (opcode < 0x80) { // 00-7F: zero bytes followed by data bytes
-          for (size_t z = 0; z < (opcode & 0x0F); z++) {
-            data += '\0';
-            apply_dh_dv_transform_if_row_end();
-          }
-          for (size_t z = 0; z < ((opcode >> 4) & 0x07); z++) {
-            data += r.get_u8();
-            apply_dh_dv_transform_if_row_end();
-          }
+          write_span(nullptr, opcode & 0x0F);
+          size_t data_bytes = (opcode >> 4) & 0x07;
+          write_span(reinterpret_cast<const uint8_t*>(r.getv(data_bytes)), data_bytes);
 
         } else if (opcode < 0x90) {
           // These opcodes end the row even if the current position isn't at the end
-          if (data.size() % row_length_bytes) {
-            data.resize(data.size() + (row_length_bytes - (data.size() % row_length_bytes)), '\0');
+          if (pos % row_length_bytes) {
+            pos += row_length_bytes - (pos % row_length_bytes);
             apply_dh_dv_transform_if_row_end();
           }
           // Note: The 80-family intentionally do not trigger the dh/dv transform
           switch (opcode) {
             case 0x80: // one uncompressed row
-              data += r.read(row_length_bytes);
+              check_space(row_length_bytes);
+              copy_literal_run(reinterpret_cast<uint8_t*>(data.data() + pos),
+                  reinterpret_cast<const uint8_t*>(r.getv(row_length_bytes)),
+                  row_length_bytes);
+              pos += row_length_bytes;
               break;
             case 0x81: // one white row
-              data.resize(data.size() + row_length_bytes, 0x00);
+              fill_row(0x00);
               break;
             case 0x82: // one black row
-              data.resize(data.size() + row_length_bytes, 0xFF);
+              fill_row(0xFF);
               break;
             case 0x83: { // one row filled with a specific byte
               uint8_t value = r.get_u8();
-              row_memo_bytes[(data.size() / row_length_bytes) % 8] = value;
-              data.resize(data.size() + row_length_bytes, value);
+              row_memo_bytes[(pos / row_length_bytes) % 8] = value;
+              fill_row(value);
               break;
             }
-            case 0x84: { // like 83, but use a previous value
-              uint8_t value = row_memo_bytes[(data.size() / row_length_bytes) % 8];
-              data.resize(data.size() + row_length_bytes, value);
+            case 0x84: // like 83, but use a previous value
+              fill_row(row_memo_bytes[(pos / row_length_bytes) % 8]);
               break;
-            }
             case 0x85: // copy the row above
             case 0x86: // copy the second row above
             case 0x87: { // copy the third row above
               uint8_t dy = opcode - 0x84;
-              if (data.size() < dy * row_length_bytes) {
+              if (pos < dy * row_length_bytes) {
                 throw runtime_error("backreference beyond beginning of output");
               }
-              data.append(data.data() + data.size() - dy * row_length_bytes, row_length_bytes);
+              check_space(row_length_bytes);
+              memcpy(data.data() + pos, data.data() + pos - dy * row_length_bytes, row_length_bytes);
+              pos += row_length_bytes;
               break;
             }
 
@@ -1031,27 +1073,18 @@ struct BitmapBlock {
 
         } else if (opcode < 0xE0) { // (opcode & 0x1F) << 3 data bytes
           size_t count = (opcode & 0x1F) << 3;
-          for (size_t z = 0; z < count; z++) {
-            data += r.get_u8();
-            apply_dh_dv_transform_if_row_end();
-          }
+          write_span(reinterpret_cast<const uint8_t*>(r.getv(count)), count);
 
         } else { // (opcode & 0x1F) << 4 zero bytes
-          size_t count = (opcode & 0x1F) << 4;
-          for (size_t z = 0; z < count; z++) {
-            data += '\0';
-            apply_dh_dv_transform_if_row_end();
-          }
+          write_span(nullptr, (opcode & 0x1F) << 4);
         }
       }
       repeat_count = next_repeat_count;
       next_repeat_count = 1;
     }
 
-    if (data.size() != image_bytes) {
-      throw runtime_error(string_printf(
-          "decompression produced an incorrect amount of data (%zu bytes produced, (%zu * %zu >> 3) = %zu bytes expected)",
-          data.size(), image_w, image_h, image_bytes));
+    if (pos != image_bytes) {
+      throw_incorrect_size(pos);
     }
 
     // TODO: We should trim the left/right edges of the image here
@@ -1120,6 +1153,10 @@ Options:\n\
       In this mode, bitmaps are skipped, and instead a PICT (from one of the\n\
       resource files) is rendered in each card image. The PICT ID is given by\n\
       a part contents entry in the card.\n\
+  --threads=N\n\
+      Decode and disassemble blocks on N threads (0 means one thread per\n\
+      core). The output files and log are the same regardless of the number\n\
+      of threads used. The default is 1.\n\
 \n");
 }
 
@@ -1131,6 +1168,7 @@ int main(int argc, char** argv) {
   bool render_card_parts = true;
   bool render_bitmap = true;
   const char* manhole_res_directory = nullptr;
+  size_t num_threads = 1;
   for (int x = 1; x < argc; x++) {
     if (!strcmp(argv[x], "--dump-raw-blocks")) {
       dump_raw_blocks = true;
@@ -1142,6 +1180,8 @@ int main(int argc, char** argv) {
       render_bitmap = false;
     } else if (!strncmp(argv[x], "--manhole-res-directory=", 24)) {
       manhole_res_directory = &argv[x][24];
+    } else if (!strncmp(argv[x], "--threads=", 10)) {
+      num_threads = strtoull(&argv[x][10], nullptr, 0);
     } else if (filename.empty()) {
       filename = argv[x];
     } else if (out_dir.empty()) {
@@ -1169,7 +1209,7 @@ int main(int argc, char** argv) {
       for (const string& filename : list_directory(dir)) {
         string file_path = dir + "/" + filename;
         if (isfile(file_path)) {
-          manhole_rfs.emplace_back(parse_resource_fork(load_file(file_path + "/..namedfork/rsrc")));
+          manhole_rfs.emplace_back(parse_resource_fork(make_shared<MappedFile>(file_path + "/..namedfork/rsrc")));
           fprintf(stderr, "added manhole resource file: %s\n", file_path.c_str());
         } else if (isdir(file_path)) {
           dirs_to_process.emplace(file_path);
@@ -1183,14 +1223,22 @@ int main(int argc, char** argv) {
   }
   mkdir(out_dir.c_str(), 0777);
 
-  string data = load_file(filename);
+  MappedFile data(filename);
   StringReader r(data.data(), data.size());
   uint32_t stack_format = 0;
 
+  // The first pass only finds the blocks (and parses the stack block, since
+  // the other blocks' formats depend on it); the card, background, and bitmap
+  // blocks are decoded afterward, possibly in parallel
+  struct BlockLocation {
+    size_t offset;
+    size_t end_offset;
+    uint32_t type;
+    int32_t id;
+    uint32_t stack_format;
+  };
   shared_ptr<StackBlock> stack;
-  unordered_map<uint32_t, BitmapBlock> bitmaps;
-  unordered_map<uint32_t, CardOrBackgroundBlock> backgrounds;
-  unordered_map<uint32_t, CardOrBackgroundBlock> cards;
+  vector<BlockLocation> block_locations;
   while (!r.eof()) {
     size_t block_offset = r.where();
     const BlockHeader& header = r.get<BlockHeader>(false);
@@ -1200,6 +1248,13 @@ int main(int argc, char** argv) {
     // needed.
     int32_t block_id = header.id;
 
+    if (header.size < sizeof(BlockHeader)) {
+      throw runtime_error("block is smaller than header");
+    }
+    if (block_end > r.size()) {
+      throw runtime_error("block extends beyond end of file");
+    }
+
     if (dump_raw_blocks) {
       string type_str = string_for_resource_type(header.type);
       string data = r.read(header.size);
@@ -1207,38 +1262,68 @@ int main(int argc, char** argv) {
           type_str.c_str(), block_id, block_offset);
       save_file(output_filename, data);
       fprintf(stderr, "... %s\n", output_filename.c_str());
+      r.go(block_offset);
     }
 
     switch (header.type) {
       case 0x5354414B: // STAK
         stack.reset(new StackBlock(r));
         stack_format = stack->format;
+        print_extra_data(r, block_end, "block", stderr);
         break;
       case 0x424B4744: // BKGD
-        backgrounds.emplace(piecewise_construct, make_tuple(block_id),
-            forward_as_tuple(r, stack_format));
-        break;
       case 0x43415244: // CARD
-        cards.emplace(piecewise_construct, make_tuple(block_id),
-            forward_as_tuple(r, stack_format));
-        break;
       case 0x424D4150: // BMAP
-        bitmaps.emplace(piecewise_construct, make_tuple(block_id),
-            forward_as_tuple(r, stack_format));
+        block_locations.emplace_back(BlockLocation{
+            block_offset, block_end, header.type, block_id, stack_format});
+        r.go(block_end);
         break;
 
       default:
         fprintf(stderr, "warning: skipping unknown block at %08zX size: %08X type: %08X (%.4s) id: %08X (%d)\n",
             r.where(), header.size.load(), header.type.load(),
             reinterpret_cast<const char*>(&header.type), block_id, block_id);
-
-        if (header.size < sizeof(BlockHeader)) {
-          throw runtime_error("block is smaller than header");
-        }
         r.go(block_end);
     }
+  }
 
-    print_extra_data(r, block_end, "block");
+  vector<unique_ptr<BitmapBlock>> decoded_bitmaps(block_locations.size());
+  vector<unique_ptr<CardOrBackgroundBlock>> decoded_blocks(block_locations.size());
+  run_parallel_tasks(block_locations.size(), num_threads, [&](size_t z, FILE* log_stream) -> void {
+    const auto& loc = block_locations[z];
+    StringReader block_r(data.data(), data.size());
+    block_r.go(loc.offset);
+    if (loc.type == 0x424D4150) { // BMAP
+      decoded_bitmaps[z].reset(new BitmapBlock(block_r, loc.stack_format));
+    } else {
+      decoded_blocks[z].reset(new CardOrBackgroundBlock(block_r, loc.stack_format, log_stream));
+    }
+    print_extra_data(block_r, loc.end_offset, "block", log_stream);
+  });
+
+  // If multiple blocks have the same type and ID, the first one is used. The
+  // outputs are generated in file order so they don't depend on hashing.
+  unordered_map<uint32_t, const BitmapBlock*> bitmaps;
+  unordered_map<uint32_t, const CardOrBackgroundBlock*> backgrounds;
+  unordered_map<uint32_t, const CardOrBackgroundBlock*> cards;
+  vector<pair<int32_t, const BitmapBlock*>> ordered_bitmaps;
+  vector<const CardOrBackgroundBlock*> ordered_backgrounds;
+  vector<const CardOrBackgroundBlock*> ordered_cards;
+  for (size_t z = 0; z < block_locations.size(); z++) {
+    const auto& loc = block_locations[z];
+    if (loc.type == 0x424D4150) { // BMAP
+      if (bitmaps.emplace(loc.id, decoded_bitmaps[z].get()).second) {
+        ordered_bitmaps.emplace_back(loc.id, decoded_bitmaps[z].get());
+      }
+    } else if (loc.type == 0x424B4744) { // BKGD
+      if (backgrounds.emplace(loc.id, decoded_blocks[z].get()).second) {
+        ordered_backgrounds.emplace_back(decoded_blocks[z].get());
+      }
+    } else {
+      if (cards.emplace(loc.id, decoded_blocks[z].get()).second) {
+        ordered_cards.emplace_back(decoded_blocks[z].get());
+      }
+    }
   }
 
   // Disassemble stack block
@@ -1284,29 +1369,31 @@ int main(int argc, char** argv) {
       fprintf(f.get(), "-- patterns[%zu]: 0x%016" PRIX64 "\n", x, stack->patterns[x]);
     }
     fprintf(f.get(), "-- checksum: 0x%X\n", stack->checksum);
-    print_formatted_script(f.get(), stack->script, stack->osa_script_data);
+    print_formatted_script(f.get(), stack->script, stack->osa_script_data, stderr);
     fprintf(stderr, "... %s\n", disassembly_filename.c_str());
   }
 
   // Disassemble bitmap blocks
-  for (const auto& bitmap_it : bitmaps) {
-    int32_t id = bitmap_it.first;
-    const auto& bmap = bitmap_it.second;
-
+  auto disassemble_bitmap = [&](int32_t id, const BitmapBlock& bmap, FILE* log_stream) {
     string filename = string_printf("%s/bitmap_%d.bmp", out_dir.c_str(), id);
     bmap.image.save(filename, Image::Format::WINDOWS_BITMAP);
-    fprintf(stderr, "... %s\n", filename.c_str());
+    fprintf(log_stream, "... %s\n", filename.c_str());
 
     if (bmap.mask_mode == BitmapBlock::MaskMode::PRESENT) {
       string filename = string_printf("%s/bitmap_%d_mask.bmp", out_dir.c_str(), id);
       bmap.mask.save(filename, Image::Format::WINDOWS_BITMAP);
-      fprintf(stderr, "... %s\n", filename.c_str());
+      fprintf(log_stream, "... %s\n", filename.c_str());
     }
-  }
+  };
 
   // Disassemble card and background blocks
   {
-    auto disassemble_block = [&](const CardOrBackgroundBlock& block) {
+    // The Manhole's PICTs are shared between cards, so they're decoded at most
+    // once. This cache is shared between all threads.
+    unordered_map<int16_t, Image> picts_cache;
+    mutex picts_cache_lock;
+
+    auto disassemble_block = [&](const CardOrBackgroundBlock& block, FILE* log_stream) {
       bool is_card = block.header.type == 0x43415244;
       string render_img_filename = string_printf("%s/%s_%d_render.bmp",
           out_dir.c_str(), is_card ? "card" : "background", block.header.id.load());
@@ -1320,22 +1407,22 @@ int main(int argc, char** argv) {
       const BitmapBlock* background_bmap = nullptr;
       if (block.bmap_block_id) {
         try {
-          bmap = &bitmaps.at(block.bmap_block_id);
+          bmap = bitmaps.at(block.bmap_block_id);
         } catch (const out_of_range&) {
-          fprintf(stderr, "warning: could not look up bitmap %d\n", block.bmap_block_id);
+          fprintf(log_stream, "warning: could not look up bitmap %d\n", block.bmap_block_id);
         }
       }
       if (block.background_id) {
         try {
-          background = &backgrounds.at(block.background_id);
+          background = backgrounds.at(block.background_id);
         } catch (const out_of_range&) {
-          fprintf(stderr, "warning: could not look up background %d\n", block.background_id);
+          fprintf(log_stream, "warning: could not look up background %d\n", block.background_id);
         }
         if (background && background->bmap_block_id) {
           try {
-            background_bmap = &bitmaps.at(background->bmap_block_id);
+            background_bmap = bitmaps.at(background->bmap_block_id);
           } catch (const out_of_range&) {
-            fprintf(stderr, "warning: could not look up background bitmap %d\n", background->bmap_block_id);
+            fprintf(log_stream, "warning: could not look up background bitmap %d\n", background->bmap_block_id);
           }
         }
       }
@@ -1378,7 +1465,7 @@ int main(int argc, char** argv) {
               continue;
             }
 
-            static unordered_map<int16_t, Image> picts_cache;
+            lock_guard<mutex> g(picts_cache_lock);
             try {
               pict = &picts_cache.at(pict_id);
             } catch (const out_of_range&) { }
@@ -1401,7 +1488,7 @@ int main(int argc, char** argv) {
           }
 
           if (!pict) {
-            fprintf(stderr, "warning: no valid PICT found for this card\n");
+            fprintf(log_stream, "warning: no valid PICT found for this card\n");
           } else {
             render_img.blit(*pict, 0, 0, pict->get_width(), pict->get_height(), 0, 0);
           }
@@ -1424,7 +1511,7 @@ int main(int argc, char** argv) {
       fprintf(f.get(), "-- flags: %04hX\n", block.flags);
       fprintf(f.get(), "-- background id: %d\n", block.background_id);
       fprintf(f.get(), "-- name: %s\n", block.name.c_str());
-      print_formatted_script(f.get(), block.script, block.osa_script_data);
+      print_formatted_script(f.get(), block.script, block.osa_script_data, log_stream);
 
       const uint32_t background_parts_render_color = 0x00FF00FF;
       const uint32_t card_parts_render_color = 0xFF0000FF;
@@ -1463,7 +1550,7 @@ int main(int argc, char** argv) {
         fprintf(f.get(), "-- style flags: %hu\n", part.style_flags);
         fprintf(f.get(), "-- line height: %hu\n", part.line_height);
         fprintf(f.get(), "-- part name: %s\n", part.name.c_str());
-        print_formatted_script(f.get(), part.script, part.osa_script_data);
+        print_formatted_script(f.get(), part.script, part.osa_script_data, log_stream);
       }
 
       for (const auto& part_contents : block.part_contents) {
@@ -1478,23 +1565,32 @@ int main(int argc, char** argv) {
         fwritex(f.get(), part_contents.text);
       }
 
-      fprintf(stderr, "... %s\n", disassembly_filename.c_str());
+      fprintf(log_stream, "... %s\n", disassembly_filename.c_str());
 
       // TODO: do something with OSA script data
       if (!card_w || !card_h) {
-        fprintf(stderr, "warning: could not determine card dimensions\n");
+        fprintf(log_stream, "warning: could not determine card dimensions\n");
       } else if (render_bitmap || render_background_parts || render_card_parts) {
         render_img.save(render_img_filename, Image::Format::WINDOWS_BITMAP);
-        fprintf(stderr, "... %s\n", render_img_filename.c_str());
+        fprintf(log_stream, "... %s\n", render_img_filename.c_str());
       }
     };
 
-    for (const auto& background_it : backgrounds) {
-      disassemble_block(background_it.second);
-    }
-    for (const auto& card_it : cards) {
-      disassemble_block(card_it.second);
-    }
+    // Bitmaps are written first, then backgrounds, then cards
+    size_t num_outputs = ordered_bitmaps.size() + ordered_backgrounds.size() + ordered_cards.size();
+    run_parallel_tasks(num_outputs, num_threads, [&](size_t z, FILE* log_stream) -> void {
+      if (z < ordered_bitmaps.size()) {
+        const auto& it = ordered_bitmaps[z];
+        disassemble_bitmap(it.first, *it.second, log_stream);
+        return;
+      }
+      z -= ordered_bitmaps.size();
+      if (z < ordered_backgrounds.size()) {
+        disassemble_block(*ordered_backgrounds[z], log_stream);
+      } else {
+        disassemble_block(*ordered_cards[z - ordered_backgrounds.size()], log_stream);
+      }
+    });
   }
 
   return 0;
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include <algorithm>
+#include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
@@ -10,6 +11,8 @@
 #include <stdexcept>
 #include <vector>
 
+#include "Blitter.hh"
+#include "ParallelTasks.hh"
 #include "ResourceFile.hh"
 #include "IndexFormats/Formats.hh"
 #include "SpriteDecoders/Decoders.hh"
@@ -193,6 +196,8 @@ Options:\n\
       Draw normal tiles with this opacity (0-255; default 255).\n\
   --object-opacity=N\n\
       Draw objects with this opacity (0-255; default 255).\n\
+  --threads=N\n\
+      Render levels on N threads (0 means one thread per core; default 1).\n\
 \n");
 }
 
@@ -208,6 +213,7 @@ int main(int argc, char** argv) {
   uint8_t object_opacity = 0xFF;
   bool show_unused_images = false;
   bool use_shpd_v2 = false;
+  size_t num_threads = 1;
   for (int z = 1; z < argc; z++) {
     if (!strcmp(argv[z], "--help") || !strcmp(argv[z], "-h")) {
       print_usage();
@@ -234,6 +240,8 @@ int main(int argc, char** argv) {
       tile_opacity = strtoul(&argv[z][15], nullptr, 0);
     } else if (!strncmp(argv[z], "--object-opacity=", 17)) {
       object_opacity = strtoul(&argv[z][17], nullptr, 0);
+    } else if (!strncmp(argv[z], "--threads=", 10)) {
+      num_threads = strtoull(&argv[z][10], nullptr, 0);
     } else {
       print_usage();
       throw invalid_argument(string_printf("invalid option: %s", argv[z]));
@@ -251,7 +259,7 @@ int main(int argc, char** argv) {
   }
 
   const string levels_resource_filename = levels_filename + "/..namedfork/rsrc";
-  ResourceFile levels(parse_resource_fork(load_file(levels_resource_filename.c_str())));
+  ResourceFile levels(parse_resource_fork(make_shared<MappedFile>(levels_resource_filename.c_str())));
 
   string graphics_rsf_contents = load_file(graphics_filename + "/..namedfork/rsrc");
   string graphics_df_contents = load_file(graphics_filename);
@@ -264,18 +272,33 @@ int main(int argc, char** argv) {
   auto level_resources = levels.all_resources_of_type(level_resource_type);
   sort(level_resources.begin(), level_resources.end());
 
-  vector<vector<LemmingsObjectDefinition>> object_defs_cache;
+  // There are at most 6 ground types, so this is never resized, and the
+  // references to its entries remain valid while other threads fill it in
+  mutex object_defs_cache_lock;
+  vector<vector<LemmingsObjectDefinition>> object_defs_cache(6);
+  mutex used_image_names_lock;
   unordered_set<string> used_erase_image_names;
   unordered_set<string> used_image_names;
 
+  vector<int16_t> target_level_ids;
   for (int16_t level_id : level_resources) {
-    if (!target_levels.empty() && !target_levels.count(level_id)) {
-      continue;
+    if (target_levels.empty() || target_levels.count(level_id)) {
+      target_level_ids.emplace_back(level_id);
     }
+  }
+
+  // Levels are rendered independently, so they can be rendered in parallel.
+  // The ResourceFiles aren't safe to modify from multiple threads, so load
+  // everything up front in that case.
+  if (num_threads != 1) {
+    levels.load_all_resources();
+  }
 
+  run_parallel_tasks(target_level_ids.size(), num_threads, [&](size_t level_index, FILE* log_stream) -> void {
+    int16_t level_id = target_level_ids[level_index];
     string level_data = levels.get_resource(level_resource_type, level_id)->data;
     if (level_data.size() != sizeof(LemmingsLevel)) {
-      print_data(stderr, level_data);
+      print_data(log_stream, level_data);
       throw runtime_error(string_printf(
           "level data size is incorrect: expected %zu bytes, received %zu bytes",
           sizeof(LemmingsLevel), level_data.size()));
@@ -285,25 +308,25 @@ int main(int argc, char** argv) {
       throw runtime_error("invalid ground type in level");
     }
 
-    if (object_defs_cache.size() <= level->ground_type) {
-      object_defs_cache.resize(level->ground_type + 1);
-    }
-    if (object_defs_cache[level->ground_type].empty()) {
-      constexpr uint32_t object_def_resource_type = 0x4F424A44; // OBJD
-      const string& data = levels.get_resource(object_def_resource_type, level->ground_type)->data;
-      if (data.size() % sizeof(LemmingsObjectDefinition)) {
-        throw runtime_error(string_printf(
-            "object definition list size is incorrect: expected a multiple of %zu bytes, received %zu bytes",
-            sizeof(LemmingsObjectDefinition), level_data.size()));
-      }
-      size_t count = data.size() / sizeof(LemmingsObjectDefinition);
+    {
+      lock_guard<mutex> g(object_defs_cache_lock);
+      if (object_defs_cache[level->ground_type].empty()) {
+        constexpr uint32_t object_def_resource_type = 0x4F424A44; // OBJD
+        const string& data = levels.get_resource(object_def_resource_type, level->ground_type)->data;
+        if (data.size() % sizeof(LemmingsObjectDefinition)) {
+          throw runtime_error(string_printf(
+              "object definition list size is incorrect: expected a multiple of %zu bytes, received %zu bytes",
+              sizeof(LemmingsObjectDefinition), level_data.size()));
+        }
+        size_t count = data.size() / sizeof(LemmingsObjectDefinition);
 
-      const auto* res_obj_defs = reinterpret_cast<const LemmingsObjectDefinition*>(data.data());
-      vector<LemmingsObjectDefinition> obj_defs;
-      while (obj_defs.size() < count) {
-        obj_defs.emplace_back(res_obj_defs[obj_defs.size()]);
+        const auto* res_obj_defs = reinterpret_cast<const LemmingsObjectDefinition*>(data.data());
+        vector<LemmingsObjectDefinition> obj_defs;
+        while (obj_defs.size() < count) {
+          obj_defs.emplace_back(res_obj_defs[obj_defs.size()]);
+        }
+        object_defs_cache[level->ground_type] = move(obj_defs);
       }
-      object_defs_cache[level->ground_type] = move(obj_defs);
     }
     const auto& obj_defs = object_defs_cache.at(level->ground_type);
 
@@ -318,9 +341,10 @@ int main(int argc, char** argv) {
       string img_name = string_printf("%d_Special%d_0",
           1699 + level->iff_number, level->iff_number - 1);
       if (show_unused_images) {
+        lock_guard<mutex> g(used_image_names_lock);
         used_image_names.emplace(img_name);
       }
-      auto img = shapes.at(img_name);
+      const auto& img = shapes.at(img_name);
       result.blit(img.image, (result.get_width() - img.image.get_width()) / 2 - 16, 0,
           img.image.get_width(), img.image.get_height(), 0, 0);
     }
@@ -340,6 +364,7 @@ int main(int argc, char** argv) {
         ssize_t orig_tile_y = tile.y();
 
         if (show_unused_images) {
+          lock_guard<mutex> g(used_image_names_lock);
           if (tile.erase()) {
             used_erase_image_names.emplace(tile_name);
           } else {
@@ -367,6 +392,9 @@ int main(int argc, char** argv) {
             ((!use_shpd_v2 && tile.vertical_reverse()) ? 0 : tile_img.origin_y);
 
         if (tile.background()) {
+          // Background tiles are blended with black rather than with what's
+          // already there, and keep their own alpha, so blit_pixels can't do
+          // this one
           result.custom_blit(*img_to_render, tile_x, tile_y,
               img_to_render->get_width(), img_to_render->get_height(), 0, 0,
               [&](uint32_t& dc, uint32_t sc) -> void {
@@ -383,13 +411,13 @@ int main(int argc, char** argv) {
                 }
               });
         } else {
-          result.custom_blit(*img_to_render, tile_x, tile_y,
+          BlitOptions options;
+          options.mode = BlitMode::ALPHA;
+          options.opacity = tile_opacity;
+          options.output_alpha = 0xFF;
+          blit_pixels(result, *img_to_render, tile_x, tile_y,
               img_to_render->get_width(), img_to_render->get_height(), 0, 0,
-              [&](uint32_t& dc, uint32_t sc) -> void {
-                if ((sc & 0x000000FF) != 0x00000000) {
-                  dc = alpha_blend(dc, (sc & 0xFFFFFF00) | 0x000000FF, tile_opacity);
-                }
-              });
+              options);
         }
 
         if (show_tile_ids) {
@@ -399,7 +427,7 @@ int main(int argc, char** argv) {
         }
 
       } catch (const exception& e) {
-        fprintf(stderr, "warning: cannot render tile %zu: %s\n", z, e.what());
+        fprintf(log_stream, "warning: cannot render tile %zu: %s\n", z, e.what());
       }
     }
 
@@ -420,6 +448,7 @@ int main(int argc, char** argv) {
       bool image_valid = true;
       try {
         if (show_unused_images) {
+          lock_guard<mutex> g(used_image_names_lock);
           used_image_names.emplace(img_name);
         }
         const auto& img = shapes.at(img_name);
@@ -427,28 +456,17 @@ int main(int argc, char** argv) {
         img_y += img.origin_y;
 
         auto draw_img_with_flags = [&](const Image& src, ssize_t x, ssize_t y) {
+          BlitOptions options;
+          options.mode = BlitMode::ALPHA;
+          options.opacity = object_opacity;
+          options.output_alpha = 0xE0;
           if (obj.draw_only_on_tiles()) {
-            result.custom_blit(src, x, y, src.get_width(), src.get_height(), 0, 0, 
-                [&](uint32_t& dc, uint32_t sc) -> void {
-                  if (((dc & 0x000000FF) == 0x000000FF) && ((sc & 0x000000FF) != 0x00000000)) {
-                    dc = alpha_blend(dc, (sc & 0xFFFFFF00) | 0x000000E0, object_opacity);
-                  }
-                });
+            options.dest_alpha_filter = 0xFF;
           } else if (obj.background()) {
-            result.custom_blit(src, x, y, src.get_width(), src.get_height(), 0, 0,
-                [&](uint32_t& dc, uint32_t sc) -> void {
-                  if (((dc & 0x000000FF) == 0x00000000) && ((sc & 0x000000FF) != 0x00000000)) {
-                    dc = alpha_blend(dc, (sc & 0xFFFFFF00) | 0x000000E0, object_opacity);
-                  }
-                });
-          } else {
-            result.custom_blit(src, x, y, src.get_width(), src.get_height(), 0, 0,
-                [&](uint32_t& dc, uint32_t sc) -> void {
-                  if ((sc & 0x000000FF) != 0x00000000) {
-                    dc = alpha_blend(dc, (sc & 0xFFFFFF00) | 0x000000E0, object_opacity);
-                  }
-                });
+            options.dest_alpha_filter = 0x00;
           }
+          blit_pixels(result, src, x, y, src.get_width(), src.get_height(), 0, 0,
+              options);
         };
         draw_img_with_flags(img.image, img_x, img_y);
 
@@ -461,6 +479,7 @@ int main(int argc, char** argv) {
 
           try {
             if (show_unused_images) {
+              lock_guard<mutex> g(used_image_names_lock);
               used_image_names.emplace(subimg_name);
             }
             const auto& subimg = shapes.at(subimg_name);
@@ -468,13 +487,13 @@ int main(int argc, char** argv) {
             ssize_t subimg_y = img_y + img.image.get_height();
             draw_img_with_flags(subimg.image, subimg_x, subimg_y);
           } catch (const out_of_range&) {
-            fprintf(stderr, "warning: missing object subimage %s\n", subimg_name.c_str());
+            fprintf(log_stream, "warning: missing object subimage %s\n", subimg_name.c_str());
             image_valid = false;
           }
         }
 
       } catch (const out_of_range&) {
-        fprintf(stderr, "warning: missing object image %s\n", img_name.c_str());
+        fprintf(log_stream, "warning: missing object image %s\n", img_name.c_str());
         image_valid = false;
       }
 
@@ -548,8 +567,8 @@ int main(int argc, char** argv) {
     string result_filename = string_printf("Lemmings_Level_%" PRId16 "_%s.bmp",
         level_id, sanitized_name.c_str());
     result.save(result_filename.c_str(), Image::Format::WINDOWS_BITMAP);
-    fprintf(stderr, "... %s\n", result_filename.c_str());
-  }
+    fprintf(log_stream, "... %s\n", result_filename.c_str());
+  });
 
   if (show_unused_images) {
     for (const auto& it : shapes) {
@@ -4,6 +4,7 @@
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
 #include <phosg/Strings.hh>
+#include <phosg/Time.hh>
 #include <stdexcept>
 
 #include "Emulators/X86Emulator.hh"
@@ -11,6 +12,7 @@
 #include "Emulators/PPC32Emulator.hh"
 #include "ExecutableFormats/PEFile.hh"
 #include "ExecutableFormats/DOLFile.hh"
+#include "ExecutableFormats/RELLinker.hh"
 
 using namespace std;
 
@@ -154,9 +156,18 @@ Memory setup options:\n\
       Loads the given DOL executable before starting emulation. Emulation\n\
       starts at the file\'s entrypoint by default, but this can be overridden\n\
       with the --pc option. Implies --ppc32, but this can also be overridden.\n\
+  --load-rel=FILENAME\n\
+      Loads the given REL module before starting emulation, and links it with\n\
+      the DOL and any other REL modules given. This option may be given\n\
+      multiple times. Modules are placed in free memory after the DOL, and\n\
+      their on_load, on_unload, and on_missing functions are added as symbols\n\
+      named after the file (e.g. for d_a_npc.rel, d_a_npc_on_load); they are\n\
+      not called automatically. Implies --ppc32.\n\
   --load-state=FILENAME\n\
-      Loads emulation state from the given file, saved with the savestate\n\
-      command in single-step mode. Note that state outside of the CPU engine\n\
+      Loads emulation state from the given file, saved with the savestate or\n\
+      saveimage command in single-step mode. (Image files saved with\n\
+      saveimage load much faster, since most of their memory contents are\n\
+      mapped directly from the file.) Note that state outside of the CPU engine\n\
       itself (for example, breakpoints and the step/trace flags) are not saved\n\
       in the state file, so they will not persist across save and load\n\
       operations. If this option is given, other options like --mem and --push\n\
@@ -179,11 +190,22 @@ Environment behavior options:\n\
       allocates entire pages at a time. This option adds an additional check\n\
       before each memory access to disallow access to the technically-\n\
       unallocated-but-otherwise-accessible space. It also slows down emulation.\n\
+  --direct-memory\n\
+      Maps the emulated address space directly into a reserved range of host\n\
+      address space, so the emulator can access memory without looking up or\n\
+      checking each address. This is faster, but m68kexec will crash (instead\n\
+      of stopping with an error) if the emulated CPU accesses unmapped memory.\n\
+      This option has no effect if --strict-memory is also given, and it\n\
+      requires a 64-bit host.\n\
 \n\
 Debugger options:\n\
   --break=ADDR\n\
   --breakpoint=ADDR\n\
       Switches to single-step mode when execution reaches this address.\n\
+  --break-if=ADDR:CONDITION\n\
+      Switches to single-step mode when execution reaches this address and\n\
+      CONDITION is nonzero. See the debugger's help (the \'h\' command) for the\n\
+      condition syntax.\n\
   --break-cycles=COUNT\n\
       Switches to single-step mode after this many instructions have executed.\n\
   --trace\n\
@@ -200,6 +222,11 @@ Debugger options:\n\
       output.\n\
   --no-memory-log\n\
       Suppresses all memory access messages in the trace and step output.\n\
+  --memory-trace=FILENAME\n\
+      Writes every memory access to FILENAME in a compact binary format, in\n\
+      any debugger mode (including when not tracing). Use memory_trace_dump\n\
+      to convert the file to the same text format as the trace output.\n\
+      Currently only x86 emulation logs memory accesses.\n\
 \n\
 Program analysis options:\n\
   --trace-data-sources\n\
@@ -212,6 +239,22 @@ Program analysis options:\n\
   --trace-data-source-addrs\n\
       Includes registers involved in effective address calculations in data\n\
       source traces. No effect unless --trace-data-sources is also used.\n\
+  --profile=FILENAME\n\
+      Samples the PC during emulation and records the number of calls to and\n\
+      time spent in each syscall. When emulation ends, writes the PC samples\n\
+      to FILENAME in folded-stack format (suitable for flamegraph.pl) and\n\
+      prints a summary to stderr.\n\
+  --profile-interval=N\n\
+      Samples the PC once every N instructions instead of on every\n\
+      instruction (N is decimal). No effect unless --profile is also used.\n\
+\n\
+Performance options:\n\
+  --jit\n\
+      Enables the JIT tier, which translates frequently-executed basic blocks\n\
+      into predecoded instruction lists so they run with less overhead. This is\n\
+      currently only implemented in M68K emulation. It has no effect if any\n\
+      debugger or profiling options are used, since those require checking\n\
+      the state before each instruction.\n\
 ");
 }
 
@@ -233,9 +276,10 @@ uint32_t load_pe(shared_ptr<MemoryContext> mem, const string& filename) {
   const auto& header = pe.unloaded_header();
   StringWriter stubs_w;
   unordered_map<uint32_t, uint32_t> addr_addr_to_stub_offset;
-  for (const auto& it : pe.labels_for_loaded_imports()) {
-    uint32_t addr_addr = it.first;
-    const string& name = it.second;
+  auto import_labels = pe.labels_for_loaded_imports();
+  for (const auto& it : import_labels) {
+    uint32_t addr_addr = it.addr;
+    const string& name = *it.name;
 
     addr_addr_to_stub_offset.emplace(addr_addr, stubs_w.size());
 
@@ -266,6 +310,36 @@ uint32_t load_dol(shared_ptr<MemoryContext> mem, const string& filename) {
   return dol.entrypoint;
 }
 
+uint32_t load_dol_and_rels(shared_ptr<MemoryContext> mem,
+    const char* dol_filename, const vector<const char*>& rel_filenames) {
+  RELLinker linker;
+  shared_ptr<DOLFile> dol;
+  if (dol_filename) {
+    dol = make_shared<DOLFile>(dol_filename);
+    linker.add_dol(dol);
+  }
+  for (const char* filename : rel_filenames) {
+    linker.add_module(make_shared<RELFile>(filename));
+  }
+
+  RELLinker::Options options;
+  auto stats = linker.link(mem, options);
+  for (const auto& module : linker.get_modules()) {
+    fprintf(stderr, "note: loaded REL module %08" PRIX32 " (%s)", module.module_id, module.name.c_str());
+    for (size_t z = 0; z < module.sections.size(); z++) {
+      if (module.sections[z].address) {
+        fprintf(stderr, " %zX:%08" PRIX32, z, module.sections[z].address);
+      }
+    }
+    fputc('\n', stderr);
+  }
+  fprintf(stderr, "note: linked %zu modules with %zu relocations (%zu unresolved) in %" PRIu64 " usecs (%" PRIu64 " usecs layout, %" PRIu64 " usecs relocation)\n",
+      stats.num_modules, stats.num_relocations, stats.num_unresolved_relocations,
+      stats.layout_usecs + stats.relocation_usecs, stats.layout_usecs, stats.relocation_usecs);
+
+  return dol ? dol->entrypoint : 0;
+}
+
 
 
 template <typename EmuT>
@@ -466,7 +540,16 @@ void set_trace_flags_t<X86Emulator>(
 
 template <typename EmuT>
 int main_t(int argc, char** argv) {
-  shared_ptr<MemoryContext> mem(new MemoryContext());
+  // The memory context has to be created before any of the other options are
+  // parsed, so look for this one first
+  bool direct_memory = false;
+  for (int x = 1; x < argc; x++) {
+    if (!strcmp(argv[x], "--direct-memory")) {
+      direct_memory = true;
+    }
+  }
+
+  shared_ptr<MemoryContext> mem(new MemoryContext(direct_memory));
   EmuT emu(mem);
   auto& regs = emu.registers();
 
@@ -478,11 +561,15 @@ int main_t(int argc, char** argv) {
   uint32_t pc = 0;
   const char* pe_filename = nullptr;
   const char* dol_filename = nullptr;
+  vector<const char*> rel_filenames;
   vector<SegmentDefinition> segment_defs;
   vector<uint32_t> values_to_push;
   unordered_map<uint32_t, string> patches;
   const char* state_filename = nullptr;
   bool enable_syscalls = true;
+  const char* profile_filename = nullptr;
+  uint64_t profile_interval = 1;
+  bool enable_jit = false;
   for (int x = 1; x < argc; x++) {
     if (!strncmp(argv[x], "--mem=", 6)) {
       segment_defs.emplace_back(parse_segment_definition(&argv[x][6]));
@@ -506,6 +593,8 @@ int main_t(int argc, char** argv) {
       pe_filename = &argv[x][10];
     } else if (!strncmp(argv[x], "--load-dol=", 11)) {
       dol_filename = &argv[x][11];
+    } else if (!strncmp(argv[x], "--load-rel=", 11)) {
+      rel_filenames.emplace_back(&argv[x][11]);
     } else if (!strncmp(argv[x], "--push=", 7)) {
       values_to_push.emplace_back(strtoul(&argv[x][7], nullptr, 16));
     } else if (!strncmp(argv[x], "--pc=", 5)) {
@@ -521,18 +610,28 @@ int main_t(int argc, char** argv) {
       debugger->state.print_state_headers = false;
     } else if (!strcmp(argv[x], "--no-memory-log")) {
       debugger->state.print_memory_accesses = false;
+    } else if (!strncmp(argv[x], "--memory-trace=", 15)) {
+      emu.set_memory_access_trace_file(&argv[x][15]);
     } else if (!strncmp(argv[x], "--load-state=", 13)) {
       state_filename = &argv[x][13];
     } else if (!strncmp(argv[x], "--break=", 8)) {
-      debugger->state.breakpoints.emplace(stoul(&argv[x][8], nullptr, 16));
+      debugger->state.add_breakpoint(stoul(&argv[x][8], nullptr, 16));
     } else if (!strncmp(argv[x], "--breakpoint=", 13)) {
-      debugger->state.breakpoints.emplace(stoul(&argv[x][13], nullptr, 16));
+      debugger->state.add_breakpoint(stoul(&argv[x][13], nullptr, 16));
+    } else if (!strncmp(argv[x], "--break-if=", 11)) {
+      const char* colon = strchr(&argv[x][11], ':');
+      if (!colon) {
+        throw invalid_argument("invalid conditional breakpoint definition");
+      }
+      debugger->state.add_breakpoint(stoul(&argv[x][11], nullptr, 16), colon + 1);
     } else if (!strncmp(argv[x], "--break-cycles=", 15)) {
-      debugger->state.cycle_breakpoints.emplace(stoul(&argv[x][15], nullptr, 16));
+      debugger->state.cycle_breakpoints.add(stoull(&argv[x][15], nullptr, 16));
     } else if (!strncmp(argv[x], "--max-cycles=", 13)) {
       debugger->state.max_cycles = stoull(&argv[x][13], nullptr, 16);
     } else if (!strcmp(argv[x], "--m68k") || !strcmp(argv[x], "--ppc32") || !strcmp(argv[x], "--x86")) {
       // These are handled in the calling function (main)
+    } else if (!strcmp(argv[x], "--direct-memory")) {
+      // This is handled above, before the memory context is created
     } else if (!strncmp(argv[x], "--behavior=", 11)) {
       emu.set_behavior_by_name(&argv[x][11]);
     } else if (!strncmp(argv[x], "--time-base=", 12)) {
@@ -551,8 +650,14 @@ int main_t(int argc, char** argv) {
       mem->set_strict(true);
     } else if (!strcmp(argv[x], "--trace-data-sources")) {
       trace_data_sources = true;
+    } else if (!strncmp(argv[x], "--profile=", 10)) {
+      profile_filename = &argv[x][10];
+    } else if (!strncmp(argv[x], "--profile-interval=", 19)) {
+      profile_interval = strtoull(&argv[x][19], nullptr, 10);
     } else if (!strcmp(argv[x], "--trace-data-source-addrs")) {
       trace_data_source_addrs = true;
+    } else if (!strcmp(argv[x], "--jit")) {
+      enable_jit = true;
     } else if (!strcmp(argv[x], "--trace")) {
       debugger->state.mode = DebuggerMode::TRACE;
     } else if (!strncmp(argv[x], "--periodic-trace=", 17)) {
@@ -565,19 +670,25 @@ int main_t(int argc, char** argv) {
     }
   }
 
-  if (segment_defs.empty() && !state_filename && !pe_filename && !dol_filename) {
+  if (segment_defs.empty() && !state_filename && !pe_filename && !dol_filename && rel_filenames.empty()) {
     print_usage();
     return 1;
   }
 
   if (state_filename) {
-    auto f = fopen_unique(state_filename, "rb");
-    emu.import_state(f.get());
+    if (MemoryContext::is_image_file(state_filename)) {
+      emu.import_image(state_filename);
+    } else {
+      auto f = fopen_unique(state_filename, "rb");
+      emu.import_state(f.get());
+    }
   }
 
   // Load executable if needed
   if (pe_filename) {
     regs.pc = load_pe(mem, pe_filename);
+  } else if (!rel_filenames.empty()) {
+    regs.pc = load_dol_and_rels(mem, dol_filename, rel_filenames);
   } else if (dol_filename) {
     regs.pc = load_dol(mem, dol_filename);
   }
@@ -667,9 +778,38 @@ int main_t(int argc, char** argv) {
     create_syscall_handler_t(emu, debugger);
   }
 
+  shared_ptr<ExecutionProfiler> profiler;
+  if (profile_filename) {
+    profiler.reset(new ExecutionProfiler(profile_interval));
+    emu.set_profiler(profiler);
+  }
+
+  // The debug hook slows down every instruction (and prevents the JIT tier
+  // from running), so it's only installed if any of its features are needed
+  debugger->unbind_if_not_needed();
+  if (enable_jit) {
+    if (debugger->bound_emu || profiler) {
+      fprintf(stderr, "warning: --jit has no effect when debugger or profiling options are used\n");
+    } else {
+      emu.set_jit_enabled(true);
+    }
+  }
+
   // Run it
   set_trace_flags_t(emu, trace_data_sources, trace_data_source_addrs);
+  uint64_t start_time = now();
   emu.execute();
+  uint64_t duration = now() - start_time;
+
+  if (profiler) {
+    auto f = fopen_unique(profile_filename, "wt");
+    profiler->write_folded_stacks(f.get(), emu);
+    profiler->print_summary(stderr, emu);
+  }
+
+  fprintf(stderr, "note: executed %" PRIu64 " instructions in %g seconds (%g instructions/sec)\n",
+      emu.cycles(), static_cast<double>(duration) / 1000000.0,
+      duration ? (static_cast<double>(emu.cycles()) * 1000000.0 / duration) : 0.0);
 
   return 0;
 }
@@ -693,7 +833,7 @@ int main(int argc, char** argv) {
       arch = Architecture::X86;
     } else if (!strncmp(argv[x], "--load-pe=", 10)) {
       arch = Architecture::X86;
-    } else if (!strncmp(argv[x], "--load-dol=", 11)) {
+    } else if (!strncmp(argv[x], "--load-dol=", 11) || !strncmp(argv[x], "--load-rel=", 11)) {
       arch = Architecture::PPC32;
     }
   }
@@ -0,0 +1,58 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <phosg/Filesystem.hh>
+#include <stdexcept>
+#include <string>
+
+#include "Emulators/MemoryAccessLog.hh"
+
+using namespace std;
+
+
+
+int main(int argc, char** argv) {
+  const char* input_filename = nullptr;
+  bool show_cycles = false;
+  for (int x = 1; x < argc; x++) {
+    if (!strcmp(argv[x], "--show-cycles")) {
+      show_cycles = true;
+    } else if (!input_filename) {
+      input_filename = argv[x];
+    } else {
+      fprintf(stderr, "excess argument: %s\n", argv[x]);
+      input_filename = nullptr;
+      break;
+    }
+  }
+
+  if (!input_filename) {
+    fprintf(stderr, "\
+Usage: memory_trace_dump [--show-cycles] trace_filename\n\
+\n\
+Converts a memory access trace written by m68kexec --memory-trace to text, in\n\
+the same format as m68kexec's trace output. If trace_filename is '-', reads\n\
+from stdin. With --show-cycles, each line is preceded by the cycle number at\n\
+which the access occurred.\n\
+");
+    return 2;
+  }
+
+  try {
+    unique_ptr<FILE, fclose_deleter> f;
+    if (strcmp(input_filename, "-")) {
+      f = fopen_unique(input_filename, "rb");
+    }
+    read_memory_access_trace(f ? f.get() : stdin, [&](const MemoryAccess& acc) {
+      if (show_cycles) {
+        fprintf(stdout, "%016" PRIX64, acc.cycle);
+      }
+      print_memory_access(stdout, acc);
+    });
+  } catch (const exception& e) {
+    fprintf(stderr, "failed: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
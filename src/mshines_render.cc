@@ -1,6 +1,8 @@
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
@@ -9,6 +11,7 @@
 #include <vector>
 
 #include "IndexFormats/Formats.hh"
+#include "ParallelTasks.hh"
 #include "ResourceFile.hh"
 
 using namespace std;
@@ -163,13 +166,28 @@ vector<unordered_map<int16_t, pair<int16_t, int16_t>>> generate_room_placement_m
 
 
 int main(int argc, char** argv) {
-  if (argc < 2) {
+  string filename;
+  string out_prefix;
+  size_t num_threads = 1;
+  for (int z = 1; z < argc; z++) {
+    if (!strncmp(argv[z], "--threads=", 10)) {
+      num_threads = strtoull(&argv[z][10], nullptr, 0);
+    } else if (filename.empty()) {
+      filename = argv[z];
+    } else if (out_prefix.empty()) {
+      out_prefix = argv[z];
+    } else {
+      throw invalid_argument(string_printf("excess argument: %s", argv[z]));
+    }
+  }
+  if (filename.empty()) {
     throw invalid_argument("no filename given");
   }
-  const string filename = argv[1];
-  const string out_prefix = (argc < 3) ? filename : argv[2];
+  if (out_prefix.empty()) {
+    out_prefix = filename;
+  }
 
-  ResourceFile rf(parse_resource_fork(load_file(filename + "/..namedfork/rsrc")));
+  ResourceFile rf(parse_resource_fork(make_shared<MappedFile>(filename + "/..namedfork/rsrc")));
   const uint32_t room_type = 0x506C766C; // Plvl
   auto room_resource_ids = rf.all_resources_of_type(room_type);
   auto sprites_pict = rf.decode_PICT(130); // hardcoded ID for all worlds
@@ -184,7 +202,7 @@ int main(int argc, char** argv) {
         break;
       }
       auto pict = rf.decode_PICT(id);
-      shared_ptr<const Image> img(new Image(pict.image));
+      shared_ptr<const Image> img = make_shared<Image>(move(pict.image));
       for (size_t z = 0; z < img->get_height(); z += 80) {
         enemy_image_locations.emplace(next_type_id, make_pair(img, z));
         next_type_id++;
@@ -196,13 +214,31 @@ int main(int argc, char** argv) {
   // which apparently happens quite a lot - it looks like the ppat id field used
   // to be the room id field and they just never updated it after implementing
   // the custom backgrounds feature)
+  mutex background_ppat_cache_lock;
   unordered_map<int16_t, const Image> background_ppat_cache;
   const Image* default_background_ppat = &background_ppat_cache.emplace(1000,
       rf.decode_ppat(1000).pattern).first->second;
 
   size_t component_number = 0;
   auto placement_maps = generate_room_placement_maps(room_resource_ids);
+  // Components that don't contain either start room are numbered in order,
+  // so the numbers are assigned before rendering them in parallel
+  vector<size_t> component_numbers;
   for (const auto& placement_map : placement_maps) {
+    component_numbers.emplace_back(component_number);
+    if (!placement_map.count(1000) && !placement_map.count(10000)) {
+      component_number++;
+    }
+  }
+
+  // The ResourceFile isn't safe to modify from multiple threads, so load
+  // everything up front if rendering in parallel
+  if (num_threads != 1) {
+    rf.load_all_resources();
+  }
+
+  run_parallel_tasks(placement_maps.size(), num_threads, [&](size_t placement_map_index, FILE* log_stream) -> void {
+    const auto& placement_map = placement_maps[placement_map_index];
     // First figure out the width and height of this component
     uint16_t w_rooms = 0, h_rooms = 0;
     bool component_contains_start = false, component_contains_bonus_start = false;
@@ -232,7 +268,7 @@ int main(int argc, char** argv) {
 
       string room_data = rf.get_resource(room_type, room_id)->data;
       if (room_data.size() != sizeof(MonkeyShinesRoom)) {
-        fprintf(stderr, "warning: room 0x%04hX is not the correct size (expected %zu bytes, got %zu bytes)\n",
+        fprintf(log_stream, "warning: room 0x%04hX is not the correct size (expected %zu bytes, got %zu bytes)\n",
             room_id, sizeof(MonkeyShinesRoom), room_data.size());
         result.fill_rect(room_px, room_py, 32 * 20, 20 * 20, 0xFF00FFFF);
         continue;
@@ -244,17 +280,20 @@ int main(int argc, char** argv) {
       // use Image::blit() here just in case the room dimensions aren't a
       // multiple of the ppat dimensions
       const Image* background_ppat = nullptr;
-      try {
-        background_ppat = &background_ppat_cache.at(room->background_ppat_id);
-      } catch (const out_of_range&) {
+      {
+        lock_guard<mutex> g(background_ppat_cache_lock);
         try {
-          auto ppat_id = room->background_ppat_id;
-          background_ppat = &background_ppat_cache.emplace(ppat_id,
-              rf.decode_ppat(room->background_ppat_id).pattern).first->second;
-        } catch (const exception& e) {
-          fprintf(stderr, "warning: room %hd uses ppat %hd but it can\'t be decoded (%s)\n",
-              room_id, room->background_ppat_id.load(), e.what());
-          background_ppat = default_background_ppat;
+          background_ppat = &background_ppat_cache.at(room->background_ppat_id);
+        } catch (const out_of_range&) {
+          try {
+            auto ppat_id = room->background_ppat_id;
+            background_ppat = &background_ppat_cache.emplace(ppat_id,
+                rf.decode_ppat(room->background_ppat_id).pattern).first->second;
+          } catch (const exception& e) {
+            fprintf(log_stream, "warning: room %hd uses ppat %hd but it can\'t be decoded (%s)\n",
+                room_id, room->background_ppat_id.load(), e.what());
+            background_ppat = default_background_ppat;
+          }
         }
       }
 
@@ -312,7 +351,7 @@ int main(int argc, char** argv) {
 
           if (tile_x == 0xFFFFFFFF || tile_y == 0xFFFFFFFF) {
             result.fill_rect(room_px + x * 20, room_py + y * 20, 20, 20, 0xFF00FFFF);
-            fprintf(stderr, "warning: no known tile for %02hX (room %hd, x=%zu, y=%zu)\n",
+            fprintf(log_stream, "warning: no known tile for %02hX (room %hd, x=%zu, y=%zu)\n",
                 tile_id, room_id, x, y);
           } else {
             for (size_t py = 0; py < 20; py++) {
@@ -418,12 +457,11 @@ int main(int argc, char** argv) {
       result_filename = out_prefix + "_bonus.bmp";
     } else {
       result_filename = string_printf("%s_%zu.bmp", out_prefix.c_str(),
-          component_number);
-      component_number++;
+          component_numbers[placement_map_index]);
     }
     result.save(result_filename.c_str(), Image::Format::WINDOWS_BITMAP);
-    fprintf(stderr, "... %s\n", result_filename.c_str());
-  }
+    fprintf(log_stream, "... %s\n", result_filename.c_str());
+  });
 
   return 0;
 }
@@ -1,14 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <functional>
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 #include <unordered_map>
 #include <vector>
 
 #include "IndexFormats/Formats.hh"
+#include "ParallelTasks.hh"
 #include "RealmzGlobalData.hh"
 #include "RealmzScenarioData.hh"
 
@@ -17,7 +20,7 @@ using namespace std;
 
 
 int disassemble_scenario(const string& data_dir, const string& scenario_dir,
-    const string& out_dir) {
+    const string& out_dir, size_t num_threads) {
 
   string scenario_name;
   {
@@ -32,6 +35,14 @@ int disassemble_scenario(const string& data_dir, const string& scenario_dir,
   RealmzGlobalData global(data_dir);
   RealmzScenarioData scen(global, scenario_dir, scenario_name);
 
+  // ResourceFile loads and decompresses resources on demand, so load
+  // everything up front if the tasks below will share the files
+  if (num_threads != 1) {
+    global.global_rsf.load_all_resources();
+    global.portraits_rsf.load_all_resources();
+    scen.scenario_rsf.load_all_resources();
+  }
+
   // Make necessary directories for output
   {
     mkdir(out_dir.c_str(), 0755);
@@ -39,57 +50,39 @@ int disassemble_scenario(const string& data_dir, const string& scenario_dir,
     mkdir(filename.c_str(), 0755);
   }
 
-  // Disassemble scenario text
+  // Disassemble scenario text. The sections are independent, so they're
+  // generated in parallel and written in order afterward.
   {
     string filename = string_printf("%s/script.txt", out_dir.c_str());
-    auto f = fopen_unique(filename.c_str(), "wt");
+    vector<pair<const char*, function<string()>>> sections({
+      {"global metadata", [&]() { return scen.disassemble_globals(); }},
+      {"treasures", [&]() { return scen.disassemble_all_treasures(); }},
+      {"party_maps", [&]() { return scen.disassemble_all_party_maps(); }},
+      {"simple encounters", [&]() { return scen.disassemble_all_simple_encounters(); }},
+      {"complex encounters", [&]() { return scen.disassemble_all_complex_encounters(); }},
+      {"rogue encounters", [&]() { return scen.disassemble_all_rogue_encounters(); }},
+      {"time encounters", [&]() { return scen.disassemble_all_time_encounters(); }},
+      {"dungeon APs", [&]() { return scen.disassemble_all_level_aps(true); }},
+      {"land APs", [&]() { return scen.disassemble_all_level_aps(false); }},
+      {"extra APs", [&]() { return scen.disassemble_all_xaps(); }},
+    });
+    vector<string> section_texts(sections.size());
+    run_parallel_tasks(sections.size(), num_threads, [&](size_t z, FILE*) {
+      section_texts[z] = sections[z].second();
+    });
 
-    // global metadata
-    fwritex(f.get(), scen.disassemble_globals());
-    fprintf(stderr, "... %s (global metadata)\n", filename.c_str());
- 
-    // treasures
-    fwritex(f.get(), scen.disassemble_all_treasures());
-    fprintf(stderr, "... %s (treasures)\n", filename.c_str());
-
-    // party maps
-    fwritex(f.get(), scen.disassemble_all_party_maps());
-    fprintf(stderr, "... %s (party_maps)\n", filename.c_str());
-
-    // simple encounters
-    fwritex(f.get(), scen.disassemble_all_simple_encounters());
-    fprintf(stderr, "... %s (simple encounters)\n", filename.c_str());
-
-    // complex encounters
-    fwritex(f.get(), scen.disassemble_all_complex_encounters());
-    fprintf(stderr, "... %s (complex encounters)\n", filename.c_str());
-
-    // rogue encounters
-    fwritex(f.get(), scen.disassemble_all_rogue_encounters());
-    fprintf(stderr, "... %s (rogue encounters)\n", filename.c_str());
-
-    // time encounters
-    fwritex(f.get(), scen.disassemble_all_time_encounters());
-    fprintf(stderr, "... %s (time encounters)\n", filename.c_str());
-
-    // dungeon APs
-    fwritex(f.get(), scen.disassemble_all_level_aps(true));
-    fprintf(stderr, "... %s (dungeon APs)\n", filename.c_str());
-
-    // land APs
-    fwritex(f.get(), scen.disassemble_all_level_aps(false));
-    fprintf(stderr, "... %s (land APs)\n", filename.c_str());
-
-    // extra APs
-    fwritex(f.get(), scen.disassemble_all_xaps());
-    fprintf(stderr, "... %s (extra APs)\n", filename.c_str());
+    auto f = fopen_unique(filename.c_str(), "wt");
+    for (size_t z = 0; z < sections.size(); z++) {
+      fwritex(f.get(), section_texts[z]);
+      fprintf(stderr, "... %s (%s)\n", filename.c_str(), sections[z].first);
+    }
   }
 
   // Save media
   for (int16_t id : scen.scenario_rsf.all_resources_of_type(RESOURCE_TYPE_PICT)) {
-    auto decoded = scen.scenario_rsf.decode_PICT(id);
+    auto decoded = global.decode_PICT_cached(scen.scenario_rsf, id);
     string filename = string_printf("%s/media/picture_%d.bmp", out_dir.c_str(), id);
-    decoded.image.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
+    decoded->save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
     fprintf(stderr, "... %s\n", filename.c_str());
   }
   for (int16_t id : scen.scenario_rsf.all_resources_of_type(RESOURCE_TYPE_cicn)) {
@@ -130,52 +123,88 @@ int disassemble_scenario(const string& data_dir, const string& scenario_dir,
     if (!scen.scenario_rsf.resource_exists(RESOURCE_TYPE_PICT, resource_id)) {
       fprintf(stderr, "### %s FAILED: PICT %hd is missing\n", filename.c_str(), resource_id);
     } else {
-      Image positive_pattern = scen.scenario_rsf.decode_PICT(resource_id).image;
-      Image legend = generate_tileset_definition_legend(it.second, positive_pattern);
+      auto positive_pattern = global.decode_PICT_cached(scen.scenario_rsf, resource_id);
+      Image legend = generate_tileset_definition_legend(it.second, *positive_pattern);
       legend.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
       fprintf(stderr, "... %s\n", filename.c_str());
     }
   }
 
-  // Generate dungeon maps
-  for (size_t z = 0; z < scen.dungeon_maps.size(); z++) {
-    string filename = string_printf("%s/dungeon_%zu.bmp", out_dir.c_str(), z);
-    Image map = scen.generate_dungeon_map(z, 0, 0, 90, 90);
-    map.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
-    fprintf(stderr, "... %s\n", filename.c_str());
-  }
-
-  // Generate land maps
-  unordered_map<int16_t, string> level_id_to_filename;
-  for (size_t z = 0; z < scen.land_maps.size(); z++) {
-    string filename = string_printf("%s/land_%zu.bmp", out_dir.c_str(), z);
+  // Decode the tileset patterns used by land maps before starting the map
+  // tasks, so they're shared from the cache instead of being decoded by
+  // several tasks at once
+  for (const auto& metadata : scen.land_metadata) {
+    int16_t resource_id;
     try {
-      Image map = scen.generate_land_map(z, 0, 0, 90, 90);
-      map.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
-      fprintf(stderr, "... %s\n", filename.c_str());
-      level_id_to_filename[z] = filename;
-    } catch (const exception& e) {
-      fprintf(stderr, "### %s FAILED: %s\n", filename.c_str(), e.what());
+      resource_id = resource_id_for_land_type(metadata.land_type);
+    } catch (const out_of_range&) {
+      continue;
     }
+    try {
+      global.decode_PICT_cached(
+          scen.scenario_rsf.resource_exists(RESOURCE_TYPE_PICT, resource_id)
+          ? scen.scenario_rsf : global.global_rsf, resource_id);
+    } catch (const exception&) { }
   }
 
-  // Generate party maps
-  for (size_t z = 0; z < scen.party_maps.size(); z++) {
-    string filename = string_printf("%s/map_%zu.bmp", out_dir.c_str(), z);
-    try {
-      Image map = scen.render_party_map(z);
+  // Generate dungeon, land, and party maps. Each task renders one map; the
+  // scenario isn't modified by any of them.
+  size_t num_dungeon_maps = scen.dungeon_maps.size();
+  size_t num_land_maps = scen.land_maps.size();
+  size_t num_party_maps = scen.party_maps.size();
+  vector<string> land_map_filenames(num_land_maps);
+  run_parallel_tasks(num_dungeon_maps + num_land_maps + num_party_maps,
+      num_threads, [&](size_t index, FILE* log_stream) {
+    if (index < num_dungeon_maps) {
+      size_t z = index;
+      string filename = string_printf("%s/dungeon_%zu.bmp", out_dir.c_str(), z);
+      Image map = scen.generate_dungeon_map(z, 0, 0, 90, 90);
       map.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
-      fprintf(stderr, "... %s\n", filename.c_str());
-    } catch (const exception& e) {
-      fprintf(stderr, "### %s FAILED: %s\n", filename.c_str(), e.what());
+      fprintf(log_stream, "... %s\n", filename.c_str());
+
+    } else if (index < num_dungeon_maps + num_land_maps) {
+      size_t z = index - num_dungeon_maps;
+      string filename = string_printf("%s/land_%zu.bmp", out_dir.c_str(), z);
+      try {
+        Image map = scen.generate_land_map(z, 0, 0, 90, 90);
+        map.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
+        fprintf(log_stream, "... %s\n", filename.c_str());
+        land_map_filenames[z] = filename;
+      } catch (const exception& e) {
+        fprintf(log_stream, "### %s FAILED: %s\n", filename.c_str(), e.what());
+      }
+
+    } else {
+      size_t z = index - num_dungeon_maps - num_land_maps;
+      string filename = string_printf("%s/map_%zu.bmp", out_dir.c_str(), z);
+      try {
+        Image map = scen.render_party_map(z);
+        map.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
+        fprintf(log_stream, "... %s\n", filename.c_str());
+      } catch (const exception& e) {
+        fprintf(log_stream, "### %s FAILED: %s\n", filename.c_str(), e.what());
+      }
+    }
+  });
+
+  unordered_map<int16_t, string> level_id_to_filename;
+  for (size_t z = 0; z < num_land_maps; z++) {
+    if (!land_map_filenames[z].empty()) {
+      level_id_to_filename[z] = land_map_filenames[z];
     }
   }
 
-  // Generate connected land map
+  // Generate connected land maps. These read the land map images saved above,
+  // so they can't start until all of those are done.
+  vector<RealmzScenarioData::LandLayout> layout_components;
   for (auto layout_component : scen.layout.get_connected_components()) {
-    if (layout_component.num_valid_levels() < 2) {
-      continue;
+    if (layout_component.num_valid_levels() >= 2) {
+      layout_components.emplace_back(layout_component);
     }
+  }
+  run_parallel_tasks(layout_components.size(), num_threads,
+      [&](size_t index, FILE* log_stream) {
+    const auto& layout_component = layout_components[index];
     string filename = string_printf("%s/land_connected", out_dir.c_str());
     for (int y = 0; y < 8; y++) {
       for (int x = 0; x < 16; x++) {
@@ -189,8 +218,8 @@ int disassemble_scenario(const string& data_dir, const string& scenario_dir,
     Image connected_map = scen.generate_layout_map(layout_component,
         level_id_to_filename);
     connected_map.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
-    fprintf(stderr, "... %s\n", filename.c_str());
-  }
+    fprintf(log_stream, "... %s\n", filename.c_str());
+  });
 
   return 0;
 }
@@ -210,9 +239,9 @@ int disassemble_global_data(const string& data_dir, const string& out_dir) {
   // Save media
   // TODO: factor this out somehow with scenario media exporting code
   for (int16_t id : global.global_rsf.all_resources_of_type(RESOURCE_TYPE_PICT)) {
-    auto decoded = global.global_rsf.decode_PICT(id);
+    auto decoded = global.decode_PICT_cached(global.global_rsf, id);
     string filename = string_printf("%s/media/picture_%d.bmp", out_dir.c_str(), id);
-    decoded.image.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
+    decoded->save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
     fprintf(stderr, "... %s\n", filename.c_str());
   }
   for (int16_t id : global.global_rsf.all_resources_of_type(RESOURCE_TYPE_cicn)) {
@@ -252,8 +281,8 @@ int disassemble_global_data(const string& data_dir, const string& out_dir) {
     string filename = string_printf("%s/tileset_%s_legend.bmp",
         out_dir.c_str(), it.first.c_str());
     int16_t resource_id = resource_id_for_land_type(it.first);
-    Image positive_pattern = global.global_rsf.decode_PICT(resource_id).image;
-    Image legend = generate_tileset_definition_legend(it.second, positive_pattern);
+    auto positive_pattern = global.decode_PICT_cached(global.global_rsf, resource_id);
+    Image legend = generate_tileset_definition_legend(it.second, *positive_pattern);
     legend.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
     fprintf(stderr, "... %s\n", filename.c_str());
   }
@@ -264,14 +293,29 @@ int disassemble_global_data(const string& data_dir, const string& out_dir) {
 
 
 int main(int argc, char* argv[]) {
-  if (argc < 3 || argc > 4) {
-    fprintf(stderr, "Usage: %s data_dir [scenario_dir] out_dir\n", argv[0]);
+  size_t num_threads = 1;
+  vector<const char*> positional_args;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--threads=", 10)) {
+      num_threads = strtoull(&argv[x][10], nullptr, 0);
+    } else {
+      positional_args.emplace_back(argv[x]);
+    }
+  }
+
+  if (positional_args.size() < 2 || positional_args.size() > 3) {
+    fprintf(stderr, "\
+Usage: %s [--threads=N] data_dir [scenario_dir] out_dir\n\
+\n\
+--threads=N renders scenario maps and disassembles scenario text using N\n\
+threads (0 = one per CPU core). The default is 1.\n", argv[0]);
     return 1;
   }
 
-  if (argc == 4) {
-    return disassemble_scenario(argv[1], argv[2], argv[3]);
+  if (positional_args.size() == 3) {
+    return disassemble_scenario(positional_args[0], positional_args[1],
+        positional_args[2], num_threads);
   } else {
-    return disassemble_global_data(argv[1], argv[2]);
+    return disassemble_global_data(positional_args[0], positional_args[1]);
   }
 }
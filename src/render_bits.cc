@@ -3,12 +3,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <phosg/Encoding.hh>
 #include <phosg/Image.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 #include <string>
+#include <vector>
 
+#include "MappedFile.hh"
 #include "ResourceFile.hh"
 
 using namespace std;
@@ -103,6 +106,292 @@ bool color_format_has_alpha(ColorFormat format) {
 
 
 
+// Converts input pixels to RGBA8888 values. Formats with 8 or fewer bits per
+// pixel (and indexed formats) are decoded through a lookup table; sub-byte
+// formats unpack a whole byte's worth of pixels at a time when the input is
+// byte-aligned. The direct-color formats are decoded a row at a time with
+// simple loops that the compiler can vectorize, instead of switching on the
+// format for every pixel.
+class PixelDecoder {
+public:
+  PixelDecoder(ColorFormat format, size_t pixel_bits, bool reverse_endian,
+      const vector<ColorTableEntry>& clut)
+    : format(format), pixel_bits(pixel_bits), reverse_endian(reverse_endian) {
+    switch (this->format) {
+      case ColorFormat::GRAY1:
+        // Note: This is the opposite of what you'd expect for other formats
+        // (1 is black, 0 is white). We do this because it seems to be the
+        // common behavior on old Mac OS.
+        this->palette = {0xFFFFFFFF, 0x000000FF};
+        break;
+      case ColorFormat::GRAY2:
+        this->palette = {0x000000FF, 0x555555FF, 0xAAAAAAFF, 0xFFFFFFFF};
+        break;
+      case ColorFormat::GRAY4:
+        this->palette = {
+          0x000000FF,
+          0x242424FF,
+          0x494949FF,
+          0x6D6D6DFF,
+          0x929292FF,
+          0xB6B6B6FF,
+          0xDADADAFF,
+          0xFFFFFFFF,
+        };
+        this->palette.resize(16, 0x00000000);
+        break;
+      case ColorFormat::GRAY8:
+        for (uint32_t z = 0; z < 0x100; z++) {
+          this->palette.emplace_back((z << 24) | (z << 16) | (z << 8) | 0xFF);
+        }
+        break;
+      case ColorFormat::INDEXED:
+        for (const auto& entry : clut) {
+          Color8 c = entry.c.as8();
+          this->palette.emplace_back((c.r << 24) | (c.g << 16) | (c.b << 8) | 0xFF);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Decodes count pixels, starting at the given bit offset within data
+  void decode(uint32_t* out, const uint8_t* data, size_t start_bit, size_t count) const {
+    if (!this->palette.empty()) {
+      this->decode_indexed(out, data, start_bit, count);
+    } else {
+      this->decode_direct(out, data + (start_bit >> 3), count);
+    }
+  }
+
+private:
+  ColorFormat format;
+  size_t pixel_bits;
+  bool reverse_endian;
+  vector<uint32_t> palette;
+
+  static inline uint32_t read_bits(const uint8_t* data, size_t bit_offset, size_t bits) {
+    uint32_t ret = 0;
+    for (size_t z = 0; z < bits; z++, bit_offset++) {
+      ret = (ret << 1) | ((data[bit_offset >> 3] >> (7 - (bit_offset & 7))) & 1);
+    }
+    return ret;
+  }
+
+  void decode_indexed(uint32_t* out, const uint8_t* data, size_t start_bit, size_t count) const {
+    const uint32_t* palette = this->palette.data();
+    size_t bits = this->pixel_bits;
+    size_t z = 0;
+
+    if (bits == 8) {
+      const uint8_t* src = data + (start_bit >> 3);
+      for (; z < count; z++) {
+        out[z] = palette[src[z]];
+      }
+      return;
+    }
+
+    if ((bits < 8) && !(8 % bits)) {
+      // Decode individual pixels until the input is byte-aligned, then decode
+      // entire bytes at a time
+      for (; (z < count) && (start_bit & 7); z++, start_bit += bits) {
+        out[z] = palette[read_bits(data, start_bit, bits)];
+      }
+      size_t pixels_per_byte = 8 / bits;
+      uint8_t mask = (1 << bits) - 1;
+      const uint8_t* src = data + (start_bit >> 3);
+      size_t num_bytes = (count - z) / pixels_per_byte;
+      for (size_t b = 0; b < num_bytes; b++) {
+        uint8_t v = src[b];
+        for (size_t k = 0; k < pixels_per_byte; k++) {
+          out[z + k] = palette[(v >> (8 - bits * (k + 1))) & mask];
+        }
+        z += pixels_per_byte;
+      }
+      start_bit += num_bytes * 8;
+    }
+
+    for (; z < count; z++, start_bit += bits) {
+      out[z] = palette[read_bits(data, start_bit, bits)];
+    }
+  }
+
+  template <size_t BytesPerPixel>
+  inline uint32_t read_pixel(const uint8_t* src) const {
+    uint32_t ret = 0;
+    if (this->reverse_endian) {
+      for (size_t z = 0; z < BytesPerPixel; z++) {
+        ret |= static_cast<uint32_t>(src[z]) << (8 * z);
+      }
+    } else {
+      for (size_t z = 0; z < BytesPerPixel; z++) {
+        ret = (ret << 8) | src[z];
+      }
+    }
+    return ret;
+  }
+
+  void decode_direct(uint32_t* out, const uint8_t* src, size_t count) const {
+    switch (this->format) {
+      case ColorFormat::RGBX5551:
+        for (size_t z = 0; z < count; z++) {
+          uint32_t pixel = this->read_pixel<2>(&src[z * 2]);
+          out[z] = (((pixel >> 8) & 0xF8) << 24) | (((pixel >> 3) & 0xF8) << 16) |
+              (((pixel << 2) & 0xF8) << 8) | 0xFF;
+        }
+        break;
+      case ColorFormat::XRGB1555:
+        for (size_t z = 0; z < count; z++) {
+          uint32_t pixel = this->read_pixel<2>(&src[z * 2]);
+          out[z] = (((pixel >> 7) & 0xF8) << 24) | (((pixel >> 2) & 0xF8) << 16) |
+              (((pixel << 3) & 0xF8) << 8) | 0xFF;
+        }
+        break;
+      case ColorFormat::RGB565:
+        for (size_t z = 0; z < count; z++) {
+          uint32_t pixel = this->read_pixel<2>(&src[z * 2]);
+          out[z] = (((pixel >> 8) & 0xF8) << 24) | (((pixel >> 3) & 0xFC) << 16) |
+              (((pixel << 3) & 0xF8) << 8) | 0xFF;
+        }
+        break;
+      case ColorFormat::RGB888:
+        for (size_t z = 0; z < count; z++) {
+          out[z] = (this->read_pixel<3>(&src[z * 3]) << 8) | 0xFF;
+        }
+        break;
+      case ColorFormat::XRGB8888:
+        for (size_t z = 0; z < count; z++) {
+          out[z] = (this->read_pixel<4>(&src[z * 4]) << 8) | 0xFF;
+        }
+        break;
+      case ColorFormat::ARGB8888:
+        for (size_t z = 0; z < count; z++) {
+          uint32_t pixel = this->read_pixel<4>(&src[z * 4]);
+          out[z] = (pixel << 8) | (pixel >> 24);
+        }
+        break;
+      case ColorFormat::RGBX8888:
+        for (size_t z = 0; z < count; z++) {
+          out[z] = this->read_pixel<4>(&src[z * 4]) | 0xFF;
+        }
+        break;
+      case ColorFormat::RGBA8888:
+        for (size_t z = 0; z < count; z++) {
+          out[z] = this->read_pixel<4>(&src[z * 4]);
+        }
+        break;
+      default:
+        throw logic_error("invalid color format");
+    }
+  }
+};
+
+
+
+// Writes an image to a BMP or PPM file a strip of rows at a time, so the
+// entire image never has to be in memory. BMP files are stored bottom-up, so
+// the caller must provide the rows in reverse order for BMP output (see
+// rows_bottom_up()). PPM files don't support alpha, so it's discarded.
+class StripImageWriter {
+public:
+  StripImageWriter(FILE* f, size_t w, size_t h, bool has_alpha, bool ppm)
+    : f(f), w(w), h(h), has_alpha(has_alpha && !ppm), ppm(ppm) {
+    size_t bytes_per_pixel = this->has_alpha ? 4 : 3;
+    this->row_bytes = this->w * bytes_per_pixel;
+    if (!this->ppm) {
+      this->row_bytes = (this->row_bytes + 3) & (~3);
+    }
+
+    if (this->ppm) {
+      fprintf(this->f, "P6 %zu %zu 255\n", this->w, this->h);
+    } else {
+      BitmapFileHeader file_header;
+      BitmapInfoHeader info_header;
+      file_header.magic = 0x4D42; // 'BM'
+      file_header.file_size = sizeof(file_header) + sizeof(info_header) + this->row_bytes * this->h;
+      file_header.reserved = 0;
+      file_header.data_offset = sizeof(file_header) + sizeof(info_header);
+      info_header.header_size = sizeof(info_header);
+      info_header.width = this->w;
+      info_header.height = this->h;
+      info_header.planes = 1;
+      info_header.bit_depth = bytes_per_pixel * 8;
+      info_header.compression = 0; // BI_RGB
+      info_header.image_size = this->row_bytes * this->h;
+      info_header.x_pixels_per_meter = 0x0B13;
+      info_header.y_pixels_per_meter = 0x0B13;
+      info_header.num_colors = 0;
+      info_header.important_colors = 0;
+      fwritex(this->f, &file_header, sizeof(file_header));
+      fwritex(this->f, &info_header, sizeof(info_header));
+    }
+    this->row_data.resize(this->row_bytes, 0);
+  }
+
+  inline bool rows_bottom_up() const {
+    return !this->ppm;
+  }
+
+  // pixels contains w RGBA8888 values
+  void write_row(const uint32_t* pixels) {
+    uint8_t* out = this->row_data.data();
+    if (this->ppm) {
+      for (size_t x = 0; x < this->w; x++) {
+        out[x * 3 + 0] = pixels[x] >> 24;
+        out[x * 3 + 1] = pixels[x] >> 16;
+        out[x * 3 + 2] = pixels[x] >> 8;
+      }
+    } else if (this->has_alpha) {
+      for (size_t x = 0; x < this->w; x++) {
+        out[x * 4 + 0] = pixels[x] >> 8;
+        out[x * 4 + 1] = pixels[x] >> 16;
+        out[x * 4 + 2] = pixels[x] >> 24;
+        out[x * 4 + 3] = pixels[x];
+      }
+    } else {
+      for (size_t x = 0; x < this->w; x++) {
+        out[x * 3 + 0] = pixels[x] >> 8;
+        out[x * 3 + 1] = pixels[x] >> 16;
+        out[x * 3 + 2] = pixels[x] >> 24;
+      }
+    }
+    fwritex(this->f, this->row_data.data(), this->row_bytes);
+  }
+
+private:
+  struct BitmapFileHeader {
+    le_uint16_t magic;
+    le_uint32_t file_size;
+    le_uint32_t reserved;
+    le_uint32_t data_offset;
+  } __attribute__((packed));
+
+  struct BitmapInfoHeader {
+    le_uint32_t header_size;
+    le_int32_t width;
+    le_int32_t height;
+    le_uint16_t planes;
+    le_uint16_t bit_depth;
+    le_uint32_t compression;
+    le_uint32_t image_size;
+    le_int32_t x_pixels_per_meter;
+    le_int32_t y_pixels_per_meter;
+    le_uint32_t num_colors;
+    le_uint32_t important_colors;
+  } __attribute__((packed));
+
+  FILE* f;
+  size_t w;
+  size_t h;
+  bool has_alpha;
+  bool ppm;
+  size_t row_bytes;
+  vector<uint8_t> row_data;
+};
+
+
+
 int main(int argc, char* argv[]) {
   if (argc == 1) {
     fprintf(stderr, "Usage: %s [options] [input_filename [output_filename]]\n\
@@ -142,6 +431,14 @@ Options:\n\
       Expect input in text format, and parse it using phosg\'s standard data\n\
       format. Use this if you have e.g. a hex string and you want to paste it\n\
       into your terminal.\n\
+  --stream\n\
+      Decode the input a strip of rows at a time and write each strip to the\n\
+      output file as soon as it\'s decoded, so the entire image is never in\n\
+      memory. Use this for very large inputs. An input filename is required,\n\
+      and --parse cannot be used. If the output filename ends in .ppm, a PPM\n\
+      file is written instead of a BMP file.\n\
+  --strip-rows=N\n\
+      In streaming mode, decode this many rows at a time (default 256).\n\
 ", argv[0]);
     return 1;
   }
@@ -151,6 +448,8 @@ Options:\n\
   size_t w = 0, h = 0;
   ColorFormat color_format = ColorFormat::GRAY1;
   bool reverse_endian = false;
+  bool stream = false;
+  size_t strip_rows = 256;
   const char* input_filename = nullptr;
   const char* output_filename = nullptr;
   const char* clut_filename = nullptr;
@@ -170,6 +469,10 @@ Options:\n\
       offset = strtoull(&argv[x][9], nullptr, 0);
     } else if (!strcmp(argv[x], "--parse")) {
       parse = true;
+    } else if (!strcmp(argv[x], "--stream")) {
+      stream = true;
+    } else if (!strncmp(argv[x], "--strip-rows=", 13)) {
+      strip_rows = strtoull(&argv[x][13], nullptr, 0);
     } else if (!input_filename) {
       input_filename = argv[x];
     } else if (!output_filename) {
@@ -179,20 +482,46 @@ Options:\n\
     }
   }
 
-  string data;
-  if (input_filename) {
-    data = load_file(input_filename);
-  } else {
-    data = read_all(stdin);
+  if (stream) {
+    if (!input_filename) {
+      throw invalid_argument("an input filename is required in streaming mode");
+    }
+    if (parse) {
+      throw invalid_argument("--parse cannot be used in streaming mode");
+    }
+    if (strip_rows == 0) {
+      throw invalid_argument("--strip-rows must be at least 1");
+    }
   }
 
-  if (parse) {
-    data = parse_data_string(data);
+  // In streaming mode the input is mapped instead of loaded, so its pages can
+  // be discarded by the OS as they're decoded
+  shared_ptr<MappedFile> mapped_input;
+  string data;
+  const uint8_t* input_data;
+  size_t input_size;
+  if (stream) {
+    mapped_input = make_shared<MappedFile>(input_filename);
+    input_data = reinterpret_cast<const uint8_t*>(mapped_input->data());
+    input_size = mapped_input->size();
+  } else {
+    if (input_filename) {
+      data = load_file(input_filename);
+    } else {
+      data = read_all(stdin);
+    }
+    if (parse) {
+      data = parse_data_string(data);
+    }
+    input_data = reinterpret_cast<const uint8_t*>(data.data());
+    input_size = data.size();
   }
 
-  if (offset) {
-    data = data.substr(offset);
+  if (offset > input_size) {
+    throw out_of_range("offset is beyond the end of the input");
   }
+  input_data += offset;
+  input_size -= offset;
 
   vector<ColorTableEntry> clut;
   size_t pixel_bits;
@@ -216,7 +545,7 @@ Options:\n\
   } else {
     pixel_bits = bits_for_format(color_format);
   }
-  size_t pixel_count = (data.size() * 8) / pixel_bits;
+  size_t pixel_count = (input_size * 8) / pixel_bits;
 
   if (w == 0 && h == 0) {
     double z = sqrt(pixel_count);
@@ -240,135 +569,53 @@ Options:\n\
     }
   }
 
-  BitReader r(data);
-  Image img(w, h, color_format_has_alpha(color_format));
-  for (size_t z = 0; z < pixel_count; z++) {
-    size_t x = z % w;
-    size_t y = z / w;
-    if (y >= h) {
-      break;
-    }
-    switch (color_format) {
-      case ColorFormat::GRAY1:
-        // Note: This is the opposite of what you'd expect for other formats
-        // (1 is black, 0 is white). We do this because it seems to be the
-        // common behavior on old Mac OS.
-        img.write_pixel(x, y, r.read(1) ? 0x000000FF : 0xFFFFFFFF);
-        break;
-
-      case ColorFormat::GRAY2: {
-        static const uint32_t colors[4] = {
-            0x000000FF, 0x555555FF, 0xAAAAAAFF, 0xFFFFFFFF};
-        img.write_pixel(x, y, colors[r.read(2)]);
-        break;
-      }
-
-      case ColorFormat::GRAY4: {
-        static const uint32_t colors[16] = {
-          0x000000FF,
-          0x242424FF,
-          0x494949FF,
-          0x6D6D6DFF,
-          0x929292FF,
-          0xB6B6B6FF,
-          0xDADADAFF,
-          0xFFFFFFFF,
-        };
-        img.write_pixel(x, y, colors[r.read(4)]);
-        break;
-      }
+  PixelDecoder decoder(color_format, pixel_bits, reverse_endian, clut);
 
-      case ColorFormat::GRAY8:
-        img.write_pixel(x, y, data[z], data[z], data[z]);
-        break;
-
-      case ColorFormat::INDEXED: {
-        Color8 c = clut.at(r.read(pixel_bits)).c.as8();
-        img.write_pixel(x, y, c.r, c.g, c.b, 0xFF);
-        break;
-      }
-
-      case ColorFormat::RGBX5551: {
-        uint16_t pixel = r.read(16);
-        if (reverse_endian) {
-          pixel = bswap16(pixel);
-        }
-        img.write_pixel(x, y, ((pixel >> 8) & 0xF8), ((pixel >> 3) & 0xF8),
-            ((pixel << 2) & 0xF8));
-        break;
-      }
-
-      case ColorFormat::XRGB1555: {
-        uint16_t pixel = r.read(16);
-        if (reverse_endian) {
-          pixel = bswap16(pixel);
-        }
-        img.write_pixel(x, y, ((pixel >> 7) & 0xF8), ((pixel >> 2) & 0xF8),
-            ((pixel << 3) & 0xF8));
-        break;
-      }
-
-      case ColorFormat::RGB565: {
-        uint16_t pixel = r.read(16);
-        if (reverse_endian) {
-          pixel = bswap16(pixel);
-        }
-        img.write_pixel(x, y, ((pixel >> 8) & 0xF8), ((pixel >> 3) & 0xFC),
-            ((pixel << 3) & 0xF8));
-        break;
-      }
-
-      case ColorFormat::RGB888: {
-        uint32_t pixel = r.read(24);
-        if (reverse_endian) {
-          pixel = bswap32(pixel) >> 8;
-        }
-        img.write_pixel(x, y, ((pixel >> 16) & 0xFF), ((pixel >> 8) & 0xFF),
-            (pixel & 0xFF));
-        break;
-      }
-
-      case ColorFormat::XRGB8888: {
-        uint32_t pixel = r.read(32);
-        if (reverse_endian) {
-          pixel = bswap32(pixel);
-        }
-        img.write_pixel(x, y, ((pixel >> 16) & 0xFF), ((pixel >> 8) & 0xFF),
-            (pixel & 0xFF));
-        break;
-      }
-
-      case ColorFormat::ARGB8888: {
-        uint32_t pixel = r.read(32);
-        if (reverse_endian) {
-          pixel = bswap32(pixel);
-        }
-        img.write_pixel(x, y, ((pixel >> 16) & 0xFF), ((pixel >> 8) & 0xFF),
-            (pixel & 0xFF), ((pixel >> 24) & 0xFF));
-        break;
-      }
-
-      case ColorFormat::RGBX8888: {
-        uint32_t pixel = r.read(32);
-        if (reverse_endian) {
-          pixel = bswap32(pixel);
-        }
-        img.write_pixel(x, y, pixel | 0xFF);
-        break;
+  // Decodes the given row into row_pixels. Pixels past the end of the input
+  // are left black and transparent, as in the non-streaming case.
+  auto decode_row = [&](uint32_t* row_pixels, size_t y) -> void {
+    size_t start_pixel = y * w;
+    size_t count = (start_pixel >= pixel_count) ? 0 : min<size_t>(w, pixel_count - start_pixel);
+    decoder.decode(row_pixels, input_data, start_pixel * pixel_bits, count);
+    for (size_t x = count; x < w; x++) {
+      row_pixels[x] = 0x00000000;
+    }
+  };
+
+  if (stream) {
+    string output_filename_str = output_filename
+        ? output_filename : string_printf("%s.bmp", input_filename);
+    bool ppm = ends_with(output_filename_str, ".ppm");
+    auto f = fopen_unique(output_filename_str, "wb");
+    StripImageWriter writer(f.get(), w, h, color_format_has_alpha(color_format), ppm);
+
+    vector<uint32_t> strip_pixels(strip_rows * w);
+    bool bottom_up = writer.rows_bottom_up();
+    for (size_t strip_start = 0; strip_start < h; strip_start += strip_rows) {
+      size_t num_rows = min<size_t>(strip_rows, h - strip_start);
+      // For bottom-up output, the strips are decoded starting from the bottom
+      // of the image
+      size_t first_row = bottom_up ? (h - strip_start - num_rows) : strip_start;
+      for (size_t z = 0; z < num_rows; z++) {
+        decode_row(&strip_pixels[z * w], first_row + z);
       }
-
-      case ColorFormat::RGBA8888: {
-        uint32_t pixel = r.read(32);
-        if (reverse_endian) {
-          pixel = bswap32(pixel);
-        }
-        img.write_pixel(x, y, pixel);
-        break;
+      for (size_t z = 0; z < num_rows; z++) {
+        writer.write_row(&strip_pixels[(bottom_up ? (num_rows - z - 1) : z) * w]);
       }
+    }
+    return 0;
+  }
 
-      default:
-        fprintf(stderr, "invalid color format");
-        return 1;
+  vector<uint32_t> row_pixels(w);
+  Image img(w, h, color_format_has_alpha(color_format));
+  for (size_t y = 0; y < h; y++) {
+    if (y * w >= pixel_count) {
+      break;
+    }
+    decode_row(row_pixels.data(), y);
+    size_t count = min<size_t>(w, pixel_count - y * w);
+    for (size_t x = 0; x < count; x++) {
+      img.write_pixel(x, y, row_pixels[x]);
     }
   }
 
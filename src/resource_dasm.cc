@@ -1,35 +1,60 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <deque>
 #include <functional>
+#include <list>
+#include <mutex>
+#include <new>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
 #include <phosg/JSON.hh>
 #include <phosg/Process.hh>
 #include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "AudioEncoder.hh"
 #include "Emulators/M68KEmulator.hh"
 #include "Emulators/PPC32Emulator.hh"
 #include "Emulators/X86Emulator.hh"
+#include "Decompressors/Codecs.hh"
+#include "DecodeStats.hh"
 #include "ExecutableFormats/DOLFile.hh"
 #include "ExecutableFormats/ELFFile.hh"
 #include "ExecutableFormats/PEFFFile.hh"
 #include "ExecutableFormats/PEFile.hh"
 #include "ExecutableFormats/RELFile.hh"
+#include "GlyphAtlas.hh"
+#include "ImageEncoder.hh"
 #include "IndexFormats/Formats.hh"
+#include "OutputSink.hh"
 #include "ResourceCompression.hh"
+#include "ParallelTasks.hh"
+#include "ResourceBudget.hh"
 #include "ResourceFile.hh"
+#include "ScratchArena.hh"
+#include "SongRenderer.hh"
 #include "SystemTemplates.hh"
 
 using namespace std;
@@ -41,39 +66,745 @@ static const string RESOURCE_FORK_FILENAME_SHORT_SUFFIX = "/rsrc";
 
 
 
+// When --stats is given, every allocation made through operator new is
+// counted, so resource_dasm_perf can catch changes that allocate much more
+// than before. When it isn't given, this only costs one relaxed load per
+// allocation.
+static atomic<bool> should_count_allocations(false);
+static atomic<uint64_t> allocation_count(0);
+static atomic<uint64_t> allocated_byte_count(0);
+
+void* operator new(size_t size) {
+  if (should_count_allocations.load(memory_order_relaxed)) {
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    allocated_byte_count.fetch_add(size, memory_order_relaxed);
+  }
+  void* ret = malloc(size ? size : 1);
+  if (!ret) {
+    throw bad_alloc();
+  }
+  return ret;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+static DecodeStats::MemoryTotals current_memory_totals() {
+  DecodeStats::MemoryTotals ret;
+  struct rusage usage;
+  if (!getrusage(RUSAGE_SELF, &usage)) {
+#ifdef __APPLE__
+    ret.peak_rss_bytes = usage.ru_maxrss; // Already in bytes on macOS
+#else
+    ret.peak_rss_bytes = static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+  }
+  ret.allocations = allocation_count.load(memory_order_relaxed);
+  ret.allocated_bytes = allocated_byte_count.load(memory_order_relaxed);
+  return ret;
+}
+
+
+
 static constexpr bool should_escape_filename_char(char ch) {
   return (ch < 0x20) || (ch > 0x7E) || (ch == '/') || (ch == ':');
 }
 
+// Calls fn with a stream, and returns everything it wrote to the stream. This
+// is used for outputs produced by functions that print to a FILE*, so they can
+// be written to any OutputSink.
+static string capture_stream_output(const function<void(FILE*)>& fn) {
+  char* data = nullptr;
+  size_t size = 0;
+  FILE* f = open_memstream(&data, &size);
+  if (!f) {
+    throw runtime_error("cannot create output buffer");
+  }
+  try {
+    fn(f);
+  } catch (const exception&) {
+    fclose(f);
+    free(data);
+    throw;
+  }
+  fclose(f);
+  string ret(data, size);
+  free(data);
+  return ret;
+}
+
+// Appends s to out as a quoted JSON string. s should already be UTF-8; bytes
+// 0x80 and above are passed through unchanged.
+static void append_json_string(string& out, const string& s) {
+  out += '"';
+  for (char ch : s) {
+    if (ch == '"') {
+      out += "\\\"";
+    } else if (ch == '\\') {
+      out += "\\\\";
+    } else if (ch == '\n') {
+      out += "\\n";
+    } else if (ch == '\t') {
+      out += "\\t";
+    } else if (static_cast<uint8_t>(ch) < 0x20) {
+      out += string_printf("\\u%04hhX", static_cast<uint8_t>(ch));
+    } else {
+      out += ch;
+    }
+  }
+  out += '"';
+}
 
+// Appends s to out as a TSV field, escaping characters that would break the
+// row or column structure
+static void append_tsv_field(string& out, const string& s) {
+  for (char ch : s) {
+    if (ch == '\\') {
+      out += "\\\\";
+    } else if (ch == '\t') {
+      out += "\\t";
+    } else if (ch == '\n') {
+      out += "\\n";
+    } else if (ch == '\r') {
+      out += "\\r";
+    } else {
+      out += ch;
+    }
+  }
+}
 
-class ResourceExporter {
-private:
-  void ensure_directories_exist(const string& filename) {
-    vector<string> tokens = split(filename, '/');
-    if (tokens.empty()) {
+
+
+// Remembers the output files produced by decoding resources, so resources that
+// appear in many files (games often have the same palettes, patterns, and
+// sounds in every file) are only decoded once per run. Entries are keyed by
+// the resource's type and contents, and by a context string that covers
+// anything else the output depends on (e.g. the TMPL used to decode it). When
+// the total size of the cached outputs would exceed max_size, the least
+// recently used entries are discarded. This is shared between all threads
+// when --jobs is used.
+class DecodedOutputCache {
+public:
+  struct Output {
+    string after; // Filename suffix passed to output_filename
+    string filename; // Where this output was first written
+    string data;
+  };
+  struct Entry {
+    uint32_t type;
+    string context;
+    string resource_data;
+    vector<Output> outputs;
+
+    size_t size() const {
+      size_t ret = this->context.size() + this->resource_data.size();
+      for (const auto& output : this->outputs) {
+        ret += output.data.size();
+      }
+      return ret;
+    }
+  };
+
+  explicit DecodedOutputCache(size_t max_size)
+    : max_size(max_size), current_size(0), hits(0), misses(0) { }
+
+  inline size_t get_max_size() const {
+    return this->max_size;
+  }
+
+  shared_ptr<const Entry> get(uint32_t type, const string& context, const string& data) {
+    uint64_t key = this->key_for(type, context, data);
+    lock_guard<mutex> g(this->lock);
+    auto it = this->index.find(key);
+    if ((it == this->index.end()) || ((*it->second)->type != type) ||
+        ((*it->second)->context != context) || ((*it->second)->resource_data != data)) {
+      this->misses++;
+      return nullptr;
+    }
+    this->lru.splice(this->lru.begin(), this->lru, it->second);
+    this->hits++;
+    return *it->second;
+  }
+
+  void insert(shared_ptr<const Entry> entry) {
+    size_t entry_size = entry->size();
+    if (entry_size > this->max_size) {
       return;
     }
-    tokens.pop_back();
 
-    if (tokens.empty()) {
+    uint64_t key = this->key_for(entry->type, entry->context, entry->resource_data);
+    lock_guard<mutex> g(this->lock);
+    auto it = this->index.find(key);
+    if (it != this->index.end()) {
+      this->current_size -= (*it->second)->size();
+      this->lru.erase(it->second);
+      this->index.erase(it);
+    }
+    while (!this->lru.empty() && (this->current_size + entry_size > this->max_size)) {
+      const auto& last = this->lru.back();
+      this->current_size -= last->size();
+      this->index.erase(this->key_for(last->type, last->context, last->resource_data));
+      this->lru.pop_back();
+    }
+    this->lru.emplace_front(entry);
+    this->index.emplace(key, this->lru.begin());
+    this->current_size += entry_size;
+  }
+
+  inline size_t hit_count() const {
+    return this->hits;
+  }
+  inline size_t miss_count() const {
+    return this->misses;
+  }
+
+private:
+  mutex lock;
+  size_t max_size;
+  size_t current_size;
+  list<shared_ptr<const Entry>> lru; // Most recently used first
+  unordered_map<uint64_t, list<shared_ptr<const Entry>>::iterator> index;
+  // These are only modified while holding lock, but are read without it
+  atomic<size_t> hits;
+  atomic<size_t> misses;
+
+  // Different entries can have the same key; get() checks the entry's full
+  // type, context, and data before using it
+  static uint64_t key_for(uint32_t type, const string& context, const string& data) {
+    uint64_t key = hash<string>()(data);
+    uint64_t context_hash = hash<string>()(context);
+    key ^= (static_cast<uint64_t>(type) << 32) + context_hash + 0x9E3779B97F4A7C15 + (key << 6) + (key >> 2);
+    return key;
+  }
+};
+
+
+
+// Remembers which outputs were produced from each input file and resource, so
+// that runs with --incremental can skip inputs that haven't changed since the
+// previous run. Files whose size and modification time are the same as before
+// aren't parsed at all; for other files, each resource's contents are compared
+// to the previous run's by hash, and only changed resources are exported. Only
+// resources whose outputs depend solely on their own contents can be skipped
+// this way (see ResourceExporter::cacheable_decoder_types); the rest are always
+// exported again if their file changed, since they may depend on other
+// resources in it (e.g. ICN# masks, cluts, and TMPLs). The manifest is saved
+// in the output directory and is discarded if any option that affects the
+// outputs has changed. This is shared between all threads when --jobs is used.
+class IncrementalManifest {
+public:
+  struct ResourceEntry {
+    uint64_t hash;
+    bool exported; // export_resource's return value
+    vector<string> outputs;
+  };
+  struct FileEntry {
+    int64_t mtime;
+    int64_t size;
+    bool exported; // disassemble_file's return value
+    unordered_map<string, ResourceEntry> resources;
+    vector<string> outputs; // Outputs not associated with any one resource
+
+    bool all_outputs_exist() const {
+      if (!IncrementalManifest::outputs_exist(this->outputs)) {
+        return false;
+      }
+      for (const auto& it : this->resources) {
+        if (!IncrementalManifest::outputs_exist(it.second.outputs)) {
+          return false;
+        }
+      }
+      return true;
+    }
+  };
+
+  IncrementalManifest(const string& filename, const string& options)
+    : filename(filename), options(options) {
+    string contents;
+    try {
+      contents = load_file(this->filename);
+    } catch (const cannot_open_file&) {
       return;
     }
 
-    string dir;
-    bool first_token = true;
-    for (const string& token : tokens) {
-      if (!first_token) {
-        dir.push_back('/');
-      } else {
-        first_token = false;
+    try {
+      auto json = JSONObject::parse(contents);
+      const auto& root = json->as_dict();
+      if ((root.at("version")->as_int() != 1) ||
+          (root.at("options")->as_string() != this->options)) {
+        return;
+      }
+      for (const auto& file_it : root.at("files")->as_dict()) {
+        const auto& file_dict = file_it.second->as_dict();
+        auto& file_entry = this->previous[file_it.first];
+        file_entry.mtime = file_dict.at("mtime")->as_int();
+        file_entry.size = file_dict.at("size")->as_int();
+        file_entry.exported = file_dict.at("exported")->as_bool();
+        file_entry.outputs = parse_outputs(file_dict.at("outputs"));
+        for (const auto& res_it : file_dict.at("resources")->as_dict()) {
+          const auto& res_dict = res_it.second->as_dict();
+          auto& res_entry = file_entry.resources[res_it.first];
+          res_entry.hash = stoull(res_dict.at("hash")->as_string(), nullptr, 16);
+          res_entry.exported = res_dict.at("exported")->as_bool();
+          res_entry.outputs = parse_outputs(res_dict.at("outputs"));
+        }
+      }
+    } catch (const exception& e) {
+      fprintf(stderr, "warning: ignoring invalid manifest %s: %s\n",
+          this->filename.c_str(), e.what());
+      this->previous.clear();
+    }
+  }
+
+  // Returns the previous run's entry for the given input file, or nullptr if
+  // it wasn't processed in the previous run
+  const FileEntry* get_previous(const string& input_filename) const {
+    auto it = this->previous.find(input_filename);
+    return (it == this->previous.end()) ? nullptr : &it->second;
+  }
+
+  void set_current(const string& input_filename, FileEntry&& entry) {
+    lock_guard<mutex> g(this->lock);
+    this->current[input_filename] = move(entry);
+  }
+
+  static bool outputs_exist(const vector<string>& outputs) {
+    for (const auto& output : outputs) {
+      if (!isfile(output)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Hashes the resource's name along with its data, since the output
+  // filenames can include the name
+  static uint64_t hash_resource(const ResourceFile::Resource& res) {
+    // FNV-1a, since the hash must be the same across runs and platforms
+    uint64_t hash = 0xCBF29CE484222325;
+    auto update = [&](const string& s) -> void {
+      for (char ch : s) {
+        hash = (hash ^ static_cast<uint8_t>(ch)) * 0x00000100000001B3;
+      }
+    };
+    update(res.name);
+    hash = (hash ^ 0xFF) * 0x00000100000001B3;
+    update(res.data);
+    return hash;
+  }
+
+  void save() const {
+    JSONObject::dict_type files_dict;
+    for (const auto& file_it : this->current) {
+      JSONObject::dict_type resources_dict;
+      for (const auto& res_it : file_it.second.resources) {
+        JSONObject::dict_type res_dict;
+        res_dict.emplace("hash", new JSONObject(string_printf("%016" PRIX64, res_it.second.hash)));
+        res_dict.emplace("exported", new JSONObject(res_it.second.exported));
+        res_dict.emplace("outputs", format_outputs(res_it.second.outputs));
+        resources_dict.emplace(res_it.first, new JSONObject(move(res_dict)));
+      }
+      JSONObject::dict_type file_dict;
+      file_dict.emplace("mtime", new JSONObject(file_it.second.mtime));
+      file_dict.emplace("size", new JSONObject(file_it.second.size));
+      file_dict.emplace("exported", new JSONObject(file_it.second.exported));
+      file_dict.emplace("outputs", format_outputs(file_it.second.outputs));
+      file_dict.emplace("resources", new JSONObject(move(resources_dict)));
+      files_dict.emplace(file_it.first, new JSONObject(move(file_dict)));
+    }
+
+    JSONObject::dict_type root;
+    root.emplace("version", new JSONObject(static_cast<int64_t>(1)));
+    root.emplace("options", new JSONObject(this->options));
+    root.emplace("files", new JSONObject(move(files_dict)));
+    // Write to a temporary file first, so an interrupted save doesn't destroy
+    // the previous manifest
+    string temp_filename = this->filename + ".tmp";
+    save_file(temp_filename, JSONObject(move(root)).format());
+    if (rename(temp_filename.c_str(), this->filename.c_str()) != 0) {
+      throw runtime_error("cannot replace manifest " + this->filename);
+    }
+  }
+
+private:
+  string filename;
+  string options;
+  // Read-only after construction, so it isn't protected by lock
+  unordered_map<string, FileEntry> previous;
+  mutex lock;
+  unordered_map<string, FileEntry> current;
+
+  static vector<string> parse_outputs(shared_ptr<JSONObject> json) {
+    vector<string> ret;
+    for (const auto& item : json->as_list()) {
+      ret.emplace_back(item->as_string());
+    }
+    return ret;
+  }
+
+  static shared_ptr<JSONObject> format_outputs(const vector<string>& outputs) {
+    JSONObject::list_type ret;
+    for (const auto& output : outputs) {
+      ret.emplace_back(new JSONObject(output));
+    }
+    return make_shared<JSONObject>(move(ret));
+  }
+};
+
+
+
+// Writes output files on background threads, so decoding the next resource
+// can proceed while the previous resource's outputs are encoded and written.
+// The queue is limited to max_queued_bytes of data; write() blocks when it's
+// full. Errors that occur on the writer threads are logged to stderr, since
+// the resource that produced the output may have been finished long before.
+// With no threads, write() writes the file immediately and throws on failure.
+// The files are written to the given sink, which may be an archive instead of
+// a directory tree. This is shared between all threads when --jobs is used.
+class OutputWriter {
+public:
+  OutputWriter(shared_ptr<OutputSink> sink, size_t num_threads, size_t max_queued_bytes)
+    : sink(sink),
+      max_queued_bytes(max_queued_bytes),
+      queued_bytes(0),
+      num_writing(0),
+      should_exit(false) {
+    for (size_t z = 0; z < num_threads; z++) {
+      this->threads.emplace_back(&OutputWriter::thread_fn, this);
+    }
+  }
+  OutputWriter(const OutputWriter&) = delete;
+  OutputWriter(OutputWriter&&) = delete;
+  OutputWriter& operator=(const OutputWriter&) = delete;
+  OutputWriter& operator=(OutputWriter&&) = delete;
+
+  ~OutputWriter() {
+    {
+      lock_guard<mutex> g(this->lock);
+      this->should_exit = true;
+    }
+    this->items_available.notify_all();
+    // The threads write everything remaining in the queue before exiting
+    for (auto& t : this->threads) {
+      t.join();
+    }
+  }
+
+  inline shared_ptr<OutputSink> get_sink() const {
+    return this->sink;
+  }
+
+  void ensure_directories_exist(const string& filename) {
+    this->sink->ensure_directories_exist(filename);
+  }
+
+  // A set of writes that can be waited for without waiting for anything else
+  // that's queued (unlike flush, which also waits for other threads' writes).
+  // Only the OutputWriter modifies this, while holding its lock.
+  struct WriteGroup {
+    size_t num_pending = 0;
+  };
+
+  // If group is given, the write is added to it (see wait)
+  void write(const string& filename, const string& data,
+      shared_ptr<WriteGroup> group = nullptr) {
+    auto stats = get_decode_stats();
+    if (stats.get()) {
+      stats->record_output(data.size());
+    }
+    if (this->threads.empty()) {
+      this->write_to_sink(filename, data);
+    } else {
+      this->enqueue(Item{filename, data, nullptr, ImageEncodingOptions(), data.size(),
+          AudioEncodingOptions(), group});
+    }
+  }
+
+  // Images are encoded on the writer threads, so with multiple threads,
+  // several images can be compressed at once
+  void write(const string& filename, const Image& img,
+      const ImageEncodingOptions& options, shared_ptr<WriteGroup> group = nullptr) {
+    if (this->threads.empty()) {
+      this->save_image_recording_stats(img, filename, options);
+    } else {
+      size_t size = img.get_width() * img.get_height() * (img.get_has_alpha() ? 4 : 3);
+      this->enqueue(Item{filename, "", make_unique<Image>(img), options, size,
+          AudioEncodingOptions(), group});
+    }
+  }
+
+  // Like images, sounds are converted from WAV to other formats on the writer
+  // threads, so several sounds can be encoded at once
+  void write_audio(const string& filename, const string& wav_data,
+      const AudioEncodingOptions& options, shared_ptr<WriteGroup> group = nullptr) {
+    if (options.format == AudioFormat::WAV) {
+      this->write(filename, wav_data, group);
+    } else if (this->threads.empty()) {
+      this->save_audio_recording_stats(wav_data, filename, options);
+    } else {
+      this->enqueue(Item{filename, wav_data, nullptr, ImageEncodingOptions(), wav_data.size(),
+          options, group});
+    }
+  }
+
+  // Blocks until all queued files have been written
+  void flush() {
+    unique_lock<mutex> g(this->lock);
+    this->queue_empty.wait(g, [&]() {
+      return this->queue.empty() && (this->num_writing == 0);
+    });
+  }
+
+  // Blocks until all the files in group have been written
+  void wait(shared_ptr<WriteGroup> group) {
+    unique_lock<mutex> g(this->lock);
+    this->group_done.wait(g, [&]() {
+      return group->num_pending == 0;
+    });
+  }
+
+private:
+  struct Item {
+    string filename;
+    string data;
+    unique_ptr<Image> img; // If not null, data is unused
+    ImageEncodingOptions image_options;
+    size_t size;
+    // If the format isn't WAV, data is a WAV file to be converted
+    AudioEncodingOptions audio_options = AudioEncodingOptions();
+    shared_ptr<WriteGroup> group = nullptr;
+  };
+
+  shared_ptr<OutputSink> sink;
+  size_t max_queued_bytes;
+  mutex lock;
+  condition_variable items_available;
+  condition_variable space_available;
+  condition_variable queue_empty;
+  condition_variable group_done;
+  deque<Item> queue;
+  size_t queued_bytes; // Includes items being written
+  size_t num_writing;
+  bool should_exit;
+  vector<thread> threads;
+
+  void write_to_sink(const string& filename, const string& data) {
+    auto stats = get_decode_stats();
+    uint64_t start_time = stats.get() ? now() : 0;
+    this->sink->write(filename, data);
+    if (stats.get()) {
+      stats->record_stage("write", now() - start_time);
+    }
+  }
+
+  // The encoded size isn't known until the image is encoded, so images are
+  // counted here instead of when they're queued
+  void save_image_recording_stats(const Image& img,
+      const string& filename, const ImageEncodingOptions& options) {
+    auto stats = get_decode_stats();
+    if (stats.get() || !this->sink->is_file_tree()) {
+      uint64_t start_time = stats.get() ? now() : 0;
+      string data = encode_image(img, options);
+      if (stats.get()) {
+        stats->record_stage("encode", now() - start_time);
+      }
+      this->write_to_sink(filename, data);
+      if (stats.get()) {
+        stats->record_output(data.size());
+      }
+    } else {
+      save_image(img, filename, options);
+    }
+  }
+
+  void save_audio_recording_stats(const string& wav_data,
+      const string& filename, const AudioEncodingOptions& options) {
+    auto stats = get_decode_stats();
+    uint64_t start_time = stats.get() ? now() : 0;
+    string data = encode_flac_from_wav(wav_data, options);
+    if (stats.get()) {
+      stats->record_stage("encode", now() - start_time);
+    }
+    this->write_to_sink(filename, data);
+    if (stats.get()) {
+      stats->record_output(data.size());
+    }
+  }
+
+  void enqueue(Item&& item) {
+    unique_lock<mutex> g(this->lock);
+    // Items larger than the limit are still accepted when nothing else is
+    // queued, so they don't block forever
+    this->space_available.wait(g, [&]() {
+      return (this->queued_bytes == 0) ||
+          (this->queued_bytes + item.size <= this->max_queued_bytes);
+    });
+    this->queued_bytes += item.size;
+    if (item.group.get()) {
+      item.group->num_pending++;
+    }
+    this->queue.emplace_back(move(item));
+    this->items_available.notify_one();
+  }
+
+  void thread_fn() {
+    unique_lock<mutex> g(this->lock);
+    for (;;) {
+      this->items_available.wait(g, [&]() {
+        return this->should_exit || !this->queue.empty();
+      });
+      if (this->queue.empty()) {
+        return;
+      }
+      Item item = move(this->queue.front());
+      this->queue.pop_front();
+      this->num_writing++;
+      g.unlock();
+
+      try {
+        if (item.img.get()) {
+          this->save_image_recording_stats(*item.img, item.filename, item.image_options);
+        } else if (item.audio_options.format != AudioFormat::WAV) {
+          this->save_audio_recording_stats(item.data, item.filename, item.audio_options);
+        } else {
+          this->write_to_sink(item.filename, item.data);
+        }
+      } catch (const exception& e) {
+        fprintf(stderr, "warning: failed to write %s: %s\n", item.filename.c_str(), e.what());
+      }
+
+      g.lock();
+      this->num_writing--;
+      this->queued_bytes -= item.size;
+      this->space_available.notify_all();
+      if (item.group.get() && (--item.group->num_pending == 0)) {
+        this->group_done.notify_all();
+      }
+      if (this->queue.empty() && (this->num_writing == 0)) {
+        this->queue_empty.notify_all();
+      }
+    }
+  }
+};
+
+
+
+// With --external-preprocessor-processes, the external preprocessor command is
+// started once per process slot and kept running for the whole run, instead of
+// being started once per resource. Each resource is sent to the process's
+// stdin as an ExternalPreprocessorRequestHeader followed by the resource data,
+// and the process must respond on stdout with an
+// ExternalPreprocessorResponseHeader followed by the result (all fields are
+// big-endian). If the status is not zero, the result is an error message and
+// the original data is decoded instead. The process must read each entire
+// request before writing its response. Processes that exit or break the
+// protocol are replaced by a new process for the next resource. This is shared
+// between all threads when --jobs is used.
+struct ExternalPreprocessorRequestHeader {
+  be_uint32_t type;
+  be_int16_t id;
+  be_uint16_t unused;
+  be_uint32_t size;
+} __attribute__((packed));
+
+struct ExternalPreprocessorResponseHeader {
+  be_uint32_t status;
+  be_uint32_t size;
+} __attribute__((packed));
+
+class ExternalPreprocessorPool {
+public:
+  ExternalPreprocessorPool(const vector<string>& command, size_t num_processes)
+    : command(command), num_available(num_processes) { }
+  ExternalPreprocessorPool(const ExternalPreprocessorPool&) = delete;
+  ExternalPreprocessorPool& operator=(const ExternalPreprocessorPool&) = delete;
+  ~ExternalPreprocessorPool() = default;
+
+  struct Result {
+    uint32_t status;
+    string data;
+  };
+
+  // Throws if the process can't be started or doesn't respond correctly
+  Result process(uint32_t type, int16_t id, const string& data) {
+    unique_ptr<Subprocess> proc;
+    {
+      unique_lock<mutex> g(this->lock);
+      this->process_available.wait(g, [&]() { return this->num_available > 0; });
+      this->num_available--;
+      if (!this->idle_processes.empty()) {
+        proc = move(this->idle_processes.back());
+        this->idle_processes.pop_back();
       }
-      dir += token;
-      // dir can be / if filename is an absolute path; just skip it
-      if (dir != "/" && !isdir(dir)) {
-        mkdir(dir.c_str(), 0777);
+    }
+
+    try {
+      if (!proc.get()) {
+        proc.reset(new Subprocess(this->command, -1, -1, fileno(stderr)));
       }
+
+      ExternalPreprocessorRequestHeader req;
+      req.type = type;
+      req.id = id;
+      req.unused = 0;
+      req.size = data.size();
+      writex(proc->stdin_fd(), &req, sizeof(req));
+      writex(proc->stdin_fd(), data);
+
+      ExternalPreprocessorResponseHeader resp;
+      readx(proc->stdout_fd(), &resp, sizeof(resp));
+      Result ret = {resp.status, readx(proc->stdout_fd(), resp.size)};
+      this->release(move(proc));
+      return ret;
+
+    } catch (const exception&) {
+      // The process is in an unknown state, so it's killed (by ~Subprocess)
+      // instead of being reused
+      this->release(nullptr);
+      throw;
+    }
+  }
+
+private:
+  vector<string> command;
+  mutex lock;
+  condition_variable process_available;
+  vector<unique_ptr<Subprocess>> idle_processes;
+  size_t num_available; // Idle processes and slots with no process yet
+
+  void release(unique_ptr<Subprocess>&& proc) {
+    lock_guard<mutex> g(this->lock);
+    if (proc.get()) {
+      this->idle_processes.emplace_back(move(proc));
     }
+    this->num_available++;
+    this->process_available.notify_one();
+  }
+};
+
+
+
+class ResourceExporter {
+private:
+  void ensure_directories_exist(const string& filename) {
+    this->output_writer->ensure_directories_exist(filename);
   }
 
   string output_filename(
@@ -198,8 +929,9 @@ private:
       const string& data) {
     string filename = this->output_filename(base_filename, res, after);
     this->ensure_directories_exist(filename);
-    save_file(filename.c_str(), data);
-    fprintf(stderr, "... %s\n", filename.c_str());
+    this->output_writer->write(filename, data, this->write_group);
+    this->record_output(after, filename);
+    fprintf(this->log_stream, "... %s\n", filename.c_str());
   }
 
   void write_decoded_data(
@@ -207,10 +939,33 @@ private:
       shared_ptr<const ResourceFile::Resource> res,
       const string& after,
       const Image& img) {
+    string image_after = filename_for_image_format(after, this->image_options.format);
+    string filename = this->output_filename(base_filename, res, image_after);
+    this->ensure_directories_exist(filename);
+    this->output_writer->write(filename, img, this->image_options, this->write_group);
+    this->record_output(image_after, filename);
+    fprintf(this->log_stream, "... %s\n", filename.c_str());
+  }
+
+  AudioEncodingOptions effective_audio_options() const {
+    AudioEncodingOptions ret = this->audio_options;
+    // Files are already processed in parallel if num_jobs > 1
+    ret.flac_threads = (this->num_jobs == 1) ? 0 : 1;
+    return ret;
+  }
+
+  // wav_data is converted to the selected audio format
+  void write_decoded_audio(
+      const string& base_filename,
+      shared_ptr<const ResourceFile::Resource> res,
+      const string& wav_data) {
+    string after = filename_for_audio_format(".wav", this->audio_options.format);
     string filename = this->output_filename(base_filename, res, after);
     this->ensure_directories_exist(filename);
-    img.save(filename.c_str(), Image::Format::WINDOWS_BITMAP);
-    fprintf(stderr, "... %s\n", filename.c_str());
+    this->output_writer->write_audio(filename, wav_data, this->effective_audio_options(),
+        this->write_group);
+    this->record_output(after, filename);
+    fprintf(this->log_stream, "... %s\n", filename.c_str());
   }
 
   void write_decoded_TMPL(
@@ -726,58 +1481,144 @@ private:
     }
   }
 
+  // Sounds are written to the output file as they're decoded, so long sounds
+  // don't have to be entirely decoded in memory first. Archives can't be
+  // written a piece at a time, so when writing to an archive, the sound is
+  // collected in memory and written all at once instead. If another audio
+  // format is selected, the WAV data is converted as it's decoded.
+  void write_decoded_sound(
+      const string& base_filename,
+      shared_ptr<const ResourceFile::Resource> res,
+      function<void(const ResourceFile::SoundBeginFn&, const ResourceFile::SoundWriteFn&)> stream_fn) {
+    bool to_file = this->output_writer->get_sink()->is_file_tree();
+    string filename;
+    string after;
+    FILE* f = nullptr;
+    char* buffer_data = nullptr;
+    size_t buffer_size = 0;
+    size_t bytes_written = 0;
+    unique_ptr<WAVToFLACConverter> converter;
+    auto write_output = [&](const void* data, size_t size) {
+      fwritex(f, data, size);
+      bytes_written += size;
+    };
+    try {
+      stream_fn([&](const ResourceFile::DecodedSoundResource& metadata) {
+        if (metadata.is_mp3) {
+          after = ".mp3";
+        } else {
+          after = filename_for_audio_format(".wav", this->audio_options.format);
+          if (this->audio_options.format == AudioFormat::FLAC) {
+            converter = make_unique<WAVToFLACConverter>(this->effective_audio_options(), write_output);
+          }
+        }
+        filename = this->output_filename(base_filename, res, after);
+        this->ensure_directories_exist(filename);
+        if (to_file) {
+          f = fopen_unique(filename, "wb").release();
+        } else if (!(f = open_memstream(&buffer_data, &buffer_size))) {
+          throw runtime_error("cannot create output buffer");
+        }
+      }, [&](const void* data, size_t size) {
+        if (converter) {
+          converter->write(data, size);
+        } else {
+          write_output(data, size);
+        }
+      });
+      if (converter) {
+        converter->finish();
+      }
+    } catch (const exception&) {
+      // Don't leave a truncated file behind if decoding fails partway through
+      if (f) {
+        fclose(f);
+        if (to_file) {
+          remove(filename.c_str());
+        }
+      }
+      free(buffer_data);
+      throw;
+    }
+    if (f) {
+      fclose(f);
+      if (to_file) {
+        auto stats = get_decode_stats();
+        if (stats.get()) {
+          stats->record_output(bytes_written);
+        }
+      } else {
+        string data(buffer_data, buffer_size);
+        free(buffer_data);
+        this->output_writer->write(filename, data, this->write_group);
+      }
+      this->record_output(after, filename);
+      fprintf(this->log_stream, "... %s\n", filename.c_str());
+    }
+  }
+
   void write_decoded_snd(
       const string& base_filename,
       shared_ptr<const ResourceFile::Resource> res) {
-    auto decoded = this->current_rf->decode_snd(res);
-    write_decoded_data(base_filename, res,
-        decoded.is_mp3 ? ".mp3" : ".wav", decoded.data);
+    this->write_decoded_sound(base_filename, res, [&](
+        const ResourceFile::SoundBeginFn& begin_fn,
+        const ResourceFile::SoundWriteFn& write_fn) {
+      this->current_rf->stream_snd(res, begin_fn, write_fn);
+    });
   }
 
   void write_decoded_csnd(
       const string& base_filename,
       shared_ptr<const ResourceFile::Resource> res) {
-    auto decoded = this->current_rf->decode_csnd(res);
-    write_decoded_data(base_filename, res,
-        decoded.is_mp3 ? ".mp3" : ".wav", decoded.data);
+    this->write_decoded_sound(base_filename, res, [&](
+        const ResourceFile::SoundBeginFn& begin_fn,
+        const ResourceFile::SoundWriteFn& write_fn) {
+      this->current_rf->stream_csnd(res, begin_fn, write_fn);
+    });
   }
 
   void write_decoded_esnd(
       const string& base_filename,
       shared_ptr<const ResourceFile::Resource> res) {
-    auto decoded = this->current_rf->decode_esnd(res);
-    write_decoded_data(base_filename, res,
-        decoded.is_mp3 ? ".mp3" : ".wav", decoded.data);
+    this->write_decoded_sound(base_filename, res, [&](
+        const ResourceFile::SoundBeginFn& begin_fn,
+        const ResourceFile::SoundWriteFn& write_fn) {
+      this->current_rf->stream_esnd(res, begin_fn, write_fn);
+    });
   }
 
   void write_decoded_ESnd(
       const string& base_filename,
       shared_ptr<const ResourceFile::Resource> res) {
-    auto decoded = this->current_rf->decode_ESnd(res);
-    write_decoded_data(base_filename, res,
-        decoded.is_mp3 ? ".mp3" : ".wav", decoded.data);
+    this->write_decoded_sound(base_filename, res, [&](
+        const ResourceFile::SoundBeginFn& begin_fn,
+        const ResourceFile::SoundWriteFn& write_fn) {
+      this->current_rf->stream_ESnd(res, begin_fn, write_fn);
+    });
   }
 
   void write_decoded_Ysnd(
       const string& base_filename,
       shared_ptr<const ResourceFile::Resource> res) {
-    auto decoded = this->current_rf->decode_Ysnd(res);
-    write_decoded_data(base_filename, res,
-        decoded.is_mp3 ? ".mp3" : ".wav", decoded.data);
+    this->write_decoded_sound(base_filename, res, [&](
+        const ResourceFile::SoundBeginFn& begin_fn,
+        const ResourceFile::SoundWriteFn& write_fn) {
+      this->current_rf->stream_Ysnd(res, begin_fn, write_fn);
+    });
   }
 
   void write_decoded_SMSD(
       const string& base_filename,
       shared_ptr<const ResourceFile::Resource> res) {
     string decoded = this->current_rf->decode_SMSD(res);
-    write_decoded_data(base_filename, res, ".wav", decoded);
+    write_decoded_audio(base_filename, res, decoded);
   }
 
   void write_decoded_SOUN(
       const string& base_filename,
       shared_ptr<const ResourceFile::Resource> res) {
     string decoded = this->current_rf->decode_SOUN(res);
-    write_decoded_data(base_filename, res, ".wav", decoded);
+    write_decoded_audio(base_filename, res, decoded);
   }
 
   void write_decoded_cmid(
@@ -807,10 +1648,8 @@ private:
     auto decoded = this->current_rf->decode_FONT(res);
 
     {
-      string description_filename = this->output_filename(base_filename, res, "_description.txt");
-      this->ensure_directories_exist(description_filename);
-      auto f = fopen_unique(description_filename, "wt");
-      fprintf(f.get(), "\
+      string description = capture_stream_output([&](FILE* f) {
+        fprintf(f, "\
   # source_bit_depth = %hhu (%s color table)\n\
   # dynamic: %s\n\
   # has non-black colors: %s\n\
@@ -822,36 +1661,36 @@ private:
   # maximum ascent: %hd\n\
   # maximum descent: %hd\n\
   # leading: %hd\n",
-          decoded.source_bit_depth,
-          decoded.color_table.empty() ? "no" : "has",
-          decoded.is_dynamic ? "yes" : "no",
-          decoded.has_non_black_colors ? "yes" : "no",
-          decoded.fixed_width ? "yes" : "no",
-          decoded.first_char,
-          decoded.last_char,
-          decoded.max_width,
-          decoded.max_kerning,
-          decoded.rect_width,
-          decoded.rect_height,
-          decoded.max_ascent,
-          decoded.max_descent,
-          decoded.leading);
-
-      for (const auto& glyph : decoded.glyphs) {
-        if (isprint(glyph.ch)) {
-          fprintf(f.get(), "\n# glyph %02hX (%c)\n", glyph.ch, glyph.ch);
-        } else {
-          fprintf(f.get(), "\n# glyph %02hX\n", glyph.ch);
+            decoded.source_bit_depth,
+            decoded.color_table.empty() ? "no" : "has",
+            decoded.is_dynamic ? "yes" : "no",
+            decoded.has_non_black_colors ? "yes" : "no",
+            decoded.fixed_width ? "yes" : "no",
+            decoded.first_char,
+            decoded.last_char,
+            decoded.max_width,
+            decoded.max_kerning,
+            decoded.rect_width,
+            decoded.rect_height,
+            decoded.max_ascent,
+            decoded.max_descent,
+            decoded.leading);
+
+        for (const auto& glyph : decoded.glyphs) {
+          if (isprint(glyph.ch)) {
+            fprintf(f, "\n# glyph %02hX (%c)\n", glyph.ch, glyph.ch);
+          } else {
+            fprintf(f, "\n# glyph %02hX\n", glyph.ch);
+          }
+          fprintf(f, "#   bitmap offset: %hu; width: %hu\n", glyph.bitmap_offset, glyph.bitmap_width);
+          fprintf(f, "#   character offset: %hhd; width: %hhu\n", glyph.offset, glyph.width);
         }
-        fprintf(f.get(), "#   bitmap offset: %hu; width: %hu\n", glyph.bitmap_offset, glyph.bitmap_width);
-        fprintf(f.get(), "#   character offset: %hhd; width: %hhu\n", glyph.offset, glyph.width);
-      }
-
-      fprintf(f.get(), "\n# missing glyph\n");
-      fprintf(f.get(), "#   bitmap offset: %hu; width: %hu\n", decoded.missing_glyph.bitmap_offset, decoded.missing_glyph.bitmap_width);
-      fprintf(f.get(), "#   character offset: %hhd; width: %hhu\n", decoded.missing_glyph.offset, decoded.missing_glyph.width);
 
-      fprintf(stderr, "... %s\n", description_filename.c_str());
+        fprintf(f, "\n# missing glyph\n");
+        fprintf(f, "#   bitmap offset: %hu; width: %hu\n", decoded.missing_glyph.bitmap_offset, decoded.missing_glyph.bitmap_width);
+        fprintf(f, "#   character offset: %hhd; width: %hhu\n", decoded.missing_glyph.offset, decoded.missing_glyph.width);
+      });
+      this->write_decoded_data(base_filename, res, "_description.txt", description);
     }
 
     if (decoded.missing_glyph.img.get_width()) {
@@ -865,6 +1704,27 @@ private:
       string after = string_printf("_glyph_%02zX.bmp", decoded.first_char + x);
       write_decoded_data(base_filename, res, after, decoded.glyphs[x].img);
     }
+
+    // Render all of the font's characters, 16 per line, in a sample image
+    GlyphAtlas atlas(decoded);
+    vector<GlyphAtlas::TextRun> runs;
+    size_t sample_width = 0;
+    for (size_t ch = decoded.first_char; ch <= decoded.last_char; ch += 16) {
+      string line;
+      for (size_t z = ch; (z < ch + 16) && (z <= decoded.last_char); z++) {
+        line.push_back(z);
+      }
+      sample_width = max<size_t>(sample_width, atlas.text_width(line));
+      runs.emplace_back(GlyphAtlas::TextRun{
+          4, static_cast<ssize_t>(4 + atlas.get_ascent() + runs.size() * atlas.line_height()),
+          move(line), 0x000000FF});
+    }
+    if (sample_width > 0) {
+      Image sample(sample_width + 8, runs.size() * atlas.line_height() + 8);
+      sample.clear(0xFFFFFFFF);
+      atlas.draw_text_runs(sample, runs);
+      write_decoded_data(base_filename, res, "_sample.bmp", sample);
+    }
   }
 
   string generate_text_for_cfrg(const vector<ResourceFile::DecodedCodeFragmentEntry>& entries) {
@@ -1032,13 +1892,15 @@ private:
       shared_ptr<const ResourceFile::Resource> res) {
     auto decoded = this->current_rf->decode_finf(res);
 
+    // Font names come from the file's own family resources when it has them
+    GlyphAtlasCache fonts(*this->current_rf);
     string disassembly;
     for (size_t x = 0; x < decoded.size(); x++) {
       const auto& finf = decoded[x];
 
       string font_id_str = string_printf("%hd", finf.font_id);
-      const char* font_name = name_for_font_id(finf.font_id);
-      if (font_name) {
+      string font_name = fonts.name_for_font_id(finf.font_id);
+      if (!font_name.empty()) {
         font_id_str += " (";
         font_id_str += font_name;
         font_id_str += ")";
@@ -1105,6 +1967,173 @@ private:
     write_decoded_data(base_filename, res, ".txt", disassembly);
   }
 
+  // Shared state for disassembling all the CODE segments in a file. CODE 0 is
+  // decoded only once, and its jump table is used to label every segment's
+  // exported entry points and to annotate calls through the jump table to
+  // other segments. When possible, all the segments are disassembled together
+  // on disassembly_threads threads the first time any of them is exported;
+  // write_decoded_CODE then just writes each segment's result.
+  struct CODEApplication {
+    bool has_code0 = false;
+    ResourceFile::DecodedCode0Resource code0;
+    // Exported entry point labels for each segment, by segment ID
+    unordered_map<int16_t, multimap<uint32_t, string>> segment_labels;
+    // Results of the parallel pass, by segment ID. Segments that failed to
+    // decode have an entry in errors instead.
+    unordered_map<int16_t, string> disassemblies;
+    unordered_map<int16_t, string> errors;
+  };
+
+  CODEApplication& get_CODE_application(uint32_t type) {
+    auto it = this->code_applications.find(type);
+    if (it != this->code_applications.end()) {
+      return it->second;
+    }
+
+    auto& app = this->code_applications[type];
+    try {
+      app.code0 = this->current_rf->decode_CODE_0(0, type);
+      app.has_code0 = true;
+      for (size_t x = 0; x < app.code0.jump_table.size(); x++) {
+        const auto& e = app.code0.jump_table[x];
+        if (e.code_resource_id || e.offset) {
+          app.segment_labels[e.code_resource_id].emplace(
+              e.offset, string_printf("export_%zu", x));
+        }
+      }
+    } catch (const exception&) { }
+
+    // In incremental mode, unchanged segments aren't exported at all, so
+    // disassembling them all up front could be wasted work. Otherwise, every
+    // segment that passes the filters will be exported, so do them all now.
+    // The same goes for runs with a preprocessor, since it may change the
+    // segments' data before they're exported.
+    if (this->manifest.get() || !this->external_preprocessor_command.empty() ||
+        this->internal_preprocessor || this->internal_preprocessor_auto) {
+      return app;
+    }
+
+    vector<int16_t> segment_ids;
+    vector<ResourceFile::DecodedCodeResource> segments;
+    for (int16_t id : this->current_rf->all_resources_of_type(type)) {
+      if ((id == 0) || !this->should_export(type, id)) {
+        continue;
+      }
+      // Decoding modifies the ResourceFile, so it's done here on one thread
+      try {
+        auto res = this->current_rf->get_resource(type, id, this->decompress_flags);
+        segments.emplace_back(this->current_rf->decode_CODE(res));
+        segment_ids.emplace_back(id);
+      } catch (const exception& e) {
+        app.errors.emplace(id, e.what());
+      }
+    }
+
+    vector<string> results(segments.size());
+    vector<string> result_errors(segments.size());
+    run_parallel_tasks(segments.size(), this->disassembly_threads, [&](size_t z, FILE*) {
+      try {
+        results[z] = this->disassemble_CODE_segment(app, segment_ids[z], segments[z], 1);
+      } catch (const exception& e) {
+        result_errors[z] = e.what();
+      }
+    });
+    for (size_t z = 0; z < segments.size(); z++) {
+      if (result_errors[z].empty()) {
+        app.disassemblies.emplace(segment_ids[z], move(results[z]));
+      } else {
+        app.errors.emplace(segment_ids[z], move(result_errors[z]));
+      }
+    }
+    return app;
+  }
+
+  // Lists the places in a segment that refer to jump table entries (via
+  // JSR/JMP/PEA d16(A5)), along with the segment and offset that each entry
+  // refers to. This is a linear scan, so data in the segment that happens to
+  // look like one of these instructions is listed too.
+  static string describe_jump_table_references(const CODEApplication& app,
+      int16_t segment_id, const ResourceFile::DecodedCodeResource& decoded) {
+    if (!app.has_code0) {
+      return "";
+    }
+    const auto& jump_table = app.code0.jump_table;
+    string ret;
+    StringReader r(decoded.code.data(), decoded.code.size());
+    for (size_t offset = 0; offset + 4 <= decoded.code.size(); offset += 2) {
+      uint16_t opcode = r.pget_u16b(offset);
+      const char* op_name;
+      if (opcode == 0x4EAD) {
+        op_name = "jsr";
+      } else if (opcode == 0x4EED) {
+        op_name = "jmp";
+      } else if (opcode == 0x487D) {
+        op_name = "pea";
+      } else {
+        continue;
+      }
+      int16_t a5_offset = r.pget_u16b(offset + 2);
+      if ((a5_offset < 0x22) || ((a5_offset - 0x22) & 7)) {
+        continue;
+      }
+      size_t index = (a5_offset - 0x22) >> 3;
+      if (index >= jump_table.size()) {
+        continue;
+      }
+      const auto& e = jump_table[index];
+      ret += string_printf("#   %08zX: %s export_%zu [A5 + 0x%hX] -> CODE %hd offset 0x%hX%s\n",
+          offset, op_name, index, a5_offset, e.code_resource_id, e.offset,
+          (e.code_resource_id == segment_id) ? " (this segment)" : "");
+    }
+    if (!ret.empty()) {
+      ret = "# jump table references:\n" + ret;
+    }
+    return ret;
+  }
+
+  string disassemble_CODE_segment(const CODEApplication& app, int16_t segment_id,
+      const ResourceFile::DecodedCodeResource& decoded, size_t num_threads) const {
+    string disassembly;
+    if (decoded.first_jump_table_entry < 0) {
+      disassembly += "# far model CODE resource\n";
+      disassembly += string_printf("# near model jump table entries starting at A5 + 0x%08X (%u of them)\n",
+          decoded.near_entry_start_a5_offset, decoded.near_entry_count);
+      disassembly += string_printf("# far model jump table entries starting at A5 + 0x%08X (%u of them)\n",
+          decoded.far_entry_start_a5_offset, decoded.far_entry_count);
+      disassembly += string_printf("# A5 relocation data at 0x%08X\n", decoded.a5_relocation_data_offset);
+      for (uint32_t addr : decoded.a5_relocation_addresses) {
+        disassembly += string_printf("#   A5 relocation at %08X\n", addr);
+      }
+      disassembly += string_printf("# A5 is 0x%08X\n", decoded.a5);
+      disassembly += string_printf("# PC relocation data at 0x%08X\n", decoded.pc_relocation_data_offset);
+      for (uint32_t addr : decoded.pc_relocation_addresses) {
+        disassembly += string_printf("#   PC relocation at %08X\n", addr);
+      }
+      disassembly += string_printf("# load address is 0x%08X\n", decoded.load_address);
+    } else {
+      disassembly += "# near model CODE resource\n";
+      if (decoded.num_jump_table_entries == 0) {
+        disassembly += string_printf("# this CODE claims to have no jump table entries (but starts at %04X)\n", decoded.first_jump_table_entry);
+      } else {
+        disassembly += string_printf("# jump table entries: %d-%d (%hu of them)\n",
+            decoded.first_jump_table_entry,
+            decoded.first_jump_table_entry + decoded.num_jump_table_entries - 1,
+            decoded.num_jump_table_entries);
+      }
+    }
+    disassembly += describe_jump_table_references(app, segment_id, decoded);
+
+    LabelIndex labels;
+    auto labels_it = app.segment_labels.find(segment_id);
+    if (labels_it != app.segment_labels.end()) {
+      labels = LabelIndex(labels_it->second);
+    }
+    DisassemblyOutput out(move(disassembly));
+    M68KEmulator::disassemble(out, decoded.code.data(), decoded.code.size(), 0,
+        &labels, num_threads);
+    return out.take();
+  }
+
   void write_decoded_CODE(
       const string& base_filename,
       shared_ptr<const ResourceFile::Resource> res) {
@@ -1122,49 +2151,24 @@ private:
       }
 
     } else {
-      auto decoded = this->current_rf->decode_CODE(res);
-
-      // attempt to decode CODE 0 to get the exported label offsets
-      multimap<uint32_t, string> labels;
-      try {
-        auto code0_data = this->current_rf->decode_CODE_0(0, res->type);
-        for (size_t x = 0; x < code0_data.jump_table.size(); x++) {
-          const auto& e = code0_data.jump_table[x];
-          if (e.code_resource_id == res->id) {
-            labels.emplace(e.offset, string_printf("export_%zu", x));
-          }
-        }
-      } catch (const exception&) { }
-
-      if (decoded.first_jump_table_entry < 0) {
-        disassembly += "# far model CODE resource\n";
-        disassembly += string_printf("# near model jump table entries starting at A5 + 0x%08X (%u of them)\n",
-            decoded.near_entry_start_a5_offset, decoded.near_entry_count);
-        disassembly += string_printf("# far model jump table entries starting at A5 + 0x%08X (%u of them)\n",
-            decoded.far_entry_start_a5_offset, decoded.far_entry_count);
-        disassembly += string_printf("# A5 relocation data at 0x%08X\n", decoded.a5_relocation_data_offset);
-        for (uint32_t addr : decoded.a5_relocation_addresses) {
-          disassembly += string_printf("#   A5 relocation at %08X\n", addr);
-        }
-        disassembly += string_printf("# A5 is 0x%08X\n", decoded.a5);
-        disassembly += string_printf("# PC relocation data at 0x%08X\n", decoded.pc_relocation_data_offset);
-        for (uint32_t addr : decoded.pc_relocation_addresses) {
-          disassembly += string_printf("#   PC relocation at %08X\n", addr);
-        }
-        disassembly += string_printf("# load address is 0x%08X\n", decoded.load_address);
+      auto& app = this->get_CODE_application(res->type);
+      auto disassembly_it = app.disassemblies.find(res->id);
+      auto error_it = app.errors.find(res->id);
+      if (disassembly_it != app.disassemblies.end()) {
+        // Each segment is written only once, so the result isn't kept
+        disassembly = move(disassembly_it->second);
+        app.disassemblies.erase(disassembly_it);
+      } else if (error_it != app.errors.end()) {
+        string error = move(error_it->second);
+        app.errors.erase(error_it);
+        throw runtime_error(error);
       } else {
-        disassembly += "# near model CODE resource\n";
-        if (decoded.num_jump_table_entries == 0) {
-          disassembly += string_printf("# this CODE claims to have no jump table entries (but starts at %04X)\n", decoded.first_jump_table_entry);
-        } else {
-          disassembly += string_printf("# jump table entries: %d-%d (%hu of them)\n",
-              decoded.first_jump_table_entry,
-              decoded.first_jump_table_entry + decoded.num_jump_table_entries - 1,
-              decoded.num_jump_table_entries);
-        }
+        // Not done by the parallel pass (e.g. because this is an incremental
+        // run, or the segment was exported individually)
+        auto decoded = this->current_rf->decode_CODE(res);
+        disassembly = this->disassemble_CODE_segment(
+            app, res->id, decoded, this->disassembly_threads);
       }
-
-      disassembly += M68KEmulator::disassemble(decoded.code.data(), decoded.code.size(), 0, &labels);
     }
 
     write_decoded_data(base_filename, res, ".txt", disassembly);
@@ -1233,9 +2237,11 @@ private:
     add_label(decoded.status_label, "status");
     add_label(decoded.close_label, "close");
 
-    disassembly += M68KEmulator::disassemble(decoded.code.data(), decoded.code.size(), 0, &labels);
+    LabelIndex label_index(labels);
+    DisassemblyOutput out(move(disassembly));
+    M68KEmulator::disassemble(out, decoded.code.data(), decoded.code.size(), 0, &label_index);
 
-    write_decoded_data(base_filename, res, ".txt", disassembly);
+    write_decoded_data(base_filename, res, ".txt", out.str());
   }
 
   void write_decoded_dcmp(
@@ -1283,25 +2289,23 @@ private:
       const string& base_filename,
       shared_ptr<const ResourceFile::Resource> res) {
     auto peff = this->current_rf->decode_peff(res);
-    string filename = this->output_filename(base_filename, res, ".txt");
-    this->ensure_directories_exist(filename);
-    auto f = fopen_unique(filename, "wt");
-    peff.print(f.get());
-    fprintf(stderr, "... %s\n", filename.c_str());
+    string text = capture_stream_output([&](FILE* f) {
+      peff.print(f, nullptr, false, this->disassembly_threads);
+    });
+    this->write_decoded_data(base_filename, res, ".txt", text);
   }
 
   void write_decoded_expt_nsrd(
       const string& base_filename,
       shared_ptr<const ResourceFile::Resource> res) {
     auto decoded = (res->type == RESOURCE_TYPE_expt) ? this->current_rf->decode_expt(res) : this->current_rf->decode_nsrd(res);
-    string filename = this->output_filename(base_filename, res, ".txt");
-    this->ensure_directories_exist(filename);
-    auto f = fopen_unique(filename, "wt");
-    fputs("Mixed-mode manager header:\n", f.get());
-    print_data(f.get(), decoded.header);
-    fputc('\n', f.get());
-    decoded.peff.print(f.get());
-    fprintf(stderr, "... %s\n", filename.c_str());
+    string text = capture_stream_output([&](FILE* f) {
+      fputs("Mixed-mode manager header:\n", f);
+      print_data(f, decoded.header);
+      fputc('\n', f);
+      decoded.peff.print(f, nullptr, false, this->disassembly_threads);
+    });
+    this->write_decoded_data(base_filename, res, ".txt", text);
   }
 
   void write_decoded_inline_68k_or_peff(
@@ -1386,8 +2390,9 @@ private:
       uint32_t snd_sample_rate = 22050;
       bool snd_is_mp3 = false;
       try {
-        // TODO: This is dumb; we only need the sample rate and base note; find
-        // a way to not have to re-decode the sound.
+        // We only need the sample rate and base note here. ResourceFile
+        // remembers the metadata, so sounds shared by many instruments and
+        // SONGs are only decoded once.
         ResourceFile::DecodedSoundResource decoded_snd;
         if (rgn.snd_type == RESOURCE_TYPE_esnd) {
           decoded_snd = this->current_rf->decode_esnd(rgn.snd_id, rgn.snd_type, true);
@@ -1403,12 +2408,12 @@ private:
         snd_is_mp3 = decoded_snd.is_mp3;
 
       } catch (const exception& e) {
-        fprintf(stderr, "warning: failed to get sound metadata for instrument %" PRId32 " region %hhX-%hhX from snd/csnd/esnd %hu: %s\n",
+        fprintf(this->log_stream, "warning: failed to get sound metadata for instrument %" PRId32 " region %hhX-%hhX from snd/csnd/esnd %hu: %s\n",
             id, rgn.key_low, rgn.key_high, rgn.snd_id, e.what());
       }
 
       string snd_filename = basename(this->output_filename(base_filename, snd_res,
-          snd_is_mp3 ? ".mp3" : ".wav"));
+          snd_is_mp3 ? ".mp3" : filename_for_audio_format(".wav", this->audio_options.format)));
       key_region_dict.emplace("filename", new JSONObject(snd_filename));
 
       uint8_t base_note;
@@ -1496,7 +2501,7 @@ private:
           instruments.emplace_back(generate_json_for_INST(
               base_filename, it.first, this->current_rf->decode_INST(it.second), s->semitone_shift));
         } catch (const exception& e) {
-          fprintf(stderr, "warning: failed to add instrument %hu from INST %hu: %s\n",
+          fprintf(this->log_stream, "warning: failed to add instrument %hu from INST %hu: %s\n",
               it.first, it.second, e.what());
         }
       }
@@ -1509,7 +2514,7 @@ private:
         instruments.emplace_back(generate_json_for_INST(
             base_filename, id, this->current_rf->decode_INST(id), s ? s->semitone_shift : 0));
       } catch (const exception& e) {
-        fprintf(stderr, "warning: failed to add instrument %hu: %s\n", id, e.what());
+        fprintf(this->log_stream, "warning: failed to add instrument %hu: %s\n", id, e.what());
       }
     }
 
@@ -1591,6 +2596,32 @@ private:
     auto song = this->current_rf->decode_SONG(res);
     auto json = generate_json_for_SONG(base_filename, &song);
     write_decoded_data(base_filename, res, "_smssynth_env.json", json->format());
+
+    if (this->render_songs) {
+      try {
+        SongRenderer::Options options;
+        options.sample_rate = this->song_sample_rate;
+        // Files are already processed in parallel if num_jobs > 1
+        options.num_threads = (this->num_jobs == 1) ? 0 : 1;
+        SongRenderer renderer(*this->current_rf, song, options);
+        for (const auto& warning : renderer.get_warnings()) {
+          fprintf(this->log_stream, "warning: %s\n", warning.c_str());
+        }
+        // Rendered songs can be very large, so they're written as they're
+        // rendered, like sounds are
+        this->write_decoded_sound(base_filename, res, [&](
+            const ResourceFile::SoundBeginFn& begin_fn, const ResourceFile::SoundWriteFn& write_fn) {
+          ResourceFile::DecodedSoundResource metadata;
+          metadata.is_mp3 = false;
+          metadata.sample_rate = renderer.sample_rate();
+          metadata.base_note = 0x3C;
+          begin_fn(metadata);
+          renderer.render_wav(write_fn);
+        });
+      } catch (const exception& e) {
+        fprintf(this->log_stream, "warning: failed to render song: %s\n", e.what());
+      }
+    }
   }
 
   void write_decoded_Tune(
@@ -1609,6 +2640,101 @@ private:
   static const unordered_map<uint32_t, resource_decode_fn> default_type_to_decode_fn;
   unordered_map<uint32_t, resource_decode_fn> type_to_decode_fn;
   static const unordered_map<uint32_t, const char*> type_to_ext;
+  static const unordered_set<uint32_t> cacheable_decoder_types;
+
+  void record_output(const string& after, const string& filename) {
+    this->recorded_outputs.emplace_back(after, filename);
+  }
+
+  // Calls decode_fn, which writes the resource's decoded output files. If the
+  // decoded output cache is enabled and an identical resource has already been
+  // decoded in the same context, the earlier outputs are written again (or
+  // linked to) instead.
+  void decode_with_cache(
+      const string& base_filename,
+      shared_ptr<const ResourceFile::Resource> res,
+      const string& data,
+      const string& context,
+      const function<void()>& decode_fn) {
+    if (!this->decoded_output_cache.get()) {
+      decode_fn();
+      return;
+    }
+
+    auto entry = this->decoded_output_cache->get(res->type, context, data);
+    if (entry.get()) {
+      for (const auto& output : entry->outputs) {
+        string filename = this->output_filename(base_filename, res, output.after);
+        this->ensure_directories_exist(filename);
+        if (!this->hardlink_cached_outputs ||
+            (link(output.filename.c_str(), filename.c_str()) != 0)) {
+          this->output_writer->write(filename, output.data);
+        }
+        this->record_output(output.after, filename);
+        fprintf(this->log_stream, "... %s\n", filename.c_str());
+      }
+      return;
+    }
+
+    // The outputs are read back below (and may be hardlinked to later), so
+    // they must actually exist before this returns. Other jobs share the output
+    // writer, so only this resource's writes are waited for.
+    size_t outputs_start = this->recorded_outputs.size();
+    auto prev_write_group = this->write_group;
+    this->write_group = make_shared<OutputWriter::WriteGroup>();
+    try {
+      decode_fn();
+    } catch (const exception&) {
+      this->write_group = prev_write_group;
+      throw;
+    }
+    auto write_group = move(this->write_group);
+    this->write_group = prev_write_group;
+    this->output_writer->wait(write_group);
+
+    // Don't read back outputs that are too large to be cached anyway
+    size_t entry_size = data.size();
+    for (size_t z = outputs_start; z < this->recorded_outputs.size(); z++) {
+      struct stat st;
+      if (::stat(this->recorded_outputs[z].second.c_str(), &st) != 0) {
+        return;
+      }
+      entry_size += st.st_size;
+    }
+    if (entry_size > this->decoded_output_cache->get_max_size()) {
+      return;
+    }
+
+    auto new_entry = make_shared<DecodedOutputCache::Entry>();
+    new_entry->type = res->type;
+    new_entry->context = context;
+    new_entry->resource_data = data;
+    for (size_t z = outputs_start; z < this->recorded_outputs.size(); z++) {
+      const auto& it = this->recorded_outputs[z];
+      new_entry->outputs.emplace_back(DecodedOutputCache::Output{
+          it.first, it.second, load_file(it.second)});
+    }
+    this->decoded_output_cache->insert(new_entry);
+  }
+
+  // Checks the type, ID, and name filters. The name filters are checked
+  // without loading (and possibly decompressing) the resource's data.
+  bool should_export(uint32_t type, int16_t id) const {
+    if ((!this->target_types.empty() && !this->target_types.count(type)) ||
+        this->skip_types.count(type)) {
+      return false;
+    }
+    if ((!this->target_ids.empty() && !this->target_ids.count(id)) ||
+        this->skip_ids.count(id)) {
+      return false;
+    }
+    if (this->target_names.empty() && this->skip_names.empty()) {
+      return true;
+    }
+    auto res_metadata = this->current_rf->get_resource_metadata(type, id);
+    return (this->target_names.empty() || this->target_names.count(res_metadata->name)) &&
+        !this->skip_names.count(res_metadata->name);
+  }
 
   bool disassemble_file(const string& filename) {
     // open resource fork if present
@@ -1620,7 +2746,7 @@ private:
     } else if (isfile(filename + RESOURCE_FORK_FILENAME_SHORT_SUFFIX)) {
       resource_fork_filename = filename + RESOURCE_FORK_FILENAME_SHORT_SUFFIX;
     } else {
-      fprintf(stderr, "failed on %s: no resource fork present\n", filename.c_str());
+      fprintf(this->log_stream, "failed on %s: no resource fork present\n", filename.c_str());
       return false;
     }
 
@@ -1629,20 +2755,58 @@ private:
     string base_filename = (last_slash_pos == string::npos) ? filename :
         filename.substr(last_slash_pos + 1);
 
+    // In incremental mode, skip the file entirely if it hasn't changed since
+    // the previous run and all of its outputs still exist
+    const IncrementalManifest::FileEntry* prev_file_entry = nullptr;
+    IncrementalManifest::FileEntry file_entry;
+    if (this->manifest.get()) {
+      struct stat st;
+      if (::stat(resource_fork_filename.c_str(), &st) == 0) {
+        file_entry.mtime = st.st_mtime;
+        file_entry.size = st.st_size;
+      } else {
+        file_entry.mtime = -1;
+        file_entry.size = -1;
+      }
+      prev_file_entry = this->manifest->get_previous(filename);
+      if (prev_file_entry && (file_entry.size >= 0) &&
+          (prev_file_entry->mtime == file_entry.mtime) &&
+          (prev_file_entry->size == file_entry.size) &&
+          prev_file_entry->all_outputs_exist()) {
+        fprintf(this->log_stream, "... unchanged since previous run\n");
+        this->manifest->set_current(filename, IncrementalManifest::FileEntry(*prev_file_entry));
+        return prev_file_entry->exported;
+      }
+    }
+
     // get the resources from the file
     try {
-      this->current_rf.reset(new ResourceFile(this->parse(load_file(resource_fork_filename))));
+      // Resource data is read from the mapped file only when it's decoded, so
+      // skipped resources (e.g. due to --target-type) cost almost nothing
+      auto file = make_shared<MappedFile>(resource_fork_filename);
+      uint64_t parse_start_time = now();
+      if (this->index_cache_directory.empty()) {
+        this->current_rf.reset(new ResourceFile(this->parse(file)));
+      } else {
+        this->current_rf.reset(new ResourceFile(parse_with_sidecar_index(
+            this->index_cache_directory, resource_fork_filename, file, this->index_format)));
+      }
+      auto stats = get_decode_stats();
+      if (stats.get()) {
+        stats->record_stage("parse", now() - parse_start_time);
+      }
+      this->code_applications.clear();
     } catch (const cannot_open_file&) {
-      fprintf(stderr, "failed on %s: cannot open file\n", filename.c_str());
+      fprintf(this->log_stream, "failed on %s: cannot open file\n", filename.c_str());
       return false;
     } catch (const io_error& e) {
-      fprintf(stderr, "failed on %s: cannot read data\n", filename.c_str());
+      fprintf(this->log_stream, "failed on %s: cannot read data\n", filename.c_str());
       return false;
     } catch (const runtime_error& e) {
-      fprintf(stderr, "failed on %s: corrupt resource index (%s)\n", filename.c_str(), e.what());
+      fprintf(this->log_stream, "failed on %s: corrupt resource index (%s)\n", filename.c_str(), e.what());
       return false;
     } catch (const out_of_range& e) {
-      fprintf(stderr, "failed on %s: corrupt resource index\n", filename.c_str());
+      fprintf(this->log_stream, "failed on %s: corrupt resource index\n", filename.c_str());
       return false;
     }
 
@@ -1651,25 +2815,57 @@ private:
       auto resources = this->current_rf->all_resources();
 
       bool has_INST = false;
+      size_t num_unchanged_resources = 0;
       for (const auto& it : resources) {
-        if ((!this->target_types.empty() && !this->target_types.count(it.first)) ||
-            this->skip_types.count(it.first)) {
-          continue;
-        }
-        if ((!this->target_ids.empty() && !this->target_ids.count(it.second)) ||
-            this->skip_ids.count(it.second)) {
+        if (!this->should_export(it.first, it.second)) {
           continue;
         }
+        // The budget covers decompressing the resource and exporting it
+        ResourceBudgetScope budget_scope(this->resource_budget);
+        uint64_t decompress_start_time = now();
         const auto& res = this->current_rf->get_resource(
             it.first, it.second, this->decompress_flags);
-        if ((!this->target_names.empty() && !this->target_names.count(res->name)) ||
-            this->skip_names.count(res->name)) {
+        auto stats = get_decode_stats();
+        if (stats.get()) {
+          stats->record_stage("decompress", now() - decompress_start_time);
+        }
+        if (it.first == RESOURCE_TYPE_INST) {
+          has_INST = true;
+        }
+
+        if (!this->manifest.get()) {
+          ret |= this->export_resource(base_filename.c_str(), res);
           continue;
         }
-        if (it.first == RESOURCE_TYPE_INST) {
-          has_INST = true;
+
+        // Skip resources that are the same as in the previous run, if their
+        // outputs can't have been affected by other changes in the file
+        string res_key = string_printf("%08" PRIX32 ":%hd", it.first, it.second);
+        uint64_t res_hash = IncrementalManifest::hash_resource(*res);
+        if (prev_file_entry && cacheable_decoder_types.count(it.first)) {
+          auto prev_it = prev_file_entry->resources.find(res_key);
+          if ((prev_it != prev_file_entry->resources.end()) &&
+              (prev_it->second.hash == res_hash) &&
+              IncrementalManifest::outputs_exist(prev_it->second.outputs)) {
+            file_entry.resources.emplace(res_key, prev_it->second);
+            ret |= prev_it->second.exported;
+            num_unchanged_resources++;
+            continue;
+          }
+        }
+
+        bool exported = this->export_resource(base_filename.c_str(), res);
+        ret |= exported;
+        auto& res_entry = file_entry.resources[res_key];
+        res_entry.hash = res_hash;
+        res_entry.exported = exported;
+        for (const auto& output : this->recorded_outputs) {
+          res_entry.outputs.emplace_back(output.second);
         }
-        ret |= this->export_resource(base_filename.c_str(), res);
+      }
+      if (num_unchanged_resources) {
+        fprintf(this->log_stream, "... %zu resources unchanged since previous run\n",
+            num_unchanged_resources);
       }
 
       // special case: if we disassembled any INSTs and the save-raw behavior is
@@ -1700,32 +2896,170 @@ private:
 
         try {
           auto json = generate_json_for_SONG(base_filename, nullptr);
-          save_file(json_filename.c_str(), json->format());
-          fprintf(stderr, "... %s\n", json_filename.c_str());
+          this->ensure_directories_exist(json_filename);
+          this->output_writer->write(json_filename, json->format());
+          file_entry.outputs.emplace_back(json_filename);
+          fprintf(this->log_stream, "... %s\n", json_filename.c_str());
 
         } catch (const exception& e) {
-          fprintf(stderr, "failed to write smssynth env template %s: %s\n",
+          fprintf(this->log_stream, "failed to write smssynth env template %s: %s\n",
               json_filename.c_str(), e.what());
         }
       }
 
+      if (this->manifest.get()) {
+        file_entry.exported = ret;
+        this->manifest->set_current(filename, move(file_entry));
+      }
+
     } catch (const exception& e) {
-      fprintf(stderr, "failed on %s: %s\n", filename.c_str(), e.what());
+      fprintf(this->log_stream, "failed on %s: %s\n", filename.c_str(), e.what());
     }
 
+    auto stats = get_decode_stats();
+    if (stats.get() && this->current_rf.get()) {
+      auto& dcmp_cache = this->current_rf->decompressor_cache();
+      stats->record_cache_lookups("decompressor_cache",
+          dcmp_cache.hit_count(), dcmp_cache.miss_count());
+    }
     this->current_rf.reset();
+    this->code_applications.clear();
+    return ret;
+  }
+
+  struct PathTask {
+    string filename;
+    string out_dir;
+    bool is_file;
+    bool ret;
+    // For directories, this is filled in during the traversal; for files, it's
+    // filled in by the worker thread that disassembles the file
+    string log_contents;
+
+    PathTask(const string& filename, const string& out_dir, bool is_file)
+      : filename(filename), out_dir(out_dir), is_file(is_file), ret(false) { }
+  };
+
+  void collect_path_tasks(
+      vector<PathTask>& tasks, const string& filename, const string& out_dir) {
+    if (!isdir(filename)) {
+      tasks.emplace_back(filename, out_dir, true);
+      return;
+    }
+
+    auto& dir_task = tasks.emplace_back(filename, out_dir, false);
+    dir_task.log_contents = string_printf(">>> %s (directory)\n", filename.c_str());
+
+    unordered_set<string> items;
+    try {
+      items = list_directory(filename);
+    } catch (const runtime_error& e) {
+      dir_task.log_contents += string_printf(
+          "warning: can\'t list directory: %s\n", e.what());
+      return;
+    }
+
+    vector<string> sorted_items;
+    sorted_items.insert(sorted_items.end(), items.begin(), items.end());
+    sort(sorted_items.begin(), sorted_items.end());
+
+    size_t last_slash_pos = filename.rfind('/');
+    string base_filename = (last_slash_pos == string::npos) ? filename :
+        filename.substr(last_slash_pos + 1);
+    string sub_out_dir = out_dir.empty()
+        ? base_filename : (out_dir + "/" + base_filename);
+    for (const string& item : sorted_items) {
+      this->collect_path_tasks(tasks, filename + "/" + item, sub_out_dir);
+    }
+  }
+
+  bool disassemble_path_parallel(const string& filename) {
+    // The directory traversal is done up front (and serially) so that the set
+    // of files and their output directories is the same as in the serial
+    // implementation below. Each worker thread then repeatedly claims the next
+    // unprocessed file, so long-running files don't hold up the others. Each
+    // file's log output is buffered and written to stderr in traversal order,
+    // so the log is the same as it would be if only one job were used.
+    vector<PathTask> tasks;
+    this->collect_path_tasks(tasks, filename, this->out_dir);
+
+    atomic<size_t> next_task_index(0);
+    mutex output_lock;
+    vector<bool> task_done(tasks.size(), false);
+    size_t next_output_index = 0;
+
+    auto run_worker = [&]() -> void {
+      // Each worker has its own copy of the exporter, so the per-file state
+      // (current_rf, out_dir, log_stream) isn't shared between threads
+      ResourceExporter task_exporter(*this);
+      for (;;) {
+        size_t task_index = next_task_index++;
+        if (task_index >= tasks.size()) {
+          break;
+        }
+
+        auto& task = tasks[task_index];
+        if (task.is_file) {
+          char* log_data = nullptr;
+          size_t log_size = 0;
+          FILE* log_stream = open_memstream(&log_data, &log_size);
+          if (!log_stream) {
+            // Nothing may escape the worker thread, so this is reported in the
+            // task's log like any other failure
+            task.log_contents = string_printf(">>> %s\nfailed on %s: cannot create log buffer\n",
+                task.filename.c_str(), task.filename.c_str());
+          } else {
+            task_exporter.log_stream = log_stream;
+            task_exporter.out_dir = task.out_dir;
+            fprintf(log_stream, ">>> %s\n", task.filename.c_str());
+            try {
+              TaskLogScope log_scope(log_stream);
+              task.ret = task_exporter.disassemble_file(task.filename);
+            } catch (const exception& e) {
+              fprintf(log_stream, "failed on %s: %s\n", task.filename.c_str(), e.what());
+            }
+            fclose(log_stream);
+            task.log_contents.assign(log_data, log_size);
+            free(log_data);
+          }
+        }
+
+        lock_guard<mutex> g(output_lock);
+        task_done[task_index] = true;
+        while ((next_output_index < tasks.size()) && task_done[next_output_index]) {
+          auto& output_task = tasks[next_output_index];
+          fwritex(this->log_stream, output_task.log_contents);
+          output_task.log_contents.clear();
+          next_output_index++;
+        }
+      }
+    };
+
+    size_t num_threads = min<size_t>(this->num_jobs, tasks.size());
+    vector<thread> threads;
+    for (size_t z = 0; z < num_threads; z++) {
+      threads.emplace_back(run_worker);
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+
+    bool ret = false;
+    for (const auto& task : tasks) {
+      ret |= task.ret;
+    }
     return ret;
   }
 
   bool disassemble_path(const string& filename) {
     if (isdir(filename)) {
-      fprintf(stderr, ">>> %s (directory)\n", filename.c_str());
+      fprintf(this->log_stream, ">>> %s (directory)\n", filename.c_str());
 
       unordered_set<string> items;
       try {
         items = list_directory(filename);
       } catch (const runtime_error& e) {
-        fprintf(stderr, "warning: can\'t list directory: %s\n", e.what());
+        fprintf(this->log_stream, "warning: can\'t list directory: %s\n", e.what());
         return false;
       }
 
@@ -1748,7 +3082,7 @@ private:
       return ret;
 
     } else {
-      fprintf(stderr, ">>> %s\n", filename.c_str());
+      fprintf(this->log_stream, ">>> %s\n", filename.c_str());
       return this->disassemble_file(filename);
     }
   }
@@ -1772,6 +3106,10 @@ public:
     TYPE_FIRST,
     TYPE_FIRST_DIRS,
   };
+  enum class InventoryFormat {
+    NDJSON = 0,
+    TSV,
+  };
 
   ResourceExporter()
     : type_to_decode_fn(default_type_to_decode_fn),
@@ -1779,15 +3117,28 @@ public:
       filename_format(FilenameFormat::STANDARD),
       save_raw(SaveRawBehavior::IfDecodeFails),
       decompress_flags(0),
+      external_preprocessor_processes(0),
+      internal_preprocessor(nullptr),
+      internal_preprocessor_auto(false),
       target_compressed_behavior(TargetCompressedBehavior::Default),
       skip_templates(false),
+      render_songs(false),
+      song_sample_rate(44100),
+      num_jobs(1),
+      disassembly_threads(1),
+      log_stream(stderr),
+      hardlink_cached_outputs(false),
+      incremental(false),
+      output_writer(make_shared<OutputWriter>(make_shared<FileTreeOutputSink>(), 0, 0)),
       index_format(IndexFormat::RESOURCE_FORK),
       parse(parse_resource_fork) { }
+  ResourceExporter(const ResourceExporter&) = default;
   ~ResourceExporter() = default;
 
   bool use_data_fork;
   FilenameFormat filename_format;
   SaveRawBehavior save_raw;
+  ResourceBudget resource_budget;
   uint64_t decompress_flags;
   unordered_set<uint32_t> target_types;
   unordered_set<uint32_t> skip_types;
@@ -1796,17 +3147,96 @@ public:
   unordered_set<string> target_names;
   unordered_set<string> skip_names;
   std::vector<std::string> external_preprocessor_command;
+  // If nonzero, use this many persistent preprocessor processes (see
+  // ExternalPreprocessorPool) instead of one process per resource
+  size_t external_preprocessor_processes;
+  // If not null, resources are decompressed with this codec before decoding
+  // (only if they begin with its magic value, if it has one). If
+  // internal_preprocessor_auto is true, the codec is instead chosen by each
+  // resource's magic value.
+  const DecompressionCodec* internal_preprocessor;
+  bool internal_preprocessor_auto;
   TargetCompressedBehavior target_compressed_behavior;
   bool skip_templates;
+  // If true, SONG resources are also rendered to WAV files with SongRenderer
+  bool render_songs;
+  uint32_t song_sample_rate;
+  // If this is greater than 1, files are disassembled on this many threads
+  size_t num_jobs;
+  // Code resources (CODE and PEFF) are disassembled on this many threads;
+  // this is independent of num_jobs, and 0 means one thread per core
+  size_t disassembly_threads;
+  // If not empty, sidecar indexes for input files are kept in this directory
+  // (see parse_with_sidecar_index)
+  string index_cache_directory;
+  // All log output goes here (stderr by default)
+  FILE* log_stream;
+  // If not null, decoded outputs are kept here and reused for identical
+  // resources in other files
+  shared_ptr<DecodedOutputCache> decoded_output_cache;
+  // If true, outputs reused from the cache are hardlinked to the first file
+  // written with the same contents, if possible
+  bool hardlink_cached_outputs;
+  // If true, disassemble() skips files and resources that haven't changed
+  // since the previous run into the same output directory
+  bool incremental;
+  // Most output files are written through this, so it can be replaced with
+  // one that has writer threads
+  shared_ptr<OutputWriter> output_writer;
+  // Format (and PNG compression level) for decoded images
+  ImageEncodingOptions image_options;
+  // Format for decoded sounds (other than MP3s, which are never converted)
+  AudioEncodingOptions audio_options;
 private:
   string base_out_dir; // Fixed part of filename (e.g. <file>.out)
   string out_dir; // Recursive part of filename (dirs after <file>.out)
   IndexFormat index_format;
-  unique_ptr<ResourceFile> current_rf;
-  ResourceFile (*parse)(const string&);
+  shared_ptr<ResourceFile> current_rf;
+  ResourceFile (*parse)(shared_ptr<const MappedFile>);
+  // Output buffer for resources decoded with templates; reused between
+  // resources so it isn't reallocated each time
+  string template_output;
+  // Outputs written while exporting the current resource, as (after, filename)
+  // pairs
+  vector<pair<string, string>> recorded_outputs;
+  // If not null, decoded outputs are added to this group when they're written,
+  // so decode_with_cache can wait for them
+  shared_ptr<OutputWriter::WriteGroup> write_group;
+  // CODE 0 and the results of the parallel CODE disassembly pass for the
+  // current file, by resource type
+  unordered_map<uint32_t, CODEApplication> code_applications;
+  // Only set during disassemble() in incremental mode
+  shared_ptr<IncrementalManifest> manifest;
+  shared_ptr<ExternalPreprocessorPool> external_preprocessor_pool;
+
+  // This is called before the worker threads are started when --jobs is used,
+  // so they all share the same pool
+  void ensure_external_preprocessor_pool() {
+    if (!this->external_preprocessor_pool.get() &&
+        !this->external_preprocessor_command.empty() &&
+        this->external_preprocessor_processes) {
+      this->external_preprocessor_pool = make_shared<ExternalPreprocessorPool>(
+          this->external_preprocessor_command, this->external_preprocessor_processes);
+    }
+  }
 
 public:
 
+  // Sets up state that's shared between copies of the exporter, so copies made
+  // afterward (e.g. for each connection in service mode) share it instead of
+  // each creating their own. This also loads the system decompressors, so the
+  // first job that needs them doesn't have to wait.
+  void prepare_for_jobs() {
+    this->ensure_external_preprocessor_pool();
+    for (int16_t id = 0; id < 4; id++) {
+      for (bool use_ncmp : {false, true}) {
+        try {
+          get_system_decompressor(use_ncmp, id);
+        } catch (const exception&) { }
+      }
+    }
+  }
+
   void set_index_format(IndexFormat new_format) {
     this->index_format = new_format;
     if (this->index_format == IndexFormat::RESOURCE_FORK) {
@@ -1839,13 +3269,16 @@ public:
   bool export_resource(
       const string& base_filename,
       shared_ptr<const ResourceFile::Resource> res) {
+    this->recorded_outputs.clear();
+    // Decoders' temporary buffers are freed all at once after the export
+    ScratchArenaScope scratch_arena;
 
     bool decompression_failed = res->flags & ResourceFlag::FLAG_DECOMPRESSION_FAILED;
     bool is_compressed = res->flags & ResourceFlag::FLAG_COMPRESSED;
     bool was_compressed = res->flags & ResourceFlag::FLAG_DECOMPRESSED;
     if (decompression_failed || is_compressed) {
       auto type_str = string_for_resource_type(res->type);
-      fprintf(stderr,
+      fprintf(this->log_stream,
           decompression_failed
             ? "warning: failed to decompress resource %s:%d; saving raw compressed data\n"
             : "note: resource %s:%d is compressed; saving raw compressed data\n",
@@ -1863,13 +3296,52 @@ public:
     ResourceFile::Resource preprocessed_res;
     shared_ptr<const ResourceFile::Resource> res_to_decode = res;
 
+    // Run the internal preprocessor, if any. As for the external preprocessor
+    // below, this only makes sense if the resource isn't still compressed.
+    if (!is_compressed && (this->internal_preprocessor || this->internal_preprocessor_auto)) {
+      const auto* detected = find_codec_for_data(res->data.data(), res->data.size());
+      bool should_run = this->internal_preprocessor_auto
+          ? (detected != nullptr)
+          : (!this->internal_preprocessor->magic || (detected == this->internal_preprocessor));
+      if (should_run) {
+        try {
+          string data = this->internal_preprocessor_auto
+              ? decompress_with_detected_codecs(res->data.data(), res->data.size())
+              : decompress_with_codec(*this->internal_preprocessor, res->data.data(), res->data.size());
+          fprintf(this->log_stream, "note: internal preprocessor returned %zu bytes\n", data.size());
+          res_to_decode.reset(new ResourceFile::Resource(
+              res->type, res->id, res->flags, res->name, move(data)));
+        } catch (const exception& e) {
+          fprintf(this->log_stream, "warning: internal preprocessor failed: %s\n", e.what());
+        }
+      }
+    }
+
     // Run external preprocessor if possible. The resource could still be
     // compressed if --skip-decompression was used or if decompression failed;
     // in these cases it doesn't make sense to run the external preprocessor.
-    if (!is_compressed && !this->external_preprocessor_command.empty()) {
+    if (!is_compressed && !this->external_preprocessor_command.empty() &&
+        this->external_preprocessor_processes) {
+      this->ensure_external_preprocessor_pool();
+      try {
+        auto result = this->external_preprocessor_pool->process(res->type, res->id, res->data);
+        if (result.status != 0) {
+          fprintf(this->log_stream, "warning: external preprocessor failed with status 0x%" PRIX32 ": %s\n",
+              result.status, result.data.c_str());
+        } else {
+          fprintf(this->log_stream, "note: external preprocessor succeeded and returned %zu bytes\n",
+              result.data.size());
+          res_to_decode.reset(new ResourceFile::Resource(
+              res->type, res->id, res->flags, res->name, move(result.data)));
+        }
+      } catch (const exception& e) {
+        fprintf(this->log_stream, "warning: external preprocessor failed: %s\n", e.what());
+      }
+
+    } else if (!is_compressed && !this->external_preprocessor_command.empty()) {
       auto result = run_process(this->external_preprocessor_command, &res->data, false);
       if (result.exit_status != 0) {
-        fprintf(stderr, "\
+        fprintf(this->log_stream, "\
 warning: external preprocessor failed with exit status 0x%x\n\
 \n\
 stdout (%zu bytes):\n\
@@ -1879,7 +3351,7 @@ stderr (%zu bytes):\n\
 %s\n\
 \n", result.exit_status, result.stdout_contents.size(), result.stdout_contents.c_str(), result.stderr_contents.size(), result.stderr_contents.c_str());
       } else {
-        fprintf(stderr, "note: external preprocessor succeeded and returned %zu bytes\n",
+        fprintf(this->log_stream, "note: external preprocessor succeeded and returned %zu bytes\n",
             result.stdout_contents.size());
         res_to_decode.reset(new ResourceFile::Resource(
             res->type, res->id, res->flags, res->name, move(result.stdout_contents)));
@@ -1888,6 +3360,7 @@ stderr (%zu bytes):\n\
 
     // Decode if possible. If decompression failed, don't bother trying to
     // decode the resource.
+    uint64_t decode_start_time = now();
     resource_decode_fn decode_fn = nullptr;
     try {
       decode_fn = type_to_decode_fn.at(res_to_decode->type);
@@ -1896,10 +3369,20 @@ stderr (%zu bytes):\n\
     bool decoded = false;
     if (!is_compressed && decode_fn) {
       try {
-        (this->*decode_fn)(base_filename, res_to_decode);
+        if (cacheable_decoder_types.count(res_to_decode->type)) {
+          // Some sound formats are parsed differently in HIRF files
+          string context(1, static_cast<char>(this->current_rf.get()
+              ? this->current_rf->index_format() : IndexFormat::NONE));
+          this->decode_with_cache(base_filename, res_to_decode,
+              res_to_decode->data, context, [&]() {
+            (this->*decode_fn)(base_filename, res_to_decode);
+          });
+        } else {
+          (this->*decode_fn)(base_filename, res_to_decode);
+        }
         decoded = true;
       } catch (const exception& e) {
-        fprintf(stderr, "warning: failed to decode resource: %s\n", e.what());
+        fprintf(this->log_stream, "warning: failed to decode resource: %s\n", e.what());
       }
     }
     // If there's no built-in decoder and there's a context ResourceFile, try to
@@ -1917,32 +3400,50 @@ stderr (%zu bytes):\n\
 
       if (tmpl_res.get()) {
         try {
-          string result = string_printf("# (decoded with TMPL %hd)\n", tmpl_res->id);
-          result += this->current_rf->disassemble_from_template(
-              res->data.data(), res->data.size(), this->current_rf->decode_TMPL(tmpl_res));
-          write_decoded_data(base_filename, res_to_decode, ".txt", result);
+          // The output includes the TMPL's ID, so it's part of the context too
+          string context = string_printf("%hd:", tmpl_res->id) + tmpl_res->data;
+          this->decode_with_cache(base_filename, res_to_decode, res->data, context, [&]() {
+            this->template_output = string_printf("# (decoded with TMPL %hd)\n", tmpl_res->id);
+            ResourceFile::disassemble_from_template(this->template_output,
+                res->data.data(), res->data.size(), *this->current_rf->get_compiled_TMPL(tmpl_res));
+            write_decoded_data(base_filename, res_to_decode, ".txt", this->template_output);
+          });
           decoded = true;
         } catch (const exception& e) {
-          fprintf(stderr, "warning: failed to decode resource with template %hd: %s\n", tmpl_res->id, e.what());
+          fprintf(this->log_stream, "warning: failed to decode resource with template %hd: %s\n", tmpl_res->id, e.what());
         }
       }
     }
     // If there's no built-in decoder and no TMPL in the file, try using a
     // system template
     if (!is_compressed && !decoded && !this->skip_templates) {
-      const ResourceFile::TemplateEntryList& tmpl = get_system_template(res_to_decode->type);
-      if (!tmpl.empty()) {
+      auto tmpl = get_compiled_system_template(res_to_decode->type);
+      if (tmpl.get()) {
         try {
-          string result = ResourceFile::disassemble_from_template(
-              res->data.data(), res->data.size(), tmpl);
-          write_decoded_data(base_filename, res_to_decode, ".txt", result);
+          // System templates don't depend on the file, so there's no context
+          this->decode_with_cache(base_filename, res_to_decode, res->data, "", [&]() {
+            this->template_output.clear();
+            ResourceFile::disassemble_from_template(this->template_output,
+                res->data.data(), res->data.size(), *tmpl);
+            write_decoded_data(base_filename, res_to_decode, ".txt", this->template_output);
+          });
           decoded = true;
         } catch (const exception& e) {
-          fprintf(stderr, "warning: failed to decode resource with system template: %s\n", e.what());
+          fprintf(this->log_stream, "warning: failed to decode resource with system template: %s\n", e.what());
         }
       }
     }
 
+    if (!is_compressed) {
+      auto stats = get_decode_stats();
+      if (stats.get()) {
+        uint64_t decode_usecs = now() - decode_start_time;
+        stats->record_decode(res->type, decoded, decode_usecs,
+            res_to_decode->data.size());
+        stats->record_stage("decode", decode_usecs);
+      }
+    }
+
     if (!decoded && this->save_raw == SaveRawBehavior::IfDecodeFails) {
       write_raw = true;
     }
@@ -1961,24 +3462,364 @@ stderr (%zu bytes):\n\
         // Hack: PICT resources, when saved to disk, should be prepended with a
         // 512-byte unused header
         if (res_to_decode->type == RESOURCE_TYPE_PICT) {
-          static const string pict_header(512, 0);
-          auto f = fopen_unique(out_filename, "wb");
-          fwritex(f.get(), pict_header);
-          fwritex(f.get(), res_to_decode->data);
+          string pict_data(512, 0);
+          pict_data += res_to_decode->data;
+          this->output_writer->write(out_filename, pict_data);
         } else {
-          save_file(out_filename, res_to_decode->data);
+          this->output_writer->write(out_filename, res_to_decode->data);
         }
-        fprintf(stderr, "... %s\n", out_filename.c_str());
+        this->record_output(out_filename_after, out_filename);
+        fprintf(this->log_stream, "... %s\n", out_filename.c_str());
       } catch (const exception& e) {
-        fprintf(stderr, "warning: failed to save raw data: %s\n", e.what());
+        fprintf(this->log_stream, "warning: failed to save raw data: %s\n", e.what());
       }
     }
     return decoded || write_raw;
   }
 
+  // Describes all the options that affect which outputs are written and what
+  // they contain. If this changes between runs, the incremental manifest from
+  // the previous run is ignored.
+  string options_fingerprint() const {
+    bool internal_pict = this->type_to_decode_fn.count(RESOURCE_TYPE_PICT) &&
+        (this->type_to_decode_fn.at(RESOURCE_TYPE_PICT) == &ResourceExporter::write_decoded_PICT_internal);
+    string ret = string_printf(
+        "data_fork=%d filename_format=%d save_raw=%d decompress_flags=%" PRIX64
+        " compressed=%d skip_templates=%d index_format=%d decoders=%zu internal_pict=%d"
+        " image_format=%d png_level=%d audio_format=%d render_songs=%d,%" PRIu32
+        " budget=%" PRIu64 ",%" PRIu64 ",%zu",
+        this->use_data_fork, static_cast<int>(this->filename_format),
+        static_cast<int>(this->save_raw), this->decompress_flags,
+        static_cast<int>(this->target_compressed_behavior), this->skip_templates,
+        static_cast<int>(this->index_format), this->type_to_decode_fn.size(),
+        internal_pict, static_cast<int>(this->image_options.format),
+        this->image_options.png_level, static_cast<int>(this->audio_options.format),
+        this->render_songs, this->song_sample_rate, this->resource_budget.max_emulated_cycles,
+        this->resource_budget.max_usecs, this->resource_budget.max_memory_bytes);
+
+    // The filters are unordered, so sort them to make the result stable
+    vector<string> filters;
+    for (uint32_t type : this->target_types) {
+      filters.emplace_back(string_printf("+type:%08" PRIX32, type));
+    }
+    for (uint32_t type : this->skip_types) {
+      filters.emplace_back(string_printf("-type:%08" PRIX32, type));
+    }
+    for (int64_t id : this->target_ids) {
+      filters.emplace_back(string_printf("+id:%" PRId64, id));
+    }
+    for (int64_t id : this->skip_ids) {
+      filters.emplace_back(string_printf("-id:%" PRId64, id));
+    }
+    // Names may not be valid UTF-8, so they're hex-encoded
+    auto hex_name = [](const string& name) -> string {
+      string ret;
+      for (char ch : name) {
+        ret += string_printf("%02hhX", static_cast<uint8_t>(ch));
+      }
+      return ret;
+    };
+    for (const auto& name : this->target_names) {
+      filters.emplace_back("+name:" + hex_name(name));
+    }
+    for (const auto& name : this->skip_names) {
+      filters.emplace_back("-name:" + hex_name(name));
+    }
+    sort(filters.begin(), filters.end());
+    for (const auto& filter : filters) {
+      ret += ' ';
+      ret += filter;
+    }
+    for (const auto& arg : this->external_preprocessor_command) {
+      ret += " preprocessor:";
+      ret += arg;
+    }
+    if (this->internal_preprocessor_auto) {
+      ret += " internal_preprocessor:auto";
+    } else if (this->internal_preprocessor) {
+      ret += " internal_preprocessor:";
+      ret += this->internal_preprocessor->name;
+    }
+    return ret;
+  }
+
   bool disassemble(const string& filename, const string& base_out_dir) {
     this->base_out_dir = base_out_dir;
-    return this->disassemble_path(filename);
+    this->ensure_external_preprocessor_pool();
+    if (this->incremental) {
+      string manifest_filename = base_out_dir.empty()
+          ? ".resource_dasm_manifest.json"
+          : (base_out_dir + "/.resource_dasm_manifest.json");
+      this->manifest = make_shared<IncrementalManifest>(
+          manifest_filename, this->options_fingerprint());
+    }
+
+    bool ret = (this->num_jobs > 1)
+        ? this->disassemble_path_parallel(filename)
+        : this->disassemble_path(filename);
+    this->output_writer->flush();
+
+    if (this->manifest.get()) {
+      this->manifest->save();
+      this->manifest.reset();
+    }
+    return ret;
+  }
+
+private:
+  // State shared between the threads of an inventory scan. Directories and
+  // files are both work items; listing a directory adds its contents to the
+  // queue, so large trees are traversed by all the threads at once.
+  struct InventoryScan {
+    enum class ItemType {
+      UNKNOWN = 0, // Must be checked with stat()
+      FILE,
+      DIRECTORY,
+    };
+
+    FILE* out;
+    InventoryFormat format;
+
+    mutex queue_lock;
+    condition_variable queue_cv;
+    deque<pair<string, ItemType>> queue;
+    size_t num_busy_workers {0};
+
+    mutex output_lock;
+
+    // Set when opening a resource fork with the long (or short) suffix fails
+    // with ENOTDIR. That means the filesystem doesn't support that way of
+    // naming resource forks at all, so it isn't tried again for later files.
+    atomic<bool> long_suffix_unsupported{false};
+    atomic<bool> short_suffix_unsupported{false};
+
+    atomic<size_t> num_files{0};
+    atomic<size_t> num_archives{0};
+    atomic<size_t> num_resources{0};
+    atomic<size_t> num_failures{0};
+  };
+
+  // Opens the resource fork of filename (or its data fork, if use_data_fork
+  // is set), or returns null if it has no resource fork. Unlike
+  // disassemble_file, this doesn't check whether each fork exists before
+  // opening it.
+  shared_ptr<const MappedFile> open_inventory_fork(
+      InventoryScan& scan, const string& filename, string& fork_filename) const {
+    if (this->use_data_fork) {
+      fork_filename = filename;
+      return make_shared<MappedFile>(filename);
+    }
+    if (!scan.long_suffix_unsupported) {
+      try {
+        fork_filename = filename + RESOURCE_FORK_FILENAME_SUFFIX;
+        return make_shared<MappedFile>(fork_filename);
+      } catch (const cannot_open_file& e) {
+        if (e.error == ENOTDIR) {
+          scan.long_suffix_unsupported = true;
+        } else if (e.error != ENOENT) {
+          throw;
+        }
+      }
+    }
+    if (!scan.short_suffix_unsupported) {
+      try {
+        fork_filename = filename + RESOURCE_FORK_FILENAME_SHORT_SUFFIX;
+        return make_shared<MappedFile>(fork_filename);
+      } catch (const cannot_open_file& e) {
+        if (e.error == ENOTDIR) {
+          scan.short_suffix_unsupported = true;
+        } else if (e.error != ENOENT) {
+          throw;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  // Appends the inventory records for one file to output. Only the file's
+  // index is parsed; no resource data is read or decompressed.
+  void inventory_file(InventoryScan& scan, const string& filename, string& output) const {
+    scan.num_files++;
+    ResourceFile rf;
+    try {
+      string fork_filename;
+      auto file = this->open_inventory_fork(scan, filename, fork_filename);
+      if (!file.get() || (file->size() == 0)) {
+        return;
+      }
+      if (this->index_cache_directory.empty()) {
+        rf = this->parse(file);
+      } else {
+        rf = parse_with_sidecar_index(
+            this->index_cache_directory, fork_filename, file, this->index_format);
+      }
+    } catch (const exception& e) {
+      scan.num_failures++;
+      if (scan.format == InventoryFormat::NDJSON) {
+        output += "{\"file\":";
+        append_json_string(output, filename);
+        output += ",\"error\":";
+        append_json_string(output, e.what());
+        output += "}\n";
+      } else {
+        lock_guard<mutex> g(scan.output_lock);
+        fprintf(stderr, "failed on %s: %s\n", filename.c_str(), e.what());
+      }
+      return;
+    }
+
+    scan.num_archives++;
+    for (const auto& it : rf.all_resources()) {
+      auto res = rf.get_resource_metadata(it.first, it.second);
+      bool compressed = res->flags & ResourceFlag::FLAG_COMPRESSED;
+      string type_str = string_for_resource_type(res->type);
+      string name = decode_mac_roman(res->name);
+      if (scan.format == InventoryFormat::NDJSON) {
+        output += "{\"file\":";
+        append_json_string(output, filename);
+        output += ",\"type\":";
+        append_json_string(output, type_str);
+        output += string_printf(",\"id\":%hd,\"flags\":%hu,\"size\":%zu,\"compressed\":%s,\"name\":",
+            res->id, res->flags, res->data_size(), compressed ? "true" : "false");
+        append_json_string(output, name);
+        output += "}\n";
+      } else {
+        append_tsv_field(output, filename);
+        output += '\t';
+        append_tsv_field(output, type_str);
+        output += string_printf("\t%hd\t%hu\t%zu\t%d\t",
+            res->id, res->flags, res->data_size(), compressed ? 1 : 0);
+        append_tsv_field(output, name);
+        output += '\n';
+      }
+      scan.num_resources++;
+    }
+  }
+
+  void list_inventory_directory(InventoryScan& scan, const string& dirname) const {
+    DIR* dir = opendir(dirname.c_str());
+    if (!dir) {
+      scan.num_failures++;
+      lock_guard<mutex> g(scan.output_lock);
+      fprintf(stderr, "warning: can\'t list directory %s\n", dirname.c_str());
+      return;
+    }
+
+    // readdir usually tells us which entries are directories, so most files
+    // don't need a stat() call
+    vector<pair<string, InventoryScan::ItemType>> items;
+    struct dirent* ent;
+    while ((ent = readdir(dir))) {
+      if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+        continue;
+      }
+      InventoryScan::ItemType type;
+      if (ent->d_type == DT_DIR) {
+        type = InventoryScan::ItemType::DIRECTORY;
+      } else if (ent->d_type == DT_REG) {
+        type = InventoryScan::ItemType::FILE;
+      } else {
+        type = InventoryScan::ItemType::UNKNOWN;
+      }
+      items.emplace_back(dirname + "/" + ent->d_name, type);
+    }
+    closedir(dir);
+
+    if (!items.empty()) {
+      lock_guard<mutex> g(scan.queue_lock);
+      for (auto& item : items) {
+        scan.queue.emplace_back(move(item));
+      }
+      scan.queue_cv.notify_all();
+    }
+  }
+
+  void run_inventory_worker(InventoryScan& scan) const {
+    // Records are buffered and written in large blocks, so the threads rarely
+    // wait for each other. All the records for one file are always written
+    // together.
+    string output;
+    auto flush_output = [&]() -> void {
+      if (!output.empty()) {
+        lock_guard<mutex> g(scan.output_lock);
+        fwritex(scan.out, output);
+        output.clear();
+      }
+    };
+
+    for (;;) {
+      pair<string, InventoryScan::ItemType> item;
+      {
+        unique_lock<mutex> g(scan.queue_lock);
+        // If the queue is empty and no other thread is working on a
+        // directory (and might add more items), the scan is done
+        scan.queue_cv.wait(g, [&]() -> bool {
+          return !scan.queue.empty() || (scan.num_busy_workers == 0);
+        });
+        if (scan.queue.empty()) {
+          break;
+        }
+        item = move(scan.queue.front());
+        scan.queue.pop_front();
+        scan.num_busy_workers++;
+      }
+
+      if (item.second == InventoryScan::ItemType::UNKNOWN) {
+        // Like isdir(), this follows symbolic links
+        item.second = isdir(item.first)
+            ? InventoryScan::ItemType::DIRECTORY : InventoryScan::ItemType::FILE;
+      }
+      if (item.second == InventoryScan::ItemType::DIRECTORY) {
+        this->list_inventory_directory(scan, item.first);
+      } else {
+        this->inventory_file(scan, item.first, output);
+        if (output.size() >= 0x10000) {
+          flush_output();
+        }
+      }
+
+      lock_guard<mutex> g(scan.queue_lock);
+      if ((--scan.num_busy_workers == 0) && scan.queue.empty()) {
+        scan.queue_cv.notify_all();
+      }
+    }
+    flush_output();
+  }
+
+public:
+  // Writes one record to out for each resource in filename (or in all files in
+  // it, if it's a directory), without reading or decompressing any resource
+  // data. Directories are scanned on num_jobs threads; records for different
+  // files may appear in any order, but each file's records are contiguous.
+  // Returns false if any file or directory couldn't be read.
+  bool inventory(const string& filename, FILE* out, InventoryFormat format) const {
+    if (!isfile(filename) && !isdir(filename)) {
+      throw cannot_open_file(filename);
+    }
+
+    InventoryScan scan;
+    scan.out = out;
+    scan.format = format;
+    scan.queue.emplace_back(filename, InventoryScan::ItemType::UNKNOWN);
+
+    if (format == InventoryFormat::TSV) {
+      fwritex(out, "file\ttype\tid\tflags\tsize\tcompressed\tname\n");
+    }
+
+    vector<thread> threads;
+    for (size_t z = 1; z < this->num_jobs; z++) {
+      threads.emplace_back(&ResourceExporter::run_inventory_worker, this, ref(scan));
+    }
+    this->run_inventory_worker(scan);
+    for (auto& t : threads) {
+      t.join();
+    }
+    fflush(out);
+
+    fprintf(stderr, "%zu files scanned; %zu resources in %zu files; %zu failures\n",
+        scan.num_files.load(), scan.num_resources.load(), scan.num_archives.load(),
+        scan.num_failures.load());
+    return (scan.num_failures == 0);
   }
 };
 
@@ -2115,6 +3956,45 @@ const unordered_map<uint32_t, ResourceExporter::resource_decode_fn> ResourceExpo
   {RESOURCE_TYPE_pthg, &ResourceExporter::write_decoded_inline_68k_or_peff},
 });
 
+// The outputs for these types depend only on the resource's contents (and the
+// index format, for sounds), so they can be cached by decode_with_cache. Types
+// whose decoders look up other resources (e.g. icl8, which uses ICN# as a mask,
+// and PICT, which can use the file's clut resources) or write references to
+// other outputs (e.g. INST) are not included.
+const unordered_set<uint32_t> ResourceExporter::cacheable_decoder_types({
+  RESOURCE_TYPE_actb,
+  RESOURCE_TYPE_cctb,
+  RESOURCE_TYPE_cicn,
+  RESOURCE_TYPE_clut,
+  RESOURCE_TYPE_cmid,
+  RESOURCE_TYPE_crsr,
+  RESOURCE_TYPE_csnd,
+  RESOURCE_TYPE_CURS,
+  RESOURCE_TYPE_dctb,
+  RESOURCE_TYPE_ecmi,
+  RESOURCE_TYPE_emid,
+  RESOURCE_TYPE_esnd,
+  RESOURCE_TYPE_ESnd,
+  RESOURCE_TYPE_fctb,
+  RESOURCE_TYPE_icmN,
+  RESOURCE_TYPE_ICNN,
+  RESOURCE_TYPE_ICON,
+  RESOURCE_TYPE_icsN,
+  RESOURCE_TYPE_kcsN,
+  RESOURCE_TYPE_PAT ,
+  RESOURCE_TYPE_PATN,
+  RESOURCE_TYPE_pltt,
+  RESOURCE_TYPE_ppat,
+  RESOURCE_TYPE_pptN,
+  RESOURCE_TYPE_SICN,
+  RESOURCE_TYPE_SMSD,
+  RESOURCE_TYPE_snd ,
+  RESOURCE_TYPE_SOUN,
+  RESOURCE_TYPE_Tune,
+  RESOURCE_TYPE_wctb,
+  RESOURCE_TYPE_Ysnd,
+});
+
 const unordered_map<uint32_t, const char*> ResourceExporter::type_to_ext({
   {RESOURCE_TYPE_icns, "icns"},
   {RESOURCE_TYPE_MADH, "madh"},
@@ -2134,13 +4014,14 @@ void disassemble_executable(
     const std::string& data,
     const std::string& output_filename,
     const multimap<uint32_t, string>* disassembly_labels,
-    bool print_hex_view_for_code) {
+    bool print_hex_view_for_code,
+    size_t disassembly_threads) {
   ExecT f(filename.c_str(), data);
   if (!output_filename.empty()) {
     auto out = fopen_unique(output_filename, "wt");
-    f.print(out.get(), disassembly_labels, print_hex_view_for_code);
+    f.print(out.get(), disassembly_labels, print_hex_view_for_code, disassembly_threads);
   } else {
-    f.print(stdout, disassembly_labels, print_hex_view_for_code);
+    f.print(stdout, disassembly_labels, print_hex_view_for_code, disassembly_threads);
   }
 }
 
@@ -2172,6 +4053,11 @@ Resource disassembly input options:\n\
         hirf: Beatnik HIRF archive (also known as IREZ, HSB, or RMF)\n\
         dc-data: DC Data file\n\
       If the index format is not resource-fork, --data-fork is implied.\n\
+  --index-cache=DIR\n\
+      Keep a compact copy of each input file\'s resource index in DIR, and use\n\
+      it instead of parsing the file\'s index again the next time the file is\n\
+      opened, as long as the file\'s size and modification time haven\'t\n\
+      changed. This speeds up repeatedly opening large archives.\n\
   --data-fork\n\
       Disassemble the file\'s data fork as if it were the resource fork.\n\
   --target-type=TYPE\n\
@@ -2231,6 +4117,21 @@ Resource decompression options:\n\
       Don\'t attempt to use the default 68K decompressors.\n\
   --skip-system-ncmp\n\
       Don\'t attempt to use the default PEFF decompressors.\n\
+  --jit-dcmp\n\
+      Use the emulator\'s JIT tier when running 68K decompressors. Has no\n\
+      effect with --trace-decompression or --debug-decompression.\n\
+  --decompression-cache=DIR\n\
+      Save the results of emulated decompressors in DIR, and reuse them instead\n\
+      of running the decompressor again when the same compressed data and\n\
+      decompressors are seen later (in this run or a future one). The number\n\
+      of cache hits and misses is shown at the end of the run.\n\
+  --dcmp-fingerprints=FILE\n\
+      Use native implementations for the decompressors listed in FILE instead\n\
+      of emulating them. Each line of FILE has a decompressor fingerprint (in\n\
+      hex) and the name of a native codec (dcmp0, dcmp1, dcmp2, or dcmp3),\n\
+      separated by a space. Copies of the system decompressors are recognized\n\
+      automatically. Fingerprints are shown by --verbose-decompression, and a\n\
+      count of the recognized ones used is shown at the end of the run.\n\
   --verbose-decompression\n\
       Show log output when running resource decompressors.\n\
   --trace-decompression\n\
@@ -2256,6 +4157,23 @@ Resource decoding options:\n\
       command via stdin, and the command\'s output on stdout will be treated as\n\
       the resource data to decode. This can be used to transparently decompress\n\
       some custom compression formats.\n\
+  --external-preprocessor-processes=N\n\
+      Instead of running the external preprocessor once for each resource,\n\
+      keep up to N instances of it running and send all resources to them.\n\
+      In this mode, each request on the preprocessor\'s stdin is a 12-byte\n\
+      header (type, ID, 2 unused bytes, and data size as a 32-bit integer)\n\
+      followed by the resource data. The preprocessor must read the entire\n\
+      request, then respond on stdout with an 8-byte header (status, which is\n\
+      0 on success, and data size) followed by the preprocessed data, or an\n\
+      error message if the status isn\'t 0. All fields are big-endian.\n\
+  --internal-preprocessor=CODEC\n\
+      After decompression, but before decoding resource data, decompress it\n\
+      with one of the built-in codecs. This is like using macski_decomp or\n\
+      flashback_decomp with --external-preprocessor, but doesn\'t start a new\n\
+      process for each resource. CODEC may be flashback-lzss, run4, cook, or\n\
+      co2k; resources that don\'t begin with the codec\'s signature are left\n\
+      alone. CODEC may also be auto, which decompresses resources beginning\n\
+      with any codec\'s signature (repeatedly, if the result also has one).\n\
   --skip-decode\n\
       Don\'t use any decoders to convert resources to modern formats. This\n\
       option implies --skip-templates as well.\n\
@@ -2264,6 +4182,12 @@ Resource decoding options:\n\
       picttoppm for decoding PICT resources.\n\
   --skip-templates\n\
       Don\'t attempt to use TMPL resources to convert resources to text files.\n\
+  --render-songs\n\
+  --render-songs=SAMPLE-RATE\n\
+      In addition to generating smssynth templates for SONG resources, render\n\
+      them to WAV files using the instruments and sounds in the same file. The\n\
+      default sample rate is 44100Hz. Instruments that can\'t be decoded are\n\
+      silent (and a warning is logged).\n\
 \n\
 Resource disassembly output options:\n\
   --save-raw=no\n\
@@ -2286,6 +4210,121 @@ Resource disassembly output options:\n\
       resources will not play with smssynth unless you manually put the\n\
       required sound and MIDI resources in the same directory as the SONG JSON\n\
       after decoding.\n\
+  --jobs=N\n\
+      When the input is a directory, disassemble up to N files at once. Log\n\
+      output is buffered per file and written in the same order as it would\n\
+      be with a single job. If N is 0, use one job per CPU core.\n\
+  --decoded-cache-size=BYTES\n\
+      Keep up to BYTES of decoded output in memory, and reuse it when an\n\
+      identical resource appears in another file instead of decoding it again.\n\
+      This applies to images, sounds, and template-decoded text. The least\n\
+      recently used outputs are discarded when the limit is reached. The\n\
+      default is 0 (no caching).\n\
+  --hardlink-cached-outputs\n\
+      When reusing cached outputs, create hard links to the first copy of each\n\
+      output instead of writing new files where possible.\n\
+  --incremental\n\
+      Save a manifest of the input files and the outputs produced from them in\n\
+      the output directory, and skip any files and resources that haven\'t\n\
+      changed since the previous run into the same directory. Files with the\n\
+      same size and modification time as before aren\'t read at all. If any\n\
+      options that affect the outputs are different from the previous run,\n\
+      everything is disassembled again.\n\
+  --write-threads=N\n\
+      Write output files on N background threads, so decoding isn\'t delayed\n\
+      by slow storage (e.g. network filesystems). Up to 64MB of outputs can be\n\
+      waiting to be written at once. Errors during writing are reported as\n\
+      warnings, but don\'t cause the resource to be saved in raw form. The\n\
+      default is 0 (write each file before continuing). Images are encoded on\n\
+      the writer threads too, so this also compresses several images at once.\n\
+  --output-archive=FORMAT\n\
+      Write all the output files into a single archive instead of creating\n\
+      each as a separate file, which is much faster on filesystems where\n\
+      creating files is slow. The paths within the archive are the same as\n\
+      the paths that would be created within the output directory, and follow\n\
+      --filename-format. FORMAT may be:\n\
+        files: Write separate files (this is the default)\n\
+        tar: Write a tar archive\n\
+        zip: Write a zip archive, compressing each file\n\
+        pack: Write a pack file (see src/OutputSink.hh), which stores each\n\
+          distinct output only once and compresses it\n\
+        none: Don\'t write anything (this is only useful with --stats, to\n\
+          measure performance without measuring the filesystem)\n\
+      The archive is written to the output filename if one is given, or to\n\
+      <input_filename>.out.<FORMAT> otherwise. For tar and zip, an output\n\
+      filename of - writes the archive to stdout. Files are compressed on the\n\
+      --write-threads threads, if there are any. This can\'t be combined with\n\
+      --incremental, --decoded-cache-size, or --hardlink-cached-outputs.\n\
+  --output-archive-level=N\n\
+      Compress files in zip and pack archives with this zlib level, from 0 to\n\
+      9. The default is 6.\n\
+  --image-format=FORMAT\n\
+      Save decoded images in this format. FORMAT may be bmp (the default) or\n\
+      png.\n\
+  --png-level=N\n\
+      Compress PNG images with this zlib level, from 0 to 9. The default is 6.\n\
+      Levels 1-3 are much faster than the default but make larger files; level\n\
+      0 doesn\'t compress at all.\n\
+  --audio-format=FORMAT\n\
+      Save decoded sounds in this format. FORMAT may be wav (the default) or\n\
+      flac. FLAC files are lossless and usually about half the size; any loop\n\
+      in the sound is saved as LOOPSTART and LOOPLENGTH tags. Sounds that are\n\
+      MP3s in the resource are always saved as MP3s.\n\
+  --stats=json\n\
+      When done, print statistics to stdout as a JSON object: decode counts,\n\
+      times, and input sizes per resource type; decompression counts, times,\n\
+      sizes, and emulated cycle counts per decompressor implementation; cache\n\
+      hit rates; the number and total size of output files; total times spent\n\
+      parsing, decompressing, decoding, encoding images, and writing files;\n\
+      and peak memory usage and the number of allocations made. Times are in\n\
+      microseconds.\n\
+  --max-emulated-cycles=N\n\
+      Stop any emulated decompressor after it executes N instructions.\n\
+  --max-resource-time=MSECS\n\
+      Stop decompressing or decoding a resource after MSECS milliseconds. This\n\
+      is enforced in emulated decompressors and PICT rendering.\n\
+  --max-resource-memory=BYTES\n\
+      Don\'t decompress or decode a resource if it would require an allocation\n\
+      larger than BYTES (e.g. for a decompressor\'s memory or a PICT\'s canvas).\n\
+      Resources that exceed any of these limits are treated as if they could\n\
+      not be decompressed or decoded, so their raw data is saved unless\n\
+      --save-raw=no is given. By default, there are no limits.\n\
+\n\
+Service mode options:\n\
+  --serve\n\
+  --serve=SOCKET\n\
+      Instead of disassembling one input, stay running and disassemble inputs\n\
+      as they\'re requested. Requests are read from stdin (or from connections\n\
+      to the Unix socket SOCKET, which is created if needed). Each request is\n\
+      a line containing an input filename, optionally followed by a tab and an\n\
+      output directory (or archive filename, with --output-archive). For each\n\
+      request, one line is written in response: OK if any resources were\n\
+      exported, FAILED if none were, or ERROR followed by a message. An empty\n\
+      line or the end of the input ends the connection (or, with stdin, the\n\
+      process). All the other resource disassembly options apply to every\n\
+      request. Caches (e.g. from --decoded-cache-size and\n\
+      --decompression-cache) and loaded system decompressors are kept between\n\
+      requests, so repeated requests are much faster than running\n\
+      resource_dasm once per file. Requests on different connections to the\n\
+      socket are processed at the same time. Log output goes to stderr. When\n\
+      serving on stdin, archives can\'t be written to stdout (-), since the\n\
+      responses are written there.\n\
+  --serve-connections=N\n\
+      With --serve=SOCKET, serve at most N connections at once (by default,\n\
+      one per CPU core). Further connections wait until one ends.\n\
+\n\
+Resource inventory options:\n\
+  --inventory[=FORMAT]\n\
+      Instead of disassembling resources, list the type, ID, flags, size, and\n\
+      name of every resource in the input file (or in every file in the input\n\
+      directory and its subdirectories). Only the resource indexes are read;\n\
+      resource data isn\'t read or decompressed, so the sizes of compressed\n\
+      resources are their compressed sizes. FORMAT may be ndjson (one JSON\n\
+      object per resource, per line; the default) or tsv (tab-separated\n\
+      columns with a header row). The listing is written to the output file if\n\
+      one is given, or to stdout otherwise. With --jobs, directories are\n\
+      scanned on multiple threads, and files may be listed in any order. The\n\
+      --index-format, --index-cache, and --data-fork options also apply here.\n\
 \n\
 Resource file modification options:\n\
   --create\n\
@@ -2325,6 +4364,13 @@ Executable disassembly options:\n\
       \"label<ADDR>\" as the label name. May be given multiple times.\n\
   --hex-view-for-code\n\
       Show all sections in hex view, even if they are also disassembled.\n\
+  --disassembly-threads=N\n\
+      Disassemble large code sections on N threads. For 68K and x86 code, the\n\
+      code is only split at labels (including CODE jump table entries and\n\
+      exported functions), so this has no effect on code without labels. The\n\
+      output is the same regardless of N. If N is 0, use one thread per CPU\n\
+      core. This also applies to CODE and PEFF resources when disassembling\n\
+      resource files.\n\
   --parse-data\n\
       Treat the input data as a hexadecimal string instead of raw (binary)\n\
       machine code. This is useful when pasting data into a terminal from a hex\n\
@@ -2369,6 +4415,171 @@ static uint32_t parse_cli_type(const char* str, char end_char = '\0', size_t* nu
   return dest.type;
 }
 
+// Disassembles filename (a file or directory) into the directory out_dir, or
+// into an archive named out_dir if archive_format isn't FILE_TREE. If out_dir
+// is empty, the output is written next to the input. Returns true if any
+// resources were exported.
+static bool run_disassembly_job(
+    ResourceExporter& exporter,
+    const string& filename,
+    string out_dir,
+    OutputArchiveFormat archive_format,
+    int archive_level,
+    size_t write_threads) {
+  if (archive_format == OutputArchiveFormat::FILE_TREE) {
+    if (out_dir.empty()) {
+      out_dir = filename + ".out";
+    }
+    mkdir(out_dir.c_str(), 0777);
+    return exporter.disassemble(filename, out_dir);
+  }
+
+  // The output filenames are relative to the root of the archive, so there's
+  // no base output directory
+  if (out_dir.empty()) {
+    out_dir = filename + ".out." + file_extension_for_output_archive_format(archive_format);
+  }
+  auto sink = make_output_sink(archive_format, out_dir, archive_level);
+  exporter.output_writer = make_shared<OutputWriter>(sink, write_threads, 0x4000000);
+  bool ret = exporter.disassemble(filename, "");
+  sink->close();
+  return ret;
+}
+
+// In service mode, each request is one line, containing an input filename and
+// optionally a tab and an output filename (as would be given on the command
+// line). The response is also one line: "OK" if any resources were exported,
+// "FAILED" if none were, or "ERROR <message>" if the job couldn't be run at
+// all. Jobs on the same connection run one at a time, in order; jobs on
+// different connections (in socket mode) run at the same time. All jobs share
+// the exporter's configuration and caches (and the process-wide caches, like
+// the decompression result cache and loaded system decompressors), so after
+// the first few jobs, the cost of each job is mostly just decoding.
+static void serve_disassembly_jobs(
+    const ResourceExporter& base_exporter,
+    FILE* in,
+    FILE* out,
+    OutputArchiveFormat archive_format,
+    int archive_level,
+    size_t write_threads) {
+  // disassemble() keeps some state in the exporter, so each connection gets
+  // its own copy; the caches are shared between copies. The output writer
+  // isn't shared, since flushing it waits for every connection's writes.
+  ResourceExporter exporter(base_exporter);
+  exporter.output_writer = make_shared<OutputWriter>(
+      make_shared<FileTreeOutputSink>(), write_threads, 0x4000000);
+  char* line_data = nullptr;
+  size_t line_capacity = 0;
+  ssize_t line_size;
+  while ((line_size = getline(&line_data, &line_capacity, in)) > 0) {
+    string line(line_data, line_size);
+    strip_trailing_whitespace(line);
+    if (line.empty()) {
+      break;
+    }
+
+    size_t tab_pos = line.find('\t');
+    string filename = line.substr(0, tab_pos);
+    string out_dir = (tab_pos == string::npos) ? "" : line.substr(tab_pos + 1);
+    string response;
+    try {
+      // An archive written to stdout would be mixed up with the responses
+      if ((out == stdout) && (archive_format != OutputArchiveFormat::FILE_TREE) &&
+          (out_dir == "-")) {
+        throw invalid_argument("archives can\'t be written to stdout when serving on stdin");
+      }
+      response = run_disassembly_job(exporter, filename, out_dir,
+          archive_format, archive_level, write_threads) ? "OK\n" : "FAILED\n";
+    } catch (const exception& e) {
+      response = string_printf("ERROR %s\n", e.what());
+      // Messages can't contain newlines, since they end the response
+      for (size_t z = 0; z < response.size() - 1; z++) {
+        if (response[z] == '\n') {
+          response[z] = ' ';
+        }
+      }
+    }
+    fwritex(out, response);
+    fflush(out);
+  }
+  free(line_data);
+}
+
+// Listens for connections on a Unix socket at socket_path, and serves jobs on
+// each connection (on its own thread) as described above. At most
+// max_connections connections are served at once; further connections wait in
+// the socket's backlog until one ends. Never returns unless the socket can't
+// be created.
+[[noreturn]] static void serve_disassembly_jobs_on_socket(
+    const ResourceExporter& base_exporter,
+    const string& socket_path,
+    size_t max_connections,
+    OutputArchiveFormat archive_format,
+    int archive_level,
+    size_t write_threads) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    throw invalid_argument("socket path is too long");
+  }
+  strcpy(addr.sun_path, socket_path.c_str());
+
+  scoped_fd listen_fd(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (listen_fd < 0) {
+    throw runtime_error(string_printf("cannot create socket (%d)", errno));
+  }
+  // A socket left behind by a previous run would make bind() fail
+  unlink(socket_path.c_str());
+  if (::bind(listen_fd, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr))) {
+    throw runtime_error(string_printf("cannot bind socket to %s (%d)", socket_path.c_str(), errno));
+  }
+  if (listen(listen_fd, 16)) {
+    throw runtime_error(string_printf("cannot listen on socket (%d)", errno));
+  }
+  fprintf(stderr, "listening on %s\n", socket_path.c_str());
+
+  // These are never destroyed, since this function never returns
+  mutex connections_lock;
+  condition_variable connection_finished;
+  size_t num_connections = 0;
+
+  for (;;) {
+    {
+      unique_lock<mutex> g(connections_lock);
+      connection_finished.wait(g, [&]() -> bool {
+        return num_connections < max_connections;
+      });
+    }
+
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno != EINTR) {
+        fprintf(stderr, "warning: cannot accept connection (%d)\n", errno);
+      }
+      continue;
+    }
+
+    {
+      lock_guard<mutex> g(connections_lock);
+      num_connections++;
+    }
+    thread([&, fd]() -> void {
+      try {
+        auto in = fdopen_unique(fd, "rb");
+        auto out = fdopen_unique(dup(fd), "wb");
+        serve_disassembly_jobs(base_exporter, in.get(), out.get(),
+            archive_format, archive_level, write_threads);
+      } catch (const exception& e) {
+        fprintf(stderr, "warning: connection failed: %s\n", e.what());
+      }
+      lock_guard<mutex> g(connections_lock);
+      num_connections--;
+      connection_finished.notify_one();
+    }).detach();
+  }
+}
+
 int main(int argc, char* argv[]) {
   signal(SIGPIPE, SIG_IGN);
 
@@ -2384,6 +4595,8 @@ int main(int argc, char* argv[]) {
     DISASSEMBLE_REL,
     DISASSEMBLE_PE,
     DISASSEMBLE_ELF,
+    INVENTORY,
+    SERVE,
   };
 
   struct ModificationOperation {
@@ -2420,6 +4633,12 @@ int main(int argc, char* argv[]) {
   bool print_hex_view_for_code = false;
   bool create_resource_map = false;
   bool use_output_data_fork = false; // Only used for Behavior::MODIFY_RESOURCE_MAP
+  auto inventory_format = ResourceExporter::InventoryFormat::NDJSON;
+  size_t write_threads = 0;
+  auto output_archive_format = OutputArchiveFormat::FILE_TREE;
+  int output_archive_level = 6;
+  string serve_socket_path; // If empty, serve jobs on stdin/stdout
+  size_t serve_max_connections = 0; // 0 = one per CPU core
   uint32_t disassembly_start_address = 0;
   multimap<uint32_t, string> disassembly_labels;
   for (int x = 1; x < argc; x++) {
@@ -2435,6 +4654,26 @@ int main(int argc, char* argv[]) {
       } else if (!strcmp(argv[x], "--index-format=dc-data")) {
         exporter.set_index_format(IndexFormat::DC_DATA);
         exporter.use_data_fork = true;
+      } else if (!strncmp(argv[x], "--index-cache=", 14)) {
+        exporter.index_cache_directory = &argv[x][14];
+        if (mkdir(exporter.index_cache_directory.c_str(), 0777) && (errno != EEXIST)) {
+          throw runtime_error("cannot create index cache directory " + exporter.index_cache_directory);
+        }
+
+      } else if (!strcmp(argv[x], "--inventory") || !strcmp(argv[x], "--inventory=ndjson")) {
+        behavior = Behavior::INVENTORY;
+        inventory_format = ResourceExporter::InventoryFormat::NDJSON;
+      } else if (!strcmp(argv[x], "--inventory=tsv")) {
+        behavior = Behavior::INVENTORY;
+        inventory_format = ResourceExporter::InventoryFormat::TSV;
+      } else if (!strcmp(argv[x], "--serve")) {
+        behavior = Behavior::SERVE;
+        serve_socket_path.clear();
+      } else if (!strncmp(argv[x], "--serve=", 8)) {
+        behavior = Behavior::SERVE;
+        serve_socket_path = &argv[x][8];
+      } else if (!strncmp(argv[x], "--serve-connections=", 20)) {
+        serve_max_connections = strtoull(&argv[x][20], nullptr, 0);
 
       } else if (!strcmp(argv[x], "--decode-pict-file")) {
         decode_pict_file = true;
@@ -2560,6 +4799,8 @@ int main(int argc, char* argv[]) {
 
       } else if (!strcmp(argv[x], "--hex-view-for-code")) {
         print_hex_view_for_code = true;
+      } else if (!strncmp(argv[x], "--disassembly-threads=", 22)) {
+        exporter.disassembly_threads = strtoull(&argv[x][22], nullptr, 0);
 
       } else if (!strcmp(argv[x], "--parse-data")) {
         parse_data = true;
@@ -2577,8 +4818,17 @@ int main(int argc, char* argv[]) {
       } else if (!strcmp(argv[x], "--skip-external-decoders")) {
         exporter.disable_external_decoders();
 
+      } else if (!strcmp(argv[x], "--internal-preprocessor=auto")) {
+        exporter.internal_preprocessor_auto = true;
+      } else if (!strncmp(argv[x], "--internal-preprocessor=", 24)) {
+        exporter.internal_preprocessor = find_codec(&argv[x][24]);
+        if (!exporter.internal_preprocessor || (exporter.internal_preprocessor->dcmp_id >= 0)) {
+          throw invalid_argument("unknown codec for --internal-preprocessor");
+        }
       } else if (!strncmp(argv[x], "--external-preprocessor=", 24)) {
         exporter.external_preprocessor_command = split(&argv[x][24], ' ');
+      } else if (!strncmp(argv[x], "--external-preprocessor-processes=", 34)) {
+        exporter.external_preprocessor_processes = strtoull(&argv[x][34], nullptr, 0);
 
       } else if (!strncmp(argv[x], "--target-type=", 14)) {
         exporter.target_types.emplace(parse_cli_type(&argv[x][14]));
@@ -2639,10 +4889,66 @@ int main(int argc, char* argv[]) {
 
       } else if (!strcmp(argv[x], "--skip-templates")) {
         exporter.skip_templates = true;
+      } else if (!strcmp(argv[x], "--render-songs")) {
+        exporter.render_songs = true;
+      } else if (!strncmp(argv[x], "--render-songs=", 15)) {
+        exporter.render_songs = true;
+        exporter.song_sample_rate = strtoul(&argv[x][15], nullptr, 0);
+        if (exporter.song_sample_rate == 0) {
+          throw invalid_argument("invalid sample rate for --render-songs");
+        }
+
+      } else if (!strncmp(argv[x], "--decoded-cache-size=", 21)) {
+        size_t max_size = strtoull(&argv[x][21], nullptr, 0);
+        exporter.decoded_output_cache = max_size ? make_shared<DecodedOutputCache>(max_size) : nullptr;
+      } else if (!strcmp(argv[x], "--hardlink-cached-outputs")) {
+        exporter.hardlink_cached_outputs = true;
+      } else if (!strcmp(argv[x], "--incremental")) {
+        exporter.incremental = true;
+      } else if (!strncmp(argv[x], "--write-threads=", 16)) {
+        write_threads = strtoull(&argv[x][16], nullptr, 0);
+      } else if (!strncmp(argv[x], "--output-archive=", 17)) {
+        output_archive_format = output_archive_format_for_name(&argv[x][17]);
+      } else if (!strncmp(argv[x], "--output-archive-level=", 23)) {
+        output_archive_level = strtol(&argv[x][23], nullptr, 0);
+        if ((output_archive_level < 0) || (output_archive_level > 9)) {
+          throw invalid_argument("output archive compression level must be between 0 and 9");
+        }
+      } else if (!strncmp(argv[x], "--audio-format=", 15)) {
+        exporter.audio_options.format = audio_format_for_name(&argv[x][15]);
+      } else if (!strncmp(argv[x], "--image-format=", 15)) {
+        exporter.image_options.format = image_format_for_name(&argv[x][15]);
+      } else if (!strncmp(argv[x], "--png-level=", 12)) {
+        exporter.image_options.png_level = strtol(&argv[x][12], nullptr, 0);
+        if ((exporter.image_options.png_level < 0) || (exporter.image_options.png_level > 9)) {
+          throw invalid_argument("--png-level must be between 0 and 9");
+        }
+
+      } else if (!strncmp(argv[x], "--jobs=", 7)) {
+        exporter.num_jobs = strtoull(&argv[x][7], nullptr, 0);
+        if (exporter.num_jobs == 0) {
+          exporter.num_jobs = thread::hardware_concurrency();
+        }
 
       } else if (!strcmp(argv[x], "--skip-decompression")) {
         exporter.decompress_flags |= DecompressionFlag::DISABLED;
 
+      } else if (!strncmp(argv[x], "--max-emulated-cycles=", 22)) {
+        exporter.resource_budget.max_emulated_cycles = strtoull(&argv[x][22], nullptr, 0);
+      } else if (!strncmp(argv[x], "--max-resource-time=", 20)) {
+        exporter.resource_budget.max_usecs = strtoull(&argv[x][20], nullptr, 0) * 1000;
+      } else if (!strncmp(argv[x], "--max-resource-memory=", 22)) {
+        exporter.resource_budget.max_memory_bytes = strtoull(&argv[x][22], nullptr, 0);
+      } else if (!strncmp(argv[x], "--stats=", 8)) {
+        if (strcmp(&argv[x][8], "json")) {
+          throw invalid_argument("--stats format must be json");
+        }
+        set_decode_stats(make_shared<DecodeStats>());
+        should_count_allocations = true;
+      } else if (!strncmp(argv[x], "--decompression-cache=", 22)) {
+        set_decompression_result_cache(make_shared<DecompressionResultCache>(&argv[x][22]));
+      } else if (!strncmp(argv[x], "--dcmp-fingerprints=", 20)) {
+        load_decompressor_fingerprints(&argv[x][20]);
       } else if (!strcmp(argv[x], "--verbose-decompression")) {
         exporter.decompress_flags |= DecompressionFlag::VERBOSE;
       } else if (!strcmp(argv[x], "--trace-decompression")) {
@@ -2660,6 +4966,8 @@ int main(int argc, char* argv[]) {
         exporter.decompress_flags |= DecompressionFlag::SKIP_SYSTEM_DCMP;
       } else if (!strcmp(argv[x], "--skip-system-ncmp")) {
         exporter.decompress_flags |= DecompressionFlag::SKIP_SYSTEM_NCMP;
+      } else if (!strcmp(argv[x], "--jit-dcmp")) {
+        exporter.decompress_flags |= DecompressionFlag::USE_JIT;
 
       } else {
         fprintf(stderr, "unknown option: %s\n", argv[x]);
@@ -2681,6 +4989,16 @@ int main(int argc, char* argv[]) {
     throw runtime_error("multiple incompatible modes were specified");
   }
 
+  // These options all need each output to be a separate file, so they can be
+  // read back, linked to, or checked for existence later
+  if ((output_archive_format != OutputArchiveFormat::FILE_TREE) &&
+      (exporter.incremental || exporter.hardlink_cached_outputs ||
+          exporter.decoded_output_cache.get() || single_resource.type)) {
+    throw invalid_argument("--output-archive cannot be used with --incremental, --decoded-cache-size, --hardlink-cached-outputs, or --decode-single-resource");
+  }
+  exporter.output_writer = make_shared<OutputWriter>(
+      make_shared<FileTreeOutputSink>(), write_threads, 0x4000000);
+
   if (behavior == Behavior::DISASSEMBLE_RESOURCES) {
     if (filename.empty()) {
       print_usage();
@@ -2712,20 +5030,71 @@ int main(int argc, char* argv[]) {
       string base_filename = (last_slash_pos == string::npos) ? filename :
           filename.substr(last_slash_pos + 1);
 
+      ResourceBudgetScope budget_scope(exporter.resource_budget);
       const auto& res = rf.get_resource(type, id, exporter.decompress_flags);
       return exporter.export_resource(filename, res) ? 0 : 3;
 
     } else {
-      if (out_dir.empty()) {
-        out_dir = filename + ".out";
+      bool success = run_disassembly_job(exporter, filename, out_dir,
+          output_archive_format, output_archive_level, write_threads);
+      auto decompression_cache = get_decompression_result_cache();
+      if (decompression_cache.get()) {
+        fprintf(stderr, "decompression cache: %zu hits, %zu misses\n",
+            decompression_cache->hit_count(), decompression_cache->miss_count());
       }
-      mkdir(out_dir.c_str(), 0777);
-      if (!exporter.disassemble(filename, out_dir)) {
-        return 3;
-      } else {
-        return 0;
+      for (const auto& it : decompressor_fingerprint_hits()) {
+        fprintf(stderr, "native decompressor used for fingerprint %016" PRIX64 ": %zu times\n",
+            it.first, it.second);
+      }
+      auto stats = get_decode_stats();
+      if (stats.get()) {
+        exporter.output_writer->flush();
+        if (decompression_cache.get()) {
+          stats->record_cache_lookups("decompression_result_cache",
+              decompression_cache->hit_count(), decompression_cache->miss_count());
+        }
+        if (exporter.decoded_output_cache.get()) {
+          stats->record_cache_lookups("decoded_output_cache",
+              exporter.decoded_output_cache->hit_count(),
+              exporter.decoded_output_cache->miss_count());
+        }
+        stats->set_memory_totals(current_memory_totals());
+        fprintf(stdout, "%s\n", stats->json().c_str());
+      }
+      return success ? 0 : 3;
+    }
+
+  } else if (behavior == Behavior::SERVE) {
+    if (!filename.empty()) {
+      print_usage();
+      return 1;
+    }
+    exporter.prepare_for_jobs();
+    if (serve_socket_path.empty()) {
+      serve_disassembly_jobs(exporter, stdin, stdout,
+          output_archive_format, output_archive_level, write_threads);
+    } else {
+      if (serve_max_connections == 0) {
+        serve_max_connections = max<size_t>(thread::hardware_concurrency(), 1);
       }
+      serve_disassembly_jobs_on_socket(exporter, serve_socket_path,
+          serve_max_connections, output_archive_format, output_archive_level,
+          write_threads);
+    }
+    return 0;
+
+  } else if (behavior == Behavior::INVENTORY) {
+    if (filename.empty()) {
+      print_usage();
+      return 1;
+    }
+    unique_ptr<FILE, fclose_deleter> out_file;
+    if (!out_dir.empty()) {
+      out_file = fopen_unique(out_dir, "wb");
     }
+    bool success = exporter.inventory(
+        filename, out_file ? out_file.get() : stdout, inventory_format);
+    return success ? 0 : 3;
 
   } else if (behavior == Behavior::MODIFY_RESOURCE_MAP) {
     if (filename.empty()) {
@@ -2733,9 +5102,9 @@ int main(int argc, char* argv[]) {
       return 1;
     }
 
-    string input_data;
+    string input_filename;
+    shared_ptr<const MappedFile> input_file;
     if (!create_resource_map) {
-      string input_filename;
       if (exporter.use_data_fork) {
         input_filename = filename;
       } else if (isfile(filename + RESOURCE_FORK_FILENAME_SUFFIX)) {
@@ -2743,7 +5112,7 @@ int main(int argc, char* argv[]) {
       } else if (isfile(filename + RESOURCE_FORK_FILENAME_SHORT_SUFFIX)) {
         input_filename = filename + RESOURCE_FORK_FILENAME_SHORT_SUFFIX;
       }
-      input_data = load_file(input_filename);
+      input_file = make_shared<MappedFile>(input_filename);
 
       if (out_dir.empty()) {
         out_dir = filename + ".out";
@@ -2756,9 +5125,9 @@ int main(int argc, char* argv[]) {
       out_dir = filename;
     }
 
-    fprintf(stderr, "... (load input) %zu bytes\n", input_data.size());
+    fprintf(stderr, "... (load input) %zu bytes\n", input_file ? input_file->size() : 0);
 
-    ResourceFile rf = parse_resource_fork(input_data);
+    ResourceFile rf = input_file ? parse_resource_fork(input_file) : parse_resource_fork(string());
     for (const auto& op : modifications) {
       string type_str = string_for_resource_type(op.res_type);
       switch (op.op_type) {
@@ -2806,18 +5175,36 @@ int main(int argc, char* argv[]) {
       out_dir += RESOURCE_FORK_FILENAME_SUFFIX;
     }
 
-    string output_data = serialize_resource_fork(rf);
-    fprintf(stderr, "... (serialize output) %zu bytes\n", output_data.size());
-
     // Attempting to open the resource fork of a nonexistent file will fail
     // without creating the file, so if we're writing to a resource fork, we
     // touch the file first to make sure it will exist when we write the output.
+    // A resource fork can't be replaced by renaming a file over it, so it's
+    // overwritten in place instead.
+    bool output_is_resource_fork = true;
     if (ends_with(out_dir, RESOURCE_FORK_FILENAME_SUFFIX)) {
       fopen_unique(out_dir.substr(0, out_dir.size() - RESOURCE_FORK_FILENAME_SUFFIX.size()), "a+");
     } else if (ends_with(out_dir, RESOURCE_FORK_FILENAME_SHORT_SUFFIX)) {
       fopen_unique(out_dir.substr(0, out_dir.size() - RESOURCE_FORK_FILENAME_SHORT_SUFFIX.size()), "a+");
+    } else {
+      output_is_resource_fork = false;
+    }
+
+    // Unmodified resources are written directly from the input file's
+    // mapping, which doesn't work if the output overwrites the input in place;
+    // in that case, load all the data before writing the output
+    struct stat input_st, output_st;
+    if (output_is_resource_fork && input_file &&
+        !stat(input_filename.c_str(), &input_st) &&
+        !stat(out_dir.c_str(), &output_st) &&
+        (input_st.st_dev == output_st.st_dev) &&
+        (input_st.st_ino == output_st.st_ino)) {
+      for (const auto& it : rf.all_resources()) {
+        rf.get_resource(it.first, it.second, DecompressionFlag::DISABLED);
+      }
     }
-    save_file(out_dir, output_data);
+
+    size_t output_bytes = save_resource_fork(out_dir, rf, !output_is_resource_fork);
+    fprintf(stderr, "... (serialize output) %zu bytes\n", output_bytes);
 
   } else {
     string data;
@@ -2844,40 +5231,47 @@ int main(int argc, char* argv[]) {
 
     } else if (behavior == Behavior::DISASSEMBLE_PEFF) {
       disassemble_executable<PEFFFile>(
-          filename, data, out_dir, &disassembly_labels, print_hex_view_for_code);
+          filename, data, out_dir, &disassembly_labels, print_hex_view_for_code,
+          exporter.disassembly_threads);
     } else if (behavior == Behavior::DISASSEMBLE_DOL) {
       disassemble_executable<DOLFile>(
-          filename, data, out_dir, &disassembly_labels, print_hex_view_for_code);
+          filename, data, out_dir, &disassembly_labels, print_hex_view_for_code,
+          exporter.disassembly_threads);
     } else if (behavior == Behavior::DISASSEMBLE_REL) {
       disassemble_executable<RELFile>(
-          filename, data, out_dir, &disassembly_labels, print_hex_view_for_code);
+          filename, data, out_dir, &disassembly_labels, print_hex_view_for_code,
+          exporter.disassembly_threads);
     } else if (behavior == Behavior::DISASSEMBLE_PE) {
       disassemble_executable<PEFile>(
-          filename, data, out_dir, &disassembly_labels, print_hex_view_for_code);
+          filename, data, out_dir, &disassembly_labels, print_hex_view_for_code,
+          exporter.disassembly_threads);
     } else if (behavior == Behavior::DISASSEMBLE_ELF) {
       disassemble_executable<ELFFile>(
-          filename, data, out_dir, &disassembly_labels, print_hex_view_for_code);
+          filename, data, out_dir, &disassembly_labels, print_hex_view_for_code,
+          exporter.disassembly_threads);
 
     } else {
-      string disassembly;
+      // The disassembly is written to the output as it's generated, rather
+      // than all at once at the end
+      LabelIndex labels(disassembly_labels);
+      unique_ptr<FILE, fclose_deleter> out_file;
+      if (!out_dir.empty()) {
+        out_file = fopen_unique(out_dir, "wt");
+      }
+      DisassemblyOutput out(out_file.get() ? out_file.get() : stdout);
       if (behavior == Behavior::DISASSEMBLE_M68K) {
-        disassembly = M68KEmulator::disassemble(data.data(), data.size(),
-            disassembly_start_address, &disassembly_labels);
+        M68KEmulator::disassemble(out, data.data(), data.size(),
+            disassembly_start_address, &labels, exporter.disassembly_threads);
       } else if (behavior == Behavior::DISASSEMBLE_PPC) {
-        disassembly = PPC32Emulator::disassemble(data.data(), data.size(),
-            disassembly_start_address, &disassembly_labels);
+        PPC32Emulator::disassemble(out, data.data(), data.size(),
+            disassembly_start_address, &labels, exporter.disassembly_threads);
       } else if (behavior == Behavior::DISASSEMBLE_X86) {
-        disassembly = X86Emulator::disassemble(data.data(), data.size(),
-            disassembly_start_address, &disassembly_labels);
+        X86Emulator::disassemble(out, data.data(), data.size(),
+            disassembly_start_address, &labels, exporter.disassembly_threads);
       } else {
         throw logic_error("invalid behavior");
       }
-      if (!out_dir.empty()) {
-        auto out = fopen_unique(out_dir, "wt");
-        fwritex(out.get(), disassembly);
-      } else {
-        fwritex(stdout, disassembly);
-      }
+      out.flush();
     }
     return 0;
   }
@@ -0,0 +1,601 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <functional>
+#include <memory>
+#include <phosg/Filesystem.hh>
+#include <phosg/JSON.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "AudioCodecs.hh"
+#include "Decompressors/System.hh"
+#include "Emulators/M68KEmulator.hh"
+#include "Emulators/PPC32Emulator.hh"
+#include "Emulators/X86Emulator.hh"
+#include "ResourceCompression.hh"
+#include "ResourceFile.hh"
+
+using namespace std;
+
+
+
+// All inputs are generated here rather than loaded from files, so results from
+// different machines and builds are directly comparable. The generator is a
+// plain LCG so the data doesn't depend on the standard library's
+// implementation of any random distribution.
+
+static string pseudorandom_data(size_t size, uint32_t seed) {
+  string ret(size, '\0');
+  for (size_t z = 0; z < size; z++) {
+    seed = seed * 1103515245 + 12345;
+    ret[z] = (seed >> 16) & 0xFF;
+  }
+  return ret;
+}
+
+static string make_compressed_resource_data(
+    int16_t dcmp_resource_id,
+    uint8_t header_version,
+    uint32_t decompressed_size,
+    const string& stream,
+    uint8_t param1 = 0,
+    uint8_t param2 = 0) {
+  StringWriter w;
+  w.put_u32b(0xA89F6572);
+  w.put_u16b(sizeof(CompressedResourceHeader));
+  w.put_u8(header_version);
+  w.put_u8(0x01); // attributes
+  w.put_u32b(decompressed_size);
+  if (header_version == 9) {
+    w.put_u16b(dcmp_resource_id);
+    w.put_u16b(0); // output_extra_bytes
+    w.put_u8(param1);
+    w.put_u8(param2);
+  } else {
+    size_t fractional_size = decompressed_size ? ((stream.size() * 0x100) / decompressed_size) : 0xFF;
+    w.put_u8((fractional_size > 0xFF) ? 0xFF : fractional_size);
+    w.put_u8(0); // output_extra_bytes
+    w.put_u16b(dcmp_resource_id);
+    w.put_u16b(0); // unused
+  }
+  w.write(stream);
+  return move(w.str());
+}
+
+// System dcmp 0 stream: a mix of memoized raw data, references to memo slots,
+// unmemoized raw data, and const words. Each block is 34 bytes when
+// decompressed.
+static string make_system0_stream(size_t num_blocks) {
+  StringWriter w;
+  for (size_t z = 0; z < num_blocks; z++) {
+    if (z < 0x28) {
+      w.put_u8(0x18); // 16 bytes of raw data, memoized
+      w.write(pseudorandom_data(0x10, z));
+    } else {
+      w.put_u8(0x23 + (z % 0x28)); // memo string, fixed slot
+    }
+    w.put_u8(0x08); // 16 bytes of raw data
+    w.write(pseudorandom_data(0x10, z + 0x10000));
+    w.put_u8(0x4B + (z % 0x20)); // const word
+  }
+  w.put_u8(0xFF);
+  return move(w.str());
+}
+
+// System dcmp 1 stream: the same mix of commands as above (and the same
+// decompressed size), with dcmp 1's command numbering
+static string make_system1_stream(size_t num_blocks) {
+  StringWriter w;
+  for (size_t z = 0; z < num_blocks; z++) {
+    if (z < 0xB0) {
+      w.put_u8(0x1F); // 16 bytes of raw data, memoized
+      w.write(pseudorandom_data(0x10, z));
+    } else {
+      w.put_u8(0x20 + (z % 0xB0)); // memo string, fixed slot
+    }
+    w.put_u8(0x0F); // 16 bytes of raw data
+    w.write(pseudorandom_data(0x10, z + 0x10000));
+    w.put_u8(0xD5 + (z % 0x20)); // const word
+  }
+  w.put_u8(0xFF);
+  return move(w.str());
+}
+
+// System dcmp 2 stream (with param2 = 0): the output is entirely const words
+// from the default table, so the stream is just one index per word
+static string make_system2_stream(size_t num_words) {
+  return pseudorandom_data(num_words, 2);
+}
+
+// Writes bits MSB-first, as dcmp 3 reads them
+class BitStreamWriter {
+public:
+  BitStreamWriter() : pending(0), pending_bits(0) { }
+
+  void write(uint32_t value, uint8_t bits) {
+    for (uint8_t z = bits; z > 0; z--) {
+      this->pending = (this->pending << 1) | ((value >> (z - 1)) & 1);
+      if (++this->pending_bits == 8) {
+        this->data.push_back(this->pending);
+        this->pending = 0;
+        this->pending_bits = 0;
+      }
+    }
+  }
+
+  string finish() {
+    if (this->pending_bits) {
+      this->data.push_back(this->pending << (8 - this->pending_bits));
+      this->pending = 0;
+      this->pending_bits = 0;
+    }
+    return move(this->data);
+  }
+
+private:
+  string data;
+  uint8_t pending;
+  uint8_t pending_bits;
+};
+
+// System dcmp 3 stream: alternating 63-byte literal blocks and 124-byte
+// backreferences. Returns the stream and the decompressed size.
+static pair<string, size_t> make_system3_stream(size_t num_blocks) {
+  // These are the offset encoding family thresholds used by dcmp 3; see
+  // read_int_max in Decompressors/System3.cc
+  static const uint32_t family_limits[] = {
+    0x0000A, 0x00014, 0x00028, 0x00050, 0x000A0, 0x002A0, 0x003E8, 0x00A80,
+    0x01500, 0x02A00, 0x05400, 0x0A800, 0x11170, 0x2A000,
+  };
+
+  BitStreamWriter w;
+  size_t bytes_written = 0;
+  for (size_t z = 0; z < num_blocks; z++) {
+    w.write(0x0, 2); // no backreference
+    w.write(0x3FF, 10); // 63 literal bytes
+    string literal = pseudorandom_data(63, z);
+    for (char ch : literal) {
+      w.write(static_cast<uint8_t>(ch), 8);
+    }
+    bytes_written += 63;
+
+    w.write(0x7E, 7); // backreference of 59 + x (+ 2) bytes...
+    w.write(0x3F, 6); // ... where x = 63
+    uint8_t family = 0;
+    while ((family < sizeof(family_limits) / sizeof(family_limits[0])) &&
+           (bytes_written > family_limits[family])) {
+      family++;
+    }
+    // Offset is 1 + 2^family + x; use the farthest one that's in range
+    uint32_t max_x = (1 << (family + 2)) - 1;
+    uint32_t x = bytes_written - (1 << family) - 1;
+    w.write(0x2, 2);
+    w.write((x > max_x) ? max_x : x, family + 2);
+    bytes_written += 124;
+  }
+  return make_pair(w.finish(), bytes_written);
+}
+
+// A 512x384 version 2 PICT containing a single PackBitsRect opcode with an
+// 8-bit indexed pixel map, which is the most common kind of image in PICTs
+static string make_indexed_color_pict(uint16_t width, uint16_t height) {
+  StringWriter w;
+  w.put_u16b(0); // size (ignored in v2)
+  w.put_u16b(0); // bounds
+  w.put_u16b(0);
+  w.put_u16b(height);
+  w.put_u16b(width);
+  w.put_u16b(0x0011); // version (parsed as nop + version in v1)
+  w.put_u16b(0x02FF);
+  w.put_u16b(0x0C00); // v2 extended header
+  w.put_u16b(0xFFFE);
+  w.put_u16b(0x0000);
+  w.put_u32b(0x00480000);
+  w.put_u32b(0x00480000);
+  w.put_u16b(0);
+  w.put_u16b(0);
+  w.put_u16b(height);
+  w.put_u16b(width);
+  w.put_u32b(0);
+  w.put_u16b(0x0001); // clip region
+  w.put_u16b(0x000A);
+  w.put_u16b(0);
+  w.put_u16b(0);
+  w.put_u16b(height);
+  w.put_u16b(width);
+
+  w.put_u16b(0x0098); // PackBitsRect
+  w.put_u16b(0x8000 | width); // PixelMapHeader: flags_row_bytes
+  w.put_u16b(0); // bounds
+  w.put_u16b(0);
+  w.put_u16b(height);
+  w.put_u16b(width);
+  w.put_u16b(0); // version
+  w.put_u16b(0); // pack_format
+  w.put_u32b(0); // pack_size
+  w.put_u32b(0x00480000); // h_res
+  w.put_u32b(0x00480000); // v_res
+  w.put_u16b(0); // pixel_type
+  w.put_u16b(8); // pixel_size
+  w.put_u16b(1); // component_count
+  w.put_u16b(8); // component_size
+  w.put_u32b(0); // plane_offset
+  w.put_u32b(0); // color_table_offset
+  w.put_u32b(0); // reserved
+
+  w.put_u32b(0); // color table seed
+  w.put_u16b(0); // color table flags
+  w.put_u16b(0x00FF); // color table entry count - 1
+  for (size_t z = 0; z < 0x100; z++) {
+    w.put_u16b(z);
+    w.put_u16b(z * 0x0101);
+    w.put_u16b((0xFF - z) * 0x0101);
+    w.put_u16b((z ^ 0x55) * 0x0101);
+  }
+  w.put_u16b(0); // source rect
+  w.put_u16b(0);
+  w.put_u16b(height);
+  w.put_u16b(width);
+  w.put_u16b(0); // dest rect
+  w.put_u16b(0);
+  w.put_u16b(height);
+  w.put_u16b(width);
+  w.put_u16b(0); // mode (srcCopy)
+
+  // Each row alternates 32-byte runs and 32-byte literal segments. Rows are
+  // more than 250 bytes, so their packed sizes are words.
+  for (size_t y = 0; y < height; y++) {
+    string row;
+    for (size_t x = 0; x < width; x += 32) {
+      if ((x / 32) & 1) {
+        row.push_back(31);
+        row += pseudorandom_data(32, y * width + x);
+      } else {
+        row.push_back(-31);
+        row.push_back(y + x);
+      }
+    }
+    w.put_u16b(row.size());
+    w.write(row);
+  }
+
+  if (w.size() & 1) {
+    w.put_u8(0);
+  }
+  w.put_u16b(0x00FF); // end of picture
+  return move(w.str());
+}
+
+
+
+// Emulator workloads are tight counting loops that end with a syscall, which
+// the syscall handler turns into a clean exit. Each loop iteration is the
+// same small number of instructions on all three CPUs, so the results mostly
+// reflect the dispatch overhead of the emulator.
+
+static const uint32_t emulator_code_addr = 0x00001000;
+static const uint32_t emulator_code_region_size = 0x1000;
+
+static uint64_t run_m68k_loop(uint32_t loop_count) {
+  StringWriter code;
+  code.put_u16b(0x203C); // move.l #loop_count, d0
+  code.put_u32b(loop_count);
+  code.put_u16b(0x5281); // loop: addq.l #1, d1
+  code.put_u16b(0x5380); // subq.l #1, d0
+  code.put_u16b(0x66FA); // bne.s loop
+  code.put_u16b(0xA9F4); // ExitToShell
+
+  auto mem = make_shared<MemoryContext>();
+  mem->allocate_at(emulator_code_addr, emulator_code_region_size);
+  mem->memcpy(emulator_code_addr, code.str().data(), code.str().size());
+
+  M68KEmulator emu(mem);
+  emu.registers().pc = emulator_code_addr;
+  emu.registers().set_sp(emulator_code_addr + emulator_code_region_size);
+  emu.set_syscall_handler([](M68KEmulator&, uint16_t) {
+    throw M68KEmulator::terminate_emulation();
+  });
+  emu.execute();
+  return emu.cycles();
+}
+
+static uint64_t run_ppc32_loop(uint32_t loop_count) {
+  StringWriter code;
+  code.put_u32b(0x3C600000 | (loop_count >> 16)); // lis r3, loop_count@h
+  code.put_u32b(0x60630000 | (loop_count & 0xFFFF)); // ori r3, r3, loop_count@l
+  code.put_u32b(0x7C6903A6); // mtctr r3
+  code.put_u32b(0x38840001); // loop: addi r4, r4, 1
+  code.put_u32b(0x4200FFFC); // bdnz loop
+  code.put_u32b(0x44000002); // sc
+
+  auto mem = make_shared<MemoryContext>();
+  mem->allocate_at(emulator_code_addr, emulator_code_region_size);
+  mem->memcpy(emulator_code_addr, code.str().data(), code.str().size());
+
+  PPC32Emulator emu(mem);
+  emu.registers().pc = emulator_code_addr;
+  emu.registers().set_sp(emulator_code_addr + emulator_code_region_size);
+  emu.set_syscall_handler([](PPC32Emulator&) {
+    throw PPC32Emulator::terminate_emulation();
+  });
+  emu.execute();
+  return emu.cycles();
+}
+
+static uint64_t run_x86_loop(uint32_t loop_count) {
+  StringWriter code;
+  code.put_u8(0xB9); // mov ecx, loop_count
+  code.put_u32l(loop_count);
+  code.put_u8(0x40); // loop: inc eax
+  code.put_u8(0x49); // dec ecx
+  code.put_u8(0x75); // jnz loop
+  code.put_u8(0xFC);
+  code.put_u8(0xCD); // int 0x80
+  code.put_u8(0x80);
+
+  auto mem = make_shared<MemoryContext>();
+  mem->allocate_at(emulator_code_addr, emulator_code_region_size);
+  mem->memcpy(emulator_code_addr, code.str().data(), code.str().size());
+
+  X86Emulator emu(mem);
+  emu.registers().eip = emulator_code_addr;
+  emu.registers().set_sp(emulator_code_addr + emulator_code_region_size);
+  emu.set_syscall_handler([](X86Emulator&, uint8_t) {
+    throw X86Emulator::terminate_emulation();
+  });
+  emu.execute();
+  return emu.cycles();
+}
+
+
+
+struct Benchmark {
+  string name;
+  // What run() counts (e.g. "bytes" or "instructions")
+  string unit;
+  // Runs one iteration of the benchmark and returns the number of units
+  // processed
+  function<uint64_t()> run;
+};
+
+static vector<Benchmark> make_benchmarks() {
+  vector<Benchmark> ret;
+
+  // Internal decompressors, and emulated versions of the same via the system
+  // dcmps. The emulated runs go through a ResourceFile so the loaded
+  // decompressor is cached between iterations, as it is in resource_dasm.
+  uint64_t emulated_flags = DecompressionFlag::SKIP_INTERNAL |
+      DecompressionFlag::SKIP_FILE_DCMP |
+      DecompressionFlag::SKIP_FILE_NCMP |
+      DecompressionFlag::SKIP_SYSTEM_NCMP;
+  auto context_rf = make_shared<ResourceFile>();
+  auto add_decompressor_benchmarks = [&](
+      const char* name,
+      int16_t dcmp_resource_id,
+      const string& data,
+      string (*decompress)(const CompressedResourceHeader&, const void*, size_t)) {
+    auto data_ptr = make_shared<string>(data);
+    ret.emplace_back(Benchmark{name, "bytes", [data_ptr, decompress]() -> uint64_t {
+      const auto& header = *reinterpret_cast<const CompressedResourceHeader*>(data_ptr->data());
+      return decompress(header,
+          data_ptr->data() + sizeof(CompressedResourceHeader),
+          data_ptr->size() - sizeof(CompressedResourceHeader)).size();
+    }});
+    ret.emplace_back(Benchmark{
+        string_printf("decompress_resource.dcmp%hd.emulated", dcmp_resource_id), "bytes",
+        [data_ptr, context_rf, emulated_flags]() -> uint64_t {
+      auto res = make_shared<ResourceFile::Resource>(
+          0x44415441, 128, ResourceFlag::FLAG_COMPRESSED, "", *data_ptr);
+      decompress_resource(res, emulated_flags, context_rf.get());
+      return res->data.size();
+    }});
+    // The same, but with many resources decompressed at once on all cores, to
+    // measure how well concurrent emulator instances scale
+    ret.emplace_back(Benchmark{
+        string_printf("decompress_resources.dcmp%hd.emulated.parallel", dcmp_resource_id), "bytes",
+        [data_ptr, context_rf, emulated_flags]() -> uint64_t {
+      vector<shared_ptr<ResourceFile::Resource>> resources;
+      for (size_t z = 0; z < 0x40; z++) {
+        resources.emplace_back(make_shared<ResourceFile::Resource>(
+            0x44415441, 128, ResourceFlag::FLAG_COMPRESSED, "", *data_ptr));
+      }
+      decompress_resources(resources, emulated_flags, context_rf.get(), 0);
+      uint64_t total_bytes = 0;
+      for (const auto& res : resources) {
+        total_bytes += res->data.size();
+      }
+      return total_bytes;
+    }});
+  };
+
+  {
+    size_t num_blocks = 0x800;
+    add_decompressor_benchmarks("decompress_system0", 0,
+        make_compressed_resource_data(0, 8, num_blocks * 34, make_system0_stream(num_blocks)),
+        decompress_system0);
+  }
+  {
+    size_t num_blocks = 0x800;
+    add_decompressor_benchmarks("decompress_system1", 1,
+        make_compressed_resource_data(1, 8, num_blocks * 34, make_system1_stream(num_blocks)),
+        decompress_system1);
+  }
+  {
+    // decompress_system2 reads one index for every 4 bytes of decompressed_size
+    // (see the comment about num_words there)
+    size_t decompressed_size = 0x10000;
+    add_decompressor_benchmarks("decompress_system2", 2,
+        make_compressed_resource_data(2, 9, decompressed_size, make_system2_stream(decompressed_size / 4)),
+        decompress_system2);
+  }
+  {
+    auto stream = make_system3_stream(0x200);
+    add_decompressor_benchmarks("decompress_system3", 3,
+        make_compressed_resource_data(3, 8, stream.second, stream.first),
+        decompress_system3);
+  }
+
+  {
+    auto pict_res = make_shared<ResourceFile::Resource>(
+        RESOURCE_TYPE_PICT, 128, make_indexed_color_pict(512, 384));
+    ret.emplace_back(Benchmark{"render_pict.packed_indexed_8bit", "pixels",
+        [pict_res, context_rf]() -> uint64_t {
+      auto decoded = context_rf->decode_PICT_internal(pict_res);
+      return decoded.image.get_width() * decoded.image.get_height();
+    }});
+  }
+
+  {
+    // MACE packets are 2 bytes (MACE3) or 1 byte (MACE6) per 3 or 6 samples;
+    // IMA4 packets are 34 bytes per 64 samples
+    auto mace_data = make_shared<string>(pseudorandom_data(0x10000, 3));
+    ret.emplace_back(Benchmark{"decode_mace3", "samples", [mace_data]() -> uint64_t {
+      return decode_mace(mace_data->data(), mace_data->size(), false, true).size();
+    }});
+    ret.emplace_back(Benchmark{"decode_mace6", "samples", [mace_data]() -> uint64_t {
+      return decode_mace(mace_data->data(), mace_data->size(), false, false).size();
+    }});
+    auto ima4_data = make_shared<string>(pseudorandom_data(34 * 0x800, 4));
+    ret.emplace_back(Benchmark{"decode_ima4", "samples", [ima4_data]() -> uint64_t {
+      return decode_ima4(ima4_data->data(), ima4_data->size(), false).size();
+    }});
+  }
+
+  ret.emplace_back(Benchmark{"emulate.m68k", "instructions", []() -> uint64_t {
+    return run_m68k_loop(1000000);
+  }});
+  ret.emplace_back(Benchmark{"emulate.ppc32", "instructions", []() -> uint64_t {
+    return run_ppc32_loop(1000000);
+  }});
+  ret.emplace_back(Benchmark{"emulate.x86", "instructions", []() -> uint64_t {
+    return run_x86_loop(1000000);
+  }});
+
+  return ret;
+}
+
+// Runs the benchmark until it has done at least min_iterations and at least
+// min_usecs have elapsed. The first iteration is a warmup and isn't counted.
+static shared_ptr<JSONObject> run_benchmark(
+    const Benchmark& b, size_t min_iterations, uint64_t min_usecs) {
+  JSONObject::dict_type result;
+  result.emplace("name", new JSONObject(b.name));
+  result.emplace("unit", new JSONObject(b.unit));
+
+  try {
+    b.run();
+
+    size_t iterations = 0;
+    uint64_t total_units = 0;
+    uint64_t start_time = now();
+    uint64_t elapsed_usecs = 0;
+    while ((iterations < min_iterations) || (elapsed_usecs < min_usecs)) {
+      total_units += b.run();
+      iterations++;
+      elapsed_usecs = now() - start_time;
+    }
+
+    double seconds = static_cast<double>(elapsed_usecs) / 1000000.0;
+    result.emplace("iterations", new JSONObject(static_cast<uint64_t>(iterations)));
+    result.emplace("total_usecs", new JSONObject(elapsed_usecs));
+    result.emplace("usecs_per_iteration", new JSONObject(
+        static_cast<double>(elapsed_usecs) / iterations));
+    result.emplace("units_per_iteration", new JSONObject(total_units / iterations));
+    result.emplace("units_per_second", new JSONObject(
+        (seconds > 0) ? (total_units / seconds) : 0.0));
+
+  } catch (const exception& e) {
+    result.emplace("error", new JSONObject(e.what()));
+  }
+
+  return shared_ptr<JSONObject>(new JSONObject(move(result)));
+}
+
+
+
+void print_usage() {
+  fprintf(stderr, "\
+Usage: resource_dasm_bench [options] [output-filename]\n\
+\n\
+Runs a fixed set of benchmarks over the decompressors, the PICT renderer, the\n\
+audio codecs, and the CPU emulators, and writes the results as JSON to the\n\
+given file, or to stdout if no filename is given. The emulated decompression\n\
+benchmarks use the files in system_dcmps, so this should be run from the\n\
+resource_dasm source directory.\n\
+\n\
+Options:\n\
+  --filter=STRING\n\
+      Only run benchmarks whose names contain STRING.\n\
+  --min-iterations=N\n\
+      Run each benchmark at least N times (default 5).\n\
+  --min-time=MSECS\n\
+      Run each benchmark for at least this many milliseconds (default 500).\n\
+  --list\n\
+      List the benchmark names and exit.\n\
+\n");
+}
+
+int main(int argc, char** argv) {
+  string filter;
+  size_t min_iterations = 5;
+  uint64_t min_usecs = 500000;
+  bool list_only = false;
+  const char* output_filename = nullptr;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--filter=", 9)) {
+      filter = &argv[x][9];
+    } else if (!strncmp(argv[x], "--min-iterations=", 17)) {
+      min_iterations = strtoull(&argv[x][17], nullptr, 0);
+    } else if (!strncmp(argv[x], "--min-time=", 11)) {
+      min_usecs = strtoull(&argv[x][11], nullptr, 0) * 1000;
+    } else if (!strcmp(argv[x], "--list")) {
+      list_only = true;
+    } else if (!strcmp(argv[x], "--help")) {
+      print_usage();
+      return 0;
+    } else if (!output_filename) {
+      output_filename = argv[x];
+    } else {
+      fprintf(stderr, "excess argument: %s\n", argv[x]);
+      print_usage();
+      return 1;
+    }
+  }
+
+  auto benchmarks = make_benchmarks();
+
+  if (list_only) {
+    for (const auto& b : benchmarks) {
+      fprintf(stdout, "%s\n", b.name.c_str());
+    }
+    return 0;
+  }
+
+  JSONObject::list_type results;
+  for (const auto& b : benchmarks) {
+    if (!filter.empty() && (b.name.find(filter) == string::npos)) {
+      continue;
+    }
+    fprintf(stderr, "... %s\n", b.name.c_str());
+    results.emplace_back(run_benchmark(b, min_iterations, min_usecs));
+  }
+
+  JSONObject::dict_type root;
+  root.emplace("benchmarks", new JSONObject(move(results)));
+  string json_data = JSONObject(move(root)).format();
+  json_data.push_back('\n');
+
+  if (output_filename) {
+    save_file(output_filename, json_data);
+  } else {
+    fwritex(stdout, json_data);
+  }
+
+  return 0;
+}
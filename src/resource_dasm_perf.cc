@@ -0,0 +1,386 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <phosg/Filesystem.hh>
+#include <phosg/JSON.hh>
+#include <phosg/Process.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+
+// The exporter is part of the resource_dasm executable rather than the
+// library, so this replays each archive by running resource_dasm with
+// --stats=json and --output-archive=none, and reads the stats it prints. This
+// also means each archive is measured in a fresh process, so peak RSS and
+// allocation counts are per-archive.
+
+struct Metric {
+  const char* name;
+  // Times are subject to more noise than counts, so they're only compared if
+  // they're long enough to be meaningful (see --min-time)
+  bool is_time;
+  // For metrics that are kept once per run (not summed), the total over all
+  // archives is the maximum over all archives instead of the sum
+  bool total_is_max;
+};
+
+static const vector<Metric> METRICS = {
+    {"wall_usecs", true, false},
+    {"parse_usecs", true, false},
+    {"decompress_usecs", true, false},
+    {"decode_usecs", true, false},
+    {"encode_usecs", true, false},
+    {"write_usecs", true, false},
+    {"peak_rss_bytes", false, true},
+    {"allocations", false, false},
+    {"allocated_bytes", false, false},
+    {"output_files", false, false},
+    {"output_bytes", false, false},
+};
+
+static const vector<const char*> STAGE_NAMES = {
+    "parse", "decompress", "decode", "encode", "write"};
+
+struct ManifestEntry {
+  string filename;
+  vector<string> extra_args;
+};
+
+// Each line of the manifest is an archive filename, optionally followed by a
+// tab and extra arguments for resource_dasm (separated by spaces). Blank lines
+// and lines beginning with # are ignored.
+static vector<ManifestEntry> load_manifest(const string& filename) {
+  vector<ManifestEntry> ret;
+  for (string line : split(load_file(filename), '\n')) {
+    strip_trailing_whitespace(line);
+    if (line.empty() || (line[0] == '#')) {
+      continue;
+    }
+    auto& entry = ret.emplace_back();
+    size_t tab_pos = line.find('\t');
+    entry.filename = line.substr(0, tab_pos);
+    if (tab_pos != string::npos) {
+      for (const string& arg : split(line.substr(tab_pos + 1), ' ')) {
+        if (!arg.empty()) {
+          entry.extra_args.emplace_back(arg);
+        }
+      }
+    }
+  }
+  return ret;
+}
+
+static int64_t get_int_or_zero(const JSONObject& dict, const string& key) {
+  const auto& d = dict.as_dict();
+  auto it = d.find(key);
+  return (it == d.end()) ? 0 : it->second->as_int();
+}
+
+// Runs resource_dasm once on the archive and returns its metrics
+static map<string, int64_t> run_archive(
+    const string& resource_dasm_path,
+    const ManifestEntry& entry,
+    const vector<string>& common_args) {
+  vector<string> cmd = {resource_dasm_path, "--stats=json",
+      "--output-archive=none", "--write-threads=1"};
+  cmd.insert(cmd.end(), common_args.begin(), common_args.end());
+  cmd.insert(cmd.end(), entry.extra_args.begin(), entry.extra_args.end());
+  cmd.emplace_back(entry.filename);
+
+  uint64_t start_time = now();
+  auto result = run_process(cmd, nullptr, false);
+  uint64_t wall_usecs = now() - start_time;
+
+  // resource_dasm returns 3 if nothing in the archive could be exported, but
+  // that's still a valid measurement
+  if (!WIFEXITED(result.exit_status) ||
+      ((WEXITSTATUS(result.exit_status) != 0) && (WEXITSTATUS(result.exit_status) != 3))) {
+    throw runtime_error(string_printf("resource_dasm failed with status %d: %s",
+        result.exit_status, result.stderr_contents.c_str()));
+  }
+
+  // The stats are the last thing written to stdout, and the object begins at
+  // the start of a line
+  const string& out = result.stdout_contents;
+  size_t json_offset = out.rfind("\n{");
+  json_offset = (json_offset == string::npos) ? 0 : (json_offset + 1);
+  auto stats = JSONObject::parse(out.substr(json_offset));
+
+  map<string, int64_t> ret;
+  ret.emplace("wall_usecs", wall_usecs);
+  const auto& stats_dict = stats->as_dict();
+  const auto& stages = *stats_dict.at("stages");
+  for (const char* stage_name : STAGE_NAMES) {
+    int64_t usecs = 0;
+    auto it = stages.as_dict().find(stage_name);
+    if (it != stages.as_dict().end()) {
+      usecs = get_int_or_zero(*it->second, "usecs");
+    }
+    ret.emplace(string(stage_name) + "_usecs", usecs);
+  }
+  const auto& memory = *stats_dict.at("memory");
+  ret.emplace("peak_rss_bytes", get_int_or_zero(memory, "peak_rss_bytes"));
+  ret.emplace("allocations", get_int_or_zero(memory, "allocations"));
+  ret.emplace("allocated_bytes", get_int_or_zero(memory, "allocated_bytes"));
+  const auto& output = *stats_dict.at("output");
+  ret.emplace("output_files", get_int_or_zero(output, "files"));
+  ret.emplace("output_bytes", get_int_or_zero(output, "bytes"));
+  return ret;
+}
+
+static shared_ptr<JSONObject> metrics_json(const map<string, int64_t>& metrics) {
+  JSONObject::dict_type ret;
+  for (const auto& it : metrics) {
+    ret.emplace(it.first, new JSONObject(it.second));
+  }
+  return shared_ptr<JSONObject>(new JSONObject(move(ret)));
+}
+
+struct Thresholds {
+  double default_pct = 10.0;
+  map<string, double> metric_pct;
+  uint64_t min_usecs = 10000;
+
+  double for_metric(const string& name) const {
+    auto it = this->metric_pct.find(name);
+    return (it == this->metric_pct.end()) ? this->default_pct : it->second;
+  }
+};
+
+// Compares one archive's (or the totals') metrics against the baseline's and
+// prints any that got worse by more than their threshold. Returns the number
+// of regressions.
+static size_t compare_metrics(
+    const string& label,
+    const map<string, int64_t>& current,
+    const JSONObject& baseline,
+    const Thresholds& thresholds) {
+  size_t num_regressions = 0;
+  for (const auto& metric : METRICS) {
+    auto current_it = current.find(metric.name);
+    auto baseline_it = baseline.as_dict().find(metric.name);
+    if ((current_it == current.end()) || (baseline_it == baseline.as_dict().end())) {
+      continue;
+    }
+    int64_t current_value = current_it->second;
+    int64_t baseline_value = baseline_it->second->as_int();
+    if (metric.is_time &&
+        (static_cast<uint64_t>(max<int64_t>(current_value, baseline_value)) < thresholds.min_usecs)) {
+      continue;
+    }
+    if (baseline_value <= 0) {
+      continue;
+    }
+
+    double change_pct = (static_cast<double>(current_value - baseline_value) * 100.0) / baseline_value;
+    double threshold_pct = thresholds.for_metric(metric.name);
+    if (change_pct > threshold_pct) {
+      fprintf(stderr, "REGRESSION: %s: %s: %" PRId64 " -> %" PRId64 " (%+.1f%%, threshold %.1f%%)\n",
+          label.c_str(), metric.name, baseline_value, current_value, change_pct, threshold_pct);
+      num_regressions++;
+    } else if (change_pct < -threshold_pct) {
+      fprintf(stderr, "improvement: %s: %s: %" PRId64 " -> %" PRId64 " (%+.1f%%)\n",
+          label.c_str(), metric.name, baseline_value, current_value, change_pct);
+    }
+  }
+  return num_regressions;
+}
+
+
+
+void print_usage() {
+  fprintf(stderr, "\
+Usage: resource_dasm_perf [options] manifest-filename [output-filename]\n\
+\n\
+Replays a corpus of real archives through resource_dasm with all outputs\n\
+discarded, and records how long each stage of exporting took (parsing the\n\
+index, decompressing, decoding, encoding images, and writing), the peak RSS,\n\
+and the number of allocations made for each archive. The results are written\n\
+as JSON to the given file, or to stdout if no filename is given; they can be\n\
+used as the baseline for later runs.\n\
+\n\
+Each line of the manifest is an archive filename, optionally followed by a tab\n\
+and extra arguments for resource_dasm for that archive only (separated by\n\
+spaces). Blank lines and lines beginning with # are ignored.\n\
+\n\
+Outputs are written on one background thread, so encoding and writing images\n\
+isn\'t counted in the decode stage.\n\
+\n\
+Options:\n\
+  --resource-dasm=PATH\n\
+      Run this resource_dasm executable (default: the one in the same\n\
+      directory as resource_dasm_perf).\n\
+  --dasm-arg=ARG\n\
+      Pass ARG to resource_dasm for every archive. May be given multiple\n\
+      times.\n\
+  --iterations=N\n\
+      Run each archive N times (default 3). Times are the minimum over all\n\
+      runs; other metrics are the maximum.\n\
+  --baseline=FILENAME\n\
+      Compare the results against a previous run\'s results, and exit with\n\
+      status 2 if any metric got worse by more than its threshold. (If any\n\
+      archive can't be replayed at all, the exit status is 3.)\n\
+  --threshold=PCT\n\
+      Report a regression if a metric increased by more than PCT percent\n\
+      (default 10).\n\
+  --threshold=METRIC:PCT\n\
+      Use a different threshold for one metric (e.g. decode_usecs:20 or\n\
+      peak_rss_bytes:5). May be given multiple times.\n\
+  --min-time=MSECS\n\
+      Don\'t compare times that are shorter than this in both the baseline\n\
+      and the current run, since they\'re mostly noise (default 10).\n\
+\n");
+}
+
+int main(int argc, char** argv) {
+  string resource_dasm_path;
+  vector<string> common_args;
+  size_t iterations = 3;
+  const char* baseline_filename = nullptr;
+  Thresholds thresholds;
+  const char* manifest_filename = nullptr;
+  const char* output_filename = nullptr;
+  try {
+    for (int x = 1; x < argc; x++) {
+      if (!strncmp(argv[x], "--resource-dasm=", 16)) {
+        resource_dasm_path = &argv[x][16];
+      } else if (!strncmp(argv[x], "--dasm-arg=", 11)) {
+        common_args.emplace_back(&argv[x][11]);
+      } else if (!strncmp(argv[x], "--iterations=", 13)) {
+        iterations = strtoull(&argv[x][13], nullptr, 0);
+        if (iterations == 0) {
+          throw invalid_argument("--iterations must be at least 1");
+        }
+      } else if (!strncmp(argv[x], "--baseline=", 11)) {
+        baseline_filename = &argv[x][11];
+      } else if (!strncmp(argv[x], "--threshold=", 12)) {
+        string spec = &argv[x][12];
+        size_t colon_pos = spec.find(':');
+        if (colon_pos == string::npos) {
+          thresholds.default_pct = stod(spec);
+        } else {
+          string metric_name = spec.substr(0, colon_pos);
+          if (none_of(METRICS.begin(), METRICS.end(), [&](const Metric& m) { return metric_name == m.name; })) {
+            throw invalid_argument("unknown metric: " + metric_name);
+          }
+          thresholds.metric_pct[metric_name] = stod(spec.substr(colon_pos + 1));
+        }
+      } else if (!strncmp(argv[x], "--min-time=", 11)) {
+        thresholds.min_usecs = strtoull(&argv[x][11], nullptr, 0) * 1000;
+      } else if (!strcmp(argv[x], "--help")) {
+        print_usage();
+        return 0;
+      } else if (!manifest_filename) {
+        manifest_filename = argv[x];
+      } else if (!output_filename) {
+        output_filename = argv[x];
+      } else {
+        throw invalid_argument(string_printf("excess argument: %s", argv[x]));
+      }
+    }
+    if (!manifest_filename) {
+      throw invalid_argument("no manifest filename given");
+    }
+  } catch (const exception& e) {
+    fprintf(stderr, "%s\n", e.what());
+    print_usage();
+    return 1;
+  }
+
+  if (resource_dasm_path.empty()) {
+    string self_path = argv[0];
+    size_t slash_pos = self_path.rfind('/');
+    resource_dasm_path = (slash_pos == string::npos)
+        ? "resource_dasm"
+        : (self_path.substr(0, slash_pos + 1) + "resource_dasm");
+  }
+
+  auto manifest = load_manifest(manifest_filename);
+  shared_ptr<JSONObject> baseline;
+  if (baseline_filename) {
+    baseline = JSONObject::parse(load_file(baseline_filename));
+  }
+
+  map<string, int64_t> totals;
+  JSONObject::dict_type archives_dict;
+  size_t num_regressions = 0;
+  size_t num_errors = 0;
+  for (const auto& entry : manifest) {
+    fprintf(stderr, "... %s\n", entry.filename.c_str());
+    map<string, int64_t> metrics;
+    try {
+      for (size_t z = 0; z < iterations; z++) {
+        auto run_metrics = run_archive(resource_dasm_path, entry, common_args);
+        for (const auto& metric : METRICS) {
+          int64_t value = run_metrics.at(metric.name);
+          auto emplace_ret = metrics.emplace(metric.name, value);
+          if (!emplace_ret.second) {
+            int64_t& existing = emplace_ret.first->second;
+            existing = metric.is_time ? min(existing, value) : max(existing, value);
+          }
+        }
+      }
+    } catch (const exception& e) {
+      fprintf(stderr, "error: %s: %s\n", entry.filename.c_str(), e.what());
+      num_errors++;
+      continue;
+    }
+
+    for (const auto& metric : METRICS) {
+      int64_t value = metrics.at(metric.name);
+      int64_t& total = totals[metric.name];
+      total = metric.total_is_max ? max(total, value) : (total + value);
+    }
+
+    if (baseline.get()) {
+      const auto& baseline_archives = baseline->at("archives").as_dict();
+      auto it = baseline_archives.find(entry.filename);
+      if (it == baseline_archives.end()) {
+        fprintf(stderr, "note: %s is not in the baseline\n", entry.filename.c_str());
+      } else {
+        num_regressions += compare_metrics(entry.filename, metrics, *it->second, thresholds);
+      }
+    }
+    archives_dict.emplace(entry.filename, metrics_json(metrics));
+  }
+
+  // The totals are only comparable if the same archives were replayed
+  if (baseline.get() && (num_errors == 0) &&
+      (baseline->at("archives").as_dict().size() == archives_dict.size())) {
+    num_regressions += compare_metrics("total", totals, baseline->at("total"), thresholds);
+  }
+
+  JSONObject::dict_type root;
+  root.emplace("archives", new JSONObject(move(archives_dict)));
+  root.emplace("total", metrics_json(totals));
+  string json_data = JSONObject(move(root)).format();
+  json_data.push_back('\n');
+
+  if (output_filename) {
+    save_file(output_filename, json_data);
+  } else {
+    fwritex(stdout, json_data);
+  }
+
+  if (num_errors) {
+    fprintf(stderr, "%zu archive(s) could not be replayed\n", num_errors);
+    return 3;
+  }
+  if (num_regressions) {
+    fprintf(stderr, "%zu regression(s) found\n", num_regressions);
+    return 2;
+  }
+  return 0;
+}